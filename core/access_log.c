@@ -0,0 +1,240 @@
+#include "access_log.h"
+#include "json.h"
+#include <errno.h>
+#include <linux/futex.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+// A slot is free for the producer holding ticket n while its sequence is
+// n, and holds that producer's record once the sequence is n + 1
+typedef struct {
+    atomic_size_t sequence;
+    access_record_t record;
+} access_slot_t;
+
+static access_slot_t ring[ACCESS_LOG_RING_SIZE];
+static atomic_size_t ring_tail;         // next ticket for a producer
+static atomic_size_t ring_head;         // next ticket for the logger
+static atomic_ullong dropped;
+static atomic_ullong next_id;
+static atomic_int logger_running;
+static atomic_int logger_sleeping;
+static atomic_uint logger_wakeups;     // the futex the idle logger waits on
+static pthread_t logger_thread;
+
+static void wake_logger(void) {
+    atomic_fetch_add(&logger_wakeups, 1);
+    syscall(SYS_futex, &logger_wakeups, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+}
+
+// ----------------------------------------------------------------------------
+// Producers
+// ----------------------------------------------------------------------------
+
+uint64_t access_log_next_id(void) {
+    return atomic_fetch_add_explicit(&next_id, 1, memory_order_relaxed) + 1;
+}
+
+unsigned long long access_log_dropped(void) {
+    return atomic_load_explicit(&dropped, memory_order_relaxed);
+}
+
+void access_log_record(const access_record_t *record) {
+    size_t ticket = atomic_load_explicit(&ring_tail, memory_order_relaxed);
+    access_slot_t *slot;
+
+    for (;;) {
+        slot = &ring[ticket & (ACCESS_LOG_RING_SIZE - 1)];
+        size_t sequence = atomic_load_explicit(&slot->sequence, memory_order_acquire);
+        intptr_t diff = (intptr_t)sequence - (intptr_t)ticket;
+
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(&ring_tail, &ticket, ticket + 1,
+                                                      memory_order_relaxed, memory_order_relaxed)) {
+                break;
+            }
+        } else if (diff < 0) {
+            // The logger has not freed this slot since the last lap
+            atomic_fetch_add_explicit(&dropped, 1, memory_order_relaxed);
+            return;
+        } else {
+            ticket = atomic_load_explicit(&ring_tail, memory_order_relaxed);
+        }
+    }
+
+    slot->record = *record;
+    atomic_store_explicit(&slot->sequence, ticket + 1, memory_order_release);
+
+    // Pairs with the fence in logger_main: either the logger sees this
+    // record before it sleeps, or this sees it asleep and wakes it
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load_explicit(&logger_sleeping, memory_order_relaxed)) {
+        wake_logger();
+    }
+}
+
+// ----------------------------------------------------------------------------
+// Logger
+// ----------------------------------------------------------------------------
+
+static int take_record(access_record_t *record) {
+    size_t ticket = atomic_load_explicit(&ring_head, memory_order_relaxed);
+    access_slot_t *slot;
+
+    for (;;) {
+        slot = &ring[ticket & (ACCESS_LOG_RING_SIZE - 1)];
+        size_t sequence = atomic_load_explicit(&slot->sequence, memory_order_acquire);
+        intptr_t diff = (intptr_t)sequence - (intptr_t)(ticket + 1);
+
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(&ring_head, &ticket, ticket + 1,
+                                                      memory_order_relaxed, memory_order_relaxed)) {
+                break;
+            }
+        } else if (diff < 0) {
+            return 0;
+        } else {
+            ticket = atomic_load_explicit(&ring_head, memory_order_relaxed);
+        }
+    }
+
+    *record = slot->record;
+    atomic_store_explicit(&slot->sequence, ticket + ACCESS_LOG_RING_SIZE, memory_order_release);
+    return 1;
+}
+
+static size_t format_record(const access_record_t *record, char *line, size_t size) {
+    char url[MAX_URL_SIZE * 6 + 1];
+    char method[MAX_METHOD_SIZE * 6 + 1];
+    char timestamp[32];
+    struct tm tm;
+
+    gmtime_r(&record->received.tv_sec, &tm);
+    strftime(timestamp, sizeof(timestamp), "%Y-%m-%dT%H:%M:%S", &tm);
+    json_escape(record->url, url, sizeof(url));
+    json_escape(record->method, method, sizeof(method));
+
+    int len = snprintf(line, size,
+                       "{\"time\":\"%s.%06ldZ\",\"id\":%llu,\"remote\":\"%s\",\"method\":\"%s\","
+                       "\"url\":\"%s\",\"route\":\"%s\",\"status\":%d,\"bytes\":%lld,\"duration_us\":%llu}\n",
+                       timestamp, record->received.tv_nsec / 1000, (unsigned long long)record->id,
+                       record->remote, method, url, metrics_route_name(record->route), record->status,
+                       record->bytes, (unsigned long long)record->micros);
+    if (len < 0) {
+        return 0;
+    }
+    return (size_t)len < size ? (size_t)len : size - 1;
+}
+
+static void write_batch(const char *data, size_t len) {
+    while (len > 0) {
+        ssize_t written = write(STDOUT_FILENO, data, len);
+        if (written < 0) {
+            if (errno == EINTR) continue;
+            return;
+        }
+        data += written;
+        len -= written;
+    }
+}
+
+// Write out whatever is queued; returns how many records that was
+static int drain_records(char *batch, unsigned long long *reported) {
+    char line[MAX_URL_SIZE * 6 + 512];
+    access_record_t record;
+    size_t used = 0;
+    int count = 0;
+
+    unsigned long long lost = access_log_dropped();
+    if (lost != *reported) {
+        used += snprintf(batch, ACCESS_LOG_BATCH_SIZE, "{\"event\":\"access_log_dropped\",\"count\":%llu}\n",
+                         lost - *reported);
+        *reported = lost;
+    }
+
+    while (take_record(&record)) {
+        size_t len = format_record(&record, line, sizeof(line));
+        if (used + len > ACCESS_LOG_BATCH_SIZE) {
+            write_batch(batch, used);
+            used = 0;
+        }
+        memcpy(batch + used, line, len);
+        used += len;
+        count++;
+    }
+
+    if (used > 0) {
+        write_batch(batch, used);
+    }
+    return count;
+}
+
+static void* logger_main(void *arg) {
+    char *batch = arg;
+    unsigned long long reported = 0;
+
+    while (atomic_load(&logger_running)) {
+        if (drain_records(batch, &reported) > 0) {
+            continue;
+        }
+
+        // Announce the sleep, then look once more: a record published
+        // before the announcement is drained here, one after it wakes us
+        unsigned int wakeups = atomic_load(&logger_wakeups);
+        atomic_store_explicit(&logger_sleeping, 1, memory_order_relaxed);
+        atomic_thread_fence(memory_order_seq_cst);
+        if (drain_records(batch, &reported) == 0 && atomic_load(&logger_running)) {
+            syscall(SYS_futex, &logger_wakeups, FUTEX_WAIT_PRIVATE, wakeups, NULL, NULL, 0);
+        }
+        atomic_store_explicit(&logger_sleeping, 0, memory_order_relaxed);
+    }
+    drain_records(batch, &reported);
+
+    free(batch);
+    return NULL;
+}
+
+int init_access_log(void) {
+    sigset_t block, previous;
+    char *batch;
+
+    for (size_t i = 0; i < ACCESS_LOG_RING_SIZE; i++) {
+        atomic_init(&ring[i].sequence, i);
+    }
+
+    batch = malloc(ACCESS_LOG_BATCH_SIZE);
+    if (!batch) {
+        perror("malloc");
+        return -1;
+    }
+
+    // Shutdown signals join the logger, so they must land on another thread
+    sigemptyset(&block);
+    sigaddset(&block, SIGTERM);
+    sigaddset(&block, SIGINT);
+    pthread_sigmask(SIG_BLOCK, &block, &previous);
+
+    atomic_store(&logger_running, 1);
+    int result = pthread_create(&logger_thread, NULL, logger_main, batch);
+    pthread_sigmask(SIG_SETMASK, &previous, NULL);
+    if (result != 0) {
+        perror("pthread_create");
+        atomic_store(&logger_running, 0);
+        free(batch);
+        return -1;
+    }
+    return 0;
+}
+
+// Stop the logger once it has written out everything queued so far
+void cleanup_access_log(void) {
+    int running = 1;
+
+    if (atomic_compare_exchange_strong(&logger_running, &running, 0)) {
+        wake_logger();
+        pthread_join(logger_thread, NULL);
+    }
+}
@@ -0,0 +1,42 @@
+#ifndef ACCESS_LOG_H
+#define ACCESS_LOG_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "http.h"
+
+// One JSON line per request on stdout. Request threads put their record in
+// a bounded ring without taking any lock; a logger thread takes records out
+// in batches and writes each batch with one write(). When the ring is full
+// the record is dropped and counted, and the logger reports how many were
+// lost before the next line it writes. An idle logger sleeps on a futex,
+// and only a producer that finds it asleep pays for the wakeup.
+#define ACCESS_LOG_RING_SIZE 1024       // a power of two
+#define ACCESS_LOG_BATCH_SIZE (64 * 1024)
+
+typedef struct {
+    uint64_t id;
+    struct timespec received;           // wall clock
+    char remote[INET_ADDRSTRLEN];
+    char method[MAX_METHOD_SIZE];
+    char url[MAX_URL_SIZE];
+    metrics_route_t route;
+    int status;
+    long long bytes;
+    uint64_t micros;
+} access_record_t;
+
+// Function declarations
+int init_access_log(void);
+void cleanup_access_log(void);
+void access_log_record(const access_record_t *record);
+uint64_t access_log_next_id(void);
+unsigned long long access_log_dropped(void);
+
+#endif // ACCESS_LOG_H
@@ -0,0 +1,129 @@
+#include "arena.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+void arena_init(arena_t *arena, size_t block_size) {
+    arena->head = NULL;
+    arena->block_size = block_size ? block_size : ARENA_DEFAULT_BLOCK_SIZE;
+    arena->allocated = 0;
+    arena->allocations = 0;
+}
+
+static arena_block_t* arena_new_block(arena_t *arena, size_t min_size) {
+    size_t size = arena->block_size;
+    arena_block_t *block;
+
+    // Oversized requests get a dedicated block instead of failing
+    if (min_size > size) {
+        size = min_size;
+    }
+
+    block = malloc(sizeof(arena_block_t) + size);
+    if (!block) {
+        perror("malloc arena block");
+        return NULL;
+    }
+
+    block->size = size;
+    block->used = 0;
+    block->next = arena->head;
+    arena->head = block;
+    return block;
+}
+
+void* arena_alloc(arena_t *arena, size_t size) {
+    arena_block_t *block = arena->head;
+    size_t offset;
+
+    if (size == 0) {
+        size = 1;
+    }
+
+    if (block) {
+        offset = (block->used + ARENA_ALIGNMENT - 1) & ~(size_t)(ARENA_ALIGNMENT - 1);
+        if (offset + size <= block->size) {
+            block->used = offset + size;
+            arena->allocated += size;
+            arena->allocations++;
+            return block->data + offset;
+        }
+    }
+
+    block = arena_new_block(arena, size);
+    if (!block) {
+        return NULL;
+    }
+
+    block->used = size;
+    arena->allocated += size;
+    arena->allocations++;
+    return block->data;
+}
+
+void* arena_calloc(arena_t *arena, size_t count, size_t size) {
+    void *ptr;
+
+    if (size && count > (size_t)-1 / size) {
+        return NULL;
+    }
+
+    ptr = arena_alloc(arena, count * size);
+    if (ptr) {
+        memset(ptr, 0, count * size);
+    }
+    return ptr;
+}
+
+char* arena_strndup(arena_t *arena, const char *str, size_t len) {
+    char *copy = arena_alloc(arena, len + 1);
+
+    if (copy) {
+        memcpy(copy, str, len);
+        copy[len] = '\0';
+    }
+    return copy;
+}
+
+char* arena_strdup(arena_t *arena, const char *str) {
+    return arena_strndup(arena, str, strlen(str));
+}
+
+void arena_reset(arena_t *arena) {
+    arena_block_t *block = arena->head;
+
+    if (!block) {
+        return;
+    }
+
+    // Keep one standard-sized block around for the next round
+    while (block->next) {
+        arena_block_t *next = block->next;
+        if (block->size == arena->block_size) {
+            block->next = next->next;
+            free(next);
+        } else {
+            arena->head = next;
+            free(block);
+            block = next;
+        }
+    }
+
+    block->used = 0;
+    arena->allocated = 0;
+    arena->allocations = 0;
+}
+
+void arena_free(arena_t *arena) {
+    arena_block_t *block = arena->head;
+
+    while (block) {
+        arena_block_t *next = block->next;
+        free(block);
+        block = next;
+    }
+
+    arena->head = NULL;
+    arena->allocated = 0;
+    arena->allocations = 0;
+}
@@ -0,0 +1,34 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+
+#define ARENA_DEFAULT_BLOCK_SIZE (64 * 1024)
+#define ARENA_ALIGNMENT 16
+
+typedef struct arena_block {
+    struct arena_block *next;
+    size_t size;
+    size_t used;
+    char data[];
+} arena_block_t;
+
+// Bump allocator: allocations are never freed individually, the whole
+// arena is reset or released at once.
+typedef struct {
+    arena_block_t *head;
+    size_t block_size;
+    size_t allocated;
+    size_t allocations;
+} arena_t;
+
+// Function declarations
+void arena_init(arena_t *arena, size_t block_size);
+void* arena_alloc(arena_t *arena, size_t size);
+void* arena_calloc(arena_t *arena, size_t count, size_t size);
+char* arena_strndup(arena_t *arena, const char *str, size_t len);
+char* arena_strdup(arena_t *arena, const char *str);
+void arena_reset(arena_t *arena);
+void arena_free(arena_t *arena);
+
+#endif // ARENA_H
@@ -0,0 +1,328 @@
+#include "batch.h"
+#include "metrics.h"
+#include "container_index.h"
+#include <pthread.h>
+#include <stdatomic.h>
+#include <time.h>
+
+typedef struct {
+    char *data;
+    size_t len;
+    size_t capacity;
+} batch_output_t;
+
+typedef struct {
+    batch_action_t action;
+    char **ids;
+    int count;
+    atomic_int next;                    // index of the next container to take
+    pthread_mutex_t lock;               // around the results and stats
+    batch_format_fn format_fn;
+    batch_write_fn write_fn;
+    void *user_data;
+    batch_output_t pending;             // formatted, not yet handed to write
+    batch_output_t writing;             // what the writer is sending
+    int writer_active;
+    int reader_gone;
+    batch_stats_t stats;
+} batch_t;
+
+static const char *action_names[] = { "start", "stop", "kill", "rm" };
+
+int batch_action_from_name(const char *name, batch_action_t *action) {
+    for (size_t i = 0; i < sizeof(action_names) / sizeof(action_names[0]); i++) {
+        if (strcmp(name, action_names[i]) == 0) {
+            *action = (batch_action_t)i;
+            return 0;
+        }
+    }
+    if (strcmp(name, "remove") == 0) {
+        *action = BATCH_REMOVE;
+        return 0;
+    }
+    return -1;
+}
+
+const char* batch_action_name(batch_action_t action) {
+    return action_names[action];
+}
+
+// ----------------------------------------------------------------------------
+// Selection
+// ----------------------------------------------------------------------------
+
+static int value_matches(const char *key, const json_value_t *element, const container_record_t *container) {
+    char value[MAX_CONTAINER_NAME_LEN];
+
+    // Nothing a value had to be cut short for can match
+    if (json_string_copy(element, value, sizeof(value)) != 0) {
+        return 0;
+    }
+    if (strcmp(key, "status") == 0) {
+        return strcmp(value, container_state_name(container->state)) == 0;
+    } else if (strcmp(key, "name") == 0) {
+        return strcmp(value, container->name) == 0;
+    } else if (strcmp(key, "id") == 0) {
+        return value[0] && strncmp(container->id, value, strlen(value)) == 0;
+    } else if (strcmp(key, "image") == 0) {
+        return strcmp(value, container->image) == 0 || strcmp(value, container->image_id) == 0;
+    }
+    return 0;
+}
+
+// No values for key matches everything, otherwise any value does; a
+// single string stands for a list of one
+static int filter_matches(const json_value_t *filters, const char *key, const container_record_t *container) {
+    json_value_t object, values, element;
+    json_iter_t it;
+    int any = 0;
+
+    object = *filters;
+    if (json_get(&object, key, &values) != 0) {
+        return 1;
+    }
+    if (values.type == JSON_STRING) {
+        return value_matches(key, &values, container);
+    }
+    if (json_iter_init(&values, &it) != 0 || it.object) {
+        return 1;
+    }
+    while (json_iter_next(&it, NULL, &element) > 0) {
+        if (element.type != JSON_STRING) {
+            continue;
+        }
+        any = 1;
+        if (value_matches(key, &element, container)) {
+            return 1;
+        }
+    }
+    return !any;
+}
+
+typedef struct {
+    const json_value_t *filters;
+    arena_t *arena;
+    char **ids;
+    int count;
+    int capacity;
+    int failed;
+} batch_selection_t;
+
+static int select_container(const container_record_t *container, void *ctx) {
+    batch_selection_t *selection = ctx;
+    const json_value_t *filters = selection->filters;
+
+    if (filters && (!filter_matches(filters, "status", container) || !filter_matches(filters, "name", container) ||
+                    !filter_matches(filters, "id", container) || !filter_matches(filters, "image", container))) {
+        return 0;
+    }
+
+    if (selection->count == selection->capacity) {
+        int capacity = selection->capacity ? selection->capacity * 2 : 64;
+        char **grown = arena_alloc(selection->arena, sizeof(char*) * capacity);
+        if (!grown) {
+            return selection->failed = 1;
+        }
+        if (selection->count > 0) {
+            memcpy(grown, selection->ids, sizeof(char*) * selection->count);
+        }
+        selection->ids = grown;
+        selection->capacity = capacity;
+    }
+    if (!(selection->ids[selection->count] = arena_strdup(selection->arena, container->id))) {
+        return selection->failed = 1;
+    }
+    selection->count++;
+    return 0;
+}
+
+// The ids of the containers the selector picks, straight from the index and
+// allocated from arena
+int batch_select(arena_t *arena, const batch_selector_t *selector, char ***ids, int *count) {
+    batch_selection_t selection;
+    json_value_t filters, value;
+
+    *ids = NULL;
+    *count = 0;
+    memset(&selection, 0, sizeof(selection));
+    selection.arena = arena;
+    if (selector->filters && selector->filters->type == JSON_OBJECT) {
+        filters = *selector->filters;
+        if (json_get(&filters, "status", &value) == 0 || json_get(&filters, "name", &value) == 0 ||
+            json_get(&filters, "id", &value) == 0 || json_get(&filters, "image", &value) == 0) {
+            selection.filters = &filters;
+        }
+    }
+    if (!selector->all && !selection.filters) {
+        return 0;
+    }
+
+    container_index_scan(NULL, select_container, &selection);
+    if (selection.failed) {
+        return -1;
+    }
+    *ids = selection.ids;
+    *count = selection.count;
+    return 0;
+}
+
+// ----------------------------------------------------------------------------
+// Execution
+// ----------------------------------------------------------------------------
+
+static int run_action(batch_action_t action, const char *container_id) {
+    metrics_op_t op;
+    struct timespec started;
+    int result;
+
+    clock_gettime(CLOCK_MONOTONIC, &started);
+    switch (action) {
+        case BATCH_START:
+            op = METRICS_OP_START;
+            result = start_container(container_id);
+            break;
+        case BATCH_STOP:
+            op = METRICS_OP_STOP;
+            result = stop_container(container_id);
+            break;
+        case BATCH_KILL:
+            op = METRICS_OP_KILL;
+            result = kill_container(container_id);
+            break;
+        default:
+            op = METRICS_OP_REMOVE;
+            result = remove_container(container_id);
+            break;
+    }
+    metrics_observe_container_op(op, result != 0, metrics_elapsed_us(&started));
+    return result;
+}
+
+// Caller holds batch->lock. A line that does not fit in memory is dropped.
+static void queue_result(batch_t *batch, const char *line, size_t len) {
+    batch_output_t *pending = &batch->pending;
+
+    if (pending->len + len > pending->capacity) {
+        size_t capacity = pending->capacity * 2 + len;
+        char *data = realloc(pending->data, capacity);
+        if (!data) {
+            perror("realloc");
+            return;
+        }
+        pending->data = data;
+        pending->capacity = capacity;
+    }
+    memcpy(pending->data + pending->len, line, len);
+    pending->len += len;
+}
+
+// Caller holds batch->lock, and releases it around each write. One worker
+// at a time is the writer and sends what the others queued meanwhile too.
+static void flush_results(batch_t *batch) {
+    if (batch->writer_active) {
+        return;
+    }
+
+    batch->writer_active = 1;
+    while (batch->pending.len > 0 && !batch->reader_gone) {
+        batch_output_t sending = batch->pending;
+        batch->pending = batch->writing;
+        batch->pending.len = 0;
+        batch->writing = sending;
+
+        pthread_mutex_unlock(&batch->lock);
+        int gone = batch->write_fn(sending.data, sending.len, batch->user_data) != 0;
+        pthread_mutex_lock(&batch->lock);
+        if (gone) {
+            batch->reader_gone = 1;
+        }
+    }
+    batch->pending.len = 0;
+    batch->writer_active = 0;
+}
+
+static void* batch_worker(void *arg) {
+    batch_t *batch = arg;
+    int index;
+
+    while ((index = atomic_fetch_add(&batch->next, 1)) < batch->count) {
+        struct timespec started;
+        char line[BATCH_MAX_RESULT];
+        int len = 0;
+
+        clock_gettime(CLOCK_MONOTONIC, &started);
+        int result = run_action(batch->action, batch->ids[index]);
+        uint64_t micros = metrics_elapsed_us(&started);
+
+        if (batch->format_fn) {
+            len = batch->format_fn(line, sizeof(line), batch->ids[index], result != 0, micros, batch->user_data);
+            if (len < 0 || len >= (int)sizeof(line)) {
+                len = 0;
+            }
+        }
+
+        pthread_mutex_lock(&batch->lock);
+        if (result == 0) {
+            batch->stats.succeeded++;
+        } else {
+            batch->stats.failed++;
+        }
+        if (len > 0 && !batch->reader_gone) {
+            queue_result(batch, line, len);
+            flush_results(batch);
+        }
+        pthread_mutex_unlock(&batch->lock);
+    }
+    return NULL;
+}
+
+// Runs action on every container in ids with up to parallel at a time. The
+// calling thread is one of the workers. 0 when every container succeeded.
+int run_container_batch(batch_action_t action, char **ids, int count, int parallel,
+                        batch_format_fn format_fn, batch_write_fn write_fn, void *user_data,
+                        batch_stats_t *stats) {
+    pthread_t threads[BATCH_MAX_PARALLEL];
+    int started = 0;
+    batch_t batch;
+
+    memset(&batch, 0, sizeof(batch));
+    batch.action = action;
+    batch.ids = ids;
+    batch.count = count;
+    atomic_init(&batch.next, 0);
+    pthread_mutex_init(&batch.lock, NULL);
+    batch.format_fn = write_fn ? format_fn : NULL;
+    batch.write_fn = write_fn;
+    batch.user_data = user_data;
+    batch.stats.total = count;
+
+    if (parallel < 1) {
+        parallel = 1;
+    } else if (parallel > BATCH_MAX_PARALLEL) {
+        parallel = BATCH_MAX_PARALLEL;
+    }
+    if (parallel > count) {
+        parallel = count;
+    }
+
+    // Fewer helpers than asked for is fine; this thread works through the rest
+    for (int i = 1; i < parallel; i++) {
+        if (pthread_create(&threads[started], NULL, batch_worker, &batch) != 0) {
+            perror("pthread_create");
+            break;
+        }
+        started++;
+    }
+    batch_worker(&batch);
+    for (int i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    pthread_mutex_destroy(&batch.lock);
+    free(batch.pending.data);
+    free(batch.writing.data);
+    if (stats) {
+        *stats = batch.stats;
+    }
+    return batch.stats.failed == 0 ? 0 : -1;
+}
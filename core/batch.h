@@ -0,0 +1,61 @@
+#ifndef BATCH_H
+#define BATCH_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "container.h"
+#include "arena.h"
+#include "json.h"
+
+// One action over many containers, fanned out across a pool of worker
+// threads started for the batch. Results are handed back one at a time as
+// each container finishes, in completion order.
+#define BATCH_DEFAULT_PARALLEL 8
+#define BATCH_MAX_PARALLEL 64
+#define BATCH_MAX_BODY (1024 * 1024)
+#define BATCH_MAX_RESULT 1024           // one formatted result line
+
+typedef enum {
+    BATCH_START,
+    BATCH_STOP,
+    BATCH_KILL,
+    BATCH_REMOVE
+} batch_action_t;
+
+// Which containers a selector picks. Values of one key are alternatives,
+// and every key given has to match; no keys at all picks nothing unless
+// all is set.
+typedef struct {
+    const json_value_t *filters;    // {"status":[..],"name":[..],"id":[..],"image":[..]}, or NULL
+    int all;
+} batch_selector_t;
+
+typedef struct {
+    int total;
+    int succeeded;
+    int failed;
+} batch_stats_t;
+
+// Formats one result into line, returning its length like snprintf; called
+// on the worker that ran it, with no lock held.
+typedef int (*batch_format_fn)(char *line, size_t size, const char *container_id, int failed,
+                               uint64_t micros, void *user_data);
+
+// Sends formatted results, possibly several at once. Never called twice at
+// once, and never with the batch's lock held, so a slow reader holds up only
+// the worker writing to it. A nonzero return means the reader is gone; the
+// batch still runs to completion in that case.
+typedef int (*batch_write_fn)(const char *data, size_t len, void *user_data);
+
+// Function declarations
+int batch_action_from_name(const char *name, batch_action_t *action);
+const char* batch_action_name(batch_action_t action);
+int batch_select(arena_t *arena, const batch_selector_t *selector, char ***ids, int *count);
+int run_container_batch(batch_action_t action, char **ids, int count, int parallel,
+                        batch_format_fn format_fn, batch_write_fn write_fn, void *user_data,
+                        batch_stats_t *stats);
+
+#endif // BATCH_H
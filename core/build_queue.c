@@ -0,0 +1,507 @@
+#include "build_queue.h"
+#include "http.h"
+#include "metrics.h"
+#include "trace.h"
+#include "events.h"
+#include "json.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/prctl.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
+
+// Builds past the concurrency limit wait here in arrival order
+typedef struct build_waiter {
+    struct build_waiter *next;
+    int admitted;
+} build_waiter_t;
+
+static pthread_mutex_t queue_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queue_changed = PTHREAD_COND_INITIALIZER;
+static build_waiter_t *queue_head = NULL;
+static build_waiter_t *queue_tail = NULL;
+static int running_builds = 0;
+static int max_running_builds = DEFAULT_MAX_CONCURRENT_BUILDS;
+static cgroup_version_t build_cgroups = CGROUP_NONE;
+
+int init_build_queue(void) {
+    const char *limit = getenv(MAX_BUILDS_ENV);
+
+    if (limit && *limit) {
+        char *end;
+        long value = strtol(limit, &end, 10);
+        if (*end != '\0' || value < 1 || value > 1024) {
+            fprintf(stderr, "Invalid %s: %s\n", MAX_BUILDS_ENV, limit);
+            return -1;
+        }
+        max_running_builds = value;
+    }
+
+    if (mkdir(BUILD_ROOT_DIR, 0755) != 0 && errno != EEXIST) {
+        perror("mkdir build root");
+        return -1;
+    }
+
+    build_cgroups = cgroup_detect();
+    if (build_cgroups == CGROUP_NONE) {
+        fprintf(stderr, "cgroups unavailable, build resource budgets disabled\n");
+    }
+
+    printf("Build queue: %d concurrent build(s)\n", max_running_builds);
+    return 0;
+}
+
+void cleanup_build_queue(void) {
+    char rm_cmd[256];
+
+    snprintf(rm_cmd, sizeof(rm_cmd), "rm -rf %s", BUILD_ROOT_DIR);
+    system(rm_cmd);
+}
+
+// Writes the event with text standing in for its args or message
+static long long write_build_event(const build_event_t *event, const char *text, char *line, size_t size) {
+    json_writer_t w;
+
+    json_writer_init(&w, line, size, NULL, NULL);
+    json_write_object_begin(&w);
+    json_write_key(&w, "event");
+    switch (event->type) {
+        case BUILD_EVENT_STEP_START:
+            json_write_string(&w, "step_start");
+            json_write_key(&w, "step");
+            json_write_ll(&w, event->step);
+            json_write_key(&w, "total");
+            json_write_ll(&w, event->total);
+            json_write_key(&w, "instruction");
+            json_write_string(&w, event->instruction);
+            json_write_key(&w, "args");
+            json_write_string(&w, text);
+            break;
+        case BUILD_EVENT_STEP_END:
+            json_write_string(&w, "step_end");
+            json_write_key(&w, "step");
+            json_write_ll(&w, event->step);
+            json_write_key(&w, "total");
+            json_write_ll(&w, event->total);
+            json_write_key(&w, "duration_ms");
+            json_write_fixed(&w, event->duration_ms, 3);
+            json_write_key(&w, "cached");
+            json_write_ll(&w, event->stats->cached);
+            json_write_key(&w, "bytes_copied");
+            json_write_ll(&w, event->stats->bytes_copied);
+            json_write_key(&w, "cache_hits");
+            json_write_ll(&w, event->stats->cache_hits);
+            json_write_key(&w, "cache_misses");
+            json_write_ll(&w, event->stats->cache_misses);
+            json_write_key(&w, "digest");
+            json_write_string(&w, event->stats->digest);
+            break;
+        case BUILD_EVENT_ERROR:
+            json_write_string(&w, "error");
+            json_write_key(&w, "step");
+            json_write_ll(&w, event->step);
+            json_write_key(&w, "total");
+            json_write_ll(&w, event->total);
+            json_write_key(&w, "message");
+            json_write_string(&w, text);
+            break;
+        case BUILD_EVENT_COMPLETE:
+            json_write_string(&w, "complete");
+            json_write_key(&w, "total");
+            json_write_ll(&w, event->total);
+            json_write_key(&w, "duration_ms");
+            json_write_fixed(&w, event->duration_ms, 3);
+            break;
+    }
+    json_write_object_end(&w);
+    return json_writer_finish(&w);
+}
+
+// One event as a JSON line. Args or a message too long for the line are
+// cut short and end in "...", so the line is always whole JSON.
+int format_build_event(const build_event_t *event, char *line, size_t size) {
+    const char *text = event->type == BUILD_EVENT_STEP_START ? event->args : event->message;
+    char shortened[512];
+    long long len;
+
+    // One byte held back for the newline
+    len = write_build_event(event, text ? text : "", line, size - 1);
+    if (len < 0 && text) {
+        snprintf(shortened, sizeof(shortened) - 3, "%s", text);
+        strcat(shortened, "...");
+        len = write_build_event(event, shortened, line, size - 1);
+    }
+    if (len < 0) {
+        return 0;
+    }
+    line[len++] = '\n';
+    line[len] = '\0';
+    return (int)len;
+}
+
+static int report_build_error(build_output_fn output, void *user_data, const char *message) {
+    char line[MAX_BUILD_EVENT_LEN];
+    build_event_t event;
+
+    memset(&event, 0, sizeof(event));
+    event.type = BUILD_EVENT_ERROR;
+    event.message = message;
+    return output(line, format_build_event(&event, line, sizeof(line)), user_data);
+}
+
+static double elapsed_since(const struct timespec *start) {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) * 1000.0 + (now.tv_nsec - start->tv_nsec) / 1000000.0;
+}
+
+// Caller holds queue_lock
+static void admit_waiting_builds(void) {
+    while (queue_head && running_builds < max_running_builds) {
+        build_waiter_t *waiter = queue_head;
+
+        queue_head = waiter->next;
+        if (!queue_head) {
+            queue_tail = NULL;
+        }
+        waiter->admitted = 1;
+        running_builds++;
+    }
+    pthread_cond_broadcast(&queue_changed);
+}
+
+// Caller holds queue_lock
+static int queue_position(const build_waiter_t *waiter) {
+    int position = 1;
+
+    for (const build_waiter_t *w = queue_head; w && w != waiter; w = w->next) {
+        position++;
+    }
+    return position;
+}
+
+// Caller holds queue_lock
+static void remove_waiter(build_waiter_t *waiter) {
+    build_waiter_t *prev = NULL;
+
+    for (build_waiter_t *w = queue_head; w; prev = w, w = w->next) {
+        if (w == waiter) {
+            if (prev) {
+                prev->next = w->next;
+            } else {
+                queue_head = w->next;
+            }
+            if (queue_tail == w) {
+                queue_tail = prev;
+            }
+            break;
+        }
+    }
+
+    // Later builds move up a place
+    pthread_cond_broadcast(&queue_changed);
+}
+
+static int acquire_build_slot(build_output_fn output, void *user_data) {
+    build_waiter_t waiter = { NULL, 0 };
+    char line[256];
+    int reported = 0;
+
+    pthread_mutex_lock(&queue_lock);
+
+    if (queue_tail) {
+        queue_tail->next = &waiter;
+    } else {
+        queue_head = &waiter;
+    }
+    queue_tail = &waiter;
+    admit_waiting_builds();
+
+    while (!waiter.admitted) {
+        int position = queue_position(&waiter);
+
+        if (position == reported) {
+            pthread_cond_wait(&queue_changed, &queue_lock);
+            continue;
+        }
+
+        int len = snprintf(line, sizeof(line), "{\"event\":\"queued\",\"position\":%d,\"running\":%d,\"limit\":%d}\n",
+                           position, running_builds, max_running_builds);
+        reported = position;
+
+        pthread_mutex_unlock(&queue_lock);
+        int gone = output(line, len, user_data) != 0;
+        pthread_mutex_lock(&queue_lock);
+
+        // Nobody is waiting on this build any more, so give up the place
+        if (gone) {
+            if (waiter.admitted) {
+                running_builds--;
+                admit_waiting_builds();
+            } else {
+                remove_waiter(&waiter);
+            }
+            pthread_mutex_unlock(&queue_lock);
+            return -1;
+        }
+    }
+
+    pthread_mutex_unlock(&queue_lock);
+    return 0;
+}
+
+static void release_build_slot(void) {
+    pthread_mutex_lock(&queue_lock);
+    running_builds--;
+    admit_waiting_builds();
+    pthread_mutex_unlock(&queue_lock);
+}
+
+static int write_all(int fd, const char *data, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, data, len);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        data += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static void forward_build_event(const build_event_t *event, void *user_data) {
+    int fd = *(int*)user_data;
+    char line[MAX_BUILD_EVENT_LEN];
+
+    write_all(fd, line, format_build_event(event, line, sizeof(line)));
+}
+
+static int write_worker_event(const char *data, size_t len, void *user_data) {
+    return write_all(*(int*)user_data, data, len);
+}
+
+// Keeps what the worker wrote on the report pipe, one image name per line
+static void append_report(char **report, size_t *len, const char *data, size_t n) {
+    char *grown = realloc(*report, *len + n);
+
+    if (!grown) {
+        perror("realloc build report");
+        return;
+    }
+    memcpy(grown + *len, data, n);
+    *report = grown;
+    *len += n;
+}
+
+// Runs in the forked worker. Everything the build spawns inherits its cgroup.
+static void run_build_worker(const build_job_t *job, const char *build_dir, const cgroup_t *cgroup, int event_fd,
+                             int report_fd) {
+    dockerfile_t *dockerfile;
+    build_progress_t progress;
+    trace_span_t span;
+    int result;
+
+    signal(SIGTERM, SIG_DFL);
+    signal(SIGINT, SIG_DFL);
+    signal(SIGPIPE, SIG_DFL);
+    prctl(PR_SET_PDEATHSIG, SIGKILL);
+
+    // Inherited client sockets would keep other connections open until this
+    // build finished, so keep only stdio, the event pipe and the report pipe.
+    // The report pipe moves above 4 first so neither dup2 clobbers it.
+    if ((report_fd = fcntl(report_fd, F_DUPFD_CLOEXEC, 5)) < 0 || dup2(event_fd, 3) < 0 || dup2(report_fd, 4) < 0) {
+        _exit(1);
+    }
+    event_fd = 3;
+    fcntl(event_fd, F_SETFD, FD_CLOEXEC);
+    fcntl(4, F_SETFD, FD_CLOEXEC);
+    close_range(5, ~0U, 0);
+    enter_build_worker(4);
+
+    if (cgroup->version != CGROUP_NONE && cgroup_attach(cgroup, 0) != 0) {
+        report_build_error(write_worker_event, &event_fd, "Failed to enter build cgroup");
+        _exit(1);
+    }
+
+    trace_begin(&span, "parse_dockerfile");
+    dockerfile = parse_dockerfile(job->dockerfile_path);
+    trace_end(&span, job->dockerfile_path);
+    if (!dockerfile) {
+        report_build_error(write_worker_event, &event_fd, "Failed to parse Dockerfile");
+        _exit(1);
+    }
+
+    progress.callback = forward_build_event;
+    progress.user_data = &event_fd;
+    trace_begin(&span, "build");
+    result = build_image_with_progress(dockerfile, job->image_name, job->tag, job->context_path,
+                                       build_dir, job->compression, &progress);
+    trace_end(&span, job->image_name);
+
+    free_dockerfile(dockerfile);
+    fflush(stdout);
+    _exit(result == 0 ? 0 : 1);
+}
+
+int run_queued_build(const build_job_t *job, build_output_fn output, void *user_data) {
+    char build_dir[MAX_PATH_LEN];
+    char buffer[MAX_BUILD_EVENT_LEN];
+    char message[256];
+    char full_name[sizeof(job->image_name) + sizeof(job->tag) + 1];
+    struct timespec queued_at;
+    cgroup_t cgroup;
+    image_info_t image;
+    int budgeted = job->limits.memory_bytes > 0 || job->limits.cpu_quota_us > 0;
+    int reader_gone = 0;
+    int result = -1;
+    struct pollfd fds[2];
+    char *report = NULL;
+    size_t report_len = 0;
+    int pipefd[2];
+    int reportfd[2];
+    int status = 0;
+    pid_t pid;
+    ssize_t n;
+
+    clock_gettime(CLOCK_MONOTONIC, &queued_at);
+    if (acquire_build_slot(output, user_data) != 0) {
+        return -1;
+    }
+
+    memset(&cgroup, 0, sizeof(cgroup));
+    if (create_build_dir(build_dir, sizeof(build_dir)) != 0) {
+        report_build_error(output, user_data, "Failed to create build directory");
+        release_build_slot();
+        return -1;
+    }
+
+    // Even unbudgeted builds get a group so stray processes die with them
+    if (build_cgroups != CGROUP_NONE &&
+        cgroup_create(&cgroup, BUILD_CGROUP_PARENT, strrchr(build_dir, '/') + 1, &job->limits) != 0) {
+        memset(&cgroup, 0, sizeof(cgroup));
+    }
+    if (budgeted && cgroup.version == CGROUP_NONE) {
+        report_build_error(output, user_data, "Cannot enforce build resource budget: cgroups unavailable");
+        goto done;
+    }
+
+    int len = snprintf(buffer, sizeof(buffer),
+                       "{\"event\":\"started\",\"build\":\"%s\",\"queued_ms\":%.3f,"
+                       "\"memory\":%lld,\"cpu_quota\":%ld,\"cpu_period\":%ld}\n",
+                       strrchr(build_dir, '/') + 1, elapsed_since(&queued_at), job->limits.memory_bytes,
+                       job->limits.cpu_quota_us, job->limits.cpu_period_us);
+    if (output(buffer, len, user_data) != 0) {
+        reader_gone = 1;
+    }
+
+    if (pipe2(pipefd, O_CLOEXEC) != 0) {
+        perror("pipe");
+        report_build_error(output, user_data, "Failed to start build worker");
+        goto done;
+    }
+    if (pipe2(reportfd, O_CLOEXEC) != 0) {
+        perror("pipe");
+        close(pipefd[0]);
+        close(pipefd[1]);
+        report_build_error(output, user_data, "Failed to start build worker");
+        goto done;
+    }
+
+    // The worker records its steps into this thread's metrics slab and
+    // trace ring
+    metrics_attach_thread();
+    trace_attach_thread();
+
+    pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        close(pipefd[0]);
+        close(pipefd[1]);
+        close(reportfd[0]);
+        close(reportfd[1]);
+        report_build_error(output, user_data, "Failed to start build worker");
+        goto done;
+    }
+    if (pid == 0) {
+        close(pipefd[0]);
+        close(reportfd[0]);
+        run_build_worker(job, build_dir, &cgroup, pipefd[1], reportfd[1]);
+    }
+
+    close(pipefd[1]);
+    close(reportfd[1]);
+
+    // Relay worker events as they arrive; stop forwarding if the client
+    // leaves. Collect the names of the images it writes alongside.
+    fds[0].fd = pipefd[0];
+    fds[1].fd = reportfd[0];
+    fds[0].events = fds[1].events = POLLIN;
+    while (fds[0].fd >= 0 || fds[1].fd >= 0) {
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+        for (int i = 0; i < 2; i++) {
+            if (fds[i].fd < 0 || !fds[i].revents) {
+                continue;
+            }
+            n = read(fds[i].fd, buffer, sizeof(buffer));
+            if (n > 0 && i == 0 && !reader_gone && output(buffer, n, user_data) != 0) {
+                reader_gone = 1;
+            } else if (n > 0 && i == 1) {
+                append_report(&report, &report_len, buffer, n);
+            } else if (n == 0 || (n < 0 && errno != EINTR)) {
+                close(fds[i].fd);
+                fds[i].fd = -1;
+            }
+        }
+    }
+    for (int i = 0; i < 2; i++) {
+        if (fds[i].fd >= 0) close(fds[i].fd);
+    }
+
+    while (waitpid(pid, &status, 0) < 0 && errno == EINTR) {
+    }
+
+    // The built image, and any base image the worker pulled even if the
+    // build then failed: both are on disk now
+    for (char *line = report, *end; line && line < report + report_len; line = end + 1) {
+        if (!(end = memchr(line, '\n', report + report_len - line))) {
+            break;
+        }
+        *end = '\0';
+        adopt_image_metadata(line);
+    }
+    free(report);
+
+    if (WIFEXITED(status) && WEXITSTATUS(status) == 0) {
+        snprintf(full_name, sizeof(full_name), "%s:%s", job->image_name, job->tag);
+        if (read_image_metadata(full_name, &image) == 0) {
+            publish_event(EVENT_TYPE_IMAGE, "build", image.id, full_name, NULL, -1);
+            free(image.layers);
+        }
+        result = 0;
+    } else if (!reader_gone) {
+        if (cgroup.version != CGROUP_NONE && cgroup_oom_killed(&cgroup)) {
+            snprintf(message, sizeof(message), "Build exceeded its memory budget of %lld bytes",
+                     job->limits.memory_bytes);
+            report_build_error(output, user_data, message);
+        } else if (WIFSIGNALED(status)) {
+            snprintf(message, sizeof(message), "Build worker killed by signal %d", WTERMSIG(status));
+            report_build_error(output, user_data, message);
+        }
+    }
+
+done:
+    cgroup_destroy(&cgroup);
+    remove_build_dir(build_dir);
+    release_build_slot();
+
+    return result;
+}
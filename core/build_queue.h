@@ -0,0 +1,36 @@
+#ifndef BUILD_QUEUE_H
+#define BUILD_QUEUE_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "config.h"
+#include "dockerfile.h"
+#include "cgroup.h"
+
+#define BUILD_CGROUP_PARENT "docker-clone-builds"
+#define MAX_BUILD_EVENT_LEN 4096
+
+typedef struct {
+    char image_name[256];
+    char tag[64];
+    char dockerfile_path[MAX_PATH_LEN];
+    char context_path[MAX_PATH_LEN];
+    image_compression_t compression;
+    cgroup_limits_t limits;
+} build_job_t;
+
+// Receives newline-delimited JSON events; a nonzero return means the
+// reader is gone. The build still runs to completion in that case.
+typedef int (*build_output_fn)(const char *data, size_t len, void *user_data);
+
+// Function declarations
+int init_build_queue(void);
+void cleanup_build_queue(void);
+int run_queued_build(const build_job_t *job, build_output_fn output, void *user_data);
+int format_build_event(const build_event_t *event, char *line, size_t size);
+
+#endif // BUILD_QUEUE_H
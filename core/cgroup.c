@@ -0,0 +1,259 @@
+#include "cgroup.h"
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/stat.h>
+
+static int write_cgroup_file(const char *dir, const char *file, const char *value) {
+    char path[MAX_CGROUP_PATH_LEN + 64];
+    FILE *fp;
+    int ok;
+
+    snprintf(path, sizeof(path), "%s/%s", dir, file);
+    fp = fopen(path, "w");
+    if (!fp) {
+        return -1;
+    }
+
+    // The kernel rejects bad values on write, which stdio reports at close
+    ok = fputs(value, fp) >= 0;
+    if (fclose(fp) != 0) {
+        ok = 0;
+    }
+    return ok ? 0 : -1;
+}
+
+static long long read_cgroup_counter(const char *dir, const char *file, const char *key) {
+    char path[MAX_CGROUP_PATH_LEN + 64];
+    char name[64];
+    long long value;
+    FILE *fp;
+
+    snprintf(path, sizeof(path), "%s/%s", dir, file);
+    fp = fopen(path, "r");
+    if (!fp) {
+        return -1;
+    }
+
+    while (fscanf(fp, "%63s %lld", name, &value) == 2) {
+        if (strcmp(name, key) == 0) {
+            fclose(fp);
+            return value;
+        }
+    }
+
+    fclose(fp);
+    return -1;
+}
+
+static int make_cgroup_dir(const char *path) {
+    if (mkdir(path, 0755) != 0 && errno != EEXIST) {
+        return -1;
+    }
+    return 0;
+}
+
+static void kill_cgroup_procs(const char *dir) {
+    char path[MAX_CGROUP_PATH_LEN + 64];
+    FILE *fp;
+    int pid;
+
+    snprintf(path, sizeof(path), "%s/cgroup.procs", dir);
+    fp = fopen(path, "r");
+    if (!fp) {
+        return;
+    }
+
+    while (fscanf(fp, "%d", &pid) == 1) {
+        kill(pid, SIGKILL);
+    }
+    fclose(fp);
+}
+
+static int remove_cgroup_dir(const char *dir) {
+    struct timespec delay = { 0, 10 * 1000 * 1000 };
+
+    if (dir[0] == '\0') {
+        return 0;
+    }
+
+    // Killed processes linger briefly before the group counts as empty
+    for (int attempt = 0; attempt < 100; attempt++) {
+        if (rmdir(dir) == 0 || errno == ENOENT) {
+            return 0;
+        }
+        if (errno != EBUSY) {
+            break;
+        }
+        kill_cgroup_procs(dir);
+        nanosleep(&delay, NULL);
+    }
+
+    perror("rmdir cgroup");
+    return -1;
+}
+
+cgroup_version_t cgroup_detect(void) {
+    if (access(CGROUP_MOUNT "/cgroup.controllers", F_OK) == 0) {
+        return CGROUP_V2;
+    }
+    if (access(CGROUP_MOUNT "/cpu", W_OK) == 0 && access(CGROUP_MOUNT "/memory", W_OK) == 0) {
+        return CGROUP_V1;
+    }
+    return CGROUP_NONE;
+}
+
+// Fails rather than cutting the path short
+static int join_cgroup_path(char *out, size_t size, const char *dir, const char *name) {
+    if (snprintf(out, size, "%s/%s", dir, name) >= (int)size) {
+        fprintf(stderr, "cgroup path too long: %s/%s\n", dir, name);
+        return -1;
+    }
+    return 0;
+}
+
+int cgroup_create(cgroup_t *cgroup, const char *parent, const char *name, const cgroup_limits_t *limits) {
+    char parent_path[MAX_CGROUP_PATH_LEN];
+    char value[64];
+    long period = limits->cpu_period_us > 0 ? limits->cpu_period_us : 100000;
+
+    memset(cgroup, 0, sizeof(cgroup_t));
+    cgroup->version = cgroup_detect();
+
+    switch (cgroup->version) {
+        case CGROUP_V2:
+            if (join_cgroup_path(parent_path, sizeof(parent_path), CGROUP_MOUNT, parent) != 0) {
+                return -1;
+            }
+            if (make_cgroup_dir(parent_path) != 0) {
+                perror("mkdir cgroup");
+                return -1;
+            }
+
+            // Controllers have to be delegated down every level of the tree
+            write_cgroup_file(CGROUP_MOUNT, "cgroup.subtree_control", "+cpu +memory");
+            write_cgroup_file(parent_path, "cgroup.subtree_control", "+cpu +memory");
+
+            if (join_cgroup_path(cgroup->path, sizeof(cgroup->path), parent_path, name) != 0) {
+                return -1;
+            }
+            if (make_cgroup_dir(cgroup->path) != 0) {
+                perror("mkdir cgroup");
+                return -1;
+            }
+            strcpy(cgroup->memory_path, cgroup->path);
+
+            if (limits->cpu_quota_us > 0) {
+                snprintf(value, sizeof(value), "%ld %ld", limits->cpu_quota_us, period);
+                if (write_cgroup_file(cgroup->path, "cpu.max", value) != 0) {
+                    goto limit_failed;
+                }
+            }
+            if (limits->memory_bytes > 0) {
+                snprintf(value, sizeof(value), "%lld", limits->memory_bytes);
+                if (write_cgroup_file(cgroup->path, "memory.max", value) != 0) {
+                    goto limit_failed;
+                }
+                // Without swap accounting the limit still holds for RAM
+                write_cgroup_file(cgroup->path, "memory.swap.max", "0");
+            }
+            return 0;
+
+        case CGROUP_V1:
+            if (join_cgroup_path(parent_path, sizeof(parent_path), CGROUP_MOUNT "/cpu", parent) != 0 ||
+                join_cgroup_path(cgroup->path, sizeof(cgroup->path), parent_path, name) != 0) {
+                return -1;
+            }
+            if (make_cgroup_dir(parent_path) != 0 || make_cgroup_dir(cgroup->path) != 0) {
+                perror("mkdir cgroup");
+                return -1;
+            }
+
+            if (join_cgroup_path(parent_path, sizeof(parent_path), CGROUP_MOUNT "/memory", parent) != 0 ||
+                join_cgroup_path(cgroup->memory_path, sizeof(cgroup->memory_path), parent_path, name) != 0) {
+                cgroup_destroy(cgroup);
+                return -1;
+            }
+            if (make_cgroup_dir(parent_path) != 0 || make_cgroup_dir(cgroup->memory_path) != 0) {
+                perror("mkdir cgroup");
+                cgroup_destroy(cgroup);
+                return -1;
+            }
+
+            if (limits->cpu_quota_us > 0) {
+                snprintf(value, sizeof(value), "%ld", period);
+                if (write_cgroup_file(cgroup->path, "cpu.cfs_period_us", value) != 0) {
+                    goto limit_failed;
+                }
+                snprintf(value, sizeof(value), "%ld", limits->cpu_quota_us);
+                if (write_cgroup_file(cgroup->path, "cpu.cfs_quota_us", value) != 0) {
+                    goto limit_failed;
+                }
+            }
+            if (limits->memory_bytes > 0) {
+                snprintf(value, sizeof(value), "%lld", limits->memory_bytes);
+                if (write_cgroup_file(cgroup->memory_path, "memory.limit_in_bytes", value) != 0) {
+                    goto limit_failed;
+                }
+                // memsw only exists with swap accounting; it must follow the RAM limit
+                write_cgroup_file(cgroup->memory_path, "memory.memsw.limit_in_bytes", value);
+            }
+            return 0;
+
+        case CGROUP_NONE:
+            break;
+    }
+
+    return -1;
+
+limit_failed:
+    fprintf(stderr, "Failed to apply cgroup limits to %s: %s\n", cgroup->path, strerror(errno));
+    cgroup_destroy(cgroup);
+    return -1;
+}
+
+int cgroup_attach(const cgroup_t *cgroup, pid_t pid) {
+    char value[32];
+
+    snprintf(value, sizeof(value), "%d", (int)pid);
+    if (write_cgroup_file(cgroup->path, "cgroup.procs", value) != 0) {
+        return -1;
+    }
+    if (cgroup->version == CGROUP_V1 &&
+        write_cgroup_file(cgroup->memory_path, "cgroup.procs", value) != 0) {
+        return -1;
+    }
+    return 0;
+}
+
+int cgroup_oom_killed(const cgroup_t *cgroup) {
+    const char *file = cgroup->version == CGROUP_V2 ? "memory.events" : "memory.oom_control";
+    return read_cgroup_counter(cgroup->memory_path, file, "oom_kill") > 0;
+}
+
+int cgroup_destroy(cgroup_t *cgroup) {
+    int result = 0;
+
+    if (cgroup->version == CGROUP_NONE) {
+        return 0;
+    }
+
+    // Anything a build left running in the background goes with it
+    if (cgroup->version == CGROUP_V2 && cgroup->path[0] &&
+        write_cgroup_file(cgroup->path, "cgroup.kill", "1") != 0) {
+        kill_cgroup_procs(cgroup->path);
+    } else if (cgroup->version == CGROUP_V1) {
+        kill_cgroup_procs(cgroup->path);
+        kill_cgroup_procs(cgroup->memory_path);
+    }
+
+    if (remove_cgroup_dir(cgroup->path) != 0) {
+        result = -1;
+    }
+    if (cgroup->version == CGROUP_V1 && remove_cgroup_dir(cgroup->memory_path) != 0) {
+        result = -1;
+    }
+
+    cgroup->version = CGROUP_NONE;
+    return result;
+}
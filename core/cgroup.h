@@ -0,0 +1,39 @@
+#ifndef CGROUP_H
+#define CGROUP_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#define CGROUP_MOUNT "/sys/fs/cgroup"
+#define MAX_CGROUP_PATH_LEN 512
+
+typedef enum {
+    CGROUP_NONE = 0,
+    CGROUP_V1,
+    CGROUP_V2
+} cgroup_version_t;
+
+// Zero means unlimited for every field
+typedef struct {
+    long long memory_bytes;
+    long cpu_quota_us;
+    long cpu_period_us;
+} cgroup_limits_t;
+
+typedef struct {
+    cgroup_version_t version;
+    char path[MAX_CGROUP_PATH_LEN];         // unified group (v2) or cpu group (v1)
+    char memory_path[MAX_CGROUP_PATH_LEN];  // memory group (v1), same as path on v2
+} cgroup_t;
+
+// Function declarations
+cgroup_version_t cgroup_detect(void);
+int cgroup_create(cgroup_t *cgroup, const char *parent, const char *name, const cgroup_limits_t *limits);
+int cgroup_attach(const cgroup_t *cgroup, pid_t pid);
+int cgroup_oom_killed(const cgroup_t *cgroup);
+int cgroup_destroy(cgroup_t *cgroup);
+
+#endif // CGROUP_H
@@ -0,0 +1,489 @@
+#include "chunk.h"
+#include "lz.h"
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// The gear table is fixed, so every daemon cuts the same stream at the
+// same places and their chunks dedupe against each other
+#define CHUNK_GEAR_SEED 0x6a09e667f3bcc908ULL
+
+// Mask bits sit just below the top bit, where the hash covers the last
+// ~60 bytes; bit 63 stays clear so the two-byte step below is exact
+#define CHUNK_MASK(bits) ((((uint64_t)1 << (bits)) - 1) << (63 - (bits)))
+
+static uint64_t gear[256];
+static uint64_t gear_shifted[256];
+static pthread_once_t gear_once = PTHREAD_ONCE_INIT;
+
+static void init_gear(void) {
+    uint64_t state = CHUNK_GEAR_SEED;
+
+    // splitmix64
+    for (int i = 0; i < 256; i++) {
+        uint64_t z = (state += 0x9e3779b97f4a7c15ULL);
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+        gear[i] = z ^ (z >> 31);
+        gear_shifted[i] = gear[i] << 1;
+    }
+}
+
+// Returns the length of the chunk at the start of data. Bytes below the
+// minimum are skipped without hashing, a stricter mask applies up to the
+// average size and a looser one after it (normalized chunking), and the
+// hash rolls two bytes per step: (h << 2) + (gear[a] << 1) is the hash
+// after byte a shifted left once, so it is tested against the shifted mask.
+size_t chunk_boundary(const uint8_t *data, size_t len) {
+    const uint64_t mask_small = CHUNK_MASK(CHUNK_AVG_BITS + 2);
+    const uint64_t mask_large = CHUNK_MASK(CHUNK_AVG_BITS - 2);
+    size_t normal = (size_t)1 << CHUNK_AVG_BITS;
+    uint64_t hash = 0;
+    size_t i;
+
+    pthread_once(&gear_once, init_gear);
+    if (len <= CHUNK_MIN_SIZE) {
+        return len;
+    }
+    if (len > CHUNK_MAX_SIZE) {
+        len = CHUNK_MAX_SIZE;
+    }
+    if (normal > len) {
+        normal = len;
+    }
+
+    for (i = CHUNK_MIN_SIZE; i + 1 < normal; i += 2) {
+        hash = (hash << 2) + gear_shifted[data[i]];
+        if (!(hash & (mask_small << 1))) return i + 1;
+        hash += gear[data[i + 1]];
+        if (!(hash & mask_small)) return i + 2;
+    }
+    for (; i + 1 < len; i += 2) {
+        hash = (hash << 2) + gear_shifted[data[i]];
+        if (!(hash & (mask_large << 1))) return i + 1;
+        hash += gear[data[i + 1]];
+        if (!(hash & mask_large)) return i + 2;
+    }
+    return len;
+}
+
+int chunk_storage_path(const char *hex, char *path, size_t size) {
+    if (strlen(hex) != SHA256_HEX_LEN || strspn(hex, "0123456789abcdef") != SHA256_HEX_LEN) {
+        return -1;
+    }
+    snprintf(path, size, "%s/sha256/%s", CHUNK_STORAGE_DIR, hex);
+    return 0;
+}
+
+int create_chunk_storage(void) {
+    if ((mkdir(CHUNK_STORAGE_DIR, 0755) != 0 && errno != EEXIST) ||
+        (mkdir(CHUNK_STORAGE_DIR "/sha256", 0755) != 0 && errno != EEXIST)) {
+        perror("mkdir chunk storage");
+        return -1;
+    }
+    return 0;
+}
+
+static int write_all(int fd, const void *data, size_t len) {
+    const char *p = data;
+
+    while (len > 0) {
+        ssize_t n = write(fd, p, len);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// ---------------------------------------------------------------------------
+// Writer
+
+chunk_writer_t* chunk_writer_open(const char *list_path) {
+    chunk_writer_t *writer;
+
+    if (create_chunk_storage() != 0) {
+        return NULL;
+    }
+
+    writer = calloc(1, sizeof(chunk_writer_t));
+    if (!writer) {
+        perror("calloc");
+        return NULL;
+    }
+    snprintf(writer->list_path, sizeof(writer->list_path), "%s", list_path);
+    snprintf(writer->temp_path, sizeof(writer->temp_path), "%s.%lld.tmp", list_path, (long long)time(NULL));
+
+    writer->buffer = malloc(CHUNK_BUFFER_SIZE);
+    writer->packed = malloc(lz_compress_bound(CHUNK_MAX_SIZE));
+    writer->table = malloc(LZ_TABLE_SIZE);
+    writer->list = fopen(writer->temp_path, "w");
+    if (!writer->buffer || !writer->packed || !writer->table || !writer->list) {
+        perror("open chunk list");
+        chunk_writer_close(writer, 0, NULL);
+        return NULL;
+    }
+    return writer;
+}
+
+// Records a chunk in the list and stores it unless some layer already did
+static int store_chunk(chunk_writer_t *writer, const uint8_t *data, size_t len) {
+    char hex[SHA256_HEX_LEN + 1];
+    char path[MAX_CHUNK_PATH_LEN];
+    char temp_path[MAX_CHUNK_PATH_LEN + 8];
+    size_t packed_len;
+    int fd;
+
+    sha256_hex(data, len, hex);
+    fprintf(writer->list, "%s %zu\n", hex, len);
+    writer->stats.chunks++;
+    writer->stats.bytes += len;
+
+    // Touching a stored chunk keeps it from a sweep until this list is in
+    // place; one the sweep has just taken is stored again
+    chunk_storage_path(hex, path, sizeof(path));
+    if (utimensat(AT_FDCWD, path, NULL, 0) == 0) {
+        return 0;
+    }
+
+    // Kept raw unless compression saves something; the list has the length
+    packed_len = len > 1 ? lz_compress_block(data, len, writer->packed, len - 1, writer->table) : 0;
+
+    // Concurrent builds may store the same chunk: the last rename wins
+    snprintf(temp_path, sizeof(temp_path), "%s.XXXXXX", path);
+    fd = mkstemp(temp_path);
+    if (fd < 0) {
+        perror("mkstemp chunk");
+        return -1;
+    }
+    if (write_all(fd, packed_len ? writer->packed : data, packed_len ? packed_len : len) != 0 ||
+        fchmod(fd, 0644) != 0 || close(fd) != 0 || rename(temp_path, path) != 0) {
+        perror("write chunk");
+        unlink(temp_path);
+        return -1;
+    }
+
+    writer->stats.new_chunks++;
+    writer->stats.new_bytes += len;
+    writer->stats.stored_bytes += packed_len ? packed_len : len;
+    return 0;
+}
+
+// Cuts every chunk whose end is certain: those starting at least a
+// maximum-size chunk before the end of the buffer, or all of them at the
+// end of the stream
+static int cut_chunks(chunk_writer_t *writer, int final) {
+    size_t start = 0;
+
+    while (writer->buffered - start >= CHUNK_MAX_SIZE || (final && start < writer->buffered)) {
+        size_t len = chunk_boundary(writer->buffer + start, writer->buffered - start);
+        if (store_chunk(writer, writer->buffer + start, len) != 0) {
+            writer->failed = 1;
+            return -1;
+        }
+        start += len;
+    }
+
+    memmove(writer->buffer, writer->buffer + start, writer->buffered - start);
+    writer->buffered -= start;
+    return 0;
+}
+
+int chunk_write(chunk_writer_t *writer, const void *data, size_t len) {
+    const uint8_t *p = data;
+
+    if (writer->failed) {
+        return -1;
+    }
+
+    while (len > 0) {
+        size_t n = CHUNK_BUFFER_SIZE - writer->buffered;
+        if (n > len) n = len;
+
+        memcpy(writer->buffer + writer->buffered, p, n);
+        writer->buffered += n;
+        p += n;
+        len -= n;
+
+        if (writer->buffered == CHUNK_BUFFER_SIZE && cut_chunks(writer, 0) != 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Stores what is left and puts the list in place, or with commit unset
+// drops the list. Chunks already stored stay for other layers to use.
+int chunk_writer_close(chunk_writer_t *writer, int commit, chunk_stats_t *stats) {
+    int result = commit && !writer->failed ? 0 : -1;
+
+    if (result == 0 && cut_chunks(writer, 1) != 0) {
+        result = -1;
+    }
+    if (writer->list && fclose(writer->list) != 0) {
+        result = -1;
+    }
+    if (result == 0 && rename(writer->temp_path, writer->list_path) != 0) {
+        perror("rename chunk list");
+        result = -1;
+    }
+    if (result != 0) {
+        unlink(writer->temp_path);
+    }
+
+    if (stats) {
+        *stats = writer->stats;
+    }
+    free(writer->buffer);
+    free(writer->packed);
+    free(writer->table);
+    free(writer);
+    return result;
+}
+
+// ---------------------------------------------------------------------------
+// Reader
+
+chunk_reader_t* chunk_reader_open(const char *list_path) {
+    chunk_reader_t *reader = calloc(1, sizeof(chunk_reader_t));
+
+    if (!reader) {
+        perror("calloc");
+        return NULL;
+    }
+
+    reader->chunk = malloc(CHUNK_MAX_SIZE);
+    reader->packed = malloc(CHUNK_MAX_SIZE);
+    reader->list = fopen(list_path, "r");
+    if (!reader->chunk || !reader->packed || !reader->list) {
+        perror("open chunk list");
+        chunk_reader_close(reader);
+        return NULL;
+    }
+    return reader;
+}
+
+// Loads the next chunk of the list. Returns 0 at the end of the list.
+static int load_chunk(chunk_reader_t *reader) {
+    char hex[SHA256_HEX_LEN + 2];
+    char path[MAX_CHUNK_PATH_LEN];
+    struct stat st;
+    size_t len;
+    int fd;
+
+    int fields = fscanf(reader->list, "%65s %zu", hex, &len);
+    if (fields == EOF) {
+        return 0;
+    }
+    if (fields != 2 || len == 0 || len > CHUNK_MAX_SIZE || chunk_storage_path(hex, path, sizeof(path)) != 0) {
+        fprintf(stderr, "Malformed chunk list\n");
+        return -1;
+    }
+
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0 || fstat(fd, &st) != 0 || (size_t)st.st_size > len) {
+        fprintf(stderr, "Chunk %s is missing or damaged\n", hex);
+        if (fd >= 0) close(fd);
+        return -1;
+    }
+
+    // A chunk shorter than its length is compressed
+    uint8_t *target = (size_t)st.st_size == len ? reader->chunk : reader->packed;
+    ssize_t n = pread(fd, target, st.st_size, 0);
+    close(fd);
+    if (n != st.st_size ||
+        (target == reader->packed && lz_decompress_block(reader->packed, n, reader->chunk, len) != (ssize_t)len)) {
+        fprintf(stderr, "Chunk %s is damaged\n", hex);
+        return -1;
+    }
+
+    reader->len = len;
+    reader->offset = 0;
+    return 1;
+}
+
+// The layer's tar stream, chunk after chunk; an lz_read_fn
+ssize_t chunk_read(void *ctx, void *buf, size_t len) {
+    chunk_reader_t *reader = ctx;
+
+    if (reader->failed) {
+        return -1;
+    }
+    if (reader->offset == reader->len) {
+        int loaded = load_chunk(reader);
+        if (loaded <= 0) {
+            reader->failed = loaded < 0;
+            return loaded;
+        }
+    }
+
+    size_t n = reader->len - reader->offset;
+    if (n > len) n = len;
+    memcpy(buf, reader->chunk + reader->offset, n);
+    reader->offset += n;
+    return n;
+}
+
+void chunk_reader_close(chunk_reader_t *reader) {
+    if (!reader) return;
+    if (reader->list) {
+        fclose(reader->list);
+    }
+    free(reader->chunk);
+    free(reader->packed);
+    free(reader);
+}
+
+// ---------------------------------------------------------------------------
+// Sweep
+
+typedef struct {
+    char (*digests)[SHA256_HEX_LEN + 1];
+    size_t count;
+    size_t capacity;
+} digest_list_t;
+
+static int compare_digests(const void *a, const void *b) {
+    return strcmp(a, b);
+}
+
+static int mark_chunk_list(const char *list_path, digest_list_t *live) {
+    char hex[SHA256_HEX_LEN + 2];
+    size_t len;
+    FILE *fp = fopen(list_path, "r");
+
+    if (!fp) {
+        return errno == ENOENT ? 0 : -1;
+    }
+    while (fscanf(fp, "%65s %zu", hex, &len) == 2) {
+        if (live->count == live->capacity) {
+            size_t capacity = live->capacity ? live->capacity * 2 : 4096;
+            void *grown = realloc(live->digests, capacity * sizeof(live->digests[0]));
+            if (!grown) {
+                fclose(fp);
+                return -1;
+            }
+            live->digests = grown;
+            live->capacity = capacity;
+        }
+        // Anything but a whole digest means the list is damaged: keep
+        // every chunk rather than guess what it named
+        if (snprintf(live->digests[live->count], SHA256_HEX_LEN + 1, "%s", hex) != SHA256_HEX_LEN) {
+            fclose(fp);
+            return -1;
+        }
+        live->count++;
+    }
+    fclose(fp);
+    return 0;
+}
+
+// Lowers *oldest to the time the oldest list still being written in the
+// layer directory was opened
+static void find_open_lists(const char *layer_dir, const char *id, time_t *oldest) {
+    char prefix[MAX_CHUNK_PATH_LEN];
+    struct dirent *entry;
+    DIR *dir = opendir(layer_dir);
+    size_t prefix_len;
+
+    if (!dir) {
+        return;
+    }
+    prefix_len = snprintf(prefix, sizeof(prefix), "%s%s.", id, CHUNK_LIST_SUFFIX);
+    while ((entry = readdir(dir)) != NULL) {
+        char *end;
+        long long opened;
+
+        if (strncmp(entry->d_name, prefix, prefix_len) != 0) continue;
+        opened = strtoll(entry->d_name + prefix_len, &end, 10);
+        if (strcmp(end, ".tmp") == 0 && opened < *oldest) {
+            *oldest = opened;
+        }
+    }
+    closedir(dir);
+}
+
+// Deletes the chunks no list under layers_dir (layers_dir/<id>/<id>.chunks)
+// names. Lists being written, here or in a build worker, are not there yet,
+// so chunks touched since the oldest of them was opened are kept as well.
+int chunk_store_sweep(const char *layers_dir, long long *removed, long long *bytes) {
+    char path[MAX_CHUNK_PATH_LEN * 2];
+    char trash_path[MAX_CHUNK_PATH_LEN * 2 + 8];
+    digest_list_t live = { NULL, 0, 0 };
+    time_t cutoff = time(NULL);
+    struct dirent *entry;
+    DIR *dir;
+
+    *removed = 0;
+    *bytes = 0;
+
+    // Mark: every chunk named by a list in place now, staging directories
+    // (.squash-XXXXXX/.squash-XXXXXX.chunks) included
+    dir = opendir(layers_dir);
+    if (!dir) {
+        return errno == ENOENT ? 0 : -1;
+    }
+    while ((entry = readdir(dir)) != NULL) {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) continue;
+        if (snprintf(path, sizeof(path), "%s/%s", layers_dir, entry->d_name) >= (int)sizeof(path)) {
+            fprintf(stderr, "Layer path too long: %s/%s\n", layers_dir, entry->d_name);
+            closedir(dir);
+            free(live.digests);
+            return -1;
+        }
+        find_open_lists(path, entry->d_name, &cutoff);
+        if (snprintf(path, sizeof(path), "%s/%s/%s%s", layers_dir, entry->d_name, entry->d_name,
+                     CHUNK_LIST_SUFFIX) >= (int)sizeof(path) ||
+            mark_chunk_list(path, &live) != 0) {
+            fprintf(stderr, "Failed to read chunk list %s\n", path);
+            closedir(dir);
+            free(live.digests);
+            return -1;
+        }
+    }
+    closedir(dir);
+    qsort(live.digests, live.count, sizeof(live.digests[0]), compare_digests);
+    cutoff -= CHUNK_SWEEP_SLACK_SECONDS;
+
+    // Sweep. A writer may touch a chunk between its stat and the rename,
+    // so the time is checked again once it is out of the way; a writer
+    // touching it after the rename finds it gone and stores it again.
+    dir = opendir(CHUNK_STORAGE_DIR "/sha256");
+    if (!dir) {
+        free(live.digests);
+        return errno == ENOENT ? 0 : -1;
+    }
+    while ((entry = readdir(dir)) != NULL) {
+        struct stat st;
+
+        if (chunk_storage_path(entry->d_name, path, sizeof(path)) != 0 ||
+            bsearch(entry->d_name, live.digests, live.count, sizeof(live.digests[0]), compare_digests) ||
+            lstat(path, &st) != 0 || st.st_mtime >= cutoff) {
+            continue;
+        }
+
+        snprintf(trash_path, sizeof(trash_path), "%s.sweep", path);
+        if (rename(path, trash_path) != 0) {
+            continue;
+        }
+        if (lstat(trash_path, &st) == 0 && st.st_mtime >= cutoff) {
+            rename(trash_path, path);
+            continue;
+        }
+        if (unlink(trash_path) == 0) {
+            (*removed)++;
+            *bytes += (long long)st.st_blocks * 512;
+        }
+    }
+    closedir(dir);
+
+    free(live.digests);
+    return 0;
+}
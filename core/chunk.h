@@ -0,0 +1,76 @@
+#ifndef CHUNK_H
+#define CHUNK_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "sha256.h"
+
+// Content-defined chunks of layer tar streams, shared by every layer that
+// contains them. A chunk lives at CHUNK_STORAGE_DIR/sha256/<digest of its
+// bytes>, lz-compressed when that makes it smaller. A chunked layer keeps
+// only its chunk list: one "<hex digest> <length>" line per chunk, in
+// stream order.
+#define CHUNK_STORAGE_DIR "/tmp/docker-chunks"
+#define CHUNK_LIST_SUFFIX ".chunks"
+#define MAX_CHUNK_PATH_LEN 128
+
+// Gear-hash cut points: never below the minimum, rarely above the average
+// (a stricter mask until then), always at the maximum
+#define CHUNK_MIN_SIZE (8 * 1024)
+#define CHUNK_AVG_BITS 15
+#define CHUNK_MAX_SIZE (256 * 1024)
+#define CHUNK_BUFFER_SIZE (4 * 1024 * 1024)
+
+// A list being written is <list>.<unix time it was opened>.tmp. A sweep
+// keeps chunks touched since the oldest of those opened, and this much
+// before, which covers the coarser clock file times come from.
+#define CHUNK_SWEEP_SLACK_SECONDS 2
+
+typedef struct {
+    long long chunks;
+    long long new_chunks;       // not in the store before
+    long long bytes;            // stream bytes
+    long long new_bytes;        // stream bytes in new chunks
+    long long stored_bytes;     // what the new chunks take on disk
+} chunk_stats_t;
+
+typedef struct {
+    char list_path[512];
+    char temp_path[544];
+    FILE *list;
+    uint8_t *buffer;
+    size_t buffered;
+    uint8_t *packed;
+    uint32_t *table;            // lz match finder
+    chunk_stats_t stats;
+    int failed;
+} chunk_writer_t;
+
+typedef struct {
+    FILE *list;
+    uint8_t *chunk;
+    uint8_t *packed;
+    size_t len;
+    size_t offset;
+    int failed;
+} chunk_reader_t;
+
+// Function declarations
+size_t chunk_boundary(const uint8_t *data, size_t len);
+chunk_writer_t* chunk_writer_open(const char *list_path);
+int chunk_write(chunk_writer_t *writer, const void *data, size_t len);
+int chunk_writer_close(chunk_writer_t *writer, int commit, chunk_stats_t *stats);
+chunk_reader_t* chunk_reader_open(const char *list_path);
+ssize_t chunk_read(void *ctx, void *buf, size_t len);
+void chunk_reader_close(chunk_reader_t *reader);
+int chunk_store_sweep(const char *layers_dir, long long *removed, long long *bytes);
+
+// Helper functions
+int chunk_storage_path(const char *hex, char *path, size_t size);
+int create_chunk_storage(void);
+
+#endif // CHUNK_H
@@ -12,6 +12,15 @@ command_type_t get_command_type(const char *cmd) {
     if (strcmp(cmd, "logs") == 0) return CMD_LOGS;
     if (strcmp(cmd, "exec") == 0) return CMD_EXEC;
     if (strcmp(cmd, "commit") == 0) return CMD_COMMIT;
+    if (strcmp(cmd, "save") == 0) return CMD_SAVE;
+    if (strcmp(cmd, "load") == 0) return CMD_LOAD;
+    if (strcmp(cmd, "pull") == 0) return CMD_PULL;
+    if (strcmp(cmd, "push") == 0) return CMD_PUSH;
+    if (strcmp(cmd, "system") == 0) return CMD_SYSTEM;
+    if (strcmp(cmd, "squash") == 0) return CMD_SQUASH;
+    if (strcmp(cmd, "events") == 0) return CMD_EVENTS;
+    if (strcmp(cmd, "wait") == 0) return CMD_WAIT;
+    if (strcmp(cmd, "kill") == 0) return CMD_KILL;
     if (strcmp(cmd, "daemon") == 0) return CMD_DAEMON;
     return CMD_UNKNOWN;
 }
@@ -57,14 +66,38 @@ parsed_command_t* parse_arguments(int argc, char *argv[]) {
             break;
         case CMD_STOP:
         case CMD_RM:
-        case CMD_RMI:
+        case CMD_KILL:
+            parse_batch_command(cmd, argc, argv);
+            break;
+        case CMD_IMAGES:
+        case CMD_CONTAINERS:
+        case CMD_PS:
+            parse_list_command(cmd, argc, argv);
+            break;
         case CMD_LOGS:
         case CMD_EXEC:
+        case CMD_WAIT:
             parse_container_command(cmd, argc, argv);
             break;
         case CMD_COMMIT:
             parse_commit_command(cmd, argc, argv);
             break;
+        case CMD_RMI:
+        case CMD_SAVE:
+        case CMD_LOAD:
+        case CMD_PULL:
+        case CMD_PUSH:
+            parse_archive_command(cmd, argc, argv);
+            break;
+        case CMD_SYSTEM:
+            parse_system_command(cmd, argc, argv);
+            break;
+        case CMD_SQUASH:
+            parse_squash_command(cmd, argc, argv);
+            break;
+        case CMD_EVENTS:
+            parse_events_command(cmd, argc, argv);
+            break;
         default:
             break;
     }
@@ -117,6 +150,27 @@ void parse_run_command(parsed_command_t *cmd, int argc, char *argv[]) {
     }
 }
 
+// Accepts plain bytes or a b/k/m/g suffix, as in "512m"
+static long long parse_memory_size(const char *value) {
+    char *end;
+    long long size = strtoll(value, &end, 10);
+
+    if (end == value || size < 0) {
+        return -1;
+    }
+
+    switch (*end) {
+        case '\0': case 'b': case 'B': break;
+        case 'k': case 'K': size <<= 10; end++; break;
+        case 'm': case 'M': size <<= 20; end++; break;
+        case 'g': case 'G': size <<= 30; end++; break;
+        default: return -1;
+    }
+
+    if (*end == 'b' || *end == 'B') end++;
+    return *end == '\0' ? size : -1;
+}
+
 void parse_build_command(parsed_command_t *cmd, int argc, char *argv[]) {
     for (int i = 2; i < argc; i++) {
         if (strcmp(argv[i], "-t") == 0 || strcmp(argv[i], "--tag") == 0) {
@@ -127,6 +181,22 @@ void parse_build_command(parsed_command_t *cmd, int argc, char *argv[]) {
             if (i + 1 < argc) {
                 strncpy(cmd->dockerfile_path, argv[++i], sizeof(cmd->dockerfile_path) - 1);
             }
+        } else if (strcmp(argv[i], "-m") == 0 || strcmp(argv[i], "--memory") == 0) {
+            if (i + 1 < argc) {
+                cmd->memory_limit = parse_memory_size(argv[++i]);
+            }
+        } else if (strcmp(argv[i], "--cpu-quota") == 0) {
+            if (i + 1 < argc) {
+                cmd->cpu_quota = strtol(argv[++i], NULL, 10);
+            }
+        } else if (strcmp(argv[i], "--cpu-period") == 0) {
+            if (i + 1 < argc) {
+                cmd->cpu_period = strtol(argv[++i], NULL, 10);
+            }
+        } else if (strcmp(argv[i], "--compression") == 0) {
+            if (i + 1 < argc) {
+                strncpy(cmd->compression, argv[++i], sizeof(cmd->compression) - 1);
+            }
         } else if (argv[i][0] != '-') {
             // This should be the build context
             if (strlen(cmd->working_dir) == 0) {
@@ -150,12 +220,53 @@ void parse_container_command(parsed_command_t *cmd, int argc, char *argv[]) {
     }
 }
 
+// Any number of containers, or every container the filters pick
+void parse_batch_command(parsed_command_t *cmd, int argc, char *argv[]) {
+    cmd->containers = malloc(sizeof(char*) * argc);
+    if (!cmd->containers) {
+        perror("malloc");
+        return;
+    }
+
+    for (int i = 2; i < argc; i++) {
+        if (strcmp(argv[i], "--filter") == 0 && i + 1 < argc) {
+            size_t used = strlen(cmd->filters);
+            snprintf(cmd->filters + used, sizeof(cmd->filters) - used, "%s%s", used ? ";" : "", argv[++i]);
+        } else if (strcmp(argv[i], "-a") == 0 || strcmp(argv[i], "--all") == 0) {
+            cmd->all = 1;
+        } else if (strcmp(argv[i], "--parallel") == 0 && i + 1 < argc) {
+            cmd->parallel = (int)strtol(argv[++i], NULL, 10);
+        } else if (argv[i][0] != '-') {
+            cmd->containers[cmd->container_count++] = cmd->args[i];
+            if (strlen(cmd->container_name) == 0) {
+                strncpy(cmd->container_name, argv[i], sizeof(cmd->container_name) - 1);
+            }
+        }
+    }
+}
+
+// A page of a listing: filters, how many, and the key to start after
+void parse_list_command(parsed_command_t *cmd, int argc, char *argv[]) {
+    for (int i = 2; i < argc; i++) {
+        if ((strcmp(argv[i], "-f") == 0 || strcmp(argv[i], "--filter") == 0) && i + 1 < argc) {
+            size_t used = strlen(cmd->filters);
+            snprintf(cmd->filters + used, sizeof(cmd->filters) - used, "%s%s", used ? ";" : "", argv[++i]);
+        } else if (strcmp(argv[i], "--limit") == 0 && i + 1 < argc) {
+            cmd->limit = (int)strtol(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--cursor") == 0 && i + 1 < argc) {
+            strncpy(cmd->cursor, argv[++i], sizeof(cmd->cursor) - 1);
+        }
+    }
+}
+
 void parse_commit_command(parsed_command_t *cmd, int argc, char *argv[]) {
     for (int i = 2; i < argc; i++) {
         if (strcmp(argv[i], "-m") == 0 || strcmp(argv[i], "--message") == 0) {
             if (i + 1 < argc) {
                 strncpy(cmd->command, argv[++i], sizeof(cmd->command) - 1);
             }
+        } else if (strcmp(argv[i], "-p=false") == 0 || strcmp(argv[i], "--pause=false") == 0) {
+            cmd->no_pause = 1;
         } else if (argv[i][0] != '-') {
             if (strlen(cmd->container_name) == 0) {
                 strncpy(cmd->container_name, argv[i], sizeof(cmd->container_name) - 1);
@@ -166,8 +277,124 @@ void parse_commit_command(parsed_command_t *cmd, int argc, char *argv[]) {
     }
 }
 
+void parse_archive_command(parsed_command_t *cmd, int argc, char *argv[]) {
+    for (int i = 2; i < argc; i++) {
+        if ((strcmp(argv[i], "-o") == 0 || strcmp(argv[i], "--output") == 0 ||
+             strcmp(argv[i], "-i") == 0 || strcmp(argv[i], "--input") == 0) && i + 1 < argc) {
+            strncpy(cmd->file_path, argv[++i], sizeof(cmd->file_path) - 1);
+        } else if (strcmp(argv[i], "--compression") == 0 && i + 1 < argc) {
+            strncpy(cmd->compression, argv[++i], sizeof(cmd->compression) - 1);
+        } else if (strcmp(argv[i], "--lazy") == 0) {
+            cmd->lazy = 1;
+        } else if (argv[i][0] != '-' && strlen(cmd->image_name) == 0) {
+            strncpy(cmd->image_name, argv[i], sizeof(cmd->image_name) - 1);
+        }
+    }
+}
+
+void parse_system_command(parsed_command_t *cmd, int argc, char *argv[]) {
+    for (int i = 2; i < argc; i++) {
+        if (strcmp(argv[i], "-f") == 0 || strcmp(argv[i], "--force") == 0) {
+            cmd->force = 1;
+        } else if (argv[i][0] != '-' && strlen(cmd->command) == 0) {
+            strncpy(cmd->command, argv[i], sizeof(cmd->command) - 1);
+        }
+    }
+}
+
+// Layers are counted from 0 at the bottom; -1 leaves the range open
+void parse_squash_command(parsed_command_t *cmd, int argc, char *argv[]) {
+    cmd->from_layer = -1;
+    cmd->to_layer = -1;
+    for (int i = 2; i < argc; i++) {
+        if ((strcmp(argv[i], "-t") == 0 || strcmp(argv[i], "--tag") == 0) && i + 1 < argc) {
+            strncpy(cmd->target_name, argv[++i], sizeof(cmd->target_name) - 1);
+        } else if (strcmp(argv[i], "--from") == 0 && i + 1 < argc) {
+            cmd->from_layer = (int)strtol(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--to") == 0 && i + 1 < argc) {
+            cmd->to_layer = (int)strtol(argv[++i], NULL, 10);
+        } else if (argv[i][0] != '-' && strlen(cmd->image_name) == 0) {
+            strncpy(cmd->image_name, argv[i], sizeof(cmd->image_name) - 1);
+        }
+    }
+}
+
+void parse_events_command(parsed_command_t *cmd, int argc, char *argv[]) {
+    for (int i = 2; i < argc; i++) {
+        if (strcmp(argv[i], "--since") == 0 && i + 1 < argc) {
+            strncpy(cmd->since, argv[++i], sizeof(cmd->since) - 1);
+        } else if ((strcmp(argv[i], "-f") == 0 || strcmp(argv[i], "--filter") == 0) && i + 1 < argc) {
+            size_t used = strlen(cmd->filters);
+            snprintf(cmd->filters + used, sizeof(cmd->filters) - used, "%s%s", used ? ";" : "", argv[++i]);
+        }
+    }
+}
+
+static const char *event_filter_keys[] = { "type", "event", "container", "image", NULL };
+static const char *container_filter_keys[] = { "status", "name", "id", "image", NULL };
+static const char *list_filter_keys[] = { "status", "name", "id", "image", "label", NULL };
+static const char *image_filter_keys[] = { "reference", "id", "label", NULL };
+
+// Every key=value in filters has one of keys; complains about the first that doesn't
+static int validate_filters(const char *filters, const char **keys) {
+    for (const char *filter = filters; *filter; filter += strcspn(filter, ";"), filter += *filter == ';') {
+        size_t key_len = strcspn(filter, "=;");
+        int known = 0;
+
+        for (int i = 0; keys[i] && filter[key_len] == '='; i++) {
+            if (strlen(keys[i]) == key_len && strncmp(filter, keys[i], key_len) == 0) {
+                known = 1;
+            }
+        }
+        if (!known) {
+            fprintf(stderr, "Error: Invalid filter '%.*s' (expected key=value with key one of",
+                    (int)strcspn(filter, ";"), filter);
+            for (int i = 0; keys[i]; i++) {
+                fprintf(stderr, "%s %s", i > 0 ? "," : "", keys[i]);
+            }
+            fprintf(stderr, ")\n");
+            return 0;
+        }
+    }
+    return 1;
+}
+
 int validate_command(parsed_command_t *cmd) {
+    if (cmd->compression[0] && strcmp(cmd->compression, "none") != 0 && strcmp(cmd->compression, "lz") != 0 &&
+        (cmd->type != CMD_BUILD || strcmp(cmd->compression, "chunked") != 0)) {
+        fprintf(stderr, "Error: Unknown compression '%s' (expected none or lz%s)\n", cmd->compression,
+                cmd->type == CMD_BUILD ? " or chunked" : "");
+        return 0;
+    }
+
     switch (cmd->type) {
+        case CMD_STOP:
+        case CMD_RM:
+        case CMD_KILL:
+            if (cmd->container_count == 0 && cmd->filters[0] == '\0' && !cmd->all) {
+                fprintf(stderr, "Error: Container name, --filter or --all required for '%s' command\n",
+                        cmd->type == CMD_STOP ? "stop" : cmd->type == CMD_RM ? "rm" : "kill");
+                return 0;
+            }
+            if (cmd->parallel < 0) {
+                fprintf(stderr, "Error: Invalid --parallel value\n");
+                return 0;
+            }
+            if (!validate_filters(cmd->filters, container_filter_keys)) {
+                return 0;
+            }
+            break;
+        case CMD_IMAGES:
+        case CMD_CONTAINERS:
+        case CMD_PS:
+            if (cmd->limit < 0) {
+                fprintf(stderr, "Error: Invalid --limit value\n");
+                return 0;
+            }
+            if (!validate_filters(cmd->filters, cmd->type == CMD_IMAGES ? image_filter_keys : list_filter_keys)) {
+                return 0;
+            }
+            break;
         case CMD_RUN:
             if (strlen(cmd->image_name) == 0) {
                 fprintf(stderr, "Error: Image name required for 'run' command\n");
@@ -179,16 +406,18 @@ int validate_command(parsed_command_t *cmd) {
                 fprintf(stderr, "Error: Image name required for 'build' command\n");
                 return 0;
             }
+            if (cmd->memory_limit < 0 || cmd->cpu_quota < 0 || cmd->cpu_period < 0) {
+                fprintf(stderr, "Error: Invalid --memory, --cpu-quota or --cpu-period value\n");
+                return 0;
+            }
             break;
-        case CMD_STOP:
-        case CMD_RM:
         case CMD_LOGS:
         case CMD_EXEC:
+        case CMD_WAIT:
             if (strlen(cmd->container_name) == 0) {
                 fprintf(stderr, "Error: Container name required for '%s' command\n",
-                        cmd->type == CMD_STOP ? "stop" :
-                        cmd->type == CMD_RM ? "rm" :
-                        cmd->type == CMD_LOGS ? "logs" : "exec");
+                        cmd->type == CMD_LOGS ? "logs" :
+                        cmd->type == CMD_WAIT ? "wait" : "exec");
                 return 0;
             }
             break;
@@ -198,6 +427,55 @@ int validate_command(parsed_command_t *cmd) {
                 return 0;
             }
             break;
+        case CMD_PULL:
+        case CMD_PUSH:
+            if (strlen(cmd->image_name) == 0) {
+                fprintf(stderr, "Error: Image reference required for '%s' command\n",
+                        cmd->type == CMD_PULL ? "pull" : "push");
+                return 0;
+            }
+            break;
+        case CMD_RMI:
+            if (strlen(cmd->image_name) == 0) {
+                fprintf(stderr, "Error: Image name required for 'rmi' command\n");
+                return 0;
+            }
+            break;
+        case CMD_SAVE:
+            if (strlen(cmd->image_name) == 0) {
+                fprintf(stderr, "Error: Image name required for 'save' command\n");
+                return 0;
+            }
+            if (strlen(cmd->file_path) == 0 && isatty(STDOUT_FILENO)) {
+                fprintf(stderr, "Error: Refusing to write an archive to a terminal, use -o\n");
+                return 0;
+            }
+            break;
+        case CMD_SYSTEM:
+            if (strcmp(cmd->command, "prune") != 0) {
+                fprintf(stderr, "Error: Unknown 'system' subcommand '%s', expected 'prune'\n", cmd->command);
+                return 0;
+            }
+            break;
+        case CMD_SQUASH:
+            if (strlen(cmd->image_name) == 0) {
+                fprintf(stderr, "Error: Image name required for 'squash' command\n");
+                return 0;
+            }
+            if (cmd->from_layer < -1 || cmd->to_layer < -1) {
+                fprintf(stderr, "Error: Invalid --from or --to layer\n");
+                return 0;
+            }
+            break;
+        case CMD_EVENTS:
+            if (cmd->since[0] && strspn(cmd->since, "0123456789") != strlen(cmd->since)) {
+                fprintf(stderr, "Error: --since takes a unix timestamp\n");
+                return 0;
+            }
+            if (!validate_filters(cmd->filters, event_filter_keys)) {
+                return 0;
+            }
+            break;
         default:
             break;
     }
@@ -213,6 +491,7 @@ void free_parsed_command(parsed_command_t *cmd) {
         }
         free(cmd->args);
     }
+    free(cmd->containers);
     free(cmd);
 }
 
@@ -221,19 +500,42 @@ void print_usage(const char *program_name) {
     printf("Commands:\n");
     printf("  run        Run a container from an image\n");
     printf("  build      Build an image from a Dockerfile\n");
-    printf("  images     List images\n");
-    printf("  containers List containers\n");
-    printf("  ps         List running containers\n");
-    printf("  stop       Stop a running container\n");
-    printf("  rm         Remove a container\n");
+    printf("  images     List images (--filter key=value, --limit n, --cursor last-name:tag)\n");
+    printf("  containers List containers (--filter key=value, --limit n, --cursor last-id)\n");
+    printf("  ps         List containers (same options as containers)\n");
+    printf("  stop       Stop running containers (several at once, --filter key=value, --all, --parallel n)\n");
+    printf("  kill       Kill running containers (same selection as stop)\n");
+    printf("  wait       Block until a container exits, then print its exit code\n");
+    printf("  rm         Remove containers (same selection as stop)\n");
     printf("  rmi        Remove an image\n");
     printf("  logs       Show container logs\n");
     printf("  exec       Execute command in running container\n");
-    printf("  commit     Create image from container\n");
+    printf("  commit     Create an image from a container's changes (-m message, --pause=false)\n");
+    printf("  save       Save an image to a tar archive (-o file, default stdout, --compression lz)\n");
+    printf("  load       Load an image from a tar archive (-i file, default stdin)\n");
+    printf("  pull       Pull an image from a registry (host:port/name:tag, --lazy fetches files on first use)\n");
+    printf("  push       Push an image to a registry (host:port/name:tag)\n");
+    printf("  squash     Merge an image's layers into one (--from/--to layer range, -t new name:tag)\n");
+    printf("  events     Stream container and image events (--since unix-time, --filter key=value)\n");
+    printf("  system     Manage the daemon's storage (prune [-f] removes what nothing uses)\n");
     printf("  daemon     Start the daemon\n\n");
     printf("Examples:\n");
     printf("  %s run -it ubuntu bash\n", program_name);
     printf("  %s build -t myimage .\n", program_name);
+    printf("  %s build -t myimage --memory 512m --cpu-quota 50000 .\n", program_name);
+    printf("  %s build -t myimage --compression lz .\n", program_name);
+    printf("  %s build -t myimage --compression chunked .\n", program_name);
     printf("  %s images\n", program_name);
+    printf("  %s save -o myimage.tar myimage:latest\n", program_name);
+    printf("  %s load -i myimage.tar\n", program_name);
+    printf("  %s pull localhost:5000/tools/busybox:1.36\n", program_name);
+    printf("  %s pull --lazy localhost:5000/tools/busybox:1.36\n", program_name);
+    printf("  %s commit -m \"add config\" mycontainer myimage:v2\n", program_name);
+    printf("  %s squash -t myimage:flat myimage\n", program_name);
+    printf("  %s squash --from 1 --to 4 myimage\n", program_name);
+    printf("  %s rm --filter status=exited --parallel 16\n", program_name);
+    printf("  %s events --filter type=container --filter event=die\n", program_name);
+    printf("  %s system prune -f\n", program_name);
     printf("  %s ps\n", program_name);
+    printf("  %s ps --filter status=running --limit 100\n", program_name);
 }
@@ -23,6 +23,15 @@ typedef enum {
     CMD_LOGS,
     CMD_EXEC,
     CMD_COMMIT,
+    CMD_SAVE,
+    CMD_LOAD,
+    CMD_PULL,
+    CMD_PUSH,
+    CMD_SYSTEM,
+    CMD_SQUASH,
+    CMD_EVENTS,
+    CMD_WAIT,
+    CMD_KILL,
     CMD_DAEMON
 } command_type_t;
 
@@ -33,6 +42,7 @@ typedef struct {
     char image_name[MAX_PATH_LEN];
     char container_name[MAX_PATH_LEN];
     char dockerfile_path[MAX_PATH_LEN];
+    char file_path[MAX_PATH_LEN];
     char working_dir[MAX_PATH_LEN];
     char command[MAX_COMMAND_LEN];
     int detach;
@@ -41,6 +51,24 @@ typedef struct {
     char port_mapping[64];
     char volume_mapping[256];
     char env_vars[512];
+    char compression[16];
+    int lazy;
+    int force;
+    int no_pause;
+    char target_name[MAX_PATH_LEN];
+    int from_layer;
+    int to_layer;
+    long long memory_limit;
+    long cpu_quota;
+    long cpu_period;
+    char since[32];
+    char filters[512];                  // key=value pairs separated by ;
+    char **containers;                  // stop, rm and kill: into args
+    int container_count;
+    int all;
+    int parallel;
+    int limit;                          // images and ps: entries per page
+    char cursor[MAX_PATH_LEN];          // images and ps: where the page starts
 } parsed_command_t;
 
 // Function declarations
@@ -52,6 +80,12 @@ int validate_command(parsed_command_t *cmd);
 void parse_run_command(parsed_command_t *cmd, int argc, char *argv[]);
 void parse_build_command(parsed_command_t *cmd, int argc, char *argv[]);
 void parse_container_command(parsed_command_t *cmd, int argc, char *argv[]);
+void parse_batch_command(parsed_command_t *cmd, int argc, char *argv[]);
+void parse_list_command(parsed_command_t *cmd, int argc, char *argv[]);
 void parse_commit_command(parsed_command_t *cmd, int argc, char *argv[]);
+void parse_archive_command(parsed_command_t *cmd, int argc, char *argv[]);
+void parse_system_command(parsed_command_t *cmd, int argc, char *argv[]);
+void parse_squash_command(parsed_command_t *cmd, int argc, char *argv[]);
+void parse_events_command(parsed_command_t *cmd, int argc, char *argv[]);
 
 #endif // CLI_PARSER_H
@@ -1,4 +1,12 @@
 #include "client.h"
+#include <ctype.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <signal.h>
+#include <strings.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <time.h>
 
 int connect_to_daemon(const char* host, int port) {
     int socket_fd;
@@ -102,15 +110,54 @@ int parse_http_response(const char* response, int* status_code, char* body) {
     return 0;
 }
 
+// The first member named key anywhere in the document json, depth first
+// Parses a reply or event once for the field_* lookups after it; one that
+// is not JSON reads as null, so every field comes back empty
+static void parse_reply(const char* json, json_value_t* reply) {
+    if (json_parse(json, strlen(json), reply) != 0) {
+        memset(reply, 0, sizeof(*reply));
+        reply->type = JSON_NULL;
+    }
+}
+
+// A nested object, or null when the member is missing or something else
+static void field_object(json_value_t* reply, const char* key, json_value_t* out) {
+    if (json_get(reply, key, out) != 0 || out->type != JSON_OBJECT) {
+        memset(out, 0, sizeof(*out));
+        out->type = JSON_NULL;
+    }
+}
+
+static int field_string(json_value_t* reply, const char* key, char* out, int size) {
+    json_value_t value;
+
+    if (json_get(reply, key, &value) != 0) {
+        out[0] = '\0';
+        return -1;
+    }
+    return json_string_copy(&value, out, size);
+}
+
+static double field_number(json_value_t* reply, const char* key) {
+    json_value_t value;
+    double number = 0;
+
+    if (json_get(reply, key, &value) == 0) {
+        json_number_double(&value, &number);
+    }
+    return number;
+}
+
 int docker_run(const char* image, const char* command, const char* name,
                const char* working_dir, const char* env_vars,
                const char* port_mappings, const char* volume_mappings,
                int interactive, int tty, int detach) {
     int socket_fd;
-    char request_body[1024];
+    char request_body[4096];
     char response[MAX_RESPONSE_SIZE];
     int status_code;
     char response_body[MAX_RESPONSE_SIZE];
+    json_writer_t w;
 
     // Connect to daemon
     socket_fd = connect_to_daemon(DEFAULT_DAEMON_HOST, DEFAULT_DAEMON_PORT);
@@ -120,17 +167,38 @@ int docker_run(const char* image, const char* command, const char* name,
     }
 
     // Create request body
-    snprintf(request_body, sizeof(request_body),
-             "{\"Image\":\"%s\",\"Cmd\":[\"%s\"],\"WorkingDir\":\"%s\",\"Env\":[\"%s\"],\"PortBindings\":\"%s\",\"Binds\":[\"%s\"],\"AttachStdin\":%s,\"AttachStdout\":%s,\"Detach\":%s}",
-             image ? image : "ubuntu",
-             command ? command : "",
-             working_dir ? working_dir : "/",
-             env_vars ? env_vars : "",
-             port_mappings ? port_mappings : "",
-             volume_mappings ? volume_mappings : "",
-             interactive ? "true" : "false",
-             tty ? "true" : "false",
-             detach ? "true" : "false");
+    json_writer_init(&w, request_body, sizeof(request_body), NULL, NULL);
+    json_write_object_begin(&w);
+    json_write_key(&w, "Image");
+    json_write_string(&w, image ? image : "ubuntu");
+    json_write_key(&w, "Cmd");
+    json_write_array_begin(&w);
+    json_write_string(&w, command ? command : "");
+    json_write_array_end(&w);
+    json_write_key(&w, "WorkingDir");
+    json_write_string(&w, working_dir ? working_dir : "/");
+    json_write_key(&w, "Env");
+    json_write_array_begin(&w);
+    json_write_string(&w, env_vars ? env_vars : "");
+    json_write_array_end(&w);
+    json_write_key(&w, "PortBindings");
+    json_write_string(&w, port_mappings ? port_mappings : "");
+    json_write_key(&w, "Binds");
+    json_write_array_begin(&w);
+    json_write_string(&w, volume_mappings ? volume_mappings : "");
+    json_write_array_end(&w);
+    json_write_key(&w, "AttachStdin");
+    json_write_bool(&w, interactive);
+    json_write_key(&w, "AttachStdout");
+    json_write_bool(&w, tty);
+    json_write_key(&w, "Detach");
+    json_write_bool(&w, detach);
+    json_write_object_end(&w);
+    if (json_writer_finish(&w) < 0) {
+        fprintf(stderr, "Run options are too long\n");
+        close(socket_fd);
+        return -1;
+    }
 
     // Send request
     if (send_request_to_daemon(socket_fd, "POST", "/containers/create", request_body) != 0) {
@@ -152,110 +220,531 @@ int docker_run(const char* image, const char* command, const char* name,
 
     close(socket_fd);
 
-    if (status_code == 201) {
-        printf("Container created successfully\n");
-        return 0;
-    } else {
+    if (status_code != 201) {
         fprintf(stderr, "Failed to create container: %s\n", response_body);
         return -1;
     }
-}
 
-int docker_build(const char* image_name, const char* dockerfile_path, const char* context_path) {
-    int socket_fd;
-    char url[512];
-    char response[MAX_RESPONSE_SIZE];
-    int status_code;
-    char response_body[MAX_RESPONSE_SIZE];
+    char container_id[128];
+    char url[256];
+    json_value_t reply;
 
-    // Connect to daemon
+    parse_reply(response_body, &reply);
+    field_string(&reply, "Id", container_id, sizeof(container_id));
+    printf("Container %s created\n", container_id);
+
+    // Start it: without -d the daemon answers once the command has exited
     socket_fd = connect_to_daemon(DEFAULT_DAEMON_HOST, DEFAULT_DAEMON_PORT);
     if (socket_fd < 0) {
         fprintf(stderr, "Failed to connect to daemon\n");
         return -1;
     }
-
-    // Create URL with query parameters
-    snprintf(url, sizeof(url), "/build?t=%s&dockerfile=%s",
-             image_name ? image_name : "myimage",
-             dockerfile_path ? dockerfile_path : "Dockerfile");
-
-    // Send request
-    if (send_request_to_daemon(socket_fd, "POST", url, NULL) != 0) {
+    snprintf(url, sizeof(url), "/containers/%s/start", container_id);
+    if (send_request_to_daemon(socket_fd, "POST", url, NULL) != 0 ||
+        receive_response_from_daemon(socket_fd, response, sizeof(response)) < 0 ||
+        parse_http_response(response, &status_code, response_body) != 0) {
         close(socket_fd);
         return -1;
     }
+    close(socket_fd);
 
-    // Receive response
-    if (receive_response_from_daemon(socket_fd, response, sizeof(response)) < 0) {
-        close(socket_fd);
+    if (status_code != 204) {
+        fprintf(stderr, "Failed to start container: %s\n", response_body);
         return -1;
     }
+    printf("Container %s %s\n", container_id, detach ? "started" : "exited");
+    return 0;
+}
 
-    // Parse response
-    if (parse_http_response(response, &status_code, response_body) != 0) {
-        close(socket_fd);
-        return -1;
+typedef struct {
+    int step;
+    double duration_ms;
+    char text[160];
+} build_step_timing_t;
+
+typedef struct {
+    build_step_timing_t *steps;
+    int count;
+    int failed;
+    int completed;
+    int queued;
+} build_render_t;
+
+static void format_bytes(long long bytes, char* out, int size) {
+    const char *units[] = {"B", "KB", "MB", "GB", "TB"};
+    double value = bytes;
+    int unit = 0;
+
+    while (value >= 1024 && unit < 4) {
+        value /= 1024;
+        unit++;
+    }
+    snprintf(out, size, unit == 0 ? "%.0f %s" : "%.1f %s", value, units[unit]);
+}
+
+static void format_duration(double ms, char* out, int size) {
+    if (ms >= 1000) {
+        snprintf(out, size, "%.2fs", ms / 1000);
+    } else {
+        snprintf(out, size, "%.1fms", ms);
     }
+}
 
-    close(socket_fd);
+static int compare_step_durations(const void* a, const void* b) {
+    double da = ((const build_step_timing_t*)a)->duration_ms;
+    double db = ((const build_step_timing_t*)b)->duration_ms;
+    return da < db ? 1 : da > db ? -1 : 0;
+}
 
-    if (status_code == 200) {
-        printf("Image built successfully\n");
-        return 0;
-    } else {
-        fprintf(stderr, "Failed to build image: %s\n", response_body);
-        return -1;
+static void render_build_event(const char* line, void* user_data) {
+    build_render_t *render = user_data;
+    char event[32], instruction[64], args[1024], message[1024];
+    char duration[32], bytes[32];
+    json_value_t reply;
+
+    parse_reply(line, &reply);
+    field_string(&reply, "event", event, sizeof(event));
+    int step = (int)field_number(&reply, "step");
+    int total = (int)field_number(&reply, "total");
+
+    if (strcmp(event, "queued") == 0) {
+        render->queued = 1;
+        printf("Waiting for a build slot: position %d in queue (%d/%d builds running)\n",
+               (int)field_number(&reply, "position"), (int)field_number(&reply, "running"),
+               (int)field_number(&reply, "limit"));
+        fflush(stdout);
+    } else if (strcmp(event, "started") == 0) {
+        if (render->queued) {
+            format_duration(field_number(&reply, "queued_ms"), duration, sizeof(duration));
+            printf("Build slot acquired after %s\n", duration);
+        }
+        long long memory = (long long)field_number(&reply, "memory");
+        long quota = (long)field_number(&reply, "cpu_quota");
+        long period = (long)field_number(&reply, "cpu_period");
+        if (memory > 0 || quota > 0) {
+            char cpu[64];
+            format_bytes(memory, bytes, sizeof(bytes));
+            snprintf(cpu, sizeof(cpu), "%ldus per %ldus", quota, period > 0 ? period : 100000);
+            printf("Resource budget: memory %s, cpu %s\n", memory > 0 ? bytes : "unlimited",
+                   quota > 0 ? cpu : "unlimited");
+        }
+        fflush(stdout);
+    } else if (strcmp(event, "step_start") == 0) {
+        field_string(&reply, "instruction", instruction, sizeof(instruction));
+        field_string(&reply, "args", args, sizeof(args));
+        printf("Step %d/%d : %s %s\n", step, total, instruction, args);
+        fflush(stdout);
+
+        build_step_timing_t *steps = realloc(render->steps, sizeof(build_step_timing_t) * (render->count + 1));
+        if (steps) {
+            render->steps = steps;
+            char *text = steps[render->count].text;
+            steps[render->count].step = step;
+            steps[render->count].duration_ms = 0;
+            // The summary has room for the start of a long step only
+            if (snprintf(text, sizeof(steps[render->count].text), "%s %s", instruction, args) >=
+                (int)sizeof(steps[render->count].text)) {
+                strcpy(text + sizeof(steps[render->count].text) - 4, "...");
+            }
+            render->count++;
+        }
+    } else if (strcmp(event, "step_end") == 0) {
+        double ms = field_number(&reply, "duration_ms");
+        long long copied = (long long)field_number(&reply, "bytes_copied");
+        int hits = (int)field_number(&reply, "cache_hits");
+        int misses = (int)field_number(&reply, "cache_misses");
+
+        format_duration(ms, duration, sizeof(duration));
+        if (field_number(&reply, "cached")) {
+            printf(" ---> Using cache");
+        } else {
+            printf(" ---> Done in %s", duration);
+        }
+        if (copied > 0) {
+            format_bytes(copied, bytes, sizeof(bytes));
+            printf(", %s copied", bytes);
+        }
+        if (hits + misses > 0) {
+            printf(", digest cache %d hit / %d miss", hits, misses);
+        }
+        printf("\n");
+        fflush(stdout);
+
+        if (render->count > 0 && render->steps[render->count - 1].step == step) {
+            render->steps[render->count - 1].duration_ms = ms;
+        }
+    } else if (strcmp(event, "error") == 0) {
+        field_string(&reply, "message", message, sizeof(message));
+        fprintf(stderr, "Error: %s\n", message);
+        render->failed = 1;
+    } else if (strcmp(event, "complete") == 0) {
+        double total_ms = field_number(&reply, "duration_ms");
+
+        render->completed = 1;
+        format_duration(total_ms, duration, sizeof(duration));
+        printf("\nBuild completed in %s\n", duration);
+
+        // Slowest steps first, so the ones worth optimizing stand out
+        qsort(render->steps, render->count, sizeof(build_step_timing_t), compare_step_durations);
+        printf("STEP    DURATION    SHARE    INSTRUCTION\n");
+        for (int i = 0; i < render->count; i++) {
+            format_duration(render->steps[i].duration_ms, duration, sizeof(duration));
+            printf("%-7d %-11s %5.1f%%   %.60s\n", render->steps[i].step, duration,
+                   total_ms > 0 ? render->steps[i].duration_ms * 100 / total_ms : 0,
+                   render->steps[i].text);
+        }
     }
 }
 
-int docker_images() {
-    int socket_fd;
-    char response[MAX_RESPONSE_SIZE];
-    int status_code;
-    char response_body[MAX_RESPONSE_SIZE];
+typedef struct {
+    int fd;
+    char buffer[MAX_RESPONSE_SIZE];
+    int start;
+    int end;
+} stream_reader_t;
 
-    // Connect to daemon
-    socket_fd = connect_to_daemon(DEFAULT_DAEMON_HOST, DEFAULT_DAEMON_PORT);
-    if (socket_fd < 0) {
-        fprintf(stderr, "Failed to connect to daemon\n");
+static int reader_fill(stream_reader_t* reader) {
+    if (reader->start > 0) {
+        memmove(reader->buffer, reader->buffer + reader->start, reader->end - reader->start);
+        reader->end -= reader->start;
+        reader->start = 0;
+    }
+    if (reader->end >= (int)sizeof(reader->buffer)) {
         return -1;
     }
 
-    // Send request
-    if (send_request_to_daemon(socket_fd, "GET", "/images/json", NULL) != 0) {
-        close(socket_fd);
+    int n = recv(reader->fd, reader->buffer + reader->end, sizeof(reader->buffer) - reader->end, 0);
+    if (n <= 0) {
         return -1;
     }
+    reader->end += n;
+    return n;
+}
 
-    // Receive response
-    if (receive_response_from_daemon(socket_fd, response, sizeof(response)) < 0) {
-        close(socket_fd);
+static int reader_read_line(stream_reader_t* reader, char* line, int size) {
+    for (;;) {
+        char *newline = memchr(reader->buffer + reader->start, '\n', reader->end - reader->start);
+        if (newline) {
+            int len = newline - (reader->buffer + reader->start);
+            if (len > 0 && newline[-1] == '\r') len--;
+            if (len >= size) len = size - 1;
+            memcpy(line, reader->buffer + reader->start, len);
+            line[len] = '\0';
+            reader->start = newline - reader->buffer + 1;
+            return len;
+        }
+        if (reader_fill(reader) < 0) {
+            return -1;
+        }
+    }
+}
+
+// Copies through the buffer, so len may be more than it holds
+static int reader_read(stream_reader_t* reader, char* out, int len) {
+    int got = 0;
+
+    while (got < len) {
+        int n = reader->end - reader->start;
+        if (n == 0) {
+            if (reader_fill(reader) < 0) {
+                return -1;
+            }
+            continue;
+        }
+        if (n > len - got) n = len - got;
+        memcpy(out + got, reader->buffer + reader->start, n);
+        reader->start += n;
+        got += n;
+    }
+    return len;
+}
+
+static void read_plain_body(stream_reader_t* reader, int content_length, char* body, int size) {
+    int len = content_length >= 0 && content_length < size ? content_length : size - 1;
+    int got = 0;
+
+    while (got < len) {
+        int n = reader->end - reader->start;
+        if (n == 0 && reader_fill(reader) < 0) break;
+        n = reader->end - reader->start;
+        if (n > len - got) n = len - got;
+        memcpy(body + got, reader->buffer + reader->start, n);
+        reader->start += n;
+        got += n;
+    }
+    body[got] = '\0';
+}
+
+static int read_response_headers(stream_reader_t* reader, int* status_code, int* chunked, int* content_length) {
+    char line[MAX_RESPONSE_SIZE];
+
+    if (reader_read_line(reader, line, sizeof(line)) < 0 ||
+        sscanf(line, "HTTP/1.1 %d", status_code) != 1) {
         return -1;
     }
 
-    // Parse response
-    if (parse_http_response(response, &status_code, response_body) != 0) {
-        close(socket_fd);
+    while (reader_read_line(reader, line, sizeof(line)) > 0) {
+        if (strncasecmp(line, "Transfer-Encoding:", 18) == 0 && strstr(line, "chunked")) {
+            *chunked = 1;
+        } else if (strncasecmp(line, "Content-Length:", 15) == 0) {
+            *content_length = atoi(line + 15);
+        }
+    }
+    return 0;
+}
+
+int receive_streamed_response(int socket, int* status_code, stream_line_fn on_line, void* user_data,
+                              char* error_body, int error_size) {
+    stream_reader_t *reader;
+    char line[MAX_RESPONSE_SIZE];
+    char *pending = NULL;
+    int pending_len = 0;
+    int chunked = 0;
+    int content_length = -1;
+    int result = -1;
+
+    reader = calloc(1, sizeof(stream_reader_t));
+    if (!reader) {
+        perror("calloc");
         return -1;
     }
+    reader->fd = socket;
 
-    close(socket_fd);
+    if (read_response_headers(reader, status_code, &chunked, &content_length) != 0) {
+        free(reader);
+        return -1;
+    }
 
-    if (status_code == 200) {
-        print_images_json(response_body);
+    if (!chunked) {
+        // Plain responses carry an error document rather than events
+        read_plain_body(reader, content_length, error_body, error_size);
+        free(reader);
         return 0;
-    } else {
-        fprintf(stderr, "Failed to list images: %s\n", response_body);
+    }
+
+    // Events are newline delimited and may straddle chunk boundaries
+    for (;;) {
+        char *data;
+        long size;
+
+        if (reader_read_line(reader, line, sizeof(line)) < 0) break;
+        size = strtol(line, NULL, 16);
+        if (size == 0) {
+            result = 0;
+            break;
+        }
+
+        data = realloc(pending, pending_len + size + 1);
+        if (!data) break;
+        pending = data;
+        if (reader_read(reader, pending + pending_len, size) < 0) break;
+        pending_len += size;
+        reader_read_line(reader, line, sizeof(line));
+
+        int consumed = 0;
+        for (int i = 0; i < pending_len; i++) {
+            if (pending[i] == '\n') {
+                pending[i] = '\0';
+                on_line(pending + consumed, user_data);
+                consumed = i + 1;
+            }
+        }
+        memmove(pending, pending + consumed, pending_len - consumed);
+        pending_len -= consumed;
+    }
+
+    free(pending);
+    free(reader);
+    return result;
+}
+
+static int write_all(int fd, const char* data, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, data, len);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            perror("write");
+            return -1;
+        }
+        data += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// Moves len body bytes to out_fd: first whatever the reader has buffered,
+// then straight from the socket through a pipe with splice. Outputs that
+// cannot be spliced to fall back to recv and write.
+static int copy_body(stream_reader_t* reader, int out_fd, long long len, int pipe_fds[2],
+                     char* buffer, size_t buffer_size) {
+    long long buffered = reader->end - reader->start;
+
+    if (buffered > 0) {
+        if (buffered > len) buffered = len;
+        if (write_all(out_fd, reader->buffer + reader->start, buffered) != 0) {
+            return -1;
+        }
+        reader->start += buffered;
+        len -= buffered;
+    }
+
+    while (len > 0) {
+        ssize_t n;
+
+        if (pipe_fds[0] >= 0) {
+            n = splice(reader->fd, NULL, pipe_fds[1], NULL, len, SPLICE_F_MOVE | SPLICE_F_MORE);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) {
+                if (n < 0 && errno == EINVAL) {
+                    close(pipe_fds[0]);
+                    close(pipe_fds[1]);
+                    pipe_fds[0] = pipe_fds[1] = -1;
+                    continue;
+                }
+                return -1;
+            }
+            len -= n;
+
+            while (n > 0) {
+                ssize_t moved = splice(pipe_fds[0], NULL, out_fd, NULL, n, SPLICE_F_MOVE | SPLICE_F_MORE);
+                if (moved < 0 && errno == EINTR) continue;
+                if (moved <= 0) {
+                    // Empty the pipe by hand and stop splicing
+                    while (n > 0) {
+                        ssize_t r = read(pipe_fds[0], buffer, n < (ssize_t)buffer_size ? (size_t)n : buffer_size);
+                        if (r <= 0 || write_all(out_fd, buffer, r) != 0) return -1;
+                        n -= r;
+                    }
+                    close(pipe_fds[0]);
+                    close(pipe_fds[1]);
+                    pipe_fds[0] = pipe_fds[1] = -1;
+                    break;
+                }
+                n -= moved;
+            }
+            continue;
+        }
+
+        n = recv(reader->fd, buffer, len < (long long)buffer_size ? (size_t)len : buffer_size, 0);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0 || write_all(out_fd, buffer, n) != 0) {
+            return -1;
+        }
+        len -= n;
+    }
+    return 0;
+}
+
+int receive_streamed_body(int socket, int* status_code, int out_fd, char* error_body, int error_size) {
+    stream_reader_t *reader;
+    char line[MAX_RESPONSE_SIZE];
+    char *buffer;
+    int pipe_fds[2] = { -1, -1 };
+    int chunked = 0;
+    int content_length = -1;
+    int result = -1;
+
+    reader = calloc(1, sizeof(stream_reader_t));
+    buffer = malloc(1024 * 1024);
+    if (!reader || !buffer) {
+        perror("malloc");
+        free(reader);
+        free(buffer);
         return -1;
     }
+    reader->fd = socket;
+    error_body[0] = '\0';
+
+    if (read_response_headers(reader, status_code, &chunked, &content_length) != 0) {
+        goto out;
+    }
+
+    if (!chunked) {
+        read_plain_body(reader, content_length, error_body, error_size);
+        result = 0;
+        goto out;
+    }
+
+    if (pipe(pipe_fds) == 0) {
+        fcntl(pipe_fds[1], F_SETPIPE_SZ, 1024 * 1024);
+    }
+
+    for (;;) {
+        long long size;
+
+        if (reader_read_line(reader, line, sizeof(line)) < 0) break;
+        size = strtoll(line, NULL, 16);
+        if (size == 0) {
+            result = 0;
+            break;
+        }
+        if (size < 0 || copy_body(reader, out_fd, size, pipe_fds, buffer, 1024 * 1024) != 0) break;
+        reader_read_line(reader, line, sizeof(line));
+    }
+
+out:
+    if (pipe_fds[0] >= 0) {
+        close(pipe_fds[0]);
+        close(pipe_fds[1]);
+    }
+    free(buffer);
+    free(reader);
+    return result;
+}
+
+// Percent-encodes a query value
+static void encode_query_value(const char* src, char* dst, int size) {
+    int len = 0;
+
+    for (; *src && len < size - 4; src++) {
+        unsigned char c = (unsigned char)*src;
+
+        if (isalnum(c) || strchr("-_.~:/", c)) {
+            dst[len++] = c;
+        } else {
+            len += snprintf(dst + len, size - len, "%%%02X", c);
+        }
+    }
+    dst[len] = '\0';
 }
 
-int docker_containers() {
+int docker_build(const char* image_name, const char* dockerfile_path, const char* context_path,
+                 long long memory_limit, long cpu_quota, long cpu_period, const char* compression) {
     int socket_fd;
-    char response[MAX_RESPONSE_SIZE];
-    int status_code;
+    char url[7 * PATH_MAX];
+    char dockerfile_abs[PATH_MAX];
+    char context_abs[PATH_MAX];
+    char name_query[3 * 256];
+    char compression_query[3 * 32];
+    char dockerfile_query[3 * PATH_MAX];
+    char context_query[3 * PATH_MAX];
+    int status_code = 0;
     char response_body[MAX_RESPONSE_SIZE];
+    build_render_t render;
+
+    // The daemon resolves paths from its own cwd, so send absolute ones
+    if (!realpath(context_path && context_path[0] ? context_path : ".", context_abs)) {
+        perror("realpath context");
+        return -1;
+    }
+    if (!realpath(dockerfile_path ? dockerfile_path : "Dockerfile", dockerfile_abs)) {
+        perror("realpath Dockerfile");
+        return -1;
+    }
+
+    // Create URL with query parameters; paths go last since they are the longest
+    encode_query_value(image_name ? image_name : "myimage", name_query, sizeof(name_query));
+    encode_query_value(compression && compression[0] ? compression : "none", compression_query,
+                       sizeof(compression_query));
+    encode_query_value(dockerfile_abs, dockerfile_query, sizeof(dockerfile_query));
+    encode_query_value(context_abs, context_query, sizeof(context_query));
+    if (snprintf(url, sizeof(url), "/build?t=%s&memory=%lld&cpuquota=%ld&cpuperiod=%ld&compression=%s&dockerfile=%s&context=%s",
+                 name_query, memory_limit, cpu_quota, cpu_period, compression_query, dockerfile_query,
+                 context_query) >=
+        (int)sizeof(url)) {
+        fprintf(stderr, "Build paths too long\n");
+        return -1;
+    }
 
     // Connect to daemon
     socket_fd = connect_to_daemon(DEFAULT_DAEMON_HOST, DEFAULT_DAEMON_PORT);
@@ -265,38 +754,33 @@ int docker_containers() {
     }
 
     // Send request
-    if (send_request_to_daemon(socket_fd, "GET", "/containers/json", NULL) != 0) {
+    if (send_request_to_daemon(socket_fd, "POST", url, NULL) != 0) {
         close(socket_fd);
         return -1;
     }
 
-    // Receive response
-    if (receive_response_from_daemon(socket_fd, response, sizeof(response)) < 0) {
-        close(socket_fd);
-        return -1;
-    }
+    // Render progress events as they arrive
+    memset(&render, 0, sizeof(render));
+    response_body[0] = '\0';
+    int result = receive_streamed_response(socket_fd, &status_code, render_build_event, &render,
+                                           response_body, sizeof(response_body));
+    close(socket_fd);
+    free(render.steps);
 
-    // Parse response
-    if (parse_http_response(response, &status_code, response_body) != 0) {
-        close(socket_fd);
+    if (result != 0) {
+        fprintf(stderr, "Connection to daemon lost during build\n");
         return -1;
     }
 
-    close(socket_fd);
-
-    if (status_code == 200) {
-        print_containers_json(response_body);
+    if (status_code == 200 && render.completed && !render.failed) {
+        printf("Image built successfully\n");
         return 0;
     } else {
-        fprintf(stderr, "Failed to list containers: %s\n", response_body);
+        fprintf(stderr, "Failed to build image%s%s\n", response_body[0] ? ": " : "", response_body);
         return -1;
     }
 }
 
-int docker_ps() {
-    return docker_containers();
-}
-
 int docker_stop(const char* container_id) {
     int socket_fd;
     char url[512];
@@ -348,6 +832,41 @@ int docker_stop(const char* container_id) {
     }
 }
 
+int docker_wait(const char* container_id) {
+    int socket_fd;
+    char url[512];
+    char response[MAX_RESPONSE_SIZE];
+    char response_body[MAX_RESPONSE_SIZE];
+    int status_code;
+
+    socket_fd = connect_to_daemon(DEFAULT_DAEMON_HOST, DEFAULT_DAEMON_PORT);
+    if (socket_fd < 0) {
+        fprintf(stderr, "Failed to connect to daemon\n");
+        return -1;
+    }
+
+    // The daemon answers only once the container has exited
+    snprintf(url, sizeof(url), "/containers/%s/wait", container_id);
+    if (send_request_to_daemon(socket_fd, "POST", url, NULL) != 0 ||
+        receive_response_from_daemon(socket_fd, response, sizeof(response)) < 0 ||
+        parse_http_response(response, &status_code, response_body) != 0) {
+        close(socket_fd);
+        return -1;
+    }
+    close(socket_fd);
+
+    if (status_code != 200) {
+        fprintf(stderr, "Failed to wait for container: %s\n", response_body);
+        return -1;
+    }
+
+    json_value_t reply;
+
+    parse_reply(response_body, &reply);
+    printf("%.0f\n", field_number(&reply, "StatusCode"));
+    return 0;
+}
+
 int docker_rm(const char* container_id) {
     int socket_fd;
     char url[512];
@@ -450,244 +969,873 @@ int docker_rmi(const char* image_name) {
     }
 }
 
-int docker_logs(const char* container_id) {
-    if (!container_id) {
-        fprintf(stderr, "Container ID required\n");
+// Pull and push answer with one JSON object once every blob has moved
+static int registry_command(const char* url, const char* verb) {
+    int socket_fd;
+    char response[MAX_RESPONSE_SIZE];
+    char response_body[MAX_RESPONSE_SIZE];
+    char status[512];
+    char transferred[32], resumed[32];
+    int status_code;
+
+    socket_fd = connect_to_daemon(DEFAULT_DAEMON_HOST, DEFAULT_DAEMON_PORT);
+    if (socket_fd < 0) {
+        fprintf(stderr, "Failed to connect to daemon\n");
         return -1;
     }
 
-    printf("Logs for container %s:\n", container_id);
-    printf("(Logs functionality not yet implemented)\n");
-    return 0;
-}
+    if (send_request_to_daemon(socket_fd, "POST", url, NULL) != 0 ||
+        receive_response_from_daemon(socket_fd, response, sizeof(response)) < 0 ||
+        parse_http_response(response, &status_code, response_body) != 0) {
+        close(socket_fd);
+        return -1;
+    }
+    close(socket_fd);
 
-int docker_exec(const char* container_id, const char* command) {
-    if (!container_id || !command) {
-        fprintf(stderr, "Container ID and command required\n");
+    if (status_code != 200) {
+        fprintf(stderr, "Failed to %s image: %s\n", verb, response_body);
         return -1;
     }
 
-    printf("Executing '%s' in container %s\n", command, container_id);
-    printf("(Exec functionality not yet implemented)\n");
+    json_value_t reply;
+
+    parse_reply(response_body, &reply);
+    field_string(&reply, "status", status, sizeof(status));
+    format_bytes((long long)field_number(&reply, "bytes_transferred"), transferred, sizeof(transferred));
+    format_bytes((long long)field_number(&reply, "bytes_resumed"), resumed, sizeof(resumed));
+    printf("%s\n", status);
+    printf("%.0f blob(s) transferred (%s, %s resumed), %.0f already present\n",
+           field_number(&reply, "blobs_transferred"), transferred, resumed,
+           field_number(&reply, "blobs_skipped"));
+    if (field_number(&reply, "layers_lazy") > 0) {
+        printf("%.0f layer(s) will be fetched on demand\n", field_number(&reply, "layers_lazy"));
+    }
     return 0;
 }
 
-int docker_commit(const char* container_id, const char* image_name, const char* message) {
-    if (!container_id || !image_name) {
-        fprintf(stderr, "Container ID and image name required\n");
+int docker_pull(const char* image_ref, int lazy) {
+    char url[1024];
+
+    if (!image_ref || !image_ref[0]) {
+        fprintf(stderr, "Image reference required\n");
         return -1;
     }
 
-    printf("Committing container %s to image %s\n", container_id, image_name);
-    if (message) {
-        printf("Message: %s\n", message);
+    snprintf(url, sizeof(url), "/images/create?fromImage=%s%s", image_ref, lazy ? "&lazy=1" : "");
+    return registry_command(url, "pull");
+}
+
+int docker_push(const char* image_ref) {
+    char url[1024];
+
+    if (!image_ref || !image_ref[0]) {
+        fprintf(stderr, "Image reference required\n");
+        return -1;
     }
-    printf("(Commit functionality not yet implemented)\n");
-    return 0;
+
+    snprintf(url, sizeof(url), "/images/%s/push", image_ref);
+    return registry_command(url, "push");
 }
 
-int docker_version() {
+int docker_system_prune(int force) {
     int socket_fd;
     char response[MAX_RESPONSE_SIZE];
-    int status_code;
     char response_body[MAX_RESPONSE_SIZE];
+    char reclaimed[32];
+    char answer[16];
+    int status_code;
+
+    if (!force) {
+        printf("WARNING! This will remove:\n");
+        printf("  - all stopped containers\n");
+        printf("  - all layers and chunks not used by an image or container\n\n");
+        printf("Are you sure you want to continue? [y/N] ");
+        fflush(stdout);
+        if (!fgets(answer, sizeof(answer), stdin) || (answer[0] != 'y' && answer[0] != 'Y')) {
+            return 0;
+        }
+    }
 
-    // Connect to daemon
     socket_fd = connect_to_daemon(DEFAULT_DAEMON_HOST, DEFAULT_DAEMON_PORT);
     if (socket_fd < 0) {
         fprintf(stderr, "Failed to connect to daemon\n");
         return -1;
     }
 
-    // Send request
-    if (send_request_to_daemon(socket_fd, "GET", "/version", NULL) != 0) {
-        close(socket_fd);
-        return -1;
-    }
-
-    // Receive response
-    if (receive_response_from_daemon(socket_fd, response, sizeof(response)) < 0) {
+    if (send_request_to_daemon(socket_fd, "POST", "/system/prune", NULL) != 0 ||
+        receive_response_from_daemon(socket_fd, response, sizeof(response)) < 0 ||
+        parse_http_response(response, &status_code, response_body) != 0) {
         close(socket_fd);
         return -1;
     }
+    close(socket_fd);
 
-    // Parse response
-    if (parse_http_response(response, &status_code, response_body) != 0) {
-        close(socket_fd);
+    if (status_code != 200) {
+        fprintf(stderr, "Failed to prune: %s\n", response_body);
         return -1;
     }
 
-    close(socket_fd);
+    json_value_t reply;
 
-    if (status_code == 200) {
-        printf("Docker version information:\n%s\n", response_body);
-        return 0;
-    } else {
-        fprintf(stderr, "Failed to get version: %s\n", response_body);
-        return -1;
-    }
+    parse_reply(response_body, &reply);
+    format_bytes((long long)field_number(&reply, "space_reclaimed"), reclaimed, sizeof(reclaimed));
+    printf("Deleted %.0f container(s), %.0f layer(s), %.0f chunk(s)\n",
+           field_number(&reply, "containers_deleted"),
+           field_number(&reply, "layers_deleted"),
+           field_number(&reply, "chunks_deleted"));
+    printf("Total reclaimed space: %s\n", reclaimed);
+    return 0;
 }
 
-int docker_info() {
+int docker_squash(const char* image_ref, int from, int to, const char* target_ref) {
     int socket_fd;
+    char url[1024];
     char response[MAX_RESPONSE_SIZE];
-    int status_code;
     char response_body[MAX_RESPONSE_SIZE];
+    char image_id[128], layer_id[128];
+    char size[32];
+    int status_code;
+
+    snprintf(url, sizeof(url), "/images/%s/squash?from=%d&to=%d%s%s", image_ref, from, to,
+             target_ref && target_ref[0] ? "&tag=" : "", target_ref ? target_ref : "");
 
-    // Connect to daemon
     socket_fd = connect_to_daemon(DEFAULT_DAEMON_HOST, DEFAULT_DAEMON_PORT);
     if (socket_fd < 0) {
         fprintf(stderr, "Failed to connect to daemon\n");
         return -1;
     }
 
-    // Send request
-    if (send_request_to_daemon(socket_fd, "GET", "/info", NULL) != 0) {
+    if (send_request_to_daemon(socket_fd, "POST", url, NULL) != 0 ||
+        receive_response_from_daemon(socket_fd, response, sizeof(response)) < 0 ||
+        parse_http_response(response, &status_code, response_body) != 0) {
         close(socket_fd);
         return -1;
     }
+    close(socket_fd);
 
-    // Receive response
-    if (receive_response_from_daemon(socket_fd, response, sizeof(response)) < 0) {
-        close(socket_fd);
+    if (status_code != 200) {
+        fprintf(stderr, "Failed to squash image: %s\n", response_body);
         return -1;
     }
 
-    // Parse response
-    if (parse_http_response(response, &status_code, response_body) != 0) {
+    json_value_t reply;
+
+    parse_reply(response_body, &reply);
+    field_string(&reply, "id", image_id, sizeof(image_id));
+    field_string(&reply, "layer", layer_id, sizeof(layer_id));
+    format_bytes((long long)field_number(&reply, "layer_size"), size, sizeof(size));
+    printf("Squashed into %s (layer %s, %s)\n", image_id, layer_id, size);
+    printf("%.0f entries kept, %.0f shadowed or whited out\n",
+           field_number(&reply, "entries_written"),
+           field_number(&reply, "entries_dropped"));
+    printf("Lookup depth: %.0f -> %.0f layers for a missing path, %.1f -> %.1f on average for the squashed paths\n",
+           field_number(&reply, "layers_before"), field_number(&reply, "layers_after"),
+           field_number(&reply, "depth_before"), field_number(&reply, "depth_after"));
+    return 0;
+}
+
+int docker_logs(const char* container_id) {
+    if (!container_id) {
+        fprintf(stderr, "Container ID required\n");
+        return -1;
+    }
+
+    printf("Logs for container %s:\n", container_id);
+    printf("(Logs functionality not yet implemented)\n");
+    return 0;
+}
+
+int docker_exec(const char* container_id, const char* command) {
+    if (!container_id || !command) {
+        fprintf(stderr, "Container ID and command required\n");
+        return -1;
+    }
+
+    printf("Executing '%s' in container %s\n", command, container_id);
+    printf("(Exec functionality not yet implemented)\n");
+    return 0;
+}
+
+static void render_event(const char* line, void* user_data) {
+    char type[32], action[32], id[128], name[256], image[256], exit_code[16], stamp[32];
+    json_value_t reply, actor, attributes, value;
+    long long time_nano = 0;
+    time_t seconds;
+    struct tm tm;
+
+    (void)user_data;
+    parse_reply(line, &reply);
+    field_string(&reply, "Type", type, sizeof(type));
+    field_string(&reply, "Action", action, sizeof(action));
+
+    if (strcmp(type, "events") == 0 && strcmp(action, "dropped") == 0) {
+        fprintf(stderr, "Warning: %.0f events were dropped, the client fell behind\n",
+                field_number(&reply, "count"));
+        return;
+    }
+
+    // Actor and its Attributes come before the times
+    field_object(&reply, "Actor", &actor);
+    field_string(&actor, "ID", id, sizeof(id));
+    field_object(&actor, "Attributes", &attributes);
+    field_string(&attributes, "name", name, sizeof(name));
+    field_string(&attributes, "image", image, sizeof(image));
+    field_string(&attributes, "exitCode", exit_code, sizeof(exit_code));
+    if (json_get(&reply, "timeNano", &value) == 0) {
+        json_number_ll(&value, &time_nano);
+    }
+    seconds = (time_t)(time_nano / 1000000000LL);
+
+    gmtime_r(&seconds, &tm);
+    strftime(stamp, sizeof(stamp), "%Y-%m-%dT%H:%M:%S", &tm);
+    printf("%s.%09lldZ %s %s %s (", stamp, time_nano % 1000000000LL, type, action, id);
+    if (image[0]) {
+        printf("image=%s, ", image);
+    }
+    printf("name=%s", name);
+    if (exit_code[0]) {
+        printf(", exitCode=%s", exit_code);
+    }
+    printf(")\n");
+    fflush(stdout);
+}
+
+// Turns key=value;key=value into the daemon's {"key":["value",...]} form
+static void build_filters(const char* filters, const char** keys, char* json, int size) {
+    int len = snprintf(json, size, "{");
+
+    for (int k = 0; keys[k]; k++) {
+        size_t key_len = strlen(keys[k]);
+        int values = 0;
+
+        for (const char *p = filters; *p; p += strcspn(p, ";"), p += *p == ';') {
+            int value_len = (int)(strcspn(p, ";") - key_len - 1);
+
+            if (strncmp(p, keys[k], key_len) != 0 || p[key_len] != '=' || len >= size) {
+                continue;
+            }
+            if (values == 0) {
+                len += snprintf(json + len, size - len, "%s\"%s\":[", len > 1 ? "," : "", keys[k]);
+            }
+            if (len < size) {
+                len += snprintf(json + len, size - len, "%s\"%.*s\"", values ? "," : "", value_len, p + key_len + 1);
+            }
+            values++;
+        }
+        if (values && len < size) {
+            len += snprintf(json + len, size - len, "]");
+        }
+    }
+    if (len < size) {
+        snprintf(json + len, size - len, "}");
+    }
+}
+
+// ----------------------------------------------------------------------------
+// Listing
+// ----------------------------------------------------------------------------
+
+typedef struct {
+    int rows;
+    char last_key[512];                 // the cursor for the page after this one
+} list_render_t;
+
+// An entry of a listing; entries but the last carry the array's comma
+static int parse_list_entry(const char* line, json_value_t* entry) {
+    size_t len = strlen(line);
+
+    if (line[0] != '{') {
+        return -1;
+    }
+    if (len > 0 && line[len - 1] == ',') {
+        len--;
+    }
+    return json_parse(line, len, entry) == 0 && entry->type == JSON_OBJECT ? 0 : -1;
+}
+
+// The first string of an array member, as in "Names":["x"]
+static void first_array_string(json_value_t* entry, const char* key, char* out, int size) {
+    json_value_t array, element;
+    json_iter_t it;
+
+    out[0] = '\0';
+    if (json_get(entry, key, &array) == 0 && json_iter_init(&array, &it) == 0 &&
+        json_iter_next(&it, NULL, &element) > 0) {
+        json_string_copy(&element, out, size);
+    }
+}
+
+static void format_created(long long created, char* out, int size) {
+    time_t seconds = (time_t)created;
+    struct tm tm;
+
+    if (created <= 0) {
+        snprintf(out, size, "-");
+        return;
+    }
+    localtime_r(&seconds, &tm);
+    strftime(out, size, "%Y-%m-%d %H:%M", &tm);
+}
+
+static void render_container_row(const char* line, void* user_data) {
+    list_render_t *render = user_data;
+    char id[128], name[256], image[256], command[256], status[64], created_text[32];
+    json_value_t entry;
+    long long created = 0;
+
+    // The array's brackets come on lines of their own
+    if (parse_list_entry(line, &entry) != 0) {
+        return;
+    }
+    json_get_string(&entry, "Id", id, sizeof(id));
+    first_array_string(&entry, "Names", name, sizeof(name));
+    json_get_string(&entry, "Image", image, sizeof(image));
+    json_get_string(&entry, "Command", command, sizeof(command));
+    json_get_string(&entry, "Status", status, sizeof(status));
+    json_get_ll(&entry, "Created", &created);
+    format_created(created, created_text, sizeof(created_text));
+
+    printf("%-12.12s  %-20.20s  %-20.20s  %-24.24s  %-16s  %s\n", id, image, command, name, created_text, status);
+    snprintf(render->last_key, sizeof(render->last_key), "%s", id);
+    render->rows++;
+}
+
+static void render_image_row(const char* line, void* user_data) {
+    list_render_t *render = user_data;
+    char id[128], reference[512], created_text[32], size_text[32];
+    const char *hex = id;
+    json_value_t entry;
+    long long created = 0, size = 0;
+    char *colon;
+
+    if (parse_list_entry(line, &entry) != 0) {
+        return;
+    }
+    json_get_string(&entry, "Id", id, sizeof(id));
+    first_array_string(&entry, "RepoTags", reference, sizeof(reference));
+    json_get_ll(&entry, "Created", &created);
+    json_get_ll(&entry, "Size", &size);
+    format_created(created, created_text, sizeof(created_text));
+    format_bytes(size, size_text, sizeof(size_text));
+    snprintf(render->last_key, sizeof(render->last_key), "%s", reference);
+    render->rows++;
+
+    if (strncmp(hex, "sha256:", 7) == 0) {
+        hex += 7;
+    }
+    colon = strrchr(reference, ':');
+    if (colon) {
+        *colon = '\0';
+    }
+    printf("%-30.30s  %-16.16s  %-12.12s  %-16s  %s\n", reference, colon ? colon + 1 : "", hex, created_text,
+           size_text);
+}
+
+// GETs a listing endpoint with the filters, page and fields given and
+// renders each entry as it arrives
+static int list_from_daemon(const char* path, const char* fields, const char* filters, const char** keys,
+                            int limit, const char* cursor, stream_line_fn render_row, const char* what) {
+    int socket_fd;
+    char url[2048];
+    char filters_json[1024];
+    char encoded[1536];
+    char error_body[MAX_RESPONSE_SIZE];
+    list_render_t render;
+    int status_code;
+    int len;
+
+    len = snprintf(url, sizeof(url), "%s?fields=%s", path, fields);
+    if (filters && filters[0]) {
+        build_filters(filters, keys, filters_json, sizeof(filters_json));
+        encode_query_value(filters_json, encoded, sizeof(encoded));
+        len += snprintf(url + len, sizeof(url) - len, "&filters=%s", encoded);
+    }
+    if (limit > 0) {
+        len += snprintf(url + len, sizeof(url) - len, "&limit=%d", limit);
+    }
+    if (cursor && cursor[0]) {
+        encode_query_value(cursor, encoded, sizeof(encoded));
+        snprintf(url + len, sizeof(url) - len, "&cursor=%s", encoded);
+    }
+
+    socket_fd = connect_to_daemon(DEFAULT_DAEMON_HOST, DEFAULT_DAEMON_PORT);
+    if (socket_fd < 0) {
+        fprintf(stderr, "Failed to connect to daemon\n");
+        return -1;
+    }
+
+    if (send_request_to_daemon(socket_fd, "GET", url, NULL) != 0) {
         close(socket_fd);
         return -1;
     }
 
+    memset(&render, 0, sizeof(render));
+    error_body[0] = '\0';
+    int result = receive_streamed_response(socket_fd, &status_code, render_row, &render,
+                                           error_body, sizeof(error_body));
     close(socket_fd);
 
-    if (status_code == 200) {
-        printf("Docker system information:\n%s\n", response_body);
-        return 0;
-    } else {
-        fprintf(stderr, "Failed to get info: %s\n", response_body);
+    if (result != 0) {
+        fprintf(stderr, "Lost connection to daemon\n");
+        return -1;
+    }
+    if (status_code != 200) {
+        fprintf(stderr, "Failed to list %s: %s\n", what, error_body);
         return -1;
     }
+    if (limit > 0 && render.rows == limit) {
+        fflush(stdout);
+        fprintf(stderr, "More may follow: --cursor %s\n", render.last_key);
+    }
+    return 0;
 }
 
-void print_containers_json(const char* json) {
-    printf("CONTAINER ID    IMAGE    COMMAND    CREATED    STATUS\n");
-    printf("----------------------------------------------------\n");
+int docker_images(const char* filters, int limit, const char* cursor) {
+    static const char *keys[] = { "reference", "id", "label", NULL };
 
-    // Simple JSON parsing - in a real implementation, use a proper JSON library
-    char *id_start, *name_start, *image_start, *command_start, *created_start, *status_start;
+    printf("%-30s  %-16s  %-12s  %-16s  %s\n", "REPOSITORY", "TAG", "IMAGE ID", "CREATED", "SIZE");
+    return list_from_daemon("/images/json", "Id,RepoTags,Created,Size", filters, keys, limit, cursor,
+                            render_image_row, "images");
+}
 
-    id_start = strstr(json, "\"Id\":\"");
-    if (id_start) {
-        id_start += 6;
-        char *id_end = strchr(id_start, '"');
-        if (id_end) {
-            printf("%.*s    ", (int)(id_end - id_start), id_start);
-        }
+int docker_containers(const char* filters, int limit, const char* cursor) {
+    static const char *keys[] = { "status", "name", "id", "image", "label", NULL };
+
+    printf("%-12s  %-20s  %-20s  %-24s  %-16s  %s\n", "CONTAINER ID", "IMAGE", "COMMAND", "NAMES", "CREATED",
+           "STATUS");
+    return list_from_daemon("/containers/json", "Id,Names,Image,Command,Created,Status", filters, keys, limit,
+                            cursor, render_container_row, "containers");
+}
+
+int docker_ps(const char* filters, int limit, const char* cursor) {
+    return docker_containers(filters, limit, cursor);
+}
+
+int docker_events(const char* since, const char* filters) {
+    int socket_fd;
+    char url[2048];
+    char filters_json[1024];
+    char encoded[1536];
+    char error_body[MAX_RESPONSE_SIZE];
+    int status_code;
+    int len;
+
+    len = snprintf(url, sizeof(url), "/events");
+    if (since && since[0]) {
+        len += snprintf(url + len, sizeof(url) - len, "?since=%s", since);
+    }
+    if (filters && filters[0]) {
+        static const char *keys[] = { "type", "event", "container", "image", NULL };
+        build_filters(filters, keys, filters_json, sizeof(filters_json));
+        encode_query_value(filters_json, encoded, sizeof(encoded));
+        snprintf(url + len, sizeof(url) - len, "%cfilters=%s", strchr(url, '?') ? '&' : '?', encoded);
     }
 
-    name_start = strstr(json, "\"Names\":[\"");
-    if (name_start) {
-        name_start += 11;
-        char *name_end = strchr(name_start, '"');
-        if (name_end) {
-            printf("%.*s    ", (int)(name_end - name_start), name_start);
-        }
+    socket_fd = connect_to_daemon(DEFAULT_DAEMON_HOST, DEFAULT_DAEMON_PORT);
+    if (socket_fd < 0) {
+        fprintf(stderr, "Failed to connect to daemon\n");
+        return -1;
     }
 
-    image_start = strstr(json, "\"Image\":\"");
-    if (image_start) {
-        image_start += 9;
-        char *image_end = strchr(image_start, '"');
-        if (image_end) {
-            printf("%.*s    ", (int)(image_end - image_start), image_start);
-        }
+    if (send_request_to_daemon(socket_fd, "GET", url, NULL) != 0) {
+        close(socket_fd);
+        return -1;
     }
 
-    command_start = strstr(json, "\"Command\":\"");
-    if (command_start) {
-        command_start += 11;
-        char *command_end = strchr(command_start, '"');
-        if (command_end) {
-            printf("%.*s    ", (int)(command_end - command_start), command_start);
-        }
+    // Runs until the daemon goes away or the user interrupts
+    error_body[0] = '\0';
+    int result = receive_streamed_response(socket_fd, &status_code, render_event, NULL,
+                                           error_body, sizeof(error_body));
+    close(socket_fd);
+
+    if (result != 0) {
+        fprintf(stderr, "Connection to daemon lost\n");
+        return -1;
+    }
+    if (status_code != 200) {
+        fprintf(stderr, "Failed to stream events%s%s\n", error_body[0] ? ": " : "", error_body);
+        return -1;
     }
+    return 0;
+}
 
-    created_start = strstr(json, "\"Created\":");
-    if (created_start) {
-        created_start += 10;
-        char *created_end = strchr(created_start, ',');
-        if (!created_end) created_end = strchr(created_start, '}');
-        if (created_end) {
-            printf("%.*s    ", (int)(created_end - created_start), created_start);
+typedef struct {
+    const char *verb;
+    int total;
+    int failed;
+    double duration_ms;
+} batch_render_t;
+
+static void render_batch_result(const char* line, void* user_data) {
+    batch_render_t *render = user_data;
+    char event[16], id[128];
+    json_value_t reply, value;
+    int ok = 0;
+
+    parse_reply(line, &reply);
+    field_string(&reply, "event", event, sizeof(event));
+    if (strcmp(event, "result") == 0) {
+        field_string(&reply, "id", id, sizeof(id));
+        if (json_get(&reply, "ok", &value) == 0) {
+            json_bool(&value, &ok);
+        }
+        if (ok) {
+            printf("%s\n", id);
+        } else {
+            fprintf(stderr, "Error: Failed to %s container %s\n", render->verb, id);
         }
+        fflush(stdout);
+    } else if (strcmp(event, "done") == 0) {
+        render->total = (int)field_number(&reply, "total");
+        render->failed = (int)field_number(&reply, "failed");
+        render->duration_ms = field_number(&reply, "duration_ms");
+    }
+}
+
+// stop, rm or kill over the listed containers, or the ones the filters (or
+// all) pick, carried out by the daemon in parallel over one connection
+int docker_batch(const char* action, const char** containers, int count, const char* filters, int all,
+                 int parallel) {
+    static const char *keys[] = { "status", "name", "id", "image", NULL };
+    char header[MAX_REQUEST_SIZE];
+    char filters_json[1024];
+    char response_body[MAX_RESPONSE_SIZE];
+    batch_render_t render;
+    size_t capacity = 256 + sizeof(filters_json), len;
+    int status_code;
+    char *body;
+
+    for (int i = 0; i < count; i++) {
+        capacity += strlen(containers[i]) + 3;
+    }
+    body = malloc(capacity);
+    if (!body) {
+        perror("malloc");
+        return -1;
     }
 
-    status_start = strstr(json, "\"Status\":\"");
-    if (status_start) {
-        status_start += 10;
-        char *status_end = strchr(status_start, '"');
-        if (status_end) {
-            printf("%.*s\n", (int)(status_end - status_start), status_start);
+    len = snprintf(body, capacity, "{\"action\":\"%s\"", action);
+    if (parallel > 0) {
+        len += snprintf(body + len, capacity - len, ",\"parallel\":%d", parallel);
+    }
+    if (count > 0) {
+        len += snprintf(body + len, capacity - len, ",\"containers\":[");
+        for (int i = 0; i < count; i++) {
+            len += snprintf(body + len, capacity - len, "%s\"%s\"", i ? "," : "", containers[i]);
         }
+        len += snprintf(body + len, capacity - len, "]");
+    } else {
+        build_filters(filters, keys, filters_json, sizeof(filters_json));
+        len += snprintf(body + len, capacity - len, ",\"filters\":%s%s", filters_json, all ? ",\"all\":true" : "");
+    }
+    len += snprintf(body + len, capacity - len, "}");
+
+    int socket_fd = connect_to_daemon(DEFAULT_DAEMON_HOST, DEFAULT_DAEMON_PORT);
+    if (socket_fd < 0) {
+        fprintf(stderr, "Failed to connect to daemon\n");
+        free(body);
+        return -1;
+    }
+
+    int header_len = snprintf(header, sizeof(header),
+                              "POST /containers/batch HTTP/1.1\r\n"
+                              "Host: localhost\r\n"
+                              "Content-Type: application/json\r\n"
+                              "Content-Length: %zu\r\n"
+                              "Connection: close\r\n"
+                              "\r\n",
+                              len);
+    if (write_all(socket_fd, header, header_len) != 0 || write_all(socket_fd, body, len) != 0) {
+        close(socket_fd);
+        free(body);
+        return -1;
+    }
+    free(body);
+
+    memset(&render, 0, sizeof(render));
+    render.verb = action;
+    response_body[0] = '\0';
+    int result = receive_streamed_response(socket_fd, &status_code, render_batch_result, &render,
+                                           response_body, sizeof(response_body));
+    close(socket_fd);
+
+    if (result != 0) {
+        fprintf(stderr, "Connection to daemon lost\n");
+        return -1;
+    }
+    if (status_code != 200) {
+        fprintf(stderr, "Failed to %s containers: %s\n", action, response_body);
+        return -1;
+    }
+    if (render.total == 0) {
+        fprintf(stderr, "No containers matched\n");
+    } else if (render.total > 1 || render.failed > 0) {
+        fprintf(stderr, "%s: %d of %d containers in %.0fms\n", action, render.total - render.failed,
+                render.total, render.duration_ms);
+    }
+    return render.failed == 0 ? 0 : -1;
+}
+
+int docker_commit(const char* container_id, const char* image_name, const char* message, int pause) {
+    int socket_fd;
+    char url[2048];
+    char repo[768], comment[768];
+    char response[MAX_RESPONSE_SIZE];
+    char response_body[MAX_RESPONSE_SIZE];
+    char image_id[128];
+    char size[32];
+    int status_code;
+
+    if (!container_id || !image_name) {
+        fprintf(stderr, "Container ID and image name required\n");
+        return -1;
+    }
+
+    encode_query_value(image_name, repo, sizeof(repo));
+    encode_query_value(message ? message : "", comment, sizeof(comment));
+    snprintf(url, sizeof(url), "/commit?container=%s&repo=%s&comment=%s&pause=%d", container_id, repo, comment, pause);
+
+    socket_fd = connect_to_daemon(DEFAULT_DAEMON_HOST, DEFAULT_DAEMON_PORT);
+    if (socket_fd < 0) {
+        fprintf(stderr, "Failed to connect to daemon\n");
+        return -1;
+    }
+
+    if (send_request_to_daemon(socket_fd, "POST", url, NULL) != 0 ||
+        receive_response_from_daemon(socket_fd, response, sizeof(response)) < 0 ||
+        parse_http_response(response, &status_code, response_body) != 0) {
+        close(socket_fd);
+        return -1;
+    }
+    close(socket_fd);
+
+    if (status_code != 201) {
+        fprintf(stderr, "Failed to commit container: %s\n", response_body);
+        return -1;
     }
+
+    json_value_t reply;
+
+    parse_reply(response_body, &reply);
+    field_string(&reply, "Id", image_id, sizeof(image_id));
+    format_bytes((long long)field_number(&reply, "layer_size"), size, sizeof(size));
+    printf("%s\n", image_id);
+    printf("New layer: %s\n", size);
+    return 0;
 }
 
-void print_images_json(const char* json) {
-    printf("REPOSITORY    TAG    IMAGE ID    CREATED    SIZE\n");
-    printf("------------------------------------------------\n");
+int docker_save(const char* image_name, const char* output_path, const char* compression) {
+    int socket_fd;
+    char url[512];
+    int status_code = 0;
+    char error_body[MAX_RESPONSE_SIZE];
+    int to_stdout = !output_path || output_path[0] == '\0' || strcmp(output_path, "-") == 0;
+    int out_fd;
 
-    // Simple JSON parsing - in a real implementation, use a proper JSON library
-    char *repo_start, *tag_start, *id_start, *created_start, *size_start;
+    if (!image_name) {
+        fprintf(stderr, "Image name required\n");
+        return -1;
+    }
 
-    repo_start = strstr(json, "\"RepoTags\":[\"");
-    if (repo_start) {
-        repo_start += 13;
-        char *repo_end = strchr(repo_start, ':');
-        if (repo_end) {
-            printf("%.*s    ", (int)(repo_end - repo_start), repo_start);
-        }
+    // Connect to daemon
+    socket_fd = connect_to_daemon(DEFAULT_DAEMON_HOST, DEFAULT_DAEMON_PORT);
+    if (socket_fd < 0) {
+        fprintf(stderr, "Failed to connect to daemon\n");
+        return -1;
     }
 
-    tag_start = strstr(json, "\"RepoTags\":[\"");
-    if (tag_start) {
-        tag_start += 13;
-        char *colon = strchr(tag_start, ':');
-        if (colon) {
-            colon++;
-            char *tag_end = strchr(colon, '"');
-            if (tag_end) {
-                printf("%.*s    ", (int)(tag_end - colon), colon);
-            }
-        }
+    out_fd = to_stdout ? STDOUT_FILENO : open(output_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (out_fd < 0) {
+        perror("open");
+        close(socket_fd);
+        return -1;
     }
 
-    id_start = strstr(json, "\"Id\":\"");
-    if (id_start) {
-        id_start += 6;
-        char *id_end = strchr(id_start, '"');
-        if (id_end) {
-            printf("%.*s    ", (int)(id_end - id_start), id_start);
-        }
+    snprintf(url, sizeof(url), "/images/%s/get?compression=%s", image_name,
+             compression && compression[0] ? compression : "none");
+
+    int result = -1;
+    if (send_request_to_daemon(socket_fd, "GET", url, NULL) == 0) {
+        result = receive_streamed_body(socket_fd, &status_code, out_fd, error_body, sizeof(error_body));
+    }
+    close(socket_fd);
+
+    if (result != 0) {
+        fprintf(stderr, "Connection to daemon lost during save\n");
+    } else if (status_code != 200) {
+        fprintf(stderr, "Failed to save image: %s\n", error_body);
+        result = -1;
     }
 
-    created_start = strstr(json, "\"Created\":");
-    if (created_start) {
-        created_start += 10;
-        char *created_end = strchr(created_start, ',');
-        if (!created_end) created_end = strchr(created_start, '}');
-        if (created_end) {
-            printf("%.*s    ", (int)(created_end - created_start), created_start);
+    if (!to_stdout) {
+        if (close(out_fd) != 0) {
+            perror("close");
+            result = -1;
+        }
+        if (result != 0) {
+            unlink(output_path);
         }
     }
+    return result;
+}
+
+int docker_load(const char* input_path) {
+    int socket_fd;
+    char header[MAX_REQUEST_SIZE];
+    char response[MAX_RESPONSE_SIZE];
+    char response_body[MAX_RESPONSE_SIZE];
+    char message[MAX_RESPONSE_SIZE];
+    int status_code;
+    int from_stdin = !input_path || input_path[0] == '\0' || strcmp(input_path, "-") == 0;
+    struct stat st;
+    int in_fd;
 
-    size_start = strstr(json, "\"Size\":");
-    if (size_start) {
-        size_start += 7;
-        char *size_end = strchr(size_start, ',');
-        if (!size_end) size_end = strchr(size_start, '}');
-        if (size_end) {
-            printf("%.*s\n", (int)(size_end - size_start), size_start);
+    in_fd = from_stdin ? STDIN_FILENO : open(input_path, O_RDONLY | O_CLOEXEC);
+    if (in_fd < 0) {
+        perror("open");
+        return -1;
+    }
+
+    // The archive is sent with its length up front, so it has to be a file
+    if (fstat(in_fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+        fprintf(stderr, "Archive must be a regular file (use -i)\n");
+        if (!from_stdin) close(in_fd);
+        return -1;
+    }
+
+    // Connect to daemon
+    socket_fd = connect_to_daemon(DEFAULT_DAEMON_HOST, DEFAULT_DAEMON_PORT);
+    if (socket_fd < 0) {
+        fprintf(stderr, "Failed to connect to daemon\n");
+        if (!from_stdin) close(in_fd);
+        return -1;
+    }
+
+    // A daemon that rejects the archive early closes before we finish sending
+    signal(SIGPIPE, SIG_IGN);
+
+    int len = snprintf(header, sizeof(header),
+                       "POST /images/load HTTP/1.1\r\n"
+                       "Host: localhost\r\n"
+                       "Content-Type: application/x-tar\r\n"
+                       "Content-Length: %lld\r\n"
+                       "Connection: close\r\n"
+                       "\r\n",
+                       (long long)st.st_size);
+
+    if (write_all(socket_fd, header, len) == 0) {
+        off_t offset = 0;
+        while (offset < st.st_size) {
+            ssize_t n = sendfile(socket_fd, in_fd, &offset, st.st_size - offset);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) break;
         }
     }
+    if (!from_stdin) close(in_fd);
+
+    // Receive response
+    if (receive_response_from_daemon(socket_fd, response, sizeof(response)) <= 0 ||
+        parse_http_response(response, &status_code, response_body) != 0) {
+        fprintf(stderr, "Connection to daemon lost during load\n");
+        close(socket_fd);
+        return -1;
+    }
+
+    close(socket_fd);
+
+    if (status_code == 200) {
+        json_value_t reply;
+
+        parse_reply(response_body, &reply);
+        field_string(&reply, "stream", message, sizeof(message));
+        printf("%s", message);
+        return 0;
+    } else {
+        fprintf(stderr, "Failed to load image: %s\n", response_body);
+        return -1;
+    }
+}
+
+int docker_version() {
+    int socket_fd;
+    char response[MAX_RESPONSE_SIZE];
+    int status_code;
+    char response_body[MAX_RESPONSE_SIZE];
+
+    // Connect to daemon
+    socket_fd = connect_to_daemon(DEFAULT_DAEMON_HOST, DEFAULT_DAEMON_PORT);
+    if (socket_fd < 0) {
+        fprintf(stderr, "Failed to connect to daemon\n");
+        return -1;
+    }
+
+    // Send request
+    if (send_request_to_daemon(socket_fd, "GET", "/version", NULL) != 0) {
+        close(socket_fd);
+        return -1;
+    }
+
+    // Receive response
+    if (receive_response_from_daemon(socket_fd, response, sizeof(response)) < 0) {
+        close(socket_fd);
+        return -1;
+    }
+
+    // Parse response
+    if (parse_http_response(response, &status_code, response_body) != 0) {
+        close(socket_fd);
+        return -1;
+    }
+
+    close(socket_fd);
+
+    if (status_code == 200) {
+        printf("Docker version information:\n%s\n", response_body);
+        return 0;
+    } else {
+        fprintf(stderr, "Failed to get version: %s\n", response_body);
+        return -1;
+    }
+}
+
+int docker_info() {
+    int socket_fd;
+    char response[MAX_RESPONSE_SIZE];
+    int status_code;
+    char response_body[MAX_RESPONSE_SIZE];
+
+    // Connect to daemon
+    socket_fd = connect_to_daemon(DEFAULT_DAEMON_HOST, DEFAULT_DAEMON_PORT);
+    if (socket_fd < 0) {
+        fprintf(stderr, "Failed to connect to daemon\n");
+        return -1;
+    }
+
+    // Send request
+    if (send_request_to_daemon(socket_fd, "GET", "/info", NULL) != 0) {
+        close(socket_fd);
+        return -1;
+    }
+
+    // Receive response
+    if (receive_response_from_daemon(socket_fd, response, sizeof(response)) < 0) {
+        close(socket_fd);
+        return -1;
+    }
+
+    // Parse response
+    if (parse_http_response(response, &status_code, response_body) != 0) {
+        close(socket_fd);
+        return -1;
+    }
+
+    close(socket_fd);
+
+    if (status_code == 200) {
+        printf("Docker system information:\n%s\n", response_body);
+        return 0;
+    } else {
+        fprintf(stderr, "Failed to get info: %s\n", response_body);
+        return -1;
+    }
 }
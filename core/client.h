@@ -11,12 +11,15 @@
 #include <errno.h>
 
 #include "config.h"
+#include "json.h"
 
 #define MAX_RESPONSE_SIZE 8192
 #define MAX_REQUEST_SIZE 4096
 #define DEFAULT_DAEMON_PORT DOCKERD_PORT
 #define DEFAULT_DAEMON_HOST DOCKERD_HOST
 
+typedef void (*stream_line_fn)(const char* line, void* user_data);
+
 // Function declarations
 int connect_to_daemon(const char* host, int port);
 int send_request_to_daemon(int socket, const char* method, const char* url, const char* body);
@@ -25,24 +28,36 @@ int docker_run(const char* image, const char* command, const char* name,
                const char* working_dir, const char* env_vars, 
                const char* port_mappings, const char* volume_mappings,
                int interactive, int tty, int detach);
-int docker_build(const char* image_name, const char* dockerfile_path, const char* context_path);
-int docker_images();
-int docker_containers();
-int docker_ps();
+int docker_build(const char* image_name, const char* dockerfile_path, const char* context_path,
+                 long long memory_limit, long cpu_quota, long cpu_period, const char* compression);
+int docker_images(const char* filters, int limit, const char* cursor);
+int docker_containers(const char* filters, int limit, const char* cursor);
+int docker_ps(const char* filters, int limit, const char* cursor);
 int docker_stop(const char* container_id);
+int docker_wait(const char* container_id);
 int docker_rm(const char* container_id);
+int docker_batch(const char* action, const char** containers, int count, const char* filters, int all,
+                 int parallel);
 int docker_rmi(const char* image_name);
 int docker_logs(const char* container_id);
 int docker_exec(const char* container_id, const char* command);
-int docker_commit(const char* container_id, const char* image_name, const char* message);
+int docker_commit(const char* container_id, const char* image_name, const char* message, int pause);
+int docker_save(const char* image_name, const char* output_path, const char* compression);
+int docker_load(const char* input_path);
+int docker_pull(const char* image_ref, int lazy);
+int docker_push(const char* image_ref);
+int docker_system_prune(int force);
+int docker_squash(const char* image_ref, int from, int to, const char* target_ref);
+int docker_events(const char* since, const char* filters);
 int docker_version();
 int docker_info();
 
 // Helper functions
 int create_http_request(char* request, const char* method, const char* url, const char* body);
 int parse_http_response(const char* response, int* status_code, char* body);
-void print_containers_json(const char* json);
-void print_images_json(const char* json);
+int receive_streamed_response(int socket, int* status_code, stream_line_fn on_line, void* user_data,
+                              char* error_body, int error_size);
+int receive_streamed_body(int socket, int* status_code, int out_fd, char* error_body, int error_size);
 
 #endif // CLIENT_H
 
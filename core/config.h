@@ -4,4 +4,14 @@
 #define DOCKERD_HOST "127.0.0.1"
 #define DOCKERD_PORT 2375
 
+// Builds beyond this many wait in a FIFO queue; MAX_BUILDS_ENV overrides it
+#define DEFAULT_MAX_CONCURRENT_BUILDS 2
+#define MAX_BUILDS_ENV "DOCKER_CLONE_MAX_BUILDS"
+
+// Image references without a registry host resolve against this one;
+// REGISTRY_ENV overrides it
+#define DEFAULT_REGISTRY "localhost:5000"
+#define REGISTRY_ENV "DOCKER_CLONE_REGISTRY"
+#define REGISTRY_MAX_CONNECTIONS 4
+
 #endif
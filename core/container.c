@@ -1,16 +1,40 @@
 #include "container.h"
+#include "image.h"
+#include "lazy.h"
+#include "chunk.h"
+#include "gc.h"
+#include "events.h"
+#include "reaper.h"
+#include "container_index.h"
+#include "container_lock.h"
+#include "id.h"
+#include "json.h"
+#include <sys/sysmacros.h>
+#include <sys/xattr.h>
 #include <syscall.h>
 #include <sched.h>
 #include <linux/sched.h>
 #include <sched.h>
 
 int init_container_system() {
-    if (create_container_directories() != 0) {
+    if (create_container_directories() != 0 || init_container_index() != 0) {
         return -1;
     }
     return 0;
 }
 
+const char* container_state_name(container_state_t state) {
+    switch (state) {
+        case CONTAINER_STATE_CREATED: return "created";
+        case CONTAINER_STATE_RUNNING: return "running";
+        case CONTAINER_STATE_PAUSED: return "paused";
+        case CONTAINER_STATE_RESTARTING: return "restarting";
+        case CONTAINER_STATE_REMOVING: return "removing";
+        case CONTAINER_STATE_EXITED: return "exited";
+        default: return "dead";
+    }
+}
+
 int create_container_directories() {
     char dirs[][MAX_PATH_LEN] = {
         CONTAINER_STORAGE_DIR,
@@ -38,35 +62,51 @@ int create_container_directories() {
     return 0;
 }
 
-char* generate_container_id() {
-    static char id[MAX_CONTAINER_ID_LEN];
-    time_t now = time(NULL);
-    snprintf(id, sizeof(id), "cont_%08x%08x", (unsigned int)now, (unsigned int)(now >> 32));
-    return id;
+// 64 hex digits, as Docker's; any unique prefix of one names the container
+void generate_container_id(char *out, size_t size) {
+    generate_id(out, size);
+}
+
+// Accepts a container id or a unique prefix of one
+int resolve_container_id(const char *container_ref, char *container_id, size_t size) {
+    return container_index_resolve(container_ref, container_id, size);
+}
+
+// Where create_container lays a container out, from its id alone
+void container_dir_path(const char *container_id, char *out, size_t size) {
+    snprintf(out, size, "%s/%s", CONTAINER_STORAGE_DIR, container_id);
 }
 
-char* get_container_full_path(const char *container_id) {
-    static char path[MAX_PATH_LEN];
-    snprintf(path, sizeof(path), "%s/%s", CONTAINER_STORAGE_DIR, container_id);
-    return path;
+void container_rootfs_path(const char *container_id, char *out, size_t size) {
+    snprintf(out, size, "%s/%s/rootfs", CONTAINER_STORAGE_DIR, container_id);
+}
+
+void container_log_path(const char *container_id, char *out, size_t size) {
+    snprintf(out, size, "%s/%s.log", CONTAINER_LOG_DIR, container_id);
+}
+
+void container_metadata_path(const char *container_id, char *out, size_t size) {
+    snprintf(out, size, "%s/%s.json", CONTAINER_METADATA_DIR, container_id);
 }
 
 int container_exists(const char *container_id) {
     char metadata_path[MAX_PATH_LEN];
-    snprintf(metadata_path, sizeof(metadata_path), "%s/%s.json", CONTAINER_METADATA_DIR, container_id);
+    container_metadata_path(container_id, metadata_path, sizeof(metadata_path));
     return access(metadata_path, F_OK) == 0;
 }
 
 int create_container(const char *name, const char *image, const char *command,
                     const char *working_dir, const char *env_vars,
                     const char *port_mappings, const char *volume_mappings,
-                    int interactive, int tty, int detach) {
+                    int interactive, int tty, int detach, char *container_id) {
     container_info_t container;
-    char container_path[MAX_PATH_LEN];
+    char container_path[MAX_PATH_LEN], rootfs_path[MAX_PATH_LEN];
+    trace_span_t span, phase;
 
     // Initialize container structure
+    trace_begin(&span, "create_container");
     memset(&container, 0, sizeof(container));
-    strcpy(container.id, generate_container_id());
+    generate_container_id(container.id, sizeof(container.id));
     strncpy(container.name, name ? name : container.id, sizeof(container.name) - 1);
     strncpy(container.image, image, sizeof(container.image) - 1);
     strncpy(container.command, command ? command : "", sizeof(container.command) - 1);
@@ -81,221 +121,497 @@ int create_container(const char *name, const char *image, const char *command,
     snprintf(container.created, sizeof(container.created), "%ld", time(NULL));
 
     // Create container directory
-    strcpy(container_path, get_container_full_path(container.id));
+    trace_begin(&phase, "create_dirs");
+    container_dir_path(container.id, container_path, sizeof(container_path));
     if (mkdir(container_path, 0755) != 0 && errno != EEXIST) {
         perror("mkdir container");
-        return -1;
+        goto failed;
     }
 
     // Create rootfs directory
-    snprintf(container.rootfs_path, sizeof(container.rootfs_path), "%s/rootfs", container_path);
-    if (mkdir(container.rootfs_path, 0755) != 0 && errno != EEXIST) {
+    container_rootfs_path(container.id, rootfs_path, sizeof(rootfs_path));
+    if (mkdir(rootfs_path, 0755) != 0 && errno != EEXIST) {
         perror("mkdir rootfs");
-        return -1;
+        goto failed;
     }
-
-    // Create log file
-    snprintf(container.log_path, sizeof(container.log_path), "%s/%s.log", CONTAINER_LOG_DIR, container.id);
-
-    // Create config file path
-    snprintf(container.config_path, sizeof(container.config_path), "%s/%s.json", CONTAINER_METADATA_DIR, container.id);
+    trace_end(&phase, NULL);
+
+    // The container holds its image's layers until it is removed
+    char full_name[MAX_IMAGE_NAME_LEN + MAX_IMAGE_TAG_LEN + 2];
+    image_info_t image_info;
+    trace_begin(&phase, "resolve_image");
+    if (resolve_image_name(image, full_name, sizeof(full_name)) == 0 &&
+        read_image_metadata(full_name, &image_info) == 0) {
+        snprintf(container.image_id, sizeof(container.image_id), "%s", image_info.id);
+        gc_ref_container(container.id, &image_info);
+        free(image_info.layers);
+    }
+    trace_end(&phase, image);
 
     // Write metadata
+    trace_begin(&phase, "write_metadata");
     if (write_container_metadata(&container) != 0) {
-        return -1;
+        goto failed;
     }
+    trace_end(&phase, NULL);
 
+    if (container_id) {
+        strcpy(container_id, container.id);
+    }
     printf("Container %s created successfully\n", container.id);
+    publish_event(EVENT_TYPE_CONTAINER, "create", container.id, container.name, container.image, -1);
+    trace_end(&span, container.id);
     return 0;
+
+failed:
+    trace_end(&phase, "failed");
+    trace_end(&span, container.id);
+    return -1;
 }
 
+// Written beside the old file and renamed over it, so a reader never sees
+// half of one. Callers changing an existing container hold its lock.
 int write_container_metadata(container_info_t *container) {
+    char metadata_path[MAX_PATH_LEN], temp_path[MAX_PATH_LEN + 8];
+    char buffer[4096];
+    json_writer_t w;
     FILE *fp;
 
-    fp = fopen(container->config_path, "w");
+    container_metadata_path(container->id, metadata_path, sizeof(metadata_path));
+    snprintf(temp_path, sizeof(temp_path), "%s.tmp", metadata_path);
+    fp = fopen(temp_path, "w");
     if (!fp) {
         perror("fopen container metadata");
         return -1;
     }
 
-    fprintf(fp, "{\n");
-    fprintf(fp, "  \"id\": \"%s\",\n", container->id);
-    fprintf(fp, "  \"name\": \"%s\",\n", container->name);
-    fprintf(fp, "  \"image\": \"%s\",\n", container->image);
-    fprintf(fp, "  \"image_id\": \"%s\",\n", container->image_id);
-    fprintf(fp, "  \"command\": \"%s\",\n", container->command);
-    fprintf(fp, "  \"working_dir\": \"%s\",\n", container->working_dir);
-    fprintf(fp, "  \"user\": \"%s\",\n", container->user);
-    fprintf(fp, "  \"shell\": \"%s\",\n", container->shell);
-    fprintf(fp, "  \"entrypoint\": \"%s\",\n", container->entrypoint);
-    fprintf(fp, "  \"cmd\": \"%s\",\n", container->cmd);
-    fprintf(fp, "  \"env_vars\": \"%s\",\n", container->env_vars);
-    fprintf(fp, "  \"port_mappings\": \"%s\",\n", container->port_mappings);
-    fprintf(fp, "  \"volume_mappings\": \"%s\",\n", container->volume_mappings);
-    fprintf(fp, "  \"network_config\": \"%s\",\n", container->network_config);
-    fprintf(fp, "  \"state\": %d,\n", container->state);
-    fprintf(fp, "  \"pid\": %d,\n", container->pid);
-    fprintf(fp, "  \"created\": \"%s\",\n", container->created);
-    fprintf(fp, "  \"started\": \"%s\",\n", container->started);
-    fprintf(fp, "  \"finished\": \"%s\",\n", container->finished);
-    fprintf(fp, "  \"exit_code\": %d,\n", container->exit_code);
-    fprintf(fp, "  \"log_path\": \"%s\",\n", container->log_path);
-    fprintf(fp, "  \"rootfs_path\": \"%s\",\n", container->rootfs_path);
-    fprintf(fp, "  \"interactive\": %d,\n", container->interactive);
-    fprintf(fp, "  \"tty\": %d,\n", container->tty);
-    fprintf(fp, "  \"detach\": %d,\n", container->detach);
-    fprintf(fp, "  \"restart_policy\": %d,\n", container->restart_policy);
-    fprintf(fp, "  \"memory_limit\": %d,\n", container->memory_limit);
-    fprintf(fp, "  \"cpu_limit\": %d,\n", container->cpu_limit);
-    fprintf(fp, "  \"pid_limit\": %d\n", container->pid_limit);
-    fprintf(fp, "}\n");
+    json_writer_init(&w, buffer, sizeof(buffer), json_flush_file, fp);
+    w.pretty = 1;
+    json_write_object_begin(&w);
+    json_write_key(&w, "id");
+    json_write_string(&w, container->id);
+    json_write_key(&w, "name");
+    json_write_string(&w, container->name);
+    json_write_key(&w, "image");
+    json_write_string(&w, container->image);
+    json_write_key(&w, "image_id");
+    json_write_string(&w, container->image_id);
+    json_write_key(&w, "command");
+    json_write_string(&w, container->command);
+    json_write_key(&w, "working_dir");
+    json_write_string(&w, container->working_dir);
+    json_write_key(&w, "env_vars");
+    json_write_string(&w, container->env_vars);
+    json_write_key(&w, "port_mappings");
+    json_write_string(&w, container->port_mappings);
+    json_write_key(&w, "volume_mappings");
+    json_write_string(&w, container->volume_mappings);
+    json_write_key(&w, "state");
+    json_write_ll(&w, container->state);
+    json_write_key(&w, "pid");
+    json_write_ll(&w, container->pid);
+    json_write_key(&w, "created");
+    json_write_string(&w, container->created);
+    json_write_key(&w, "started");
+    json_write_string(&w, container->started);
+    json_write_key(&w, "finished");
+    json_write_string(&w, container->finished);
+    json_write_key(&w, "exit_code");
+    json_write_ll(&w, container->exit_code);
+    json_write_key(&w, "interactive");
+    json_write_ll(&w, container->interactive);
+    json_write_key(&w, "tty");
+    json_write_ll(&w, container->tty);
+    json_write_key(&w, "detach");
+    json_write_ll(&w, container->detach);
+    json_write_object_end(&w);
+    json_write_raw(&w, "\n", 1);
+
+    if (json_writer_finish(&w) < 0) {
+        fprintf(stderr, "Failed to write container metadata\n");
+        fclose(fp);
+        unlink(temp_path);
+        return -1;
+    }
+    if (fclose(fp) != 0) {
+        perror("fclose container metadata");
+        unlink(temp_path);
+        return -1;
+    }
+    if (rename(temp_path, metadata_path) != 0) {
+        perror("rename container metadata");
+        unlink(temp_path);
+        return -1;
+    }
+    return container_index_put(container);
+}
+
+static int metadata_int(json_value_t *root, const char *key, int *out) {
+    long long value;
 
-    fclose(fp);
+    if (json_get_ll(root, key, &value) != 0) {
+        return -1;
+    }
+    *out = (int)value;
     return 0;
 }
 
 int read_container_metadata(const char *container_id, container_info_t *container) {
     char metadata_path[MAX_PATH_LEN];
+    char buffer[16384];
+    json_value_t root;
+    size_t len;
+    int state = CONTAINER_STATE_CREATED;
     FILE *fp;
-    char line[1024];
 
-    snprintf(metadata_path, sizeof(metadata_path), "%s/%s.json", CONTAINER_METADATA_DIR, container_id);
+    container_metadata_path(container_id, metadata_path, sizeof(metadata_path));
 
     fp = fopen(metadata_path, "r");
     if (!fp) {
         return -1;
     }
+    len = fread(buffer, 1, sizeof(buffer), fp);
+    fclose(fp);
 
-    // Simple JSON parsing
-    while (fgets(line, sizeof(line), fp)) {
-        if (strstr(line, "\"id\"")) {
-            sscanf(line, "  \"id\": \"%[^\"]\"", container->id);
-        } else if (strstr(line, "\"name\"")) {
-            sscanf(line, "  \"name\": \"%[^\"]\"", container->name);
-        } else if (strstr(line, "\"image\"")) {
-            sscanf(line, "  \"image\": \"%[^\"]\"", container->image);
-        } else if (strstr(line, "\"command\"")) {
-            sscanf(line, "  \"command\": \"%[^\"]\"", container->command);
-        } else if (strstr(line, "\"state\"")) {
-            sscanf(line, "  \"state\": %d", &container->state);
-        } else if (strstr(line, "\"pid\"")) {
-            sscanf(line, "  \"pid\": %d", &container->pid);
-        } else if (strstr(line, "\"created\"")) {
-            sscanf(line, "  \"created\": \"%[^\"]\"", container->created);
-        } else if (strstr(line, "\"started\"")) {
-            sscanf(line, "  \"started\": \"%[^\"]\"", container->started);
-        } else if (strstr(line, "\"finished\"")) {
-            sscanf(line, "  \"finished\": \"%[^\"]\"", container->finished);
-        } else if (strstr(line, "\"exit_code\"")) {
-            sscanf(line, "  \"exit_code\": %d", &container->exit_code);
-        }
+    if (len == sizeof(buffer) || json_parse(buffer, len, &root) != 0 || root.type != JSON_OBJECT) {
+        fprintf(stderr, "Malformed container metadata %s\n", metadata_path);
+        return -1;
     }
 
-    fclose(fp);
+    memset(container, 0, sizeof(*container));
+    json_get_string(&root, "id", container->id, sizeof(container->id));
+    json_get_string(&root, "name", container->name, sizeof(container->name));
+    json_get_string(&root, "image", container->image, sizeof(container->image));
+    json_get_string(&root, "image_id", container->image_id, sizeof(container->image_id));
+    json_get_string(&root, "command", container->command, sizeof(container->command));
+    json_get_string(&root, "working_dir", container->working_dir, sizeof(container->working_dir));
+    json_get_string(&root, "env_vars", container->env_vars, sizeof(container->env_vars));
+    json_get_string(&root, "port_mappings", container->port_mappings, sizeof(container->port_mappings));
+    json_get_string(&root, "volume_mappings", container->volume_mappings, sizeof(container->volume_mappings));
+    metadata_int(&root, "state", &state);
+    container->state = (container_state_t)state;
+    metadata_int(&root, "pid", &container->pid);
+    json_get_string(&root, "created", container->created, sizeof(container->created));
+    json_get_string(&root, "started", container->started, sizeof(container->started));
+    json_get_string(&root, "finished", container->finished, sizeof(container->finished));
+    metadata_int(&root, "exit_code", &container->exit_code);
+    metadata_int(&root, "interactive", &container->interactive);
+    metadata_int(&root, "tty", &container->tty);
+    metadata_int(&root, "detach", &container->detach);
     return 0;
 }
 
+// Compressed layers have no tree to use as a lowerdir, so each container
+// unpacks its own copy once
+static int unpack_container_layer(const char *container_path, const char *layer_id, char *path, size_t size) {
+    char layers_path[MAX_PATH_LEN];
+    char staging[MAX_PATH_LEN + 16];
+    char rm_cmd[MAX_PATH_LEN + 32];
+
+    snprintf(layers_path, sizeof(layers_path), "%s/layers", container_path);
+    snprintf(path, size, "%s/%s", layers_path, layer_id);
+    if (access(path, F_OK) == 0) {
+        return 0;
+    }
+
+    snprintf(staging, sizeof(staging), "%s.XXXXXX", path);
+    if ((mkdir(layers_path, 0755) != 0 && errno != EEXIST) || !mkdtemp(staging)) {
+        perror("mkdir container layer");
+        return -1;
+    }
+    if (extract_layer(layer_id, staging) == 0 && rename(staging, path) == 0) {
+        return 0;
+    }
+
+    fprintf(stderr, "Failed to unpack layer %s\n", layer_id);
+    snprintf(rm_cmd, sizeof(rm_cmd), "rm -rf %s", staging);
+    if (system(rm_cmd) != 0) {
+        fprintf(stderr, "Failed to remove %s\n", staging);
+    }
+    return -1;
+}
+
+// Each layer keeps its own metadata (<id>.json and the like) at the top of
+// its tree; whiteouts in the upper layer keep those files out of the root
+static void hide_layer_metadata(const char *upperdir, const char *layer_id) {
+    static const char *const suffixes[] = { ".json", ".diffid", LAZY_STATE_SUFFIX, LAYER_BLOB_SUFFIX,
+                                          CHUNK_LIST_SUFFIX };
+    char path[MAX_PATH_LEN];
+
+    for (size_t i = 0; i < sizeof(suffixes) / sizeof(suffixes[0]); i++) {
+        snprintf(path, sizeof(path), "%s/%s%s", upperdir, layer_id, suffixes[i]);
+        if (mknod(path, S_IFCHR, makedev(0, 0)) != 0 && errno != EEXIST) {
+            perror("mknod whiteout");
+        }
+    }
+}
+
+// Stacks the image's layers under a per-container upper directory. Layers
+// pulled lazily get a watch that fetches their files on first open.
+static int prepare_container_rootfs(container_info_t *container, container_start_t *start, lazy_watch_t **watch) {
+    char full_name[MAX_IMAGE_NAME_LEN + MAX_IMAGE_TAG_LEN + 2];
+    char container_path[MAX_PATH_LEN];
+    const char **layer_ids = NULL;
+    image_info_t image;
+    size_t size, len = 0;
+    int result = -1;
+
+    memset(start, 0, sizeof(*start));
+    start->container = container;
+    start->fanotify_fd = -1;
+    *watch = NULL;
+
+    if (resolve_image_name(container->image, full_name, sizeof(full_name)) != 0 ||
+        read_image_metadata(full_name, &image) != 0) {
+        fprintf(stderr, "No such image: %s\n", container->image);
+        return -1;
+    }
+
+    // The tag may have moved since the container was created
+    gc_ref_container(container->id, &image);
+    if (image.layer_count == 0) {
+        free(image.layers);
+        return 0;
+    }
+
+    container_dir_path(container->id, container_path, sizeof(container_path));
+    if (snprintf(start->upperdir, sizeof(start->upperdir), "%s/upper", container_path) >= (int)sizeof(start->upperdir) ||
+        snprintf(start->workdir, sizeof(start->workdir), "%s/work", container_path) >= (int)sizeof(start->workdir)) {
+        fprintf(stderr, "Container path too long: %s\n", container_path);
+        goto out;
+    }
+    if ((mkdir(start->upperdir, 0755) != 0 && errno != EEXIST) ||
+        (mkdir(start->workdir, 0755) != 0 && errno != EEXIST)) {
+        perror("mkdir overlay");
+        goto out;
+    }
+
+    size = (size_t)image.layer_count * MAX_PATH_LEN;
+    start->lowerdir = malloc(size);
+    layer_ids = calloc(image.layer_count, sizeof(char *));
+    if (!start->lowerdir || !layer_ids) {
+        goto out;
+    }
+
+    // Overlay wants the top layer first
+    for (int i = image.layer_count - 1; i >= 0; i--) {
+        const char *id = image.layers[i].id;
+        char path[MAX_PATH_LEN];
+
+        if (layer_is_compressed(id)) {
+            if (unpack_container_layer(container_path, id, path, sizeof(path)) != 0) {
+                goto out;
+            }
+        } else {
+            snprintf(path, sizeof(path), "%s/%s", LAYER_STORAGE_DIR, id);
+        }
+        len += snprintf(start->lowerdir + len, size - len, "%s%s", len ? ":" : "", path);
+        hide_layer_metadata(start->upperdir, id);
+        layer_ids[i] = id;
+    }
+
+    if (lazy_watch_prepare(layer_ids, image.layer_count, watch) != 0) {
+        goto out;
+    }
+    if (*watch) {
+        start->fanotify_fd = (*watch)->fanotify_fd;
+    }
+    result = 0;
+
+out:
+    if (result != 0) {
+        free(start->lowerdir);
+        start->lowerdir = NULL;
+    }
+    free(layer_ids);
+    free(image.layers);
+    return result;
+}
+
 int start_container(const char *container_id) {
     container_info_t container;
+    container_start_t start;
+    lazy_watch_t *watch;
+    trace_span_t span, phase;
     char *stack;
     pid_t child_pid;
 
+    trace_begin(&span, "start_container");
+    trace_begin(&phase, "read_metadata");
+    container_lock(container_id);
     if (!container_exists(container_id)) {
         fprintf(stderr, "Container %s does not exist\n", container_id);
-        return -1;
+        goto failed;
     }
 
     if (read_container_metadata(container_id, &container) != 0) {
         fprintf(stderr, "Failed to read container metadata\n");
-        return -1;
+        goto failed;
     }
 
     if (container.state == CONTAINER_STATE_RUNNING) {
         fprintf(stderr, "Container %s is already running\n", container_id);
-        return -1;
+        goto failed;
+    }
+    trace_end(&phase, NULL);
+
+    trace_begin(&phase, "prepare_rootfs");
+    if (prepare_container_rootfs(&container, &start, &watch) != 0) {
+        goto failed;
     }
+    trace_end(&phase, container.image);
 
     // Allocate stack for child process
+    trace_begin(&phase, "clone");
     stack = malloc(STACK_SIZE);
     if (!stack) {
         perror("malloc stack");
-        return -1;
+        lazy_watch_abort(watch);
+        free(start.lowerdir);
+        goto failed;
     }
 
     printf("Starting container %s...\n", container_id);
 
     // Create new namespaces and start container
     // provided by sched.h , but even after adding the lib , error persists
+    start.trace = trace_reserve_buffer();
     child_pid = clone(child_main, stack + STACK_SIZE,
-                     CLONE_NEWPID | CLONE_NEWUTS | CLONE_NEWNS | SIGCHLD, &container);
+                     CLONE_NEWPID | CLONE_NEWUTS | CLONE_NEWNS | SIGCHLD, &start);
+    free(start.lowerdir);
 
     if (child_pid == -1) {
         perror("clone");
+        trace_release_buffer(start.trace);
+        lazy_watch_abort(watch);
         free(stack);
-        return -1;
+        goto failed;
+    }
+    trace_end(&phase, NULL);
+
+    // The child already waits on its first open of a pending file
+    if (watch) {
+        trace_begin(&phase, "lazy_watch");
+        if (lazy_watch_start(watch, child_pid) != 0) {
+            kill(child_pid, SIGKILL);
+            waitpid(child_pid, NULL, 0);
+            free(stack);
+            goto failed;
+        }
+        trace_end(&phase, NULL);
     }
 
     // Update container metadata
+    trace_begin(&phase, "write_metadata");
     container.pid = child_pid;
     container.state = CONTAINER_STATE_RUNNING;
     snprintf(container.started, sizeof(container.started), "%ld", time(NULL));
 
     if (write_container_metadata(&container) != 0) {
         kill(child_pid, SIGKILL);
+        waitpid(child_pid, NULL, 0);
         free(stack);
-        return -1;
+        goto failed;
     }
 
-    printf("Container %s started with PID %d\n", container_id, child_pid);
-
-    if (container.detach) {
-        free(stack);
-        return 0;
-    } else {
-        // Wait for container to exit
-        int status;
-        waitpid(child_pid, &status, 0);
-
-        // Update container state
+    // From here on the reaper collects the exit, detached or not
+    if (reaper_track(container.id, child_pid) != 0) {
+        kill(child_pid, SIGKILL);
+        waitpid(child_pid, NULL, 0);
         container.state = CONTAINER_STATE_EXITED;
-        container.exit_code = WEXITSTATUS(status);
-        snprintf(container.finished, sizeof(container.finished), "%ld", time(NULL));
         write_container_metadata(&container);
-
         free(stack);
-        return 0;
+        goto failed;
     }
+    trace_end(&phase, NULL);
+
+    // The reaper takes the lock to record the exit
+    container_unlock(container_id);
+    printf("Container %s started with PID %d\n", container_id, child_pid);
+    publish_event(EVENT_TYPE_CONTAINER, "start", container.id, container.name, container.image, -1);
+
+    if (!container.detach) {
+        trace_begin(&phase, "wait");
+        reaper_wait(container.id, -1);
+        trace_end(&phase, NULL);
+    }
+
+    // The child runs on a copy-on-write copy of the stack, not this one
+    free(stack);
+    trace_end(&span, container_id);
+    return 0;
+
+failed:
+    container_unlock(container_id);
+    trace_end(&phase, "failed");
+    trace_end(&span, container_id);
+    return -1;
 }
 
 int child_main(void *arg) {
-    container_info_t *container = (container_info_t *)arg;
+    container_start_t *start = (container_start_t *)arg;
+    container_info_t *container = start->container;
+    char rootfs_path[MAX_PATH_LEN];
+    trace_span_t span, phase;
+
+    // The parent's ring is still the parent's; spans from here go to the
+    // one reserved for this process
+    trace_adopt_buffer(start->trace);
+    trace_begin(&span, "container_init");
 
     printf("Child process PID (inside container): %d\n", getpid());
 
     // Set hostname
+    trace_begin(&phase, "sethostname");
     if (sethostname(container->name, strlen(container->name)) == -1) {
         perror("sethostname");
     }
+    trace_end(&phase, NULL);
 
     // Setup mount namespace
+    trace_begin(&phase, "mount_rootfs");
     if (mount(NULL, "/", NULL, MS_PRIVATE | MS_REC, NULL) == -1) {
         perror("mount MS_PRIVATE");
     }
 
     // Create new root filesystem
-    if (mount("tmpfs", container->rootfs_path, "tmpfs", 0, NULL) == -1) {
+    container_rootfs_path(container->id, rootfs_path, sizeof(rootfs_path));
+    if (start->lowerdir) {
+        size_t len = strlen(start->lowerdir) + sizeof(start->upperdir) + sizeof(start->workdir) + 64;
+        char *options = malloc(len);
+
+        if (!options) {
+            goto failed;
+        }
+        snprintf(options, len, "lowerdir=%s,upperdir=%s,workdir=%s", start->lowerdir, start->upperdir, start->workdir);
+        if (mount("overlay", rootfs_path, "overlay", 0, options) == -1) {
+            perror("mount overlay");
+            free(options);
+            goto failed;
+        }
+        free(options);
+
+        if (start->fanotify_fd >= 0) {
+            if (lazy_watch_mark(start->fanotify_fd, rootfs_path) != 0) {
+                goto failed;
+            }
+            close(start->fanotify_fd);
+        }
+    } else if (mount("tmpfs", rootfs_path, "tmpfs", 0, NULL) == -1) {
         perror("mount tmpfs");
     }
+    trace_end(&phase, start->lowerdir ? "overlay" : "tmpfs");
 
     // Pivot root
+    trace_begin(&phase, "pivot_root");
     char old_root[256];
-    snprintf(old_root, sizeof(old_root), "%s/old-root", container->rootfs_path);
+    snprintf(old_root, sizeof(old_root), "%s/old-root", rootfs_path);
 
     if (mkdir(old_root, 0755) == -1 && errno != EEXIST) {
         perror("mkdir old-root");
     }
 
-    if (syscall(SYS_pivot_root, container->rootfs_path, old_root) == -1) {
+    if (syscall(SYS_pivot_root, rootfs_path, old_root) == -1) {
         perror("pivot_root");
     }
 
@@ -310,6 +626,11 @@ int child_main(void *arg) {
     if (rmdir("/old-root") == -1) {
         perror("rmdir old-root");
     }
+    trace_end(&phase, NULL);
+
+    // Nothing is recorded past exec; the ring goes back before it
+    trace_end(&span, container->id);
+    trace_release_buffer(start->trace);
 
     // Execute container command
     if (strlen(container->command) > 0) {
@@ -323,24 +644,34 @@ int child_main(void *arg) {
     }
 
     return 0;
+
+failed:
+    trace_end(&phase, "failed");
+    trace_end(&span, container->id);
+    trace_release_buffer(start->trace);
+    return 1;
 }
 
+// Signalled under the container's lock, then waited on without it: the
+// reaper needs it to record the exit
 int stop_container(const char *container_id) {
     container_info_t container;
+    int result = -1;
 
+    container_lock(container_id);
     if (!container_exists(container_id)) {
         fprintf(stderr, "Container %s does not exist\n", container_id);
-        return -1;
+        goto out;
     }
 
     if (read_container_metadata(container_id, &container) != 0) {
         fprintf(stderr, "Failed to read container metadata\n");
-        return -1;
+        goto out;
     }
 
     if (container.state != CONTAINER_STATE_RUNNING) {
         fprintf(stderr, "Container %s is not running\n", container_id);
-        return -1;
+        goto out;
     }
 
     printf("Stopping container %s...\n", container_id);
@@ -348,26 +679,79 @@ int stop_container(const char *container_id) {
     // Send SIGTERM to container process
     if (kill(container.pid, SIGTERM) != 0) {
         perror("kill SIGTERM");
-        return -1;
+        goto out;
     }
+    container_unlock(container_id);
 
-    // Wait for process to exit
-    int status;
-    if (waitpid(container.pid, &status, 0) == -1) {
-        perror("waitpid");
-        return -1;
+    // The reaper records the exit and publishes die
+    if (reaper_wait(container_id, CONTAINER_STOP_TIMEOUT_MS) != 0) {
+        fprintf(stderr, "Container %s ignored SIGTERM, killing it\n", container_id);
+        kill(container.pid, SIGKILL);
+        reaper_wait(container_id, -1);
     }
 
-    // Update container state
-    container.state = CONTAINER_STATE_EXITED;
-    container.exit_code = WEXITSTATUS(status);
-    snprintf(container.finished, sizeof(container.finished), "%ld", time(NULL));
+    container_lock(container_id);
+    if (read_container_metadata(container_id, &container) != 0) {
+        fprintf(stderr, "Failed to read container metadata\n");
+        goto out;
+    }
 
-    if (write_container_metadata(&container) != 0) {
+    // Not started by this daemon, so not the reaper's to collect
+    if (container.state == CONTAINER_STATE_RUNNING) {
+        int status;
+        if (waitpid(container.pid, &status, 0) == -1) {
+            perror("waitpid");
+            goto out;
+        }
+
+        container.state = CONTAINER_STATE_EXITED;
+        container.exit_code = reaper_exit_code(status);
+        snprintf(container.finished, sizeof(container.finished), "%ld", time(NULL));
+        publish_event(EVENT_TYPE_CONTAINER, "die", container.id, container.name, container.image, container.exit_code);
+
+        if (write_container_metadata(&container) != 0) {
+            goto out;
+        }
+    }
+    result = 0;
+
+out:
+    container_unlock(container_id);
+    if (result != 0) {
         return -1;
     }
 
     printf("Container %s stopped\n", container_id);
+    publish_event(EVENT_TYPE_CONTAINER, "stop", container.id, container.name, container.image, -1);
+    return 0;
+}
+
+// SIGKILL, then wait for the reaper to record the exit, so a remove right
+// after finds the container stopped
+int kill_container(const char *container_id) {
+    container_info_t container;
+
+    container_lock(container_id);
+    if (read_container_metadata(container_id, &container) != 0) {
+        container_unlock(container_id);
+        fprintf(stderr, "Container %s does not exist\n", container_id);
+        return -1;
+    }
+
+    if (container.state != CONTAINER_STATE_RUNNING) {
+        container_unlock(container_id);
+        fprintf(stderr, "Container %s is not running\n", container_id);
+        return -1;
+    }
+
+    if (kill(container.pid, SIGKILL) != 0) {
+        container_unlock(container_id);
+        perror("kill SIGKILL");
+        return -1;
+    }
+    container_unlock(container_id);
+    publish_event(EVENT_TYPE_CONTAINER, "kill", container.id, container.name, container.image, -1);
+    reaper_wait(container_id, -1);
     return 0;
 }
 
@@ -379,21 +763,21 @@ int restart_container(const char *container_id) {
     return start_container(container_id);
 }
 
-int remove_container(const char *container_id) {
-    container_info_t container;
-    char container_path[MAX_PATH_LEN];
+// Caller holds the container's lock
+static int remove_stopped_container(const char *container_id, container_info_t *container) {
+    char container_path[MAX_PATH_LEN], file_path[MAX_PATH_LEN];
 
     if (!container_exists(container_id)) {
         fprintf(stderr, "Container %s does not exist\n", container_id);
         return -1;
     }
 
-    if (read_container_metadata(container_id, &container) != 0) {
+    if (read_container_metadata(container_id, container) != 0) {
         fprintf(stderr, "Failed to read container metadata\n");
         return -1;
     }
 
-    if (container.state == CONTAINER_STATE_RUNNING) {
+    if (container->state == CONTAINER_STATE_RUNNING) {
         fprintf(stderr, "Cannot remove running container %s\n", container_id);
         return -1;
     }
@@ -401,94 +785,99 @@ int remove_container(const char *container_id) {
     printf("Removing container %s...\n", container_id);
 
     // Remove container directory
-    strcpy(container_path, get_container_full_path(container_id));
+    container_dir_path(container_id, container_path, sizeof(container_path));
     char rm_cmd[1024];
     snprintf(rm_cmd, sizeof(rm_cmd), "rm -rf %s", container_path);
     if (system(rm_cmd) != 0) {
         fprintf(stderr, "Failed to remove container directory\n");
         return -1;
     }
+    gc_unref_container(container_id);
 
     // Remove metadata file
-    if (unlink(container.config_path) != 0) {
+    container_metadata_path(container_id, file_path, sizeof(file_path));
+    if (unlink(file_path) != 0) {
         perror("unlink metadata");
         return -1;
     }
+    container_index_remove(container_id);
 
     // Remove log file
-    if (unlink(container.log_path) != 0 && errno != ENOENT) {
+    container_log_path(container_id, file_path, sizeof(file_path));
+    if (unlink(file_path) != 0 && errno != ENOENT) {
         perror("unlink log");
         return -1;
     }
+    return 0;
+}
+
+int remove_container(const char *container_id) {
+    container_info_t container;
+    int result;
+
+    container_lock(container_id);
+    result = remove_stopped_container(container_id, &container);
+    container_unlock(container_id);
+    if (result != 0) {
+        return -1;
+    }
 
     printf("Container %s removed\n", container_id);
+    publish_event(EVENT_TYPE_CONTAINER, "destroy", container.id, container.name, container.image, -1);
     return 0;
 }
 
-container_list_t* list_containers() {
-    DIR *dir;
-    struct dirent *entry;
-    container_list_t *list;
-    container_info_t *containers;
-    int count = 0;
+static int append_container(const container_record_t *record, void *ctx) {
+    container_list_t *list = ctx;
+    container_record_t *copy;
 
-    list = malloc(sizeof(container_list_t));
-    if (!list) {
-        perror("malloc");
-        return NULL;
+    if (list->count == list->capacity) {
+        return 0;
     }
-
-    // Count metadata files
-    dir = opendir(CONTAINER_METADATA_DIR);
-    if (!dir) {
-        perror("opendir metadata");
-        free(list);
-        return NULL;
+    copy = &list->containers[list->count];
+    *copy = *record;
+    copy->strings = NULL;
+    copy->name = arena_strdup(&list->strings, record->name);
+    copy->image = arena_strdup(&list->strings, record->image);
+    copy->image_id = arena_strdup(&list->strings, record->image_id);
+    copy->command = arena_strdup(&list->strings, record->command);
+    if (copy->name && copy->image && copy->image_id && copy->command) {
+        list->count++;
     }
+    return 0;
+}
 
-    while ((entry = readdir(dir)) != NULL) {
-        if (strstr(entry->d_name, ".json")) {
-            count++;
-        }
-    }
-    closedir(dir);
+// A snapshot of the container index, in id order; free_container_list
+// releases it
+container_list_t* list_containers() {
+    container_list_t *list;
 
-    if (count == 0) {
-        list->containers = NULL;
-        list->count = 0;
-        list->capacity = 0;
-        return list;
+    list = calloc(1, sizeof(container_list_t));
+    if (!list) {
+        perror("calloc");
+        return NULL;
     }
 
-    containers = malloc(sizeof(container_info_t) * count);
-    if (!containers) {
+    // Room for a few made while the snapshot is taken; any past that wait for the next one
+    list->capacity = container_index_count() + 16;
+    list->containers = malloc(sizeof(container_record_t) * list->capacity);
+    if (!list->containers) {
         perror("malloc");
         free(list);
         return NULL;
     }
+    arena_init(&list->strings, 0);
 
-    // Read metadata files
-    dir = opendir(CONTAINER_METADATA_DIR);
-    count = 0;
-    while ((entry = readdir(dir)) != NULL) {
-        if (strstr(entry->d_name, ".json")) {
-            char container_id[MAX_CONTAINER_ID_LEN];
-            sscanf(entry->d_name, "%[^.].json", container_id);
-
-            if (read_container_metadata(container_id, &containers[count]) == 0) {
-                count++;
-            }
-        }
-    }
-    closedir(dir);
-
-    list->containers = containers;
-    list->count = count;
-    list->capacity = count;
-
+    container_index_scan(NULL, append_container, list);
     return list;
 }
 
+void free_container_list(container_list_t *list) {
+    arena_free(&list->strings);
+    free(list->containers);
+    free(list);
+}
+
 container_info_t* get_container_info(const char *container_id) {
     container_info_t *container;
 
@@ -506,6 +895,135 @@ container_info_t* get_container_info(const char *container_id) {
     return container;
 }
 
+// Sends signal to every process in the container's pid namespace, so
+// SIGSTOP and SIGCONT freeze and thaw the whole container
+int signal_container(const char *container_id, int signal) {
+    char path[64];
+    char ns[64], other[64];
+    container_info_t container;
+    struct dirent *entry;
+    ssize_t len;
+    int signalled = 0;
+    DIR *proc;
+
+    if (read_container_metadata(container_id, &container) != 0 || container.pid <= 0) {
+        return -1;
+    }
+    snprintf(path, sizeof(path), "/proc/%d/ns/pid", container.pid);
+    if ((len = readlink(path, ns, sizeof(ns) - 1)) < 0) {
+        return -1;
+    }
+    ns[len] = '\0';
+
+    proc = opendir("/proc");
+    if (!proc) {
+        perror("opendir /proc");
+        return -1;
+    }
+    while ((entry = readdir(proc)) != NULL) {
+        pid_t pid = (pid_t)strtol(entry->d_name, NULL, 10);
+
+        if (pid <= 0) continue;
+        snprintf(path, sizeof(path), "/proc/%d/ns/pid", pid);
+        if ((len = readlink(path, other, sizeof(other) - 1)) < 0) continue;
+        other[len] = '\0';
+        if (strcmp(ns, other) == 0 && kill(pid, signal) == 0) {
+            signalled++;
+        }
+    }
+    closedir(proc);
+    return signalled > 0 ? 0 : -1;
+}
+
+typedef struct {
+    image_info_t *image;
+} commit_filter_t;
+
+// The upper directory holds the container's changes, plus the whiteouts
+// hide_layer_metadata put there for the image's own files, which are not
+// changes. Directories overlay made opaque keep hiding the layers below.
+static int filter_upper_entry(void *ctx, const char *path, const char *relative, const struct stat *st) {
+    commit_filter_t *filter = ctx;
+    char opaque[2];
+
+    if (S_ISCHR(st->st_mode) && st->st_rdev == makedev(0, 0) && !strchr(relative, '/')) {
+        for (int i = 0; i < filter->image->layer_count; i++) {
+            const char *id = filter->image->layers[i].id;
+            size_t id_len = strlen(id);
+
+            if (strncmp(relative, id, id_len) == 0 && relative[id_len] == '.') {
+                return TAR_TREE_SKIP;
+            }
+        }
+    }
+    if (S_ISDIR(st->st_mode) && lgetxattr(path, "trusted.overlay.opaque", opaque, sizeof(opaque)) == 1 &&
+        opaque[0] == 'y') {
+        return TAR_TREE_OPAQUE;
+    }
+    return TAR_TREE_INCLUDE;
+}
+
+// Makes an image of the container: its upper directory becomes one new
+// layer on top of the image it runs, which is never read. A running
+// container is frozen meanwhile unless pause is 0. The container's lock is
+// held from reading its metadata until its upper directory is captured, so
+// a start, stop or remove cannot change it underneath.
+int commit_container(const char *container_id, const char *target_ref, const char *comment, int pause,
+                     commit_stats_t *stats) {
+    char full_name[MAX_IMAGE_NAME_LEN + MAX_IMAGE_TAG_LEN + 2];
+    char container_path[MAX_PATH_LEN], upperdir[MAX_PATH_LEN];
+    container_info_t container;
+    commit_filter_t filter;
+    image_info_t image;
+    int frozen = 0;
+    int result;
+
+    container_lock(container_id);
+    if (!container_exists(container_id) || read_container_metadata(container_id, &container) != 0) {
+        container_unlock(container_id);
+        fprintf(stderr, "Container %s does not exist\n", container_id);
+        return -1;
+    }
+
+    // By id first: the tag may have moved since the container was created
+    if ((resolve_image_name(container.image_id, full_name, sizeof(full_name)) != 0 &&
+         resolve_image_name(container.image, full_name, sizeof(full_name)) != 0) ||
+        read_image_metadata(full_name, &image) != 0) {
+        container_unlock(container_id);
+        fprintf(stderr, "No such image: %s\n", container.image);
+        return -1;
+    }
+
+    // A container never started has no changes: its layer is empty
+    container_dir_path(container.id, container_path, sizeof(container_path));
+    if (snprintf(upperdir, sizeof(upperdir), "%s/upper", container_path) >= (int)sizeof(upperdir)) {
+        container_unlock(container_id);
+        fprintf(stderr, "Container path too long: %s\n", container_path);
+        free(image.layers);
+        return -1;
+    }
+    if (mkdir(upperdir, 0755) != 0 && errno != EEXIST) {
+        container_unlock(container_id);
+        perror("mkdir upper");
+        free(image.layers);
+        return -1;
+    }
+
+    if (pause && container.state == CONTAINER_STATE_RUNNING) {
+        frozen = signal_container(container.id, SIGSTOP) == 0;
+    }
+
+    filter.image = &image;
+    result = commit_image(full_name, upperdir, filter_upper_entry, &filter, target_ref, comment, stats);
+
+    if (frozen) {
+        signal_container(container.id, SIGCONT);
+    }
+    container_unlock(container_id);
+    free(image.layers);
+    return result;
+}
+
 int is_container_running(const char *container_id) {
     container_info_t container;
 
@@ -18,21 +18,25 @@
 #include <netinet/in.h>
 #include <arpa/inet.h>
 
+#include "image.h"
+#include "trace.h"
+#include "arena.h"
+
 #define MAX_CONTAINER_NAME_LEN 256
-#define MAX_CONTAINER_ID_LEN 64
+#define MAX_CONTAINER_ID_LEN 72
 #define MAX_IMAGE_NAME_LEN 256
 #define MAX_COMMAND_LEN 1024
 #define MAX_PATH_LEN 512
 #define MAX_ENV_VAR_LEN 512
 #define MAX_PORT_MAPPING_LEN 64
 #define MAX_VOLUME_MAPPING_LEN 256
-#define MAX_NETWORK_CONFIG_LEN 256
 
 #define CONTAINER_STORAGE_DIR "/tmp/docker-containers"
 #define CONTAINER_METADATA_DIR "/tmp/docker-container-metadata"
 #define CONTAINER_LOG_DIR "/tmp/docker-logs"
 
 #define STACK_SIZE (1024 * 1024)
+#define CONTAINER_STOP_TIMEOUT_MS 10000     // SIGTERM, then SIGKILL
 
 typedef enum {
     CONTAINER_STATE_CREATED,
@@ -44,6 +48,9 @@ typedef enum {
     CONTAINER_STATE_DEAD
 } container_state_t;
 
+// A container's whole metadata, as it is read, changed and written back by
+// one operation. Paths follow from the id (container_rootfs_path and the
+// like) and are not kept.
 typedef struct {
     char id[MAX_CONTAINER_ID_LEN];
     char name[MAX_CONTAINER_NAME_LEN];
@@ -51,36 +58,54 @@ typedef struct {
     char image_id[MAX_CONTAINER_ID_LEN];
     char command[MAX_COMMAND_LEN];
     char working_dir[MAX_PATH_LEN];
-    char user[MAX_PATH_LEN];
-    char shell[MAX_PATH_LEN];
-    char entrypoint[MAX_COMMAND_LEN];
-    char cmd[MAX_COMMAND_LEN];
     char env_vars[MAX_ENV_VAR_LEN];
     char port_mappings[MAX_PORT_MAPPING_LEN];
     char volume_mappings[MAX_VOLUME_MAPPING_LEN];
-    char network_config[MAX_NETWORK_CONFIG_LEN];
     container_state_t state;
     pid_t pid;
     char created[32];
     char started[32];
     char finished[32];
     int exit_code;
-    char log_path[MAX_PATH_LEN];
-    char rootfs_path[MAX_PATH_LEN];
-    char config_path[MAX_PATH_LEN];
     int interactive;
     int tty;
     int detach;
-    int restart_policy;
-    int memory_limit;
-    int cpu_limit;
-    int pid_limit;
 } container_info_t;
 
+// What the daemon keeps of every container between operations: the fields
+// listings filter on and print. The record is small and fixed size so the
+// index can keep all of them contiguous; its strings sit together in one
+// allocation of their own, out of the way of scans over ids and states.
+typedef struct {
+    char id[MAX_CONTAINER_ID_LEN];
+    container_state_t state;
+    pid_t pid;
+    int exit_code;
+    long long created;          // unix seconds
+    long long started;
+    long long finished;
+    const char *name;           // these four point into strings
+    const char *image;
+    const char *image_id;
+    const char *command;
+    char *strings;
+} container_record_t;
+
+// What the container's init needs from the daemon before it pivots
+typedef struct {
+    container_info_t *container;
+    char *lowerdir;             // overlay layers, top first; NULL for an empty root
+    char upperdir[MAX_PATH_LEN];
+    char workdir[MAX_PATH_LEN];
+    int fanotify_fd;            // lazy layers' open watch, or -1
+    trace_buffer_t *trace;      // where init records its spans, or NULL
+} container_start_t;
+
 typedef struct {
-    container_info_t *containers;
+    container_record_t *containers;
     int count;
     int capacity;
+    arena_t strings;            // the records' strings
 } container_list_t;
 
 // Function declarations
@@ -88,18 +113,23 @@ int init_container_system();
 int create_container(const char *name, const char *image, const char *command, 
                     const char *working_dir, const char *env_vars, 
                     const char *port_mappings, const char *volume_mappings,
-                    int interactive, int tty, int detach);
+                    int interactive, int tty, int detach, char *container_id);
 int start_container(const char *container_id);
 int stop_container(const char *container_id);
+int kill_container(const char *container_id);
 int restart_container(const char *container_id);
 int pause_container(const char *container_id);
 int unpause_container(const char *container_id);
 int remove_container(const char *container_id);
+int commit_container(const char *container_id, const char *target_ref, const char *comment, int pause,
+                     commit_stats_t *stats);
 int exec_container(const char *container_id, const char *command);
 container_list_t* list_containers();
+void free_container_list(container_list_t *list);
 container_info_t* get_container_info(const char *container_id);
 int container_exists(const char *container_id);
-char* generate_container_id();
+void generate_container_id(char *out, size_t size);
+int resolve_container_id(const char *container_ref, char *container_id, size_t size);
 int create_container_filesystem(const char *container_id, const char *image_id);
 int setup_container_namespaces(container_info_t *container);
 int setup_container_cgroups(container_info_t *container);
@@ -114,7 +144,10 @@ int setup_container_environment(container_info_t *container);
 int execute_container_command(container_info_t *container);
 
 // Helper functions
-char* get_container_full_path(const char *container_id);
+void container_dir_path(const char *container_id, char *out, size_t size);
+void container_rootfs_path(const char *container_id, char *out, size_t size);
+void container_log_path(const char *container_id, char *out, size_t size);
+void container_metadata_path(const char *container_id, char *out, size_t size);
 int write_container_metadata(container_info_t *container);
 int read_container_metadata(const char *container_id, container_info_t *container);
 int create_container_directories();
@@ -122,6 +155,7 @@ int cleanup_container_resources(const char *container_id);
 int signal_container(const char *container_id, int signal);
 int get_container_pid(const char *container_id);
 int is_container_running(const char *container_id);
+const char* container_state_name(container_state_t state);
 
 // Namespace and cgroup functions
 int create_new_namespaces();
@@ -0,0 +1,236 @@
+#include "container_index.h"
+#include <dirent.h>
+#include <pthread.h>
+
+static pthread_rwlock_t index_lock = PTHREAD_RWLOCK_INITIALIZER;
+static container_record_t *records = NULL;
+static int record_count = 0, record_capacity = 0;
+
+// Where id is, or where it would go
+static int find_position(const char *container_id, int *found) {
+    int low = 0, high = record_count;
+
+    while (low < high) {
+        int mid = low + (high - low) / 2;
+        int cmp = strcmp(records[mid].id, container_id);
+        if (cmp == 0) {
+            *found = 1;
+            return mid;
+        } else if (cmp < 0) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    *found = 0;
+    return low;
+}
+
+static long long metadata_time(const char *text) {
+    return strtoll(text, NULL, 10);
+}
+
+// The record for container, its strings packed into one allocation
+static int make_record(const container_info_t *container, container_record_t *record) {
+    size_t name_len = strlen(container->name) + 1;
+    size_t image_len = strlen(container->image) + 1;
+    size_t image_id_len = strlen(container->image_id) + 1;
+    size_t command_len = strlen(container->command) + 1;
+    char *strings = malloc(name_len + image_len + image_id_len + command_len);
+
+    if (!strings) {
+        perror("malloc");
+        return -1;
+    }
+
+    memset(record, 0, sizeof(*record));
+    snprintf(record->id, sizeof(record->id), "%s", container->id);
+    record->state = container->state;
+    record->pid = container->pid;
+    record->exit_code = container->exit_code;
+    record->created = metadata_time(container->created);
+    record->started = metadata_time(container->started);
+    record->finished = metadata_time(container->finished);
+
+    record->strings = strings;
+    record->name = memcpy(strings, container->name, name_len);
+    record->image = memcpy(strings += name_len, container->image, image_len);
+    record->image_id = memcpy(strings += image_len, container->image_id, image_id_len);
+    record->command = memcpy(strings + image_id_len, container->command, command_len);
+    return 0;
+}
+
+// Caller holds the write lock
+static int put_record(const container_info_t *container) {
+    container_record_t record;
+    int found;
+    int position = find_position(container->id, &found);
+
+    if (make_record(container, &record) != 0) {
+        return -1;
+    }
+    if (found) {
+        free(records[position].strings);
+        records[position] = record;
+        return 0;
+    }
+
+    if (record_count == record_capacity) {
+        int capacity = record_capacity ? record_capacity * 2 : 64;
+        container_record_t *grown = realloc(records, sizeof(container_record_t) * capacity);
+        if (!grown) {
+            perror("realloc");
+            free(record.strings);
+            return -1;
+        }
+        records = grown;
+        record_capacity = capacity;
+    }
+
+    memmove(&records[position + 1], &records[position], sizeof(container_record_t) * (record_count - position));
+    records[position] = record;
+    record_count++;
+    return 0;
+}
+
+// Caller holds the write lock; the array is sorted once all are in
+static int append_record(const container_info_t *container) {
+    if (record_count == record_capacity) {
+        int capacity = record_capacity ? record_capacity * 2 : 64;
+        container_record_t *grown = realloc(records, sizeof(container_record_t) * capacity);
+        if (!grown) {
+            perror("realloc");
+            return -1;
+        }
+        records = grown;
+        record_capacity = capacity;
+    }
+    if (make_record(container, &records[record_count]) != 0) {
+        return -1;
+    }
+    record_count++;
+    return 0;
+}
+
+static int compare_records(const void *a, const void *b) {
+    return strcmp(((const container_record_t *)a)->id, ((const container_record_t *)b)->id);
+}
+
+int init_container_index(void) {
+    container_info_t container;
+    struct dirent *entry;
+    DIR *dir;
+    int result = 0;
+
+    dir = opendir(CONTAINER_METADATA_DIR);
+    if (!dir) {
+        perror("opendir metadata");
+        return -1;
+    }
+
+    pthread_rwlock_wrlock(&index_lock);
+    while (result == 0 && (entry = readdir(dir)) != NULL) {
+        char container_id[MAX_CONTAINER_ID_LEN];
+        size_t len = strlen(entry->d_name);
+
+        if (len <= 5 || len - 5 >= sizeof(container_id) || strcmp(entry->d_name + len - 5, ".json") != 0) {
+            continue;
+        }
+        snprintf(container_id, sizeof(container_id), "%.*s", (int)(len - 5), entry->d_name);
+        if (read_container_metadata(container_id, &container) == 0) {
+            result = append_record(&container);
+        }
+    }
+    qsort(records, record_count, sizeof(container_record_t), compare_records);
+    pthread_rwlock_unlock(&index_lock);
+    closedir(dir);
+
+    if (result != 0) {
+        fprintf(stderr, "Failed to load container index\n");
+    }
+    return result;
+}
+
+int container_index_put(const container_info_t *container) {
+    int result;
+
+    pthread_rwlock_wrlock(&index_lock);
+    result = put_record(container);
+    pthread_rwlock_unlock(&index_lock);
+    return result;
+}
+
+int container_index_remove(const char *container_id) {
+    int found, position;
+
+    pthread_rwlock_wrlock(&index_lock);
+    position = find_position(container_id, &found);
+    if (found) {
+        free(records[position].strings);
+        memmove(&records[position], &records[position + 1],
+                sizeof(container_record_t) * (record_count - position - 1));
+        record_count--;
+    }
+    pthread_rwlock_unlock(&index_lock);
+    return found ? 0 : -1;
+}
+
+// The id container_ref is, or the one id it is a prefix of. container_id
+// may be container_ref itself.
+int container_index_resolve(const char *container_ref, char *container_id, size_t size) {
+    char id[MAX_CONTAINER_ID_LEN];
+    size_t len = strlen(container_ref);
+    int found, position, ambiguous = 0;
+
+    pthread_rwlock_rdlock(&index_lock);
+    position = find_position(container_ref, &found);
+    if (!found) {
+        found = len > 0 && position < record_count && strncmp(records[position].id, container_ref, len) == 0;
+        ambiguous = found && position + 1 < record_count &&
+                    strncmp(records[position + 1].id, container_ref, len) == 0;
+    }
+    if (found) {
+        memcpy(id, records[position].id, sizeof(id));
+    }
+    pthread_rwlock_unlock(&index_lock);
+
+    if (ambiguous) {
+        fprintf(stderr, "Container id prefix %s matches more than one container\n", container_ref);
+        return -1;
+    }
+    if (found) {
+        snprintf(container_id, size, "%s", id);
+    }
+    return found ? 0 : -1;
+}
+
+int container_index_count(void) {
+    int count;
+
+    pthread_rwlock_rdlock(&index_lock);
+    count = record_count;
+    pthread_rwlock_unlock(&index_lock);
+    return count;
+}
+
+// Visits the records after after_id (from the first when it is NULL or
+// empty). Returns how many were visited.
+int container_index_scan(const char *after_id, container_visit_fn visit, void *ctx) {
+    int found, position = 0, visited = 0;
+
+    pthread_rwlock_rdlock(&index_lock);
+    if (after_id && after_id[0]) {
+        position = find_position(after_id, &found);
+        if (found) {
+            position++;
+        }
+    }
+    for (int i = position; i < record_count; i++) {
+        visited++;
+        if (visit(&records[i], ctx) != 0) {
+            break;
+        }
+    }
+    pthread_rwlock_unlock(&index_lock);
+    return visited;
+}
@@ -0,0 +1,29 @@
+#ifndef CONTAINER_INDEX_H
+#define CONTAINER_INDEX_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "container.h"
+
+// A container_record_t for every container, kept in memory so listing
+// never reads the metadata directory. Loaded from it once at startup and
+// kept up to date by every metadata write and removal. Records are sorted
+// by id, which is the order listings come out in and what a page cursor
+// points into.
+
+// Called for each record in id order under the index's read lock; a
+// nonzero return stops the scan. The record's strings are only good until
+// the lock is let go.
+typedef int (*container_visit_fn)(const container_record_t *record, void *ctx);
+
+// Function declarations
+int init_container_index(void);
+int container_index_put(const container_info_t *container);
+int container_index_remove(const char *container_id);
+int container_index_resolve(const char *container_ref, char *container_id, size_t size);
+int container_index_count(void);
+int container_index_scan(const char *after_id, container_visit_fn visit, void *ctx);
+
+#endif // CONTAINER_INDEX_H
@@ -0,0 +1,36 @@
+#include "container_lock.h"
+#include <pthread.h>
+
+// A line each, so neighbouring shards taken by different threads don't
+// share one
+typedef struct {
+    pthread_mutex_t mutex;
+} __attribute__((aligned(64))) lock_shard_t;
+
+static lock_shard_t shards[CONTAINER_LOCK_SHARDS];
+static pthread_once_t shards_once = PTHREAD_ONCE_INIT;
+
+static void init_shards(void) {
+    for (int i = 0; i < CONTAINER_LOCK_SHARDS; i++) {
+        pthread_mutex_init(&shards[i].mutex, NULL);
+    }
+}
+
+// FNV-1a
+static pthread_mutex_t* shard_for(const char *container_id) {
+    unsigned int hash = 2166136261u;
+
+    pthread_once(&shards_once, init_shards);
+    for (const unsigned char *p = (const unsigned char *)container_id; *p; p++) {
+        hash = (hash ^ *p) * 16777619u;
+    }
+    return &shards[hash % CONTAINER_LOCK_SHARDS].mutex;
+}
+
+void container_lock(const char *container_id) {
+    pthread_mutex_lock(shard_for(container_id));
+}
+
+void container_unlock(const char *container_id) {
+    pthread_mutex_unlock(shard_for(container_id));
+}
@@ -0,0 +1,24 @@
+#ifndef CONTAINER_LOCK_H
+#define CONTAINER_LOCK_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Serializes what changes one container: start, stop, kill, remove and the
+// reaper recording an exit each read the container's metadata, decide, and
+// write it back under its lock; commit holds it while it captures the
+// container's upper directory. Ids hash onto a fixed table of mutexes, so
+// operations on different containers almost never wait on each other and
+// no lock is made or freed per container.
+//
+// The lock is taken before the container index's, the reaper's and gc's
+// own locks and is never held while waiting on the reaper, which takes it
+// to record an exit.
+#define CONTAINER_LOCK_SHARDS 256
+
+// Function declarations
+void container_lock(const char *container_id);
+void container_unlock(const char *container_id);
+
+#endif // CONTAINER_LOCK_H
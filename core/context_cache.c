@@ -0,0 +1,599 @@
+#include "context_cache.h"
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+
+typedef struct {
+    context_cache_t *cache;
+    int root_fd;
+    int *scan;
+    int scan_count;
+    int scan_capacity;
+    int *work;
+    int work_count;
+    int work_capacity;
+    context_digest_stats_t *stats;
+} context_scan_t;
+
+typedef struct {
+    context_scan_t *scan;
+    atomic_int next;
+    atomic_int failed;
+} hash_job_t;
+
+static uint64_t hash_path(const char *path) {
+    uint64_t h = 1469598103934665603ULL;
+
+    while (*path) {
+        h ^= (unsigned char)*path++;
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+static int rebuild_slots(context_cache_t *cache, int slot_count) {
+    int *slots = malloc(sizeof(int) * slot_count);
+    if (!slots) {
+        perror("malloc");
+        return -1;
+    }
+
+    for (int i = 0; i < slot_count; i++) {
+        slots[i] = -1;
+    }
+
+    for (int i = 0; i < cache->count; i++) {
+        uint64_t h = hash_path(cache->entries[i].path) & (slot_count - 1);
+        while (slots[h] != -1) {
+            h = (h + 1) & (slot_count - 1);
+        }
+        slots[h] = i;
+    }
+
+    free(cache->slots);
+    cache->slots = slots;
+    cache->slot_count = slot_count;
+    return 0;
+}
+
+static context_entry_t* find_entry(context_cache_t *cache, const char *path) {
+    uint64_t h = hash_path(path) & (cache->slot_count - 1);
+
+    while (cache->slots[h] != -1) {
+        context_entry_t *entry = &cache->entries[cache->slots[h]];
+        if (strcmp(entry->path, path) == 0) {
+            return entry;
+        }
+        h = (h + 1) & (cache->slot_count - 1);
+    }
+    return NULL;
+}
+
+static context_entry_t* add_entry(context_cache_t *cache, const char *path) {
+    if (cache->count >= cache->capacity) {
+        int capacity = cache->capacity ? cache->capacity * 2 : 256;
+        context_entry_t *entries = realloc(cache->entries, sizeof(context_entry_t) * capacity);
+        if (!entries) {
+            perror("realloc");
+            return NULL;
+        }
+        cache->entries = entries;
+        cache->capacity = capacity;
+    }
+
+    // Keep the table at most half full so probes stay short
+    if ((cache->count + 1) * 2 > cache->slot_count) {
+        if (rebuild_slots(cache, cache->slot_count * 2) != 0) {
+            return NULL;
+        }
+    }
+
+    context_entry_t *entry = &cache->entries[cache->count];
+    memset(entry, 0, sizeof(*entry));
+    entry->path = strdup(path);
+    if (!entry->path) {
+        perror("strdup");
+        return NULL;
+    }
+
+    uint64_t h = hash_path(path) & (cache->slot_count - 1);
+    while (cache->slots[h] != -1) {
+        h = (h + 1) & (cache->slot_count - 1);
+    }
+    cache->slots[h] = cache->count;
+    cache->count++;
+
+    return entry;
+}
+
+static int push_index(int **items, int *count, int *capacity, int index) {
+    if (*count >= *capacity) {
+        int new_capacity = *capacity ? *capacity * 2 : 256;
+        int *new_items = realloc(*items, sizeof(int) * new_capacity);
+        if (!new_items) {
+            perror("realloc");
+            return -1;
+        }
+        *items = new_items;
+        *capacity = new_capacity;
+    }
+    (*items)[(*count)++] = index;
+    return 0;
+}
+
+context_cache_t* load_context_cache(const char *context_path) {
+    context_cache_t *cache;
+    char resolved[PATH_MAX];
+    char key[SHA256_HEX_LEN + 1];
+    FILE *fp;
+
+    if (!realpath(context_path, resolved)) {
+        perror("realpath context");
+        return NULL;
+    }
+
+    if (mkdir(BUILD_CACHE_DIR, 0755) != 0 && errno != EEXIST) {
+        perror("mkdir build cache");
+        return NULL;
+    }
+
+    cache = calloc(1, sizeof(context_cache_t));
+    if (!cache) {
+        perror("calloc");
+        return NULL;
+    }
+
+    strncpy(cache->context_path, resolved, sizeof(cache->context_path) - 1);
+    sha256_hex(resolved, strlen(resolved), key);
+    snprintf(cache->cache_file, sizeof(cache->cache_file), "%s/%s.cache", BUILD_CACHE_DIR, key);
+    cache->scan_started = time(NULL);
+
+    if (rebuild_slots(cache, 1024) != 0) {
+        free(cache);
+        return NULL;
+    }
+
+    fp = fopen(cache->cache_file, "r");
+    if (!fp) {
+        // No cache yet: the first build hashes everything
+        return cache;
+    }
+
+    // One entry per line, tab separated: mode size mtime_sec mtime_nsec
+    // inode digest path. The path runs verbatim to the end of the line.
+    char *line = NULL;
+    size_t line_cap = 0;
+    ssize_t line_len;
+    while ((line_len = getline(&line, &line_cap, fp)) > 0) {
+        unsigned int mode;
+        long long size, mtime_sec;
+        long mtime_nsec;
+        unsigned long long inode;
+        char digest[SHA256_HEX_LEN + 1];
+        char *path = line;
+        int fields_len = -1;
+
+        if (line[line_len - 1] == '\n') {
+            line[--line_len] = '\0';
+        }
+
+        for (int i = 0; i < 6 && path; i++) {
+            path = strchr(path, '\t');
+            path = path ? path + 1 : NULL;
+        }
+        if (!path || *path == '\0') {
+            continue;
+        }
+        path[-1] = '\0';
+
+        if (sscanf(line, "%o\t%lld\t%lld\t%ld\t%llu\t%64[0-9a-f-]%n", &mode, &size, &mtime_sec,
+                   &mtime_nsec, &inode, digest, &fields_len) != 6 || line + fields_len != path - 1) {
+            continue;
+        }
+
+        context_entry_t *entry = add_entry(cache, path);
+        if (!entry) {
+            break;
+        }
+        entry->mode = mode;
+        entry->size = size;
+        entry->mtime_sec = mtime_sec;
+        entry->mtime_nsec = mtime_nsec;
+        entry->inode = inode;
+        strcpy(entry->digest, strcmp(digest, "-") == 0 ? "" : digest);
+    }
+
+    free(line);
+    fclose(fp);
+    return cache;
+}
+
+static int is_under_root(const char *path, const char *root) {
+    size_t len = strlen(root);
+
+    if (len == 0) {
+        return 1;
+    }
+    return strncmp(path, root, len) == 0 && (path[len] == '\0' || path[len] == '/');
+}
+
+int save_context_cache(context_cache_t *cache) {
+    char tmp_path[MAX_CACHE_PATH_LEN + 32];
+    FILE *fp;
+
+    snprintf(tmp_path, sizeof(tmp_path), "%s.%d.%lx", cache->cache_file, getpid(),
+             (unsigned long)pthread_self());
+
+    fp = fopen(tmp_path, "w");
+    if (!fp) {
+        perror("fopen context cache");
+        return -1;
+    }
+
+    for (int i = 0; i < cache->count; i++) {
+        context_entry_t *entry = &cache->entries[i];
+        int dropped = 0;
+
+        // Entries under a root we just walked but did not see were deleted
+        if (!entry->seen) {
+            for (int j = 0; j < cache->scanned_count; j++) {
+                if (is_under_root(entry->path, cache->scanned_roots[j])) {
+                    dropped = 1;
+                    break;
+                }
+            }
+        }
+
+        // Files modified in the same second as the scan may change again
+        // without moving mtime, so they are never trusted on the next run
+        if (dropped || entry->mtime_sec >= cache->scan_started || strchr(entry->path, '\n')) {
+            continue;
+        }
+
+        fprintf(fp, "%o\t%lld\t%lld\t%ld\t%llu\t%s\t%s\n",
+                (unsigned int)entry->mode, (long long)entry->size, (long long)entry->mtime_sec,
+                entry->mtime_nsec, (unsigned long long)entry->inode,
+                entry->digest[0] ? entry->digest : "-", entry->path);
+    }
+
+    if (fclose(fp) != 0) {
+        perror("fclose context cache");
+        unlink(tmp_path);
+        return -1;
+    }
+
+    // Concurrent builds of the same context each replace the file whole
+    if (rename(tmp_path, cache->cache_file) != 0) {
+        perror("rename context cache");
+        unlink(tmp_path);
+        return -1;
+    }
+
+    return 0;
+}
+
+void free_context_cache(context_cache_t *cache) {
+    if (!cache) return;
+
+    for (int i = 0; i < cache->count; i++) {
+        free(cache->entries[i].path);
+    }
+    for (int i = 0; i < cache->scanned_count; i++) {
+        free(cache->scanned_roots[i]);
+    }
+
+    free(cache->entries);
+    free(cache->slots);
+    free(cache->scanned_roots);
+    free(cache);
+}
+
+static int visit_path(context_scan_t *scan, const char *rel_path, struct stat *st) {
+    context_cache_t *cache = scan->cache;
+    context_entry_t *entry = find_entry(cache, rel_path);
+
+    if (!entry) {
+        entry = add_entry(cache, rel_path);
+        if (!entry) {
+            return -1;
+        }
+    }
+
+    int index = entry - cache->entries;
+    int unchanged = entry->digest[0] != '\0' &&
+                    entry->mode == st->st_mode &&
+                    entry->size == st->st_size &&
+                    entry->mtime_sec == st->st_mtim.tv_sec &&
+                    entry->mtime_nsec == st->st_mtim.tv_nsec &&
+                    entry->inode == st->st_ino;
+
+    entry->seen = 1;
+    entry->mode = st->st_mode;
+    entry->size = st->st_size;
+    entry->mtime_sec = st->st_mtim.tv_sec;
+    entry->mtime_nsec = st->st_mtim.tv_nsec;
+    entry->inode = st->st_ino;
+
+    if (push_index(&scan->scan, &scan->scan_count, &scan->scan_capacity, index) != 0) {
+        return -1;
+    }
+
+    scan->stats->files++;
+    if (S_ISREG(st->st_mode)) {
+        scan->stats->bytes += st->st_size;
+    }
+
+    if (unchanged) {
+        scan->stats->reused++;
+        return 0;
+    }
+
+    if (S_ISREG(st->st_mode)) {
+        entry->digest[0] = '\0';
+        scan->stats->hashed++;
+        scan->stats->bytes_hashed += st->st_size;
+        return push_index(&scan->work, &scan->work_count, &scan->work_capacity, index);
+    }
+
+    if (S_ISLNK(st->st_mode)) {
+        char target[PATH_MAX];
+        ssize_t len = readlinkat(scan->root_fd, rel_path, target, sizeof(target) - 1);
+        if (len < 0) {
+            perror("readlink");
+            return -1;
+        }
+        sha256_hex(target, len, entry->digest);
+        scan->stats->hashed++;
+        return 0;
+    }
+
+    // Directories and special files are keyed on their mode alone
+    strcpy(entry->digest, "-");
+    return 0;
+}
+
+static int walk_directory(context_scan_t *scan, char *rel_path, size_t rel_len) {
+    DIR *dir;
+    struct dirent *de;
+    int fd;
+
+    fd = openat(scan->root_fd, rel_len ? rel_path : ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0) {
+        perror("open context directory");
+        return -1;
+    }
+
+    dir = fdopendir(fd);
+    if (!dir) {
+        perror("fdopendir");
+        close(fd);
+        return -1;
+    }
+
+    while ((de = readdir(dir)) != NULL) {
+        struct stat st;
+        size_t name_len = strlen(de->d_name);
+
+        if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0) {
+            continue;
+        }
+
+        if (rel_len + name_len + 2 >= MAX_CACHE_PATH_LEN) {
+            fprintf(stderr, "Context path too long: %s/%s\n", rel_path, de->d_name);
+            closedir(dir);
+            return -1;
+        }
+
+        if (fstatat(dirfd(dir), de->d_name, &st, AT_SYMLINK_NOFOLLOW) != 0) {
+            perror("fstatat");
+            closedir(dir);
+            return -1;
+        }
+
+        size_t child_len = rel_len;
+        if (rel_len > 0) {
+            rel_path[child_len++] = '/';
+        }
+        memcpy(rel_path + child_len, de->d_name, name_len + 1);
+        child_len += name_len;
+
+        if (visit_path(scan, rel_path, &st) != 0 ||
+            (S_ISDIR(st.st_mode) && walk_directory(scan, rel_path, child_len) != 0)) {
+            closedir(dir);
+            return -1;
+        }
+
+        rel_path[rel_len] = '\0';
+    }
+
+    closedir(dir);
+    return 0;
+}
+
+static void* hash_worker(void *arg) {
+    hash_job_t *job = arg;
+    context_scan_t *scan = job->scan;
+    char buffer[65536];
+
+    for (;;) {
+        int i = atomic_fetch_add(&job->next, 1);
+        if (i >= scan->work_count || atomic_load(&job->failed)) {
+            break;
+        }
+
+        context_entry_t *entry = &scan->cache->entries[scan->work[i]];
+        int fd = openat(scan->root_fd, entry->path, O_RDONLY | O_CLOEXEC | O_NOFOLLOW);
+        if (fd < 0) {
+            fprintf(stderr, "Failed to open %s: %s\n", entry->path, strerror(errno));
+            atomic_store(&job->failed, 1);
+            break;
+        }
+
+        sha256_ctx_t ctx;
+        uint8_t digest[SHA256_DIGEST_LEN];
+        ssize_t n;
+
+        sha256_init(&ctx);
+        while ((n = read(fd, buffer, sizeof(buffer))) > 0) {
+            sha256_update(&ctx, buffer, n);
+        }
+        close(fd);
+
+        if (n < 0) {
+            fprintf(stderr, "Failed to read %s: %s\n", entry->path, strerror(errno));
+            atomic_store(&job->failed, 1);
+            break;
+        }
+
+        sha256_final(&ctx, digest);
+        sha256_to_hex(digest, entry->digest);
+    }
+
+    return NULL;
+}
+
+static int hash_pending_files(context_scan_t *scan) {
+    hash_job_t job;
+    pthread_t threads[MAX_HASH_THREADS];
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int thread_count = cpus > 0 ? (int)cpus : 1;
+    int started = 0;
+
+    if (thread_count > MAX_HASH_THREADS) thread_count = MAX_HASH_THREADS;
+    if (thread_count > scan->work_count) thread_count = scan->work_count;
+
+    job.scan = scan;
+    atomic_init(&job.next, 0);
+    atomic_init(&job.failed, 0);
+
+    // The calling thread works too, so one core means no extra threads
+    for (int i = 1; i < thread_count; i++) {
+        if (pthread_create(&threads[started], NULL, hash_worker, &job) != 0) {
+            break;
+        }
+        started++;
+    }
+
+    hash_worker(&job);
+
+    for (int i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    return atomic_load(&job.failed) ? -1 : 0;
+}
+
+static int compare_entries(const void *a, const void *b, void *arg) {
+    context_cache_t *cache = arg;
+    return strcmp(cache->entries[*(const int*)a].path, cache->entries[*(const int*)b].path);
+}
+
+static int normalize_source(const char *src, char *rel_path) {
+    while (src[0] == '.' && src[1] == '/') {
+        src += 2;
+    }
+    while (*src == '/') {
+        src++;
+    }
+
+    if (strcmp(src, ".") == 0) {
+        src = "";
+    }
+
+    size_t len = strlen(src);
+    if (len >= MAX_CACHE_PATH_LEN) {
+        return -1;
+    }
+    memcpy(rel_path, src, len + 1);
+    while (len > 0 && rel_path[len - 1] == '/') {
+        rel_path[--len] = '\0';
+    }
+
+    // Sources are confined to the build context
+    if (strcmp(rel_path, "..") == 0 || strncmp(rel_path, "../", 3) == 0 || strstr(rel_path, "/../")) {
+        return -1;
+    }
+    return 0;
+}
+
+int compute_context_digest(context_cache_t *cache, const char *src, char digest[SHA256_HEX_LEN + 1],
+                           context_digest_stats_t *stats) {
+    context_scan_t scan;
+    context_digest_stats_t local_stats;
+    char rel_path[MAX_CACHE_PATH_LEN];
+    struct stat st;
+    int result = -1;
+
+    if (normalize_source(src, rel_path) != 0) {
+        fprintf(stderr, "COPY source outside build context: %s\n", src);
+        return -1;
+    }
+
+    memset(&scan, 0, sizeof(scan));
+    memset(&local_stats, 0, sizeof(local_stats));
+    scan.cache = cache;
+    scan.stats = stats ? stats : &local_stats;
+    memset(scan.stats, 0, sizeof(*scan.stats));
+
+    scan.root_fd = open(cache->context_path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (scan.root_fd < 0) {
+        perror("open build context");
+        return -1;
+    }
+
+    if (rel_path[0] == '\0') {
+        if (walk_directory(&scan, rel_path, 0) != 0) goto out;
+    } else {
+        if (fstatat(scan.root_fd, rel_path, &st, AT_SYMLINK_NOFOLLOW) != 0) {
+            fprintf(stderr, "COPY source %s: %s\n", src, strerror(errno));
+            goto out;
+        }
+        if (visit_path(&scan, rel_path, &st) != 0) goto out;
+        if (S_ISDIR(st.st_mode) && walk_directory(&scan, rel_path, strlen(rel_path)) != 0) goto out;
+    }
+
+    if (scan.work_count > 0 && hash_pending_files(&scan) != 0) {
+        goto out;
+    }
+
+    // The key covers names, modes and contents in a stable order
+    qsort_r(scan.scan, scan.scan_count, sizeof(int), compare_entries, cache);
+
+    sha256_ctx_t ctx;
+    uint8_t raw[SHA256_DIGEST_LEN];
+    sha256_init(&ctx);
+    for (int i = 0; i < scan.scan_count; i++) {
+        context_entry_t *entry = &cache->entries[scan.scan[i]];
+        char mode[16];
+        int mode_len = snprintf(mode, sizeof(mode), "%o", (unsigned int)entry->mode);
+
+        sha256_update(&ctx, entry->path, strlen(entry->path) + 1);
+        sha256_update(&ctx, mode, mode_len + 1);
+        sha256_update(&ctx, entry->digest, strlen(entry->digest));
+        sha256_update(&ctx, "\n", 1);
+    }
+    sha256_final(&ctx, raw);
+    sha256_to_hex(raw, digest);
+
+    char **roots = realloc(cache->scanned_roots, sizeof(char*) * (cache->scanned_count + 1));
+    if (roots) {
+        cache->scanned_roots = roots;
+        roots[cache->scanned_count] = strdup(rel_path);
+        if (roots[cache->scanned_count]) {
+            cache->scanned_count++;
+        }
+    }
+
+    result = 0;
+
+out:
+    close(scan.root_fd);
+    free(scan.scan);
+    free(scan.work);
+    return result;
+}
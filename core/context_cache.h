@@ -0,0 +1,58 @@
+#ifndef CONTEXT_CACHE_H
+#define CONTEXT_CACHE_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <time.h>
+
+#include "sha256.h"
+
+#define BUILD_CACHE_DIR "/tmp/docker-build-cache"
+#define MAX_CACHE_PATH_LEN 4096
+#define MAX_HASH_THREADS 32
+
+// One file of the build context as it looked when it was last hashed.
+// An entry is reused while size, mtime and inode all still match.
+typedef struct {
+    char *path;
+    mode_t mode;
+    off_t size;
+    time_t mtime_sec;
+    long mtime_nsec;
+    ino_t inode;
+    char digest[SHA256_HEX_LEN + 1];
+    int seen;
+} context_entry_t;
+
+typedef struct {
+    char context_path[MAX_CACHE_PATH_LEN];
+    char cache_file[MAX_CACHE_PATH_LEN];
+    context_entry_t *entries;
+    int count;
+    int capacity;
+    int *slots;
+    int slot_count;
+    char **scanned_roots;
+    int scanned_count;
+    time_t scan_started;
+} context_cache_t;
+
+typedef struct {
+    int files;
+    int hashed;
+    int reused;
+    long long bytes;
+    long long bytes_hashed;
+} context_digest_stats_t;
+
+// Function declarations
+context_cache_t* load_context_cache(const char *context_path);
+int save_context_cache(context_cache_t *cache);
+void free_context_cache(context_cache_t *cache);
+int compute_context_digest(context_cache_t *cache, const char *src, char digest[SHA256_HEX_LEN + 1],
+                           context_digest_stats_t *stats);
+
+#endif // CONTEXT_CACHE_H
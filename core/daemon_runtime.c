@@ -2,6 +2,13 @@
 #include "http.h"
 #include "container.h"
 #include "image.h"
+#include "build_queue.h"
+#include "gc.h"
+#include "metrics.h"
+#include "access_log.h"
+#include "trace.h"
+#include "events.h"
+#include "reaper.h"
 #include <linux/prctl.h>
 #include <sys/prctl.h>
 
@@ -17,6 +24,8 @@ int daemon_main() {
 void daemon_signal_handler(int sig) {
     fprintf(stderr, "Daemon received signal %d, shutting down...\n", sig);
 
+    cleanup_access_log();
+    cleanup_build_queue();
     cleanup_image_system();
     cleanup_container_system();
 
@@ -31,6 +40,11 @@ static int run_daemon_foreground(void) {
     // custom signal handler called
     signal(SIGTERM, daemon_signal_handler);
     signal(SIGINT, daemon_signal_handler);
+    // Clients that disconnect mid-transfer surface as EPIPE, not a signal
+    signal(SIGPIPE, SIG_IGN);
+
+    // Before anything that publishes
+    init_events();
 
     if (init_image_system() != 0) {
         fprintf(stderr, "Failed to initialize image system\n");
@@ -43,9 +57,48 @@ static int run_daemon_foreground(void) {
         return -1;
     }
 
+    if (init_reaper() != 0) {
+        fprintf(stderr, "Failed to start container reaper\n");
+        cleanup_image_system();
+        cleanup_container_system();
+        return -1;
+    }
+
+    if (init_gc() != 0) {
+        fprintf(stderr, "Failed to initialize layer collector\n");
+        cleanup_image_system();
+        cleanup_container_system();
+        return -1;
+    }
+
+    if (init_build_queue() != 0) {
+        fprintf(stderr, "Failed to initialize build queue\n");
+        cleanup_image_system();
+        cleanup_container_system();
+        return -1;
+    }
+
+    if (init_metrics() != 0 || init_trace() != 0) {
+        fprintf(stderr, "Failed to initialize metrics and tracing\n");
+        cleanup_build_queue();
+        cleanup_image_system();
+        cleanup_container_system();
+        return -1;
+    }
+
+    if (init_access_log() != 0) {
+        fprintf(stderr, "Failed to start access log\n");
+        cleanup_build_queue();
+        cleanup_image_system();
+        cleanup_container_system();
+        return -1;
+    }
+
     int result = start_http_server(DAEMON_PORT);
     printf("Docker daemon listening on port %d\n", DAEMON_PORT);
 
+    cleanup_access_log();
+    cleanup_build_queue();
     cleanup_image_system();
     cleanup_container_system();
 
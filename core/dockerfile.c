@@ -1,5 +1,12 @@
 #include "dockerfile.h"
 #include "image.h"
+#include "context_cache.h"
+#include "registry.h"
+#include "metrics.h"
+#include "trace.h"
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
 
 instruction_type_t get_instruction_type(const char *instruction) {
     if (strcmp(instruction, "FROM") == 0) return INSTR_FROM;
@@ -45,8 +52,12 @@ char* trim_whitespace(char *str) {
 }
 
 int is_continuation_line(const char *line) {
-    const char *trimmed = trim_whitespace((char*)line);
-    return trimmed[0] == '\\' && trimmed[1] == '\0';
+    const char *end = line + strlen(line);
+
+    while (end > line && (end[-1] == ' ' || end[-1] == '\t' || end[-1] == '\n' || end[-1] == '\r')) {
+        end--;
+    }
+    return end > line && end[-1] == '\\';
 }
 
 char* parse_quoted_string(const char *str) {
@@ -73,156 +84,748 @@ char* parse_quoted_string(const char *str) {
     return result;
 }
 
-dockerfile_t* parse_dockerfile(const char *file_path) {
-    FILE *fp;
-    char line[MAX_LINE_LEN];
-    dockerfile_t *dockerfile;
-    dockerfile_instruction_t *instructions;
-    int line_number = 0;
-    int capacity = 10;
-    int count = 0;
-    char continuation_buffer[MAX_LINE_LEN] = {0};
-    int in_continuation = 0;
-
-    fp = fopen(file_path, "r");
-    if (!fp) {
-        perror("fopen dockerfile");
-        return NULL;
+static const char empty_string[] = "";
+
+static int is_blank(char c) {
+    return c == ' ' || c == '\t' || c == '\r';
+}
+
+static char* skip_line(char *p, char *end) {
+    while (p < end && *p != '\n') {
+        p++;
     }
+    return p < end ? p + 1 : end;
+}
 
-    dockerfile = malloc(sizeof(dockerfile_t));
-    if (!dockerfile) {
-        perror("malloc");
-        fclose(fp);
+// A backslash continues the instruction only when nothing but blanks follow it
+static int ends_line(const char *p, const char *end) {
+    for (p++; p < end && is_blank(*p); p++) {
+    }
+    return p >= end || *p == '\n';
+}
+
+static int push_string(arena_t *arena, string_list_t *list, const char *str) {
+    if (list->count >= list->capacity) {
+        int capacity = list->capacity ? list->capacity * 2 : 8;
+        const char **items = arena_alloc(arena, sizeof(char*) * capacity);
+        if (!items) {
+            return -1;
+        }
+        if (list->count > 0) {
+            memcpy(items, list->items, sizeof(char*) * list->count);
+        }
+        list->items = items;
+        list->capacity = capacity;
+    }
+
+    list->items[list->count++] = str;
+    return 0;
+}
+
+typedef const char* (*variable_lookup_fn)(const void *vars, const char *name, size_t len);
+
+typedef struct {
+    const char *const *items;
+    int count;
+} variable_array_t;
+
+static const char* lookup_array_variable(const void *vars, const char *name, size_t len) {
+    const variable_array_t *array = vars;
+
+    // Later definitions shadow earlier ones
+    for (int i = array->count - 1; i >= 0; i--) {
+        if (strncmp(array->items[i], name, len) == 0 && array->items[i][len] == '=') {
+            return array->items[i] + len + 1;
+        }
+    }
+    return NULL;
+}
+
+// ENV/ARG definitions visible to the parser, hashed by name so that
+// expansion stays linear in long Dockerfiles. Slots hold "NAME=value".
+typedef struct {
+    const char **slots;
+    size_t capacity;
+    size_t count;
+} variable_scope_t;
+
+static uint32_t hash_name(const char *name, size_t len) {
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < len; i++) {
+        hash = (hash ^ (unsigned char)name[i]) * 16777619u;
+    }
+    return hash;
+}
+
+static const char** scope_slot(const variable_scope_t *scope, const char *name, size_t len) {
+    size_t mask = scope->capacity - 1;
+    size_t i = hash_name(name, len) & mask;
+
+    while (scope->slots[i] &&
+           !(strncmp(scope->slots[i], name, len) == 0 && scope->slots[i][len] == '=')) {
+        i = (i + 1) & mask;
+    }
+    return &scope->slots[i];
+}
+
+static const char* lookup_scope_variable(const void *vars, const char *name, size_t len) {
+    const variable_scope_t *scope = vars;
+
+    if (scope->count == 0) {
         return NULL;
     }
 
-    memset(dockerfile, 0, sizeof(dockerfile_t));
-    instructions = malloc(sizeof(dockerfile_instruction_t) * capacity);
-    if (!instructions) {
-        perror("malloc");
-        free(dockerfile);
-        fclose(fp);
+    const char *pair = *scope_slot(scope, name, len);
+    return pair ? pair + len + 1 : NULL;
+}
+
+static int scope_define(arena_t *arena, variable_scope_t *scope, const char *pair) {
+    size_t len = strcspn(pair, "=");
+
+    if ((scope->count + 1) * 2 > scope->capacity) {
+        variable_scope_t grown = {0};
+        grown.capacity = scope->capacity ? scope->capacity * 2 : 64;
+        grown.slots = arena_calloc(arena, grown.capacity, sizeof(char*));
+        if (!grown.slots) {
+            return -1;
+        }
+        for (size_t i = 0; i < scope->capacity; i++) {
+            if (scope->slots[i]) {
+                *scope_slot(&grown, scope->slots[i], strcspn(scope->slots[i], "=")) = scope->slots[i];
+            }
+        }
+        grown.count = scope->count;
+        *scope = grown;
+    }
+
+    const char **slot = scope_slot(scope, pair, len);
+    if (!*slot) {
+        scope->count++;
+    }
+    *slot = pair;
+    return 0;
+}
+
+// Writes the expansion of str into out, or only measures it when out is NULL
+static size_t expand_into(const char *str, variable_lookup_fn lookup, const void *vars, char *out) {
+    size_t len = 0;
+
+#define EMIT(src, n) do { if (out) memcpy(out + len, (src), (n)); len += (n); } while (0)
+
+    for (const char *p = str; *p; ) {
+        if (p[0] == '\\' && p[1] == '$') {
+            EMIT("$", 1);
+            p += 2;
+            continue;
+        }
+        if (*p != '$') {
+            const char *next = p + 1;
+            while (*next && *next != '$' && *next != '\\') next++;
+            EMIT(p, (size_t)(next - p));
+            p = next;
+            continue;
+        }
+
+        const char *name = p + 1;
+        int braced = *name == '{';
+        if (braced) name++;
+
+        const char *name_end = name;
+        if (*name_end == '_' || (*name_end >= 'A' && *name_end <= 'Z') || (*name_end >= 'a' && *name_end <= 'z')) {
+            while (*name_end == '_' || (*name_end >= 'A' && *name_end <= 'Z') ||
+                   (*name_end >= 'a' && *name_end <= 'z') || (*name_end >= '0' && *name_end <= '9')) {
+                name_end++;
+            }
+        }
+
+        if (name_end == name || (braced && *name_end != '}' && *name_end != ':')) {
+            EMIT("$", 1);
+            p++;
+            continue;
+        }
+
+        const char *value = lookup(vars, name, name_end - name);
+        const char *after = name_end;
+
+        if (braced) {
+            // ${VAR:-default} and ${VAR:+alternate}
+            if (name_end[0] == ':' && (name_end[1] == '-' || name_end[1] == '+')) {
+                const char *word = name_end + 2;
+                const char *close = strchr(word, '}');
+                if (!close) {
+                    EMIT(p, strlen(p));
+                    break;
+                }
+                int use_word = name_end[1] == '-' ? (!value || !*value) : (value && *value);
+                if (use_word) {
+                    EMIT(word, (size_t)(close - word));
+                } else if (name_end[1] == '-') {
+                    EMIT(value, strlen(value));
+                }
+                p = close + 1;
+                continue;
+            }
+            if (*name_end != '}') {
+                EMIT(p, strlen(p));
+                break;
+            }
+            after = name_end + 1;
+        }
+
+        if (value) {
+            EMIT(value, strlen(value));
+        }
+        p = after;
+    }
+
+#undef EMIT
+    return len;
+}
+
+static const char* expand_with(arena_t *arena, const char *str, variable_lookup_fn lookup, const void *vars) {
+    // Nothing to substitute: keep pointing at the original text
+    if (!strchr(str, '$')) {
+        return str;
+    }
+
+    size_t len = expand_into(str, lookup, vars, NULL);
+    char *out = arena_alloc(arena, len + 1);
+    if (!out) {
         return NULL;
     }
 
-    dockerfile->instructions = instructions;
-    dockerfile->capacity = capacity;
+    expand_into(str, lookup, vars, out);
+    out[len] = '\0';
+    return out;
+}
 
-    while (fgets(line, sizeof(line), fp)) {
-        line_number++;
-        char *trimmed = trim_whitespace(line);
+const char* expand_variables(arena_t *arena, const char *str, const char *const env_vars[], int env_count) {
+    variable_array_t vars = { env_vars, env_count };
+    return expand_with(arena, str, lookup_array_variable, &vars);
+}
 
-        // Skip empty lines and comments
-        if (trimmed[0] == '\0' || trimmed[0] == '#') {
+static int decode_hex4(const char *p, unsigned int *value) {
+    *value = 0;
+    for (int i = 0; i < 4; i++) {
+        char c = p[i];
+        *value <<= 4;
+        if (c >= '0' && c <= '9') *value |= c - '0';
+        else if (c >= 'a' && c <= 'f') *value |= c - 'a' + 10;
+        else if (c >= 'A' && c <= 'F') *value |= c - 'A' + 10;
+        else return -1;
+    }
+    return 0;
+}
+
+// Parses ["a", "b"] exec form into arena-allocated, unescaped strings.
+// Anything that is not a well-formed array of strings is shell form.
+static int parse_exec_form(arena_t *arena, dockerfile_instruction_t *instruction) {
+    const char *p = instruction->args;
+    string_list_t argv = {0};
+
+    if (*p++ != '[') {
+        return 0;
+    }
+
+    for (;;) {
+        while (is_blank(*p)) p++;
+        if (*p == ']' && argv.count == 0) {
+            p++;
+            break;
+        }
+        if (*p != '"') {
+            return 0;
+        }
+
+        const char *start = ++p;
+        while (*p && *p != '"') {
+            if (*p == '\\' && p[1]) p++;
+            p++;
+        }
+        if (*p != '"') {
+            return 0;
+        }
+
+        // Escapes only ever shrink, so the raw length bounds the output
+        char *value = arena_alloc(arena, (p - start) + 4);
+        if (!value) {
+            return -1;
+        }
+
+        char *w = value;
+        for (const char *r = start; r < p; r++) {
+            if (*r != '\\') {
+                *w++ = *r;
+                continue;
+            }
+            r++;
+            switch (*r) {
+                case 'n': *w++ = '\n'; break;
+                case 't': *w++ = '\t'; break;
+                case 'r': *w++ = '\r'; break;
+                case 'b': *w++ = '\b'; break;
+                case 'f': *w++ = '\f'; break;
+                case 'u': {
+                    unsigned int code;
+                    if (decode_hex4(r + 1, &code) != 0) {
+                        return 0;
+                    }
+                    r += 4;
+                    if (code < 0x80) {
+                        *w++ = code;
+                    } else if (code < 0x800) {
+                        *w++ = 0xc0 | (code >> 6);
+                        *w++ = 0x80 | (code & 0x3f);
+                    } else {
+                        *w++ = 0xe0 | (code >> 12);
+                        *w++ = 0x80 | ((code >> 6) & 0x3f);
+                        *w++ = 0x80 | (code & 0x3f);
+                    }
+                    break;
+                }
+                default: *w++ = *r; break;
+            }
+        }
+        *w = '\0';
+
+        if (push_string(arena, &argv, value) != 0) {
+            return -1;
+        }
+
+        p++;
+        while (is_blank(*p)) p++;
+        if (*p == ',') {
+            p++;
             continue;
         }
+        if (*p == ']') {
+            p++;
+            break;
+        }
+        return 0;
+    }
+
+    while (is_blank(*p)) p++;
+    if (*p != '\0') {
+        return 0;
+    }
+
+    instruction->argv = argv.items;
+    instruction->argc = argv.count;
+    return 0;
+}
+
+// Collects the body of a <<WORD heredoc that starts at *cursor. The body
+// stays in the mapping; the terminator line's first byte becomes its NUL.
+static int read_heredoc(dockerfile_instruction_t *instruction, char **cursor, char *end, int *line_number) {
+    const char *marker = strstr(instruction->args, "<<");
+    char word[64];
+    int strip_tabs = 0;
+    size_t word_len = 0;
+
+    if (!marker) {
+        return 0;
+    }
+
+    marker += 2;
+    if (*marker == '-') {
+        strip_tabs = 1;
+        marker++;
+    }
+    char quote = (*marker == '"' || *marker == '\'') ? *marker++ : 0;
+    while ((marker[word_len] == '_' || (marker[word_len] >= 'A' && marker[word_len] <= 'Z') ||
+            (marker[word_len] >= 'a' && marker[word_len] <= 'z') ||
+            (marker[word_len] >= '0' && marker[word_len] <= '9')) && word_len < sizeof(word) - 1) {
+        word[word_len] = marker[word_len];
+        word_len++;
+    }
+    word[word_len] = '\0';
+    if (word_len == 0 || (quote && marker[word_len] != quote)) {
+        return 0;
+    }
+
+    char *body = *cursor;
+    char *w = body;
+    char *r = body;
+
+    while (r < end) {
+        char *content = r;
+        char *line_end = r;
+
+        if (strip_tabs) {
+            while (content < end && *content == '\t') content++;
+        }
+        while (line_end < end && *line_end != '\n') line_end++;
+
+        char *trimmed_end = line_end;
+        if (trimmed_end > content && trimmed_end[-1] == '\r') trimmed_end--;
+
+        (*line_number)++;
+        if ((size_t)(trimmed_end - content) == word_len && strncmp(content, word, word_len) == 0) {
+            instruction->heredoc = body;
+            instruction->heredoc_len = w - body;
+            *w = '\0';
+            *cursor = line_end < end ? line_end + 1 : end;
+            return 0;
+        }
+
+        // <<- strips leading tabs from every body line as well
+        size_t len = (line_end < end ? line_end + 1 : end) - content;
+        memmove(w, content, len);
+        w += len;
+        r = line_end < end ? line_end + 1 : end;
+    }
+
+    fprintf(stderr, "Unterminated heredoc <<%s at line %d\n", word, instruction->line_number);
+    return -1;
+}
+
+// Splits ENV arguments into KEY=VALUE strings, in either the KEY=VALUE ...
+// form (with quoting) or the legacy "KEY value with spaces" form.
+static int parse_env_pairs(arena_t *arena, const char *args, string_list_t *env, variable_scope_t *scope) {
+    const char *p = args;
+    const char *first_blank = args + strcspn(args, " \t");
+    const char *first_equals = strchr(args, '=');
+
+    if (!first_equals || first_equals > first_blank) {
+        const char *value = first_blank;
+        while (is_blank(*value)) value++;
+
+        size_t key_len = first_blank - args;
+        char *pair = arena_alloc(arena, key_len + strlen(value) + 2);
+        if (!pair) return -1;
+        memcpy(pair, args, key_len);
+        pair[key_len] = '=';
+        strcpy(pair + key_len + 1, value);
+        return (push_string(arena, env, pair) || scope_define(arena, scope, pair)) ? -1 : 0;
+    }
+
+    while (*p) {
+        while (is_blank(*p)) p++;
+        if (!*p) break;
+
+        const char *equals = strchr(p, '=');
+        if (!equals) {
+            fprintf(stderr, "ENV expects KEY=VALUE: %s\n", p);
+            return -1;
+        }
+
+        // Values only shrink once quotes and escapes are removed
+        char *pair = arena_alloc(arena, strlen(p) + 1);
+        if (!pair) return -1;
+
+        char *w = pair;
+        memcpy(w, p, equals - p + 1);
+        w += equals - p + 1;
+        p = equals + 1;
+
+        char quote = 0;
+        while (*p && (quote || !is_blank(*p))) {
+            if (!quote && (*p == '"' || *p == '\'')) {
+                quote = *p++;
+            } else if (quote && *p == quote) {
+                quote = 0;
+                p++;
+            } else if (*p == '\\' && p[1] && quote != '\'') {
+                p++;
+                *w++ = *p++;
+            } else {
+                *w++ = *p++;
+            }
+        }
+        *w = '\0';
+
+        if (push_string(arena, env, pair) != 0 || scope_define(arena, scope, pair) != 0) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+static int split_words(arena_t *arena, const char *args, string_list_t *list) {
+    const char *p = args;
+
+    while (*p) {
+        while (is_blank(*p)) p++;
+        if (!*p) break;
+
+        const char *start = p;
+        while (*p && !is_blank(*p)) p++;
 
-        // Handle continuation lines
-        if (is_continuation_line(trimmed)) {
-            in_continuation = 1;
+        const char *word = arena_strndup(arena, start, p - start);
+        if (!word || push_string(arena, list, word) != 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static int expands_variables(instruction_type_t type) {
+    switch (type) {
+        case INSTR_ADD:
+        case INSTR_COPY:
+        case INSTR_ENV:
+        case INSTR_EXPOSE:
+        case INSTR_FROM:
+        case INSTR_LABEL:
+        case INSTR_STOPSIGNAL:
+        case INSTR_USER:
+        case INSTR_VOLUME:
+        case INSTR_WORKDIR:
+            return 1;
+        default:
+            return 0;
+    }
+}
+
+static int accepts_exec_form(instruction_type_t type) {
+    switch (type) {
+        case INSTR_RUN:
+        case INSTR_CMD:
+        case INSTR_ENTRYPOINT:
+        case INSTR_SHELL:
+        case INSTR_COPY:
+        case INSTR_ADD:
+        case INSTR_VOLUME:
+            return 1;
+        default:
+            return 0;
+    }
+}
+
+static char* map_dockerfile(const char *file_path, size_t *file_size, size_t *map_size) {
+    struct stat st;
+    long page = sysconf(_SC_PAGESIZE);
+    char *base;
+    int fd;
+
+    fd = open(file_path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        perror("open dockerfile");
+        return NULL;
+    }
+
+    if (fstat(fd, &st) != 0) {
+        perror("fstat dockerfile");
+        close(fd);
+        return NULL;
+    }
+
+    // Reserve at least one zero byte past EOF so the final line can be
+    // terminated in place even when the file fills its last page exactly
+    *file_size = st.st_size;
+    *map_size = ((size_t)st.st_size + 1 + page - 1) & ~(size_t)(page - 1);
+
+    base = mmap(NULL, *map_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (base == MAP_FAILED) {
+        perror("mmap");
+        close(fd);
+        return NULL;
+    }
+
+    // Private mapping: folding continuations writes to our copy, never the file
+    if (st.st_size > 0 &&
+        mmap(base, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, fd, 0) == MAP_FAILED) {
+        perror("mmap dockerfile");
+        munmap(base, *map_size);
+        close(fd);
+        return NULL;
+    }
+
+    close(fd);
+    return base;
+}
+
+dockerfile_t* parse_dockerfile(const char *file_path) {
+    dockerfile_t *dockerfile;
+    variable_scope_t scope = {0};
+    size_t file_size;
+    int line_number = 1;
+
+    dockerfile = calloc(1, sizeof(dockerfile_t));
+    if (!dockerfile) {
+        perror("calloc");
+        return NULL;
+    }
+
+    dockerfile->map = map_dockerfile(file_path, &file_size, &dockerfile->map_size);
+    if (!dockerfile->map) {
+        free(dockerfile);
+        return NULL;
+    }
+
+    arena_init(&dockerfile->arena, 0);
+    dockerfile->base_image = empty_string;
+    dockerfile->working_dir = empty_string;
+    dockerfile->user = empty_string;
+    dockerfile->shell = empty_string;
+    dockerfile->entrypoint = empty_string;
+    dockerfile->cmd = empty_string;
+
+    char *p = dockerfile->map;
+    char *end = dockerfile->map + file_size;
+
+    while (p < end) {
+        // Skip indentation, blank lines and comments
+        while (p < end && is_blank(*p)) p++;
+        if (p >= end) break;
+        if (*p == '\n' || *p == '#') {
+            p = skip_line(p, end);
+            line_number++;
             continue;
         }
 
-        if (in_continuation) {
-            strcat(continuation_buffer, " ");
-            strcat(continuation_buffer, trimmed);
-            in_continuation = 0;
-            trimmed = continuation_buffer;
-            memset(continuation_buffer, 0, sizeof(continuation_buffer));
+        int instruction_line = line_number;
+        char *keyword = p;
+        while (p < end && ((*p >= 'A' && *p <= 'Z') || (*p >= 'a' && *p <= 'z'))) {
+            if (*p >= 'a') *p -= 'a' - 'A';
+            p++;
         }
 
-        // Parse instruction
-        char *space = strchr(trimmed, ' ');
-        if (!space) {
-            fprintf(stderr, "Invalid instruction at line %d: %s\n", line_number, trimmed);
+        if (p == keyword || p >= end || !is_blank(*p)) {
+            char *line_end = p;
+            while (line_end < end && *line_end != '\n') line_end++;
+            fprintf(stderr, "Invalid instruction at line %d: %.*s\n", instruction_line,
+                    (int)(line_end - keyword), keyword);
+            p = skip_line(p, end);
+            line_number++;
             continue;
         }
 
-        *space = '\0';
-        char *instruction = trimmed;
-        char *args = space + 1;
+        char *keyword_end = p;
+        while (p < end && is_blank(*p)) p++;
+
+        // Fold the logical line in place: drop backslash-newlines and any
+        // comment lines inside the continuation. Output never outruns input.
+        char *args = p;
+        char *w = p;
+        char *r = p;
+        while (r < end && *r != '\n') {
+            if (*r == '\\' && ends_line(r, end)) {
+                r = skip_line(r, end);
+                line_number++;
+                for (;;) {
+                    char *q = r;
+                    while (q < end && is_blank(*q)) q++;
+                    if (q < end && (*q == '#' || *q == '\n')) {
+                        r = skip_line(q, end);
+                        line_number++;
+                        continue;
+                    }
+                    break;
+                }
+                continue;
+            }
+            *w++ = *r++;
+        }
+        while (w > args && is_blank(w[-1])) w--;
+        *w = '\0';
+        *keyword_end = '\0';
+
+        p = r < end ? r + 1 : end;
+        line_number++;
 
-        instruction_type_t type = get_instruction_type(instruction);
+        instruction_type_t type = get_instruction_type(keyword);
         if (type == INSTR_UNKNOWN) {
-            fprintf(stderr, "Unknown instruction at line %d: %s\n", line_number, instruction);
+            fprintf(stderr, "Unknown instruction at line %d: %s\n", instruction_line, keyword);
             continue;
         }
 
-        // Resize array if needed
-        if (count >= capacity) {
-            capacity *= 2;
-            instructions = realloc(instructions, sizeof(dockerfile_instruction_t) * capacity);
-            if (!instructions) {
-                perror("realloc");
-                free(dockerfile);
-                fclose(fp);
+        dockerfile_instruction_t *instruction = arena_calloc(&dockerfile->arena, 1, sizeof(dockerfile_instruction_t));
+        if (!instruction) {
+            free_dockerfile(dockerfile);
+            return NULL;
+        }
+
+        instruction->type = type;
+        instruction->instruction = keyword;
+        instruction->args = args;
+        instruction->args_len = w - args;
+        instruction->line_number = instruction_line;
+
+        if ((type == INSTR_RUN || type == INSTR_COPY || type == INSTR_ADD) &&
+            read_heredoc(instruction, &p, end, &line_number) != 0) {
+            free_dockerfile(dockerfile);
+            return NULL;
+        }
+
+        if (expands_variables(type)) {
+            instruction->args = expand_with(&dockerfile->arena, args, lookup_scope_variable, &scope);
+            if (!instruction->args) {
+                free_dockerfile(dockerfile);
                 return NULL;
             }
-            dockerfile->instructions = instructions;
-            dockerfile->capacity = capacity;
+            instruction->args_len = strlen(instruction->args);
         }
 
-        // Store instruction
-        memset(&instructions[count], 0, sizeof(dockerfile_instruction_t));
-        instructions[count].type = type;
-        strncpy(instructions[count].instruction, instruction, sizeof(instructions[count].instruction) - 1);
-        strncpy(instructions[count].args, args, sizeof(instructions[count].args) - 1);
-        instructions[count].line_number = line_number;
+        if (accepts_exec_form(type) && parse_exec_form(&dockerfile->arena, instruction) != 0) {
+            free_dockerfile(dockerfile);
+            return NULL;
+        }
 
-        // Parse specific instruction arguments
+        int status = 0;
         switch (type) {
             case INSTR_FROM:
-                strncpy(dockerfile->base_image, args, sizeof(dockerfile->base_image) - 1);
+                dockerfile->base_image = instruction->args;
                 break;
             case INSTR_WORKDIR:
-                strncpy(dockerfile->working_dir, args, sizeof(dockerfile->working_dir) - 1);
+                dockerfile->working_dir = instruction->args;
                 break;
             case INSTR_USER:
-                strncpy(dockerfile->user, args, sizeof(dockerfile->user) - 1);
+                dockerfile->user = instruction->args;
                 break;
             case INSTR_SHELL:
-                strncpy(dockerfile->shell, args, sizeof(dockerfile->shell) - 1);
+                dockerfile->shell = instruction->args;
                 break;
             case INSTR_ENTRYPOINT:
-                strncpy(dockerfile->entrypoint, args, sizeof(dockerfile->entrypoint) - 1);
+                dockerfile->entrypoint = instruction->args;
                 break;
             case INSTR_CMD:
-                strncpy(dockerfile->cmd, args, sizeof(dockerfile->cmd) - 1);
+                dockerfile->cmd = instruction->args;
                 break;
             case INSTR_ENV:
-                if (dockerfile->env_count < MAX_ENV_VAR_LEN) {
-                    dockerfile->env_vars[dockerfile->env_count] = strdup(args);
-                    dockerfile->env_count++;
+                status = parse_env_pairs(&dockerfile->arena, instruction->args, &dockerfile->env_vars, &scope);
+                break;
+            case INSTR_ARG:
+                status = push_string(&dockerfile->arena, &dockerfile->build_args, instruction->args);
+                if (status == 0 && strchr(instruction->args, '=')) {
+                    status = scope_define(&dockerfile->arena, &scope, instruction->args);
                 }
                 break;
             case INSTR_EXPOSE:
-                if (dockerfile->port_count < MAX_PORT_LEN) {
-                    dockerfile->exposed_ports[dockerfile->port_count] = strdup(args);
-                    dockerfile->port_count++;
-                }
+                status = split_words(&dockerfile->arena, instruction->args, &dockerfile->exposed_ports);
                 break;
             case INSTR_VOLUME:
-                if (dockerfile->volume_count < MAX_VOLUME_LEN) {
-                    dockerfile->volumes[dockerfile->volume_count] = strdup(args);
-                    dockerfile->volume_count++;
+                if (instruction->argv) {
+                    for (int i = 0; i < instruction->argc && status == 0; i++) {
+                        status = push_string(&dockerfile->arena, &dockerfile->volumes, instruction->argv[i]);
+                    }
+                } else {
+                    status = split_words(&dockerfile->arena, instruction->args, &dockerfile->volumes);
                 }
                 break;
             case INSTR_LABEL:
-                if (dockerfile->label_count < MAX_ENV_VAR_LEN) {
-                    dockerfile->labels[dockerfile->label_count] = strdup(args);
-                    dockerfile->label_count++;
-                }
+                status = push_string(&dockerfile->arena, &dockerfile->labels, instruction->args);
                 break;
             default:
                 break;
         }
 
-        count++;
-    }
+        if (status != 0) {
+            fprintf(stderr, "Failed to parse %s at line %d\n", keyword, instruction_line);
+            free_dockerfile(dockerfile);
+            return NULL;
+        }
 
-    dockerfile->count = count;
-    fclose(fp);
+        if (dockerfile->last) {
+            dockerfile->last->next = instruction;
+        } else {
+            dockerfile->instructions = instruction;
+        }
+        dockerfile->last = instruction;
+        dockerfile->count++;
+    }
 
     return dockerfile;
 }
@@ -230,26 +833,10 @@ dockerfile_t* parse_dockerfile(const char *file_path) {
 void free_dockerfile(dockerfile_t *dockerfile) {
     if (!dockerfile) return;
 
-    if (dockerfile->instructions) {
-        free(dockerfile->instructions);
-    }
-
-    for (int i = 0; i < dockerfile->env_count; i++) {
-        free(dockerfile->env_vars[i]);
-    }
-
-    for (int i = 0; i < dockerfile->port_count; i++) {
-        free(dockerfile->exposed_ports[i]);
+    arena_free(&dockerfile->arena);
+    if (dockerfile->map) {
+        munmap(dockerfile->map, dockerfile->map_size);
     }
-
-    for (int i = 0; i < dockerfile->volume_count; i++) {
-        free(dockerfile->volumes[i]);
-    }
-
-    for (int i = 0; i < dockerfile->label_count; i++) {
-        free(dockerfile->labels[i]);
-    }
-
     free(dockerfile);
 }
 
@@ -264,19 +851,23 @@ int validate_dockerfile(dockerfile_t *dockerfile) {
         return 0;
     }
 
-    // First instruction must be FROM
-    if (dockerfile->instructions[0].type != INSTR_FROM) {
+    // First instruction must be FROM, optionally preceded by ARGs
+    dockerfile_instruction_t *first = dockerfile->instructions;
+    while (first && first->type == INSTR_ARG) {
+        first = first->next;
+    }
+    if (!first || first->type != INSTR_FROM) {
         fprintf(stderr, "First instruction must be FROM\n");
         return 0;
     }
 
     // Check for invalid instruction combinations
     int has_entrypoint = 0, has_cmd = 0;
-    for (int i = 0; i < dockerfile->count; i++) {
-        if (dockerfile->instructions[i].type == INSTR_ENTRYPOINT) {
+    for (dockerfile_instruction_t *instruction = dockerfile->instructions; instruction; instruction = instruction->next) {
+        if (instruction->type == INSTR_ENTRYPOINT) {
             has_entrypoint = 1;
         }
-        if (dockerfile->instructions[i].type == INSTR_CMD) {
+        if (instruction->type == INSTR_CMD) {
             has_cmd = 1;
         }
     }
@@ -288,64 +879,591 @@ int validate_dockerfile(dockerfile_t *dockerfile) {
     return 1;
 }
 
+static double elapsed_ms(const struct timespec *start) {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) * 1000.0 + (now.tv_nsec - start->tv_nsec) / 1000000.0;
+}
+
+static void emit_build_event(build_progress_t *progress, build_event_t *event) {
+    if (progress && progress->callback) {
+        progress->callback(event, progress->user_data);
+        return;
+    }
+
+    // Without a listener progress goes to the daemon's own output
+    switch (event->type) {
+        case BUILD_EVENT_STEP_START:
+            printf("Step %d/%d: %s %s\n", event->step, event->total, event->instruction, event->args);
+            break;
+        case BUILD_EVENT_STEP_END:
+            printf(" ---> %s%.1f ms", event->stats->cached ? "Using cache, " : "", event->duration_ms);
+            if (event->stats->digest[0]) {
+                printf(", context sha256:%.12s (%d cached, %d rehashed, %lld bytes)",
+                       event->stats->digest, event->stats->cache_hits,
+                       event->stats->cache_misses, event->stats->bytes_copied);
+            }
+            printf("\n");
+            break;
+        case BUILD_EVENT_ERROR:
+            fprintf(stderr, "%s\n", event->message);
+            break;
+        case BUILD_EVENT_COMPLETE:
+            printf("Build finished in %.1f ms\n", event->duration_ms);
+            break;
+    }
+}
+
+static int fail_build(build_progress_t *progress, int step, int total, const char *message) {
+    build_event_t event = {0};
+
+    event.type = BUILD_EVENT_ERROR;
+    event.step = step;
+    event.total = total;
+    event.message = message;
+    emit_build_event(progress, &event);
+    return -1;
+}
+
+int create_build_dir(char *path, size_t size) {
+    if (mkdir(BUILD_ROOT_DIR, 0755) != 0 && errno != EEXIST) {
+        perror("mkdir build root");
+        return -1;
+    }
+
+    snprintf(path, size, "%s/build-XXXXXX", BUILD_ROOT_DIR);
+    if (!mkdtemp(path)) {
+        perror("mkdtemp");
+        return -1;
+    }
+    return 0;
+}
+
+void remove_build_dir(const char *path) {
+    char rm_cmd[MAX_PATH_LEN + 16];
+
+    // Never let a bad path escape the build root
+    if (strncmp(path, BUILD_ROOT_DIR "/build-", strlen(BUILD_ROOT_DIR "/build-")) != 0) {
+        return;
+    }
+
+    snprintf(rm_cmd, sizeof(rm_cmd), "rm -rf '%s'", path);
+    system(rm_cmd);
+}
+
 int build_image_from_dockerfile(dockerfile_t *dockerfile, const char *image_name, const char *tag, const char *context_path) {
-    char layer_path[MAX_PATH_LEN];
-    char command[MAX_COMMAND_LEN];
+    char build_dir[MAX_PATH_LEN];
+    trace_span_t span;
+    int result;
 
-    if (!validate_dockerfile(dockerfile)) {
+    trace_begin(&span, "build");
+    if (create_build_dir(build_dir, sizeof(build_dir)) != 0) {
+        trace_end(&span, "failed");
         return -1;
     }
 
-    // Create base layer from base image
-    strcpy(layer_path, "/tmp/docker-build-layer");
-    if (mkdir(layer_path, 0755) != 0 && errno != EEXIST) {
-        perror("mkdir layer");
+    result = build_image_with_progress(dockerfile, image_name, tag, context_path, build_dir,
+                                       IMAGE_COMPRESSION_NONE, NULL);
+    remove_build_dir(build_dir);
+    trace_end(&span, image_name);
+    return result;
+}
+
+// The id of the local image a FROM names, or "scratch". Fails when the
+// image is not in the local store and would have to be pulled.
+static int base_image_id(const char *args, char *id, size_t size) {
+    char base[MAX_ARG_LEN];
+    char full_name[MAX_IMAGE_NAME_LEN + MAX_IMAGE_TAG_LEN + 2];
+    registry_ref_t ref;
+    image_info_t image;
+
+    if (sscanf(args, "%511s", base) != 1) {
         return -1;
     }
+    if (strcasecmp(base, "scratch") == 0) {
+        snprintf(id, size, "scratch");
+        return 0;
+    }
+    if (parse_registry_ref(base, &ref) != 0 ||
+        resolve_image_name(get_image_full_name(ref.local_name, ref.local_tag), full_name, sizeof(full_name)) != 0 ||
+        read_image_metadata(full_name, &image) != 0) {
+        return -1;
+    }
+    snprintf(id, size, "%s", image.id);
+    free(image.layers);
+    return 0;
+}
 
-    // Execute each instruction
-    for (int i = 0; i < dockerfile->count; i++) {
-        dockerfile_instruction_t *instruction = &dockerfile->instructions[i];
+// The operands of a COPY or ADD, the last one being the destination: the
+// exec form's array as the parser unquoted it, or the shell form's words
+#define MAX_COPY_OPERANDS 64
 
-        printf("Step %d/%d: %s %s\n", i + 1, dockerfile->count,
-               instruction->instruction, instruction->args);
+typedef struct {
+    const char *words[MAX_COPY_OPERANDS];
+    int count;
+    char buf[MAX_ARG_LEN];
+} copy_operands_t;
 
-        if (execute_instruction(instruction, context_path, layer_path) != 0) {
-            fprintf(stderr, "Failed to execute instruction at line %d\n", instruction->line_number);
+static int copy_operands(const dockerfile_instruction_t *instruction, copy_operands_t *ops) {
+    char *save = NULL;
+
+    ops->count = 0;
+    if (instruction->argv) {
+        if (instruction->argc > MAX_COPY_OPERANDS) {
+            fprintf(stderr, "%s has too many sources (line %d)\n", instruction->instruction, instruction->line_number);
+            return -1;
+        }
+        for (int i = 0; i < instruction->argc; i++) {
+            ops->words[ops->count++] = instruction->argv[i];
+        }
+    } else {
+        if (snprintf(ops->buf, sizeof(ops->buf), "%s", instruction->args) >= (int)sizeof(ops->buf)) {
+            fprintf(stderr, "%s arguments too long (line %d)\n", instruction->instruction, instruction->line_number);
             return -1;
         }
+        for (char *word = strtok_r(ops->buf, " \t", &save); word; word = strtok_r(NULL, " \t", &save)) {
+            if (ops->count == MAX_COPY_OPERANDS) {
+                fprintf(stderr, "%s has too many sources (line %d)\n", instruction->instruction, instruction->line_number);
+                return -1;
+            }
+            ops->words[ops->count++] = word;
+        }
+    }
+
+    if (ops->count < 2) {
+        fprintf(stderr, "%s requires a source and a destination: %s\n", instruction->instruction, instruction->args);
+        return -1;
+    }
+    return 0;
+}
+
+// Digests a COPY or ADD source into the step's stats. This is also what
+// keeps the source inside the build context. Several sources digest to
+// the hash of each name and its digest.
+static int digest_copy_source(context_cache_t *cache, const dockerfile_instruction_t *instruction,
+                              build_step_stats_t *stats) {
+    copy_operands_t ops;
+    context_digest_stats_t digest_stats;
+    char digest[SHA256_HEX_LEN + 1];
+    uint8_t raw[SHA256_DIGEST_LEN];
+    sha256_ctx_t ctx;
+    int sources;
+
+    if (copy_operands(instruction, &ops) != 0) {
+        return -1;
+    }
+    sources = ops.count - 1;
+
+    stats->cache_hits = 0;
+    stats->cache_misses = 0;
+    stats->bytes_copied = 0;
+    sha256_init(&ctx);
+    for (int i = 0; i < sources; i++) {
+        if (compute_context_digest(cache, ops.words[i], digest, &digest_stats) != 0) {
+            return -1;
+        }
+        stats->cache_hits += digest_stats.reused;
+        stats->cache_misses += digest_stats.hashed;
+        stats->bytes_copied += digest_stats.bytes;
+        if (sources == 1) {
+            memcpy(stats->digest, digest, sizeof(digest));
+            return 0;
+        }
+        sha256_update(&ctx, ops.words[i], strlen(ops.words[i]) + 1);
+        sha256_update(&ctx, digest, SHA256_HEX_LEN + 1);
+    }
+
+    sha256_final(&ctx, raw);
+    sha256_to_hex(raw, stats->digest);
+    return 0;
+}
+
+// Keys the build on its instructions, the base image each FROM starts
+// from and the context digest of each COPY and ADD: the same key builds
+// the same image. The context cache is loaded and saved once for all of
+// them. A step whose source cannot be digested fails the build and is
+// returned in *failed_step; a base image that must be pulled first leaves
+// the build unkeyed, with key empty.
+static int key_build(dockerfile_t *dockerfile, const char *context_path, image_compression_t compression,
+                     build_step_stats_t *steps, char key[SHA256_HEX_LEN + 1], int *failed_step) {
+    const char *compression_name = image_compression_name(compression);
+    context_cache_t *cache = NULL;
+    char base_id[MAX_IMAGE_ID_LEN];
+    char heredoc_len[32];
+    uint8_t raw[SHA256_DIGEST_LEN];
+    sha256_ctx_t ctx;
+    int keyed = 1;
+    int result = 0;
+    int i = 0;
+
+    sha256_init(&ctx);
+    sha256_update(&ctx, compression_name, strlen(compression_name) + 1);
+
+    for (dockerfile_instruction_t *instruction = dockerfile->instructions; instruction; instruction = instruction->next, i++) {
+        int len = snprintf(heredoc_len, sizeof(heredoc_len), "%zu", instruction->heredoc ? instruction->heredoc_len : 0);
+
+        sha256_update(&ctx, instruction->instruction, strlen(instruction->instruction) + 1);
+        sha256_update(&ctx, instruction->args, strlen(instruction->args) + 1);
+        sha256_update(&ctx, heredoc_len, len + 1);
+        if (instruction->heredoc) {
+            sha256_update(&ctx, instruction->heredoc, instruction->heredoc_len);
+        }
+
+        if (instruction->type == INSTR_FROM) {
+            if (base_image_id(instruction->args, base_id, sizeof(base_id)) == 0) {
+                sha256_update(&ctx, base_id, strlen(base_id) + 1);
+            } else {
+                keyed = 0;
+            }
+        } else if (instruction->type == INSTR_ADD || (instruction->type == INSTR_COPY && !instruction->heredoc)) {
+            // Only files whose stat changed since the last build are rehashed
+            if ((!cache && !(cache = load_context_cache(context_path))) ||
+                digest_copy_source(cache, instruction, &steps[i]) != 0) {
+                *failed_step = i;
+                result = -1;
+                break;
+            }
+            sha256_update(&ctx, steps[i].digest, SHA256_HEX_LEN + 1);
+        }
+    }
+
+    if (cache) {
+        save_context_cache(cache);
+        free_context_cache(cache);
+    }
+
+    key[0] = '\0';
+    if (result == 0 && keyed) {
+        sha256_final(&ctx, raw);
+        sha256_to_hex(raw, key);
+    }
+    return result;
+}
+
+// The name:tag of the image an earlier build with this key produced, if
+// that image is still around
+static int find_build_result(const char *key, char *full_name, size_t size) {
+    char path[MAX_PATH_LEN];
+    char image_id[MAX_IMAGE_ID_LEN];
+    FILE *fp;
+
+    snprintf(path, sizeof(path), "%s/%s", BUILD_RESULT_DIR, key);
+    fp = fopen(path, "r");
+    if (!fp) {
+        return -1;
+    }
+    if (!fgets(image_id, sizeof(image_id), fp)) {
+        fclose(fp);
+        return -1;
+    }
+    fclose(fp);
+
+    image_id[strcspn(image_id, "\n")] = '\0';
+    return resolve_image_name(image_id, full_name, size);
+}
+
+static void record_build_result(const char *key, const char *image_id) {
+    char path[MAX_PATH_LEN];
+    char tmp_path[MAX_PATH_LEN + 16];
+    FILE *fp;
+
+    if (mkdir(BUILD_RESULT_DIR, 0755) != 0 && errno != EEXIST) {
+        perror("mkdir build results");
+        return;
+    }
+
+    snprintf(path, sizeof(path), "%s/%s", BUILD_RESULT_DIR, key);
+    snprintf(tmp_path, sizeof(tmp_path), "%s.%d", path, getpid());
+    fp = fopen(tmp_path, "w");
+    if (!fp) {
+        perror("fopen build result");
+        return;
+    }
+    fprintf(fp, "%s\n", image_id);
+    if (fclose(fp) != 0 || rename(tmp_path, path) != 0) {
+        perror("write build result");
+        unlink(tmp_path);
+    }
+}
+
+int build_image_with_progress(dockerfile_t *dockerfile, const char *image_name, const char *tag,
+                              const char *context_path, const char *build_dir, image_compression_t compression,
+                              build_progress_t *progress) {
+    char layer_path[MAX_PATH_LEN + 16];
+    char message[MAX_ARG_LEN + 64];
+    char key[SHA256_HEX_LEN + 1];
+    char full_name[MAX_IMAGE_NAME_LEN + MAX_IMAGE_TAG_LEN + 2];
+    char cached_name[MAX_IMAGE_NAME_LEN + MAX_IMAGE_TAG_LEN + 2];
+    struct timespec build_start;
+    build_step_stats_t *steps;
+    build_event_t event;
+    image_info_t image;
+    int cached;
+    int failed_step = 0;
+    int i = 0;
+
+    if (!validate_dockerfile(dockerfile)) {
+        return fail_build(progress, 0, dockerfile ? dockerfile->count : 0, "Invalid Dockerfile");
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &build_start);
+
+    steps = calloc(dockerfile->count, sizeof(build_step_stats_t));
+    if (!steps) {
+        perror("calloc");
+        return fail_build(progress, 0, dockerfile->count, "Failed to start build");
+    }
+
+    dockerfile_instruction_t *instruction = dockerfile->instructions;
+    if (key_build(dockerfile, context_path, compression, steps, key, &failed_step) != 0) {
+        for (i = 0; i < failed_step; i++) {
+            instruction = instruction->next;
+        }
+        snprintf(message, sizeof(message), "Failed to execute instruction at line %d: %s %s",
+                 instruction->line_number, instruction->instruction, instruction->args);
+        free(steps);
+        return fail_build(progress, failed_step + 1, dockerfile->count, message);
     }
 
+    // An unchanged rebuild retags what the last one made and copies nothing
+    snprintf(full_name, sizeof(full_name), "%s", get_image_full_name(image_name, tag));
+    cached = key[0] && find_build_result(key, cached_name, sizeof(cached_name)) == 0 &&
+             (strcmp(cached_name, full_name) == 0 || tag_image(cached_name, image_name, tag) == 0);
+
+    // Each build assembles its layer inside its own private directory
+    snprintf(layer_path, sizeof(layer_path), "%s/rootfs", build_dir);
+    if (!cached && mkdir(layer_path, 0755) != 0 && errno != EEXIST) {
+        perror("mkdir layer");
+        free(steps);
+        return fail_build(progress, 0, dockerfile->count, "Failed to create build layer");
+    }
+
+    // Execute each instruction
+    i = 0;
+    for (instruction = dockerfile->instructions; instruction; instruction = instruction->next, i++) {
+        build_step_stats_t *stats = &steps[i];
+        struct timespec step_start;
+        char detail[TRACE_DETAIL_LEN];
+        trace_span_t span;
+
+        memset(&event, 0, sizeof(event));
+        event.type = BUILD_EVENT_STEP_START;
+        event.step = i + 1;
+        event.total = dockerfile->count;
+        event.instruction = instruction->instruction;
+        event.args = instruction->args;
+        event.stats = stats;
+        emit_build_event(progress, &event);
+
+        if (cached) {
+            stats->cached = 1;
+            stats->bytes_copied = 0;
+            event.type = BUILD_EVENT_STEP_END;
+            emit_build_event(progress, &event);
+            continue;
+        }
+
+        snprintf(detail, sizeof(detail), "%s %s", instruction->instruction, instruction->args);
+        trace_begin(&span, "step");
+        clock_gettime(CLOCK_MONOTONIC, &step_start);
+        if (execute_instruction(instruction, context_path, layer_path) != 0) {
+            trace_end(&span, detail);
+            metrics_observe_build_step(instruction->type, 1, stats, metrics_elapsed_us(&step_start));
+            snprintf(message, sizeof(message), "Failed to execute instruction at line %d: %s %s",
+                     instruction->line_number, instruction->instruction, instruction->args);
+            free(steps);
+            return fail_build(progress, i + 1, dockerfile->count, message);
+        }
+
+        event.type = BUILD_EVENT_STEP_END;
+        event.duration_ms = elapsed_ms(&step_start);
+        metrics_observe_build_step(instruction->type, 0, stats, metrics_elapsed_us(&step_start));
+        trace_end(&span, detail);
+        emit_build_event(progress, &event);
+    }
+    free(steps);
+
     // Create final image
-    snprintf(command, sizeof(command), "Built from Dockerfile");
-    if (create_image(image_name, tag, NULL, layer_path) != 0) {
-        fprintf(stderr, "Failed to create image\n");
+    if (!cached) {
+        trace_span_t span;
+        trace_begin(&span, "create_image");
+        if (create_image(image_name, tag, NULL, layer_path, compression) != 0) {
+            trace_end(&span, "failed");
+            return fail_build(progress, dockerfile->count, dockerfile->count, "Failed to create image");
+        }
+        trace_end(&span, image_name);
+
+        if (key[0] && read_image_metadata(full_name, &image) == 0) {
+            record_build_result(key, image.id);
+            free(image.layers);
+        }
+    }
+
+    memset(&event, 0, sizeof(event));
+    event.type = BUILD_EVENT_COMPLETE;
+    event.step = dockerfile->count;
+    event.total = dockerfile->count;
+    event.duration_ms = elapsed_ms(&build_start);
+    emit_build_event(progress, &event);
+
+    return 0;
+}
+
+static int write_heredoc(const dockerfile_instruction_t *instruction, const char *path, mode_t mode) {
+    FILE *file = fopen(path, "w");
+    if (!file) {
+        perror("fopen");
         return -1;
     }
 
-    // Cleanup
-    char rm_cmd[1024];
-    snprintf(rm_cmd, sizeof(rm_cmd), "rm -rf %s", layer_path);
-    system(rm_cmd);
+    if (fwrite(instruction->heredoc, 1, instruction->heredoc_len, file) != instruction->heredoc_len) {
+        perror("fwrite");
+        fclose(file);
+        return -1;
+    }
+
+    fclose(file);
+    return chmod(path, mode);
+}
+
+static int run_heredoc(const dockerfile_instruction_t *instruction, const char *layer_path) {
+    char script_path[MAX_PATH_LEN];
+
+    snprintf(script_path, sizeof(script_path), "%s/run_command.sh", layer_path);
+    if (write_heredoc(instruction, script_path, 0755) != 0) {
+        return -1;
+    }
 
+    printf("Would execute script (%zu bytes) from line %d\n", instruction->heredoc_len, instruction->line_number);
     return 0;
 }
 
+// Runs argv[0] from PATH and waits for it
+static int run_tool(const char *const argv[]) {
+    int status;
+    pid_t pid = fork();
+
+    if (pid < 0) {
+        perror("fork");
+        return -1;
+    }
+    if (pid == 0) {
+        execvp(argv[0], (char *const *)argv);
+        perror(argv[0]);
+        _exit(127);
+    }
+    while (waitpid(pid, &status, 0) < 0) {
+        if (errno != EINTR) {
+            perror("waitpid");
+            return -1;
+        }
+    }
+    return WIFEXITED(status) && WEXITSTATUS(status) == 0 ? 0 : -1;
+}
+
+// COPY <<EOF /path writes the heredoc body to the destination
+static int copy_heredoc(const dockerfile_instruction_t *instruction, const char *layer_path) {
+    char dest_path[MAX_PATH_LEN * 2];
+    char dest_dir[MAX_PATH_LEN * 2];
+    const char *dest = strrchr(instruction->args, ' ');
+
+    dest = dest ? dest + 1 : instruction->args;
+    if (*dest == '\0' || strncmp(dest, "<<", 2) == 0) {
+        fprintf(stderr, "COPY heredoc needs a destination (line %d)\n", instruction->line_number);
+        return -1;
+    }
+
+    if (snprintf(dest_path, sizeof(dest_path), "%s%s%s", layer_path, dest[0] == '/' ? "" : "/", dest) >=
+        (int)sizeof(dest_path)) {
+        fprintf(stderr, "COPY path too long: %s\n", dest);
+        return -1;
+    }
+    strcpy(dest_dir, dest_path);
+    *strrchr(dest_dir, '/') = '\0';
+
+    const char *mkdir_argv[] = {"mkdir", "-p", "--", dest_dir, NULL};
+    if (run_tool(mkdir_argv) != 0) {
+        return -1;
+    }
+
+    return write_heredoc(instruction, dest_path, 0644);
+}
+
+// Unpacks the base image into the build tree, pulling it first when it
+// is not in the local store
+static int use_base_image(const char *args, const char *layer_path) {
+    char base[MAX_ARG_LEN];
+    char full_name[MAX_IMAGE_NAME_LEN + MAX_IMAGE_TAG_LEN + 2];
+    registry_ref_t ref;
+    image_info_t *image;
+    int result = 0;
+
+    if (sscanf(args, "%511s", base) != 1) {
+        return -1;
+    }
+    if (strcasecmp(base, "scratch") == 0) {
+        printf("Using base image: scratch\n");
+        return 0;
+    }
+
+    if (parse_registry_ref(base, &ref) != 0) {
+        fprintf(stderr, "Invalid base image reference: %s\n", base);
+        return -1;
+    }
+
+    if (resolve_image_name(get_image_full_name(ref.local_name, ref.local_tag), full_name, sizeof(full_name)) != 0) {
+        printf("Pulling base image: %s\n", base);
+        if (registry_pull(base, 0, full_name, sizeof(full_name), NULL) != 0) {
+            fprintf(stderr, "Failed to pull base image %s\n", base);
+            return -1;
+        }
+    }
+
+    image = get_image_info(full_name);
+    if (!image) {
+        fprintf(stderr, "Base image %s not found\n", full_name);
+        return -1;
+    }
+
+    // Layers apply oldest first
+    for (int i = 0; i < image->layer_count && result == 0; i++) {
+        result = extract_layer(image->layers[i].id, layer_path);
+    }
+    free_image_info(image);
+
+    if (result == 0) {
+        printf("Using base image: %s\n", full_name);
+    }
+    return result;
+}
+
 int execute_instruction(dockerfile_instruction_t *instruction, const char *context_path, const char *layer_path) {
     switch (instruction->type) {
         case INSTR_FROM:
-            // Base image handling - in a real implementation, this would pull/extract the base image
-            printf("Using base image: %s\n", instruction->args);
-            break;
+            return use_base_image(instruction->args, layer_path);
 
         case INSTR_RUN:
+            if (instruction->heredoc) {
+                return run_heredoc(instruction, layer_path);
+            }
             return run_command(instruction->args, layer_path);
 
         case INSTR_COPY:
-            return copy_files(instruction->args, layer_path, context_path);
+        case INSTR_ADD: {
+            copy_operands_t ops;
 
-        case INSTR_ADD:
-            return add_files(instruction->args, layer_path, context_path);
+            if (instruction->type == INSTR_COPY && instruction->heredoc) {
+                return copy_heredoc(instruction, layer_path);
+            }
+            if (copy_operands(instruction, &ops) != 0) {
+                return -1;
+            }
+            if (instruction->type == INSTR_ADD) {
+                return add_files(ops.words, ops.count - 1, ops.words[ops.count - 1], layer_path, context_path);
+            }
+            return copy_files(ops.words, ops.count - 1, ops.words[ops.count - 1], layer_path, context_path);
+        }
 
         case INSTR_WORKDIR:
             return create_working_directory(instruction->args, layer_path);
@@ -360,6 +1478,14 @@ int execute_instruction(dockerfile_instruction_t *instruction, const char *conte
             return expose_port(instruction->args, layer_path);
 
         case INSTR_VOLUME:
+            if (instruction->argv) {
+                for (int i = 0; i < instruction->argc; i++) {
+                    if (create_volume(instruction->argv[i], layer_path) != 0) {
+                        return -1;
+                    }
+                }
+                return 0;
+            }
             return create_volume(instruction->args, layer_path);
 
         case INSTR_ENTRYPOINT:
@@ -399,27 +1525,70 @@ int run_command(const char *command, const char *layer_path) {
     return 0;
 }
 
-int copy_files(const char *args, const char *layer_path, const char *context_path) {
-    char *src, *dest;
-    char *args_copy = strdup(args);
+// The build hashed the sources while keying itself, which also kept them
+// inside the context, so this only copies
+static int copy_source(const char *src, const char *dest, const char *layer_path, const char *context_path) {
+    char src_path[MAX_PATH_LEN * 2];
+    char dest_path[MAX_PATH_LEN * 2];
+    char dest_dir[MAX_PATH_LEN * 2];
+    char copy_src[MAX_PATH_LEN * 2 + 2];
+    struct stat st;
+
+    if (snprintf(src_path, sizeof(src_path), "%s/%s", context_path, src) >= (int)sizeof(src_path) ||
+        snprintf(dest_path, sizeof(dest_path), "%s%s%s", layer_path, dest[0] == '/' ? "" : "/", dest) >=
+            (int)sizeof(dest_path)) {
+        fprintf(stderr, "COPY path too long: %s %s\n", src, dest);
+        return -1;
+    }
+
+    if (stat(src_path, &st) != 0) {
+        perror("stat COPY source");
+        return -1;
+    }
+
+    // A directory source copies its contents; a file lands inside a
+    // destination ending in '/' or replaces the destination path
+    strcpy(dest_dir, dest_path);
+    if (S_ISDIR(st.st_mode)) {
+        snprintf(copy_src, sizeof(copy_src), "%s/.", src_path);
+    } else {
+        if (dest[strlen(dest) - 1] != '/') {
+            *strrchr(dest_dir, '/') = '\0';
+        }
+        strcpy(copy_src, src_path);
+    }
 
-    // Parse source and destination
-    src = strtok(args_copy, " ");
-    dest = strtok(NULL, " ");
+    // Paths go to the tools as arguments, never through a shell
+    const char *mkdir_argv[] = {"mkdir", "-p", "--", dest_dir, NULL};
+    const char *cp_argv[] = {"cp", "-a", "--", copy_src, dest_path, NULL};
+    if (run_tool(mkdir_argv) != 0 || run_tool(cp_argv) != 0) {
+        fprintf(stderr, "Failed to copy %s to %s\n", src, dest);
+        return -1;
+    }
+
+    return 0;
+}
 
-    if (!src || !dest) {
-        free(args_copy);
+// Several sources need a directory destination, written with a trailing '/'
+int copy_files(const char *const *sources, int count, const char *dest, const char *layer_path,
+               const char *context_path) {
+    if (count > 1 && dest[strlen(dest) - 1] != '/') {
+        fprintf(stderr, "COPY with several sources needs a destination ending in '/': %s\n", dest);
         return -1;
     }
 
-    int result = copy_files(src, dest, context_path);
-    free(args_copy);
-    return result;
+    for (int i = 0; i < count; i++) {
+        if (copy_source(sources[i], dest, layer_path, context_path) != 0) {
+            return -1;
+        }
+    }
+    return 0;
 }
 
-int add_files(const char *args, const char *layer_path, const char *context_path) {
+int add_files(const char *const *sources, int count, const char *dest, const char *layer_path,
+              const char *context_path) {
     // ADD is similar to COPY but can handle URLs and tar files
-    return copy_files(args, layer_path, context_path);
+    return copy_files(sources, count, dest, layer_path, context_path);
 }
 
 int set_environment_variable(const char *key_value, const char *layer_path) {
@@ -562,16 +1731,19 @@ void print_dockerfile_info(dockerfile_t *dockerfile) {
     printf("  Entrypoint: %s\n", dockerfile->entrypoint);
     printf("  CMD: %s\n", dockerfile->cmd);
     printf("  Instructions: %d\n", dockerfile->count);
-    printf("  Environment Variables: %d\n", dockerfile->env_count);
-    printf("  Exposed Ports: %d\n", dockerfile->port_count);
-    printf("  Volumes: %d\n", dockerfile->volume_count);
-    printf("  Labels: %d\n", dockerfile->label_count);
+    printf("  Environment Variables: %d\n", dockerfile->env_vars.count);
+    printf("  Build Arguments: %d\n", dockerfile->build_args.count);
+    printf("  Exposed Ports: %d\n", dockerfile->exposed_ports.count);
+    printf("  Volumes: %d\n", dockerfile->volumes.count);
+    printf("  Labels: %d\n", dockerfile->labels.count);
 
     printf("\nInstructions:\n");
-    for (int i = 0; i < dockerfile->count; i++) {
-        printf("  %d. %s %s (line %d)\n", i + 1,
-               dockerfile->instructions[i].instruction,
-               dockerfile->instructions[i].args,
-               dockerfile->instructions[i].line_number);
+    int i = 0;
+    for (dockerfile_instruction_t *instruction = dockerfile->instructions; instruction; instruction = instruction->next) {
+        printf("  %d. %s %s (line %d)\n", ++i, instruction->instruction, instruction->args,
+               instruction->line_number);
+        if (instruction->heredoc) {
+            printf("     heredoc: %zu bytes\n", instruction->heredoc_len);
+        }
     }
 }
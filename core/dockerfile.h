@@ -8,16 +8,19 @@
 #include <unistd.h>
 #include <errno.h>
 
-#define MAX_LINE_LEN 1024
+#include "sha256.h"
+#include "arena.h"
+#include "image.h"
+#include "context_cache.h"
+
 #define MAX_INSTRUCTION_LEN 32
 #define MAX_ARG_LEN 512
 #define MAX_PATH_LEN 512
-#define MAX_ENV_VAR_LEN 256
-#define MAX_PORT_LEN 32
-#define MAX_VOLUME_LEN 256
-#define MAX_LAYER_COUNT 100
 #define MAX_COMMAND_LEN 1024
 
+#define BUILD_ROOT_DIR "/tmp/docker-builds"
+#define BUILD_RESULT_DIR BUILD_CACHE_DIR "/results"
+
 typedef enum {
     INSTR_UNKNOWN,
     INSTR_FROM,
@@ -39,44 +42,98 @@ typedef enum {
     INSTR_SHELL
 } instruction_type_t;
 
-typedef struct {
+// Instruction nodes live in the Dockerfile's arena. Strings point into the
+// private file mapping wherever the text could be folded in place, and into
+// the arena only when variable expansion or JSON unescaping produced new text.
+typedef struct dockerfile_instruction {
     instruction_type_t type;
-    char instruction[MAX_INSTRUCTION_LEN];
-    char args[MAX_ARG_LEN];
-    char src[MAX_PATH_LEN];
-    char dest[MAX_PATH_LEN];
+    const char *instruction;
+    const char *args;
+    size_t args_len;
+    const char **argv;              // exec form (JSON array) arguments, NULL for shell form
+    int argc;
+    const char *heredoc;            // body of a <<EOF heredoc, NULL when absent
+    size_t heredoc_len;
     int line_number;
+    struct dockerfile_instruction *next;
 } dockerfile_instruction_t;
 
 typedef struct {
-    dockerfile_instruction_t *instructions;
+    const char **items;
     int count;
     int capacity;
-    char base_image[MAX_PATH_LEN];
-    char working_dir[MAX_PATH_LEN];
-    char user[MAX_PATH_LEN];
-    char shell[MAX_PATH_LEN];
-    char entrypoint[MAX_ARG_LEN];
-    char cmd[MAX_ARG_LEN];
-    char *env_vars[MAX_ENV_VAR_LEN];
-    int env_count;
-    char *exposed_ports[MAX_PORT_LEN];
-    int port_count;
-    char *volumes[MAX_VOLUME_LEN];
-    int volume_count;
-    char *labels[MAX_ENV_VAR_LEN];
-    int label_count;
+} string_list_t;
+
+typedef struct {
+    dockerfile_instruction_t *instructions;
+    dockerfile_instruction_t *last;
+    int count;
+    const char *base_image;
+    const char *working_dir;
+    const char *user;
+    const char *shell;
+    const char *entrypoint;
+    const char *cmd;
+    string_list_t env_vars;         // KEY=VALUE, later definitions win
+    string_list_t build_args;       // KEY=VALUE from ARG defaults
+    string_list_t exposed_ports;
+    string_list_t volumes;
+    string_list_t labels;
+    arena_t arena;
+    char *map;
+    size_t map_size;
 } dockerfile_t;
 
+typedef enum {
+    BUILD_EVENT_STEP_START,
+    BUILD_EVENT_STEP_END,
+    BUILD_EVENT_ERROR,
+    BUILD_EVENT_COMPLETE
+} build_event_type_t;
+
+// Per-step counters, filled in while the build is keyed
+typedef struct {
+    int cached;                     // reused from an earlier build of the same key
+    int cache_hits;
+    int cache_misses;
+    long long bytes_copied;
+    char digest[SHA256_HEX_LEN + 1];
+} build_step_stats_t;
+
+typedef struct {
+    build_event_type_t type;
+    int step;
+    int total;
+    const char *instruction;
+    const char *args;
+    const build_step_stats_t *stats;
+    double duration_ms;
+    const char *message;
+} build_event_t;
+
+typedef void (*build_progress_fn)(const build_event_t *event, void *user_data);
+
+typedef struct {
+    build_progress_fn callback;
+    void *user_data;
+} build_progress_t;
+
 // Function declarations
 dockerfile_t* parse_dockerfile(const char *file_path);
 void free_dockerfile(dockerfile_t *dockerfile);
 instruction_type_t get_instruction_type(const char *instruction);
 int validate_dockerfile(dockerfile_t *dockerfile);
 int build_image_from_dockerfile(dockerfile_t *dockerfile, const char *image_name, const char *tag, const char *context_path);
+int build_image_with_progress(dockerfile_t *dockerfile, const char *image_name, const char *tag,
+                              const char *context_path, const char *build_dir, image_compression_t compression,
+                              build_progress_t *progress);
+int create_build_dir(char *path, size_t size);
+void remove_build_dir(const char *path);
 int execute_instruction(dockerfile_instruction_t *instruction, const char *context_path, const char *layer_path);
-int copy_files(const char *src, const char *dest, const char *context_path);
-int add_files(const char *src, const char *dest, const char *context_path);
+int copy_files(const char *const *sources, int count, const char *dest, const char *layer_path,
+               const char *context_path);
+int add_files(const char *const *sources, int count, const char *dest, const char *layer_path,
+              const char *context_path);
 int run_command(const char *command, const char *layer_path);
 int set_environment_variable(const char *key_value, const char *layer_path);
 int create_working_directory(const char *path, const char *layer_path);
@@ -91,7 +148,7 @@ int set_label(const char *key_value, const char *layer_path);
 char* trim_whitespace(char *str);
 int is_continuation_line(const char *line);
 char* parse_quoted_string(const char *str);
-int expand_variables(char *str, const char *env_vars[], int env_count);
+const char* expand_variables(arena_t *arena, const char *str, const char *const env_vars[], int env_count);
 void print_dockerfile_info(dockerfile_t *dockerfile);
 
 #endif // DOCKERFILE_H
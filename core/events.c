@@ -0,0 +1,139 @@
+#include "events.h"
+#include <errno.h>
+#include <unistd.h>
+
+static pthread_mutex_t bus_lock = PTHREAD_MUTEX_INITIALIZER;
+static event_t history[EVENT_HISTORY_SIZE];
+static int history_head = 0, history_count = 0;
+static unsigned long long next_sequence = 1;
+static event_subscriber_t *subscribers = NULL;
+static pid_t bus_owner = 0;
+
+int init_events(void) {
+    bus_owner = getpid();
+    return 0;
+}
+
+// Caller holds bus_lock. A full queue gives up its oldest event.
+static void enqueue_event(event_subscriber_t *subscriber, const event_t *event) {
+    if (subscriber->count == EVENT_QUEUE_SIZE) {
+        subscriber->head = (subscriber->head + 1) % EVENT_QUEUE_SIZE;
+        subscriber->count--;
+        subscriber->dropped++;
+    }
+    subscriber->queue[(subscriber->head + subscriber->count) % EVENT_QUEUE_SIZE] = *event;
+    subscriber->count++;
+}
+
+void publish_event(const char *type, const char *action, const char *id, const char *name,
+                   const char *image, int exit_code) {
+    event_t event;
+
+    if (bus_owner == 0 || getpid() != bus_owner) {
+        return;
+    }
+
+    memset(&event, 0, sizeof(event));
+    clock_gettime(CLOCK_REALTIME, &event.time);
+    snprintf(event.type, sizeof(event.type), "%s", type);
+    snprintf(event.action, sizeof(event.action), "%s", action);
+    snprintf(event.id, sizeof(event.id), "%s", id ? id : "");
+    snprintf(event.name, sizeof(event.name), "%s", name ? name : "");
+    snprintf(event.image, sizeof(event.image), "%s", image ? image : "");
+    event.exit_code = exit_code;
+
+    pthread_mutex_lock(&bus_lock);
+    event.sequence = next_sequence++;
+
+    history[(history_head + history_count) % EVENT_HISTORY_SIZE] = event;
+    if (history_count < EVENT_HISTORY_SIZE) {
+        history_count++;
+    } else {
+        history_head = (history_head + 1) % EVENT_HISTORY_SIZE;
+    }
+
+    for (event_subscriber_t *subscriber = subscribers; subscriber; subscriber = subscriber->next) {
+        enqueue_event(subscriber, &event);
+        pthread_cond_signal(&subscriber->ready);
+    }
+    pthread_mutex_unlock(&bus_lock);
+}
+
+// Starts with the kept events from since on (none when since is 0), then
+// everything published after; nothing falls between the two
+event_subscriber_t* subscribe_events(time_t since) {
+    event_subscriber_t *subscriber = calloc(1, sizeof(event_subscriber_t));
+    pthread_condattr_t attr;
+
+    if (!subscriber) {
+        perror("calloc");
+        return NULL;
+    }
+
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&subscriber->ready, &attr);
+    pthread_condattr_destroy(&attr);
+
+    pthread_mutex_lock(&bus_lock);
+    if (since > 0) {
+        for (int i = 0; i < history_count; i++) {
+            const event_t *event = &history[(history_head + i) % EVENT_HISTORY_SIZE];
+            if (event->time.tv_sec >= since) {
+                enqueue_event(subscriber, event);
+            }
+        }
+    }
+    subscriber->next = subscribers;
+    subscribers = subscriber;
+    pthread_mutex_unlock(&bus_lock);
+
+    return subscriber;
+}
+
+// 1 with the next event, 0 when none came within timeout_ms. dropped is
+// set to how many events were lost since the last call.
+int next_event(event_subscriber_t *subscriber, event_t *event, unsigned long long *dropped, int timeout_ms) {
+    struct timespec deadline;
+    int result = 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += timeout_ms / 1000;
+    deadline.tv_nsec += (long)(timeout_ms % 1000) * 1000000;
+    if (deadline.tv_nsec >= 1000000000) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000;
+    }
+
+    pthread_mutex_lock(&bus_lock);
+    while (subscriber->count == 0) {
+        if (pthread_cond_timedwait(&subscriber->ready, &bus_lock, &deadline) == ETIMEDOUT) {
+            break;
+        }
+    }
+    if (subscriber->count > 0) {
+        *event = subscriber->queue[subscriber->head];
+        subscriber->head = (subscriber->head + 1) % EVENT_QUEUE_SIZE;
+        subscriber->count--;
+        result = 1;
+    }
+    *dropped = subscriber->dropped;
+    subscriber->dropped = 0;
+    pthread_mutex_unlock(&bus_lock);
+
+    return result;
+}
+
+void unsubscribe_events(event_subscriber_t *subscriber) {
+    pthread_mutex_lock(&bus_lock);
+    for (event_subscriber_t **link = &subscribers; *link; link = &(*link)->next) {
+        if (*link == subscriber) {
+            *link = subscriber->next;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&bus_lock);
+
+    pthread_cond_destroy(&subscriber->ready);
+    free(subscriber);
+}
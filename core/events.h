@@ -0,0 +1,55 @@
+#ifndef EVENTS_H
+#define EVENTS_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+
+// Container and image state changes, published as they happen and handed
+// to every subscriber. The bus keeps the most recent events so a new
+// subscriber can start from an earlier time. Each subscriber has a queue of
+// its own; one that falls behind loses its oldest events, counted, and never
+// holds up a publisher or the other subscribers.
+//
+// Only the daemon process publishes: a forked build worker's copy of the
+// bus has no subscribers, and its images are announced when the daemon
+// adopts them.
+#define EVENT_HISTORY_SIZE 1024
+#define EVENT_QUEUE_SIZE 256
+#define MAX_EVENT_ID_LEN 128
+#define MAX_EVENT_ATTRIBUTE_LEN 256
+
+#define EVENT_TYPE_CONTAINER "container"
+#define EVENT_TYPE_IMAGE "image"
+
+typedef struct {
+    unsigned long long sequence;
+    struct timespec time;
+    char type[16];
+    char action[16];
+    char id[MAX_EVENT_ID_LEN];
+    char name[MAX_EVENT_ATTRIBUTE_LEN];     // container name, or name:tag
+    char image[MAX_EVENT_ATTRIBUTE_LEN];    // the container's image
+    int exit_code;                          // for die; -1 otherwise
+} event_t;
+
+typedef struct event_subscriber {
+    struct event_subscriber *next;
+    event_t queue[EVENT_QUEUE_SIZE];
+    int head;
+    int count;
+    unsigned long long dropped;
+    pthread_cond_t ready;
+} event_subscriber_t;
+
+// Function declarations
+int init_events(void);
+void publish_event(const char *type, const char *action, const char *id, const char *name,
+                   const char *image, int exit_code);
+event_subscriber_t* subscribe_events(time_t since);
+int next_event(event_subscriber_t *subscriber, event_t *event, unsigned long long *dropped, int timeout_ms);
+void unsubscribe_events(event_subscriber_t *subscriber);
+
+#endif // EVENTS_H
@@ -0,0 +1,828 @@
+#include "gc.h"
+#include "chunk.h"
+#include "container.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+typedef struct {
+    char id[MAX_LAYER_ID_LEN];
+    int refs;                   // images holding the layer
+    struct timespec held;       // leases from before were for those images
+    int marked;
+} gc_layer_t;
+
+typedef struct {
+    char id[MAX_IMAGE_ID_LEN];
+    int refs;                   // tags and containers pointing at it
+    char (*layers)[MAX_LAYER_ID_LEN];
+    int layer_count;
+} gc_image_t;
+
+// A tag (name:tag) or a container, pointing at an image
+typedef struct {
+    char name[MAX_IMAGE_NAME_LEN + MAX_IMAGE_TAG_LEN + 2];
+    int container;
+    char image_id[MAX_IMAGE_ID_LEN];
+} gc_root_t;
+
+// Open-addressed slots holding record numbers, -1 when free, kept at most
+// half full. Removing a record moves the last one into its place, so the
+// slot of the moved record is renumbered.
+typedef struct {
+    int *slots;
+    int size;                   // a power of two
+    uint64_t (*hash_of)(int record);
+} gc_index_t;
+
+static pthread_mutex_t graph_lock = PTHREAD_MUTEX_INITIALIZER;
+static gc_root_t *roots = NULL;
+static int root_count = 0, root_capacity = 0;
+static gc_image_t *images = NULL;
+static int image_count = 0, image_capacity = 0;
+static gc_layer_t *layers = NULL;
+static int layer_count = 0, layer_capacity = 0;
+
+// Build workers are forked from the daemon with a copy of the graph that
+// dies with them; only the daemon writes it out
+static pid_t graph_owner = 0;
+
+// Changes since the last snapshot are appended to it; records counts the
+// lines in the file, live or not
+static FILE *graph_log = NULL;
+static int graph_log_records = 0;
+
+// One collection at a time; the graph lock is only held per layer
+static pthread_mutex_t collect_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t request_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t request_changed = PTHREAD_COND_INITIALIZER;
+static int collection_requested = 0;
+
+static int grow_array(void **array, int *capacity, int count, size_t size) {
+    if (count < *capacity) {
+        return 0;
+    }
+
+    int grown_capacity = *capacity ? *capacity * 2 : 16;
+    void *grown = realloc(*array, grown_capacity * size);
+    if (!grown) {
+        perror("realloc");
+        return -1;
+    }
+    *array = grown;
+    *capacity = grown_capacity;
+    return 0;
+}
+
+// ---------------------------------------------------------------------------
+// Indexes (callers hold graph_lock)
+
+static uint64_t hash_key(const char *key) {
+    uint64_t h = 1469598103934665603ULL;
+
+    while (*key) {
+        h ^= (unsigned char)*key++;
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+// A tag and a container may share a name
+static uint64_t root_key(const char *name, int container) {
+    return hash_key(name) + (container ? 0x9e3779b97f4a7c15ULL : 0);
+}
+
+static uint64_t layer_hash(int record) {
+    return hash_key(layers[record].id);
+}
+
+static uint64_t image_hash(int record) {
+    return hash_key(images[record].id);
+}
+
+static uint64_t root_hash(int record) {
+    return root_key(roots[record].name, roots[record].container);
+}
+
+static gc_index_t layer_index = { NULL, 0, layer_hash };
+static gc_index_t image_index = { NULL, 0, image_hash };
+static gc_index_t root_index = { NULL, 0, root_hash };
+
+static void insert_slot(gc_index_t *index, int record) {
+    int mask = index->size - 1;
+    int h = index->hash_of(record) & mask;
+
+    while (index->slots[h] != -1) {
+        h = (h + 1) & mask;
+    }
+    index->slots[h] = record;
+}
+
+// Indexes the record just appended, count being the records now
+static int index_add(gc_index_t *index, int record, int count) {
+    if (count * 2 <= index->size) {
+        insert_slot(index, record);
+        return 0;
+    }
+
+    int size = index->size ? index->size * 2 : 64;
+    int *slots = malloc(sizeof(int) * size);
+    if (!slots) {
+        perror("malloc");
+        return -1;
+    }
+    for (int i = 0; i < size; i++) {
+        slots[i] = -1;
+    }
+    free(index->slots);
+    index->slots = slots;
+    index->size = size;
+    for (int i = 0; i < count; i++) {
+        insert_slot(index, i);
+    }
+    return 0;
+}
+
+static int slot_of(const gc_index_t *index, int record) {
+    int mask = index->size - 1;
+    int h = index->hash_of(record) & mask;
+
+    while (index->slots[h] != record) {
+        h = (h + 1) & mask;
+    }
+    return h;
+}
+
+// Unindexes record before the caller moves record last into its place.
+// Later slots of the probe run shift back into the hole, so lookups never
+// need tombstones.
+static void index_remove(gc_index_t *index, int record, int last) {
+    int mask = index->size - 1;
+    int hole = slot_of(index, record);
+
+    for (int next = (hole + 1) & mask; index->slots[next] != -1; next = (next + 1) & mask) {
+        int home = index->hash_of(index->slots[next]) & mask;
+        // The entry may move back unless its home lies cyclically in (hole, next]
+        if (hole <= next ? (home <= hole || home > next) : (home <= hole && home > next)) {
+            index->slots[hole] = index->slots[next];
+            hole = next;
+        }
+    }
+    index->slots[hole] = -1;
+
+    if (last != record) {
+        index->slots[slot_of(index, last)] = record;
+    }
+}
+
+// ---------------------------------------------------------------------------
+// Graph (callers hold graph_lock)
+
+static void log_image(const gc_image_t *image);
+static void log_root(const gc_root_t *root);
+static void log_drop(const char *name, int container);
+
+static gc_layer_t* find_layer(const char *id, int create) {
+    uint64_t hash = hash_key(id);
+    int mask = layer_index.size - 1;
+
+    for (int h = layer_index.size ? (int)(hash & mask) : 0; layer_index.size && layer_index.slots[h] != -1;
+         h = (h + 1) & mask) {
+        if (strcmp(layers[layer_index.slots[h]].id, id) == 0) {
+            return &layers[layer_index.slots[h]];
+        }
+    }
+    if (!create || grow_array((void **)&layers, &layer_capacity, layer_count, sizeof(gc_layer_t)) != 0) {
+        return NULL;
+    }
+
+    gc_layer_t *layer = &layers[layer_count++];
+    memset(layer, 0, sizeof(*layer));
+    snprintf(layer->id, sizeof(layer->id), "%s", id);
+    if (index_add(&layer_index, layer_count - 1, layer_count) != 0) {
+        layer_count--;
+        return NULL;
+    }
+    return layer;
+}
+
+static void remove_layer(gc_layer_t *layer) {
+    int record = layer - layers;
+
+    index_remove(&layer_index, record, layer_count - 1);
+    layers[record] = layers[--layer_count];
+}
+
+static gc_image_t* find_image(const char *id, int create) {
+    uint64_t hash = hash_key(id);
+    int mask = image_index.size - 1;
+
+    for (int h = image_index.size ? (int)(hash & mask) : 0; image_index.size && image_index.slots[h] != -1;
+         h = (h + 1) & mask) {
+        if (strcmp(images[image_index.slots[h]].id, id) == 0) {
+            return &images[image_index.slots[h]];
+        }
+    }
+    if (!create || grow_array((void **)&images, &image_capacity, image_count, sizeof(gc_image_t)) != 0) {
+        return NULL;
+    }
+
+    gc_image_t *image = &images[image_count++];
+    memset(image, 0, sizeof(*image));
+    snprintf(image->id, sizeof(image->id), "%s", id);
+    if (index_add(&image_index, image_count - 1, image_count) != 0) {
+        image_count--;
+        return NULL;
+    }
+    return image;
+}
+
+static gc_root_t* find_root(const char *name, int container) {
+    uint64_t hash = root_key(name, container);
+    int mask = root_index.size - 1;
+
+    for (int h = root_index.size ? (int)(hash & mask) : 0; root_index.size && root_index.slots[h] != -1;
+         h = (h + 1) & mask) {
+        gc_root_t *root = &roots[root_index.slots[h]];
+        if (root->container == container && strcmp(root->name, name) == 0) {
+            return root;
+        }
+    }
+    return NULL;
+}
+
+static gc_root_t* add_root(const char *name, int container) {
+    if (grow_array((void **)&roots, &root_capacity, root_count, sizeof(gc_root_t)) != 0) {
+        return NULL;
+    }
+
+    gc_root_t *root = &roots[root_count++];
+    memset(root, 0, sizeof(*root));
+    snprintf(root->name, sizeof(root->name), "%s", name);
+    root->container = container;
+    if (index_add(&root_index, root_count - 1, root_count) != 0) {
+        root_count--;
+        return NULL;
+    }
+    return root;
+}
+
+// get_image_full_name's buffer is shared between threads
+static void tag_name(const image_info_t *image, char *name, size_t size) {
+    snprintf(name, size, "%s:%s", image->name, image->tag[0] ? image->tag : "latest");
+}
+
+// Returns 1 when the image did not hold the layer before
+static int hold_layer(gc_image_t *image, const char *layer_id) {
+    gc_layer_t *layer;
+
+    for (int i = 0; i < image->layer_count; i++) {
+        if (strcmp(image->layers[i], layer_id) == 0) {
+            return 0;
+        }
+    }
+
+    void *grown = realloc(image->layers, (image->layer_count + 1) * sizeof(image->layers[0]));
+    if (!grown) {
+        perror("realloc");
+        return 0;
+    }
+    image->layers = grown;
+    if (!(layer = find_layer(layer_id, 1))) {
+        return 0;
+    }
+    snprintf(image->layers[image->layer_count++], MAX_LAYER_ID_LEN, "%s", layer_id);
+    layer->refs++;
+    clock_gettime(CLOCK_REALTIME, &layer->held);
+    return 1;
+}
+
+static void release_image(const char *image_id) {
+    gc_image_t *image = find_image(image_id, 0);
+    int garbage = 0;
+
+    if (!image || --image->refs > 0) {
+        return;
+    }
+
+    for (int i = 0; i < image->layer_count; i++) {
+        gc_layer_t *layer = find_layer(image->layers[i], 0);
+        if (layer && --layer->refs == 0) {
+            garbage = 1;
+        }
+    }
+    free(image->layers);
+    int record = image - images;
+    index_remove(&image_index, record, image_count - 1);
+    images[record] = images[--image_count];
+
+    if (garbage) {
+        gc_request();
+    }
+}
+
+// Points a tag or container at an image already in the graph
+static void point_root(const char *name, int container, gc_image_t *image) {
+    gc_root_t *root = find_root(name, container);
+    char old_id[MAX_IMAGE_ID_LEN];
+
+    if (!root && !(root = add_root(name, container))) {
+        return;
+    }
+    if (strcmp(root->image_id, image->id) == 0) {
+        return;
+    }
+
+    image->refs++;
+    snprintf(old_id, sizeof(old_id), "%s", root->image_id);
+    snprintf(root->image_id, sizeof(root->image_id), "%s", image->id);
+    log_root(root);
+    if (old_id[0]) {
+        release_image(old_id);
+    }
+}
+
+// Points a tag or container at an image. Images are keyed by id; an id seen
+// with different layers holds all of them.
+static void set_root(const char *name, int container, const image_info_t *info) {
+    int known = find_image(info->id, 0) != NULL;
+    gc_image_t *image = find_image(info->id, 1);
+    int added = 0;
+
+    if (!image) {
+        return;
+    }
+    for (int i = 0; i < info->layer_count; i++) {
+        added |= hold_layer(image, info->layers[i].id);
+    }
+    if (!known || added) {
+        log_image(image);
+    }
+    point_root(name, container, image);
+}
+
+static void drop_root(const char *name, int container) {
+    gc_root_t *root = find_root(name, container);
+    char image_id[MAX_IMAGE_ID_LEN];
+
+    if (!root) {
+        return;
+    }
+    snprintf(image_id, sizeof(image_id), "%s", root->image_id);
+    int record = root - roots;
+    index_remove(&root_index, record, root_count - 1);
+    roots[record] = roots[--root_count];
+    log_drop(name, container);
+    release_image(image_id);
+}
+
+// ---------------------------------------------------------------------------
+// Graph file: a snapshot of the images and roots, then one line per change
+// since. Replaying it gives the graph back; it is rewritten as a snapshot
+// at load, by the collector, and once the changes outgrow the graph.
+
+static void write_image_line(FILE *fp, const gc_image_t *image) {
+    fprintf(fp, "image %s", image->id);
+    for (int j = 0; j < image->layer_count; j++) {
+        fprintf(fp, " %s", image->layers[j]);
+    }
+    fprintf(fp, "\n");
+}
+
+static void compact_graph(void) {
+    char temp_path[MAX_PATH_LEN];
+    FILE *fp;
+
+    if (getpid() != graph_owner) {
+        return;
+    }
+
+    snprintf(temp_path, sizeof(temp_path), "%s.tmp", GC_GRAPH_PATH);
+    fp = fopen(temp_path, "w");
+    if (!fp) {
+        perror("fopen layer graph");
+        return;
+    }
+
+    // Images first, so loading can point roots at them
+    for (int i = 0; i < image_count; i++) {
+        write_image_line(fp, &images[i]);
+    }
+    for (int i = 0; i < root_count; i++) {
+        fprintf(fp, "%s %s %s\n", roots[i].container ? "container" : "tag", roots[i].name, roots[i].image_id);
+    }
+
+    if (fclose(fp) != 0 || rename(temp_path, GC_GRAPH_PATH) != 0) {
+        perror("write layer graph");
+        unlink(temp_path);
+        return;
+    }
+
+    if (graph_log) {
+        fclose(graph_log);
+    }
+    graph_log = fopen(GC_GRAPH_PATH, "ae");
+    if (!graph_log) {
+        perror("open layer graph");
+    }
+    graph_log_records = image_count + root_count;
+}
+
+// Each change is flushed as it is made; a line cut short by a crash is
+// skipped on load
+static void log_flush(void) {
+    if (fflush(graph_log) != 0) {
+        perror("append layer graph");
+    }
+    // Replaying a log much longer than the graph would slow the next load
+    if (++graph_log_records > 4 * (image_count + root_count) + 1024) {
+        compact_graph();
+    }
+}
+
+static void log_image(const gc_image_t *image) {
+    if (!graph_log || getpid() != graph_owner) {
+        return;
+    }
+    write_image_line(graph_log, image);
+    log_flush();
+}
+
+static void log_root(const gc_root_t *root) {
+    if (!graph_log || getpid() != graph_owner) {
+        return;
+    }
+    fprintf(graph_log, "%s %s %s\n", root->container ? "container" : "tag", root->name, root->image_id);
+    log_flush();
+}
+
+static void log_drop(const char *name, int container) {
+    if (!graph_log || getpid() != graph_owner) {
+        return;
+    }
+    fprintf(graph_log, "drop %s %s\n", container ? "container" : "tag", name);
+    log_flush();
+}
+
+// Returns 1 when there is no saved graph
+static int load_graph(void) {
+    char *line = NULL;
+    size_t size = 0;
+    ssize_t len;
+    FILE *fp = fopen(GC_GRAPH_PATH, "r");
+
+    if (!fp) {
+        return errno == ENOENT ? 1 : -1;
+    }
+
+    while ((len = getline(&line, &size, fp)) > 0) {
+        char *save = NULL;
+        char *kind, *id, *token;
+
+        if (line[len - 1] != '\n') {
+            break;
+        }
+        kind = strtok_r(line, " \n", &save);
+        id = kind ? strtok_r(NULL, " \n", &save) : NULL;
+        if (!id) {
+            continue;
+        }
+        if (strcmp(kind, "image") == 0) {
+            gc_image_t *image = find_image(id, 1);
+            while (image && (token = strtok_r(NULL, " \n", &save))) {
+                hold_layer(image, token);
+            }
+        } else if (strcmp(kind, "tag") == 0 || strcmp(kind, "container") == 0) {
+            gc_image_t *image = (token = strtok_r(NULL, " \n", &save)) ? find_image(token, 0) : NULL;
+            if (image) {
+                point_root(id, kind[0] == 'c', image);
+            }
+        } else if (strcmp(kind, "drop") == 0 && (token = strtok_r(NULL, " \n", &save))) {
+            drop_root(token, strcmp(id, "container") == 0);
+        }
+    }
+    free(line);
+    fclose(fp);
+
+    // Images nothing points at any more let go of their layers
+    for (int i = image_count - 1; i >= 0; i--) {
+        if (images[i].refs == 0) {
+            images[i].refs = 1;
+            release_image(images[i].id);
+        }
+    }
+    return 0;
+}
+
+// Without a saved graph the metadata of images and containers is the truth
+static void rebuild_graph(void) {
+    image_list_t *image_list = list_images();
+    container_list_t *container_list = list_containers();
+
+    for (int i = 0; image_list && i < image_list->count; i++) {
+        char full_name[MAX_IMAGE_NAME_LEN + MAX_IMAGE_TAG_LEN + 2];
+        tag_name(&image_list->images[i], full_name, sizeof(full_name));
+        set_root(full_name, 0, &image_list->images[i]);
+    }
+    for (int i = 0; container_list && i < container_list->count; i++) {
+        char full_name[MAX_IMAGE_NAME_LEN + MAX_IMAGE_TAG_LEN + 2];
+        image_info_t image;
+
+        if (resolve_image_name(container_list->containers[i].image, full_name, sizeof(full_name)) == 0 &&
+            read_image_metadata(full_name, &image) == 0) {
+            set_root(container_list->containers[i].id, 1, &image);
+            free(image.layers);
+        }
+    }
+
+    if (image_list) {
+        free_image_list(image_list);
+    }
+    if (container_list) {
+        free_container_list(container_list);
+    }
+}
+
+// ---------------------------------------------------------------------------
+// Collection
+
+static void* collector_thread(void *arg) {
+    (void)arg;
+
+    for (;;) {
+        gc_stats_t stats;
+
+        pthread_mutex_lock(&request_lock);
+        while (!collection_requested) {
+            pthread_cond_wait(&request_changed, &request_lock);
+        }
+        collection_requested = 0;
+        pthread_mutex_unlock(&request_lock);
+
+        if (gc_collect(&stats) == 0 && (stats.layers_removed > 0 || stats.chunks_removed > 0)) {
+            printf("Collected %d layer(s) and %lld chunk(s), %lld bytes reclaimed\n",
+                   stats.layers_removed, stats.chunks_removed, stats.bytes_reclaimed);
+        }
+    }
+    return NULL;
+}
+
+int init_gc(void) {
+    pthread_t thread;
+    int loaded;
+
+    pthread_mutex_lock(&graph_lock);
+    graph_owner = getpid();
+    loaded = load_graph();
+    if (loaded > 0) {
+        rebuild_graph();
+    }
+    if (loaded >= 0) {
+        compact_graph();
+    }
+    pthread_mutex_unlock(&graph_lock);
+
+    if (loaded < 0) {
+        perror("read layer graph");
+        return -1;
+    }
+
+    if (pthread_create(&thread, NULL, collector_thread, NULL) != 0) {
+        perror("pthread_create");
+        return -1;
+    }
+    pthread_detach(thread);
+    return 0;
+}
+
+void gc_request(void) {
+    pthread_mutex_lock(&request_lock);
+    collection_requested = 1;
+    pthread_cond_signal(&request_changed);
+    pthread_mutex_unlock(&request_lock);
+}
+
+// The lease is the layer directory's time, so build workers can take one
+// too. A layer not created yet is leased by its mkdir.
+void gc_lease_layer(const char *layer_id) {
+    char layer_path[MAX_PATH_LEN];
+
+    snprintf(layer_path, sizeof(layer_path), "%s/%s", LAYER_STORAGE_DIR, layer_id);
+    utimensat(AT_FDCWD, layer_path, NULL, 0);
+}
+
+void gc_ref_image(const image_info_t *image) {
+    char full_name[MAX_IMAGE_NAME_LEN + MAX_IMAGE_TAG_LEN + 2];
+
+    tag_name(image, full_name, sizeof(full_name));
+    pthread_mutex_lock(&graph_lock);
+    set_root(full_name, 0, image);
+    pthread_mutex_unlock(&graph_lock);
+}
+
+void gc_unref_tag(const char *full_name) {
+    pthread_mutex_lock(&graph_lock);
+    drop_root(full_name, 0);
+    pthread_mutex_unlock(&graph_lock);
+}
+
+void gc_ref_container(const char *container_id, const image_info_t *image) {
+    pthread_mutex_lock(&graph_lock);
+    set_root(container_id, 1, image);
+    pthread_mutex_unlock(&graph_lock);
+}
+
+void gc_unref_container(const char *container_id) {
+    pthread_mutex_lock(&graph_lock);
+    drop_root(container_id, 1);
+    pthread_mutex_unlock(&graph_lock);
+}
+
+// nftw has no user pointer; collect_lock serialises its users
+static long long walked_bytes;
+
+static int add_entry_bytes(const char *path, const struct stat *st, int type, struct FTW *ftw) {
+    (void)path;
+    (void)type;
+    (void)ftw;
+    walked_bytes += (long long)st->st_blocks * 512;
+    return 0;
+}
+
+// What deleting the tree gives back on disk
+static long long directory_bytes(const char *path) {
+    walked_bytes = 0;
+    nftw(path, add_entry_bytes, 16, FTW_PHYS);
+    return walked_bytes;
+}
+
+// Mark: whatever a tag or container reaches through its image. Counts and
+// marks agree unless the graph is damaged; a counted layer is kept either
+// way.
+static void mark_layers(void) {
+    pthread_mutex_lock(&graph_lock);
+    for (int i = 0; i < layer_count; i++) {
+        layers[i].marked = 0;
+    }
+    // An image's refs count the tags and containers pointing at it, so
+    // each reached image is walked once however many roots share it
+    for (int i = 0; i < image_count; i++) {
+        for (int j = 0; images[i].refs > 0 && j < images[i].layer_count; j++) {
+            gc_layer_t *layer = find_layer(images[i].layers[j], 0);
+            if (layer) layer->marked = 1;
+        }
+    }
+    for (int i = 0; i < layer_count; i++) {
+        if (!layers[i].marked && layers[i].refs > 0) {
+            fprintf(stderr, "Layer %s is held by %d image(s) no tag or container reaches\n",
+                    layers[i].id, layers[i].refs);
+            layers[i].marked = 1;
+        }
+    }
+    pthread_mutex_unlock(&graph_lock);
+}
+
+// A lease lasts GC_LEASE_SECONDS, and only counts if it was taken after the
+// last image took hold of the layer: the build or pull that leased it is
+// done with it once the image exists
+static int leased(const struct stat *st, const gc_layer_t *layer) {
+    if (st->st_mtime < time(NULL) - GC_LEASE_SECONDS) {
+        return 0;
+    }
+    return !layer || st->st_mtim.tv_sec > layer->held.tv_sec ||
+           (st->st_mtim.tv_sec == layer->held.tv_sec && st->st_mtim.tv_nsec > layer->held.tv_nsec);
+}
+
+// Sweep: layer directories that are unmarked and, checked again under the
+// lock, still unreferenced and past their lease. Each is renamed out of the
+// store under the lock and deleted after, so builds and pulls only wait for
+// a rename. A lease taken just before the rename shows on the trash, which
+// is then put back; one taken after finds the layer gone.
+static int collect(gc_stats_t *stats) {
+    char layer_path[MAX_PATH_LEN];
+    char trash_path[MAX_PATH_LEN + 8];
+    char rm_cmd[MAX_PATH_LEN + 16];
+    long long chunk_bytes;
+    struct dirent *entry;
+    DIR *dir;
+
+    memset(stats, 0, sizeof(*stats));
+    mark_layers();
+
+    dir = opendir(LAYER_STORAGE_DIR);
+    if (!dir) {
+        perror("opendir layers");
+        return -1;
+    }
+
+    while ((entry = readdir(dir)) != NULL) {
+        struct stat st;
+        int garbage;
+
+        // Dotted names are imports still being staged, or earlier trash
+        if (strchr(entry->d_name, '.')) {
+            continue;
+        }
+        snprintf(layer_path, sizeof(layer_path), "%s/%s", LAYER_STORAGE_DIR, entry->d_name);
+        snprintf(trash_path, sizeof(trash_path), "%s.gc", layer_path);
+
+        pthread_mutex_lock(&graph_lock);
+        gc_layer_t *layer = find_layer(entry->d_name, 0);
+        garbage = (!layer || (!layer->marked && layer->refs == 0)) &&
+                  lstat(layer_path, &st) == 0 && !leased(&st, layer);
+        if (garbage && rename(layer_path, trash_path) != 0) {
+            perror("rename layer");
+            garbage = 0;
+        }
+        if (garbage && (lstat(trash_path, &st) != 0 || leased(&st, layer))) {
+            rename(trash_path, layer_path);
+            garbage = 0;
+        }
+        if (garbage && layer) {
+            remove_layer(layer);
+        }
+        pthread_mutex_unlock(&graph_lock);
+
+        if (!garbage) {
+            continue;
+        }
+
+        stats->bytes_reclaimed += directory_bytes(trash_path);
+        snprintf(rm_cmd, sizeof(rm_cmd), "rm -rf %s", trash_path);
+        if (system(rm_cmd) != 0) {
+            fprintf(stderr, "Failed to remove %s\n", trash_path);
+        }
+        stats->layers_removed++;
+        printf("Deleted layer %s\n", entry->d_name);
+    }
+    closedir(dir);
+
+    // Forget unreferenced layers whose directory is already gone
+    pthread_mutex_lock(&graph_lock);
+    for (int i = layer_count - 1; i >= 0; i--) {
+        if (layers[i].refs == 0) {
+            snprintf(layer_path, sizeof(layer_path), "%s/%s", LAYER_STORAGE_DIR, layers[i].id);
+            if (access(layer_path, F_OK) != 0) {
+                remove_layer(&layers[i]);
+            }
+        }
+    }
+    compact_graph();
+    pthread_mutex_unlock(&graph_lock);
+
+    // Chunks no remaining chunked layer lists
+    if (chunk_store_sweep(LAYER_STORAGE_DIR, &stats->chunks_removed, &chunk_bytes) != 0) {
+        fprintf(stderr, "Failed to sweep the chunk store\n");
+        return -1;
+    }
+    stats->bytes_reclaimed += chunk_bytes;
+    return 0;
+}
+
+int gc_collect(gc_stats_t *stats) {
+    gc_stats_t local;
+
+    pthread_mutex_lock(&collect_lock);
+    int result = collect(stats ? stats : &local);
+    pthread_mutex_unlock(&collect_lock);
+    return result;
+}
+
+// Removes every container that is not running, then collects what that
+// and earlier image removals left unreferenced
+int system_prune(gc_stats_t *stats) {
+    container_list_t *containers = list_containers();
+    long long container_bytes = 0;
+    int removed = 0;
+    int result;
+
+    if (!containers) {
+        return -1;
+    }
+
+    pthread_mutex_lock(&collect_lock);
+    for (int i = 0; i < containers->count; i++) {
+        char container_path[MAX_PATH_LEN];
+        long long bytes;
+
+        if (containers->containers[i].state == CONTAINER_STATE_RUNNING) {
+            continue;
+        }
+        container_dir_path(containers->containers[i].id, container_path, sizeof(container_path));
+        bytes = directory_bytes(container_path);
+        if (remove_container(containers->containers[i].id) == 0) {
+            container_bytes += bytes;
+            removed++;
+        }
+    }
+    free_container_list(containers);
+
+    result = collect(stats);
+    pthread_mutex_unlock(&collect_lock);
+
+    stats->containers_removed = removed;
+    stats->bytes_reclaimed += container_bytes;
+    return result;
+}
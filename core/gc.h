@@ -0,0 +1,42 @@
+#ifndef GC_H
+#define GC_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "image.h"
+
+// Which layers are in use: tags and containers point at an image, an image
+// holds its layers. Every layer counts the images holding it and an image
+// the tags and containers pointing at it, so a layer is garbage once its
+// count drops to zero. The graph is kept in memory; next to the image
+// metadata each change is appended to a snapshot that the collector and
+// the daemon's start rewrite.
+#define GC_GRAPH_PATH METADATA_DIR "/layer-graph"
+
+// A layer that was just created, or found in the store by a build or pull
+// about to use it, is kept this long without any image holding it: the
+// layer directory's time is its lease
+#define GC_LEASE_SECONDS 3600
+
+typedef struct {
+    int containers_removed;
+    int layers_removed;
+    long long chunks_removed;
+    long long bytes_reclaimed;
+} gc_stats_t;
+
+// Function declarations
+int init_gc(void);
+void gc_lease_layer(const char *layer_id);
+void gc_ref_image(const image_info_t *image);
+void gc_unref_tag(const char *full_name);
+void gc_ref_container(const char *container_id, const image_info_t *image);
+void gc_unref_container(const char *container_id);
+int gc_collect(gc_stats_t *stats);
+void gc_request(void);
+int system_prune(gc_stats_t *stats);
+
+#endif // GC_H
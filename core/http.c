@@ -2,6 +2,43 @@
 #include "container.h"
 #include "image.h"
 #include "dockerfile.h"
+#include "build_queue.h"
+#include "registry.h"
+#include "gc.h"
+#include "access_log.h"
+#include "trace.h"
+#include "events.h"
+#include "reaper.h"
+#include "batch.h"
+#include "container_index.h"
+#include "image_index.h"
+#include "list_query.h"
+#include "json.h"
+#include <ctype.h>
+#include <poll.h>
+#include <netinet/tcp.h>
+
+// What this connection's thread has sent for the current request, for the
+// access log, and whether a streamed response got its closing chunk
+static __thread long long bytes_sent;
+static __thread int stream_ended;
+
+static void record_access(const http_request_t* request, const http_response_t* response) {
+    access_record_t record;
+
+    record.id = access_log_next_id();
+    record.received = request->received;
+    inet_ntop(AF_INET, &request->client_addr.sin_addr, record.remote, sizeof(record.remote));
+    memcpy(record.method, request->method, sizeof(record.method));
+    memcpy(record.url, request->url, sizeof(record.url));
+    record.route = request->route;
+    record.status = response->status_code;
+    record.bytes = bytes_sent;
+    record.micros = metrics_elapsed_us(&request->started);
+
+    metrics_observe_request(record.route, record.status, record.micros);
+    access_log_record(&record);
+}
 
 int start_http_server(int port) {
     int server_socket, client_socket;
@@ -65,6 +102,10 @@ int start_http_server(int port) {
         client_info->client_socket = client_socket;
         client_info->client_addr = client_addr;
 
+        // Responses are written in pieces; on a kept connection Nagle would
+        // hold the last one back until the client's delayed ACK
+        setsockopt(client_socket, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt));
+
         // Create thread to handle client
         if (pthread_create(&thread_id, NULL, handle_client, client_info) != 0) {
             perror("pthread_create");
@@ -81,74 +122,208 @@ int start_http_server(int port) {
     return 0;
 }
 
-void* handle_client(void* arg) {
-    client_info_t *client_info = (client_info_t*)arg;
+// Reads until buffer holds a whole request head, keeping what is already
+// there from the request before, and sets head_len to its length up to and
+// including the blank line. 1 then; 0 when the client closed or, between
+// requests, stayed quiet too long; -1 when the head does not fit in buffer.
+static int read_request_head(int client_socket, char *buffer, size_t *buffered, int idle, size_t *head_len) {
+    char *head_end;
+
+    while (!(head_end = memmem(buffer, *buffered, "\r\n\r\n", 4))) {
+        struct pollfd pfd = { client_socket, POLLIN, 0 };
+        ssize_t n;
+
+        if (*buffered == MAX_REQUEST_SIZE - 1) {
+            buffer[*buffered] = '\0';
+            return -1;
+        }
+        if (idle && *buffered == 0 && poll(&pfd, 1, HTTP_KEEPALIVE_TIMEOUT * 1000) <= 0) {
+            return 0;
+        }
+        n = recv(client_socket, buffer + *buffered, MAX_REQUEST_SIZE - 1 - *buffered, 0);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) {
+            return 0;
+        }
+        *buffered += n;
+    }
+    buffer[*buffered] = '\0';
+    *head_len = head_end + 4 - buffer;
+    return 1;
+}
+
+// HTTP/1.1 keeps the connection unless told to close; 1.0 only when asked
+static int wants_keep_alive(const http_request_t* request) {
+    if (strcmp(request->version, "HTTP/1.1") == 0) {
+        return !strcasestr(request->headers, "Connection: close");
+    }
+    return strcasestr(request->headers, "Connection: keep-alive") != NULL;
+}
+
+// Answers a request that never reached a handler; the connection is closed
+// after it
+static void reject_request(const client_info_t *client_info, const struct timespec *received,
+                           const struct timespec *started, int status, const char *message, const char *body) {
+    http_request_t request;
+    http_response_t response;
+
+    memset(&request, 0, sizeof(request));
+    request.client_addr = client_info->client_addr;
+    request.received = *received;
+    request.started = *started;
+    create_http_response(&response, status, message, body);
+    response.keep_alive = 0;
+    send_http_response(client_info->client_socket, &response);
+    record_access(&request, &response);
+}
+
+typedef enum {
+    CONNECTION_CLOSE,
+    CONNECTION_KEEP,
+    CONNECTION_HANDED_OFF               // a parked request owns the socket now
+} connection_state_t;
+
+// Serves the request at the front of buffer. Bytes after it that came in
+// the same reads are moved to the front for the next one.
+static connection_state_t serve_request(client_info_t *client_info, char *request_buffer, size_t *buffered,
+                                        int served) {
     int client_socket = client_info->client_socket;
-    struct sockaddr_in client_addr = client_info->client_addr;
-    char request_buffer[MAX_REQUEST_SIZE];
     http_request_t request;
     http_response_t response;
-    int bytes_received;
+    struct timespec received, started;
+    trace_span_t span, phase;
+    size_t head_len = 0, consumed;
+    int head;
 
     // Receive request
-    bytes_received = recv(client_socket, request_buffer, sizeof(request_buffer) - 1, 0);
-    if (bytes_received <= 0) {
-        close(client_socket);
-        free(client_info);
-        return NULL;
+    trace_begin(&phase, "recv");
+    head = read_request_head(client_socket, request_buffer, buffered, served > 0, &head_len);
+    trace_end(&phase, head < 0 ? "431" : NULL);
+    if (head == 0) {
+        return CONNECTION_CLOSE;
     }
 
-    request_buffer[bytes_received] = '\0';
+    clock_gettime(CLOCK_REALTIME, &received);
+    clock_gettime(CLOCK_MONOTONIC, &started);
+    bytes_sent = 0;
+    stream_ended = 0;
+    if (head < 0) {
+        reject_request(client_info, &received, &started, 431, "Request Header Fields Too Large",
+                       "Request header fields too large");
+        return CONNECTION_CLOSE;
+    }
+    trace_begin(&span, "request");
 
     // Parse request
+    trace_begin(&phase, "parse");
+    memset(&request, 0, sizeof(request));
+    request.arena = &client_info->arena;
     if (parse_http_request(request_buffer, &request) != 0) {
-        create_http_response(&response, 400, "Bad Request", "Invalid HTTP request");
-        send_http_response(client_socket, &response);
-        close(client_socket);
-        free(client_info);
-        return NULL;
+        trace_end(&phase, NULL);
+        reject_request(client_info, &received, &started, 400, "Bad Request", "Invalid HTTP request");
+        trace_end(&span, "400");
+        return CONNECTION_CLOSE;
     }
+    trace_end(&phase, NULL);
+    request.client_addr = client_info->client_addr;
+    request.received = received;
+    request.started = started;
 
-    // Log request
-    log_request(&request, &client_addr);
+    // Streaming handlers read the body themselves, starting with whatever
+    // arrived in the same reads as the headers
+    request.raw_body = request_buffer + head_len;
+    request.raw_body_len = *buffered - head_len;
 
     // Handle API request
-    if (handle_api_request(&request, &response) != 0) {
+    trace_begin(&phase, "handle");
+    request.client_socket = client_socket;
+    response.streamed = 0;
+    response.parked = 0;
+    response.keep_alive = served + 1 < HTTP_KEEPALIVE_MAX && wants_keep_alive(&request);
+    if (handle_api_request(&request, &response) != 0 && !response.streamed && !response.parked) {
         create_http_response(&response, 500, "Internal Server Error", "Failed to handle request");
     }
+    trace_end(&phase, metrics_route_name(request.route));
+
+    // A parked request is answered, logged and closed by whoever resumes
+    // it, possibly already; the socket is not this thread's any more
+    if (response.parked) {
+        trace_end(&span, request.url);
+        return CONNECTION_HANDED_OFF;
+    }
 
-    // Log response
-    log_response(&response);
+    // Streaming handlers have already written their response
+    if (!response.streamed) {
+        trace_begin(&phase, "send");
+        send_http_response(client_socket, &response);
+        trace_end(&phase, NULL);
+    }
+    record_access(&request, &response);
+    trace_end(&span, request.url);
+
+    // The next request starts where this one's body ended, so a body no
+    // one read, or a stream cut short, leaves nowhere to pick up from
+    if (!response.keep_alive || (request.content_length > 0 && !request.body_read) ||
+        (response.streamed && !stream_ended)) {
+        return CONNECTION_CLOSE;
+    }
+    consumed = head_len;
+    if (request.content_length > 0) {
+        consumed += (size_t)request.content_length < request.raw_body_len ? (size_t)request.content_length
+                                                                         : request.raw_body_len;
+    }
+    memmove(request_buffer, request_buffer + consumed, *buffered - consumed);
+    *buffered -= consumed;
+    return CONNECTION_KEEP;
+}
 
-    // Send response
-    send_http_response(client_socket, &response);
+void* handle_client(void* arg) {
+    client_info_t *client_info = (client_info_t*)arg;
+    char request_buffer[MAX_REQUEST_SIZE];
+    connection_state_t state = CONNECTION_KEEP;
+    size_t buffered = 0;
 
-    close(client_socket);
+    arena_init(&client_info->arena, HTTP_REQUEST_ARENA_SIZE);
+    for (int served = 0; state == CONNECTION_KEEP; served++) {
+        state = serve_request(client_info, request_buffer, &buffered, served);
+        arena_reset(&client_info->arena);
+    }
+
+    if (state == CONNECTION_CLOSE) {
+        close(client_info->client_socket);
+    }
+    arena_free(&client_info->arena);
     free(client_info);
     return NULL;
 }
 
 int parse_http_request(const char* request, http_request_t* parsed) {
     char *line, *method, *url, *version;
-    char *request_copy = strdup(request);
+    char *lines, *words;
+    char *request_copy = arena_strdup(parsed->arena, request);
 
     if (!request_copy) {
         return -1;
     }
 
+    // Cut off the body first: strtok skips empty lines, so it cannot find
+    // the end of the headers by itself
+    char *headers_end = strstr(request_copy, "\r\n\r\n");
+    if (headers_end) {
+        *headers_end = '\0';
+    }
+
     // Parse first line (method, URL, version)
-    line = strtok(request_copy, "\r\n");
+    line = strtok_r(request_copy, "\r\n", &lines);
     if (!line) {
-        free(request_copy);
         return -1;
     }
 
-    method = strtok(line, " ");
-    url = strtok(NULL, " ");
-    version = strtok(NULL, " ");
+    method = strtok_r(line, " ", &words);
+    url = strtok_r(NULL, " ", &words);
+    version = strtok_r(NULL, " ", &words);
 
     if (!method || !url || !version) {
-        free(request_copy);
         return -1;
     }
 
@@ -160,28 +335,21 @@ int parse_http_request(const char* request, http_request_t* parsed) {
     char *header_line;
     parsed->headers[0] = '\0';
 
-    while ((header_line = strtok(NULL, "\r\n")) != NULL) {
+    while ((header_line = strtok_r(NULL, "\r\n", &lines)) != NULL) {
         if (strlen(header_line) == 0) {
             break; // End of headers
         }
 
         if (strstr(header_line, "Content-Length:")) {
-            sscanf(header_line, "Content-Length: %d", &parsed->content_length);
+            sscanf(header_line, "Content-Length: %lld", &parsed->content_length);
         }
 
-        strcat(parsed->headers, header_line);
-        strcat(parsed->headers, "\r\n");
-    }
-
-    // Parse body
-    char *body = strtok(NULL, "");
-    if (body) {
-        strncpy(parsed->body, body, sizeof(parsed->body) - 1);
-    } else {
-        parsed->body[0] = '\0';
+        if (strlen(parsed->headers) + strlen(header_line) + 3 <= sizeof(parsed->headers)) {
+            strcat(parsed->headers, header_line);
+            strcat(parsed->headers, "\r\n");
+        }
     }
 
-    free(request_copy);
     return 0;
 }
 
@@ -198,11 +366,10 @@ int create_http_response(http_response_t* response, int status_code, const char*
         response->content_length = 0;
     }
 
-    // Set headers
+    // Set headers; send_http_response adds Connection once it is decided
     snprintf(response->headers, sizeof(response->headers),
              "Content-Type: application/json\r\n"
-             "Content-Length: %d\r\n"
-             "Connection: close\r\n",
+             "Content-Length: %d\r\n",
              response->content_length);
 
     return 0;
@@ -210,36 +377,216 @@ int create_http_response(http_response_t* response, int status_code, const char*
 
 int send_http_response(int client_socket, http_response_t* response) {
     char response_buffer[MAX_RESPONSE_SIZE];
-    int bytes_sent;
+    ssize_t sent;
 
     // Build response
     snprintf(response_buffer, sizeof(response_buffer),
              "%s %d %s\r\n"
              "%s"
+             "%s"
              "\r\n"
              "%s",
              response->version,
              response->status_code,
              response->status_message,
              response->headers,
+             response->keep_alive ? "Connection: keep-alive\r\n" : "Connection: close\r\n",
              response->body);
 
     // Send response
-    bytes_sent = send(client_socket, response_buffer, strlen(response_buffer), 0);
-    if (bytes_sent < 0) {
+    sent = send(client_socket, response_buffer, strlen(response_buffer), 0);
+    if (sent < 0) {
         perror("send");
         return -1;
     }
+    bytes_sent += sent;
 
     return 0;
 }
 
+// more holds the bytes back for what follows, so a chunk's size line, data
+// and trailer go out as one segment rather than three
+static int send_all(int client_socket, const char* data, size_t len, int more) {
+    while (len > 0) {
+        // A client that hangs up mid-stream must not kill the daemon
+        ssize_t sent = send(client_socket, data, len, MSG_NOSIGNAL | (more ? MSG_MORE : 0));
+        if (sent < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        data += sent;
+        len -= sent;
+        bytes_sent += sent;
+    }
+    return 0;
+}
+
+int send_chunked_response_header(int client_socket, http_response_t* response, int status_code, const char* status_message) {
+    return send_stream_response_header(client_socket, response, status_code, status_message, "application/x-ndjson");
+}
+
+int send_stream_response_header(int client_socket, http_response_t* response, int status_code,
+                                const char* status_message, const char* content_type) {
+    char header[MAX_HEADER_SIZE];
+
+    strcpy(response->version, "HTTP/1.1");
+    response->status_code = status_code;
+    strncpy(response->status_message, status_message, sizeof(response->status_message) - 1);
+    response->body[0] = '\0';
+    response->content_length = 0;
+    response->streamed = 1;
+
+    int len = snprintf(header, sizeof(header),
+                       "%s %d %s\r\n"
+                       "Content-Type: %s\r\n"
+                       "Transfer-Encoding: chunked\r\n"
+                       "Connection: %s\r\n"
+                       "\r\n",
+                       response->version, status_code, status_message, content_type,
+                       response->keep_alive ? "keep-alive" : "close");
+
+    return send_all(client_socket, header, len, 0);
+}
+
+int send_chunk(int client_socket, const char* data, size_t len) {
+    char size_line[32];
+
+    if (len == 0) {
+        return 0;
+    }
+
+    int size_len = snprintf(size_line, sizeof(size_line), "%zx\r\n", len);
+    if (send_all(client_socket, size_line, size_len, 1) != 0 ||
+        send_all(client_socket, data, len, 1) != 0 ||
+        send_all(client_socket, "\r\n", 2, 0) != 0) {
+        return -1;
+    }
+    return 0;
+}
+
+int end_chunked_response(int client_socket) {
+    if (send_all(client_socket, "0\r\n\r\n", 5, 0) != 0) {
+        return -1;
+    }
+    stream_ended = 1;
+    return 0;
+}
+
+// Decoding never makes a value longer, so it can be done where it lies
+static void url_decode_in_place(char* str) {
+    char *out = str;
+
+    for (; *str; str++) {
+        if (*str == '%' && isxdigit((unsigned char)str[1]) && isxdigit((unsigned char)str[2])) {
+            char hex[3] = { str[1], str[2], '\0' };
+            *out++ = (char)strtol(hex, NULL, 16);
+            str += 2;
+        } else {
+            *out++ = *str == '+' ? ' ' : *str;
+        }
+    }
+    *out = '\0';
+}
+
+// Decodes %XX escapes and '+' in a query value; the caller frees the result
+char* url_decode(const char* str) {
+    char *decoded = strdup(str);
+
+    if (!decoded) {
+        return NULL;
+    }
+    url_decode_in_place(decoded);
+    return decoded;
+}
+
+// Copies the value of key from the request's query string, decoded
+static int query_value(const char* url, const char* key, char* out, size_t size) {
+    const char *query = strchr(url, '?');
+    size_t key_len = strlen(key);
+
+    out[0] = '\0';
+    for (const char *p = query; p; p = strchr(p + 1, '&')) {
+        if (strncmp(p + 1, key, key_len) != 0 || p[1 + key_len] != '=') {
+            continue;
+        }
+        snprintf(out, size, "%.*s", (int)strcspn(p + 2 + key_len, "&"), p + 2 + key_len);
+        url_decode_in_place(out);
+        return 0;
+    }
+    return -1;
+}
+
+// Finishes a body written with a json_writer_t into its own buffer and
+// makes it the response; one that did not fit is a 500 rather than cut off
+static void json_body_response(http_response_t* response, int status_code, const char* status_message,
+                               json_writer_t* w) {
+    if (json_writer_finish(w) < 0) {
+        create_http_response(response, 500, "Internal Server Error", "{\"error\": \"Response too large\"}");
+        return;
+    }
+    create_http_response(response, status_code, status_message, w->buffer);
+}
+
+// The whole body, NUL terminated and from the request's arena: what arrived
+// with the headers, then the rest from the socket. NULL when it is over
+// limit or the client hangs up.
+static char* read_request_body(http_request_t* request, size_t limit) {
+    size_t len = request->raw_body_len;
+    size_t total;
+    char *body;
+
+    if (request->content_length < 0 || (unsigned long long)request->content_length > limit) {
+        return NULL;
+    }
+    total = (size_t)request->content_length;
+    if (len > total) {
+        len = total;
+    }
+
+    body = arena_alloc(request->arena, total + 1);
+    if (!body) {
+        return NULL;
+    }
+    if (len > 0) {
+        memcpy(body, request->raw_body, len);
+    }
+    while (len < total) {
+        ssize_t n = recv(request->client_socket, body + len, total - len, 0);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) {
+            return NULL;
+        }
+        len += n;
+    }
+    body[total] = '\0';
+    request->body_read = 1;
+    return body;
+}
+
 int handle_api_request(http_request_t* request, http_response_t* response) {
     // Route requests based on URL
     if (strstr(request->url, "/containers")) {
         return handle_containers_api(request, response);
     } else if (strstr(request->url, "/images")) {
         return handle_images_api(request, response);
+    } else if (strncmp(request->url, "/build", 6) == 0 && strcmp(request->method, "POST") == 0) {
+        request->route = METRICS_ROUTE_BUILD;
+        return handle_image_build(request, response);
+    } else if (strncmp(request->url, "/commit", 7) == 0 && strcmp(request->method, "POST") == 0) {
+        request->route = METRICS_ROUTE_CONTAINER_COMMIT;
+        return handle_container_commit(request, response);
+    } else if (strncmp(request->url, "/system/prune", 13) == 0 && strcmp(request->method, "POST") == 0) {
+        request->route = METRICS_ROUTE_SYSTEM_PRUNE;
+        return handle_system_prune(request, response);
+    } else if (strncmp(request->url, "/metrics", 8) == 0 && strcmp(request->method, "GET") == 0) {
+        request->route = METRICS_ROUTE_METRICS;
+        return handle_metrics(request, response);
+    } else if (strncmp(request->url, "/trace", 6) == 0) {
+        request->route = METRICS_ROUTE_TRACE;
+        return handle_trace(request, response);
+    } else if (strncmp(request->url, "/events", 7) == 0 && strcmp(request->method, "GET") == 0) {
+        request->route = METRICS_ROUTE_EVENTS;
+        return handle_events(request, response);
     // } else if (strstr(request->url, "/version")) {
     //     return handle_version_api(request, response);
     // } else if (strstr(request->url, "/info")) {
@@ -252,18 +599,38 @@ int handle_api_request(http_request_t* request, http_response_t* response) {
 
 int handle_containers_api(http_request_t* request, http_response_t* response) {
     if (strcmp(request->method, "GET") == 0) {
-        if (strstr(request->url, "/containers/json")) {
-            // return handle_container_list(request, response);
+        if (strncmp(request->url, "/containers/json", 16) == 0) {
+            request->route = METRICS_ROUTE_CONTAINER_LIST;
+            return handle_container_list(request, response);
         } else if (strstr(request->url, "/containers/") && strstr(request->url, "/start")) {
+            request->route = METRICS_ROUTE_CONTAINER_START;
             return handle_container_start(request, response);
         } else if (strstr(request->url, "/containers/") && strstr(request->url, "/stop")) {
+            request->route = METRICS_ROUTE_CONTAINER_STOP;
             return handle_container_stop(request, response);
         } else if (strstr(request->url, "/containers/") && strstr(request->url, "/remove")) {
+            request->route = METRICS_ROUTE_CONTAINER_REMOVE;
             return handle_container_remove(request, response);
         }
+    } else if (strcmp(request->method, "DELETE") == 0 && strstr(request->url, "/containers/")) {
+        request->route = METRICS_ROUTE_CONTAINER_REMOVE;
+        return handle_container_remove(request, response);
     } else if (strcmp(request->method, "POST") == 0) {
-        if (strstr(request->url, "/containers/create")) {
+        if (strncmp(request->url, "/containers/batch", 17) == 0) {
+            request->route = METRICS_ROUTE_CONTAINER_BATCH;
+            return handle_container_batch(request, response);
+        } else if (strstr(request->url, "/containers/create")) {
+            request->route = METRICS_ROUTE_CONTAINER_CREATE;
             return handle_container_create(request, response);
+        } else if (strstr(request->url, "/containers/") && strstr(request->url, "/start")) {
+            request->route = METRICS_ROUTE_CONTAINER_START;
+            return handle_container_start(request, response);
+        } else if (strstr(request->url, "/containers/") && strstr(request->url, "/stop")) {
+            request->route = METRICS_ROUTE_CONTAINER_STOP;
+            return handle_container_stop(request, response);
+        } else if (strstr(request->url, "/containers/") && strstr(request->url, "/wait")) {
+            request->route = METRICS_ROUTE_CONTAINER_WAIT;
+            return handle_container_wait(request, response);
         }
     }
 
@@ -273,15 +640,33 @@ int handle_containers_api(http_request_t* request, http_response_t* response) {
 
 int handle_images_api(http_request_t* request, http_response_t* response) {
     if (strcmp(request->method, "GET") == 0) {
-        if (strstr(request->url, "/images/json")) {
+        if (strncmp(request->url, "/images/json", 12) == 0) {
+            request->route = METRICS_ROUTE_IMAGE_LIST;
             return handle_image_list(request, response);
+        } else if (strstr(request->url, "/images/") && strstr(request->url, "/get")) {
+            request->route = METRICS_ROUTE_IMAGE_SAVE;
+            return handle_image_save(request, response);
         }
     } else if (strcmp(request->method, "POST") == 0) {
-        if (strstr(request->url, "/build")) {
+        if (strstr(request->url, "/images/load")) {
+            request->route = METRICS_ROUTE_IMAGE_LOAD;
+            return handle_image_load(request, response);
+        } else if (strstr(request->url, "/images/create")) {
+            request->route = METRICS_ROUTE_IMAGE_PULL;
+            return handle_image_pull(request, response);
+        } else if (strstr(request->url, "/images/") && strstr(request->url, "/push")) {
+            request->route = METRICS_ROUTE_IMAGE_PUSH;
+            return handle_image_push(request, response);
+        } else if (strstr(request->url, "/images/") && strstr(request->url, "/squash")) {
+            request->route = METRICS_ROUTE_IMAGE_SQUASH;
+            return handle_image_squash(request, response);
+        } else if (strstr(request->url, "/build")) {
+            request->route = METRICS_ROUTE_BUILD;
             return handle_image_build(request, response);
         }
     } else if (strcmp(request->method, "DELETE") == 0) {
         if (strstr(request->url, "/images/")) {
+            request->route = METRICS_ROUTE_IMAGE_REMOVE;
             return handle_image_remove(request, response);
         }
     }
@@ -298,48 +683,60 @@ int handle_container_create(http_request_t* request, http_response_t* response)
     char env_vars[512] = {0};
     char port_mappings[256] = {0};
     char volume_mappings[256] = {0};
+    char container_id[MAX_CONTAINER_ID_LEN];
+    char created[MAX_CONTAINER_ID_LEN + 64];
     int interactive = 0, tty = 0, detach = 0;
-
-    // Parse JSON body (simplified)
-    if (strstr(request->body, "\"Image\"")) {
-        sscanf(request->body, "\"Image\":\"%[^\"]\"", image_name);
-    }
-    if (strstr(request->body, "\"Cmd\"")) {
-        sscanf(request->body, "\"Cmd\":[\"%[^\"]\"", command);
-    }
-    if (strstr(request->body, "\"WorkingDir\"")) {
-        sscanf(request->body, "\"WorkingDir\":\"%[^\"]\"", working_dir);
-    }
-    if (strstr(request->body, "\"Env\"")) {
-        sscanf(request->body, "\"Env\":[\"%[^\"]\"", env_vars);
-    }
-    if (strstr(request->body, "\"PortBindings\"")) {
-        sscanf(request->body, "\"PortBindings\":\"%[^\"]\"", port_mappings);
-    }
-    if (strstr(request->body, "\"Binds\"")) {
-        sscanf(request->body, "\"Binds\":[\"%[^\"]\"", volume_mappings);
+    json_value_t body, value;
+    json_writer_t w;
+    char *text;
+
+    // The whole body, even when it did not all come with the headers
+    text = read_request_body(request, MAX_REQUEST_SIZE);
+    if (!text || json_parse(text, strlen(text), &body) != 0 || body.type != JSON_OBJECT) {
+        create_http_response(response, 400, "Bad Request", "{\"error\": \"Body must be a JSON object\"}");
+        return 0;
     }
-    if (strstr(request->body, "\"AttachStdin\"")) {
-        interactive = 1;
+
+    // Cmd, Env and Binds are arrays; the container keeps each as one string
+    json_get_string(&body, "Image", image_name, sizeof(image_name));
+    if (json_get(&body, "Cmd", &value) == 0) {
+        json_join_strings(&value, " ", command, sizeof(command));
     }
-    if (strstr(request->body, "\"AttachStdout\"")) {
-        tty = 1;
+    json_get_string(&body, "WorkingDir", working_dir, sizeof(working_dir));
+    if (json_get(&body, "Env", &value) == 0) {
+        json_join_strings(&value, ";", env_vars, sizeof(env_vars));
     }
-    if (strstr(request->body, "\"Detach\"")) {
-        detach = 1;
+    json_get_string(&body, "PortBindings", port_mappings, sizeof(port_mappings));
+    if (json_get(&body, "Binds", &value) == 0) {
+        json_join_strings(&value, ";", volume_mappings, sizeof(volume_mappings));
     }
+    json_get_bool(&body, "AttachStdin", &interactive);
+    json_get_bool(&body, "AttachStdout", &tty);
+    json_get_bool(&body, "Detach", &detach);
 
     if (strlen(image_name) == 0) {
         create_http_response(response, 400, "Bad Request", "{\"error\": \"Image name required\"}");
         return 0;
     }
 
+    struct timespec started;
+    clock_gettime(CLOCK_MONOTONIC, &started);
     int result = create_container(container_name, image_name, command, working_dir,
                                  env_vars, port_mappings, volume_mappings,
-                                 interactive, tty, detach);
+                                 interactive, tty, detach, container_id);
+    metrics_observe_container_op(METRICS_OP_CREATE, result != 0, metrics_elapsed_us(&started));
 
     if (result == 0) {
-        create_http_response(response, 201, "Created", "{\"Id\": \"container_created\", \"Warnings\": []}");
+        json_writer_init(&w, created, sizeof(created), NULL, NULL);
+        json_write_object_begin(&w);
+        json_write_key(&w, "Id");
+        json_write_string(&w, container_id);
+        json_write_key(&w, "Warnings");
+        json_write_array_begin(&w);
+        json_write_array_end(&w);
+        json_write_object_end(&w);
+        json_writer_finish(&w);
+        create_http_response(response, 201, "Created", created);
     } else {
         create_http_response(response, 500, "Internal Server Error", "{\"error\": \"Failed to create container\"}");
     }
@@ -354,8 +751,15 @@ int handle_container_start(http_request_t* request, http_response_t* response) {
         create_http_response(response, 400, "Bad Request", "{\"error\": \"Invalid container ID\"}");
         return 0;
     }
+    if (resolve_container_id(container_id, container_id, sizeof(container_id)) != 0) {
+        create_http_response(response, 404, "Not Found", "{\"error\": \"No such container\"}");
+        return 0;
+    }
 
+    struct timespec started;
+    clock_gettime(CLOCK_MONOTONIC, &started);
     int result = start_container(container_id);
+    metrics_observe_container_op(METRICS_OP_START, result != 0, metrics_elapsed_us(&started));
 
     if (result == 0) {
         create_http_response(response, 204, "No Content", "");
@@ -373,8 +777,15 @@ int handle_container_stop(http_request_t* request, http_response_t* response) {
         create_http_response(response, 400, "Bad Request", "{\"error\": \"Invalid container ID\"}");
         return 0;
     }
+    if (resolve_container_id(container_id, container_id, sizeof(container_id)) != 0) {
+        create_http_response(response, 404, "Not Found", "{\"error\": \"No such container\"}");
+        return 0;
+    }
 
+    struct timespec started;
+    clock_gettime(CLOCK_MONOTONIC, &started);
     int result = stop_container(container_id);
+    metrics_observe_container_op(METRICS_OP_STOP, result != 0, metrics_elapsed_us(&started));
 
     if (result == 0) {
         create_http_response(response, 204, "No Content", "");
@@ -392,8 +803,15 @@ int handle_container_remove(http_request_t* request, http_response_t* response)
         create_http_response(response, 400, "Bad Request", "{\"error\": \"Invalid container ID\"}");
         return 0;
     }
+    if (resolve_container_id(container_id, container_id, sizeof(container_id)) != 0) {
+        create_http_response(response, 404, "Not Found", "{\"error\": \"No such container\"}");
+        return 0;
+    }
 
+    struct timespec started;
+    clock_gettime(CLOCK_MONOTONIC, &started);
     int result = remove_container(container_id);
+    metrics_observe_container_op(METRICS_OP_REMOVE, result != 0, metrics_elapsed_us(&started));
 
     if (result == 0) {
         create_http_response(response, 204, "No Content", "");
@@ -404,126 +822,522 @@ int handle_container_remove(http_request_t* request, http_response_t* response)
     return 0;
 }
 
-int handle_container_list(http_request_t* request, http_response_t* response) {
-    container_list_t *containers = list_containers();
+// What is kept of a wait request while it is parked with the reaper
+typedef struct {
+    struct sockaddr_in client_addr;
+    struct timespec received;
+    struct timespec started;
+    char url[MAX_URL_SIZE];
+} parked_wait_t;
+
+// Runs on the reaper thread; exit_code is -1 when the client hung up.
+// The socket is non-blocking here: a client that is not reading gets its
+// connection closed rather than stalling every other wait.
+static void finish_container_wait(int fd, int exit_code, void *ctx) {
+    parked_wait_t *wait = ctx;
+    http_request_t request;
+    http_response_t response;
+    char body[64];
+
+    memset(&request, 0, sizeof(request));
+    strcpy(request.method, "POST");
+    memcpy(request.url, wait->url, sizeof(request.url));
+    request.route = METRICS_ROUTE_CONTAINER_WAIT;
+    request.client_addr = wait->client_addr;
+    request.received = wait->received;
+    request.started = wait->started;
+
+    bytes_sent = 0;
+    memset(&response, 0, sizeof(response));
+    if (exit_code >= 0) {
+        snprintf(body, sizeof(body), "{\"StatusCode\":%d}", exit_code);
+        create_http_response(&response, 200, "OK", body);
+        send_http_response(fd, &response);
+    }
+    record_access(&request, &response);
 
-    if (!containers) {
-        create_http_response(response, 500, "Internal Server Error", "{\"error\": \"Failed to list containers\"}");
+    close(fd);
+    free(wait);
+}
+
+// Answers once the container has exited. Until then the request is parked
+// with the reaper, and its thread goes back to serving nothing.
+int handle_container_wait(http_request_t* request, http_response_t* response) {
+    char container_id[256];
+    char body[64];
+    container_info_t container;
+    parked_wait_t *wait;
+    int parked;
+
+    if (extract_container_id_from_url(request->url, container_id) != 0) {
+        create_http_response(response, 400, "Bad Request", "{\"error\": \"Invalid container ID\"}");
+        return 0;
+    }
+    if (resolve_container_id(container_id, container_id, sizeof(container_id)) != 0) {
+        create_http_response(response, 404, "Not Found", "{\"error\": \"No such container\"}");
         return 0;
     }
 
-    char json_response[4096] = "[";
-    char container_json[512];
+    wait = malloc(sizeof(parked_wait_t));
+    if (!wait) {
+        perror("malloc");
+        return -1;
+    }
+    wait->client_addr = request->client_addr;
+    wait->received = request->received;
+    wait->started = request->started;
+    memcpy(wait->url, request->url, sizeof(wait->url));
+
+    parked = reaper_park(container_id, request->client_socket, finish_container_wait, wait);
+    if (parked == 0) {
+        response->parked = 1;
+        return 0;
+    }
+    free(wait);
+    if (parked < 0) {
+        return -1;
+    }
 
-    for (int i = 0; i < containers->count; i++) {
-        snprintf(container_json, sizeof(container_json),
-                 "{\"Id\":\"%s\",\"Names\":[\"%s\"],\"Image\":\"%s\",\"Command\":\"%s\",\"Created\":%s,\"Status\":\"%s\"}",
-                 containers->containers[i].id,
-                 containers->containers[i].name,
-                 containers->containers[i].image,
-                 containers->containers[i].command,
-                 containers->containers[i].created,
-                 containers->containers[i].state == CONTAINER_STATE_RUNNING ? "running" : "exited");
+    // Not running, or not this daemon's to wait on
+    if (read_container_metadata(container_id, &container) != 0) {
+        create_http_response(response, 500, "Internal Server Error", "{\"error\": \"Failed to read container metadata\"}");
+    } else if (container.state == CONTAINER_STATE_RUNNING) {
+        create_http_response(response, 409, "Conflict", "{\"error\": \"Container was not started by this daemon\"}");
+    } else {
+        snprintf(body, sizeof(body), "{\"StatusCode\":%d}", container.exit_code);
+        create_http_response(response, 200, "OK", body);
+    }
+    return 0;
+}
 
-        strcat(json_response, container_json);
-        if (i < containers->count - 1) {
-            strcat(json_response, ",");
-        }
+typedef struct {
+    int client_socket;
+    batch_action_t action;
+} batch_stream_t;
+
+static int format_batch_result(char *line, size_t size, const char *container_id, int failed,
+                               uint64_t micros, void *user_data) {
+    batch_stream_t *stream = user_data;
+    json_writer_t w;
+    long long len;
+
+    // One byte held back for the newline after the object
+    json_writer_init(&w, line, size - 1, NULL, NULL);
+    json_write_object_begin(&w);
+    json_write_key(&w, "event");
+    json_write_string(&w, "result");
+    json_write_key(&w, "id");
+    json_write_string(&w, container_id);
+    json_write_key(&w, "action");
+    json_write_string(&w, batch_action_name(stream->action));
+    json_write_key(&w, "ok");
+    json_write_bool(&w, !failed);
+    json_write_key(&w, "duration_ms");
+    json_write_fixed(&w, micros / 1000.0, 3);
+    if (failed) {
+        json_write_key(&w, "error");
+        json_write_string(&w, "failed, see the daemon log");
     }
+    json_write_object_end(&w);
+    if ((len = json_writer_finish(&w)) < 0) {
+        return -1;
+    }
+    line[len++] = '\n';
+    line[len] = '\0';
+    return (int)len;
+}
 
-    strcat(json_response, "]");
+static int send_batch_results(const char *data, size_t len, void *user_data) {
+    batch_stream_t *stream = user_data;
+    return send_chunk(stream->client_socket, data, len);
+}
 
-    create_http_response(response, 200, "OK", json_response);
+// Container ids become paths, and rm removes the container's directory
+static int valid_batch_id(const char* id) {
+    return id[0] != '\0' && id[0] != '.' && !strchr(id, '/') && strlen(id) < MAX_CONTAINER_ID_LEN;
+}
 
-    // Free containers list
-    free(containers->containers);
-    free(containers);
+// The ids of a "containers" list, from arena; -1 when one of them is not a
+// valid id. Short ids resolve as on the single-container routes; one that
+// does not stays as given and fails on its own.
+static int parse_batch_ids(arena_t *arena, const json_value_t *list, char ***ids, int *count) {
+    char id[MAX_CONTAINER_ID_LEN];
+    json_value_t element;
+    json_iter_t it;
+    int n = 0;
+
+    *count = 0;
+    if (json_iter_init(list, &it) != 0 || it.object) {
+        return -1;
+    }
+    while (json_iter_next(&it, NULL, &element) > 0) {
+        n++;
+    }
+    *ids = arena_alloc(arena, sizeof(char*) * (n > 0 ? n : 1));
+    if (!*ids) {
+        return -1;
+    }
 
+    json_iter_init(list, &it);
+    while (json_iter_next(&it, NULL, &element) > 0) {
+        if (json_string_copy(&element, id, sizeof(id)) != 0 || !valid_batch_id(id)) {
+            *count = 0;
+            return -1;
+        }
+        resolve_container_id(id, id, sizeof(id));
+        if (!((*ids)[*count] = arena_strdup(arena, id))) {
+            *count = 0;
+            return -1;
+        }
+        (*count)++;
+    }
     return 0;
 }
 
-int handle_image_build(http_request_t* request, http_response_t* response) {
-    char image_name[256] = {0};
-    char dockerfile_path[256] = {0};
-    char context_path[256] = {0};
+// {"action":"stop","containers":[ids]} or {"action":"rm","filters":{...}}
+// (or "all":true) with an optional "parallel". Streams one result line per
+// container as it finishes, then a summary.
+int handle_container_batch(http_request_t* request, http_response_t* response) {
+    char action_name[16], line[256];
+    char **ids = NULL;
+    int count = 0, parallel = BATCH_DEFAULT_PARALLEL;
+    batch_action_t action;
+    batch_stream_t stream;
+    batch_stats_t stats;
+    struct timespec started;
+    json_value_t root, value;
+    json_writer_t w;
+    long long requested;
+    char *body;
+
+    body = read_request_body(request, BATCH_MAX_BODY);
+    if (!body) {
+        create_http_response(response, 400, "Bad Request", "{\"error\": \"Missing or oversized batch body\"}");
+        return 0;
+    }
+    if (json_parse(body, strlen(body), &root) != 0 || root.type != JSON_OBJECT) {
+        create_http_response(response, 400, "Bad Request", "{\"error\": \"Body must be a JSON object\"}");
+        return 0;
+    }
 
-    // Parse query parameters
-    if (strstr(request->url, "t=")) {
-        sscanf(strstr(request->url, "t="), "t=%[^&]", image_name);
+    if (json_get_string(&root, "action", action_name, sizeof(action_name)) != 0 ||
+        batch_action_from_name(action_name, &action) != 0) {
+        create_http_response(response, 400, "Bad Request", "{\"error\": \"action must be start, stop, kill or rm\"}");
+        return 0;
     }
-    if (strstr(request->url, "dockerfile=")) {
-        sscanf(strstr(request->url, "dockerfile="), "dockerfile=%[^&]", dockerfile_path);
+    if (json_get_ll(&root, "parallel", &requested) == 0) {
+        parallel = requested < 1 ? 1 : requested > BATCH_MAX_PARALLEL ? BATCH_MAX_PARALLEL : (int)requested;
     }
 
-    if (strlen(image_name) == 0) {
-        create_http_response(response, 400, "Bad Request", "{\"error\": \"Image name required\"}");
+    if (json_get(&root, "containers", &value) == 0) {
+        if (parse_batch_ids(request->arena, &value, &ids, &count) != 0) {
+            create_http_response(response, 400, "Bad Request", "{\"error\": \"Invalid container ID\"}");
+            return 0;
+        }
+    } else {
+        batch_selector_t selector;
+        selector.all = 0;
+        json_get_bool(&root, "all", &selector.all);
+        selector.filters = json_get(&root, "filters", &value) == 0 ? &value : NULL;
+        if (batch_select(request->arena, &selector, &ids, &count) != 0) {
+            create_http_response(response, 500, "Internal Server Error", "{\"error\": \"Failed to select containers\"}");
+            return 0;
+        }
+    }
+
+    if (send_chunked_response_header(request->client_socket, response, 200, "OK") != 0) {
         return 0;
     }
 
-    if (strlen(dockerfile_path) == 0) {
-        strcpy(dockerfile_path, "Dockerfile");
+    clock_gettime(CLOCK_MONOTONIC, &started);
+    stream.client_socket = request->client_socket;
+    stream.action = action;
+    memset(&stats, 0, sizeof(stats));
+    if (count > 0) {
+        run_container_batch(action, ids, count, parallel, format_batch_result, send_batch_results, &stream, &stats);
     }
 
-    strcpy(context_path, ".");
+    json_writer_init(&w, line, sizeof(line) - 1, NULL, NULL);
+    json_write_object_begin(&w);
+    json_write_key(&w, "event");
+    json_write_string(&w, "done");
+    json_write_key(&w, "action");
+    json_write_string(&w, batch_action_name(action));
+    json_write_key(&w, "total");
+    json_write_ll(&w, count);
+    json_write_key(&w, "succeeded");
+    json_write_ll(&w, stats.succeeded);
+    json_write_key(&w, "failed");
+    json_write_ll(&w, stats.failed);
+    json_write_key(&w, "duration_ms");
+    json_write_fixed(&w, metrics_elapsed_us(&started) / 1000.0, 3);
+    json_write_object_end(&w);
+    long long len = json_writer_finish(&w);
+    if (len < 0) {
+        return 0;
+    }
+    line[len++] = '\n';
+    if (send_chunk(request->client_socket, line, len) == 0) {
+        end_chunked_response(request->client_socket);
+    }
+    return 0;
+}
 
-    // Parse Dockerfile
-    dockerfile_t *dockerfile = parse_dockerfile(dockerfile_path);
-    if (!dockerfile) {
-        create_http_response(response, 500, "Internal Server Error", "{\"error\": \"Failed to parse Dockerfile\"}");
+// A listing goes out a page at a time: each hold of an index's read lock
+// serializes up to LIST_PAGE_SIZE matches (or looks at LIST_SCAN_SIZE
+// records) into one buffer, which is sent after the lock is let go. The
+// scan picks up after the last key it looked at, so memory per request
+// stays one page whatever the index holds.
+typedef struct {
+    const list_query_t *query;
+    char *buffer;
+    size_t len;
+    int entries;                        // in this page
+    int visited;                        // in this hold of the lock
+    int sent;                           // in the whole response
+    int stopped;                        // the scan ended before the index did
+    char last_key[LIST_MAX_CURSOR_LEN];
+} list_page_t;
+
+#define LIST_PAGE_BUFFER (LIST_PAGE_SIZE * 256 + LIST_MAX_ENTRY_SIZE)
+
+// Appends the entry the writer left at the end of the buffer; len is -1
+// when it did not fit
+static int add_list_entry(list_page_t *page, int len) {
+    if (len < 0) {
+        fprintf(stderr, "List entry for %s is too large, skipped\n", page->last_key);
+        if (page->sent + page->entries > 0) {
+            page->len -= 2;
+        }
+    } else {
+        page->len += len;
+        page->entries++;
+    }
+
+    page->stopped = page->entries == LIST_PAGE_SIZE || page->visited == LIST_SCAN_SIZE ||
+                    (page->query->limit && page->sent + page->entries == page->query->limit) ||
+                    LIST_PAGE_BUFFER - page->len < LIST_MAX_ENTRY_SIZE + 3;
+    return page->stopped;
+}
+
+// Every entry after the first starts with the comma closing the one before
+static char* next_list_entry(list_page_t *page) {
+    if (page->sent + page->entries > 0) {
+        memcpy(page->buffer + page->len, ",\n", 2);
+        page->len += 2;
+    }
+    return page->buffer + page->len;
+}
+
+static int visit_listed_container(const container_record_t *container, void *ctx) {
+    list_page_t *page = ctx;
+
+    page->visited++;
+    snprintf(page->last_key, sizeof(page->last_key), "%s", container->id);
+    if (!container_matches_query(page->query, container)) {
+        return page->stopped = page->visited == LIST_SCAN_SIZE;
+    }
+    return add_list_entry(page, write_container_entry(page->query, container, next_list_entry(page),
+                                                      LIST_MAX_ENTRY_SIZE));
+}
+
+static int visit_listed_image(const char *full_name, const image_info_t *image, void *ctx) {
+    list_page_t *page = ctx;
+
+    page->visited++;
+    snprintf(page->last_key, sizeof(page->last_key), "%s", full_name);
+    if (!image_matches_query(page->query, full_name, image)) {
+        return page->stopped = page->visited == LIST_SCAN_SIZE;
+    }
+    return add_list_entry(page, write_image_entry(page->query, full_name, image, next_list_entry(page),
+                                                  LIST_MAX_ENTRY_SIZE));
+}
+
+// Streams the query's records as one JSON array, an entry per line
+static int stream_list(http_request_t* request, http_response_t* response, const list_query_t* query) {
+    list_page_t page;
+
+    memset(&page, 0, sizeof(page));
+    page.query = query;
+    snprintf(page.last_key, sizeof(page.last_key), "%s", query->cursor);
+    page.buffer = arena_alloc(request->arena, LIST_PAGE_BUFFER);
+    if (!page.buffer) {
+        create_http_response(response, 500, "Internal Server Error", "{\"error\": \"Failed to list\"}");
         return 0;
     }
 
-    // Build image
-    int result = build_image_from_dockerfile(dockerfile, image_name, "latest", context_path);
+    if (send_stream_response_header(request->client_socket, response, 200, "OK", "application/json") != 0 ||
+        send_chunk(request->client_socket, "[\n", 2) != 0) {
+        return 0;
+    }
 
-    free_dockerfile(dockerfile);
+    for (;;) {
+        page.len = 0;
+        page.entries = 0;
+        page.visited = 0;
+        page.stopped = 0;
+        if (query->kind == LIST_CONTAINERS) {
+            container_index_scan(page.last_key, visit_listed_container, &page);
+        } else {
+            image_index_scan(page.last_key, visit_listed_image, &page);
+        }
 
-    if (result == 0) {
-        create_http_response(response, 200, "OK", "{\"message\": \"Image built successfully\"}");
-    } else {
-        create_http_response(response, 500, "Internal Server Error", "{\"error\": \"Failed to build image\"}");
+        if (page.len > 0 && send_chunk(request->client_socket, page.buffer, page.len) != 0) {
+            break;
+        }
+        page.sent += page.entries;
+        if (!page.stopped || (query->limit && page.sent == query->limit)) {
+            send_chunk(request->client_socket, page.sent > 0 ? "\n]\n" : "]\n", page.sent > 0 ? 3 : 2);
+            break;
+        }
     }
 
+    end_chunked_response(request->client_socket);
     return 0;
 }
 
-int handle_image_list(http_request_t* request, http_response_t* response) {
-    image_list_t *images = list_images();
-
-    if (!images) {
-        create_http_response(response, 500, "Internal Server Error", "{\"error\": \"Failed to list images\"}");
+// Query parameters, all optional: filters (the Docker JSON form), fields
+// (a comma separated projection), limit, and cursor (the last key of the
+// page before)
+static int handle_list(http_request_t* request, http_response_t* response, list_kind_t kind) {
+    char filters[1024], fields[LIST_MAX_FIELDS_LEN], limit[16], cursor[LIST_MAX_CURSOR_LEN];
+    char error[256], body[256 * 6 + 32];
+    list_query_t *query;
+    json_writer_t w;
+
+    query_value(request->url, "filters", filters, sizeof(filters));
+    query_value(request->url, "fields", fields, sizeof(fields));
+    query_value(request->url, "limit", limit, sizeof(limit));
+    query_value(request->url, "cursor", cursor, sizeof(cursor));
+
+    query = arena_alloc(request->arena, sizeof(list_query_t));
+    if (!query) {
+        create_http_response(response, 500, "Internal Server Error", "{\"error\": \"Failed to list\"}");
         return 0;
     }
+    if (parse_list_query(kind, filters, fields, limit, cursor, query, error, sizeof(error)) != 0) {
+        json_writer_init(&w, body, sizeof(body), NULL, NULL);
+        json_write_object_begin(&w);
+        json_write_key(&w, "error");
+        json_write_string(&w, error);
+        json_write_object_end(&w);
+        json_body_response(response, 400, "Bad Request", &w);
+        return 0;
+    }
+
+    stream_list(request, response, query);
+    return 0;
+}
+
+int handle_container_list(http_request_t* request, http_response_t* response) {
+    return handle_list(request, response, LIST_CONTAINERS);
+}
+
+typedef struct {
+    int client_socket;
+    int failed;
+} build_stream_t;
+
+static int stream_build_output(const char *data, size_t len, void *user_data) {
+    build_stream_t *stream = user_data;
+
+    // Stop writing once the client has gone, but let the build finish
+    if (!stream->failed && send_chunk(stream->client_socket, data, len) != 0) {
+        stream->failed = 1;
+    }
+    return stream->failed ? -1 : 0;
+}
 
-    char json_response[4096] = "[";
-    char image_json[512];
+int handle_image_build(http_request_t* request, http_response_t* response) {
+    build_job_t job;
+    char value[MAX_PATH_LEN + 1];
 
-    for (int i = 0; i < images->count; i++) {
-        snprintf(image_json, sizeof(image_json),
-                 "{\"Id\":\"%s\",\"RepoTags\":[\"%s:%s\"],\"Created\":%s,\"Size\":%s}",
-                 images->images[i].id,
-                 images->images[i].name,
-                 images->images[i].tag,
-                 images->images[i].created,
-                 images->images[i].size);
+    memset(&job, 0, sizeof(job));
+    strcpy(job.tag, "latest");
 
-        strcat(json_response, image_json);
-        if (i < images->count - 1) {
-            strcat(json_response, ",");
+    // Every parameter arrives percent-encoded; one that does not fit is
+    // refused rather than cut short
+    if (query_value(request->url, "t", value, sizeof(value)) == 0 &&
+        snprintf(job.image_name, sizeof(job.image_name), "%s", value) >= (int)sizeof(job.image_name)) {
+        create_http_response(response, 400, "Bad Request", "{\"error\": \"Image name too long\"}");
+        return 0;
+    }
+    // -t name:tag carries the tag in the name
+    char *colon = strrchr(job.image_name, ':');
+    if (colon && colon[1]) {
+        if (snprintf(job.tag, sizeof(job.tag), "%s", colon + 1) >= (int)sizeof(job.tag)) {
+            create_http_response(response, 400, "Bad Request", "{\"error\": \"Image tag too long\"}");
+            return 0;
         }
+        *colon = '\0';
+    }
+    if ((query_value(request->url, "dockerfile", value, sizeof(value)) == 0 &&
+         snprintf(job.dockerfile_path, sizeof(job.dockerfile_path), "%s", value) >= (int)sizeof(job.dockerfile_path)) ||
+        (query_value(request->url, "context", value, sizeof(value)) == 0 &&
+         snprintf(job.context_path, sizeof(job.context_path), "%s", value) >= (int)sizeof(job.context_path))) {
+        create_http_response(response, 400, "Bad Request", "{\"error\": \"Build path too long\"}");
+        return 0;
+    }
+    if (query_value(request->url, "memory", value, sizeof(value)) == 0) {
+        job.limits.memory_bytes = atoll(value);
+    }
+    if (query_value(request->url, "cpuquota", value, sizeof(value)) == 0) {
+        job.limits.cpu_quota_us = atol(value);
+    }
+    if (query_value(request->url, "cpuperiod", value, sizeof(value)) == 0) {
+        job.limits.cpu_period_us = atol(value);
+    }
+    if (query_value(request->url, "compression", value, sizeof(value)) == 0 &&
+        parse_image_compression(value, &job.compression) != 0) {
+        create_http_response(response, 400, "Bad Request", "{\"error\": \"Unknown compression\"}");
+        return 0;
+    }
+
+    if (strlen(job.image_name) == 0) {
+        create_http_response(response, 400, "Bad Request", "{\"error\": \"Image name required\"}");
+        return 0;
+    }
+
+    if (job.limits.memory_bytes < 0 || job.limits.cpu_quota_us < 0 || job.limits.cpu_period_us < 0 ||
+        (job.limits.cpu_period_us > 0 && (job.limits.cpu_period_us < 1000 || job.limits.cpu_period_us > 1000000))) {
+        create_http_response(response, 400, "Bad Request", "{\"error\": \"Invalid build resource limits\"}");
+        return 0;
+    }
+
+    if (strlen(job.dockerfile_path) == 0) {
+        strcpy(job.dockerfile_path, "Dockerfile");
+    }
+
+    if (strlen(job.context_path) == 0) {
+        strcpy(job.context_path, ".");
     }
 
-    strcat(json_response, "]");
+    // The worker parses it later; reject unreadable paths before queueing
+    if (access(job.dockerfile_path, R_OK) != 0) {
+        create_http_response(response, 500, "Internal Server Error", "{\"error\": \"Failed to parse Dockerfile\"}");
+        return 0;
+    }
+
+    // Queue position and build progress are streamed as one JSON event per chunk
+    build_stream_t stream = { request->client_socket, 0 };
+
+    if (send_chunked_response_header(request->client_socket, response, 200, "OK") != 0) {
+        return 0;
+    }
 
-    create_http_response(response, 200, "OK", json_response);
+    run_queued_build(&job, stream_build_output, &stream);
 
-    // Free images list
-    free(images->images);
-    free(images);
+    if (!stream.failed) {
+        end_chunked_response(request->client_socket);
+    }
 
     return 0;
 }
 
+int handle_image_list(http_request_t* request, http_response_t* response) {
+    return handle_list(request, response, LIST_IMAGES);
+}
+
 int handle_image_remove(http_request_t* request, http_response_t* response) {
     char image_name[256];
 
@@ -543,6 +1357,549 @@ int handle_image_remove(http_request_t* request, http_response_t* response) {
     return 0;
 }
 
+int handle_image_save(http_request_t* request, http_response_t* response) {
+    char image_name[256];
+    char full_name[MAX_IMAGE_NAME_LEN + MAX_IMAGE_TAG_LEN + 2];
+    image_compression_t compression = IMAGE_COMPRESSION_NONE;
+    const char *param;
+
+    if (extract_image_name_from_url(request->url, image_name) != 0) {
+        create_http_response(response, 400, "Bad Request", "{\"error\": \"Invalid image name\"}");
+        return 0;
+    }
+
+    if ((param = strstr(request->url, "compression="))) {
+        char name[16] = "";
+        sscanf(param, "compression=%15[^&]", name);
+        if (parse_image_compression(name, &compression) != 0) {
+            create_http_response(response, 400, "Bad Request", "{\"error\": \"Unknown compression\"}");
+            return 0;
+        }
+        // Chunking is how layers are stored, not an archive format
+        if (compression == IMAGE_COMPRESSION_CHUNKED) {
+            create_http_response(response, 400, "Bad Request", "{\"error\": \"Archives support none or lz compression\"}");
+            return 0;
+        }
+    }
+
+    if (resolve_image_name(image_name, full_name, sizeof(full_name)) != 0) {
+        create_http_response(response, 404, "Not Found", "{\"error\": \"No such image\"}");
+        return 0;
+    }
+
+    // The archive is written straight to the socket as it is produced; a
+    // failure part way through ends the connection without the final chunk
+    if (send_stream_response_header(request->client_socket, response, 200, "OK", "application/x-tar") != 0) {
+        return 0;
+    }
+
+    if (write_image_archive(full_name, request->client_socket, 1, compression) == 0) {
+        end_chunked_response(request->client_socket);
+    } else {
+        fprintf(stderr, "Failed to save image %s\n", full_name);
+    }
+
+    return 0;
+}
+
+int handle_image_load(http_request_t* request, http_response_t* response) {
+    char loaded_ref[MAX_IMAGE_NAME_LEN + MAX_IMAGE_TAG_LEN + 2];
+    char message[sizeof(loaded_ref) + 32];
+    char body[sizeof(message) * 6 + 32];
+    size_t prefix_len = request->raw_body_len;
+    json_writer_t w;
+
+    if (request->content_length <= 0) {
+        create_http_response(response, 411, "Length Required", "{\"error\": \"Content-Length required\"}");
+        return 0;
+    }
+    if ((long long)prefix_len > request->content_length) {
+        prefix_len = request->content_length;
+    }
+
+    if (read_image_archive(request->client_socket, request->raw_body, prefix_len, request->content_length,
+                           loaded_ref, sizeof(loaded_ref)) != 0) {
+        create_http_response(response, 400, "Bad Request", "{\"error\": \"Invalid or corrupt image archive\"}");
+        return 0;
+    }
+
+    snprintf(message, sizeof(message), "Loaded image: %s\n", loaded_ref);
+    json_writer_init(&w, body, sizeof(body), NULL, NULL);
+    json_write_object_begin(&w);
+    json_write_key(&w, "stream");
+    json_write_string(&w, message);
+    json_write_object_end(&w);
+    json_body_response(response, 200, "OK", &w);
+    return 0;
+}
+
+static void registry_response(http_response_t* response, const char* status, const registry_stats_t* stats) {
+    char body[MAX_IMAGE_NAME_LEN * 12 + 256];
+    json_writer_t w;
+
+    json_writer_init(&w, body, sizeof(body), NULL, NULL);
+    json_write_object_begin(&w);
+    json_write_key(&w, "status");
+    json_write_string(&w, status);
+    json_write_key(&w, "blobs_transferred");
+    json_write_ll(&w, stats->blobs_transferred);
+    json_write_key(&w, "blobs_skipped");
+    json_write_ll(&w, stats->blobs_skipped);
+    json_write_key(&w, "bytes_transferred");
+    json_write_ll(&w, stats->bytes_transferred);
+    json_write_key(&w, "bytes_resumed");
+    json_write_ll(&w, stats->bytes_resumed);
+    json_write_key(&w, "layers_lazy");
+    json_write_ll(&w, stats->layers_lazy);
+    json_write_object_end(&w);
+    json_body_response(response, 200, "OK", &w);
+}
+
+int handle_image_pull(http_request_t* request, http_response_t* response) {
+    char image_ref[MAX_IMAGE_NAME_LEN * 2] = "";
+    char tag[MAX_IMAGE_TAG_LEN] = "";
+    char local_ref[MAX_IMAGE_NAME_LEN + MAX_IMAGE_TAG_LEN + 2];
+    char status[sizeof(image_ref) + sizeof(local_ref) + 32];
+    registry_stats_t stats;
+    const char *param;
+    int lazy = 0;
+
+    if ((param = strstr(request->url, "fromImage="))) {
+        sscanf(param, "fromImage=%511[^&]", image_ref);
+    }
+    if ((param = strstr(request->url, "tag="))) {
+        sscanf(param, "tag=%63[^&]", tag);
+    }
+    if ((param = strstr(request->url, "lazy="))) {
+        lazy = atoi(param + strlen("lazy="));
+    }
+    if (!image_ref[0]) {
+        create_http_response(response, 400, "Bad Request", "{\"error\": \"fromImage required\"}");
+        return 0;
+    }
+
+    // docker sends the tag separately
+    if (tag[0] && strlen(image_ref) + strlen(tag) + 1 < sizeof(image_ref)) {
+        strcat(image_ref, ":");
+        strcat(image_ref, tag);
+    }
+
+    if (registry_pull(image_ref, lazy, local_ref, sizeof(local_ref), &stats) != 0) {
+        create_http_response(response, 500, "Internal Server Error", "{\"error\": \"Failed to pull image\"}");
+        return 0;
+    }
+
+    snprintf(status, sizeof(status), "Pulled %s as %s", image_ref, local_ref);
+    registry_response(response, status, &stats);
+    return 0;
+}
+
+int handle_image_push(http_request_t* request, http_response_t* response) {
+    char image_ref[MAX_IMAGE_NAME_LEN * 2];
+    char status[sizeof(image_ref) + 16];
+    registry_stats_t stats;
+    const char *start = strstr(request->url, "/images/") + strlen("/images/");
+    const char *end = strstr(start, "/push");
+
+    // The reference may contain slashes, so it runs up to the last /push
+    for (const char *next = end; next; next = strstr(next + 1, "/push")) {
+        end = next;
+    }
+    if (!end || end == start || (size_t)(end - start) >= sizeof(image_ref)) {
+        create_http_response(response, 400, "Bad Request", "{\"error\": \"Invalid image name\"}");
+        return 0;
+    }
+    memcpy(image_ref, start, end - start);
+    image_ref[end - start] = '\0';
+
+    if (registry_push(image_ref, &stats) != 0) {
+        create_http_response(response, 500, "Internal Server Error", "{\"error\": \"Failed to push image\"}");
+        return 0;
+    }
+
+    snprintf(status, sizeof(status), "Pushed %s", image_ref);
+    registry_response(response, status, &stats);
+    return 0;
+}
+
+// POST /commit?container=&repo=&tag=&comment=&pause= makes an image of the
+// container's changes on top of its image; repo may carry the tag itself
+int handle_container_commit(http_request_t* request, http_response_t* response) {
+    char container_id[MAX_CONTAINER_ID_LEN];
+    char repo[MAX_IMAGE_NAME_LEN];
+    char tag[MAX_IMAGE_TAG_LEN];
+    char target_ref[MAX_IMAGE_NAME_LEN + MAX_IMAGE_TAG_LEN + 2];
+    char comment[256];
+    char pause[8];
+    char body[256];
+    commit_stats_t stats;
+    json_writer_t w;
+
+    query_value(request->url, "container", container_id, sizeof(container_id));
+    query_value(request->url, "repo", repo, sizeof(repo));
+    query_value(request->url, "tag", tag, sizeof(tag));
+    query_value(request->url, "comment", comment, sizeof(comment));
+    query_value(request->url, "pause", pause, sizeof(pause));
+    if (!container_id[0] || !repo[0]) {
+        create_http_response(response, 400, "Bad Request", "{\"error\": \"container and repo required\"}");
+        return 0;
+    }
+    snprintf(target_ref, sizeof(target_ref), "%s%s%s", repo, tag[0] ? ":" : "", tag);
+    if (resolve_container_id(container_id, container_id, sizeof(container_id)) != 0) {
+        create_http_response(response, 404, "Not Found", "{\"error\": \"No such container\"}");
+        return 0;
+    }
+
+    if (commit_container(container_id, target_ref, comment, strcmp(pause, "0") != 0 && strcmp(pause, "false") != 0,
+                         &stats) != 0) {
+        create_http_response(response, 500, "Internal Server Error", "{\"error\": \"Failed to commit container\"}");
+        return 0;
+    }
+
+    json_writer_init(&w, body, sizeof(body), NULL, NULL);
+    json_write_object_begin(&w);
+    json_write_key(&w, "Id");
+    json_write_string(&w, stats.image_id);
+    json_write_key(&w, "layer");
+    json_write_string(&w, stats.layer_id);
+    json_write_key(&w, "layer_size");
+    json_write_ll(&w, stats.tar_size);
+    json_write_object_end(&w);
+    json_body_response(response, 201, "Created", &w);
+    return 0;
+}
+
+// POST /images/<ref>/squash?from=&to=&tag= merges layers from..to (0 is the
+// bottom, both ends by default) into one and tags the result
+int handle_image_squash(http_request_t* request, http_response_t* response) {
+    char image_ref[MAX_IMAGE_NAME_LEN * 2];
+    char target_ref[MAX_IMAGE_NAME_LEN + MAX_IMAGE_TAG_LEN + 2] = "";
+    char body[512];
+    const char *start = strstr(request->url, "/images/") + strlen("/images/");
+    const char *end = strstr(start, "/squash");
+    const char *query = strchr(request->url, '?');
+    const char *param;
+    squash_stats_t stats;
+    json_writer_t w;
+    int from = -1, to = -1;
+
+    if (!end || end == start || (size_t)(end - start) >= sizeof(image_ref)) {
+        create_http_response(response, 400, "Bad Request", "{\"error\": \"Invalid image name\"}");
+        return 0;
+    }
+    memcpy(image_ref, start, end - start);
+    image_ref[end - start] = '\0';
+
+    if (query && (param = strstr(query, "from="))) {
+        from = atoi(param + strlen("from="));
+    }
+    if (query && (param = strstr(query, "to="))) {
+        to = atoi(param + strlen("to="));
+    }
+    if (query && (param = strstr(query, "tag="))) {
+        sscanf(param, "tag=%320[^&]", target_ref);
+    }
+
+    if (squash_image(image_ref, from, to, target_ref, &stats) != 0) {
+        create_http_response(response, 500, "Internal Server Error", "{\"error\": \"Failed to squash image\"}");
+        return 0;
+    }
+
+    json_writer_init(&w, body, sizeof(body), NULL, NULL);
+    json_write_object_begin(&w);
+    json_write_key(&w, "id");
+    json_write_string(&w, stats.image_id);
+    json_write_key(&w, "layer");
+    json_write_string(&w, stats.layer_id);
+    json_write_key(&w, "layer_size");
+    json_write_ll(&w, stats.tar_size);
+    json_write_key(&w, "layers_before");
+    json_write_ll(&w, stats.layers_before);
+    json_write_key(&w, "layers_after");
+    json_write_ll(&w, stats.layers_after);
+    json_write_key(&w, "entries_written");
+    json_write_ll(&w, stats.entries_written);
+    json_write_key(&w, "entries_dropped");
+    json_write_ll(&w, stats.entries_dropped);
+    json_write_key(&w, "depth_before");
+    json_write_fixed(&w, stats.depth_before, 2);
+    json_write_key(&w, "depth_after");
+    json_write_fixed(&w, stats.depth_after, 2);
+    json_write_object_end(&w);
+    json_body_response(response, 200, "OK", &w);
+    return 0;
+}
+
+// Removes stopped containers, then every layer and chunk nothing uses
+int handle_system_prune(http_request_t* request, http_response_t* response) {
+    char body[256];
+    gc_stats_t stats;
+    json_writer_t w;
+
+    (void)request;
+    if (system_prune(&stats) != 0) {
+        create_http_response(response, 500, "Internal Server Error", "{\"error\": \"Failed to prune\"}");
+        return 0;
+    }
+
+    json_writer_init(&w, body, sizeof(body), NULL, NULL);
+    json_write_object_begin(&w);
+    json_write_key(&w, "containers_deleted");
+    json_write_ll(&w, stats.containers_removed);
+    json_write_key(&w, "layers_deleted");
+    json_write_ll(&w, stats.layers_removed);
+    json_write_key(&w, "chunks_deleted");
+    json_write_ll(&w, stats.chunks_removed);
+    json_write_key(&w, "space_reclaimed");
+    json_write_ll(&w, stats.bytes_reclaimed);
+    json_write_object_end(&w);
+    json_body_response(response, 200, "OK", &w);
+    return 0;
+}
+
+int handle_metrics(http_request_t* request, http_response_t* response) {
+    size_t len;
+    char *text = metrics_render(&len);
+
+    if (!text) {
+        create_http_response(response, 500, "Internal Server Error", "{\"error\": \"Failed to collect metrics\"}");
+        return 0;
+    }
+
+    // Larger than a buffered response, so it goes out chunked
+    if (send_stream_response_header(request->client_socket, response, 200, "OK",
+                                    "text/plain; version=0.0.4; charset=utf-8") == 0 &&
+        send_chunk(request->client_socket, text, len) == 0) {
+        end_chunked_response(request->client_socket);
+    }
+
+    free(text);
+    return 0;
+}
+
+// GET dumps the recorded spans; POST ?enabled=1 or 0 turns recording on or off
+int handle_trace(http_request_t* request, http_response_t* response) {
+    char enabled[8];
+    size_t len;
+
+    if (strcmp(request->method, "POST") == 0) {
+        if (query_value(request->url, "enabled", enabled, sizeof(enabled)) != 0) {
+            create_http_response(response, 400, "Bad Request", "{\"error\": \"enabled=1 or enabled=0 required\"}");
+            return 0;
+        }
+        trace_set_enabled(strcmp(enabled, "1") == 0 || strcmp(enabled, "true") == 0);
+        create_http_response(response, 200, "OK", trace_enabled() ? "{\"enabled\":true}" : "{\"enabled\":false}");
+        return 0;
+    } else if (strcmp(request->method, "GET") != 0) {
+        create_http_response(response, 404, "Not Found", "{\"error\": \"Trace API endpoint not found\"}");
+        return 0;
+    }
+
+    char *text = trace_render(&len);
+    if (!text) {
+        create_http_response(response, 500, "Internal Server Error", "{\"error\": \"Failed to collect trace\"}");
+        return 0;
+    }
+
+    if (send_stream_response_header(request->client_socket, response, 200, "OK", "application/json") == 0 &&
+        send_chunk(request->client_socket, text, len) == 0) {
+        end_chunked_response(request->client_socket);
+    }
+
+    free(text);
+    return 0;
+}
+
+static int event_value_matches(const char* key, const json_value_t* element, const event_t* event) {
+    char value[MAX_EVENT_ATTRIBUTE_LEN];
+
+    // Nothing a value had to be cut short for can match
+    if (json_string_copy(element, value, sizeof(value)) != 0) {
+        return 0;
+    }
+    if (strcmp(key, "type") == 0) {
+        return strcmp(value, event->type) == 0;
+    } else if (strcmp(key, "event") == 0) {
+        return strcmp(value, event->action) == 0;
+    } else if (strcmp(key, "container") == 0) {
+        return strcmp(event->type, EVENT_TYPE_CONTAINER) == 0 &&
+               ((value[0] && strncmp(event->id, value, strlen(value)) == 0) || strcmp(value, event->name) == 0);
+    } else if (strcmp(key, "image") == 0) {
+        const char *name = strcmp(event->type, EVENT_TYPE_IMAGE) == 0 ? event->name : event->image;
+        return strcmp(value, name) == 0 ||
+               (strcmp(event->type, EVENT_TYPE_IMAGE) == 0 && value[0] && strncmp(event->id, value, strlen(value)) == 0);
+    }
+    return 0;
+}
+
+// One filter key: no values matches everything, otherwise any value does;
+// a single string stands for a list of one
+static int event_filter_matches(const json_value_t* filters, const char* key, const event_t* event) {
+    json_value_t object, values, element;
+    json_iter_t it;
+    int any = 0;
+
+    object = *filters;
+    if (json_get(&object, key, &values) != 0) {
+        return 1;
+    }
+    if (values.type == JSON_STRING) {
+        return event_value_matches(key, &values, event);
+    }
+    if (json_iter_init(&values, &it) != 0 || it.object) {
+        return 1;
+    }
+    while (json_iter_next(&it, NULL, &element) > 0) {
+        if (element.type != JSON_STRING) {
+            continue;
+        }
+        any = 1;
+        if (event_value_matches(key, &element, event)) {
+            return 1;
+        }
+    }
+    return !any;
+}
+
+// filters is NULL when none were given
+static int event_matches(const json_value_t* filters, const event_t* event) {
+    if (!filters) {
+        return 1;
+    }
+    return event_filter_matches(filters, "type", event) &&
+           event_filter_matches(filters, "event", event) &&
+           event_filter_matches(filters, "container", event) &&
+           event_filter_matches(filters, "image", event);
+}
+
+// A quiet stream still has to notice a client that went away
+static int client_hung_up(int client_socket) {
+    char byte;
+    ssize_t len = recv(client_socket, &byte, 1, MSG_PEEK | MSG_DONTWAIT);
+
+    return len == 0 || (len < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR);
+}
+
+// One event as a line of Docker's event JSON; -1 when it does not fit
+static int format_event_line(const event_t *event, char *line, size_t size) {
+    char exit_code[16];
+    json_writer_t w;
+    long long len;
+
+    json_writer_init(&w, line, size - 1, NULL, NULL);
+    json_write_object_begin(&w);
+    json_write_key(&w, "Type");
+    json_write_string(&w, event->type);
+    json_write_key(&w, "Action");
+    json_write_string(&w, event->action);
+    json_write_key(&w, "Actor");
+    json_write_object_begin(&w);
+    json_write_key(&w, "ID");
+    json_write_string(&w, event->id);
+    json_write_key(&w, "Attributes");
+    json_write_object_begin(&w);
+    json_write_key(&w, "name");
+    json_write_string(&w, event->name);
+    if (event->image[0]) {
+        json_write_key(&w, "image");
+        json_write_string(&w, event->image);
+    }
+    if (event->exit_code >= 0) {
+        // Docker sends attributes as strings
+        snprintf(exit_code, sizeof(exit_code), "%d", event->exit_code);
+        json_write_key(&w, "exitCode");
+        json_write_string(&w, exit_code);
+    }
+    json_write_object_end(&w);
+    json_write_object_end(&w);
+    json_write_key(&w, "time");
+    json_write_ll(&w, (long long)event->time.tv_sec);
+    json_write_key(&w, "timeNano");
+    json_write_ll(&w, (long long)event->time.tv_sec * 1000000000LL + event->time.tv_nsec);
+    json_write_object_end(&w);
+    if ((len = json_writer_finish(&w)) < 0) {
+        return -1;
+    }
+    line[len++] = '\n';
+    line[len] = '\0';
+    return (int)len;
+}
+
+// Streams one JSON line per event until the client hangs up. since (unix
+// seconds) replays what the bus still holds from then on; filters is the
+// Docker form, {"type":["container"],"event":["start","die"],...}: values of
+// one key are alternatives, and every key given has to match.
+int handle_events(http_request_t* request, http_response_t* response) {
+    char since[32], filters[1024];
+    char line[MAX_EVENT_ID_LEN * 6 + MAX_EVENT_ATTRIBUTE_LEN * 12 + 256];
+    event_subscriber_t *subscriber;
+    event_t event;
+    unsigned long long dropped;
+    time_t since_time = 0;
+    json_value_t filter_root;
+    const json_value_t *filter_object = NULL;
+
+    if (query_value(request->url, "since", since, sizeof(since)) == 0 && since[0]) {
+        char *end;
+        since_time = (time_t)strtoll(since, &end, 10);
+        if (*end != '\0' || since_time < 0) {
+            create_http_response(response, 400, "Bad Request", "{\"error\": \"since must be a unix timestamp\"}");
+            return 0;
+        }
+    }
+    if (query_value(request->url, "filters", filters, sizeof(filters)) == 0 &&
+        strspn(filters, " \t\r\n") < strlen(filters)) {
+        if (json_parse(filters, strlen(filters), &filter_root) != 0 || filter_root.type != JSON_OBJECT) {
+            create_http_response(response, 400, "Bad Request", "{\"error\": \"filters must be a JSON object\"}");
+            return 0;
+        }
+        filter_object = &filter_root;
+    }
+
+    subscriber = subscribe_events(since_time);
+    if (!subscriber) {
+        create_http_response(response, 500, "Internal Server Error", "{\"error\": \"Failed to subscribe to events\"}");
+        return 0;
+    }
+
+    if (send_chunked_response_header(request->client_socket, response, 200, "OK") != 0) {
+        unsubscribe_events(subscriber);
+        return 0;
+    }
+
+    for (;;) {
+        int got = next_event(subscriber, &event, &dropped, 1000);
+        int len;
+
+        if (dropped > 0) {
+            len = snprintf(line, sizeof(line), "{\"Type\":\"events\",\"Action\":\"dropped\",\"count\":%llu}\n", dropped);
+            if (send_chunk(request->client_socket, line, len) != 0) {
+                break;
+            }
+        }
+        if (!got) {
+            if (client_hung_up(request->client_socket)) {
+                break;
+            }
+            continue;
+        }
+        if (!event_matches(filter_object, &event)) {
+            continue;
+        }
+
+        if ((len = format_event_line(&event, line, sizeof(line))) < 0) {
+            continue;
+        }
+        if (send_chunk(request->client_socket, line, len) != 0) {
+            break;
+        }
+    }
+
+    unsubscribe_events(subscriber);
+    end_chunked_response(request->client_socket);
+    return 0;
+}
+
 int handle_version_api(http_request_t* request, http_response_t* response) {
     char version_json[] = "{\"Version\":\"1.0.0\",\"ApiVersion\":\"1.40\",\"GitCommit\":\"docker-clone\",\"GoVersion\":\"N/A\",\"Os\":\"linux\",\"Arch\":\"amd64\"}";
     create_http_response(response, 200, "OK", version_json);
@@ -601,17 +1958,6 @@ int extract_image_name_from_url(const char* url, char* image_name) {
     return 0;
 }
 
-void log_request(http_request_t* request, struct sockaddr_in* client_addr) {
-    printf("[%s] %s %s %s from %s\n",
-           request->version, request->method, request->url, request->version,
-           inet_ntoa(client_addr->sin_addr));
-}
-
-void log_response(http_response_t* response) {
-    printf("Response: %s %d %s\n",
-           response->version, response->status_code, response->status_message);
-}
-
 void cleanup_server(int server_socket) {
     if (server_socket >= 0) {
         close(server_socket);
@@ -11,8 +11,11 @@
 #include <pthread.h>
 #include <signal.h>
 #include <errno.h>
+#include <time.h>
 
 #include "config.h"
+#include "metrics.h"
+#include "arena.h"
 
 #define MAX_REQUEST_SIZE 8192
 #define MAX_RESPONSE_SIZE 8192
@@ -22,6 +25,14 @@
 #define MAX_VERSION_SIZE 16
 #define MAX_THREADS 10
 
+// A connection serves requests until the client asks to close, stays idle
+// for HTTP_KEEPALIVE_TIMEOUT seconds or has had HTTP_KEEPALIVE_MAX of them.
+// Everything a request allocates comes from the connection's arena, which
+// is reset once the response is out.
+#define HTTP_KEEPALIVE_TIMEOUT 5
+#define HTTP_KEEPALIVE_MAX 100
+#define HTTP_REQUEST_ARENA_SIZE (128 * 1024)
+
 #define DEFAULT_PORT DOCKERD_PORT
 #define DEFAULT_HOST DOCKERD_HOST
 
@@ -30,8 +41,16 @@ typedef struct {
     char url[MAX_URL_SIZE];
     char version[MAX_VERSION_SIZE];
     char headers[MAX_HEADER_SIZE];
-    char body[MAX_REQUEST_SIZE];
-    int content_length;
+    long long content_length;
+    int client_socket;
+    const char *raw_body;       // body bytes that arrived with the headers
+    size_t raw_body_len;
+    int body_read;              // the whole body has been taken off the socket
+    arena_t *arena;             // request-scoped memory, reset after the response
+    metrics_route_t route;      // set by the router once it picks a handler
+    struct sockaddr_in client_addr;
+    struct timespec received;   // wall clock
+    struct timespec started;    // monotonic
 } http_request_t;
 
 typedef struct {
@@ -41,11 +60,15 @@ typedef struct {
     char headers[MAX_HEADER_SIZE];
     char body[MAX_RESPONSE_SIZE];
     int content_length;
+    int streamed;
+    int parked;                 // the socket was handed off and is answered later
+    int keep_alive;             // the connection stays open after this response
 } http_response_t;
 
 typedef struct {
     int client_socket;
     struct sockaddr_in client_addr;
+    arena_t arena;
 } client_info_t;
 
 // Function declarations
@@ -54,6 +77,11 @@ void* handle_client(void* arg);
 int parse_http_request(const char* request, http_request_t* parsed);
 int create_http_response(http_response_t* response, int status_code, const char* status_message, const char* body);
 int send_http_response(int client_socket, http_response_t* response);
+int send_chunked_response_header(int client_socket, http_response_t* response, int status_code, const char* status_message);
+int send_stream_response_header(int client_socket, http_response_t* response, int status_code,
+                                const char* status_message, const char* content_type);
+int send_chunk(int client_socket, const char* data, size_t len);
+int end_chunked_response(int client_socket);
 int handle_api_request(http_request_t* request, http_response_t* response);
 int handle_containers_api(http_request_t* request, http_response_t* response);
 int handle_images_api(http_request_t* request, http_response_t* response);
@@ -61,9 +89,22 @@ int handle_container_create(http_request_t* request, http_response_t* response);
 int handle_container_start(http_request_t* request, http_response_t* response);
 int handle_container_stop(http_request_t* request, http_response_t* response);
 int handle_container_remove(http_request_t* request, http_response_t* response);
+int handle_container_wait(http_request_t* request, http_response_t* response);
+int handle_container_batch(http_request_t* request, http_response_t* response);
+int handle_container_list(http_request_t* request, http_response_t* response);
 int handle_image_build(http_request_t* request, http_response_t* response);
 int handle_image_list(http_request_t* request, http_response_t* response);
 int handle_image_remove(http_request_t* request, http_response_t* response);
+int handle_image_save(http_request_t* request, http_response_t* response);
+int handle_image_load(http_request_t* request, http_response_t* response);
+int handle_image_pull(http_request_t* request, http_response_t* response);
+int handle_image_push(http_request_t* request, http_response_t* response);
+int handle_container_commit(http_request_t* request, http_response_t* response);
+int handle_image_squash(http_request_t* request, http_response_t* response);
+int handle_system_prune(http_request_t* request, http_response_t* response);
+int handle_metrics(http_request_t* request, http_response_t* response);
+int handle_trace(http_request_t* request, http_response_t* response);
+int handle_events(http_request_t* request, http_response_t* response);
 void cleanup_server(int server_socket);
 
 // Helper functions
@@ -71,7 +112,5 @@ char* url_decode(const char* str);
 char* url_encode(const char* str);
 int extract_container_id_from_url(const char* url, char* container_id);
 int extract_image_name_from_url(const char* url, char* image_name);
-void log_request(http_request_t* request, struct sockaddr_in* client_addr);
-void log_response(http_response_t* response);
 
 #endif // HTTP_H
@@ -0,0 +1,97 @@
+#include "id.h"
+#include "sha256.h"
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <sys/random.h>
+#include <time.h>
+#include <unistd.h>
+
+// xoshiro256**: 2^256 - 1 outputs before a thread's sequence repeats
+static __thread uint64_t state[4];
+static __thread unsigned int seeded_generation;     // fork_generation + 1 once seeded
+
+static atomic_uint fork_generation;
+static pthread_once_t atfork_once = PTHREAD_ONCE_INIT;
+
+static void after_fork(void) {
+    atomic_fetch_add_explicit(&fork_generation, 1, memory_order_relaxed);
+}
+
+static void register_fork_handler(void) {
+    pthread_atfork(NULL, NULL, after_fork);
+}
+
+static uint64_t rotl(uint64_t x, int k) {
+    return (x << k) | (x >> (64 - k));
+}
+
+static uint64_t next(void) {
+    uint64_t result = rotl(state[1] * 5, 7) * 9;
+    uint64_t t = state[1] << 17;
+
+    state[2] ^= state[0];
+    state[3] ^= state[1];
+    state[1] ^= state[2];
+    state[0] ^= state[3];
+    state[2] ^= t;
+    state[3] = rotl(state[3], 45);
+    return result;
+}
+
+// Without getrandom the clock, pid and the thread's own address stand in,
+// stirred with splitmix64
+static void seed(void) {
+    uint8_t *bytes = (uint8_t *)state;
+    size_t got = 0;
+
+    while (got < sizeof(state)) {
+        ssize_t n = getrandom(bytes + got, sizeof(state) - got, 0);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            break;
+        }
+        got += n;
+    }
+    if (got < sizeof(state)) {
+        struct timespec now;
+        uint64_t z;
+
+        clock_gettime(CLOCK_REALTIME, &now);
+        z = (uint64_t)now.tv_sec * 1000000000ULL + (uint64_t)now.tv_nsec;
+        z ^= (uint64_t)getpid() << 32 ^ (uint64_t)(uintptr_t)&state;
+        for (int i = 0; i < 4; i++) {
+            uint64_t s = (z += 0x9e3779b97f4a7c15ULL);
+            s = (s ^ (s >> 30)) * 0xbf58476d1ce4e5b9ULL;
+            s = (s ^ (s >> 27)) * 0x94d049bb133111ebULL;
+            state[i] ^= s ^ (s >> 31);
+        }
+    }
+    if (!(state[0] | state[1] | state[2] | state[3])) {
+        state[0] = 1;
+    }
+}
+
+// As many of the id's 64 hex digits as fit in size
+void generate_id(char *out, size_t size) {
+    unsigned int generation;
+    uint8_t bytes[ID_BYTES];
+    char hex[ID_HEX_LEN + 1];
+
+    pthread_once(&atfork_once, register_fork_handler);
+    generation = atomic_load_explicit(&fork_generation, memory_order_relaxed) + 1;
+    if (seeded_generation != generation) {
+        seed();
+        seeded_generation = generation;
+    }
+
+    for (int i = 0; i < ID_BYTES / 8; i++) {
+        uint64_t word = next();
+        memcpy(bytes + i * 8, &word, 8);
+    }
+    sha256_to_hex(bytes, hex);
+    snprintf(out, size, "%s", hex);
+}
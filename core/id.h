@@ -0,0 +1,19 @@
+#ifndef ID_H
+#define ID_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Random 256-bit ids for containers, images and layers, written as 64 hex
+// digits. Each thread draws from a generator of its own, seeded from
+// getrandom(2) before its first id, so making one takes no lock and no
+// system call. A forked child reseeds instead of repeating its parent's
+// sequence.
+#define ID_BYTES 32
+#define ID_HEX_LEN 64
+
+// Function declarations
+void generate_id(char *out, size_t size);
+
+#endif // ID_H
@@ -1,9 +1,21 @@
 #include "image.h"
+#include "lazy.h"
+#include "tar.h"
+#include "chunk.h"
+#include "gc.h"
+#include "image_index.h"
+#include "events.h"
+#include "json.h"
+#include "id.h"
+#include <ctype.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <unistd.h>
 
+#define ARCHIVE_MAX_JSON_LEN (1024 * 1024)
+
 int init_image_system() {
-    if (create_directory_structure() != 0) {
+    if (create_directory_structure() != 0 || init_image_index() != 0) {
         return -1;
     }
     return 0;
@@ -13,10 +25,14 @@ int create_directory_structure() {
     char dirs[][MAX_PATH_LEN] = {
         IMAGE_STORAGE_DIR,
         LAYER_STORAGE_DIR,
-        METADATA_DIR
+        METADATA_DIR,
+        BLOB_STORAGE_DIR,
+        BLOB_STORAGE_DIR "/sha256",
+        CHUNK_STORAGE_DIR,
+        CHUNK_STORAGE_DIR "/sha256"
     };
     int createdDirsCount = 0;
-    for (int i = 0; i < 3; i++) {
+    for (int i = 0; i < (int)(sizeof(dirs) / sizeof(dirs[0])); i++) {
         if (mkdir(dirs[i], 0755) != 0 && errno != EEXIST) {
 
             for (int j = 0 ;  j < createdDirsCount; j++){
@@ -28,23 +44,24 @@ int create_directory_structure() {
             perror("mkdir");
             return -1;
         }
-        i++;
+        createdDirsCount++;
     }
     return 0;
 }
 
-char* generate_image_id() {
-    static char id[MAX_IMAGE_ID_LEN];
-    time_t now = time(NULL);
-    snprintf(id, sizeof(id), "sha256:%08x%08x", (unsigned int)now, (unsigned int)(now >> 32));
-    return id;
+// For images and layers not named by their content
+void generate_image_id(char *out, size_t size) {
+    char hex[ID_HEX_LEN + 1];
+
+    generate_id(hex, sizeof(hex));
+    snprintf(out, size, "sha256:%s", hex);
 }
 
-char* generate_layer_id() {
-    static char id[MAX_LAYER_ID_LEN];
-    time_t now = time(NULL);
-    snprintf(id, sizeof(id), "layer_%08x%08x", (unsigned int)now, (unsigned int)(now >> 32));
-    return id;
+void generate_layer_id(char *out, size_t size) {
+    char hex[ID_HEX_LEN + 1];
+
+    generate_id(hex, sizeof(hex));
+    snprintf(out, size, "layer_%s", hex);
 }
 
 char* get_image_full_name(const char *name, const char *tag) {
@@ -59,23 +76,204 @@ char* get_image_full_name(const char *name, const char *tag) {
 
 int image_exists(const char *name, const char *tag) {
     char full_name[MAX_IMAGE_NAME_LEN + MAX_IMAGE_TAG_LEN + 2];
-    char metadata_path[MAX_PATH_LEN];
+    char resolved[MAX_IMAGE_NAME_LEN + MAX_IMAGE_TAG_LEN + 2];
 
     snprintf(full_name, sizeof(full_name), "%s", get_image_full_name(name, tag));
-    snprintf(metadata_path, sizeof(metadata_path), "%s/%s.json", METADATA_DIR, full_name);
+    return resolve_image_name(full_name, resolved, sizeof(resolved)) == 0;
+}
 
-    return access(metadata_path, F_OK) == 0;
+// A forked build worker must not take the index, layer graph or event bus
+// locks: another daemon thread may have held one when it forked. It reads
+// and writes metadata files only, and reports each image it writes on this
+// fd for the daemon to index once the worker exits.
+static int build_report_fd = -1;
+
+void enter_build_worker(int report_fd) {
+    build_report_fd = report_fd;
 }
 
-int create_layer(const char *parent_id, const char *command, const char *diff_path) {
-    char layer_id[MAX_LAYER_ID_LEN];
+static void layer_blob_path(const char *layer_id, char *path, size_t size) {
+    snprintf(path, size, "%s/%s/%s%s", LAYER_STORAGE_DIR, layer_id, layer_id, LAYER_BLOB_SUFFIX);
+}
+
+static void layer_chunks_path(const char *layer_id, char *path, size_t size) {
+    snprintf(path, size, "%s/%s/%s%s", LAYER_STORAGE_DIR, layer_id, layer_id, CHUNK_LIST_SUFFIX);
+}
+
+static int layer_is_chunked(const char *layer_id) {
+    char list_path[MAX_PATH_LEN];
+
+    layer_chunks_path(layer_id, list_path, sizeof(list_path));
+    return access(list_path, F_OK) == 0;
+}
+
+// Whether the layer is kept as a tar stream (compressed or chunked)
+// rather than as an expanded tree
+int layer_is_compressed(const char *layer_id) {
+    char blob_path[MAX_PATH_LEN];
+
+    layer_blob_path(layer_id, blob_path, sizeof(blob_path));
+    return access(blob_path, F_OK) == 0 || layer_is_chunked(layer_id);
+}
+
+static void write_layer_digest(const char *layer_id, const char *diff_id, long long tar_size);
+
+static void format_diff_id(sha256_ctx_t *hash, char *diff_id) {
+    uint8_t digest[SHA256_DIGEST_LEN];
+    char hex[SHA256_HEX_LEN + 1];
+
+    sha256_final(hash, digest);
+    sha256_to_hex(digest, hex);
+    snprintf(diff_id, MAX_DIGEST_LEN, "sha256:%s", hex);
+}
+
+// Tars diff_path straight into the chunk store. Only chunks no other layer
+// has are written; the layer itself gets the list.
+static int write_layer_chunks(const char *layer_id, const char *diff_path) {
+    char list_path[MAX_PATH_LEN];
+    char diff_id[MAX_DIGEST_LEN];
+    chunk_writer_t *chunks;
+    chunk_stats_t stats;
+    tar_writer_t *writer;
+    sha256_ctx_t hash;
+    long long tar_size = 0;
+    int result = -1;
+
+    layer_chunks_path(layer_id, list_path, sizeof(list_path));
+    chunks = chunk_writer_open(list_path);
+    if (!chunks) {
+        return -1;
+    }
+
+    writer = tar_writer_open(-1, 0);
+    if (writer) {
+        sha256_init(&hash);
+        writer->hash = &hash;
+        writer->chunks = chunks;
+        if (tar_write_tree(writer, diff_path, NULL) == 0 && tar_finish(writer) == 0) {
+            result = 0;
+        }
+        tar_size = writer->offset;
+        writer->hash = NULL;
+
+        // Closing flushes the last of the stream into the chunk writer
+        if (tar_writer_close(writer) != 0) {
+            result = -1;
+        }
+    }
+
+    if (chunk_writer_close(chunks, result == 0, &stats) != 0) {
+        fprintf(stderr, "Failed to write chunked layer %s\n", layer_id);
+        return -1;
+    }
+    printf("Stored layer %s: %lld chunks, %lld new, %lld bytes written for %lld\n",
+           layer_id, stats.chunks, stats.new_chunks, stats.stored_bytes, stats.bytes);
+
+    format_diff_id(&hash, diff_id);
+    write_layer_digest(layer_id, diff_id, tar_size);
+    return 0;
+}
+
+// Tars diff_path straight into a compressed blob. The tar stream is hashed
+// on the way through, so the layer's diff_id is known without a second pass.
+static int write_layer_blob(const char *layer_id, const char *diff_path) {
+    char blob_path[MAX_PATH_LEN];
+    char temp_path[MAX_PATH_LEN + 8];
+    char diff_id[MAX_DIGEST_LEN];
+    tar_writer_t *writer;
+    sha256_ctx_t hash;
+    long long tar_size;
+    int result = -1;
+    int fd;
+
+    layer_blob_path(layer_id, blob_path, sizeof(blob_path));
+    snprintf(temp_path, sizeof(temp_path), "%s.tmp", blob_path);
+
+    fd = open(temp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        perror("open layer blob");
+        return -1;
+    }
+
+    writer = tar_writer_open(fd, 0);
+    if (writer && tar_writer_compress(writer, lz_default_threads()) == 0) {
+        sha256_init(&hash);
+        writer->hash = &hash;
+        if (tar_write_tree(writer, diff_path, NULL) == 0 && tar_finish(writer) == 0) {
+            result = 0;
+        }
+        writer->hash = NULL;
+    }
+
+    tar_size = writer ? (long long)writer->offset : 0;
+    if (writer && tar_writer_close(writer) != 0) {
+        result = -1;
+    }
+    if (close(fd) != 0) {
+        result = -1;
+    }
+    if (result == 0 && rename(temp_path, blob_path) != 0) {
+        perror("rename layer blob");
+        result = -1;
+    }
+    if (result != 0) {
+        fprintf(stderr, "Failed to write compressed layer %s\n", layer_id);
+        unlink(temp_path);
+        return -1;
+    }
+
+    format_diff_id(&hash, diff_id);
+    write_layer_digest(layer_id, diff_id, tar_size);
+    return 0;
+}
+
+// Opens a compressed or chunked layer as a plain tar stream
+static tar_reader_t* open_layer_blob(const char *layer_id, int *fd) {
+    char blob_path[MAX_PATH_LEN];
+    tar_reader_t *reader;
+
+    if (layer_is_chunked(layer_id)) {
+        layer_chunks_path(layer_id, blob_path, sizeof(blob_path));
+        *fd = -1;
+        reader = tar_reader_open(-1, NULL, 0, -1);
+        if (reader && !(reader->chunks = chunk_reader_open(blob_path))) {
+            tar_reader_close(reader);
+            reader = NULL;
+        }
+        return reader;
+    }
+
+    layer_blob_path(layer_id, blob_path, sizeof(blob_path));
+    *fd = open(blob_path, O_RDONLY | O_CLOEXEC);
+    if (*fd < 0) {
+        perror("open layer blob");
+        return NULL;
+    }
+
+    reader = tar_reader_open(*fd, NULL, 0, -1);
+    if (!reader || tar_reader_detect_compression(reader, lz_default_threads()) != 1) {
+        fprintf(stderr, "Layer %s is not a compressed tarball\n", layer_id);
+        tar_reader_close(reader);
+        close(*fd);
+        return NULL;
+    }
+    return reader;
+}
+
+static int create_layer_with_id(const char *layer_id, const char *parent_id, const char *command, const char *diff_path,
+                                image_compression_t compression) {
     char layer_path[MAX_PATH_LEN];
     char metadata_path[MAX_PATH_LEN];
     FILE *fp;
 
-    strcpy(layer_id, generate_layer_id());
-    snprintf(layer_path, sizeof(layer_path), "%s/%s", LAYER_STORAGE_DIR, layer_id);
-    snprintf(metadata_path, sizeof(metadata_path), "%s/%s.json", layer_path, layer_id);
+    if (snprintf(layer_path, sizeof(layer_path), "%s/%s", LAYER_STORAGE_DIR, layer_id) >= (int)sizeof(layer_path) ||
+        snprintf(metadata_path, sizeof(metadata_path), "%s/%s.json", layer_path, layer_id) >= (int)sizeof(metadata_path)) {
+        fprintf(stderr, "Layer id too long: %s\n", layer_id);
+        return -1;
+    }
+
+    // Kept until an image names it
+    gc_lease_layer(layer_id);
 
     // Create layer directory
     if (mkdir(layer_path, 0755) != 0 && errno != EEXIST) {
@@ -84,7 +282,15 @@ int create_layer(const char *parent_id, const char *command, const char *diff_pa
     }
 
     // Copy diff if provided
-    if (diff_path && strlen(diff_path) > 0) {
+    if (diff_path && strlen(diff_path) > 0 && compression == IMAGE_COMPRESSION_LZ) {
+        if (write_layer_blob(layer_id, diff_path) != 0) {
+            return -1;
+        }
+    } else if (diff_path && strlen(diff_path) > 0 && compression == IMAGE_COMPRESSION_CHUNKED) {
+        if (write_layer_chunks(layer_id, diff_path) != 0) {
+            return -1;
+        }
+    } else if (diff_path && strlen(diff_path) > 0) {
         char copy_cmd[1024];
         snprintf(copy_cmd, sizeof(copy_cmd), "cp -r %s/* %s/", diff_path, layer_path);
         if (system(copy_cmd) != 0) {
@@ -117,6 +323,14 @@ int create_layer(const char *parent_id, const char *command, const char *diff_pa
     return 0;
 }
 
+int create_layer(const char *parent_id, const char *command, const char *diff_path,
+                 image_compression_t compression) {
+    char layer_id[MAX_LAYER_ID_LEN];
+
+    generate_layer_id(layer_id, sizeof(layer_id));
+    return create_layer_with_id(layer_id, parent_id, command, diff_path, compression);
+}
+
 int extract_layer(const char *layer_id, const char *target_path) {
     char layer_path[MAX_PATH_LEN];
     char copy_cmd[1024];
@@ -127,8 +341,31 @@ int extract_layer(const char *layer_id, const char *target_path) {
         fprintf(stderr, "Layer %s not found\n", layer_id);
         return -1;
     }
+    if (lazy_complete_layer(layer_id) != 0) {
+        return -1;
+    }
+
+    if (layer_is_compressed(layer_id)) {
+        int fd;
+        tar_reader_t *reader = open_layer_blob(layer_id, &fd);
+        if (!reader) {
+            return -1;
+        }
+
+        int result = tar_extract(reader, target_path);
+        tar_reader_close(reader);
+        if (fd >= 0) {
+            close(fd);
+        }
+        if (result != 0) {
+            fprintf(stderr, "Failed to extract layer\n");
+        }
+        return result;
+    }
 
-    snprintf(copy_cmd, sizeof(copy_cmd), "cp -r %s/* %s/", layer_path, target_path);
+    // Copy dotfiles too, but leave the layer's own metadata behind
+    snprintf(copy_cmd, sizeof(copy_cmd), "cp -a %s/. %s/ && rm -f %s/%s.json %s/%s.diffid",
+             layer_path, target_path, target_path, layer_id, target_path, layer_id);
     if (system(copy_cmd) != 0) {
         fprintf(stderr, "Failed to extract layer\n");
         return -1;
@@ -140,6 +377,8 @@ int extract_layer(const char *layer_id, const char *target_path) {
 int write_image_metadata(image_info_t *image) {
     char metadata_path[MAX_PATH_LEN];
     char full_name[MAX_IMAGE_NAME_LEN + MAX_IMAGE_TAG_LEN + 2];
+    char buffer[4096];
+    json_writer_t w;
     FILE *fp;
 
     snprintf(full_name, sizeof(full_name), "%s", get_image_full_name(image->name, image->tag));
@@ -151,67 +390,253 @@ int write_image_metadata(image_info_t *image) {
         return -1;
     }
 
-    fprintf(fp, "{\n");
-    fprintf(fp, "  \"id\": \"%s\",\n", image->id);
-    fprintf(fp, "  \"name\": \"%s\",\n", image->name);
-    fprintf(fp, "  \"tag\": \"%s\",\n", image->tag);
-    fprintf(fp, "  \"parent\": \"%s\",\n", image->parent_id);
-    fprintf(fp, "  \"created\": \"%s\",\n", image->created);
-    fprintf(fp, "  \"size\": \"%s\",\n", image->size);
-    fprintf(fp, "  \"architecture\": \"%s\",\n", image->architecture);
-    fprintf(fp, "  \"os\": \"%s\",\n", image->os);
-    fprintf(fp, "  \"author\": \"%s\",\n", image->author);
-    fprintf(fp, "  \"comment\": \"%s\",\n", image->comment);
-    fprintf(fp, "  \"config\": {\n");
-    fprintf(fp, "    \"Cmd\": [\"%s\"],\n", image->command);
-    fprintf(fp, "    \"WorkingDir\": \"%s\",\n", image->working_dir);
-    fprintf(fp, "    \"Env\": [\"%s\"],\n", image->env_vars);
-    fprintf(fp, "    \"ExposedPorts\": {\"%s\": {}},\n", image->exposed_ports);
-    fprintf(fp, "    \"Volumes\": {\"%s\": {}}\n", image->volumes);
-    fprintf(fp, "  },\n");
-    fprintf(fp, "  \"layers\": [\n");
-
+    json_writer_init(&w, buffer, sizeof(buffer), json_flush_file, fp);
+    w.pretty = 1;
+    json_write_object_begin(&w);
+    json_write_key(&w, "id");
+    json_write_string(&w, image->id);
+    json_write_key(&w, "name");
+    json_write_string(&w, image->name);
+    json_write_key(&w, "tag");
+    json_write_string(&w, image->tag);
+    json_write_key(&w, "parent");
+    json_write_string(&w, image->parent_id);
+    json_write_key(&w, "created");
+    json_write_string(&w, image->created);
+    json_write_key(&w, "size");
+    json_write_string(&w, image->size);
+    json_write_key(&w, "architecture");
+    json_write_string(&w, image->architecture);
+    json_write_key(&w, "os");
+    json_write_string(&w, image->os);
+    json_write_key(&w, "author");
+    json_write_string(&w, image->author);
+    json_write_key(&w, "comment");
+    json_write_string(&w, image->comment);
+    json_write_key(&w, "compression");
+    json_write_string(&w, image_compression_name(image->compression));
+
+    json_write_key(&w, "config");
+    json_write_object_begin(&w);
+    json_write_key(&w, "Cmd");
+    json_write_array_begin(&w);
+    json_write_string(&w, image->command);
+    json_write_array_end(&w);
+    json_write_key(&w, "WorkingDir");
+    json_write_string(&w, image->working_dir);
+    json_write_key(&w, "Env");
+    json_write_array_begin(&w);
+    json_write_string(&w, image->env_vars);
+    json_write_array_end(&w);
+    json_write_key(&w, "ExposedPorts");
+    json_write_object_begin(&w);
+    json_write_key(&w, image->exposed_ports);
+    json_write_raw(&w, "{}", 2);
+    json_write_object_end(&w);
+    json_write_key(&w, "Volumes");
+    json_write_object_begin(&w);
+    json_write_key(&w, image->volumes);
+    json_write_raw(&w, "{}", 2);
+    json_write_object_end(&w);
+    json_write_object_end(&w);
+
+    json_write_key(&w, "layers");
+    json_write_array_begin(&w);
     for (int i = 0; i < image->layer_count; i++) {
-        fprintf(fp, "    \"%s\"", image->layers[i].id);
-        if (i < image->layer_count - 1) fprintf(fp, ",");
-        fprintf(fp, "\n");
+        json_write_string(&w, image->layers[i].id);
     }
+    json_write_array_end(&w);
+    json_write_object_end(&w);
+    json_write_raw(&w, "\n", 1);
 
-    fprintf(fp, "  ]\n");
-    fprintf(fp, "}\n");
+    if (json_writer_finish(&w) < 0) {
+        fprintf(stderr, "Failed to write image metadata\n");
+        fclose(fp);
+        return -1;
+    }
+    if (fclose(fp) != 0) {
+        perror("write image metadata");
+        return -1;
+    }
 
-    fclose(fp);
+    if (build_report_fd >= 0) {
+        char line[sizeof(full_name) + 1];
+        int len = snprintf(line, sizeof(line), "%s\n", full_name);
+
+        // Shorter than PIPE_BUF, so the line arrives whole
+        if (write(build_report_fd, line, len) != len) {
+            perror("report image metadata");
+            return -1;
+        }
+        return 0;
+    }
+
+    if (image_index_put(image) != 0) {
+        return -1;
+    }
+    gc_ref_image(image);
     return 0;
 }
 
-int read_image_metadata(const char *image_id, image_info_t *image) {
-    char metadata_path[MAX_PATH_LEN];
-    FILE *fp;
-    char line[1024];
+static int image_metadata_path(const char *full_name, char *path, size_t size) {
+    if (snprintf(path, size, "%s/%s.json", METADATA_DIR, full_name) >= (int)size) {
+        fprintf(stderr, "Image name too long: %s\n", full_name);
+        return -1;
+    }
+    return 0;
+}
+
+// From the index: this never reads the metadata file, except in a build
+// worker, which has only the files
+int read_image_metadata(const char *full_name, image_info_t *image) {
+    char path[MAX_PATH_LEN];
+
+    if (build_report_fd >= 0) {
+        if (image_metadata_path(full_name, path, sizeof(path)) != 0) {
+            return -1;
+        }
+        return parse_image_metadata(path, image);
+    }
+    return image_index_get(full_name, image);
+}
+
+// The first member's name of an object like {"80/tcp": {}}
+static void first_member_name(const json_value_t *object, char *out, size_t size) {
+    json_value_t name, value;
+    json_iter_t it;
 
-    snprintf(metadata_path, sizeof(metadata_path), "%s/%s.json", METADATA_DIR, image_id);
+    out[0] = '\0';
+    if (json_iter_init(object, &it) == 0 && json_iter_next(&it, &name, &value) > 0) {
+        json_string_copy(&name, out, size);
+    }
+}
+
+// Reads a name:tag.json file written by write_image_metadata
+int parse_image_metadata(const char *metadata_path, image_info_t *image) {
+    json_value_t root, config, value, layer;
+    json_iter_t it;
+    char compression[16];
+    char *text;
+    long len;
+    FILE *fp;
 
     fp = fopen(metadata_path, "r");
     if (!fp) {
         return -1;
     }
+    if (fseek(fp, 0, SEEK_END) != 0 || (len = ftell(fp)) < 0 || fseek(fp, 0, SEEK_SET) != 0) {
+        perror("seek image metadata");
+        fclose(fp);
+        return -1;
+    }
+    text = malloc(len + 1);
+    if (!text) {
+        perror("malloc");
+        fclose(fp);
+        return -1;
+    }
+    len = (long)fread(text, 1, len, fp);
+    fclose(fp);
+
+    memset(image, 0, sizeof(image_info_t));
+    if (json_parse(text, len, &root) != 0 || root.type != JSON_OBJECT) {
+        fprintf(stderr, "Malformed image metadata %s\n", metadata_path);
+        free(text);
+        return -1;
+    }
+
+    json_get_string(&root, "id", image->id, sizeof(image->id));
+    json_get_string(&root, "name", image->name, sizeof(image->name));
+    json_get_string(&root, "tag", image->tag, sizeof(image->tag));
+    json_get_string(&root, "parent", image->parent_id, sizeof(image->parent_id));
+    json_get_string(&root, "created", image->created, sizeof(image->created));
+    json_get_string(&root, "size", image->size, sizeof(image->size));
+    json_get_string(&root, "architecture", image->architecture, sizeof(image->architecture));
+    json_get_string(&root, "os", image->os, sizeof(image->os));
+    json_get_string(&root, "author", image->author, sizeof(image->author));
+    json_get_string(&root, "comment", image->comment, sizeof(image->comment));
+    if (json_get_string(&root, "compression", compression, sizeof(compression)) == 0) {
+        parse_image_compression(compression, &image->compression);
+    }
+
+    if (json_get(&root, "config", &config) == 0) {
+        if (json_get(&config, "Cmd", &value) == 0) {
+            json_join_strings(&value, " ", image->command, sizeof(image->command));
+        }
+        json_get_string(&config, "WorkingDir", image->working_dir, sizeof(image->working_dir));
+        if (json_get(&config, "Env", &value) == 0) {
+            json_join_strings(&value, ";", image->env_vars, sizeof(image->env_vars));
+        }
+        if (json_get(&config, "ExposedPorts", &value) == 0) {
+            first_member_name(&value, image->exposed_ports, sizeof(image->exposed_ports));
+        }
+        if (json_get(&config, "Volumes", &value) == 0) {
+            first_member_name(&value, image->volumes, sizeof(image->volumes));
+        }
+    }
 
-    // Simple JSON parsing (in a real implementation, use a proper JSON library)
-    while (fgets(line, sizeof(line), fp)) {
-        if (strstr(line, "\"id\"")) {
-            sscanf(line, "  \"id\": \"%[^\"]\"", image->id);
-        } else if (strstr(line, "\"name\"")) {
-            sscanf(line, "  \"name\": \"%[^\"]\"", image->name);
-        } else if (strstr(line, "\"tag\"")) {
-            sscanf(line, "  \"tag\": \"%[^\"]\"", image->tag);
-        } else if (strstr(line, "\"created\"")) {
-            sscanf(line, "  \"created\": \"%[^\"]\"", image->created);
-        } else if (strstr(line, "\"size\"")) {
-            sscanf(line, "  \"size\": \"%[^\"]\"", image->size);
+    if (json_get(&root, "layers", &value) == 0 && json_iter_init(&value, &it) == 0) {
+        int capacity = 0;
+
+        while (json_iter_next(&it, NULL, &layer) > 0) {
+            if (image->layer_count == capacity) {
+                capacity = capacity ? capacity * 2 : 4;
+                layer_info_t *layers = realloc(image->layers, capacity * sizeof(layer_info_t));
+                if (!layers) {
+                    perror("realloc");
+                    free(image->layers);
+                    image->layers = NULL;
+                    free(text);
+                    return -1;
+                }
+                image->layers = layers;
+            }
+            memset(&image->layers[image->layer_count], 0, sizeof(layer_info_t));
+            json_string_copy(&layer, image->layers[image->layer_count].id, MAX_LAYER_ID_LEN);
+            image->layer_count++;
         }
     }
 
-    fclose(fp);
+    free(text);
+    return 0;
+}
+
+void free_image_info(image_info_t *image) {
+    if (!image) return;
+    free(image->layers);
+    free(image);
+}
+
+void free_image_list(image_list_t *list) {
+    if (!list) return;
+    for (int i = 0; i < list->count; i++) {
+        free(list->images[i].layers);
+    }
+    free(list->images);
+    free(list);
+}
+
+const char* image_compression_name(image_compression_t compression) {
+    switch (compression) {
+        case IMAGE_COMPRESSION_LZ:
+            return "lz";
+        case IMAGE_COMPRESSION_CHUNKED:
+            return "chunked";
+        default:
+            return "none";
+    }
+}
+
+int parse_image_compression(const char *name, image_compression_t *compression) {
+    if (!name || name[0] == '\0' || strcmp(name, "none") == 0) {
+        *compression = IMAGE_COMPRESSION_NONE;
+    } else if (strcmp(name, "lz") == 0) {
+        *compression = IMAGE_COMPRESSION_LZ;
+    } else if (strcmp(name, "chunked") == 0) {
+        *compression = IMAGE_COMPRESSION_CHUNKED;
+    } else {
+        return -1;
+    }
     return 0;
 }
 
@@ -230,7 +655,8 @@ int calculate_directory_size(const char *path) {
     return size;
 }
 
-int create_image(const char *name, const char *tag, const char *dockerfile_path, const char *context_path) {
+int create_image(const char *name, const char *tag, const char *dockerfile_path, const char *context_path,
+                 image_compression_t compression) {
     image_info_t image;
     char layer_id[MAX_LAYER_ID_LEN];
     char image_path[MAX_PATH_LEN];
@@ -238,17 +664,18 @@ int create_image(const char *name, const char *tag, const char *dockerfile_path,
 
     // Initialize image structure
     memset(&image, 0, sizeof(image));
-    strcpy(image.id, generate_image_id());
+    generate_image_id(image.id, sizeof(image.id));
     strncpy(image.name, name, sizeof(image.name) - 1);
     strncpy(image.tag, tag ? tag : "latest", sizeof(image.tag) - 1);
     strcpy(image.architecture, "amd64");
     strcpy(image.os, "linux");
     strcpy(image.author, "docker-clone");
     snprintf(image.created, sizeof(image.created), "%ld", time(NULL));
+    image.compression = compression;
 
-    // Create base layer
-    strcpy(layer_id, generate_layer_id());
-    if (create_layer(NULL, "FROM scratch", context_path) != 0) {
+    // Create base layer under the id recorded in the metadata
+    generate_layer_id(layer_id, sizeof(layer_id));
+    if (create_layer_with_id(layer_id, NULL, "FROM scratch", context_path, compression) != 0) {
         return -1;
     }
 
@@ -279,67 +706,7 @@ int create_image(const char *name, const char *tag, const char *dockerfile_path,
 }
 
 image_list_t* list_images() {
-    DIR *dir;
-    struct dirent *entry;
-    image_list_t *list;
-    image_info_t *images;
-    int count = 0;
-
-    list = malloc(sizeof(image_list_t));
-    if (!list) {
-        perror("malloc");
-        return NULL;
-    }
-
-    // Count metadata files
-    dir = opendir(METADATA_DIR);
-    if (!dir) {
-        perror("opendir metadata");
-        free(list);
-        return NULL;
-    }
-
-    while ((entry = readdir(dir)) != NULL) {
-        if (strstr(entry->d_name, ".json")) {
-            count++;
-        }
-    }
-    closedir(dir);
-
-    if (count == 0) {
-        list->images = NULL;
-        list->count = 0;
-        list->capacity = 0;
-        return list;
-    }
-
-    images = malloc(sizeof(image_info_t) * count);
-    if (!images) {
-        perror("malloc");
-        free(list);
-        return NULL;
-    }
-
-    // Read metadata files
-    dir = opendir(METADATA_DIR);
-    count = 0;
-    while ((entry = readdir(dir)) != NULL) {
-        if (strstr(entry->d_name, ".json")) {
-            char metadata_path[MAX_PATH_LEN];
-            snprintf(metadata_path, sizeof(metadata_path), "%s/%s", METADATA_DIR, entry->d_name);
-
-            if (read_image_metadata(metadata_path, &images[count]) == 0) {
-                count++;
-            }
-        }
-    }
-    closedir(dir);
-
-    list->images = images;
-    list->count = count;
-    list->capacity = count;
-
-    return list;
+    return image_index_list();
 }
 
 image_info_t* get_image_info(const char *image_id) {
@@ -359,12 +726,20 @@ image_info_t* get_image_info(const char *image_id) {
     return image;
 }
 
-int remove_image(const char *image_id) {
+// Untags the image. Its layers go once no other image or container holds
+// them; the collector deletes them in the background.
+int remove_image(const char *image_ref) {
+    char full_name[MAX_IMAGE_NAME_LEN + MAX_IMAGE_TAG_LEN + 2];
     char metadata_path[MAX_PATH_LEN];
-    char layer_path[MAX_PATH_LEN];
+    image_info_t image;
 
-    snprintf(metadata_path, sizeof(metadata_path), "%s/%s.json", METADATA_DIR, image_id);
-    snprintf(layer_path, sizeof(layer_path), "%s/%s", LAYER_STORAGE_DIR, image_id);
+    if (resolve_image_name(image_ref, full_name, sizeof(full_name)) != 0 ||
+        image_index_get(full_name, &image) != 0) {
+        fprintf(stderr, "No such image: %s\n", image_ref);
+        return -1;
+    }
+    free(image.layers);
+    snprintf(metadata_path, sizeof(metadata_path), "%s/%s.json", METADATA_DIR, full_name);
 
     // Remove metadata
     if (unlink(metadata_path) != 0) {
@@ -372,13 +747,9 @@ int remove_image(const char *image_id) {
         return -1;
     }
 
-    char rm_cmd[1024];
-    snprintf(rm_cmd, sizeof(rm_cmd), "rm -rf %s", layer_path);
-    if (system(rm_cmd) != 0) {
-        fprintf(stderr, "Failed to remove layer directory\n");
-        return -1;
-    }
-
+    image_index_remove(full_name);
+    gc_unref_tag(full_name);
+    publish_event(EVENT_TYPE_IMAGE, "delete", image.id, full_name, NULL, -1);
     return 0;
 }
 
@@ -394,19 +765,19 @@ int tag_image(const char *image_id, const char *name, const char *tag) {
     strncpy(image->tag, tag ? tag : "latest", sizeof(image->tag) - 1);
 
     if (write_image_metadata(image) != 0) {
-        free(image);
+        free_image_info(image);
         return -1;
     }
 
-    free(image);
+    free_image_info(image);
     return 0;
 }
 
 int cleanup_image_system() {
     char rm_cmd[1024];
 
-    snprintf(rm_cmd, sizeof(rm_cmd), "rm -rf %s %s %s",
-             IMAGE_STORAGE_DIR, LAYER_STORAGE_DIR, METADATA_DIR);
+    snprintf(rm_cmd, sizeof(rm_cmd), "rm -rf %s %s %s %s %s",
+             IMAGE_STORAGE_DIR, LAYER_STORAGE_DIR, METADATA_DIR, BLOB_STORAGE_DIR, CHUNK_STORAGE_DIR);
 
     if (system(rm_cmd) != 0) {
         fprintf(stderr, "Failed to cleanup image system\n");
@@ -415,3 +786,2056 @@ int cleanup_image_system() {
 
     return 0;
 }
+
+static int metadata_file_exists(const char *full_name) {
+    char path[MAX_PATH_LEN];
+
+    return image_metadata_path(full_name, path, sizeof(path)) == 0 && access(path, F_OK) == 0;
+}
+
+// resolve_image_name for a build worker, which scans the metadata files
+// where the daemon would look in its index
+static int resolve_from_files(const char *image_ref, char *full_name, size_t size) {
+    char latest[MAX_IMAGE_NAME_LEN + MAX_IMAGE_TAG_LEN + 2];
+    char found_id[MAX_IMAGE_ID_LEN] = "";
+    const char *hex = strncmp(image_ref, "sha256:", 7) == 0 ? image_ref + 7 : image_ref;
+    size_t hex_len = strlen(hex);
+    struct dirent *entry;
+    int ambiguous = 0;
+    DIR *dir;
+
+    if (strchr(image_ref, ':') && strncmp(image_ref, "sha256:", 7) != 0) {
+        if (!metadata_file_exists(image_ref)) {
+            return -1;
+        }
+        snprintf(full_name, size, "%s", image_ref);
+        return 0;
+    }
+    snprintf(latest, sizeof(latest), "%s:latest", image_ref);
+    if (metadata_file_exists(latest)) {
+        snprintf(full_name, size, "%s", latest);
+        return 0;
+    }
+    if (hex_len == 0 || !(dir = opendir(METADATA_DIR))) {
+        return -1;
+    }
+
+    // An id or a unique prefix of one
+    while (!ambiguous && (entry = readdir(dir)) != NULL) {
+        char path[MAX_PATH_LEN];
+        image_info_t image;
+        const char *id_hex;
+        size_t len = strlen(entry->d_name);
+
+        if (len <= 5 || strcmp(entry->d_name + len - 5, ".json") != 0) {
+            continue;
+        }
+        if (snprintf(path, sizeof(path), "%s/%s", METADATA_DIR, entry->d_name) >= (int)sizeof(path) ||
+            parse_image_metadata(path, &image) != 0) {
+            continue;
+        }
+        id_hex = strncmp(image.id, "sha256:", 7) == 0 ? image.id + 7 : image.id;
+        if (strncmp(id_hex, hex, hex_len) == 0 || strcmp(image.id, image_ref) == 0) {
+            if (found_id[0] && strcmp(found_id, image.id) != 0) {
+                ambiguous = 1;
+            } else {
+                snprintf(found_id, sizeof(found_id), "%s", image.id);
+                snprintf(full_name, size, "%s:%s", image.name, image.tag);
+            }
+        }
+        free(image.layers);
+    }
+    closedir(dir);
+
+    if (ambiguous) {
+        fprintf(stderr, "Image id prefix %s matches more than one image\n", image_ref);
+        return -1;
+    }
+    return found_id[0] ? 0 : -1;
+}
+
+// Accepts name:tag, a bare name (meaning :latest), an image id or a
+// unique prefix of one
+int resolve_image_name(const char *image_ref, char *full_name, size_t size) {
+    if (build_report_fd >= 0) {
+        return resolve_from_files(image_ref, full_name, size);
+    }
+    return image_index_resolve(image_ref, full_name, size);
+}
+
+// Indexes an image a build worker reported: its copy of the index and the
+// layer graph went with it
+int adopt_image_metadata(const char *full_name) {
+    char path[MAX_PATH_LEN];
+    image_info_t image;
+
+    if (image_metadata_path(full_name, path, sizeof(path)) != 0 || parse_image_metadata(path, &image) != 0) {
+        fprintf(stderr, "Failed to adopt built image %s\n", full_name);
+        return -1;
+    }
+    if (image_index_put(&image) == 0) {
+        gc_ref_image(&image);
+    }
+    free(image.layers);
+    return 0;
+}
+
+// Layer ids become archive paths and directory names, so keep them plain
+static int valid_layer_id(const char *id) {
+    if (id[0] == '\0' || id[0] == '.' || strlen(id) >= MAX_LAYER_ID_LEN) {
+        return 0;
+    }
+    for (const char *p = id; *p; p++) {
+        if (!isalnum((unsigned char)*p) && *p != '_' && *p != '-' && *p != '.') {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Layers never change once written, so the digest and size of their tar
+// stream are computed on the first save and reused after that
+static int read_layer_digest(const char *layer_id, char *diff_id, long long *tar_size) {
+    char digest_path[MAX_PATH_LEN];
+    FILE *fp;
+    int matched;
+
+    snprintf(digest_path, sizeof(digest_path), "%s/%s/%s.diffid", LAYER_STORAGE_DIR, layer_id, layer_id);
+    fp = fopen(digest_path, "r");
+    if (!fp) {
+        return -1;
+    }
+
+    matched = fscanf(fp, "%71s %lld", diff_id, tar_size);
+    fclose(fp);
+    return matched == 2 && strncmp(diff_id, "sha256:", 7) == 0 ? 0 : -1;
+}
+
+static void write_layer_digest(const char *layer_id, const char *diff_id, long long tar_size) {
+    char digest_path[MAX_PATH_LEN];
+    char temp_path[MAX_PATH_LEN + 8];
+    FILE *fp;
+
+    snprintf(digest_path, sizeof(digest_path), "%s/%s/%s.diffid", LAYER_STORAGE_DIR, layer_id, layer_id);
+    snprintf(temp_path, sizeof(temp_path), "%s.tmp", digest_path);
+
+    fp = fopen(temp_path, "w");
+    if (!fp) {
+        return;
+    }
+    fprintf(fp, "%s %lld\n", diff_id, tar_size);
+    if (fclose(fp) != 0 || rename(temp_path, digest_path) != 0) {
+        unlink(temp_path);
+    }
+}
+
+// Streams the tar inside a compressed or chunked layer into writer and/or hash
+static int copy_layer_blob(const char *layer_id, tar_writer_t *writer, sha256_ctx_t *hash, long long *size) {
+    char blob_path[MAX_PATH_LEN];
+    lz_reader_t *reader = NULL;
+    chunk_reader_t *chunks = NULL;
+    char *buffer;
+    ssize_t n;
+    int result = 0;
+    int fd = -1;
+
+    if (layer_is_chunked(layer_id)) {
+        layer_chunks_path(layer_id, blob_path, sizeof(blob_path));
+        chunks = chunk_reader_open(blob_path);
+        if (!chunks) {
+            return -1;
+        }
+    } else {
+        layer_blob_path(layer_id, blob_path, sizeof(blob_path));
+        fd = open(blob_path, O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            perror("open layer blob");
+            return -1;
+        }
+        reader = lz_reader_open(lz_fd_read, &fd, lz_default_threads());
+    }
+
+    buffer = malloc(TAR_BUFFER_SIZE);
+    if (!buffer || (!reader && !chunks)) {
+        free(buffer);
+        lz_reader_close(reader);
+        chunk_reader_close(chunks);
+        if (fd >= 0) close(fd);
+        return -1;
+    }
+
+    *size = 0;
+    while ((n = chunks ? chunk_read(chunks, buffer, TAR_BUFFER_SIZE)
+                       : lz_read(reader, buffer, TAR_BUFFER_SIZE)) > 0) {
+        if (hash) {
+            sha256_update(hash, buffer, n);
+        }
+        if (writer && tar_write_data(writer, buffer, n) != 0) {
+            result = -1;
+            break;
+        }
+        *size += n;
+    }
+    if (n < 0) {
+        fprintf(stderr, "Layer %s is corrupt\n", layer_id);
+        result = -1;
+    }
+
+    lz_reader_close(reader);
+    chunk_reader_close(chunks);
+    free(buffer);
+    if (fd >= 0) {
+        close(fd);
+    }
+    return result;
+}
+
+// A compressed layer already is a tarball; it is decompressed into the
+// archive as layer.tar, which matches what an uncompressed layer produces
+static int write_compressed_layer(tar_writer_t *writer, const char *layer_id, char *diff_id) {
+    char entry_name[MAX_LAYER_ID_LEN + 16];
+    long long tar_size, written;
+    sha256_ctx_t hash;
+    struct stat st;
+
+    if (read_layer_digest(layer_id, diff_id, &tar_size) != 0) {
+        sha256_init(&hash);
+        if (copy_layer_blob(layer_id, NULL, &hash, &tar_size) != 0) {
+            return -1;
+        }
+        format_diff_id(&hash, diff_id);
+        write_layer_digest(layer_id, diff_id, tar_size);
+    }
+
+    memset(&st, 0, sizeof(st));
+    st.st_mode = S_IFREG | 0644;
+    st.st_size = tar_size;
+    snprintf(entry_name, sizeof(entry_name), "%s/layer.tar", layer_id);
+    if (tar_write_header(writer, entry_name, &st, NULL) != 0 ||
+        copy_layer_blob(layer_id, writer, NULL, &written) != 0) {
+        return -1;
+    }
+    if (written != tar_size) {
+        fprintf(stderr, "Layer %s does not match its recorded size\n", layer_id);
+        return -1;
+    }
+
+    return tar_pad(writer);
+}
+
+static int write_layer_entries(tar_writer_t *writer, const char *layer_id, char *diff_id) {
+    char layer_path[MAX_PATH_LEN];
+    char json_path[MAX_PATH_LEN];
+    char entry_name[MAX_LAYER_ID_LEN + 16];
+    char skip_prefix[MAX_LAYER_ID_LEN + 1];
+    struct stat st;
+    long long tar_size;
+    sha256_ctx_t hash;
+    int cached;
+    int fd;
+
+    if (!valid_layer_id(layer_id) ||
+        snprintf(layer_path, sizeof(layer_path), "%s/%s", LAYER_STORAGE_DIR, layer_id) >= (int)sizeof(layer_path) ||
+        snprintf(json_path, sizeof(json_path), "%s/%s.json", layer_path, layer_id) >= (int)sizeof(json_path) ||
+        stat(layer_path, &st) != 0 || !S_ISDIR(st.st_mode)) {
+        fprintf(stderr, "Layer %s not found\n", layer_id);
+        return -1;
+    }
+    snprintf(skip_prefix, sizeof(skip_prefix), "%s.", layer_id);
+
+    memset(&st, 0, sizeof(st));
+    st.st_mode = S_IFDIR | 0755;
+    snprintf(entry_name, sizeof(entry_name), "%s/", layer_id);
+    if (tar_write_header(writer, entry_name, &st, NULL) != 0) {
+        return -1;
+    }
+
+    snprintf(entry_name, sizeof(entry_name), "%s/VERSION", layer_id);
+    if (tar_write_buffer(writer, entry_name, "1.0", 3, 0644) != 0) {
+        return -1;
+    }
+
+    // The layer's own metadata travels as <id>/json
+    fd = open(json_path, O_RDONLY | O_CLOEXEC);
+    if (fd >= 0 && fstat(fd, &st) == 0) {
+        st.st_mode = S_IFREG | 0644;
+        st.st_uid = st.st_gid = 0;
+        snprintf(entry_name, sizeof(entry_name), "%s/json", layer_id);
+        if (tar_write_header(writer, entry_name, &st, NULL) != 0 ||
+            tar_write_file_data(writer, fd, st.st_size) != 0 ||
+            tar_pad(writer) != 0) {
+            close(fd);
+            return -1;
+        }
+    }
+    if (fd >= 0) {
+        close(fd);
+    }
+
+    if (layer_is_compressed(layer_id)) {
+        return write_compressed_layer(writer, layer_id, diff_id);
+    }
+    if (lazy_complete_layer(layer_id) != 0) {
+        return -1;
+    }
+
+    // The outer header needs the size of layer.tar before its contents
+    cached = read_layer_digest(layer_id, diff_id, &tar_size) == 0;
+    if (!cached && (tar_size = tar_tree_size(layer_path, skip_prefix)) < 0) {
+        fprintf(stderr, "Failed to scan layer %s\n", layer_id);
+        return -1;
+    }
+
+    memset(&st, 0, sizeof(st));
+    st.st_mode = S_IFREG | 0644;
+    st.st_size = tar_size;
+    snprintf(entry_name, sizeof(entry_name), "%s/layer.tar", layer_id);
+    if (tar_write_header(writer, entry_name, &st, NULL) != 0) {
+        return -1;
+    }
+
+    // Without a cached digest the layer is hashed as it streams; otherwise
+    // file contents go out with sendfile
+    unsigned long long start = writer->offset;
+    if (!cached) {
+        sha256_init(&hash);
+        writer->hash = &hash;
+    }
+    int result = tar_write_tree(writer, layer_path, skip_prefix);
+    if (result == 0) {
+        result = tar_finish(writer);
+    }
+    writer->hash = NULL;
+
+    if (result != 0) {
+        return -1;
+    }
+    if ((long long)(writer->offset - start) != tar_size) {
+        fprintf(stderr, "Layer %s changed while it was being saved\n", layer_id);
+        return -1;
+    }
+
+    if (!cached) {
+        format_diff_id(&hash, diff_id);
+        write_layer_digest(layer_id, diff_id, tar_size);
+    }
+
+    return tar_pad(writer);
+}
+
+// Finishes a writer streaming into an open_memstream and closes the
+// stream; the text, or NULL when either failed
+static char* close_json_stream(json_writer_t *w, FILE *fp, char **text) {
+    int failed = json_writer_finish(w) < 0;
+
+    if (fclose(fp) != 0 || failed) {
+        free(*text);
+        return NULL;
+    }
+    return *text;
+}
+
+char* build_image_config(image_info_t *image, char (*diff_ids)[MAX_DIGEST_LEN], size_t *len) {
+    char buffer[4096];
+    char *config = NULL;
+    json_writer_t w;
+    FILE *fp = open_memstream(&config, len);
+
+    if (!fp) {
+        perror("open_memstream");
+        return NULL;
+    }
+
+    json_writer_init(&w, buffer, sizeof(buffer), json_flush_file, fp);
+    json_write_object_begin(&w);
+    json_write_key(&w, "architecture");
+    json_write_string(&w, image->architecture[0] ? image->architecture : "amd64");
+    json_write_key(&w, "os");
+    json_write_string(&w, image->os[0] ? image->os : "linux");
+    json_write_key(&w, "created");
+    json_write_string(&w, image->created);
+    json_write_key(&w, "author");
+    json_write_string(&w, image->author);
+    json_write_key(&w, "comment");
+    json_write_string(&w, image->comment);
+    json_write_key(&w, "id");
+    json_write_string(&w, image->id);
+    json_write_key(&w, "config");
+    json_write_object_begin(&w);
+    json_write_key(&w, "Cmd");
+    json_write_array_begin(&w);
+    if (image->command[0]) json_write_string(&w, image->command);
+    json_write_array_end(&w);
+    json_write_key(&w, "WorkingDir");
+    json_write_string(&w, image->working_dir);
+    json_write_key(&w, "Env");
+    json_write_array_begin(&w);
+    if (image->env_vars[0]) json_write_string(&w, image->env_vars);
+    json_write_array_end(&w);
+    json_write_object_end(&w);
+    json_write_key(&w, "rootfs");
+    json_write_object_begin(&w);
+    json_write_key(&w, "type");
+    json_write_string(&w, "layers");
+    json_write_key(&w, "diff_ids");
+    json_write_array_begin(&w);
+    for (int i = 0; i < image->layer_count; i++) {
+        json_write_string(&w, diff_ids[i]);
+    }
+    json_write_array_end(&w);
+    json_write_object_end(&w);
+    json_write_object_end(&w);
+
+    return close_json_stream(&w, fp, &config);
+}
+
+static char* build_image_manifest(image_info_t *image, const char *config_name, size_t *len) {
+    char buffer[4096];
+    char *manifest = NULL;
+    json_writer_t w;
+    FILE *fp = open_memstream(&manifest, len);
+
+    if (!fp) {
+        perror("open_memstream");
+        return NULL;
+    }
+
+    json_writer_init(&w, buffer, sizeof(buffer), json_flush_file, fp);
+    json_write_array_begin(&w);
+    json_write_object_begin(&w);
+    json_write_key(&w, "Config");
+    json_write_string(&w, config_name);
+    json_write_key(&w, "RepoTags");
+    json_write_array_begin(&w);
+    json_write_string(&w, get_image_full_name(image->name, image->tag));
+    json_write_array_end(&w);
+    json_write_key(&w, "Layers");
+    json_write_array_begin(&w);
+    for (int i = 0; i < image->layer_count; i++) {
+        char layer_tar[MAX_LAYER_ID_LEN + 16];
+
+        snprintf(layer_tar, sizeof(layer_tar), "%s/layer.tar", image->layers[i].id);
+        json_write_string(&w, layer_tar);
+    }
+    json_write_array_end(&w);
+    json_write_object_end(&w);
+    json_write_array_end(&w);
+    json_write_raw(&w, "\n", 1);
+
+    return close_json_stream(&w, fp, &manifest);
+}
+
+static char* build_image_repositories(image_info_t *image, size_t *len) {
+    char buffer[1024];
+    char *repositories = NULL;
+    json_writer_t w;
+    FILE *fp = open_memstream(&repositories, len);
+
+    if (!fp) {
+        perror("open_memstream");
+        return NULL;
+    }
+
+    json_writer_init(&w, buffer, sizeof(buffer), json_flush_file, fp);
+    json_write_object_begin(&w);
+    json_write_key(&w, image->name);
+    json_write_object_begin(&w);
+    json_write_key(&w, image->tag[0] ? image->tag : "latest");
+    json_write_string(&w, image->layers[image->layer_count - 1].id);
+    json_write_object_end(&w);
+    json_write_object_end(&w);
+    json_write_raw(&w, "\n", 1);
+
+    return close_json_stream(&w, fp, &repositories);
+}
+
+// Streams an image in the docker save layout: one directory per layer with
+// its layer.tar, the image config named by its digest, and manifest.json.
+// With IMAGE_COMPRESSION_LZ the whole archive goes out as one lz frame.
+int write_image_archive(const char *image_ref, int fd, int chunked, image_compression_t compression) {
+    char full_name[MAX_IMAGE_NAME_LEN + MAX_IMAGE_TAG_LEN + 2];
+    char config_name[SHA256_HEX_LEN + 8];
+    char config_hex[SHA256_HEX_LEN + 1];
+    char (*diff_ids)[MAX_DIGEST_LEN] = NULL;
+    char *config = NULL, *manifest = NULL, *repositories = NULL;
+    size_t config_len, manifest_len, repositories_len;
+    image_info_t image;
+    tar_writer_t *writer = NULL;
+    int result = -1;
+
+    if (resolve_image_name(image_ref, full_name, sizeof(full_name)) != 0 ||
+        read_image_metadata(full_name, &image) != 0) {
+        fprintf(stderr, "No such image: %s\n", image_ref);
+        return -1;
+    }
+
+    if (image.layer_count == 0) {
+        fprintf(stderr, "Image %s has no layers\n", full_name);
+        goto out;
+    }
+
+    diff_ids = calloc(image.layer_count, MAX_DIGEST_LEN);
+    writer = tar_writer_open(fd, chunked);
+    if (!diff_ids || !writer) {
+        goto out;
+    }
+    if (compression == IMAGE_COMPRESSION_LZ && tar_writer_compress(writer, lz_default_threads()) != 0) {
+        goto out;
+    }
+
+    for (int i = 0; i < image.layer_count; i++) {
+        if (write_layer_entries(writer, image.layers[i].id, diff_ids[i]) != 0) {
+            goto out;
+        }
+    }
+
+    config = build_image_config(&image, diff_ids, &config_len);
+    if (!config) {
+        goto out;
+    }
+    sha256_hex(config, config_len, config_hex);
+    snprintf(config_name, sizeof(config_name), "%s.json", config_hex);
+
+    manifest = build_image_manifest(&image, config_name, &manifest_len);
+    repositories = build_image_repositories(&image, &repositories_len);
+    if (!manifest || !repositories) {
+        goto out;
+    }
+
+    if (tar_write_buffer(writer, config_name, config, config_len, 0644) != 0 ||
+        tar_write_buffer(writer, "manifest.json", manifest, manifest_len, 0644) != 0 ||
+        tar_write_buffer(writer, "repositories", repositories, repositories_len, 0644) != 0 ||
+        tar_finish(writer) != 0) {
+        goto out;
+    }
+
+    result = 0;
+
+out:
+    if (writer && tar_writer_close(writer) != 0) {
+        result = -1;
+    }
+    free(config);
+    free(manifest);
+    free(repositories);
+    free(diff_ids);
+    free(image.layers);
+    return result;
+}
+
+int save_image(const char *image_id, const char *output_path, image_compression_t compression) {
+    int to_stdout = !output_path || strcmp(output_path, "-") == 0;
+    int fd = to_stdout ? STDOUT_FILENO : open(output_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+
+    if (fd < 0) {
+        perror("open archive");
+        return -1;
+    }
+
+    int result = write_image_archive(image_id, fd, 0, compression);
+
+    if (!to_stdout) {
+        if (close(fd) != 0) {
+            perror("close archive");
+            result = -1;
+        }
+        if (result != 0) {
+            unlink(output_path);
+        }
+    }
+    return result;
+}
+
+typedef struct {
+    char id[MAX_LAYER_ID_LEN];
+    char diff_id[MAX_DIGEST_LEN];
+    char *json;
+    int extracted;
+} archive_layer_t;
+
+typedef struct {
+    char staging[MAX_PATH_LEN];
+    archive_layer_t *layers;
+    int count;
+    int capacity;
+    char *manifest;
+    char *config;
+    char config_name[SHA256_HEX_LEN + 8];
+} archive_load_t;
+
+static archive_layer_t* find_archive_layer(archive_load_t *load, const char *id, int create) {
+    for (int i = 0; i < load->count; i++) {
+        if (strcmp(load->layers[i].id, id) == 0) {
+            return &load->layers[i];
+        }
+    }
+    if (!create) {
+        return NULL;
+    }
+
+    if (load->count == load->capacity) {
+        int capacity = load->capacity ? load->capacity * 2 : 8;
+        archive_layer_t *layers = realloc(load->layers, capacity * sizeof(archive_layer_t));
+        if (!layers) {
+            perror("realloc");
+            return NULL;
+        }
+        load->layers = layers;
+        load->capacity = capacity;
+    }
+
+    archive_layer_t *layer = &load->layers[load->count++];
+    memset(layer, 0, sizeof(archive_layer_t));
+    snprintf(layer->id, sizeof(layer->id), "%s", id);
+    return layer;
+}
+
+// Unpacks one layer.tar straight into the staging area, hashing it on the way
+static int load_archive_layer(archive_load_t *load, tar_reader_t *reader, const char *id, long long size) {
+    char layer_path[MAX_PATH_LEN + MAX_LAYER_ID_LEN];
+    uint8_t digest[SHA256_DIGEST_LEN];
+    char hex[SHA256_HEX_LEN + 1];
+    archive_layer_t *layer;
+    tar_reader_t nested;
+    sha256_ctx_t hash;
+
+    layer = find_archive_layer(load, id, 1);
+    if (!layer) {
+        return -1;
+    }
+    if (layer->extracted) {
+        fprintf(stderr, "Archive contains layer %s twice\n", id);
+        return -1;
+    }
+
+    snprintf(layer_path, sizeof(layer_path), "%s/%s", load->staging, id);
+    if (mkdir(layer_path, 0755) != 0 && errno != EEXIST) {
+        perror("mkdir layer");
+        return -1;
+    }
+
+    sha256_init(&hash);
+    tar_reader_nested(&nested, reader, size, &hash);
+    if (tar_extract(&nested, layer_path) != 0 || tar_drain(&nested) != 0) {
+        fprintf(stderr, "Failed to extract layer %s\n", id);
+        return -1;
+    }
+
+    sha256_final(&hash, digest);
+    sha256_to_hex(digest, hex);
+    snprintf(layer->diff_id, sizeof(layer->diff_id), "sha256:%s", hex);
+    layer->extracted = 1;
+    return 0;
+}
+
+static int read_archive_entries(archive_load_t *load, tar_reader_t *reader) {
+    tar_entry_t *entry;
+    int rc;
+
+    entry = malloc(sizeof(tar_entry_t));
+    if (!entry) {
+        perror("malloc");
+        return -1;
+    }
+
+    while ((rc = tar_next(reader, entry)) == 1) {
+        const char *name = entry->name;
+        char *slash;
+
+        while (name[0] == '.' && name[1] == '/') name += 2;
+        slash = strchr(name, '/');
+
+        if (!slash) {
+            size_t len = strlen(name);
+
+            if (strcmp(name, "manifest.json") == 0) {
+                free(load->manifest);
+                load->manifest = NULL;
+                rc = tar_read_all(reader, &load->manifest, ARCHIVE_MAX_JSON_LEN) == 0 ? 1 : -1;
+            } else if (len > 5 && strcmp(name + len - 5, ".json") == 0 && entry->type == '0') {
+                char hex[SHA256_HEX_LEN + 1];
+
+                // The config is named by its own digest
+                free(load->config);
+                load->config = NULL;
+                if (tar_read_all(reader, &load->config, ARCHIVE_MAX_JSON_LEN) != 0) {
+                    rc = -1;
+                    break;
+                }
+                sha256_hex(load->config, strlen(load->config), hex);
+                if (len != SHA256_HEX_LEN + 5 || strncmp(name, hex, SHA256_HEX_LEN) != 0) {
+                    fprintf(stderr, "Image config %s does not match its digest\n", name);
+                    rc = -1;
+                    break;
+                }
+                memcpy(load->config_name, name, len + 1);
+            }
+        } else {
+            char id[MAX_LAYER_ID_LEN];
+            const char *file = slash + 1;
+
+            if (slash - name >= MAX_LAYER_ID_LEN) {
+                fprintf(stderr, "Invalid layer entry %s\n", name);
+                rc = -1;
+                break;
+            }
+            memcpy(id, name, slash - name);
+            id[slash - name] = '\0';
+            if (!valid_layer_id(id)) {
+                fprintf(stderr, "Invalid layer entry %s\n", name);
+                rc = -1;
+                break;
+            }
+
+            if (strcmp(file, "layer.tar") == 0) {
+                rc = load_archive_layer(load, reader, id, entry->size) == 0 ? 1 : -1;
+            } else if (strcmp(file, "json") == 0) {
+                archive_layer_t *layer = find_archive_layer(load, id, 1);
+                if (layer) free(layer->json);
+                rc = layer && tar_read_all(reader, &layer->json, ARCHIVE_MAX_JSON_LEN) == 0 ? 1 : -1;
+            }
+        }
+
+        if (rc != 1) {
+            break;
+        }
+    }
+
+    free(entry);
+    return rc;
+}
+
+// Checks every layer listed in the manifest against the config's diff_ids,
+// then moves the staged layers into the layer store
+// Copies what the image metadata keeps from an image config; config_hex
+// names the image when the config carries no id of its own
+static void fill_image_from_config(image_info_t *image, const json_value_t *config, const char *config_hex) {
+    json_value_t root = *config, container_config, value;
+
+    json_get_string(&root, "id", image->id, sizeof(image->id));
+    if (!image->id[0]) {
+        snprintf(image->id, sizeof(image->id), "sha256:%.12s", config_hex);
+    }
+    json_get_string(&root, "created", image->created, sizeof(image->created));
+    json_get_string(&root, "author", image->author, sizeof(image->author));
+    json_get_string(&root, "comment", image->comment, sizeof(image->comment));
+    json_get_string(&root, "architecture", image->architecture, sizeof(image->architecture));
+    json_get_string(&root, "os", image->os, sizeof(image->os));
+
+    // Cmd and Env are arrays; the image keeps each as one string
+    if (json_get(&root, "config", &container_config) != 0 || container_config.type != JSON_OBJECT) {
+        return;
+    }
+    if (json_get(&container_config, "Cmd", &value) == 0) {
+        json_join_strings(&value, " ", image->command, sizeof(image->command));
+    }
+    json_get_string(&container_config, "WorkingDir", image->working_dir, sizeof(image->working_dir));
+    if (json_get(&container_config, "Env", &value) == 0) {
+        json_join_strings(&value, ";", image->env_vars, sizeof(image->env_vars));
+    }
+}
+
+// The image of a manifest.json; docker save writes a list of them, and
+// only the first is loaded
+static int parse_archive_manifest(const char *text, json_value_t *manifest) {
+    json_value_t root;
+    json_iter_t it;
+
+    if (json_parse(text, strlen(text), &root) != 0) {
+        return -1;
+    }
+    if (root.type == JSON_ARRAY) {
+        json_iter_init(&root, &it);
+        if (json_iter_next(&it, NULL, manifest) <= 0) {
+            return -1;
+        }
+    } else {
+        *manifest = root;
+    }
+    return manifest->type == JSON_OBJECT ? 0 : -1;
+}
+
+// The rootfs diff_ids of an image config, ready to be walked
+static int config_diff_ids(const json_value_t *config, json_iter_t *it) {
+    json_value_t diff_ids;
+
+    if (json_find(config, "diff_ids", &diff_ids) != 0 || json_iter_init(&diff_ids, it) != 0 || it->object) {
+        return -1;
+    }
+    return 0;
+}
+
+// 1 with the next diff_id, 0 at the end of the list, -1 on anything but a
+// string that fits
+static int next_diff_id(json_iter_t *it, char *diff_id, size_t size) {
+    json_value_t element;
+
+    if (json_iter_next(it, NULL, &element) <= 0) {
+        return 0;
+    }
+    return json_string_copy(&element, diff_id, size) == 0 ? 1 : -1;
+}
+
+static int install_archive(archive_load_t *load, char *loaded_ref, size_t ref_size) {
+    char manifest_config[SHA256_HEX_LEN + 8];
+    char repo_tag[MAX_IMAGE_NAME_LEN + MAX_IMAGE_TAG_LEN + 2];
+    char entry_name[MAX_PATH_LEN];
+    char diff_id[MAX_DIGEST_LEN];
+    char staged_path[MAX_PATH_LEN + MAX_LAYER_ID_LEN];
+    char layer_path[MAX_PATH_LEN];
+    json_value_t manifest, config, layers, element;
+    json_iter_t layer_it, diff_it;
+    image_info_t image;
+    long long total_size = 0;
+    int result = -1;
+
+    if (!load->manifest || !load->config) {
+        fprintf(stderr, "Archive is missing manifest.json or the image config\n");
+        return -1;
+    }
+    if (parse_archive_manifest(load->manifest, &manifest) != 0 ||
+        json_parse(load->config, strlen(load->config), &config) != 0 || config.type != JSON_OBJECT) {
+        fprintf(stderr, "Archive manifest or image config is not valid JSON\n");
+        return -1;
+    }
+
+    if (json_get_string(&manifest, "Config", manifest_config, sizeof(manifest_config)) != 0 ||
+        strcmp(manifest_config, load->config_name) != 0) {
+        fprintf(stderr, "Manifest refers to a config that is not in the archive\n");
+        return -1;
+    }
+
+    if (json_get(&manifest, "Layers", &layers) != 0 || json_iter_init(&layers, &layer_it) != 0 || layer_it.object ||
+        config_diff_ids(&config, &diff_it) != 0) {
+        fprintf(stderr, "Archive manifest has no layer list\n");
+        return -1;
+    }
+
+    memset(&image, 0, sizeof(image));
+
+    while (json_iter_next(&layer_it, NULL, &element) > 0) {
+        archive_layer_t *layer = NULL;
+        char *suffix = NULL;
+
+        if (json_string_copy(&element, entry_name, sizeof(entry_name)) == 0) {
+            suffix = strstr(entry_name, "/layer.tar");
+        }
+        if (suffix && suffix[strlen("/layer.tar")] == '\0') {
+            *suffix = '\0';
+            layer = find_archive_layer(load, entry_name, 0);
+        }
+        if (!layer || !layer->extracted) {
+            fprintf(stderr, "Layer %s is missing from the archive\n", entry_name);
+            goto out;
+        }
+
+        if (next_diff_id(&diff_it, diff_id, sizeof(diff_id)) != 1 || strcmp(diff_id, layer->diff_id) != 0) {
+            fprintf(stderr, "Layer %s does not match its digest in the image config\n", layer->id);
+            goto out;
+        }
+
+        layer_info_t *layers = realloc(image.layers, (image.layer_count + 1) * sizeof(layer_info_t));
+        if (!layers) {
+            perror("realloc");
+            goto out;
+        }
+        image.layers = layers;
+        memset(&image.layers[image.layer_count], 0, sizeof(layer_info_t));
+        strcpy(image.layers[image.layer_count].id, layer->id);
+        image.layer_count++;
+    }
+
+    if (image.layer_count == 0 || next_diff_id(&diff_it, diff_id, sizeof(diff_id)) != 0) {
+        fprintf(stderr, "Archive layers do not match the image config\n");
+        goto out;
+    }
+
+    // Only verified layers reach the store; ones already present are kept
+    for (int i = 0; i < image.layer_count; i++) {
+        archive_layer_t *layer = find_archive_layer(load, image.layers[i].id, 0);
+
+        snprintf(staged_path, sizeof(staged_path), "%s/%s", load->staging, layer->id);
+        snprintf(layer_path, sizeof(layer_path), "%s/%s", LAYER_STORAGE_DIR, layer->id);
+
+        gc_lease_layer(layer->id);
+        if (access(layer_path, F_OK) != 0) {
+            char json_path[MAX_PATH_LEN * 2];
+            snprintf(json_path, sizeof(json_path), "%s/%s.json", staged_path, layer->id);
+
+            if (layer->json) {
+                FILE *fp = fopen(json_path, "w");
+                if (!fp) {
+                    perror("fopen layer metadata");
+                    goto out;
+                }
+                fputs(layer->json, fp);
+                fclose(fp);
+            }
+
+            if (rename(staged_path, layer_path) != 0) {
+                perror("rename layer");
+                goto out;
+            }
+            if (!layer->json && create_layer_with_id(layer->id, NULL, "", NULL, IMAGE_COMPRESSION_NONE) != 0) {
+                goto out;
+            }
+        }
+
+        total_size += calculate_directory_size(layer_path);
+    }
+
+    // Image metadata comes from the config; the name from RepoTags
+    fill_image_from_config(&image, &config, load->config_name);
+    snprintf(image.size, sizeof(image.size), "%lld", total_size);
+
+    json_value_t tags;
+    json_iter_t tag_it;
+    if (json_get(&manifest, "RepoTags", &tags) == 0 && json_iter_init(&tags, &tag_it) == 0 &&
+        json_iter_next(&tag_it, NULL, &element) > 0 && json_string_copy(&element, repo_tag, sizeof(repo_tag)) == 0) {
+        char *colon = strrchr(repo_tag, ':');
+        if (colon && !strchr(colon, '/')) {
+            *colon = '\0';
+            snprintf(image.tag, sizeof(image.tag), "%s", colon + 1);
+        }
+        if (snprintf(image.name, sizeof(image.name), "%s", repo_tag) >= (int)sizeof(image.name)) {
+            fprintf(stderr, "Image name too long: %s\n", repo_tag);
+            goto out;
+        }
+    } else {
+        snprintf(image.name, sizeof(image.name), "%.12s", load->config_name);
+    }
+    if (!image.tag[0]) {
+        strcpy(image.tag, "latest");
+    }
+
+    if (strchr(image.name, '/') || image.name[0] == '.' || write_image_metadata(&image) != 0) {
+        fprintf(stderr, "Failed to record image %s\n", image.name);
+        goto out;
+    }
+
+    snprintf(loaded_ref, ref_size, "%s", get_image_full_name(image.name, image.tag));
+    result = 0;
+
+out:
+    free(image.layers);
+    return result;
+}
+
+// Reads an archive written by write_image_archive (or docker save) from fd.
+// prefix holds bytes already read from fd; limit caps the stream length,
+// -1 reads until EOF. Nothing reaches the layer store unless every layer
+// matches its digest.
+int read_image_archive(int fd, const void *prefix, size_t prefix_len, long long limit,
+                       char *loaded_ref, size_t ref_size) {
+    char rm_cmd[MAX_PATH_LEN + 16];
+    archive_load_t load;
+    tar_reader_t *reader;
+    int result = -1;
+
+    memset(&load, 0, sizeof(load));
+    snprintf(load.staging, sizeof(load.staging), "%s/load-XXXXXX", IMAGE_STORAGE_DIR);
+    if (create_directory_structure() != 0 || !mkdtemp(load.staging)) {
+        perror("mkdtemp");
+        return -1;
+    }
+
+    // Archives saved with compression are recognised by their frame magic
+    reader = tar_reader_open(fd, prefix, prefix_len, limit);
+    if (reader && tar_reader_detect_compression(reader, lz_default_threads()) >= 0) {
+        if (read_archive_entries(&load, reader) == 0 && tar_drain(reader) == 0) {
+            result = install_archive(&load, loaded_ref, ref_size);
+        }
+    }
+    tar_reader_close(reader);
+
+    snprintf(rm_cmd, sizeof(rm_cmd), "rm -rf %s", load.staging);
+    if (system(rm_cmd) != 0) {
+        fprintf(stderr, "Failed to remove %s\n", load.staging);
+    }
+
+    for (int i = 0; i < load.count; i++) {
+        free(load.layers[i].json);
+    }
+    free(load.layers);
+    free(load.manifest);
+    free(load.config);
+    return result;
+}
+
+// Layers imported from a registry are named after their diff_id, so an
+// image pulled twice, or two images sharing a base, share the layer
+void imported_layer_id(const char *diff_id, char *layer_id, size_t size) {
+    const char *hex = strchr(diff_id, ':');
+    snprintf(layer_id, size, "layer_%.48s", hex ? hex + 1 : diff_id);
+}
+
+// Blobs are named by digest and only written once verified, so a plain
+// tar whose digest is its diff_id needs no second pass over the contents
+int blob_storage_path(const char *digest, char *path, size_t size) {
+    const char *hex = digest + strlen("sha256:");
+
+    if (strncmp(digest, "sha256:", 7) != 0 || strlen(hex) != SHA256_HEX_LEN ||
+        strspn(hex, "0123456789abcdef") != SHA256_HEX_LEN) {
+        return -1;
+    }
+    snprintf(path, size, "%s/sha256/%s", BLOB_STORAGE_DIR, hex);
+    return 0;
+}
+
+// Unpacks a layer tarball from the content store into the layer store,
+// checking the unpacked stream against diff_id on the way
+static int import_layer(const char *digest, const char *diff_id, const char *layer_id) {
+    char blob_path[MAX_PATH_LEN];
+    char layer_path[MAX_PATH_LEN];
+    char staging[MAX_PATH_LEN + 16];
+    char rm_cmd[MAX_PATH_LEN + 32];
+    char actual[MAX_DIGEST_LEN];
+    tar_reader_t *reader = NULL;
+    sha256_ctx_t hash;
+    struct stat st;
+    int compressed = 0;
+    int result = -1;
+    int fd;
+
+    snprintf(layer_path, sizeof(layer_path), "%s/%s", LAYER_STORAGE_DIR, layer_id);
+    gc_lease_layer(layer_id);
+    if (access(layer_path, F_OK) == 0) {
+        return 0;
+    }
+
+    if (blob_storage_path(digest, blob_path, sizeof(blob_path)) != 0) {
+        return -1;
+    }
+    fd = open(blob_path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        perror("open layer blob");
+        if (fd >= 0) close(fd);
+        return -1;
+    }
+
+    snprintf(staging, sizeof(staging), "%s/%s.import-XXXXXX", LAYER_STORAGE_DIR, layer_id);
+    // mkdtemp leaves the directory private; it becomes the layer's root
+    if (!mkdtemp(staging) || chmod(staging, 0755) != 0) {
+        perror("mkdtemp");
+        close(fd);
+        return -1;
+    }
+
+    sha256_init(&hash);
+    reader = tar_reader_open(fd, NULL, 0, st.st_size);
+    if (reader && (compressed = tar_reader_detect_compression(reader, lz_default_threads())) >= 0) {
+        int verified = !compressed && strcmp(digest, diff_id) == 0;
+
+        reader->hash = verified ? NULL : &hash;
+        if (tar_extract(reader, staging) == 0 && tar_drain(reader) == 0) {
+            if (!verified) {
+                format_diff_id(&hash, actual);
+            }
+            if (verified || strcmp(actual, diff_id) == 0) {
+                result = 0;
+            } else {
+                fprintf(stderr, "Layer %s does not match its diff_id\n", layer_id);
+            }
+        }
+    }
+    tar_reader_close(reader);
+    close(fd);
+
+    // Another pull may have installed the same layer in the meantime
+    if (result == 0 && rename(staging, layer_path) != 0 && access(layer_path, F_OK) != 0) {
+        perror("rename layer");
+        result = -1;
+    }
+    if (access(staging, F_OK) == 0) {
+        snprintf(rm_cmd, sizeof(rm_cmd), "rm -rf %s", staging);
+        if (system(rm_cmd) != 0) {
+            fprintf(stderr, "Failed to remove %s\n", staging);
+        }
+    }
+    if (result != 0) {
+        return -1;
+    }
+
+    return record_layer(layer_id, compressed ? NULL : diff_id, st.st_size);
+}
+
+// Writes the metadata of a layer whose tree is already in place. diff_id is
+// NULL when the tar stream the layer came from was not its own.
+int record_layer(const char *layer_id, const char *diff_id, long long tar_size) {
+    if (create_layer_with_id(layer_id, NULL, "", NULL, IMAGE_COMPRESSION_NONE) != 0) {
+        return -1;
+    }
+    if (diff_id) {
+        write_layer_digest(layer_id, diff_id, tar_size);
+    }
+    return 0;
+}
+
+// Records an image whose config and layer tarballs are already in the
+// content store. layer_digests follow the order of the config's diff_ids.
+int import_image(const char *name, const char *tag, const char *config, const char *config_digest,
+                 char (*layer_digests)[MAX_DIGEST_LEN], int layer_count) {
+    char diff_id[MAX_DIGEST_LEN];
+    const char *config_hex = strchr(config_digest, ':');
+    json_value_t root;
+    json_iter_t diff_it;
+    image_info_t image;
+    long long total_size = 0;
+    int result = -1;
+
+    if (json_parse(config, strlen(config), &root) != 0 || root.type != JSON_OBJECT ||
+        config_diff_ids(&root, &diff_it) != 0 || layer_count <= 0) {
+        fprintf(stderr, "Image config has no layer list\n");
+        return -1;
+    }
+
+    memset(&image, 0, sizeof(image));
+    image.layers = calloc(layer_count, sizeof(layer_info_t));
+    if (!image.layers) {
+        perror("calloc");
+        return -1;
+    }
+
+    for (int i = 0; i < layer_count; i++) {
+        char layer_path[MAX_PATH_LEN];
+
+        if (next_diff_id(&diff_it, diff_id, sizeof(diff_id)) != 1 || strncmp(diff_id, "sha256:", 7) != 0) {
+            fprintf(stderr, "Image config lists fewer layers than the manifest\n");
+            goto out;
+        }
+
+        imported_layer_id(diff_id, image.layers[i].id, sizeof(image.layers[i].id));
+        if (import_layer(layer_digests[i], diff_id, image.layers[i].id) != 0) {
+            goto out;
+        }
+        image.layer_count++;
+
+        snprintf(layer_path, sizeof(layer_path), "%s/%s", LAYER_STORAGE_DIR, image.layers[i].id);
+        total_size += calculate_directory_size(layer_path);
+    }
+
+    if (next_diff_id(&diff_it, diff_id, sizeof(diff_id)) != 0) {
+        fprintf(stderr, "Image config lists more layers than the manifest\n");
+        goto out;
+    }
+
+    fill_image_from_config(&image, &root, config_hex ? config_hex + 1 : config_digest);
+    snprintf(image.name, sizeof(image.name), "%s", name);
+    snprintf(image.tag, sizeof(image.tag), "%s", tag && tag[0] ? tag : "latest");
+    snprintf(image.size, sizeof(image.size), "%lld", total_size);
+
+    if (strchr(image.name, '/') || image.name[0] == '.' || write_image_metadata(&image) != 0) {
+        fprintf(stderr, "Failed to record image %s\n", image.name);
+        goto out;
+    }
+    result = 0;
+
+out:
+    free(image.layers);
+    return result;
+}
+
+// The uncompressed tar stream of a layer: its digest is the layer's diff_id
+int layer_tar_digest(const char *layer_id, char *diff_id, long long *tar_size) {
+    char layer_path[MAX_PATH_LEN];
+    char skip_prefix[MAX_LAYER_ID_LEN + 1];
+    tar_writer_t *writer;
+    sha256_ctx_t hash;
+    int result = -1;
+
+    if (!valid_layer_id(layer_id)) {
+        return -1;
+    }
+    if (read_layer_digest(layer_id, diff_id, tar_size) == 0) {
+        return 0;
+    }
+
+    sha256_init(&hash);
+    if (layer_is_compressed(layer_id)) {
+        if (copy_layer_blob(layer_id, NULL, &hash, tar_size) != 0) {
+            return -1;
+        }
+    } else {
+        if (lazy_complete_layer(layer_id) != 0) {
+            return -1;
+        }
+        snprintf(layer_path, sizeof(layer_path), "%s/%s", LAYER_STORAGE_DIR, layer_id);
+        snprintf(skip_prefix, sizeof(skip_prefix), "%s.", layer_id);
+
+        // A writer without a descriptor only counts and hashes
+        writer = tar_writer_open(-1, 0);
+        if (!writer) {
+            return -1;
+        }
+        writer->hash = &hash;
+        if (tar_write_tree(writer, layer_path, skip_prefix) == 0 && tar_finish(writer) == 0) {
+            *tar_size = writer->offset;
+            result = 0;
+        }
+        tar_writer_close(writer);
+        if (result != 0) {
+            fprintf(stderr, "Failed to scan layer %s\n", layer_id);
+            return -1;
+        }
+    }
+
+    format_diff_id(&hash, diff_id);
+    write_layer_digest(layer_id, diff_id, *tar_size);
+    return 0;
+}
+
+// Writes the uncompressed tar stream of a layer to fd
+int write_layer_tar(const char *layer_id, int fd) {
+    char layer_path[MAX_PATH_LEN];
+    char skip_prefix[MAX_LAYER_ID_LEN + 1];
+    tar_writer_t *writer;
+    long long size;
+    int result;
+
+    if (!valid_layer_id(layer_id)) {
+        return -1;
+    }
+
+    writer = tar_writer_open(fd, 0);
+    if (!writer) {
+        return -1;
+    }
+
+    if (layer_is_compressed(layer_id)) {
+        result = copy_layer_blob(layer_id, writer, NULL, &size);
+    } else if ((result = lazy_complete_layer(layer_id)) == 0) {
+        snprintf(layer_path, sizeof(layer_path), "%s/%s", LAYER_STORAGE_DIR, layer_id);
+        snprintf(skip_prefix, sizeof(skip_prefix), "%s.", layer_id);
+        result = tar_write_tree(writer, layer_path, skip_prefix);
+        if (result == 0) {
+            result = tar_finish(writer);
+        }
+    }
+
+    if (tar_writer_close(writer) != 0) {
+        result = -1;
+    }
+    return result;
+}
+
+int load_image(const char *image_path) {
+    char loaded_ref[MAX_IMAGE_NAME_LEN + MAX_IMAGE_TAG_LEN + 2];
+    int from_stdin = !image_path || strcmp(image_path, "-") == 0;
+    int fd = from_stdin ? STDIN_FILENO : open(image_path, O_RDONLY | O_CLOEXEC);
+
+    if (fd < 0) {
+        perror("open archive");
+        return -1;
+    }
+
+    int result = read_image_archive(fd, NULL, 0, -1, loaded_ref, sizeof(loaded_ref));
+    if (result == 0) {
+        printf("Loaded image: %s\n", loaded_ref);
+    }
+
+    if (!from_stdin) {
+        close(fd);
+    }
+    return result;
+}
+
+// ---------------------------------------------------------------------------
+// Derived layers and images
+// ---------------------------------------------------------------------------
+
+// A layer written from a tar stream made on the spot (a squash, a commit)
+// rather than from a build directory. The stream is hashed on its way into
+// a staging directory and the layer is installed under the id of that
+// hash, so making the same layer twice keeps the first one.
+typedef struct {
+    const char *root;
+    int fd;
+    int result;
+} extract_stream_t;
+
+typedef struct {
+    image_compression_t compression;
+    char staging[MAX_PATH_LEN];
+    const char *staging_name;
+    tar_writer_t *writer;       // what the layer's tar stream goes to
+    chunk_writer_t *chunks;
+    sha256_ctx_t hash;
+    extract_stream_t extract;
+    pthread_t thread;
+    int extracting;
+    int fd;
+} layer_output_t;
+
+static void* extract_layer_stream(void *arg) {
+    extract_stream_t *stream = arg;
+    tar_reader_t *reader = tar_reader_open(stream->fd, NULL, 0, -1);
+
+    stream->result = reader && tar_extract(reader, stream->root) == 0 && tar_drain(reader) == 0 ? 0 : -1;
+    tar_reader_close(reader);
+    close(stream->fd);
+    return NULL;
+}
+
+static void remove_staging(const char *staging) {
+    char rm_cmd[MAX_PATH_LEN + 16];
+
+    snprintf(rm_cmd, sizeof(rm_cmd), "rm -rf %s", staging);
+    if (system(rm_cmd) != 0) {
+        fprintf(stderr, "Failed to remove %s\n", staging);
+    }
+}
+
+static int close_layer_output(layer_output_t *out, int result, const char *command, char *layer_id,
+                              long long *tar_size);
+
+// Opens a layer kept the way compression says: an lz blob or a chunk list
+// written as the stream comes, or a tree unpacked from it by a second
+// thread. The staging directory sits in the layer store as .squash-XXXXXX.
+static int open_layer_output(layer_output_t *out, image_compression_t compression) {
+    char output_path[MAX_PATH_LEN * 2];
+
+    memset(out, 0, sizeof(*out));
+    out->compression = compression;
+    out->fd = -1;
+
+    snprintf(out->staging, sizeof(out->staging), "%s/.squash-XXXXXX", LAYER_STORAGE_DIR);
+    // mkdtemp leaves the directory private; it becomes the layer's root
+    if (!mkdtemp(out->staging) || chmod(out->staging, 0755) != 0) {
+        perror("mkdtemp");
+        return -1;
+    }
+    out->staging_name = strrchr(out->staging, '/') + 1;
+
+    if (compression == IMAGE_COMPRESSION_CHUNKED) {
+        snprintf(output_path, sizeof(output_path), "%s/%s%s", out->staging, out->staging_name, CHUNK_LIST_SUFFIX);
+        if (!(out->chunks = chunk_writer_open(output_path))) {
+            goto fail;
+        }
+    } else if (compression == IMAGE_COMPRESSION_LZ) {
+        snprintf(output_path, sizeof(output_path), "%s/%s%s", out->staging, out->staging_name, LAYER_BLOB_SUFFIX);
+        if ((out->fd = open(output_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)) < 0) {
+            perror("open layer blob");
+            goto fail;
+        }
+    } else {
+        int pipe_fds[2];
+
+        if (pipe2(pipe_fds, O_CLOEXEC) != 0) {
+            perror("pipe");
+            goto fail;
+        }
+        out->extract.root = out->staging;
+        out->extract.fd = pipe_fds[0];
+        if (pthread_create(&out->thread, NULL, extract_layer_stream, &out->extract) != 0) {
+            fprintf(stderr, "Failed to start layer extraction\n");
+            close(pipe_fds[0]);
+            close(pipe_fds[1]);
+            goto fail;
+        }
+        out->extracting = 1;
+        out->fd = pipe_fds[1];
+    }
+
+    out->writer = tar_writer_open(compression == IMAGE_COMPRESSION_CHUNKED ? -1 : out->fd, 0);
+    if (!out->writer || (compression == IMAGE_COMPRESSION_LZ &&
+                         tar_writer_compress(out->writer, lz_default_threads()) != 0)) {
+        goto fail;
+    }
+    sha256_init(&out->hash);
+    out->writer->hash = &out->hash;
+    out->writer->chunks = out->chunks;
+    return 0;
+
+fail:
+    close_layer_output(out, -1, NULL, NULL, NULL);
+    return -1;
+}
+
+// Renames the staging directory to the layer's id. The chunk list keeps
+// its staging name too until the directory is renamed, so a sweep in
+// between always finds one of them.
+static int install_layer_output(layer_output_t *out, const char *layer_id, const char *command,
+                                const char *diff_id, long long tar_size) {
+    const char *suffix = out->compression == IMAGE_COMPRESSION_CHUNKED ? CHUNK_LIST_SUFFIX : LAYER_BLOB_SUFFIX;
+    char layer_path[MAX_PATH_LEN];
+    char from[MAX_PATH_LEN * 2];
+    char to[MAX_PATH_LEN * 2];
+    int installed = 0;
+
+    snprintf(layer_path, sizeof(layer_path), "%s/%s", LAYER_STORAGE_DIR, layer_id);
+    if (access(layer_path, F_OK) != 0) {
+        snprintf(from, sizeof(from), "%s/%s%s", out->staging, out->staging_name, suffix);
+        snprintf(to, sizeof(to), "%s/%s%s", out->staging, layer_id, suffix);
+
+        if (out->compression != IMAGE_COMPRESSION_NONE && link(from, to) != 0) {
+            perror("link layer");
+            remove_staging(out->staging);
+            return -1;
+        }
+        if (rename(out->staging, layer_path) == 0) {
+            installed = 1;
+            snprintf(from, sizeof(from), "%s/%s%s", layer_path, out->staging_name, suffix);
+            if (out->compression != IMAGE_COMPRESSION_NONE) {
+                unlink(from);
+            }
+        } else if (access(layer_path, F_OK) != 0) {
+            perror("rename layer");
+            remove_staging(out->staging);
+            return -1;
+        }
+    }
+    if (!installed) {
+        remove_staging(out->staging);
+    }
+
+    if (create_layer_with_id(layer_id, NULL, command, NULL, IMAGE_COMPRESSION_NONE) != 0) {
+        return -1;
+    }
+    // An expanded layer is saved from its tree, whose tar stream is not the
+    // one hashed here; its diff_id is worked out from the tree when needed
+    if (out->compression != IMAGE_COMPRESSION_NONE) {
+        write_layer_digest(layer_id, diff_id, tar_size);
+    }
+    return 0;
+}
+
+// Ends the stream and, when result is 0, installs the layer and returns its
+// id. Anything else throws the staging directory away.
+static int close_layer_output(layer_output_t *out, int result, const char *command, char *layer_id,
+                              long long *tar_size) {
+    char diff_id[MAX_DIGEST_LEN];
+    long long size = 0;
+
+    if (out->writer) {
+        if (result == 0) {
+            result = tar_finish(out->writer);
+        }
+        size = out->writer->offset;
+        out->writer->hash = NULL;
+
+        // Closing flushes the last of the stream into the file, pipe or chunk writer
+        if (tar_writer_close(out->writer) != 0) {
+            result = -1;
+        }
+    }
+    if (out->chunks && chunk_writer_close(out->chunks, result == 0, NULL) != 0) {
+        result = -1;
+    }
+    if (out->fd >= 0 && close(out->fd) != 0) {
+        result = -1;
+    }
+    if (out->extracting) {
+        pthread_join(out->thread, NULL);
+        if (out->extract.result != 0) {
+            result = -1;
+        }
+    }
+
+    if (result != 0 || !layer_id) {
+        remove_staging(out->staging);
+        return -1;
+    }
+
+    format_diff_id(&out->hash, diff_id);
+    imported_layer_id(diff_id, layer_id, MAX_LAYER_ID_LEN);
+    if (tar_size) {
+        *tar_size = size;
+    }
+    return install_layer_output(out, layer_id, command, diff_id, size);
+}
+
+// Splits name[:tag]; a colon before the last slash belongs to a registry host
+static void split_image_ref(const char *ref, image_info_t *image) {
+    const char *colon = strrchr(ref, ':');
+    const char *slash = strrchr(ref, '/');
+
+    if (colon && (!slash || colon > slash)) {
+        snprintf(image->name, sizeof(image->name), "%.*s", (int)(colon - ref), ref);
+        snprintf(image->tag, sizeof(image->tag), "%s", colon + 1);
+    } else {
+        snprintf(image->name, sizeof(image->name), "%s", ref);
+        snprintf(image->tag, sizeof(image->tag), "latest");
+    }
+}
+
+// Records an image made from parent_id's config and a new layer list, and
+// tags it target_ref. Content-addressed like a pulled image: the id is the
+// digest of its config, which lists the layers' diff_ids.
+static int record_derived_image(image_info_t *image, const char *parent_id, const char *target_ref) {
+    char (*diff_ids)[MAX_DIGEST_LEN] = calloc(image->layer_count, sizeof(*diff_ids));
+    char hex[SHA256_HEX_LEN + 1];
+    long long total_size = 0;
+    size_t config_len;
+    char *config;
+
+    if (!diff_ids) {
+        perror("calloc");
+        return -1;
+    }
+    for (int i = 0; i < image->layer_count; i++) {
+        char layer_path[MAX_PATH_LEN];
+        long long tar_size;
+
+        if (layer_tar_digest(image->layers[i].id, diff_ids[i], &tar_size) != 0) {
+            free(diff_ids);
+            return -1;
+        }
+        snprintf(layer_path, sizeof(layer_path), "%s/%s", LAYER_STORAGE_DIR, image->layers[i].id);
+        total_size += calculate_directory_size(layer_path);
+    }
+
+    snprintf(image->parent_id, sizeof(image->parent_id), "%s", parent_id);
+    snprintf(image->created, sizeof(image->created), "%ld", time(NULL));
+    snprintf(image->size, sizeof(image->size), "%lld", total_size);
+    image->id[0] = '\0';
+    config = build_image_config(image, diff_ids, &config_len);
+    free(diff_ids);
+    if (!config) {
+        return -1;
+    }
+    sha256_hex(config, config_len, hex);
+    free(config);
+    snprintf(image->id, sizeof(image->id), "sha256:%.12s", hex);
+
+    split_image_ref(target_ref, image);
+    return write_image_metadata(image);
+}
+
+// Puts a new layer on top of an image: diff_root, usually a container's
+// upper directory, is tarred through filter straight into the layer store.
+// Only what is under diff_root is read, so the cost is the size of the
+// changes whatever the size of the image. The result is tagged target_ref.
+int commit_image(const char *image_ref, const char *diff_root, tar_tree_filter_t filter, void *filter_ctx,
+                 const char *target_ref, const char *comment, commit_stats_t *stats) {
+    char full_name[MAX_IMAGE_NAME_LEN + MAX_IMAGE_TAG_LEN + 2];
+    layer_output_t output;
+    image_info_t image, committed;
+    int result = -1;
+
+    memset(stats, 0, sizeof(*stats));
+    memset(&committed, 0, sizeof(committed));
+    if (resolve_image_name(image_ref, full_name, sizeof(full_name)) != 0 ||
+        read_image_metadata(full_name, &image) != 0) {
+        fprintf(stderr, "No such image: %s\n", image_ref);
+        return -1;
+    }
+
+    if (open_layer_output(&output, image.compression) == 0) {
+        result = tar_write_tree_filtered(output.writer, diff_root, filter, filter_ctx);
+        result = close_layer_output(&output, result, "commit", stats->layer_id, &stats->tar_size);
+    }
+    if (result != 0) {
+        fprintf(stderr, "Failed to write a layer from %s\n", diff_root);
+        goto out;
+    }
+    result = -1;
+
+    committed = image;
+    committed.layer_count = image.layer_count + 1;
+    committed.layers = calloc(committed.layer_count, sizeof(layer_info_t));
+    if (!committed.layers) {
+        perror("calloc");
+        goto out;
+    }
+    memcpy(committed.layers, image.layers, image.layer_count * sizeof(layer_info_t));
+    snprintf(committed.layers[image.layer_count].id, sizeof(committed.layers[0].id), "%s", stats->layer_id);
+    if (comment) {
+        snprintf(committed.comment, sizeof(committed.comment), "%s", comment);
+    }
+
+    if (record_derived_image(&committed, image.id, target_ref) != 0) {
+        goto out;
+    }
+    snprintf(stats->image_id, sizeof(stats->image_id), "%s", committed.id);
+    result = 0;
+
+out:
+    free(committed.layers);
+    free(image.layers);
+    return result;
+}
+
+// ---------------------------------------------------------------------------
+// Squash
+// ---------------------------------------------------------------------------
+
+// What the layers above the one being merged left at a path
+#define SQUASH_PRESENT 0x01         // an entry: the same path below is shadowed
+#define SQUASH_COVERS 0x02          // a whiteout, non-directory or opaque marker: nothing under it shows
+#define SQUASH_EMITTED 0x04         // written to the squashed layer
+#define SQUASH_OPAQUE_WRITTEN 0x08  // its opaque marker was written
+
+#define SQUASH_WHITEOUT_PREFIX ".wh."
+
+typedef struct {
+    char **paths;
+    unsigned char *flags;
+    size_t count;
+    size_t capacity;            // a power of two, at least twice count
+} path_set_t;
+
+typedef struct {
+    tar_writer_t *writer;
+    path_set_t upper;           // everything the layers merged so far hold
+    path_set_t current;         // the layer being merged, folded into upper after it
+    int keep_whiteouts;         // layers below the range still need hiding
+    long long depth_sum;        // lookup depth, before the squash, of every entry written
+    char *buffer;
+    squash_stats_t *stats;
+} squash_t;
+
+typedef struct {
+    const char *layer_id;
+    int fd;
+    int result;
+} layer_stream_t;
+
+static unsigned long long hash_path(const char *path) {
+    unsigned long long hash = 1469598103934665603ULL;
+
+    while (*path) {
+        hash ^= (unsigned char)*path++;
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+static unsigned char* path_set_lookup(path_set_t *set, const char *path, int create) {
+    size_t slot;
+
+    if (create && (set->count + 1) * 2 > set->capacity) {
+        size_t capacity = set->capacity ? set->capacity * 2 : 1024;
+        char **paths = calloc(capacity, sizeof(char *));
+        unsigned char *flags = calloc(capacity, 1);
+
+        if (!paths || !flags) {
+            perror("calloc");
+            free(paths);
+            free(flags);
+            return NULL;
+        }
+        for (size_t i = 0; i < set->capacity; i++) {
+            if (!set->paths[i]) continue;
+            slot = hash_path(set->paths[i]) & (capacity - 1);
+            while (paths[slot]) {
+                slot = (slot + 1) & (capacity - 1);
+            }
+            paths[slot] = set->paths[i];
+            flags[slot] = set->flags[i];
+        }
+        free(set->paths);
+        free(set->flags);
+        set->paths = paths;
+        set->flags = flags;
+        set->capacity = capacity;
+    }
+    if (set->capacity == 0) {
+        return NULL;
+    }
+
+    slot = hash_path(path) & (set->capacity - 1);
+    while (set->paths[slot]) {
+        if (strcmp(set->paths[slot], path) == 0) {
+            return &set->flags[slot];
+        }
+        slot = (slot + 1) & (set->capacity - 1);
+    }
+    if (!create || !(set->paths[slot] = strdup(path))) {
+        return NULL;
+    }
+    set->flags[slot] = 0;
+    set->count++;
+    return &set->flags[slot];
+}
+
+static unsigned char path_set_flags(path_set_t *set, const char *path) {
+    unsigned char *flags = path_set_lookup(set, path, 0);
+    return flags ? *flags : 0;
+}
+
+static int path_set_mark(path_set_t *set, const char *path, unsigned char flags) {
+    unsigned char *slot = path_set_lookup(set, path, 1);
+
+    if (!slot) {
+        return -1;
+    }
+    *slot |= flags;
+    return 0;
+}
+
+static void path_set_clear(path_set_t *set) {
+    for (size_t i = 0; i < set->capacity; i++) {
+        free(set->paths[i]);
+        set->paths[i] = NULL;
+        set->flags[i] = 0;
+    }
+    set->count = 0;
+}
+
+static void path_set_free(path_set_t *set) {
+    path_set_clear(set);
+    free(set->paths);
+    free(set->flags);
+    memset(set, 0, sizeof(*set));
+}
+
+// Moves src into dst, keeping both sets of flags where a path is in both
+static int path_set_merge(path_set_t *dst, path_set_t *src) {
+    for (size_t i = 0; i < src->capacity; i++) {
+        if (src->paths[i] && path_set_mark(dst, src->paths[i], src->flags[i]) != 0) {
+            return -1;
+        }
+    }
+    path_set_clear(src);
+    return 0;
+}
+
+// Whether a whiteout, opaque marker or non-directory above hides what
+// lower layers have at path: the root ("") and every parent are checked
+static int path_covered(path_set_t *set, const char *path) {
+    char parent[PATH_MAX];
+    size_t len = strlen(path);
+
+    if (len >= sizeof(parent)) {
+        return 0;
+    }
+    if (path[0] && (path_set_flags(set, "") & SQUASH_COVERS)) {
+        return 1;
+    }
+    memcpy(parent, path, len + 1);
+    for (char *slash = strchr(parent, '/'); slash; slash = strchr(slash + 1, '/')) {
+        *slash = '\0';
+        int covered = path_set_flags(set, parent) & SQUASH_COVERS;
+        *slash = '/';
+        if (covered) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Regular entries carry their data; everything else is just the header
+static int copy_entry(squash_t *squash, tar_reader_t *reader, const tar_entry_t *entry) {
+    long long remaining = entry->type == '0' || entry->type == '7' ? entry->size : 0;
+
+    if (tar_write_entry(squash->writer, entry) != 0) {
+        return -1;
+    }
+    while (remaining > 0) {
+        size_t want = remaining < TAR_BUFFER_SIZE ? (size_t)remaining : TAR_BUFFER_SIZE;
+        ssize_t n = tar_read_data(reader, squash->buffer, want);
+
+        if (n <= 0 || tar_write_data(squash->writer, squash->buffer, n) != 0) {
+            return -1;
+        }
+        remaining -= n;
+    }
+    return tar_pad(squash->writer);
+}
+
+// Overlay's own form of a whiteout, which the runtime honors when the
+// layer is mounted or unpacked. Entries made up here take the time of the
+// entry they stand for, so the same squash always hashes the same.
+static int write_whiteout(squash_t *squash, const char *path, time_t mtime) {
+    tar_entry_t entry;
+
+    memset(&entry, 0, sizeof(entry));
+    snprintf(entry.name, sizeof(entry.name), "%s", path);
+    entry.type = '3';
+    entry.mtime = mtime;
+    return tar_write_entry(squash->writer, &entry);
+}
+
+// Overlay keeps a directory's opacity in an xattr that a tar stream here
+// cannot carry, so opaque directories keep the OCI marker
+static int write_opaque_marker(squash_t *squash, const char *dir, time_t mtime) {
+    tar_entry_t entry;
+    unsigned char flags = path_set_flags(&squash->upper, dir) | path_set_flags(&squash->current, dir);
+
+    if (flags & SQUASH_OPAQUE_WRITTEN) {
+        return 0;
+    }
+    memset(&entry, 0, sizeof(entry));
+    snprintf(entry.name, sizeof(entry.name), "%s%s%s", dir, dir[0] ? "/" : "", TAR_OPAQUE_MARKER);
+    entry.type = '0';
+    entry.mode = 0644;
+    entry.mtime = mtime;
+    if (tar_write_entry(squash->writer, &entry) != 0) {
+        return -1;
+    }
+    squash->stats->entries_written++;
+    return path_set_mark(&squash->current, dir, SQUASH_OPAQUE_WRITTEN);
+}
+
+// Streams one layer's entries into the squashed layer, skipping whatever
+// the layers above it shadow or white out. Layers go top-down, so the
+// first entry seen for a path is the one that shows.
+static int merge_layer(squash_t *squash, tar_reader_t *reader, int depth) {
+    char path[PATH_MAX];
+    char target[PATH_MAX];
+    tar_entry_t entry;
+    int rc;
+
+    while ((rc = tar_next(reader, &entry)) == 1) {
+        enum { SQUASH_ENTRY, SQUASH_WHITEOUT, SQUASH_OPAQUE } kind = SQUASH_ENTRY;
+        const char *base;
+        unsigned char above;
+        int sanitized = tar_entry_path(entry.name, path, sizeof(path));
+
+        if (sanitized == 1) {
+            continue;
+        }
+        if (sanitized != 0) {
+            fprintf(stderr, "Layer entry %s leaves the layer root\n", entry.name);
+            return -1;
+        }
+
+        base = strrchr(path, '/');
+        base = base ? base + 1 : path;
+        if (strcmp(base, TAR_OPAQUE_MARKER) == 0) {
+            kind = SQUASH_OPAQUE;
+            snprintf(target, sizeof(target), "%.*s", base > path ? (int)(base - path - 1) : 0, path);
+        } else if (strncmp(base, SQUASH_WHITEOUT_PREFIX, strlen(SQUASH_WHITEOUT_PREFIX)) == 0) {
+            kind = SQUASH_WHITEOUT;
+            snprintf(target, sizeof(target), "%.*s%s", (int)(base - path), path, base + strlen(SQUASH_WHITEOUT_PREFIX));
+        } else {
+            if (entry.type == '3' && entry.devmajor == 0 && entry.devminor == 0) {
+                kind = SQUASH_WHITEOUT;
+            }
+            memcpy(target, path, strlen(path) + 1);
+        }
+
+        above = path_set_flags(&squash->upper, target);
+        if (path_covered(&squash->upper, target) || (kind == SQUASH_OPAQUE && (above & SQUASH_COVERS))) {
+            squash->stats->entries_dropped++;
+            continue;
+        }
+
+        // What this entry means for the layers below it holds even when
+        // an entry above shadows the entry itself
+        if (kind == SQUASH_OPAQUE) {
+            rc = path_set_mark(&squash->current, target, SQUASH_COVERS);
+        } else {
+            rc = path_set_mark(&squash->current, target,
+                               SQUASH_PRESENT | (kind == SQUASH_ENTRY && entry.type == '5' ? 0 : SQUASH_COVERS));
+        }
+        if (rc != 0) {
+            return -1;
+        }
+
+        if (kind != SQUASH_OPAQUE && (above & SQUASH_PRESENT)) {
+            squash->stats->entries_dropped++;
+            // A directory above a whiteout or file must now hide the
+            // layers under the range by itself
+            if (squash->keep_whiteouts && !(above & SQUASH_COVERS) &&
+                (kind == SQUASH_WHITEOUT || entry.type != '5') && write_opaque_marker(squash, target, entry.mtime) != 0) {
+                return -1;
+            }
+            continue;
+        }
+
+        if (kind == SQUASH_OPAQUE) {
+            if (!squash->keep_whiteouts) {
+                squash->stats->entries_dropped++;
+            } else if (write_opaque_marker(squash, target, entry.mtime) != 0) {
+                return -1;
+            }
+            continue;
+        }
+        if (kind == SQUASH_WHITEOUT) {
+            if (!squash->keep_whiteouts) {
+                squash->stats->entries_dropped++;
+            } else if (write_whiteout(squash, target, entry.mtime) != 0) {
+                return -1;
+            } else {
+                squash->stats->entries_written++;
+            }
+            continue;
+        }
+
+        if (entry.type == '1') {
+            char link_target[PATH_MAX];
+
+            if (tar_entry_path(entry.linkname, link_target, sizeof(link_target)) != 0 ||
+                !(path_set_flags(&squash->current, link_target) & SQUASH_EMITTED)) {
+                fprintf(stderr, "Hard link %s points at %s, which a layer above replaces\n", path, entry.linkname);
+                return -1;
+            }
+            memcpy(entry.linkname, link_target, strlen(link_target) + 1);
+        }
+
+        snprintf(entry.name, sizeof(entry.name), "%s%s", path, entry.type == '5' ? "/" : "");
+        if (copy_entry(squash, reader, &entry) != 0 ||
+            path_set_mark(&squash->current, path, SQUASH_EMITTED) != 0) {
+            return -1;
+        }
+        squash->stats->entries_written++;
+        squash->depth_sum += depth;
+    }
+    if (rc != 0) {
+        return -1;
+    }
+
+    return path_set_merge(&squash->upper, &squash->current);
+}
+
+static void* stream_layer_tar(void *arg) {
+    layer_stream_t *stream = arg;
+
+    stream->result = write_layer_tar(stream->layer_id, stream->fd);
+    close(stream->fd);
+    return NULL;
+}
+
+// Merges one layer into the squash. Compressed and chunked layers are read
+// in place; an expanded tree is tarred by a second thread through a pipe.
+static int squash_layer(squash_t *squash, const char *layer_id, int depth) {
+    layer_stream_t stream = { layer_id, -1, -1 };
+    tar_reader_t *reader;
+    pthread_t thread;
+    int pipe_fds[2];
+    int result;
+    int fd;
+
+    gc_lease_layer(layer_id);
+    if (!valid_layer_id(layer_id) || lazy_complete_layer(layer_id) != 0) {
+        fprintf(stderr, "Layer %s is not available\n", layer_id);
+        return -1;
+    }
+
+    if (layer_is_compressed(layer_id)) {
+        if (!(reader = open_layer_blob(layer_id, &fd))) {
+            return -1;
+        }
+        result = merge_layer(squash, reader, depth);
+        tar_reader_close(reader);
+        if (fd >= 0) {
+            close(fd);
+        }
+        return result;
+    }
+
+    if (pipe2(pipe_fds, O_CLOEXEC) != 0) {
+        perror("pipe");
+        return -1;
+    }
+    stream.fd = pipe_fds[1];
+    if (pthread_create(&thread, NULL, stream_layer_tar, &stream) != 0) {
+        fprintf(stderr, "Failed to start layer stream\n");
+        close(pipe_fds[0]);
+        close(pipe_fds[1]);
+        return -1;
+    }
+
+    reader = tar_reader_open(pipe_fds[0], NULL, 0, -1);
+    result = reader ? merge_layer(squash, reader, depth) : -1;
+    if (result == 0 && tar_drain(reader) != 0) {
+        result = -1;
+    }
+    tar_reader_close(reader);
+
+    // Closing the read end first stops a writer we gave up on
+    close(pipe_fds[0]);
+    pthread_join(thread, NULL);
+    return result == 0 && stream.result == 0 ? 0 : -1;
+}
+
+// Writes the merged stream of layers to..from (top-down) into a new layer,
+// kept the way the image keeps its layers
+static int write_squashed_layer(image_info_t *image, int from, int to, squash_stats_t *stats, char *layer_id) {
+    layer_output_t output;
+    squash_t squash;
+    int result = -1;
+
+    memset(&squash, 0, sizeof(squash));
+    squash.stats = stats;
+    squash.keep_whiteouts = from > 0;
+    squash.buffer = malloc(TAR_BUFFER_SIZE);
+    if (!squash.buffer) {
+        perror("malloc");
+        return -1;
+    }
+
+    if (open_layer_output(&output, image->compression) == 0) {
+        squash.writer = output.writer;
+        result = 0;
+        for (int i = to; i >= from && result == 0; i--) {
+            result = squash_layer(&squash, image->layers[i].id, image->layer_count - i);
+        }
+        result = close_layer_output(&output, result, "squash", layer_id, &stats->tar_size);
+    }
+    if (result == 0 && stats->entries_written > 0) {
+        stats->depth_before = (double)squash.depth_sum / stats->entries_written;
+    }
+    if (result != 0) {
+        fprintf(stderr, "Failed to squash layers of %s\n", image->id);
+    }
+
+    path_set_free(&squash.upper);
+    path_set_free(&squash.current);
+    free(squash.buffer);
+    return result;
+}
+
+// Replaces layers from..to (0 is the bottom, -1 for either end) of an
+// image with one layer holding what a container would see through them.
+// The layers are merged as one stream, top-down, without unpacking any;
+// the result is tagged target_ref, or the source's own name:tag.
+int squash_image(const char *image_ref, int from, int to, const char *target_ref, squash_stats_t *stats) {
+    char full_name[MAX_IMAGE_NAME_LEN + MAX_IMAGE_TAG_LEN + 2];
+    char squashed_id[MAX_LAYER_ID_LEN];
+    image_info_t image, squashed;
+    int result = -1;
+
+    memset(stats, 0, sizeof(*stats));
+    memset(&squashed, 0, sizeof(squashed));
+    if (resolve_image_name(image_ref, full_name, sizeof(full_name)) != 0 ||
+        read_image_metadata(full_name, &image) != 0) {
+        fprintf(stderr, "No such image: %s\n", image_ref);
+        return -1;
+    }
+
+    from = from < 0 ? 0 : from;
+    to = to < 0 ? image.layer_count - 1 : to;
+    if (to >= image.layer_count || from >= to) {
+        fprintf(stderr, "Image %s has %d layers: nothing to squash in %d..%d\n",
+                full_name, image.layer_count, from, to);
+        goto out;
+    }
+    stats->layers_before = image.layer_count;
+
+    if (write_squashed_layer(&image, from, to, stats, squashed_id) != 0) {
+        goto out;
+    }
+
+    squashed = image;
+    squashed.layer_count = image.layer_count - (to - from);
+    squashed.layers = calloc(squashed.layer_count, sizeof(layer_info_t));
+    if (!squashed.layers) {
+        perror("calloc");
+        goto out;
+    }
+    for (int i = 0, j = 0; i < image.layer_count; i++) {
+        if (i > from && i <= to) {
+            continue;
+        }
+        snprintf(squashed.layers[j].id, sizeof(squashed.layers[j].id), "%s",
+                 i == from ? squashed_id : image.layers[i].id);
+        j++;
+    }
+
+    if (record_derived_image(&squashed, image.id, target_ref && target_ref[0] ? target_ref : full_name) != 0) {
+        goto out;
+    }
+
+    stats->layers_after = squashed.layer_count;
+    stats->depth_after = image.layer_count - to;
+    snprintf(stats->image_id, sizeof(stats->image_id), "%s", squashed.id);
+    snprintf(stats->layer_id, sizeof(stats->layer_id), "%s", squashed_id);
+    result = 0;
+
+out:
+    free(squashed.layers);
+    free(image.layers);
+    return result;
+}
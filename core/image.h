@@ -12,20 +12,34 @@
 #include <dirent.h>
 #include <errno.h>
 
+#include "tar.h"
+
 #define MAX_IMAGE_NAME_LEN 256
 #define MAX_IMAGE_TAG_LEN 64
-#define MAX_IMAGE_ID_LEN 64
-#define MAX_LAYER_ID_LEN 64
+#define MAX_IMAGE_ID_LEN 72
+#define MAX_LAYER_ID_LEN 72
 #define MAX_PATH_LEN 512
 #define MAX_COMMAND_LEN 1024
 #define MAX_ENV_VAR_LEN 512
 #define MAX_WORKDIR_LEN 256
 #define MAX_EXPOSE_LEN 64
 #define MAX_VOLUME_LEN 256
+#define MAX_DIGEST_LEN 72
 
 #define IMAGE_STORAGE_DIR "/tmp/docker-images"
 #define LAYER_STORAGE_DIR "/tmp/docker-layers"
 #define METADATA_DIR "/tmp/docker-metadata"
+#define BLOB_STORAGE_DIR "/tmp/docker-blobs"
+
+// Compressed layers keep a single tarball in their directory instead of
+// the expanded tree; chunked ones keep a list of chunks (see chunk.h)
+#define LAYER_BLOB_SUFFIX ".tar.lz"
+
+typedef enum {
+    IMAGE_COMPRESSION_NONE,
+    IMAGE_COMPRESSION_LZ,
+    IMAGE_COMPRESSION_CHUNKED
+} image_compression_t;
 
 typedef struct {
     char id[MAX_LAYER_ID_LEN];
@@ -52,6 +66,7 @@ typedef struct {
     char env_vars[MAX_ENV_VAR_LEN];
     char exposed_ports[MAX_EXPOSE_LEN];
     char volumes[MAX_VOLUME_LEN];
+    image_compression_t compression;    // how layers are kept at rest
     layer_info_t *layers;
     int layer_count;
 } image_info_t;
@@ -62,28 +77,74 @@ typedef struct {
     int capacity;
 } image_list_t;
 
+// What a squash merged, and how many layers a lookup walks through before
+// and after: every layer for a path no layer has, and for the paths in the
+// squashed layer their average depth in the stack (1 is the top)
+typedef struct {
+    int layers_before;
+    int layers_after;
+    long long entries_written;
+    long long entries_dropped;  // shadowed, whited out, or whiteouts with nothing left to hide
+    long long tar_size;
+    double depth_before;
+    double depth_after;
+    char image_id[MAX_IMAGE_ID_LEN];
+    char layer_id[MAX_LAYER_ID_LEN];
+} squash_stats_t;
+
+typedef struct {
+    long long tar_size;         // of the new layer
+    char image_id[MAX_IMAGE_ID_LEN];
+    char layer_id[MAX_LAYER_ID_LEN];
+} commit_stats_t;
+
 // Function declarations
 int init_image_system();
-int create_image(const char *name, const char *tag, const char *dockerfile_path, const char *context_path);
+int create_image(const char *name, const char *tag, const char *dockerfile_path, const char *context_path,
+                 image_compression_t compression);
 int load_image(const char *image_path);
-int save_image(const char *image_id, const char *output_path);
-int remove_image(const char *image_id);
+int save_image(const char *image_id, const char *output_path, image_compression_t compression);
+int remove_image(const char *image_ref);
 int tag_image(const char *image_id, const char *name, const char *tag);
+int commit_image(const char *image_ref, const char *diff_root, tar_tree_filter_t filter, void *filter_ctx,
+                 const char *target_ref, const char *comment, commit_stats_t *stats);
+int squash_image(const char *image_ref, int from, int to, const char *target_ref, squash_stats_t *stats);
 image_list_t* list_images();
 image_info_t* get_image_info(const char *image_id);
 int image_exists(const char *name, const char *tag);
-char* generate_image_id();
-char* generate_layer_id();
-int create_layer(const char *parent_id, const char *command, const char *diff_path);
+void generate_image_id(char *out, size_t size);
+void generate_layer_id(char *out, size_t size);
+int create_layer(const char *parent_id, const char *command, const char *diff_path,
+                 image_compression_t compression);
 int extract_layer(const char *layer_id, const char *target_path);
+int write_image_archive(const char *image_ref, int fd, int chunked, image_compression_t compression);
+int read_image_archive(int fd, const void *prefix, size_t prefix_len, long long limit,
+                       char *loaded_ref, size_t ref_size);
+int resolve_image_name(const char *image_ref, char *full_name, size_t size);
+int import_image(const char *name, const char *tag, const char *config, const char *config_digest,
+                 char (*layer_digests)[MAX_DIGEST_LEN], int layer_count);
+int blob_storage_path(const char *digest, char *path, size_t size);
+int layer_tar_digest(const char *layer_id, char *diff_id, long long *tar_size);
+int write_layer_tar(const char *layer_id, int fd);
+int record_layer(const char *layer_id, const char *diff_id, long long tar_size);
+void imported_layer_id(const char *diff_id, char *layer_id, size_t size);
+char* build_image_config(image_info_t *image, char (*diff_ids)[MAX_DIGEST_LEN], size_t *len);
 int cleanup_image_system();
 
 // Helper functions
 char* get_image_full_name(const char *name, const char *tag);
 int write_image_metadata(image_info_t *image);
-int read_image_metadata(const char *image_id, image_info_t *image);
+int read_image_metadata(const char *full_name, image_info_t *image);
+int parse_image_metadata(const char *metadata_path, image_info_t *image);
+int adopt_image_metadata(const char *full_name);
+void enter_build_worker(int report_fd);
+void free_image_info(image_info_t *image);
+void free_image_list(image_list_t *list);
+const char* image_compression_name(image_compression_t compression);
+int parse_image_compression(const char *name, image_compression_t *compression);
 int create_directory_structure();
 int calculate_directory_size(const char *path);
+int layer_is_compressed(const char *layer_id);
 
 #endif // IMAGE_H
 
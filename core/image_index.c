@@ -0,0 +1,540 @@
+#include "image_index.h"
+#include "events.h"
+#include <ctype.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define IMAGE_INDEX_HEADER "image-index 1"
+
+typedef struct {
+    char full_name[MAX_IMAGE_NAME_LEN + MAX_IMAGE_TAG_LEN + 2];
+    image_info_t image;
+} index_record_t;
+
+// The string fields of a record, in the order an index line has them
+#define INDEX_FIELD(field) { offsetof(image_info_t, field), sizeof(((image_info_t *)0)->field) }
+
+static const struct {
+    size_t offset;
+    size_t size;
+} index_fields[] = {
+    INDEX_FIELD(id), INDEX_FIELD(name), INDEX_FIELD(tag), INDEX_FIELD(parent_id),
+    INDEX_FIELD(created), INDEX_FIELD(size), INDEX_FIELD(architecture), INDEX_FIELD(os),
+    INDEX_FIELD(author), INDEX_FIELD(comment), INDEX_FIELD(command), INDEX_FIELD(working_dir),
+    INDEX_FIELD(env_vars), INDEX_FIELD(exposed_ports), INDEX_FIELD(volumes)
+};
+#define INDEX_FIELD_COUNT ((int)(sizeof(index_fields) / sizeof(index_fields[0])))
+
+static pthread_rwlock_t index_lock = PTHREAD_RWLOCK_INITIALIZER;
+static index_record_t *records = NULL;
+static int record_count = 0, record_capacity = 0;
+
+// Open-addressed slots holding record numbers, -1 when free: one table by
+// name:tag, one by id (tags of the same image share an id, so a probe
+// takes the first). by_hex lists the records sorted by the hex of the id,
+// by_name sorted by name:tag, the order listings page through.
+static int *name_slots = NULL, *id_slots = NULL;
+static int slot_count = 0;
+static int *by_hex = NULL, *by_name = NULL;
+
+// Build workers are forked with a copy of the index; only the daemon
+// writes it out
+static pid_t index_owner = 0;
+
+static uint64_t hash_key(const char *key) {
+    uint64_t h = 1469598103934665603ULL;
+
+    while (*key) {
+        h ^= (unsigned char)*key++;
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+static const char* id_hex(const char *id) {
+    return strncmp(id, "sha256:", 7) == 0 ? id + 7 : id;
+}
+
+static int compare_hex(const void *a, const void *b) {
+    return strcmp(id_hex(records[*(const int *)a].image.id), id_hex(records[*(const int *)b].image.id));
+}
+
+static int compare_name(const void *a, const void *b) {
+    return strcmp(records[*(const int *)a].full_name, records[*(const int *)b].full_name);
+}
+
+static void insert_slot(int *slots, const char *key, int record) {
+    uint64_t h = hash_key(key) & (slot_count - 1);
+
+    while (slots[h] != -1) {
+        h = (h + 1) & (slot_count - 1);
+    }
+    slots[h] = record;
+}
+
+// Rebuilt whole after every change, which only builds, pulls, loads and
+// removals make; lookups are what has to be fast
+static int reindex(void) {
+    int count = 16;
+
+    while (count < record_count * 2) {
+        count *= 2;
+    }
+
+    int *names = malloc(sizeof(int) * count);
+    int *ids = malloc(sizeof(int) * count);
+    int *sorted = malloc(sizeof(int) * (record_count ? record_count : 1));
+    int *named = malloc(sizeof(int) * (record_count ? record_count : 1));
+    if (!names || !ids || !sorted || !named) {
+        perror("malloc");
+        free(names);
+        free(ids);
+        free(sorted);
+        free(named);
+        return -1;
+    }
+
+    free(name_slots);
+    free(id_slots);
+    free(by_hex);
+    free(by_name);
+    name_slots = names;
+    id_slots = ids;
+    by_hex = sorted;
+    by_name = named;
+    slot_count = count;
+
+    for (int i = 0; i < slot_count; i++) {
+        name_slots[i] = -1;
+        id_slots[i] = -1;
+    }
+    for (int i = 0; i < record_count; i++) {
+        insert_slot(name_slots, records[i].full_name, i);
+        insert_slot(id_slots, records[i].image.id, i);
+        by_hex[i] = i;
+        by_name[i] = i;
+    }
+    qsort(by_hex, record_count, sizeof(int), compare_hex);
+    qsort(by_name, record_count, sizeof(int), compare_name);
+    return 0;
+}
+
+static index_record_t* find_name(const char *full_name) {
+    if (slot_count == 0) {
+        return NULL;
+    }
+
+    for (uint64_t h = hash_key(full_name) & (slot_count - 1); name_slots[h] != -1; h = (h + 1) & (slot_count - 1)) {
+        if (strcmp(records[name_slots[h]].full_name, full_name) == 0) {
+            return &records[name_slots[h]];
+        }
+    }
+    return NULL;
+}
+
+static index_record_t* find_id(const char *id) {
+    if (slot_count == 0) {
+        return NULL;
+    }
+
+    for (uint64_t h = hash_key(id) & (slot_count - 1); id_slots[h] != -1; h = (h + 1) & (slot_count - 1)) {
+        if (strcmp(records[id_slots[h]].image.id, id) == 0) {
+            return &records[id_slots[h]];
+        }
+    }
+    return NULL;
+}
+
+// The one image whose id starts with hex; tags of that image all match
+static index_record_t* find_prefix(const char *hex, int *ambiguous) {
+    size_t len = strlen(hex);
+    int low = 0, high = record_count;
+
+    *ambiguous = 0;
+    for (size_t i = 0; i < len; i++) {
+        if (!isxdigit((unsigned char)hex[i])) {
+            return NULL;
+        }
+    }
+
+    while (low < high) {
+        int mid = low + (high - low) / 2;
+        if (strcmp(id_hex(records[by_hex[mid]].image.id), hex) < 0) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    if (len == 0 || low == record_count || strncmp(id_hex(records[by_hex[low]].image.id), hex, len) != 0) {
+        return NULL;
+    }
+
+    index_record_t *found = &records[by_hex[low]];
+    for (int i = low + 1; i < record_count && strncmp(id_hex(records[by_hex[i]].image.id), hex, len) == 0; i++) {
+        if (strcmp(records[by_hex[i]].image.id, found->image.id) != 0) {
+            *ambiguous = 1;
+            return NULL;
+        }
+    }
+    return found;
+}
+
+static int copy_image(image_info_t *dst, const image_info_t *src) {
+    *dst = *src;
+    dst->layers = NULL;
+    if (src->layer_count > 0) {
+        dst->layers = malloc(sizeof(layer_info_t) * src->layer_count);
+        if (!dst->layers) {
+            perror("malloc");
+            return -1;
+        }
+        memcpy(dst->layers, src->layers, sizeof(layer_info_t) * src->layer_count);
+    }
+    return 0;
+}
+
+// ---------------------------------------------------------------------------
+// Index file
+
+static void write_field(FILE *fp, const char *value) {
+    for (const char *p = value; *p; p++) {
+        if (*p == '\\') fputs("\\\\", fp);
+        else if (*p == '\t') fputs("\\t", fp);
+        else if (*p == '\n') fputs("\\n", fp);
+        else fputc(*p, fp);
+    }
+}
+
+// Copies the next tab-separated field of line into out, unescaped
+static char* read_field(char *line, char *out, size_t size) {
+    size_t len = 0;
+
+    for (; *line && *line != '\t' && *line != '\n'; line++) {
+        char c = *line;
+        if (c == '\\' && line[1]) {
+            c = *++line;
+            c = c == 't' ? '\t' : c == 'n' ? '\n' : c;
+        }
+        if (len + 1 < size) {
+            out[len++] = c;
+        }
+    }
+    if (size > 0) {
+        out[len] = '\0';
+    }
+    return *line == '\t' ? line + 1 : line;
+}
+
+static void save_index(void) {
+    char temp_path[MAX_PATH_LEN];
+    FILE *fp;
+
+    if (getpid() != index_owner) {
+        return;
+    }
+
+    snprintf(temp_path, sizeof(temp_path), "%s.tmp", IMAGE_INDEX_PATH);
+    fp = fopen(temp_path, "w");
+    if (!fp) {
+        perror("fopen image index");
+        return;
+    }
+
+    // id, name, ... volumes, compression, then the layers separated by spaces
+    fprintf(fp, "%s\n", IMAGE_INDEX_HEADER);
+    for (int i = 0; i < record_count; i++) {
+        const image_info_t *image = &records[i].image;
+
+        for (int f = 0; f < INDEX_FIELD_COUNT; f++) {
+            write_field(fp, (const char *)image + index_fields[f].offset);
+            fputc('\t', fp);
+        }
+        fprintf(fp, "%s\t", image_compression_name(image->compression));
+        for (int j = 0; j < image->layer_count; j++) {
+            fprintf(fp, "%s%s", j ? " " : "", image->layers[j].id);
+        }
+        fputc('\n', fp);
+    }
+
+    if (fclose(fp) != 0 || rename(temp_path, IMAGE_INDEX_PATH) != 0) {
+        perror("write image index");
+        unlink(temp_path);
+    }
+}
+
+static int add_record(const image_info_t *image) {
+    char full_name[MAX_IMAGE_NAME_LEN + MAX_IMAGE_TAG_LEN + 2];
+    index_record_t *record;
+
+    snprintf(full_name, sizeof(full_name), "%s:%s", image->name, image->tag[0] ? image->tag : "latest");
+    record = find_name(full_name);
+    if (record) {
+        free(record->image.layers);
+    } else {
+        if (record_count == record_capacity) {
+            int capacity = record_capacity ? record_capacity * 2 : 64;
+            index_record_t *grown = realloc(records, sizeof(index_record_t) * capacity);
+            if (!grown) {
+                perror("realloc");
+                return -1;
+            }
+            records = grown;
+            record_capacity = capacity;
+        }
+        record = &records[record_count++];
+        snprintf(record->full_name, sizeof(record->full_name), "%s", full_name);
+    }
+
+    if (copy_image(&record->image, image) != 0) {
+        memset(&record->image, 0, sizeof(record->image));
+        return -1;
+    }
+    return 0;
+}
+
+// Returns 1 when there is no usable index file
+static int load_index(void) {
+    char *line = NULL;
+    size_t size = 0;
+    int result = 0;
+    FILE *fp = fopen(IMAGE_INDEX_PATH, "r");
+
+    if (!fp) {
+        return errno == ENOENT ? 1 : -1;
+    }
+
+    if (getline(&line, &size, fp) <= 0 || strcmp(line, IMAGE_INDEX_HEADER "\n") != 0) {
+        fprintf(stderr, "Ignoring image index in an unknown format\n");
+        result = 1;
+    }
+
+    while (result == 0 && getline(&line, &size, fp) > 0) {
+        image_info_t image;
+        char compression[16];
+        char *p = line;
+
+        memset(&image, 0, sizeof(image));
+        for (int f = 0; f < INDEX_FIELD_COUNT; f++) {
+            p = read_field(p, (char *)&image + index_fields[f].offset, index_fields[f].size);
+        }
+        p = read_field(p, compression, sizeof(compression));
+        parse_image_compression(compression, &image.compression);
+
+        for (char *save = NULL, *layer = strtok_r(p, " \n", &save); layer; layer = strtok_r(NULL, " \n", &save)) {
+            layer_info_t *layers = realloc(image.layers, sizeof(layer_info_t) * (image.layer_count + 1));
+            if (!layers) {
+                perror("realloc");
+                result = -1;
+                break;
+            }
+            image.layers = layers;
+            memset(&image.layers[image.layer_count], 0, sizeof(layer_info_t));
+            snprintf(image.layers[image.layer_count++].id, MAX_LAYER_ID_LEN, "%s", layer);
+        }
+
+        if (result == 0 && image.id[0] && image.name[0] && add_record(&image) != 0) {
+            result = -1;
+        }
+        free(image.layers);
+    }
+
+    free(line);
+    fclose(fp);
+    return result;
+}
+
+// Without an index file the metadata written next to it is the truth
+static int rebuild_index(void) {
+    struct dirent *entry;
+    DIR *dir = opendir(METADATA_DIR);
+
+    if (!dir) {
+        perror("opendir metadata");
+        return -1;
+    }
+
+    while ((entry = readdir(dir)) != NULL) {
+        char path[MAX_PATH_LEN];
+        image_info_t image;
+        size_t len = strlen(entry->d_name);
+
+        if (len <= 5 || strcmp(entry->d_name + len - 5, ".json") != 0) {
+            continue;
+        }
+        snprintf(path, sizeof(path), "%s/%s", METADATA_DIR, entry->d_name);
+        if (parse_image_metadata(path, &image) == 0) {
+            add_record(&image);
+            free(image.layers);
+        }
+    }
+    closedir(dir);
+    return 0;
+}
+
+// ---------------------------------------------------------------------------
+// Lookups and changes
+
+int init_image_index(void) {
+    int result;
+
+    pthread_rwlock_wrlock(&index_lock);
+    index_owner = getpid();
+    result = load_index();
+    if (result > 0) {
+        for (int i = 0; i < record_count; i++) {
+            free(records[i].image.layers);
+        }
+        record_count = 0;
+        result = rebuild_index();
+    }
+    if (result == 0) {
+        result = reindex();
+    }
+    if (result == 0) {
+        save_index();
+    }
+    pthread_rwlock_unlock(&index_lock);
+
+    if (result != 0) {
+        fprintf(stderr, "Failed to load image index\n");
+        return -1;
+    }
+    return 0;
+}
+
+int image_index_put(const image_info_t *image) {
+    char full_name[MAX_IMAGE_NAME_LEN + MAX_IMAGE_TAG_LEN + 2];
+    int result;
+
+    pthread_rwlock_wrlock(&index_lock);
+    result = add_record(image);
+    if (reindex() != 0) {
+        result = -1;
+    }
+    save_index();
+    pthread_rwlock_unlock(&index_lock);
+
+    if (result == 0) {
+        snprintf(full_name, sizeof(full_name), "%s:%s", image->name, image->tag);
+        publish_event(EVENT_TYPE_IMAGE, "tag", image->id, full_name, NULL, -1);
+    }
+    return result;
+}
+
+int image_index_remove(const char *full_name) {
+    int result = -1;
+
+    pthread_rwlock_wrlock(&index_lock);
+    index_record_t *record = find_name(full_name);
+    if (record) {
+        free(record->image.layers);
+        *record = records[--record_count];
+        result = reindex();
+        save_index();
+    }
+    pthread_rwlock_unlock(&index_lock);
+    return result;
+}
+
+// Fills image with a copy of the record; free image->layers after
+int image_index_get(const char *full_name, image_info_t *image) {
+    int result = -1;
+
+    pthread_rwlock_rdlock(&index_lock);
+    index_record_t *record = find_name(full_name);
+    if (record) {
+        result = copy_image(image, &record->image);
+    }
+    pthread_rwlock_unlock(&index_lock);
+    return result;
+}
+
+// name:tag, a bare name (meaning :latest), an id with or without sha256:,
+// or enough of the id's hex to tell it from every other image
+int image_index_resolve(const char *image_ref, char *full_name, size_t size) {
+    char latest[MAX_IMAGE_NAME_LEN + MAX_IMAGE_TAG_LEN + 2];
+    index_record_t *record;
+    int ambiguous = 0;
+
+    pthread_rwlock_rdlock(&index_lock);
+    if (strchr(image_ref, ':') && strncmp(image_ref, "sha256:", 7) != 0) {
+        record = find_name(image_ref);
+    } else {
+        snprintf(latest, sizeof(latest), "%s:latest", image_ref);
+        record = find_name(latest);
+        if (!record) {
+            snprintf(latest, sizeof(latest), "sha256:%s", id_hex(image_ref));
+            record = find_id(latest);
+        }
+        if (!record) {
+            record = find_id(image_ref);
+        }
+        if (!record) {
+            record = find_prefix(id_hex(image_ref), &ambiguous);
+        }
+    }
+    if (record) {
+        snprintf(full_name, size, "%s", record->full_name);
+    }
+    pthread_rwlock_unlock(&index_lock);
+
+    if (ambiguous) {
+        fprintf(stderr, "Image id prefix %s matches more than one image\n", image_ref);
+    }
+    return record ? 0 : -1;
+}
+
+image_list_t* image_index_list(void) {
+    image_list_t *list = calloc(1, sizeof(image_list_t));
+
+    if (!list) {
+        perror("calloc");
+        return NULL;
+    }
+
+    pthread_rwlock_rdlock(&index_lock);
+    list->images = calloc(record_count ? record_count : 1, sizeof(image_info_t));
+    for (int i = 0; list->images && i < record_count; i++) {
+        if (copy_image(&list->images[list->count], &records[i].image) == 0) {
+            list->count++;
+        }
+    }
+    pthread_rwlock_unlock(&index_lock);
+
+    if (!list->images) {
+        perror("calloc");
+        free(list);
+        return NULL;
+    }
+    list->capacity = list->count;
+    return list;
+}
+
+// Visits the records whose name:tag sorts after after_name (from the first
+// when it is NULL or empty), in name:tag order. Returns how many were
+// visited.
+int image_index_scan(const char *after_name, image_visit_fn visit, void *ctx) {
+    int low = 0, high, visited = 0;
+
+    pthread_rwlock_rdlock(&index_lock);
+    high = record_count;
+    while (after_name && after_name[0] && low < high) {
+        int mid = low + (high - low) / 2;
+        if (strcmp(records[by_name[mid]].full_name, after_name) <= 0) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    for (int i = low; i < record_count; i++) {
+        const index_record_t *record = &records[by_name[i]];
+        visited++;
+        if (visit(record->full_name, &record->image, ctx) != 0) {
+            break;
+        }
+    }
+    pthread_rwlock_unlock(&index_lock);
+    return visited;
+}
@@ -0,0 +1,30 @@
+#ifndef IMAGE_INDEX_H
+#define IMAGE_INDEX_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "image.h"
+
+// Every tagged image, kept in memory so resolving a reference or listing
+// images never reads the metadata directory. Records are found by
+// name:tag, by id, or by a prefix of the id's hex that only one image has.
+// The index is written out on every change as one line per tag and read
+// back at startup; without it the name:tag.json files are read instead.
+#define IMAGE_INDEX_PATH METADATA_DIR "/image-index"
+
+// Called for each record in name:tag order under the index's read lock;
+// a nonzero return stops the scan
+typedef int (*image_visit_fn)(const char *full_name, const image_info_t *image, void *ctx);
+
+// Function declarations
+int init_image_index(void);
+int image_index_put(const image_info_t *image);
+int image_index_remove(const char *full_name);
+int image_index_get(const char *full_name, image_info_t *image);
+int image_index_resolve(const char *image_ref, char *full_name, size_t size);
+image_list_t* image_index_list(void);
+int image_index_scan(const char *after_name, image_visit_fn visit, void *ctx);
+
+#endif // IMAGE_INDEX_H
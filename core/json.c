@@ -0,0 +1,767 @@
+#include "json.h"
+#include <ctype.h>
+#include <limits.h>
+#include <math.h>
+#include <stdint.h>
+
+// ----------------------------------------------------------------------------
+// Reading
+// ----------------------------------------------------------------------------
+
+static const char* skip_space(const char *p, const char *end) {
+    while (p < end && (*p == ' ' || *p == '\n' || *p == '\r' || *p == '\t')) p++;
+    return p;
+}
+
+// Bytes that end a plain run inside a string: the quote, the backslash and
+// the control characters JSON does not allow unescaped
+static int is_special(unsigned char c) {
+    return c == '"' || c == '\\' || c < 0x20;
+}
+
+static const char* scan_string(const char *p, const char *end) {
+    for (p++; p < end; p++) {
+        while (p < end && !is_special((unsigned char)*p)) p++;
+        if (p == end) {
+            return NULL;
+        } else if (*p == '"') {
+            return p + 1;
+        } else if (*p == '\\') {
+            if (++p == end) {
+                return NULL;
+            }
+        } else {
+            return NULL;
+        }
+    }
+    return NULL;
+}
+
+static const char* scan_number(const char *p, const char *end) {
+    const char *start = p;
+
+    if (p < end && *p == '-') p++;
+    if (p == end || !isdigit((unsigned char)*p)) {
+        return NULL;
+    }
+    while (p < end && isdigit((unsigned char)*p)) p++;
+    if (p < end && *p == '.') {
+        p++;
+        if (p == end || !isdigit((unsigned char)*p)) return NULL;
+        while (p < end && isdigit((unsigned char)*p)) p++;
+    }
+    if (p < end && (*p == 'e' || *p == 'E')) {
+        p++;
+        if (p < end && (*p == '+' || *p == '-')) p++;
+        if (p == end || !isdigit((unsigned char)*p)) return NULL;
+        while (p < end && isdigit((unsigned char)*p)) p++;
+    }
+    return p > start ? p : NULL;
+}
+
+static const char* scan_literal(const char *p, const char *end, const char *word) {
+    size_t len = strlen(word);
+    return (size_t)(end - p) >= len && memcmp(p, word, len) == 0 ? p + len : NULL;
+}
+
+// One value starting at p (no space before it); fills value and returns
+// the position after it, or NULL when it is not well formed
+static const char* scan_value(const char *p, const char *end, json_value_t *value, int depth) {
+    if (p == end || depth > JSON_MAX_DEPTH) {
+        return NULL;
+    }
+
+    value->start = p;
+    value->resume = NULL;
+    switch (*p) {
+        case '"':
+            value->type = JSON_STRING;
+            p = scan_string(p, end);
+            break;
+        case 't':
+            value->type = JSON_BOOL;
+            p = scan_literal(p, end, "true");
+            break;
+        case 'f':
+            value->type = JSON_BOOL;
+            p = scan_literal(p, end, "false");
+            break;
+        case 'n':
+            value->type = JSON_NULL;
+            p = scan_literal(p, end, "null");
+            break;
+        case '{':
+        case '[': {
+            int object = *p == '{';
+            char close = object ? '}' : ']';
+            json_value_t member;
+
+            value->type = object ? JSON_OBJECT : JSON_ARRAY;
+            p = skip_space(p + 1, end);
+            if (p < end && *p == close) {
+                p++;
+                break;
+            }
+            for (;;) {
+                if (object) {
+                    if (p == end || *p != '"' || !(p = scan_string(p, end))) return NULL;
+                    p = skip_space(p, end);
+                    if (p == end || *p != ':') return NULL;
+                    p = skip_space(p + 1, end);
+                }
+                if (!(p = scan_value(p, end, &member, depth + 1))) return NULL;
+                p = skip_space(p, end);
+                if (p == end) return NULL;
+                if (*p == close) {
+                    p++;
+                    break;
+                }
+                if (*p != ',') return NULL;
+                p = skip_space(p + 1, end);
+            }
+            break;
+        }
+        default:
+            value->type = JSON_NUMBER;
+            p = scan_number(p, end);
+            break;
+    }
+
+    value->end = p;
+    return p;
+}
+
+// Checks the whole of text and sets root to its one value; -1 when it is
+// not a single well formed JSON document
+int json_parse(const char *text, size_t len, json_value_t *root) {
+    const char *end = text + len;
+    const char *p = skip_space(text, end);
+
+    if (!(p = scan_value(p, end, root, 0))) {
+        return -1;
+    }
+    return skip_space(p, end) == end ? 0 : -1;
+}
+
+// Past a string json_parse has already checked: the first quote that is
+// not escaped, found with memchr rather than a byte at a time
+static const char* skip_string(const char *p, const char *end) {
+    for (p++; (p = memchr(p, '"', end - p)) != NULL; p++) {
+        int backslashes = 0;
+
+        while (p[-1 - backslashes] == '\\') backslashes++;
+        if (backslashes % 2 == 0) {
+            return p + 1;
+        }
+    }
+    return end;
+}
+
+// Past a value json_parse has already checked, without checking it again
+static const char* skip_value(const char *p, const char *end, json_value_t *value) {
+    int depth = 0;
+
+    value->start = p;
+    value->resume = NULL;
+    switch (*p) {
+        case '"': value->type = JSON_STRING; break;
+        case 't':
+        case 'f': value->type = JSON_BOOL; break;
+        case 'n': value->type = JSON_NULL; break;
+        case '{': value->type = JSON_OBJECT; break;
+        case '[': value->type = JSON_ARRAY; break;
+        default: value->type = JSON_NUMBER; break;
+    }
+
+    if (value->type == JSON_STRING) {
+        p = skip_string(p, end);
+    } else if (value->type == JSON_OBJECT || value->type == JSON_ARRAY) {
+        for (; p < end; p++) {
+            if (*p == '"') {
+                p = skip_string(p, end) - 1;
+            } else if (*p == '{' || *p == '[') {
+                depth++;
+            } else if ((*p == '}' || *p == ']') && --depth == 0) {
+                p++;
+                break;
+            }
+        }
+    } else {
+        while (p < end && *p != ',' && *p != '}' && *p != ']' && *p != ' ' && *p != '\n' &&
+               *p != '\r' && *p != '\t') p++;
+    }
+    value->end = p;
+    return p;
+}
+
+int json_iter_init(const json_value_t *container, json_iter_t *it) {
+    if (container->type != JSON_OBJECT && container->type != JSON_ARRAY) {
+        return -1;
+    }
+    it->p = container->start + 1;
+    it->end = container->end - 1;
+    it->object = container->type == JSON_OBJECT;
+    it->count = 0;
+    return 0;
+}
+
+// 1 with the next member (key is left alone for arrays, and may be NULL),
+// 0 at the end. Values came from json_parse, so they are well formed.
+int json_iter_next(json_iter_t *it, json_value_t *key, json_value_t *value) {
+    json_value_t name;
+    const char *p = skip_space(it->p, it->end);
+
+    if (p >= it->end) {
+        return 0;
+    }
+    if (it->count > 0) {
+        p = skip_space(p + 1, it->end);         // the comma
+    }
+    if (it->object) {
+        p = skip_value(p, it->end, &name);
+        p = skip_space(p, it->end);
+        p = skip_space(p + 1, it->end);         // the colon
+        if (key) {
+            *key = name;
+        }
+    }
+    it->p = skip_value(p, it->end, value);
+    it->count++;
+    return 1;
+}
+
+// The member of object named key; -1 when there is none. The search starts
+// after the member found last time and wraps around to the top.
+int json_get(json_value_t *object, const char *key, json_value_t *value) {
+    const char *resume = object->resume;
+    json_iter_t it;
+    json_value_t name;
+
+    if (json_iter_init(object, &it) != 0 || !it.object) {
+        return -1;
+    }
+    if (resume) {
+        it.p = resume;
+        it.count = 1;
+    }
+    while (json_iter_next(&it, &name, value) > 0) {
+        if (json_string_equals(&name, key)) {
+            object->resume = it.p;
+            return 0;
+        }
+    }
+    if (resume) {
+        json_iter_init(object, &it);
+        while (it.p < resume && json_iter_next(&it, &name, value) > 0) {
+            if (json_string_equals(&name, key)) {
+                object->resume = it.p;
+                return 0;
+            }
+        }
+    }
+    return -1;
+}
+
+// The first member named key anywhere under value, depth first
+int json_find(const json_value_t *value, const char *key, json_value_t *found) {
+    json_iter_t it;
+    json_value_t name, member;
+
+    if (json_iter_init(value, &it) != 0) {
+        return -1;
+    }
+    while (json_iter_next(&it, &name, &member) > 0) {
+        if (it.object && json_string_equals(&name, key)) {
+            *found = member;
+            return 0;
+        }
+        if ((member.type == JSON_OBJECT || member.type == JSON_ARRAY) && json_find(&member, key, found) == 0) {
+            return 0;
+        }
+    }
+    return -1;
+}
+
+static int hex_value(const char *p, const char *end) {
+    int value = 0;
+
+    if (end - p < 4) {
+        return -1;
+    }
+    for (int i = 0; i < 4; i++) {
+        int c = (unsigned char)p[i];
+        value <<= 4;
+        if (c >= '0' && c <= '9') value |= c - '0';
+        else if (c >= 'a' && c <= 'f') value |= c - 'a' + 10;
+        else if (c >= 'A' && c <= 'F') value |= c - 'A' + 10;
+        else return -1;
+    }
+    return value;
+}
+
+static int encode_utf8(uint32_t cp, char *out) {
+    if (cp < 0x80) {
+        out[0] = (char)cp;
+        return 1;
+    } else if (cp < 0x800) {
+        out[0] = (char)(0xc0 | (cp >> 6));
+        out[1] = (char)(0x80 | (cp & 0x3f));
+        return 2;
+    } else if (cp < 0x10000) {
+        out[0] = (char)(0xe0 | (cp >> 12));
+        out[1] = (char)(0x80 | ((cp >> 6) & 0x3f));
+        out[2] = (char)(0x80 | (cp & 0x3f));
+        return 3;
+    }
+    out[0] = (char)(0xf0 | (cp >> 18));
+    out[1] = (char)(0x80 | ((cp >> 12) & 0x3f));
+    out[2] = (char)(0x80 | ((cp >> 6) & 0x3f));
+    out[3] = (char)(0x80 | (cp & 0x3f));
+    return 4;
+}
+
+// Decodes the escape at p (just past the backslash) into out; returns how
+// many input bytes it took
+static int decode_escape(const char *p, const char *end, char *out, int *out_len) {
+    int cp;
+
+    switch (*p) {
+        case 'b': *out = '\b'; break;
+        case 'f': *out = '\f'; break;
+        case 'n': *out = '\n'; break;
+        case 'r': *out = '\r'; break;
+        case 't': *out = '\t'; break;
+        case 'u':
+            if ((cp = hex_value(p + 1, end)) < 0) {
+                *out = 'u';
+                break;
+            }
+            if (cp >= 0xd800 && cp < 0xdc00 && end - p >= 11 && p[5] == '\\' && p[6] == 'u') {
+                int low = hex_value(p + 7, end);
+                if (low >= 0xdc00 && low < 0xe000) {
+                    *out_len = encode_utf8(0x10000 + ((uint32_t)(cp - 0xd800) << 10) + (low - 0xdc00), out);
+                    return 11;
+                }
+            }
+            *out_len = encode_utf8((uint32_t)cp, out);
+            return 5;
+        default: *out = *p; break;
+    }
+    *out_len = 1;
+    return 1;
+}
+
+// Unescapes a string into out. -1 when value is not a string or did not
+// fit; out then holds as much as did.
+int json_string_copy(const json_value_t *value, char *out, size_t size) {
+    const char *p, *end;
+    size_t len = 0;
+
+    if (size == 0) {
+        return -1;
+    }
+    out[0] = '\0';
+    if (value->type != JSON_STRING) {
+        return -1;
+    }
+
+    end = value->end - 1;
+    for (p = value->start + 1; p < end; ) {
+        const char *run = p;
+        char decoded[4];
+        int decoded_len;
+
+        // The plain run up to the next escape goes over in one copy
+        while (p < end && *p != '\\') p++;
+        if (p > run) {
+            size_t n = p - run;
+            if (len + n >= size) {
+                n = size - 1 - len;
+                memcpy(out + len, run, n);
+                out[len + n] = '\0';
+                return -1;
+            }
+            memcpy(out + len, run, n);
+            len += n;
+            continue;
+        }
+
+        p += 1 + decode_escape(p + 1, end, decoded, &decoded_len);
+        if (len + decoded_len >= size) {
+            out[len] = '\0';
+            return -1;
+        }
+        memcpy(out + len, decoded, decoded_len);
+        len += decoded_len;
+    }
+    out[len] = '\0';
+    return 0;
+}
+
+int json_string_equals(const json_value_t *value, const char *str) {
+    const char *p, *end;
+
+    if (value->type != JSON_STRING) {
+        return 0;
+    }
+    end = value->end - 1;
+    // Keys are almost never escaped, so compare them as they are first
+    if (!memchr(value->start + 1, '\\', end - value->start - 1)) {
+        size_t len = end - value->start - 1;
+        return strncmp(str, value->start + 1, len) == 0 && str[len] == '\0';
+    }
+    for (p = value->start + 1; p < end; ) {
+        char decoded[4];
+        int decoded_len = 1;
+
+        if (*p == '\\') {
+            p += 1 + decode_escape(p + 1, end, decoded, &decoded_len);
+        } else {
+            decoded[0] = *p++;
+        }
+        if (strncmp(str, decoded, decoded_len) != 0) {
+            return 0;
+        }
+        str += decoded_len;
+    }
+    return *str == '\0';
+}
+
+// The integer part of a number; fractions and exponents are cut off
+int json_number_ll(const json_value_t *value, long long *out) {
+    const char *p = value->start;
+    unsigned long long magnitude = 0;
+    int negative = 0;
+
+    if (value->type != JSON_NUMBER) {
+        return -1;
+    }
+    if (*p == '-') {
+        negative = 1;
+        p++;
+    }
+    for (; p < value->end && *p >= '0' && *p <= '9'; p++) {
+        if (magnitude > (unsigned long long)LLONG_MAX / 10) {
+            return -1;
+        }
+        magnitude = magnitude * 10 + (*p - '0');
+    }
+    if (magnitude > (unsigned long long)LLONG_MAX + negative) {
+        return -1;
+    }
+    *out = negative ? (long long)(0 - magnitude) : (long long)magnitude;
+    return 0;
+}
+
+int json_number_double(const json_value_t *value, double *out) {
+    char text[64];
+    size_t len = value->end - value->start;
+
+    if (value->type != JSON_NUMBER || len >= sizeof(text)) {
+        return -1;
+    }
+    memcpy(text, value->start, len);
+    text[len] = '\0';
+    *out = strtod(text, NULL);
+    return 0;
+}
+
+int json_bool(const json_value_t *value, int *out) {
+    if (value->type != JSON_BOOL) {
+        return -1;
+    }
+    *out = *value->start == 't';
+    return 0;
+}
+
+int json_get_string(json_value_t *object, const char *key, char *out, size_t size) {
+    json_value_t value;
+
+    if (json_get(object, key, &value) != 0) {
+        if (size > 0) out[0] = '\0';
+        return -1;
+    }
+    return json_string_copy(&value, out, size);
+}
+
+int json_get_ll(json_value_t *object, const char *key, long long *out) {
+    json_value_t value;
+    return json_get(object, key, &value) == 0 ? json_number_ll(&value, out) : -1;
+}
+
+int json_get_bool(json_value_t *object, const char *key, int *out) {
+    json_value_t value;
+    return json_get(object, key, &value) == 0 ? json_bool(&value, out) : -1;
+}
+
+// The strings of an array joined by separator, as the daemon keeps a
+// command line or an environment; a lone string is taken as is
+int json_join_strings(const json_value_t *array, const char *separator, char *out, size_t size) {
+    json_iter_t it;
+    json_value_t element;
+    size_t len = 0;
+
+    if (array->type == JSON_STRING) {
+        return json_string_copy(array, out, size);
+    }
+    if (size == 0 || json_iter_init(array, &it) != 0 || it.object) {
+        return -1;
+    }
+
+    out[0] = '\0';
+    while (json_iter_next(&it, NULL, &element) > 0) {
+        if (element.type != JSON_STRING) {
+            continue;
+        }
+        if (len > 0) {
+            if (len + strlen(separator) >= size) return -1;
+            len += snprintf(out + len, size - len, "%s", separator);
+        }
+        if (json_string_copy(&element, out + len, size - len) != 0) {
+            return -1;
+        }
+        len += strlen(out + len);
+    }
+    return 0;
+}
+
+// ----------------------------------------------------------------------------
+// Writing
+// ----------------------------------------------------------------------------
+
+void json_writer_init(json_writer_t *w, char *buffer, size_t size, json_flush_fn flush, void *ctx) {
+    memset(w, 0, sizeof(*w));
+    w->buffer = buffer;
+    w->size = size;
+    w->flush = flush;
+    w->ctx = ctx;
+    if (!flush && size > 0) {
+        buffer[0] = '\0';
+    }
+}
+
+static void put(json_writer_t *w, const char *data, size_t len) {
+    if (w->failed) {
+        return;
+    }
+    // Without a flush the last byte is kept for the NUL finish adds
+    if (!w->flush) {
+        if (w->len + len >= w->size) {
+            w->failed = 1;
+            return;
+        }
+        memcpy(w->buffer + w->len, data, len);
+        w->len += len;
+        w->total += len;
+        return;
+    }
+    if (w->len + len > w->size) {
+        if (w->len > 0 && w->flush(w->buffer, w->len, w->ctx) != 0) {
+            w->failed = 1;
+            return;
+        }
+        w->len = 0;
+        if (len > w->size) {
+            if (w->flush(data, len, w->ctx) != 0) {
+                w->failed = 1;
+            }
+            w->total += len;
+            return;
+        }
+    }
+    memcpy(w->buffer + w->len, data, len);
+    w->len += len;
+    w->total += len;
+}
+
+// A line break and the indentation, JSON_MAX_DEPTH levels of it at most
+static void put_indent(json_writer_t *w) {
+    static const char indent[] = "\n                                                                ";
+
+    put(w, indent, 1 + w->depth * 2);
+}
+
+// The comma and line break a new member or element needs
+static void before_value(json_writer_t *w) {
+    if (w->after_key) {
+        w->after_key = 0;
+        return;
+    }
+    if (w->depth == 0) {
+        return;
+    }
+    if (w->members[w->depth - 1]) {
+        put(w, ",", 1);
+    }
+    w->members[w->depth - 1] = 1;
+    if (w->pretty) {
+        put_indent(w);
+    }
+}
+
+// The characters of str as they go between a JSON string's quotes
+static void put_escaped_chars(json_writer_t *w, const char *str) {
+    const char *run = str;
+
+    for (const char *p = str; *p; p++) {
+        unsigned char c = (unsigned char)*p;
+        char escaped[8];
+        int len;
+
+        if (!is_special(c)) {
+            continue;
+        }
+        put(w, run, p - run);
+        run = p + 1;
+        switch (c) {
+            case '"': len = snprintf(escaped, sizeof(escaped), "\\\""); break;
+            case '\\': len = snprintf(escaped, sizeof(escaped), "\\\\"); break;
+            case '\n': len = snprintf(escaped, sizeof(escaped), "\\n"); break;
+            case '\r': len = snprintf(escaped, sizeof(escaped), "\\r"); break;
+            case '\t': len = snprintf(escaped, sizeof(escaped), "\\t"); break;
+            default: len = snprintf(escaped, sizeof(escaped), "\\u%04x", c); break;
+        }
+        put(w, escaped, len);
+    }
+    put(w, run, strlen(run));
+}
+
+static void put_escaped(json_writer_t *w, const char *str) {
+    put(w, "\"", 1);
+    put_escaped_chars(w, str);
+    put(w, "\"", 1);
+}
+
+static void open_container(json_writer_t *w, const char *bracket) {
+    before_value(w);
+    if (w->depth == JSON_MAX_DEPTH) {
+        w->failed = 1;
+        return;
+    }
+    put(w, bracket, 1);
+    w->members[w->depth++] = 0;
+}
+
+static void close_container(json_writer_t *w, const char *bracket) {
+    if (w->depth == 0) {
+        w->failed = 1;
+        return;
+    }
+    w->depth--;
+    if (w->pretty && w->members[w->depth]) {
+        put_indent(w);
+    }
+    put(w, bracket, 1);
+}
+
+void json_write_object_begin(json_writer_t *w) {
+    open_container(w, "{");
+}
+
+void json_write_object_end(json_writer_t *w) {
+    close_container(w, "}");
+}
+
+void json_write_array_begin(json_writer_t *w) {
+    open_container(w, "[");
+}
+
+void json_write_array_end(json_writer_t *w) {
+    close_container(w, "]");
+}
+
+void json_write_key(json_writer_t *w, const char *key) {
+    before_value(w);
+    put_escaped(w, key);
+    put(w, w->pretty ? ": " : ":", w->pretty ? 2 : 1);
+    w->after_key = 1;
+}
+
+void json_write_string(json_writer_t *w, const char *str) {
+    before_value(w);
+    put_escaped(w, str ? str : "");
+}
+
+void json_write_ll(json_writer_t *w, long long number) {
+    char text[24];
+    char *p = text + sizeof(text);
+    unsigned long long magnitude = number < 0 ? 0 - (unsigned long long)number : (unsigned long long)number;
+
+    // Digits from the right, without going through printf
+    do {
+        *--p = (char)('0' + magnitude % 10);
+        magnitude /= 10;
+    } while (magnitude > 0);
+    if (number < 0) {
+        *--p = '-';
+    }
+    before_value(w);
+    put(w, p, text + sizeof(text) - p);
+}
+
+// A number with a fixed count of decimals, such as a duration in ms;
+// NaN and infinities, which JSON cannot hold, are written as null
+void json_write_fixed(json_writer_t *w, double number, int decimals) {
+    char text[64];
+    int len;
+
+    if (!isfinite(number)) {
+        json_write_null(w);
+        return;
+    }
+    len = snprintf(text, sizeof(text), "%.*f", decimals, number);
+    if (len < 0 || len >= (int)sizeof(text)) {
+        w->failed = 1;
+        return;
+    }
+    before_value(w);
+    put(w, text, len);
+}
+
+void json_write_bool(json_writer_t *w, int value) {
+    before_value(w);
+    put(w, value ? "true" : "false", value ? 4 : 5);
+}
+
+void json_write_null(json_writer_t *w) {
+    before_value(w);
+    put(w, "null", 4);
+}
+
+// A value that is already JSON, as it is
+void json_write_raw(json_writer_t *w, const char *json, size_t len) {
+    before_value(w);
+    put(w, json, len);
+}
+
+// Flushes what is left, or without a flush function NUL terminates the
+// buffer. Returns the bytes written in all, or -1 if anything failed or,
+// without a flush function, did not fit.
+long long json_writer_finish(json_writer_t *w) {
+    if (!w->flush && w->size > 0) {
+        w->buffer[w->len] = '\0';
+    }
+    if (!w->failed && w->flush && w->len > 0) {
+        if (w->flush(w->buffer, w->len, w->ctx) != 0) {
+            w->failed = 1;
+        }
+        w->len = 0;
+    }
+    return w->failed ? -1 : (long long)w->total;
+}
+
+// A json_flush_fn for writers streaming into a FILE
+int json_flush_file(const char *data, size_t len, void *fp) {
+    return fwrite(data, 1, len, fp) == len ? 0 : -1;
+}
+
+// Escapes str for use between the quotes of a JSON string, for callers
+// that format the rest themselves. Fails when out is too small, leaving
+// in it the whole escapes that fit.
+int json_escape(const char *str, char *out, size_t size) {
+    json_writer_t w;
+
+    json_writer_init(&w, out, size, NULL, NULL);
+    put_escaped_chars(&w, str);
+    return json_writer_finish(&w) < 0 ? -1 : 0;
+}
@@ -0,0 +1,95 @@
+#ifndef JSON_H
+#define JSON_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// A small JSON reader and writer shared by the daemon and the client.
+//
+// The reader never copies or allocates: json_parse checks the document's
+// structure in one pass and hands back the root as a slice of the caller's
+// buffer, and members and elements are found on demand by walking that
+// slice. Strings are unescaped only when asked for, into the caller's
+// buffer. The buffer has to outlive every value taken from it. An object
+// remembers where its last json_get stopped and the next one starts there,
+// so reading members in the order they were written is a single pass.
+//
+// The writer appends into a fixed buffer, escaping strings and placing
+// commas itself. With a flush function it streams, handing the buffer
+// over whenever it fills; without one it fails once the buffer is full.
+#define JSON_MAX_DEPTH 32
+
+typedef enum {
+    JSON_NULL,
+    JSON_BOOL,
+    JSON_NUMBER,
+    JSON_STRING,
+    JSON_ARRAY,
+    JSON_OBJECT
+} json_type_t;
+
+typedef struct {
+    json_type_t type;
+    const char *start;          // first byte of the value, the quote for strings
+    const char *end;            // one past its last byte
+    const char *resume;         // objects: where the last json_get left off
+} json_value_t;
+
+// Walks the members of an object or the elements of an array
+typedef struct {
+    const char *p;
+    const char *end;            // the closing bracket
+    int object;
+    int count;
+} json_iter_t;
+
+typedef int (*json_flush_fn)(const char *data, size_t len, void *ctx);
+
+typedef struct {
+    char *buffer;
+    size_t size;
+    size_t len;
+    size_t total;               // bytes written, flushed or not
+    json_flush_fn flush;
+    void *ctx;
+    int pretty;                 // two-space indentation, one member per line
+    int depth;
+    unsigned char members[JSON_MAX_DEPTH];  // whether each open level has any yet
+    int after_key;
+    int failed;
+} json_writer_t;
+
+// Function declarations
+int json_parse(const char *text, size_t len, json_value_t *root);
+int json_iter_init(const json_value_t *container, json_iter_t *it);
+int json_iter_next(json_iter_t *it, json_value_t *key, json_value_t *value);
+int json_get(json_value_t *object, const char *key, json_value_t *value);
+int json_find(const json_value_t *value, const char *key, json_value_t *found);
+int json_string_copy(const json_value_t *value, char *out, size_t size);
+int json_string_equals(const json_value_t *value, const char *str);
+int json_number_ll(const json_value_t *value, long long *out);
+int json_number_double(const json_value_t *value, double *out);
+int json_bool(const json_value_t *value, int *out);
+int json_get_string(json_value_t *object, const char *key, char *out, size_t size);
+int json_get_ll(json_value_t *object, const char *key, long long *out);
+int json_get_bool(json_value_t *object, const char *key, int *out);
+int json_join_strings(const json_value_t *array, const char *separator, char *out, size_t size);
+
+void json_writer_init(json_writer_t *w, char *buffer, size_t size, json_flush_fn flush, void *ctx);
+void json_write_object_begin(json_writer_t *w);
+void json_write_object_end(json_writer_t *w);
+void json_write_array_begin(json_writer_t *w);
+void json_write_array_end(json_writer_t *w);
+void json_write_key(json_writer_t *w, const char *key);
+void json_write_string(json_writer_t *w, const char *str);
+void json_write_ll(json_writer_t *w, long long number);
+void json_write_fixed(json_writer_t *w, double number, int decimals);
+void json_write_bool(json_writer_t *w, int value);
+void json_write_null(json_writer_t *w);
+void json_write_raw(json_writer_t *w, const char *json, size_t len);
+long long json_writer_finish(json_writer_t *w);
+int json_flush_file(const char *data, size_t len, void *fp);
+int json_escape(const char *str, char *out, size_t size);
+
+#endif // JSON_H
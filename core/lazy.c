@@ -0,0 +1,928 @@
+#include "lazy.h"
+#include "registry.h"
+#include "tar.h"
+#include "json.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/fanotify.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <sys/xattr.h>
+
+typedef struct {
+    const char *layer_id;
+    int fd;
+    int result;
+} index_writer_t;
+
+// Helper functions
+static void state_path(const char *layer_id, char *path, size_t size) {
+    snprintf(path, size, "%s/%s/%s%s", LAYER_STORAGE_DIR, layer_id, layer_id, LAZY_STATE_SUFFIX);
+}
+
+// Files read during earlier starts, one name per line, kept per layer blob
+static int hot_list_path(const char *blob_digest, char *path, size_t size) {
+    if (blob_storage_path(blob_digest, path, size) != 0) {
+        return -1;
+    }
+    strncat(path, ".hot", size - strlen(path) - 1);
+    return 0;
+}
+
+static char* read_file(const char *path, size_t max_len, size_t *out_len) {
+    struct stat st;
+    char *data;
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+
+    if (fd < 0) {
+        return NULL;
+    }
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size > max_len || !(data = malloc(st.st_size + 1))) {
+        close(fd);
+        return NULL;
+    }
+
+    size_t got = 0;
+    while (got < (size_t)st.st_size) {
+        ssize_t n = read(fd, data + got, st.st_size - got);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+        got += n;
+    }
+    close(fd);
+
+    data[got] = '\0';
+    if (out_len) *out_len = got;
+    return data;
+}
+
+// A number member, or 0 when there is none
+static long long number_field(json_value_t *object, const char *key) {
+    long long value;
+    return json_get_ll(object, key, &value) == 0 ? value : 0;
+}
+
+static int hot_list_contains(const char *hot, const char *name) {
+    size_t len = strlen(name);
+
+    for (const char *p = hot; p && (p = strstr(p, name)) != NULL; p++) {
+        if ((p == hot || p[-1] == '\n') && (p[len] == '\n' || p[len] == '\0')) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static void* index_writer(void *arg) {
+    index_writer_t *job = arg;
+
+    job->result = write_layer_tar(job->layer_id, job->fd);
+    close(job->fd);
+    return NULL;
+}
+
+static void write_index_entry(FILE *fp, const tar_entry_t *entry, long long offset, const char *digest, int hot) {
+    char buffer[1024];
+    char type[2] = { entry->type, '\0' };
+    json_writer_t w;
+
+    json_writer_init(&w, buffer, sizeof(buffer), json_flush_file, fp);
+    json_write_object_begin(&w);
+    json_write_key(&w, "name");
+    json_write_string(&w, entry->name);
+    json_write_key(&w, "type");
+    json_write_string(&w, type);
+    json_write_key(&w, "mode");
+    json_write_ll(&w, entry->mode);
+    json_write_key(&w, "uid");
+    json_write_ll(&w, entry->uid);
+    json_write_key(&w, "gid");
+    json_write_ll(&w, entry->gid);
+    json_write_key(&w, "mtime");
+    json_write_ll(&w, entry->mtime);
+    if (entry->linkname[0]) {
+        json_write_key(&w, "linkname");
+        json_write_string(&w, entry->linkname);
+    }
+    if (entry->type == '3' || entry->type == '4') {
+        json_write_key(&w, "devmajor");
+        json_write_ll(&w, entry->devmajor);
+        json_write_key(&w, "devminor");
+        json_write_ll(&w, entry->devminor);
+    }
+    if (digest) {
+        json_write_key(&w, "size");
+        json_write_ll(&w, entry->size);
+        json_write_key(&w, "offset");
+        json_write_ll(&w, offset);
+        json_write_key(&w, "digest");
+        json_write_string(&w, digest);
+    }
+    if (hot) {
+        json_write_key(&w, "hot");
+        json_write_bool(&w, 1);
+    }
+    json_write_object_end(&w);
+    json_writer_finish(&w);
+}
+
+// Turns one line of an index back into an entry; returns 0 for lines that
+// are not entries
+static int parse_index_entry(const char *line, tar_entry_t *entry, long long *offset, char *digest, int *hot) {
+    json_value_t object;
+    char type[4] = "";
+
+    if (strncmp(line, "{\"name\":", 8) != 0) {
+        return 0;
+    }
+    if (json_parse(line, strlen(line), &object) != 0 || object.type != JSON_OBJECT) {
+        return -1;
+    }
+
+    // Read in the order write_index_entry writes them
+    memset(entry, 0, sizeof(*entry));
+    if (json_get_string(&object, "name", entry->name, sizeof(entry->name)) != 0 ||
+        json_get_string(&object, "type", type, sizeof(type)) != 0 || strlen(type) != 1) {
+        return -1;
+    }
+    entry->type = type[0];
+    entry->mode = number_field(&object, "mode") & 07777;
+    entry->uid = number_field(&object, "uid");
+    entry->gid = number_field(&object, "gid");
+    entry->mtime = number_field(&object, "mtime");
+    json_get_string(&object, "linkname", entry->linkname, sizeof(entry->linkname));
+    entry->devmajor = number_field(&object, "devmajor");
+    entry->devminor = number_field(&object, "devminor");
+    entry->size = number_field(&object, "size");
+    *offset = number_field(&object, "offset");
+
+    digest[0] = '\0';
+    if (entry->type == '0' || entry->type == '7') {
+        if (json_get_string(&object, "digest", digest, MAX_DIGEST_LEN) != 0 || entry->size < 0 || *offset < 0) {
+            return -1;
+        }
+    }
+
+    *hot = 0;
+    json_get_bool(&object, "hot", hot);
+    return 1;
+}
+
+// Calls fn for each entry line of an index, which is edited in place
+static int for_each_entry(char *index, int (*fn)(void *ctx, const tar_entry_t *entry, long long offset,
+                                                  const char *digest, int hot), void *ctx) {
+    tar_entry_t *entry = malloc(sizeof(tar_entry_t));
+    char digest[MAX_DIGEST_LEN];
+    char *line = index;
+    int result = 0;
+
+    if (!entry) {
+        return -1;
+    }
+
+    while (line && *line && result == 0) {
+        char *next = strchr(line, '\n');
+        long long offset;
+        int hot;
+
+        if (next) {
+            *next++ = '\0';
+        }
+
+        // Entries are separated by ",\n"
+        size_t len = strlen(line);
+        if (len > 0 && line[len - 1] == ',') {
+            line[len - 1] = '\0';
+        }
+
+        int parsed = parse_index_entry(line, entry, &offset, digest, &hot);
+        if (parsed < 0) {
+            fprintf(stderr, "Malformed file index entry\n");
+            result = -1;
+        } else if (parsed == 1) {
+            result = fn(ctx, entry, offset, digest, hot);
+        }
+        line = next;
+    }
+
+    free(entry);
+    return result;
+}
+
+// Lists a layer's entries with where each file's data sits in the layer's
+// plain tar stream, which is exactly its registry blob
+char* lazy_build_index(const char *layer_id, const char *blob_digest, size_t *len) {
+    char hot_path[MAX_PATH_LEN];
+    char digest[MAX_DIGEST_LEN];
+    char *buffer = NULL, *index = NULL, *hot = NULL;
+    tar_entry_t *entry = NULL;
+    tar_reader_t *reader = NULL;
+    index_writer_t job;
+    pthread_t thread;
+    int fds[2];
+    int rc = -1;
+    FILE *fp;
+
+    if (pipe2(fds, O_CLOEXEC) != 0) {
+        perror("pipe");
+        return NULL;
+    }
+
+    fp = open_memstream(&index, len);
+    if (!fp) {
+        perror("open_memstream");
+        close(fds[0]);
+        close(fds[1]);
+        return NULL;
+    }
+
+    job.layer_id = layer_id;
+    job.fd = fds[1];
+    job.result = -1;
+    if (pthread_create(&thread, NULL, index_writer, &job) != 0) {
+        perror("pthread_create");
+        close(fds[0]);
+        close(fds[1]);
+        fclose(fp);
+        free(index);
+        return NULL;
+    }
+
+    if (hot_list_path(blob_digest, hot_path, sizeof(hot_path)) == 0) {
+        hot = read_file(hot_path, LAZY_MAX_INDEX_LEN, NULL);
+    }
+
+    fprintf(fp, "{\"mediaType\":\"%s\",\"layer\":\"%s\",\"entries\":[\n", MEDIA_TYPE_FILE_INDEX, blob_digest);
+
+    entry = malloc(sizeof(tar_entry_t));
+    buffer = malloc(TAR_BUFFER_SIZE);
+    reader = tar_reader_open(fds[0], NULL, 0, -1);
+    if (entry && buffer && reader) {
+        int first = 1;
+
+        while ((rc = tar_next(reader, entry)) == 1) {
+            long long offset = reader->offset;
+            int regular = entry->type == '0' || entry->type == '7';
+
+            if (regular) {
+                sha256_ctx_t hash;
+                uint8_t sum[SHA256_DIGEST_LEN];
+                ssize_t n;
+
+                sha256_init(&hash);
+                while ((n = tar_read_data(reader, buffer, TAR_BUFFER_SIZE)) > 0) {
+                    sha256_update(&hash, buffer, n);
+                }
+                if (n < 0) {
+                    rc = -1;
+                    break;
+                }
+                sha256_final(&hash, sum);
+                strcpy(digest, "sha256:");
+                sha256_to_hex(sum, digest + 7);
+            }
+
+            if (!first) {
+                fprintf(fp, ",\n");
+            }
+            write_index_entry(fp, entry, offset, regular ? digest : NULL,
+                              regular && hot && hot_list_contains(hot, entry->name));
+            first = 0;
+        }
+        if (rc == 0) {
+            rc = tar_drain(reader);
+        }
+    }
+    fprintf(fp, "\n]}\n");
+
+    // Closing our end unblocks the writer if reading stopped early
+    tar_reader_close(reader);
+    close(fds[0]);
+    pthread_join(thread, NULL);
+
+    free(entry);
+    free(buffer);
+    free(hot);
+    if (fclose(fp) != 0 || rc != 0 || job.result != 0) {
+        fprintf(stderr, "Failed to index layer %s\n", layer_id);
+        free(index);
+        return NULL;
+    }
+    return index;
+}
+
+typedef struct {
+    const char *layer_id;
+    const char *root;
+    int regular;
+} skeleton_t;
+
+static int create_skeleton_entry(void *ctx, const tar_entry_t *entry, long long offset, const char *digest,
+                                 int hot) {
+    skeleton_t *skeleton = ctx;
+    char path[PATH_MAX * 2];
+    int rc;
+
+    (void)offset;
+    (void)digest;
+    (void)hot;
+
+    rc = tar_create_entry(skeleton->root, entry, path, sizeof(path));
+    if (rc < 0) {
+        return -1;
+    }
+
+    if (entry->type == '0' || entry->type == '7') {
+        // Entries are numbered in index order, so the xattr finds the entry
+        // again without a path lookup
+        if (rc == 0 && entry->size > 0) {
+            char value[MAX_LAYER_ID_LEN + 16];
+            snprintf(value, sizeof(value), "%s %d", skeleton->layer_id, skeleton->regular);
+            if (lsetxattr(path, LAZY_XATTR, value, strlen(value), 0) != 0) {
+                perror("setxattr");
+                return -1;
+            }
+        }
+        skeleton->regular++;
+    }
+    return 0;
+}
+
+// Lays out a layer from its file index alone: directories, links and
+// metadata are final, regular files are sparse until fetched. The layer's
+// diff_id is its blob digest, since the blob is a plain tar stream.
+int lazy_create_layer(const char *layer_id, const char *source, const char *blob_digest, long long blob_size,
+                      const char *index, size_t index_len) {
+    char layer_path[MAX_PATH_LEN];
+    char staging[MAX_PATH_LEN + 16];
+    char root[PATH_MAX];
+    char path[PATH_MAX];
+    char rm_cmd[MAX_PATH_LEN + 32];
+    skeleton_t skeleton;
+    char *copy;
+    int result = -1;
+    FILE *fp;
+
+    snprintf(layer_path, sizeof(layer_path), "%s/%s", LAYER_STORAGE_DIR, layer_id);
+    if (access(layer_path, F_OK) == 0) {
+        return 0;
+    }
+
+    snprintf(staging, sizeof(staging), "%s/%s.lazy-XXXXXX", LAYER_STORAGE_DIR, layer_id);
+
+    // mkdtemp leaves the directory private; it becomes the layer's root
+    if (!mkdtemp(staging) || chmod(staging, 0755) != 0) {
+        perror("mkdtemp");
+        return -1;
+    }
+
+    copy = malloc(index_len + 1);
+    if (copy && realpath(staging, root)) {
+        memcpy(copy, index, index_len);
+        copy[index_len] = '\0';
+
+        skeleton.layer_id = layer_id;
+        skeleton.root = root;
+        skeleton.regular = 0;
+        if (for_each_entry(copy, create_skeleton_entry, &skeleton) == 0) {
+            if (snprintf(path, sizeof(path), "%s/%s%s", root, layer_id, LAZY_STATE_SUFFIX) >= (int)sizeof(path)) {
+                fprintf(stderr, "Lazy layer path too long: %s\n", root);
+            } else if ((fp = fopen(path, "w")) != NULL) {
+                fprintf(fp, "{\"source\":\"%s\",\"size\":%lld}\n", source, blob_size);
+                fwrite(index, 1, index_len, fp);
+                result = fclose(fp) == 0 ? 0 : -1;
+            }
+        }
+    }
+    free(copy);
+
+    // Another pull may have installed the same layer in the meantime
+    if (result == 0 && rename(staging, layer_path) != 0 && access(layer_path, F_OK) != 0) {
+        perror("rename layer");
+        result = -1;
+    }
+    if (access(staging, F_OK) == 0) {
+        snprintf(rm_cmd, sizeof(rm_cmd), "rm -rf %s", staging);
+        if (system(rm_cmd) != 0) {
+            fprintf(stderr, "Failed to remove %s\n", staging);
+        }
+    }
+    if (result != 0) {
+        fprintf(stderr, "Failed to lay out lazy layer %s\n", layer_id);
+        return -1;
+    }
+
+    return record_layer(layer_id, blob_digest, blob_size);
+}
+
+int lazy_layer_pending(const char *layer_id) {
+    char path[MAX_PATH_LEN];
+
+    state_path(layer_id, path, sizeof(path));
+    return access(path, F_OK) == 0;
+}
+
+static int load_layer_entry(void *ctx, const tar_entry_t *entry, long long offset, const char *digest, int hot) {
+    lazy_layer_t *layer = ctx;
+    lazy_entry_t *item;
+
+    if (entry->type != '0' && entry->type != '7') {
+        return 0;
+    }
+
+    if (layer->count % 256 == 0) {
+        lazy_entry_t *grown = realloc(layer->entries, (layer->count + 256) * sizeof(lazy_entry_t));
+        if (!grown) {
+            return -1;
+        }
+        layer->entries = grown;
+    }
+
+    item = &layer->entries[layer->count];
+    memset(item, 0, sizeof(*item));
+    item->name = strdup(entry->name);
+    item->offset = offset;
+    item->size = entry->size;
+    item->mtime = entry->mtime;
+    item->hot = hot;
+    snprintf(item->digest, sizeof(item->digest), "%s", digest);
+    if (!item->name) {
+        return -1;
+    }
+    layer->count++;
+    return 0;
+}
+
+int lazy_load_layer(const char *layer_id, lazy_layer_t *layer) {
+    char path[MAX_PATH_LEN];
+    char *state, *index, *hot;
+    json_value_t root;
+    const char *at;
+
+    memset(layer, 0, sizeof(*layer));
+    snprintf(layer->layer_id, sizeof(layer->layer_id), "%s", layer_id);
+
+    state_path(layer_id, path, sizeof(path));
+    state = read_file(path, LAZY_MAX_INDEX_LEN, NULL);
+    if (!state) {
+        return -1;
+    }
+
+    index = strchr(state, '\n');
+    if (!index) {
+        free(state);
+        return -1;
+    }
+    *index++ = '\0';
+
+    if (json_parse(state, strlen(state), &root) != 0 || root.type != JSON_OBJECT ||
+        json_get_string(&root, "source", layer->source, sizeof(layer->source)) != 0 ||
+        !(at = strchr(layer->source, '@'))) {
+        fprintf(stderr, "Lazy layer %s does not say where it came from\n", layer_id);
+        free(state);
+        return -1;
+    }
+    snprintf(layer->blob_digest, sizeof(layer->blob_digest), "%s", at + 1);
+    layer->blob_size = number_field(&root, "size");
+
+    if (for_each_entry(index, load_layer_entry, layer) != 0) {
+        free(state);
+        lazy_free_layer(layer);
+        return -1;
+    }
+    free(state);
+
+    // Files earlier starts read locally count as hot too
+    if (hot_list_path(layer->blob_digest, path, sizeof(path)) == 0 &&
+        (hot = read_file(path, LAZY_MAX_INDEX_LEN, NULL)) != NULL) {
+        for (int i = 0; i < layer->count; i++) {
+            layer->entries[i].hot = layer->entries[i].hot || hot_list_contains(hot, layer->entries[i].name);
+        }
+        free(hot);
+    }
+    return 0;
+}
+
+void lazy_free_layer(lazy_layer_t *layer) {
+    for (int i = 0; i < layer->count; i++) {
+        free(layer->entries[i].name);
+    }
+    free(layer->entries);
+    layer->entries = NULL;
+    layer->count = 0;
+}
+
+// Copies a file's bytes out of the blob when the whole blob is already in
+// the content store
+static int fill_from_blob(const lazy_layer_t *layer, const lazy_entry_t *item, int fd, sha256_ctx_t *hash) {
+    char blob_path[MAX_PATH_LEN];
+    char buffer[65536];
+    int blob_fd;
+
+    if (blob_storage_path(layer->blob_digest, blob_path, sizeof(blob_path)) != 0 ||
+        (blob_fd = open(blob_path, O_RDONLY | O_CLOEXEC)) < 0) {
+        return -1;
+    }
+
+    for (long long done = 0; done < item->size; ) {
+        size_t want = item->size - done < (long long)sizeof(buffer) ? (size_t)(item->size - done) : sizeof(buffer);
+        ssize_t n = pread(blob_fd, buffer, want, item->offset + done);
+        if (n <= 0 || pwrite(fd, buffer, n, done) != n) {
+            close(blob_fd);
+            return -1;
+        }
+        sha256_update(hash, buffer, n);
+        done += n;
+    }
+
+    close(blob_fd);
+    return 0;
+}
+
+// Fetches one pending file into its placeholder. Returns 1 when it was
+// fetched now, 0 when there was nothing to do, -1 on failure.
+int lazy_fill_entry(lazy_layer_t *layer, int entry, long long *bytes) {
+    lazy_entry_t *item = &layer->entries[entry];
+    char path[MAX_PATH_LEN + PATH_MAX];
+    uint8_t sum[SHA256_DIGEST_LEN];
+    char digest[MAX_DIGEST_LEN];
+    sha256_ctx_t hash;
+    int result = -1;
+    int fd;
+
+    snprintf(path, sizeof(path), "%s/%s/%s", LAYER_STORAGE_DIR, layer->layer_id, item->name);
+    fd = open(path, O_WRONLY | O_NOFOLLOW | O_CLOEXEC);
+    if (fd < 0) {
+        perror("open lazy file");
+        return -1;
+    }
+
+    // Whoever holds the lock fills the file; the rest find the xattr gone
+    if (flock(fd, LOCK_EX) != 0 || fgetxattr(fd, LAZY_XATTR, NULL, 0) < 0) {
+        int filled = errno == ENODATA;
+        close(fd);
+        return filled ? 0 : -1;
+    }
+
+    sha256_init(&hash);
+    if (fill_from_blob(layer, item, fd, &hash) != 0) {
+        sha256_init(&hash);
+        if (registry_fetch_range(layer->source, item->offset, item->size, fd, &hash) != 0) {
+            fprintf(stderr, "Failed to fetch %s from %s\n", item->name, layer->source);
+            close(fd);
+            return -1;
+        }
+    }
+
+    sha256_final(&hash, sum);
+    strcpy(digest, "sha256:");
+    sha256_to_hex(sum, digest + 7);
+    if (strcmp(digest, item->digest) != 0) {
+        fprintf(stderr, "Fetched %s does not match its digest\n", item->name);
+
+        // Back to a clean placeholder, so the next open tries again
+        if (ftruncate(fd, 0) != 0 || ftruncate(fd, item->size) != 0) {
+            perror("ftruncate");
+        }
+    } else {
+        struct timespec times[2] = { { item->mtime, 0 }, { item->mtime, 0 } };
+        futimens(fd, times);
+        if (fremovexattr(fd, LAZY_XATTR) == 0) {
+            result = 1;
+            if (bytes) *bytes = item->size;
+        } else {
+            perror("removexattr");
+        }
+    }
+
+    close(fd);
+    return result;
+}
+
+// Fetches everything still pending, for readers that go to the layer tree
+// directly (base images, save, push). The whole blob comes over once,
+// resumably, and the placeholders are filled from it.
+int lazy_complete_layer(const char *layer_id) {
+    char path[MAX_PATH_LEN];
+    lazy_layer_t layer;
+    int result = 0;
+
+    if (!lazy_layer_pending(layer_id)) {
+        return 0;
+    }
+    if (lazy_load_layer(layer_id, &layer) != 0) {
+        return -1;
+    }
+
+    printf("Fetching the rest of lazy layer %s\n", layer_id);
+    if (registry_fetch_blob(layer.source, layer.blob_size) != 0) {
+        lazy_free_layer(&layer);
+        return -1;
+    }
+
+    for (int i = 0; i < layer.count && result == 0; i++) {
+        if (layer.entries[i].size > 0 && lazy_fill_entry(&layer, i, NULL) < 0) {
+            result = -1;
+        }
+    }
+    lazy_free_layer(&layer);
+
+    state_path(layer_id, path, sizeof(path));
+    if (result == 0 && unlink(path) != 0 && errno != ENOENT) {
+        perror("unlink lazy state");
+        result = -1;
+    }
+    return result;
+}
+
+// ---------------------------------------------------------------------------
+// Serving a container's opens
+
+static int pending_entries(const lazy_layer_t *layer) {
+    char path[MAX_PATH_LEN + PATH_MAX];
+    int pending = 0;
+
+    for (int i = 0; i < layer->count; i++) {
+        snprintf(path, sizeof(path), "%s/%s/%s", LAYER_STORAGE_DIR, layer->layer_id, layer->entries[i].name);
+        pending += layer->entries[i].size > 0 && lgetxattr(path, LAZY_XATTR, NULL, 0) >= 0;
+    }
+    return pending;
+}
+
+static void record_hot(lazy_layer_t *layer, int entry) {
+    char path[MAX_PATH_LEN];
+    int fd;
+
+    if (layer->entries[entry].hot || hot_list_path(layer->blob_digest, path, sizeof(path)) != 0) {
+        return;
+    }
+    layer->entries[entry].hot = 1;
+
+    fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (fd >= 0) {
+        dprintf(fd, "%s\n", layer->entries[entry].name);
+        close(fd);
+    }
+}
+
+static void finish_fill(lazy_watch_t *watch, int filled, long long bytes) {
+    if (filled != 1) {
+        return;
+    }
+    pthread_mutex_lock(&watch->lock);
+    watch->pending--;
+    watch->fetched_files++;
+    watch->fetched_bytes += bytes;
+    pthread_mutex_unlock(&watch->lock);
+}
+
+int lazy_watch_prepare(const char *const *layer_ids, int layer_count, lazy_watch_t **out) {
+    lazy_watch_t *watch;
+
+    *out = NULL;
+    watch = calloc(1, sizeof(lazy_watch_t));
+    if (!watch || !(watch->layers = calloc(layer_count, sizeof(lazy_layer_t)))) {
+        free(watch);
+        return -1;
+    }
+    watch->fanotify_fd = -1;
+    pthread_mutex_init(&watch->lock, NULL);
+
+    for (int i = 0; i < layer_count; i++) {
+        if (!lazy_layer_pending(layer_ids[i])) {
+            continue;
+        }
+        if (lazy_load_layer(layer_ids[i], &watch->layers[watch->layer_count]) != 0) {
+            lazy_watch_abort(watch);
+            return -1;
+        }
+        watch->pending += pending_entries(&watch->layers[watch->layer_count]);
+        watch->layer_count++;
+    }
+
+    if (watch->pending == 0) {
+        lazy_watch_abort(watch);
+        return 0;
+    }
+
+    // Without permission events the files have to be there before start
+    watch->fanotify_fd = fanotify_init(FAN_CLASS_CONTENT | FAN_CLOEXEC, O_RDONLY | O_LARGEFILE);
+    if (watch->fanotify_fd < 0) {
+        perror("fanotify_init");
+        for (int i = 0; i < watch->layer_count; i++) {
+            if (lazy_complete_layer(watch->layers[i].layer_id) != 0) {
+                lazy_watch_abort(watch);
+                return -1;
+            }
+        }
+        lazy_watch_abort(watch);
+        return 0;
+    }
+
+    *out = watch;
+    return 0;
+}
+
+// Runs in the container before pivot_root: every open on the container's
+// root filesystem waits for the daemon's answer
+int lazy_watch_mark(int fanotify_fd, const char *rootfs) {
+    if (fanotify_mark(fanotify_fd, FAN_MARK_ADD | FAN_MARK_FILESYSTEM, FAN_OPEN_PERM | FAN_OPEN_EXEC_PERM,
+                      AT_FDCWD, rootfs) != 0) {
+        perror("fanotify_mark");
+        return -1;
+    }
+    return 0;
+}
+
+static lazy_layer_t* find_layer(lazy_watch_t *watch, const char *layer_id) {
+    for (int i = 0; i < watch->layer_count; i++) {
+        if (strcmp(watch->layers[i].layer_id, layer_id) == 0) {
+            return &watch->layers[i];
+        }
+    }
+    return NULL;
+}
+
+// Answers one open: files still pending are fetched before the opener
+// may go on, and are remembered as hot for the next start
+static int serve_open(lazy_watch_t *watch, int fd) {
+    char value[MAX_LAYER_ID_LEN + 16];
+    char layer_id[MAX_LAYER_ID_LEN];
+    lazy_layer_t *layer;
+    long long bytes = 0;
+    ssize_t len;
+    int entry;
+
+    len = fgetxattr(fd, LAZY_XATTR, value, sizeof(value) - 1);
+    if (len <= 0) {
+        return FAN_ALLOW;
+    }
+    value[len] = '\0';
+
+    if (sscanf(value, "%63s %d", layer_id, &entry) != 2 || !(layer = find_layer(watch, layer_id)) ||
+        entry < 0 || entry >= layer->count) {
+        return FAN_ALLOW;
+    }
+
+    int filled = lazy_fill_entry(layer, entry, &bytes);
+    if (filled < 0) {
+        return FAN_DENY;
+    }
+    finish_fill(watch, filled, bytes);
+
+    pthread_mutex_lock(&watch->lock);
+    record_hot(layer, entry);
+    pthread_mutex_unlock(&watch->lock);
+    return FAN_ALLOW;
+}
+
+// A container that has exited (or is waiting to be reaped) needs no more
+// answers
+static int container_alive(pid_t pid) {
+    char path[64];
+    char stat[256];
+    FILE *fp;
+    char *p;
+
+    snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+    fp = fopen(path, "r");
+    if (!fp) {
+        return 0;
+    }
+    p = fgets(stat, sizeof(stat), fp);
+    fclose(fp);
+
+    p = p ? strrchr(stat, ')') : NULL;
+    return p && p[1] == ' ' && p[2] != 'Z' && p[2] != 'X';
+}
+
+static void* prefetch_worker(void *arg) {
+    lazy_watch_t *watch = arg;
+
+    for (;;) {
+        lazy_layer_t *layer = NULL;
+        int entry = -1;
+
+        pthread_mutex_lock(&watch->lock);
+        while (!watch->stopping && watch->next_prefetch_layer < watch->layer_count) {
+            lazy_layer_t *candidate = &watch->layers[watch->next_prefetch_layer];
+            if (watch->next_prefetch_entry >= candidate->count) {
+                watch->next_prefetch_layer++;
+                watch->next_prefetch_entry = 0;
+                continue;
+            }
+            int i = watch->next_prefetch_entry++;
+            if (candidate->entries[i].hot && candidate->entries[i].size > 0) {
+                layer = candidate;
+                entry = i;
+                break;
+            }
+        }
+        pthread_mutex_unlock(&watch->lock);
+
+        if (!layer) {
+            return NULL;
+        }
+
+        long long bytes = 0;
+        int filled = lazy_fill_entry(layer, entry, &bytes);
+        finish_fill(watch, filled, bytes);
+    }
+}
+
+static void* watch_thread(void *arg) {
+    lazy_watch_t *watch = arg;
+    char buffer[4096];
+
+    for (;;) {
+        struct pollfd pfd = { watch->fanotify_fd, POLLIN, 0 };
+        int ready = poll(&pfd, 1, 500);
+
+        pthread_mutex_lock(&watch->lock);
+        int pending = watch->pending;
+        pthread_mutex_unlock(&watch->lock);
+
+        if (ready < 0 && errno != EINTR) {
+            perror("poll fanotify");
+            break;
+        }
+        if (ready <= 0) {
+            if (pending <= 0 || !container_alive(watch->pid)) {
+                break;
+            }
+            continue;
+        }
+
+        ssize_t n = read(watch->fanotify_fd, buffer, sizeof(buffer));
+        if (n < 0) {
+            if (errno == EINTR || errno == EAGAIN) continue;
+            perror("read fanotify");
+            break;
+        }
+
+        struct fanotify_event_metadata *event = (struct fanotify_event_metadata*)buffer;
+        for (; FAN_EVENT_OK(event, n); event = FAN_EVENT_NEXT(event, n)) {
+            if (event->fd < 0) {
+                continue;
+            }
+            struct fanotify_response response = { event->fd, serve_open(watch, event->fd) };
+            if (write(watch->fanotify_fd, &response, sizeof(response)) != sizeof(response)) {
+                perror("fanotify response");
+            }
+            close(event->fd);
+        }
+    }
+
+    // Closing the group drops the mark; opens still queued are let through
+    pthread_mutex_lock(&watch->lock);
+    watch->stopping = 1;
+    pthread_mutex_unlock(&watch->lock);
+    for (int i = 0; i < watch->prefetcher_count; i++) {
+        pthread_join(watch->prefetchers[i], NULL);
+    }
+
+    printf("Lazy layers: %lld file(s), %lld bytes fetched while container %d ran; %d still pending\n",
+           watch->fetched_files, watch->fetched_bytes, watch->pid, watch->pending);
+    lazy_watch_abort(watch);
+    return NULL;
+}
+
+// Hands the watch to a thread of its own, which frees it once the
+// container is gone or nothing is left to fetch
+int lazy_watch_start(lazy_watch_t *watch, pid_t pid) {
+    pthread_t thread;
+
+    watch->pid = pid;
+    for (int i = 0; i < LAZY_PREFETCH_THREADS; i++) {
+        if (pthread_create(&watch->prefetchers[watch->prefetcher_count], NULL, prefetch_worker, watch) != 0) {
+            break;
+        }
+        watch->prefetcher_count++;
+    }
+
+    if (pthread_create(&thread, NULL, watch_thread, watch) != 0) {
+        perror("pthread_create");
+        watch->stopping = 1;
+        for (int i = 0; i < watch->prefetcher_count; i++) {
+            pthread_join(watch->prefetchers[i], NULL);
+        }
+        lazy_watch_abort(watch);
+        return -1;
+    }
+    pthread_detach(thread);
+    return 0;
+}
+
+void lazy_watch_abort(lazy_watch_t *watch) {
+    if (!watch) return;
+    if (watch->fanotify_fd >= 0) {
+        close(watch->fanotify_fd);
+    }
+    for (int i = 0; i < watch->layer_count; i++) {
+        lazy_free_layer(&watch->layers[i]);
+    }
+    pthread_mutex_destroy(&watch->lock);
+    free(watch->layers);
+    free(watch);
+}
@@ -0,0 +1,81 @@
+#ifndef LAZY_H
+#define LAZY_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "image.h"
+
+// A lazily pulled layer is a tree of sparse placeholders. Each pending file
+// carries LAZY_XATTR ("<layer_id> <entry>") until its contents are fetched
+// from the registry; the layer keeps its file index and the blob it came
+// from in <layer_id>.lazy until nothing is pending.
+#define LAZY_XATTR "user.docker-clone.lazy"
+#define LAZY_STATE_SUFFIX ".lazy"
+
+// Layer descriptors point at their file index with this annotation
+#define LAZY_INDEX_ANNOTATION "io.docker-clone.file-index"
+#define MEDIA_TYPE_FILE_INDEX "application/vnd.docker-clone.file-index.v1+json"
+
+#define LAZY_MAX_INDEX_LEN (64 * 1024 * 1024)
+#define LAZY_PREFETCH_THREADS 2
+
+// Regular file in a layer blob: where its contents are, and their digest
+typedef struct {
+    char *name;
+    long long offset;
+    long long size;
+    time_t mtime;
+    char digest[MAX_DIGEST_LEN];
+    int hot;                    // read during an earlier start
+} lazy_entry_t;
+
+typedef struct {
+    char layer_id[MAX_LAYER_ID_LEN];
+    char source[512];           // host:port/repository@digest of the blob
+    char blob_digest[MAX_DIGEST_LEN];
+    long long blob_size;
+    lazy_entry_t *entries;
+    int count;
+} lazy_layer_t;
+
+// Serves a container's first opens of pending files, and prefetches the
+// files earlier starts needed. Owned by its thread once started.
+typedef struct {
+    int fanotify_fd;
+    pid_t pid;
+    lazy_layer_t *layers;
+    int layer_count;
+    int pending;
+    int stopping;
+    pthread_mutex_t lock;
+    pthread_t thread;
+    pthread_t prefetchers[LAZY_PREFETCH_THREADS];
+    int prefetcher_count;
+    int next_prefetch_layer;
+    int next_prefetch_entry;
+    long long fetched_files;
+    long long fetched_bytes;
+} lazy_watch_t;
+
+// Function declarations
+char* lazy_build_index(const char *layer_id, const char *blob_digest, size_t *len);
+int lazy_create_layer(const char *layer_id, const char *source, const char *blob_digest, long long blob_size,
+                      const char *index, size_t index_len);
+int lazy_layer_pending(const char *layer_id);
+int lazy_complete_layer(const char *layer_id);
+int lazy_watch_prepare(const char *const *layer_ids, int layer_count, lazy_watch_t **watch);
+int lazy_watch_mark(int fanotify_fd, const char *rootfs);
+int lazy_watch_start(lazy_watch_t *watch, pid_t pid);
+void lazy_watch_abort(lazy_watch_t *watch);
+
+// Helper functions
+int lazy_load_layer(const char *layer_id, lazy_layer_t *layer);
+void lazy_free_layer(lazy_layer_t *layer);
+int lazy_fill_entry(lazy_layer_t *layer, int entry, long long *bytes);
+
+#endif // LAZY_H
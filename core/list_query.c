@@ -0,0 +1,354 @@
+#include "list_query.h"
+#include "json.h"
+#include <ctype.h>
+#include <fnmatch.h>
+
+// Labels are accepted for Docker compatibility; no record here carries
+// any, so a label filter matches nothing
+static const char *container_filter_keys[] = { "status", "name", "id", "image", "label", NULL };
+static const char *image_filter_keys[] = { "reference", "id", "label", NULL };
+
+enum {
+    CONTAINER_FIELD_ID, CONTAINER_FIELD_NAMES, CONTAINER_FIELD_IMAGE, CONTAINER_FIELD_IMAGE_ID,
+    CONTAINER_FIELD_COMMAND, CONTAINER_FIELD_CREATED, CONTAINER_FIELD_STATE, CONTAINER_FIELD_STATUS,
+    CONTAINER_FIELD_PID, CONTAINER_FIELD_EXIT_CODE
+};
+static const char *container_fields[] = {
+    "Id", "Names", "Image", "ImageID", "Command", "Created", "State", "Status", "Pid", "ExitCode", NULL
+};
+
+enum {
+    IMAGE_FIELD_ID, IMAGE_FIELD_REPO_TAGS, IMAGE_FIELD_CREATED, IMAGE_FIELD_SIZE
+};
+static const char *image_fields[] = { "Id", "RepoTags", "Created", "Size", NULL };
+
+#define FIELD(n) (1u << (n))
+
+static int key_index(const char **keys, const char *key) {
+    for (int i = 0; keys[i]; i++) {
+        if (strcmp(keys[i], key) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// ----------------------------------------------------------------------------
+// Parsing
+// ----------------------------------------------------------------------------
+
+// Stores one value of filter, unescaped
+static int add_filter_value(list_query_t *query, list_filter_t *filter, const json_value_t *value, size_t *used) {
+    if (filter->count == LIST_MAX_FILTER_VALUES ||
+        json_string_copy(value, query->values + *used, sizeof(query->values) - *used) != 0) {
+        return -1;
+    }
+    filter->values[filter->count++] = query->values + *used;
+    *used += strlen(query->values + *used) + 1;
+    return 0;
+}
+
+// {"key":["value",...],...}; a single string in place of the array is
+// taken too. Values of a repeated key are merged.
+static int parse_filters(const char *json, const char **keys, list_query_t *query, char *error, size_t error_size) {
+    json_value_t root, name, values, value;
+    json_iter_t members, elements;
+    size_t used = 0;
+
+    if (strspn(json, " \t\r\n") == strlen(json)) {
+        return 0;
+    }
+    if (json_parse(json, strlen(json), &root) != 0 || root.type != JSON_OBJECT) {
+        goto invalid;
+    }
+
+    json_iter_init(&root, &members);
+    while (json_iter_next(&members, &name, &values) > 0) {
+        list_filter_t *filter = NULL;
+        char key[32];
+        int index;
+
+        json_string_copy(&name, key, sizeof(key));
+        if ((index = key_index(keys, key)) < 0) {
+            snprintf(error, error_size, "invalid filter '%s'", key);
+            return -1;
+        }
+
+        for (int i = 0; i < query->filter_count; i++) {
+            if (query->filters[i].key == keys[index]) {
+                filter = &query->filters[i];
+            }
+        }
+        if (!filter) {
+            filter = &query->filters[query->filter_count++];
+            filter->key = keys[index];
+        }
+
+        if (values.type == JSON_STRING) {
+            if (add_filter_value(query, filter, &values, &used) != 0) {
+                goto too_many;
+            }
+            continue;
+        }
+        if (values.type != JSON_ARRAY) {
+            goto invalid;
+        }
+        json_iter_init(&values, &elements);
+        while (json_iter_next(&elements, NULL, &value) > 0) {
+            if (value.type != JSON_STRING) {
+                goto invalid;
+            }
+            if (add_filter_value(query, filter, &value, &used) != 0) {
+                goto too_many;
+            }
+        }
+    }
+    return 0;
+
+too_many:
+    snprintf(error, error_size, "too many filter values");
+    return -1;
+
+invalid:
+    snprintf(error, error_size, "filters must be a JSON object of string arrays");
+    return -1;
+}
+
+static int parse_fields(const char *list, const char **names, unsigned int *fields, char *error, size_t error_size) {
+    char copy[LIST_MAX_FIELDS_LEN];
+    char *saveptr, *name;
+
+    *fields = 0;
+    snprintf(copy, sizeof(copy), "%s", list);
+    for (name = strtok_r(copy, ",", &saveptr); name; name = strtok_r(NULL, ",", &saveptr)) {
+        int index = key_index(names, name);
+        if (index < 0) {
+            snprintf(error, error_size, "unknown field '%s'", name);
+            return -1;
+        }
+        *fields |= FIELD(index);
+    }
+    if (*fields == 0) {
+        *fields = ~0u;
+    }
+    return 0;
+}
+
+// Any argument may be NULL or empty for its default: no filters, every
+// field, no limit, from the first record. error gets the reason on -1.
+int parse_list_query(list_kind_t kind, const char *filters, const char *fields, const char *limit,
+                     const char *cursor, list_query_t *query, char *error, size_t error_size) {
+    int containers = kind == LIST_CONTAINERS;
+
+    memset(query, 0, sizeof(*query));
+    query->kind = kind;
+
+    if (filters && parse_filters(filters, containers ? container_filter_keys : image_filter_keys,
+                                 query, error, error_size) != 0) {
+        return -1;
+    }
+    if (parse_fields(fields ? fields : "", containers ? container_fields : image_fields,
+                     &query->fields, error, error_size) != 0) {
+        return -1;
+    }
+    // The key has to come back for the client to ask for the next page
+    query->fields |= FIELD(containers ? CONTAINER_FIELD_ID : IMAGE_FIELD_REPO_TAGS);
+
+    if (limit && limit[0]) {
+        char *end;
+        long value = strtol(limit, &end, 10);
+        if (*end != '\0' || value < 0 || value > 1000000) {
+            snprintf(error, error_size, "limit must be a number from 0 to 1000000");
+            return -1;
+        }
+        query->limit = (int)value;
+    }
+    if (cursor) {
+        if (strlen(cursor) >= sizeof(query->cursor)) {
+            snprintf(error, error_size, "cursor is too long");
+            return -1;
+        }
+        snprintf(query->cursor, sizeof(query->cursor), "%s", cursor);
+    }
+    return 0;
+}
+
+// ----------------------------------------------------------------------------
+// Matching
+// ----------------------------------------------------------------------------
+
+static int container_value_matches(const char *key, const char *value, const container_record_t *container) {
+    if (strcmp(key, "status") == 0) {
+        return strcmp(value, container_state_name(container->state)) == 0;
+    } else if (strcmp(key, "name") == 0) {
+        return strstr(container->name, value) != NULL;
+    } else if (strcmp(key, "id") == 0) {
+        return value[0] && strncmp(container->id, value, strlen(value)) == 0;
+    } else if (strcmp(key, "image") == 0) {
+        return strcmp(value, container->image) == 0 || strcmp(value, container->image_id) == 0;
+    }
+    return 0;
+}
+
+// Values of one key are alternatives, and every key given has to match
+int container_matches_query(const list_query_t *query, const container_record_t *container) {
+    for (int i = 0; i < query->filter_count; i++) {
+        const list_filter_t *filter = &query->filters[i];
+        int matched = filter->count == 0;
+
+        for (int j = 0; j < filter->count && !matched; j++) {
+            matched = container_value_matches(filter->key, filter->values[j], container);
+        }
+        if (!matched) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static int image_value_matches(const char *key, const char *value, const char *full_name, const image_info_t *image) {
+    if (strcmp(key, "reference") == 0) {
+        return fnmatch(value, full_name, 0) == 0 || fnmatch(value, image->name, 0) == 0;
+    } else if (strcmp(key, "id") == 0) {
+        const char *hex = strncmp(image->id, "sha256:", 7) == 0 ? image->id + 7 : image->id;
+        return value[0] && (strncmp(image->id, value, strlen(value)) == 0 ||
+                            strncmp(hex, value, strlen(value)) == 0);
+    }
+    return 0;
+}
+
+int image_matches_query(const list_query_t *query, const char *full_name, const image_info_t *image) {
+    for (int i = 0; i < query->filter_count; i++) {
+        const list_filter_t *filter = &query->filters[i];
+        int matched = filter->count == 0;
+
+        for (int j = 0; j < filter->count && !matched; j++) {
+            matched = image_value_matches(filter->key, filter->values[j], full_name, image);
+        }
+        if (!matched) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// ----------------------------------------------------------------------------
+// Serialization
+// ----------------------------------------------------------------------------
+
+// Unix seconds, or an RFC 3339 time as pulled image configs have it
+static long long created_seconds(const char *created) {
+    struct tm tm;
+    char *end;
+    long long seconds = strtoll(created, &end, 10);
+
+    if (*end == '\0') {
+        return seconds;
+    }
+    memset(&tm, 0, sizeof(tm));
+    if (strptime(created, "%Y-%m-%dT%H:%M:%S", &tm)) {
+        return (long long)timegm(&tm);
+    }
+    return 0;
+}
+
+static void write_status(json_writer_t *w, const container_record_t *container) {
+    char status[64];
+
+    switch (container->state) {
+        case CONTAINER_STATE_RUNNING:
+            snprintf(status, sizeof(status), "Up");
+            break;
+        case CONTAINER_STATE_EXITED:
+            snprintf(status, sizeof(status), "Exited (%d)", container->exit_code);
+            break;
+        default:
+            snprintf(status, sizeof(status), "%s", container_state_name(container->state));
+            status[0] = toupper((unsigned char)status[0]);
+            break;
+    }
+    json_write_string(w, status);
+}
+
+// One record as a JSON object with the query's fields. Returns its length,
+// or -1 when it does not fit in size.
+int write_container_entry(const list_query_t *query, const container_record_t *container, char *out, size_t size) {
+    json_writer_t w;
+    unsigned int fields = query->fields;
+
+    json_writer_init(&w, out, size, NULL, NULL);
+    json_write_object_begin(&w);
+    if (fields & FIELD(CONTAINER_FIELD_ID)) {
+        json_write_key(&w, "Id");
+        json_write_string(&w, container->id);
+    }
+    if (fields & FIELD(CONTAINER_FIELD_NAMES)) {
+        json_write_key(&w, "Names");
+        json_write_array_begin(&w);
+        json_write_string(&w, container->name);
+        json_write_array_end(&w);
+    }
+    if (fields & FIELD(CONTAINER_FIELD_IMAGE)) {
+        json_write_key(&w, "Image");
+        json_write_string(&w, container->image);
+    }
+    if (fields & FIELD(CONTAINER_FIELD_IMAGE_ID)) {
+        json_write_key(&w, "ImageID");
+        json_write_string(&w, container->image_id);
+    }
+    if (fields & FIELD(CONTAINER_FIELD_COMMAND)) {
+        json_write_key(&w, "Command");
+        json_write_string(&w, container->command);
+    }
+    if (fields & FIELD(CONTAINER_FIELD_CREATED)) {
+        json_write_key(&w, "Created");
+        json_write_ll(&w, container->created);
+    }
+    if (fields & FIELD(CONTAINER_FIELD_STATE)) {
+        json_write_key(&w, "State");
+        json_write_string(&w, container_state_name(container->state));
+    }
+    if (fields & FIELD(CONTAINER_FIELD_STATUS)) {
+        json_write_key(&w, "Status");
+        write_status(&w, container);
+    }
+    if (fields & FIELD(CONTAINER_FIELD_PID)) {
+        json_write_key(&w, "Pid");
+        json_write_ll(&w, container->state == CONTAINER_STATE_RUNNING ? container->pid : 0);
+    }
+    if (fields & FIELD(CONTAINER_FIELD_EXIT_CODE)) {
+        json_write_key(&w, "ExitCode");
+        json_write_ll(&w, container->exit_code);
+    }
+    json_write_object_end(&w);
+    return (int)json_writer_finish(&w);
+}
+
+int write_image_entry(const list_query_t *query, const char *full_name, const image_info_t *image,
+                      char *out, size_t size) {
+    json_writer_t w;
+    unsigned int fields = query->fields;
+
+    json_writer_init(&w, out, size, NULL, NULL);
+    json_write_object_begin(&w);
+    if (fields & FIELD(IMAGE_FIELD_ID)) {
+        json_write_key(&w, "Id");
+        json_write_string(&w, image->id);
+    }
+    if (fields & FIELD(IMAGE_FIELD_REPO_TAGS)) {
+        json_write_key(&w, "RepoTags");
+        json_write_array_begin(&w);
+        json_write_string(&w, full_name);
+        json_write_array_end(&w);
+    }
+    if (fields & FIELD(IMAGE_FIELD_CREATED)) {
+        json_write_key(&w, "Created");
+        json_write_ll(&w, created_seconds(image->created));
+    }
+    if (fields & FIELD(IMAGE_FIELD_SIZE)) {
+        json_write_key(&w, "Size");
+        json_write_ll(&w, strtoll(image->size, NULL, 10));
+    }
+    json_write_object_end(&w);
+    return (int)json_writer_finish(&w);
+}
@@ -0,0 +1,55 @@
+#ifndef LIST_QUERY_H
+#define LIST_QUERY_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "container.h"
+
+// What a GET /containers/json or /images/json asks for: Docker-style
+// filters, the fields to return, and a page. Everything is parsed once up
+// front and then checked against records straight out of the in-memory
+// indexes, so a listing never copies the records it skips.
+//
+// Pages are keyset pages: records come out in key order (container id,
+// image name:tag) and cursor is the key of the last record of the previous
+// page. The key is returned even when fields leaves it out.
+#define LIST_PAGE_SIZE 256              // records serialized per hold of an index lock
+#define LIST_SCAN_SIZE 4096             // records looked at per hold of an index lock
+#define LIST_MAX_FILTER_VALUES 16
+#define LIST_MAX_FIELDS_LEN 256
+#define LIST_MAX_CURSOR_LEN (MAX_IMAGE_NAME_LEN + MAX_IMAGE_TAG_LEN + 2)
+#define LIST_MAX_ENTRY_SIZE 8192        // one record serialized
+
+typedef enum {
+    LIST_CONTAINERS,
+    LIST_IMAGES
+} list_kind_t;
+
+typedef struct {
+    const char *key;                    // one of the kind's filter keys
+    const char *values[LIST_MAX_FILTER_VALUES];
+    int count;
+} list_filter_t;
+
+typedef struct {
+    list_kind_t kind;
+    list_filter_t filters[8];
+    int filter_count;
+    char values[1024];                  // the filter values, NUL separated
+    unsigned int fields;                // bit per field; all when none were asked for
+    int limit;                          // 0 for no limit
+    char cursor[LIST_MAX_CURSOR_LEN];
+} list_query_t;
+
+// Function declarations
+int parse_list_query(list_kind_t kind, const char *filters, const char *fields, const char *limit,
+                     const char *cursor, list_query_t *query, char *error, size_t error_size);
+int container_matches_query(const list_query_t *query, const container_record_t *container);
+int image_matches_query(const list_query_t *query, const char *full_name, const image_info_t *image);
+int write_container_entry(const list_query_t *query, const container_record_t *container, char *out, size_t size);
+int write_image_entry(const list_query_t *query, const char *full_name, const image_info_t *image,
+                      char *out, size_t size);
+
+#endif // LIST_QUERY_H
@@ -0,0 +1,749 @@
+#include "lz.h"
+#include <errno.h>
+#include <unistd.h>
+
+#define LZ_MIN_MATCH 4
+#define LZ_LAST_LITERALS 5
+#define LZ_MFLIMIT 12
+#define LZ_MAX_OFFSET 65535
+#define LZ_SKIP_TRIGGER 6
+
+static uint32_t read32(const uint8_t *p) {
+    uint32_t value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+static uint64_t read64(const uint8_t *p) {
+    uint64_t value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+static uint32_t hash_sequence(uint32_t sequence) {
+    return (sequence * 2654435761u) >> (32 - LZ_HASH_LOG);
+}
+
+static void put_le32(uint8_t *p, uint32_t value) {
+    p[0] = value & 0xff;
+    p[1] = (value >> 8) & 0xff;
+    p[2] = (value >> 16) & 0xff;
+    p[3] = value >> 24;
+}
+
+static uint32_t get_le32(const uint8_t *p) {
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+// Length of the common prefix of a and b, stopping at limit
+static size_t match_length(const uint8_t *a, const uint8_t *b, const uint8_t *limit) {
+    const uint8_t *start = a;
+
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    while (a + 8 <= limit) {
+        uint64_t diff = read64(a) ^ read64(b);
+        if (diff) {
+            return a - start + (__builtin_ctzll(diff) >> 3);
+        }
+        a += 8;
+        b += 8;
+    }
+#endif
+    while (a < limit && *a == *b) {
+        a++;
+        b++;
+    }
+    return a - start;
+}
+
+static uint8_t* write_length(uint8_t *op, size_t len) {
+    while (len >= 255) {
+        *op++ = 255;
+        len -= 255;
+    }
+    *op++ = (uint8_t)len;
+    return op;
+}
+
+size_t lz_compress_bound(size_t len) {
+    return len + len / 255 + 16;
+}
+
+// Greedy LZ4 block encoder with a single-entry hash table. Returns the
+// compressed size, or 0 when the output would not fit in dst_size.
+size_t lz_compress_block(const void *source, size_t len, void *dest, size_t dst_size, uint32_t *table) {
+    const uint8_t *src = source;
+    const uint8_t *ip = src;
+    const uint8_t *anchor = src;
+    const uint8_t *end = src + len;
+    uint8_t *op = dest;
+    uint8_t *oend = op + dst_size;
+
+    if (len > LZ_MFLIMIT) {
+        const uint8_t *match_limit = end - LZ_MFLIMIT;
+        const uint8_t *copy_limit = end - LZ_LAST_LITERALS;
+        unsigned int misses = 1 << LZ_SKIP_TRIGGER;
+
+        memset(table, 0, LZ_TABLE_SIZE);
+        ip++;
+
+        while (ip < match_limit) {
+            uint32_t sequence = read32(ip);
+            uint32_t hash = hash_sequence(sequence);
+            const uint8_t *ref = src + table[hash];
+
+            table[hash] = ip - src;
+            if (ref >= ip || ip - ref > LZ_MAX_OFFSET || read32(ref) != sequence) {
+                // Skip ahead faster the longer nothing matches
+                ip += misses++ >> LZ_SKIP_TRIGGER;
+                continue;
+            }
+            misses = 1 << LZ_SKIP_TRIGGER;
+
+            while (ip > anchor && ref > src && ip[-1] == ref[-1]) {
+                ip--;
+                ref--;
+            }
+
+            size_t literals = ip - anchor;
+            size_t match = match_length(ip + LZ_MIN_MATCH, ref + LZ_MIN_MATCH, copy_limit);
+
+            if (op + 1 + literals + literals / 255 + 2 + match / 255 + 1 + LZ_LAST_LITERALS > oend) {
+                return 0;
+            }
+
+            uint8_t *token = op++;
+            if (literals >= 15) {
+                *token = 15 << 4;
+                op = write_length(op, literals - 15);
+            } else {
+                *token = literals << 4;
+            }
+            memcpy(op, anchor, literals);
+            op += literals;
+
+            size_t offset = ip - ref;
+            *op++ = offset & 0xff;
+            *op++ = offset >> 8;
+
+            if (match >= 15) {
+                *token |= 15;
+                op = write_length(op, match - 15);
+            } else {
+                *token |= match;
+            }
+
+            ip += match + LZ_MIN_MATCH;
+            anchor = ip;
+
+            if (ip < match_limit) {
+                table[hash_sequence(read32(ip - 2))] = ip - 2 - src;
+            }
+        }
+    }
+
+    size_t literals = end - anchor;
+    if (op + 1 + literals + literals / 255 + 1 > oend) {
+        return 0;
+    }
+
+    uint8_t *token = op++;
+    if (literals >= 15) {
+        *token = 15 << 4;
+        op = write_length(op, literals - 15);
+    } else {
+        *token = literals << 4;
+    }
+    memcpy(op, anchor, literals);
+    op += literals;
+
+    return op - (uint8_t*)dest;
+}
+
+static int read_length(const uint8_t **ip, const uint8_t *iend, size_t *len) {
+    uint8_t byte;
+
+    do {
+        if (*ip >= iend) {
+            return -1;
+        }
+        byte = *(*ip)++;
+        *len += byte;
+    } while (byte == 255);
+    return 0;
+}
+
+// Decodes one block, rejecting anything that would read or write out of
+// bounds. Returns the decompressed size or -1 for corrupt input.
+ssize_t lz_decompress_block(const void *source, size_t len, void *dest, size_t dst_size) {
+    const uint8_t *ip = source;
+    const uint8_t *iend = ip + len;
+    uint8_t *op = dest;
+    uint8_t *oend = op + dst_size;
+
+    while (ip < iend) {
+        uint8_t token = *ip++;
+        size_t literals = token >> 4;
+
+        if (literals == 15 && read_length(&ip, iend, &literals) != 0) {
+            return -1;
+        }
+        if (literals > (size_t)(iend - ip) || literals > (size_t)(oend - op)) {
+            return -1;
+        }
+        if (iend - ip >= 32 && oend - op >= 32 && literals <= 32) {
+            // Short runs are copied in fixed 32 byte moves; the spill past
+            // the run is overwritten by what follows it
+            memcpy(op, ip, 32);
+        } else {
+            memcpy(op, ip, literals);
+        }
+        op += literals;
+        ip += literals;
+
+        // The last sequence is literals only
+        if (ip == iend) {
+            break;
+        }
+
+        if (iend - ip < 2) {
+            return -1;
+        }
+        size_t offset = ip[0] | (ip[1] << 8);
+        ip += 2;
+        if (offset == 0 || offset > (size_t)(op - (uint8_t*)dest)) {
+            return -1;
+        }
+
+        size_t match = token & 15;
+        if (match == 15 && read_length(&ip, iend, &match) != 0) {
+            return -1;
+        }
+        match += LZ_MIN_MATCH;
+        if (match > (size_t)(oend - op)) {
+            return -1;
+        }
+
+        const uint8_t *ref = op - offset;
+        uint8_t *mend = op + match;
+        if (offset >= 16 && (size_t)(oend - mend) >= 16) {
+            // 16 byte moves never read bytes they have not written yet, and
+            // the room check keeps the overshoot inside the block
+            do {
+                memcpy(op, ref, 16);
+                op += 16;
+                ref += 16;
+            } while (op < mend);
+            op = mend;
+            continue;
+        }
+        if (offset >= 8) {
+            // Copies of 8 never overlap their own source here
+            while (match >= 8) {
+                memcpy(op, ref, 8);
+                op += 8;
+                ref += 8;
+                match -= 8;
+            }
+        }
+        while (match > 0) {
+            *op++ = *ref++;
+            match--;
+        }
+    }
+
+    return op - (uint8_t*)dest;
+}
+
+// ---------------------------------------------------------------------------
+// Block-parallel batches
+
+static void process_block(lz_pool_t *pool, lz_block_t *block, uint32_t *table, size_t block_size) {
+    if (pool->decompress) {
+        if (block->stored) {
+            if (block->packed_len > block_size) {
+                block->failed = 1;
+                return;
+            }
+            memcpy(block->raw, block->packed, block->packed_len);
+            block->raw_len = block->packed_len;
+        } else {
+            ssize_t n = lz_decompress_block(block->packed, block->packed_len, block->raw, block_size);
+            block->failed = n < 0;
+            block->raw_len = n < 0 ? 0 : (size_t)n;
+        }
+        return;
+    }
+
+    // Incompressible blocks are stored as they are
+    block->packed_len = lz_compress_block(block->raw, block->raw_len, block->packed, block->raw_len, table);
+    block->stored = block->packed_len == 0;
+    if (block->stored) {
+        memcpy(block->packed, block->raw, block->raw_len);
+        block->packed_len = block->raw_len;
+    }
+}
+
+typedef struct {
+    lz_pool_t *pool;
+    int index;
+    size_t block_size;
+} lz_worker_arg_t;
+
+static void run_jobs(lz_pool_t *pool, int slot, size_t block_size) {
+    pthread_mutex_lock(&pool->lock);
+    while (pool->next < pool->count) {
+        int job = pool->next++;
+        pthread_mutex_unlock(&pool->lock);
+
+        process_block(pool, &pool->blocks[job], pool->tables[slot], block_size);
+
+        pthread_mutex_lock(&pool->lock);
+        if (++pool->finished == pool->count) {
+            pthread_cond_signal(&pool->work_done);
+        }
+    }
+    pthread_mutex_unlock(&pool->lock);
+}
+
+static void* pool_worker(void *arg) {
+    lz_worker_arg_t *worker = arg;
+    lz_pool_t *pool = worker->pool;
+    unsigned int seen = 0;
+
+    for (;;) {
+        pthread_mutex_lock(&pool->lock);
+        while (!pool->shutdown && pool->generation == seen) {
+            pthread_cond_wait(&pool->work_ready, &pool->lock);
+        }
+        if (pool->shutdown) {
+            pthread_mutex_unlock(&pool->lock);
+            break;
+        }
+        seen = pool->generation;
+        pthread_mutex_unlock(&pool->lock);
+
+        run_jobs(pool, worker->index, worker->block_size);
+    }
+
+    free(worker);
+    return NULL;
+}
+
+static int pool_init(lz_pool_t *pool, lz_block_t *blocks, int threads, size_t block_size) {
+    memset(pool, 0, sizeof(lz_pool_t));
+    pool->blocks = blocks;
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->work_ready, NULL);
+    pthread_cond_init(&pool->work_done, NULL);
+
+    pool->tables = calloc(threads, sizeof(uint32_t*));
+    if (!pool->tables) {
+        return -1;
+    }
+    for (int i = 0; i < threads; i++) {
+        if (!(pool->tables[i] = malloc(LZ_TABLE_SIZE))) {
+            return -1;
+        }
+    }
+
+    if (threads > 1) {
+        pool->workers = calloc(threads - 1, sizeof(pthread_t));
+        if (!pool->workers) {
+            return -1;
+        }
+    }
+
+    for (int i = 1; i < threads; i++) {
+        lz_worker_arg_t *worker = malloc(sizeof(lz_worker_arg_t));
+        if (!worker) {
+            return -1;
+        }
+        worker->pool = pool;
+        worker->index = i;
+        worker->block_size = block_size;
+        if (pthread_create(&pool->workers[pool->worker_count], NULL, pool_worker, worker) != 0) {
+            free(worker);
+            return -1;
+        }
+        pool->worker_count++;
+    }
+    return 0;
+}
+
+static int pool_run(lz_pool_t *pool, int count, int decompress, size_t block_size) {
+    pthread_mutex_lock(&pool->lock);
+    pool->count = count;
+    pool->next = 0;
+    pool->finished = 0;
+    pool->decompress = decompress;
+    pool->generation++;
+    pthread_cond_broadcast(&pool->work_ready);
+    pthread_mutex_unlock(&pool->lock);
+
+    run_jobs(pool, 0, block_size);
+
+    pthread_mutex_lock(&pool->lock);
+    while (pool->finished < pool->count) {
+        pthread_cond_wait(&pool->work_done, &pool->lock);
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    for (int i = 0; i < count; i++) {
+        if (pool->blocks[i].failed) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static void pool_destroy(lz_pool_t *pool, int threads) {
+    pthread_mutex_lock(&pool->lock);
+    pool->shutdown = 1;
+    pthread_cond_broadcast(&pool->work_ready);
+    pthread_mutex_unlock(&pool->lock);
+
+    for (int i = 0; i < pool->worker_count; i++) {
+        pthread_join(pool->workers[i], NULL);
+    }
+
+    if (pool->tables) {
+        for (int i = 0; i < threads; i++) {
+            free(pool->tables[i]);
+        }
+    }
+    free(pool->tables);
+    free(pool->workers);
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->work_ready);
+    pthread_cond_destroy(&pool->work_done);
+}
+
+static lz_block_t* alloc_blocks(int count, size_t block_size) {
+    lz_block_t *blocks = calloc(count, sizeof(lz_block_t));
+
+    if (!blocks) {
+        return NULL;
+    }
+    for (int i = 0; i < count; i++) {
+        blocks[i].raw = malloc(block_size);
+        blocks[i].packed = malloc(lz_compress_bound(block_size));
+        if (!blocks[i].raw || !blocks[i].packed) {
+            for (int j = 0; j <= i; j++) {
+                free(blocks[j].raw);
+                free(blocks[j].packed);
+            }
+            free(blocks);
+            return NULL;
+        }
+    }
+    return blocks;
+}
+
+static void free_blocks(lz_block_t *blocks, int count) {
+    if (!blocks) return;
+    for (int i = 0; i < count; i++) {
+        free(blocks[i].raw);
+        free(blocks[i].packed);
+    }
+    free(blocks);
+}
+
+int lz_default_threads(void) {
+    const char *env = getenv(LZ_THREADS_ENV);
+    long threads = env ? atol(env) : sysconf(_SC_NPROCESSORS_ONLN);
+
+    if (threads < 1) threads = 1;
+    if (threads > LZ_MAX_THREADS) threads = LZ_MAX_THREADS;
+    return (int)threads;
+}
+
+int lz_is_frame(const void *data, size_t len) {
+    return len >= LZ_MAGIC_LEN && memcmp(data, LZ_MAGIC, LZ_MAGIC_LEN) == 0;
+}
+
+// ---------------------------------------------------------------------------
+// Writer
+
+lz_writer_t* lz_writer_open(lz_write_fn write, void *ctx, int threads) {
+    lz_writer_t *writer;
+
+    if (threads <= 0) threads = lz_default_threads();
+    if (threads > LZ_MAX_THREADS) threads = LZ_MAX_THREADS;
+
+    writer = calloc(1, sizeof(lz_writer_t));
+    if (!writer) {
+        perror("calloc");
+        return NULL;
+    }
+
+    writer->write = write;
+    writer->ctx = ctx;
+    writer->block_size = (size_t)1 << LZ_BLOCK_LOG;
+    writer->block_count = threads;
+    writer->blocks = alloc_blocks(threads, writer->block_size);
+    if (!writer->blocks) {
+        perror("malloc");
+        free(writer);
+        return NULL;
+    }
+
+    if (pool_init(&writer->pool, writer->blocks, threads, writer->block_size) != 0) {
+        fprintf(stderr, "lz: failed to set up %d compression thread(s)\n", threads);
+        pool_destroy(&writer->pool, threads);
+        free_blocks(writer->blocks, threads);
+        free(writer);
+        return NULL;
+    }
+    return writer;
+}
+
+static int flush_blocks(lz_writer_t *writer) {
+    uint8_t header[LZ_FRAME_HEADER_LEN];
+
+    if (writer->failed) {
+        return -1;
+    }
+
+    if (!writer->header_written) {
+        memcpy(header, LZ_MAGIC, LZ_MAGIC_LEN);
+        header[4] = LZ_VERSION;
+        header[5] = LZ_BLOCK_LOG;
+        header[6] = header[7] = 0;
+        if (writer->write(writer->ctx, header, sizeof(header)) != 0) {
+            writer->failed = 1;
+            return -1;
+        }
+        writer->header_written = 1;
+    }
+
+    if (writer->filled == 0) {
+        return 0;
+    }
+
+    pool_run(&writer->pool, writer->filled, 0, writer->block_size);
+
+    for (int i = 0; i < writer->filled; i++) {
+        lz_block_t *block = &writer->blocks[i];
+
+        put_le32(header, block->packed_len | (block->stored ? LZ_BLOCK_STORED : 0));
+        if (writer->write(writer->ctx, header, 4) != 0 ||
+            writer->write(writer->ctx, block->packed, block->packed_len) != 0) {
+            writer->failed = 1;
+            return -1;
+        }
+        block->raw_len = 0;
+    }
+
+    writer->filled = 0;
+    return 0;
+}
+
+int lz_write(lz_writer_t *writer, const void *data, size_t len) {
+    const uint8_t *p = data;
+
+    while (len > 0) {
+        if (writer->filled == 0 || writer->blocks[writer->filled - 1].raw_len == writer->block_size) {
+            if (writer->filled == writer->block_count && flush_blocks(writer) != 0) {
+                return -1;
+            }
+            writer->blocks[writer->filled++].raw_len = 0;
+        }
+
+        lz_block_t *block = &writer->blocks[writer->filled - 1];
+        size_t n = writer->block_size - block->raw_len;
+        if (n > len) n = len;
+
+        memcpy(block->raw + block->raw_len, p, n);
+        block->raw_len += n;
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+int lz_writer_close(lz_writer_t *writer) {
+    uint8_t end_mark[4] = { 0, 0, 0, 0 };
+    int result;
+
+    if (!writer) {
+        return -1;
+    }
+
+    result = flush_blocks(writer);
+    if (result == 0 && writer->write(writer->ctx, end_mark, sizeof(end_mark)) != 0) {
+        result = -1;
+    }
+
+    pool_destroy(&writer->pool, writer->block_count);
+    free_blocks(writer->blocks, writer->block_count);
+    free(writer);
+    return result;
+}
+
+// ---------------------------------------------------------------------------
+// Reader
+
+static int read_exact(lz_reader_t *reader, void *buf, size_t len) {
+    uint8_t *p = buf;
+
+    while (len > 0) {
+        ssize_t n = reader->read(reader->ctx, p, len);
+        if (n <= 0) {
+            return -1;
+        }
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+lz_reader_t* lz_reader_open(lz_read_fn read, void *ctx, int threads) {
+    lz_reader_t *reader;
+
+    if (threads <= 0) threads = lz_default_threads();
+    if (threads > LZ_MAX_THREADS) threads = LZ_MAX_THREADS;
+
+    reader = calloc(1, sizeof(lz_reader_t));
+    if (!reader) {
+        perror("calloc");
+        return NULL;
+    }
+    reader->read = read;
+    reader->ctx = ctx;
+    reader->threads = threads;
+    return reader;
+}
+
+static int read_frame_header(lz_reader_t *reader) {
+    uint8_t header[LZ_FRAME_HEADER_LEN];
+
+    if (read_exact(reader, header, sizeof(header)) != 0 || !lz_is_frame(header, sizeof(header))) {
+        fprintf(stderr, "lz: not a compressed stream\n");
+        return -1;
+    }
+    if (header[4] != LZ_VERSION || header[5] < LZ_MIN_BLOCK_LOG || header[5] > LZ_MAX_BLOCK_LOG) {
+        fprintf(stderr, "lz: unsupported stream version %d\n", header[4]);
+        return -1;
+    }
+
+    reader->block_size = (size_t)1 << header[5];
+    reader->block_count = reader->threads;
+    reader->blocks = alloc_blocks(reader->block_count, reader->block_size);
+    if (!reader->blocks || pool_init(&reader->pool, reader->blocks, reader->threads, reader->block_size) != 0) {
+        return -1;
+    }
+    return 0;
+}
+
+// Reads the next batch of blocks and decodes them in parallel
+static int load_blocks(lz_reader_t *reader) {
+    uint8_t header[4];
+
+    reader->loaded = 0;
+    reader->current = 0;
+    reader->offset = 0;
+
+    while (reader->loaded < reader->block_count) {
+        lz_block_t *block = &reader->blocks[reader->loaded];
+
+        if (read_exact(reader, header, sizeof(header)) != 0) {
+            fprintf(stderr, "lz: stream truncated\n");
+            return -1;
+        }
+
+        uint32_t length = get_le32(header);
+        if (length == 0) {
+            reader->finished = 1;
+            break;
+        }
+
+        block->stored = (length & LZ_BLOCK_STORED) != 0;
+        block->packed_len = length & ~LZ_BLOCK_STORED;
+        block->failed = 0;
+        if (block->packed_len > lz_compress_bound(reader->block_size) ||
+            read_exact(reader, block->packed, block->packed_len) != 0) {
+            fprintf(stderr, "lz: corrupt or truncated block\n");
+            return -1;
+        }
+        reader->loaded++;
+    }
+
+    if (reader->loaded > 0 && pool_run(&reader->pool, reader->loaded, 1, reader->block_size) != 0) {
+        fprintf(stderr, "lz: corrupt block\n");
+        return -1;
+    }
+    return 0;
+}
+
+ssize_t lz_read(lz_reader_t *reader, void *buf, size_t len) {
+    uint8_t *out = buf;
+    size_t copied = 0;
+
+    if (reader->failed) {
+        return -1;
+    }
+    if (!reader->blocks && read_frame_header(reader) != 0) {
+        reader->failed = 1;
+        return -1;
+    }
+
+    while (copied < len) {
+        if (reader->current >= reader->loaded) {
+            if (reader->finished) {
+                break;
+            }
+            if (load_blocks(reader) != 0) {
+                reader->failed = 1;
+                return -1;
+            }
+            continue;
+        }
+
+        lz_block_t *block = &reader->blocks[reader->current];
+        size_t n = block->raw_len - reader->offset;
+        if (n > len - copied) n = len - copied;
+
+        memcpy(out + copied, block->raw + reader->offset, n);
+        copied += n;
+        reader->offset += n;
+        if (reader->offset == block->raw_len) {
+            reader->current++;
+            reader->offset = 0;
+        }
+    }
+    return copied;
+}
+
+void lz_reader_close(lz_reader_t *reader) {
+    if (!reader) return;
+    if (reader->blocks) {
+        pool_destroy(&reader->pool, reader->threads);
+        free_blocks(reader->blocks, reader->block_count);
+    }
+    free(reader);
+}
+
+ssize_t lz_fd_read(void *ctx, void *buf, size_t len) {
+    ssize_t n;
+
+    do {
+        n = read(*(int*)ctx, buf, len);
+    } while (n < 0 && errno == EINTR);
+    return n;
+}
+
+int lz_fd_write(void *ctx, const void *buf, size_t len) {
+    const char *p = buf;
+
+    while (len > 0) {
+        ssize_t n = write(*(int*)ctx, p, len);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
@@ -0,0 +1,107 @@
+#ifndef LZ_H
+#define LZ_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/types.h>
+
+// Frame layout: "DCLZ", version, log2(block size), two reserved bytes,
+// then blocks of [u32 little-endian length | LZ_BLOCK_STORED][payload]
+// ended by a zero length. Blocks are independent LZ4-format sequences,
+// so a frame can be compressed and decompressed a batch of blocks at a
+// time across threads.
+#define LZ_MAGIC "DCLZ"
+#define LZ_MAGIC_LEN 4
+#define LZ_FRAME_HEADER_LEN 8
+#define LZ_VERSION 1
+#define LZ_BLOCK_LOG 20
+#define LZ_MIN_BLOCK_LOG 16
+#define LZ_MAX_BLOCK_LOG 22
+#define LZ_BLOCK_STORED 0x80000000u
+#define LZ_MAX_THREADS 16
+#define LZ_THREADS_ENV "DOCKER_CLONE_LZ_THREADS"
+
+// lz_compress_block's match finder: 1 << LZ_HASH_LOG table entries
+#define LZ_HASH_LOG 16
+#define LZ_TABLE_SIZE (sizeof(uint32_t) << LZ_HASH_LOG)
+
+typedef ssize_t (*lz_read_fn)(void *ctx, void *buf, size_t len);
+typedef int (*lz_write_fn)(void *ctx, const void *buf, size_t len);
+
+typedef struct {
+    uint8_t *raw;
+    size_t raw_len;
+    uint8_t *packed;
+    size_t packed_len;
+    int stored;                 // payload is the raw bytes
+    int failed;
+} lz_block_t;
+
+// Compresses or decompresses one batch of blocks, with the calling
+// thread taking a share of the work
+typedef struct {
+    pthread_t *workers;
+    int worker_count;
+    pthread_mutex_t lock;
+    pthread_cond_t work_ready;
+    pthread_cond_t work_done;
+    lz_block_t *blocks;
+    uint32_t **tables;          // match finder table per thread
+    int count;
+    int next;
+    int finished;
+    int decompress;
+    unsigned int generation;
+    int shutdown;
+} lz_pool_t;
+
+typedef struct {
+    lz_write_fn write;
+    void *ctx;
+    lz_pool_t pool;
+    lz_block_t *blocks;
+    int block_count;
+    int filled;                 // blocks holding data, the last may be partial
+    size_t block_size;
+    int header_written;
+    int failed;
+} lz_writer_t;
+
+typedef struct {
+    lz_read_fn read;
+    void *ctx;
+    lz_pool_t pool;
+    lz_block_t *blocks;
+    int block_count;
+    int threads;
+    int loaded;                 // blocks decoded in the current batch
+    int current;
+    size_t offset;              // read position inside the current block
+    size_t block_size;
+    int finished;
+    int failed;
+} lz_reader_t;
+
+// Function declarations
+size_t lz_compress_bound(size_t len);
+size_t lz_compress_block(const void *src, size_t len, void *dst, size_t dst_size, uint32_t *table);
+ssize_t lz_decompress_block(const void *src, size_t len, void *dst, size_t dst_size);
+
+lz_writer_t* lz_writer_open(lz_write_fn write, void *ctx, int threads);
+int lz_write(lz_writer_t *writer, const void *data, size_t len);
+int lz_writer_close(lz_writer_t *writer);
+
+lz_reader_t* lz_reader_open(lz_read_fn read, void *ctx, int threads);
+ssize_t lz_read(lz_reader_t *reader, void *buf, size_t len);
+void lz_reader_close(lz_reader_t *reader);
+
+// Helper functions
+int lz_is_frame(const void *data, size_t len);
+int lz_default_threads(void);
+ssize_t lz_fd_read(void *ctx, void *buf, size_t len);
+int lz_fd_write(void *ctx, const void *buf, size_t len);
+
+#endif // LZ_H
@@ -0,0 +1,375 @@
+#include "metrics.h"
+#include "access_log.h"
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+
+#define METRICS_CACHELINE 64
+
+// Exported histogram bounds, in powers of two microseconds: 64us to 9.5h
+#define METRICS_EXPORT_MIN_BITS 6
+#define METRICS_EXPORT_MAX_BITS 35
+
+typedef struct {
+    atomic_ullong buckets[METRICS_HISTOGRAM_BUCKETS];
+    atomic_ullong count;
+    atomic_ullong sum;              // microseconds
+} histogram_t;
+
+// Nothing but counters, so a scrape can add two of these up as flat arrays
+typedef struct {
+    atomic_ullong requests[METRICS_ROUTE_COUNT][METRICS_STATUS_CLASSES];
+    histogram_t request_latency[METRICS_ROUTE_COUNT];
+    atomic_ullong op_failures[METRICS_OP_COUNT];
+    histogram_t op_latency[METRICS_OP_COUNT];
+    atomic_ullong step_failures[METRICS_INSTRUCTIONS];
+    atomic_ullong step_cache_hits[METRICS_INSTRUCTIONS];
+    atomic_ullong step_cache_misses[METRICS_INSTRUCTIONS];
+    atomic_ullong step_bytes[METRICS_INSTRUCTIONS];
+    histogram_t step_latency[METRICS_INSTRUCTIONS];
+} metrics_data_t;
+
+// The list link and owner flag change only when a thread comes or goes;
+// the counters start on a line of their own
+typedef struct metrics_slab {
+    struct metrics_slab *next;
+    atomic_int owned;
+    _Alignas(METRICS_CACHELINE) metrics_data_t data;
+} metrics_slab_t;
+
+static _Atomic(metrics_slab_t*) slabs;
+static __thread metrics_slab_t *thread_slab;
+static pthread_key_t slab_key;
+static pthread_once_t slab_key_once = PTHREAD_ONCE_INIT;
+
+static const char *route_names[METRICS_ROUTE_COUNT] = {
+    "other",
+    "container_create",
+    "container_start",
+    "container_stop",
+    "container_remove",
+    "container_commit",
+    "container_wait",
+    "container_batch",
+    "container_list",
+    "image_list",
+    "image_save",
+    "image_load",
+    "image_pull",
+    "image_push",
+    "image_squash",
+    "image_remove",
+    "build",
+    "system_prune",
+    "metrics",
+    "trace",
+    "events"
+};
+
+static const char *op_names[METRICS_OP_COUNT] = {
+    "create",
+    "start",
+    "stop",
+    "rm",
+    "kill"
+};
+
+static const char *instruction_names[METRICS_INSTRUCTIONS] = {
+    "UNKNOWN", "FROM", "RUN", "CMD", "LABEL", "EXPOSE", "ENV", "ADD", "COPY", "ENTRYPOINT",
+    "VOLUME", "USER", "WORKDIR", "ARG", "ONBUILD", "STOPSIGNAL", "HEALTHCHECK", "SHELL"
+};
+
+// ----------------------------------------------------------------------------
+// Recording
+// ----------------------------------------------------------------------------
+
+static void release_slab(void *arg) {
+    metrics_slab_t *slab = arg;
+    atomic_store_explicit(&slab->owned, 0, memory_order_release);
+}
+
+static void create_slab_key(void) {
+    pthread_key_create(&slab_key, release_slab);
+}
+
+// Claim a slab a finished thread left behind, or map a new one. Slabs are
+// never unmapped, so a scrape can walk the list without holding anything.
+static metrics_slab_t* claim_slab(void) {
+    metrics_slab_t *slab;
+
+    pthread_once(&slab_key_once, create_slab_key);
+
+    for (slab = atomic_load_explicit(&slabs, memory_order_acquire); slab; slab = slab->next) {
+        int expected = 0;
+        if (atomic_compare_exchange_strong(&slab->owned, &expected, 1)) {
+            break;
+        }
+    }
+
+    if (!slab) {
+        slab = mmap(NULL, sizeof(*slab), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+        if (slab == MAP_FAILED) {
+            perror("mmap metrics");
+            return NULL;
+        }
+        atomic_init(&slab->owned, 1);
+        slab->next = atomic_load_explicit(&slabs, memory_order_relaxed);
+        while (!atomic_compare_exchange_weak_explicit(&slabs, &slab->next, slab, memory_order_release,
+                                                      memory_order_relaxed)) {
+        }
+    }
+
+    pthread_setspecific(slab_key, slab);
+    thread_slab = slab;
+    return slab;
+}
+
+static inline metrics_data_t* thread_data(void) {
+    metrics_slab_t *slab = thread_slab;
+    if (!slab && !(slab = claim_slab())) {
+        return NULL;
+    }
+    return &slab->data;
+}
+
+// Only the owning thread writes its slab, so this needs no read-modify-write
+static inline void bump(atomic_ullong *counter, unsigned long long n) {
+    atomic_store_explicit(counter, atomic_load_explicit(counter, memory_order_relaxed) + n,
+                          memory_order_relaxed);
+}
+
+static inline int histogram_index(uint64_t micros) {
+    if (micros < METRICS_SUB_BUCKETS) {
+        return (int)micros;
+    }
+    if (micros >> METRICS_MAX_VALUE_BITS) {
+        return METRICS_HISTOGRAM_BUCKETS - 1;
+    }
+    int shift = 63 - __builtin_clzll(micros) - METRICS_SUB_BUCKET_BITS;
+    return (shift + 1) * METRICS_SUB_BUCKETS + (int)((micros >> shift) - METRICS_SUB_BUCKETS);
+}
+
+static inline void histogram_record(histogram_t *histogram, uint64_t micros) {
+    bump(&histogram->buckets[histogram_index(micros)], 1);
+    bump(&histogram->count, 1);
+    bump(&histogram->sum, micros);
+}
+
+int init_metrics(void) {
+    if (pthread_once(&slab_key_once, create_slab_key) != 0) {
+        fprintf(stderr, "Failed to create metrics thread key\n");
+        return -1;
+    }
+    return 0;
+}
+
+// Threads that fork a worker attach first, so the worker inherits a slab
+// the daemon can see rather than mapping one of its own
+void metrics_attach_thread(void) {
+    thread_data();
+}
+
+void metrics_observe_request(metrics_route_t route, int status_code, uint64_t micros) {
+    metrics_data_t *data = thread_data();
+    int status_class = status_code / 100;
+
+    if (!data || route < 0 || route >= METRICS_ROUTE_COUNT) return;
+    if (status_class < 0 || status_class >= METRICS_STATUS_CLASSES) {
+        status_class = 0;
+    }
+
+    bump(&data->requests[route][status_class], 1);
+    histogram_record(&data->request_latency[route], micros);
+}
+
+void metrics_observe_container_op(metrics_op_t op, int failed, uint64_t micros) {
+    metrics_data_t *data = thread_data();
+
+    if (!data || op < 0 || op >= METRICS_OP_COUNT) return;
+
+    if (failed) {
+        bump(&data->op_failures[op], 1);
+    }
+    histogram_record(&data->op_latency[op], micros);
+}
+
+void metrics_observe_build_step(instruction_type_t type, int failed, const build_step_stats_t *stats,
+                                uint64_t micros) {
+    metrics_data_t *data = thread_data();
+
+    if (!data || type < 0 || type >= METRICS_INSTRUCTIONS) return;
+
+    if (failed) {
+        bump(&data->step_failures[type], 1);
+    }
+    if (stats) {
+        bump(&data->step_cache_hits[type], stats->cache_hits);
+        bump(&data->step_cache_misses[type], stats->cache_misses);
+        bump(&data->step_bytes[type], stats->bytes_copied);
+    }
+    histogram_record(&data->step_latency[type], micros);
+}
+
+const char* metrics_route_name(metrics_route_t route) {
+    return route >= 0 && route < METRICS_ROUTE_COUNT ? route_names[route] : route_names[METRICS_ROUTE_OTHER];
+}
+
+uint64_t metrics_elapsed_us(const struct timespec *start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)(now.tv_sec - start->tv_sec) * 1000000 + (now.tv_nsec - start->tv_nsec) / 1000;
+}
+
+// ----------------------------------------------------------------------------
+// Exposition
+// ----------------------------------------------------------------------------
+
+// Bucket i holds values from its lower bound up to the next bucket's
+static uint64_t bucket_lower_bound(int i) {
+    if (i < METRICS_SUB_BUCKETS) {
+        return i;
+    }
+    int shift = i / METRICS_SUB_BUCKETS - 1;
+    return (uint64_t)(METRICS_SUB_BUCKETS + i % METRICS_SUB_BUCKETS) << shift;
+}
+
+static void write_histogram(FILE *text, const char *name, const char *label, const char *value,
+                            const histogram_t *histogram) {
+    unsigned long long cumulative = 0;
+    int i = 0;
+
+    // Durations are truncated to whole microseconds, so everything in the
+    // buckets below 2^bits took less than 2^bits
+    for (int bits = METRICS_EXPORT_MIN_BITS; bits <= METRICS_EXPORT_MAX_BITS; bits++) {
+        for (; bucket_lower_bound(i) < (1ULL << bits); i++) {
+            cumulative += atomic_load_explicit(&histogram->buckets[i], memory_order_relaxed);
+        }
+        fprintf(text, "%s_bucket{%s=\"%s\",le=\"%.12g\"} %llu\n", name, label, value,
+                (double)(1ULL << bits) / 1e6, cumulative);
+    }
+
+    // Read the count after the buckets so +Inf is never below the last bucket
+    unsigned long long count = atomic_load_explicit(&histogram->count, memory_order_relaxed);
+    for (; i < METRICS_HISTOGRAM_BUCKETS; i++) {
+        cumulative += atomic_load_explicit(&histogram->buckets[i], memory_order_relaxed);
+    }
+    if (count < cumulative) {
+        count = cumulative;
+    }
+    fprintf(text, "%s_bucket{%s=\"%s\",le=\"+Inf\"} %llu\n", name, label, value, count);
+    fprintf(text, "%s_sum{%s=\"%s\"} %.6f\n", name, label, value,
+            atomic_load_explicit(&histogram->sum, memory_order_relaxed) / 1e6);
+    fprintf(text, "%s_count{%s=\"%s\"} %llu\n", name, label, value, count);
+}
+
+static unsigned long long load(const atomic_ullong *counter) {
+    return atomic_load_explicit(counter, memory_order_relaxed);
+}
+
+static void write_counter_family(FILE *text, const char *name, const char *help, const char *label,
+                                 const char **values, int count, const atomic_ullong *counters,
+                                 const histogram_t *seen) {
+    fprintf(text, "# HELP %s %s\n# TYPE %s counter\n", name, help, name);
+    for (int i = 0; i < count; i++) {
+        if (load(&seen[i].count) > 0) {
+            fprintf(text, "%s{%s=\"%s\"} %llu\n", name, label, values[i], load(&counters[i]));
+        }
+    }
+}
+
+static void write_histogram_family(FILE *text, const char *name, const char *help, const char *label,
+                                   const char **values, int count, const histogram_t *histograms) {
+    fprintf(text, "# HELP %s %s\n# TYPE %s histogram\n", name, help, name);
+    for (int i = 0; i < count; i++) {
+        if (load(&histograms[i].count) > 0) {
+            write_histogram(text, name, label, values[i], &histograms[i]);
+        }
+    }
+}
+
+// Add up every slab and format the result; the caller frees it
+char* metrics_render(size_t *len) {
+    const size_t words = sizeof(metrics_data_t) / sizeof(atomic_ullong);
+    metrics_data_t *total;
+    char *data = NULL;
+    FILE *text;
+    int mapped = 0;
+
+    total = calloc(1, sizeof(*total));
+    if (!total) {
+        perror("calloc");
+        return NULL;
+    }
+
+    for (metrics_slab_t *slab = atomic_load_explicit(&slabs, memory_order_acquire); slab; slab = slab->next) {
+        atomic_ullong *from = (atomic_ullong*)&slab->data;
+        atomic_ullong *to = (atomic_ullong*)total;
+        for (size_t i = 0; i < words; i++) {
+            atomic_store_explicit(&to[i], load(&to[i]) + load(&from[i]), memory_order_relaxed);
+        }
+        mapped++;
+    }
+
+    text = open_memstream(&data, len);
+    if (!text) {
+        perror("open_memstream");
+        free(total);
+        return NULL;
+    }
+
+    fprintf(text, "# HELP docker_clone_http_requests_total API requests handled, by route and status class.\n"
+            "# TYPE docker_clone_http_requests_total counter\n");
+    for (int route = 0; route < METRICS_ROUTE_COUNT; route++) {
+        for (int status_class = 0; status_class < METRICS_STATUS_CLASSES; status_class++) {
+            unsigned long long requests = load(&total->requests[route][status_class]);
+            if (requests == 0) continue;
+            if (status_class == 0) {
+                fprintf(text, "docker_clone_http_requests_total{route=\"%s\",code=\"unknown\"} %llu\n",
+                        route_names[route], requests);
+            } else {
+                fprintf(text, "docker_clone_http_requests_total{route=\"%s\",code=\"%dxx\"} %llu\n",
+                        route_names[route], status_class, requests);
+            }
+        }
+    }
+    write_histogram_family(text, "docker_clone_http_request_duration_seconds",
+                           "Time from parsing a request to having its response.", "route",
+                           route_names, METRICS_ROUTE_COUNT, total->request_latency);
+
+    write_histogram_family(text, "docker_clone_container_operation_duration_seconds",
+                           "Container lifecycle operations, successful or not.", "op",
+                           op_names, METRICS_OP_COUNT, total->op_latency);
+    write_counter_family(text, "docker_clone_container_operation_failures_total",
+                         "Container lifecycle operations that failed.", "op",
+                         op_names, METRICS_OP_COUNT, total->op_failures, total->op_latency);
+
+    write_histogram_family(text, "docker_clone_build_step_duration_seconds",
+                           "Dockerfile instructions executed by builds, successful or not.", "instruction",
+                           instruction_names, METRICS_INSTRUCTIONS, total->step_latency);
+    write_counter_family(text, "docker_clone_build_step_failures_total",
+                         "Dockerfile instructions that failed.", "instruction",
+                         instruction_names, METRICS_INSTRUCTIONS, total->step_failures, total->step_latency);
+    write_counter_family(text, "docker_clone_build_step_cache_hits_total",
+                         "Context cache hits while executing instructions.", "instruction",
+                         instruction_names, METRICS_INSTRUCTIONS, total->step_cache_hits, total->step_latency);
+    write_counter_family(text, "docker_clone_build_step_cache_misses_total",
+                         "Context cache misses while executing instructions.", "instruction",
+                         instruction_names, METRICS_INSTRUCTIONS, total->step_cache_misses, total->step_latency);
+    write_counter_family(text, "docker_clone_build_step_copied_bytes_total",
+                         "Bytes copied into build layers by instructions.", "instruction",
+                         instruction_names, METRICS_INSTRUCTIONS, total->step_bytes, total->step_latency);
+
+    fprintf(text, "# HELP docker_clone_access_log_dropped_total Access log records dropped on a full ring.\n"
+            "# TYPE docker_clone_access_log_dropped_total counter\n"
+            "docker_clone_access_log_dropped_total %llu\n", access_log_dropped());
+    fprintf(text, "# HELP docker_clone_metrics_slabs Per-thread metrics slabs mapped so far.\n"
+            "# TYPE docker_clone_metrics_slabs gauge\n"
+            "docker_clone_metrics_slabs %d\n", mapped);
+
+    free(total);
+    if (fclose(text) != 0) {
+        free(data);
+        return NULL;
+    }
+    return data;
+}
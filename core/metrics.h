@@ -0,0 +1,79 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "dockerfile.h"
+
+// Counters and latency histograms, served at GET /metrics in the Prometheus
+// text format. Every thread records into a slab of its own, so recording is
+// a plain load and store on memory no other thread writes; a scrape adds
+// the slabs up. Slabs are shared mappings: a forked build worker keeps
+// recording into the slab of the thread that forked it, which waits on the
+// worker meanwhile. A thread's slab goes back to a free pool when it exits,
+// counts and all, for the next thread to continue.
+
+// Latencies are kept in microseconds, HDR style: exact below 8us, then 8
+// buckets per power of two, so a bucket is at most 12.5% wide. Anything
+// from 2^36us (19 hours) up lands in the last one.
+#define METRICS_SUB_BUCKET_BITS 3
+#define METRICS_SUB_BUCKETS (1 << METRICS_SUB_BUCKET_BITS)
+#define METRICS_MAX_VALUE_BITS 36
+#define METRICS_HISTOGRAM_BUCKETS ((METRICS_MAX_VALUE_BITS - METRICS_SUB_BUCKET_BITS + 1) * METRICS_SUB_BUCKETS)
+
+#define METRICS_STATUS_CLASSES 6        // unknown, 1xx .. 5xx
+
+typedef enum {
+    METRICS_ROUTE_OTHER,
+    METRICS_ROUTE_CONTAINER_CREATE,
+    METRICS_ROUTE_CONTAINER_START,
+    METRICS_ROUTE_CONTAINER_STOP,
+    METRICS_ROUTE_CONTAINER_REMOVE,
+    METRICS_ROUTE_CONTAINER_COMMIT,
+    METRICS_ROUTE_CONTAINER_WAIT,
+    METRICS_ROUTE_CONTAINER_BATCH,
+    METRICS_ROUTE_CONTAINER_LIST,
+    METRICS_ROUTE_IMAGE_LIST,
+    METRICS_ROUTE_IMAGE_SAVE,
+    METRICS_ROUTE_IMAGE_LOAD,
+    METRICS_ROUTE_IMAGE_PULL,
+    METRICS_ROUTE_IMAGE_PUSH,
+    METRICS_ROUTE_IMAGE_SQUASH,
+    METRICS_ROUTE_IMAGE_REMOVE,
+    METRICS_ROUTE_BUILD,
+    METRICS_ROUTE_SYSTEM_PRUNE,
+    METRICS_ROUTE_METRICS,
+    METRICS_ROUTE_TRACE,
+    METRICS_ROUTE_EVENTS,
+    METRICS_ROUTE_COUNT
+} metrics_route_t;
+
+typedef enum {
+    METRICS_OP_CREATE,
+    METRICS_OP_START,
+    METRICS_OP_STOP,
+    METRICS_OP_REMOVE,
+    METRICS_OP_KILL,
+    METRICS_OP_COUNT
+} metrics_op_t;
+
+#define METRICS_INSTRUCTIONS (INSTR_SHELL + 1)
+
+// Function declarations
+int init_metrics(void);
+void metrics_attach_thread(void);
+void metrics_observe_request(metrics_route_t route, int status_code, uint64_t micros);
+void metrics_observe_container_op(metrics_op_t op, int failed, uint64_t micros);
+void metrics_observe_build_step(instruction_type_t type, int failed, const build_step_stats_t *stats,
+                                uint64_t micros);
+char* metrics_render(size_t *len);
+
+// Helper functions
+uint64_t metrics_elapsed_us(const struct timespec *start);
+const char* metrics_route_name(metrics_route_t route);
+
+#endif // METRICS_H
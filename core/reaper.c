@@ -0,0 +1,321 @@
+#include "reaper.h"
+#include "events.h"
+#include "container_lock.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+// Both kinds of epoll entry start with watched_t, so an event's pointer
+// says which one it is
+typedef struct {
+    int fd;
+    int is_waiter;
+} watched_t;
+
+typedef struct reaper_entry reaper_entry_t;
+
+typedef struct reaper_waiter {
+    watched_t watched;                  // the parked socket
+    struct reaper_waiter *next;
+    reaper_entry_t *entry;
+    reaper_wait_fn fn;
+    void *ctx;
+} reaper_waiter_t;
+
+struct reaper_entry {
+    watched_t watched;                  // the container's pidfd
+    reaper_entry_t *next;
+    pid_t pid;
+    char container_id[MAX_CONTAINER_ID_LEN];
+    reaper_waiter_t *waiters;
+};
+
+static pthread_mutex_t reaper_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t reaped;          // broadcast whenever an entry goes
+static reaper_entry_t *entries;
+static int epoll_fd = -1;
+
+int reaper_exit_code(int status) {
+    if (WIFSIGNALED(status)) {
+        return 128 + WTERMSIG(status);
+    }
+    return WEXITSTATUS(status);
+}
+
+// Caller holds reaper_lock
+static reaper_entry_t* find_entry(const char *container_id) {
+    for (reaper_entry_t *entry = entries; entry; entry = entry->next) {
+        if (strcmp(entry->container_id, container_id) == 0) {
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+// ----------------------------------------------------------------------------
+// Reaper thread
+// ----------------------------------------------------------------------------
+
+// Waiters handled in this round are freed only after it, since a later
+// event of the same round may still point at one
+static void reap_entry(reaper_entry_t *entry, reaper_waiter_t **finished) {
+    container_info_t container;
+    int status, exit_code = 0;
+    pid_t pid;
+
+    while ((pid = waitpid(entry->pid, &status, WNOHANG)) < 0 && errno == EINTR) {
+    }
+    if (pid == 0) {
+        return;
+    }
+
+    container_lock(entry->container_id);
+    if (read_container_metadata(entry->container_id, &container) == 0) {
+        // Nobody else reaps a tracked pid; if it is gone anyway, keep what the metadata says
+        exit_code = pid > 0 ? reaper_exit_code(status) : container.exit_code;
+        container.state = CONTAINER_STATE_EXITED;
+        container.exit_code = exit_code;
+        snprintf(container.finished, sizeof(container.finished), "%ld", time(NULL));
+        write_container_metadata(&container);
+        container_unlock(entry->container_id);
+        publish_event(EVENT_TYPE_CONTAINER, "die", container.id, container.name, container.image, exit_code);
+    } else {
+        container_unlock(entry->container_id);
+        if (pid > 0) {
+            exit_code = reaper_exit_code(status);
+        }
+    }
+
+    pthread_mutex_lock(&reaper_lock);
+    for (reaper_entry_t **link = &entries; *link; link = &(*link)->next) {
+        if (*link == entry) {
+            *link = entry->next;
+            break;
+        }
+    }
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, entry->watched.fd, NULL);
+    for (reaper_waiter_t *waiter = entry->waiters; waiter; waiter = waiter->next) {
+        epoll_ctl(epoll_fd, EPOLL_CTL_DEL, waiter->watched.fd, NULL);
+    }
+    pthread_cond_broadcast(&reaped);
+    pthread_mutex_unlock(&reaper_lock);
+
+    while (entry->waiters) {
+        reaper_waiter_t *waiter = entry->waiters;
+        entry->waiters = waiter->next;
+        waiter->fn(waiter->watched.fd, exit_code, waiter->ctx);
+        waiter->watched.fd = -1;
+        waiter->next = *finished;
+        *finished = waiter;
+    }
+
+    close(entry->watched.fd);
+    free(entry);
+}
+
+static void drop_waiter(reaper_waiter_t *waiter, reaper_waiter_t **finished) {
+    if (waiter->watched.fd < 0) {
+        return;
+    }
+
+    pthread_mutex_lock(&reaper_lock);
+    for (reaper_waiter_t **link = &waiter->entry->waiters; *link; link = &(*link)->next) {
+        if (*link == waiter) {
+            *link = waiter->next;
+            break;
+        }
+    }
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, waiter->watched.fd, NULL);
+    pthread_mutex_unlock(&reaper_lock);
+
+    waiter->fn(waiter->watched.fd, -1, waiter->ctx);
+    waiter->watched.fd = -1;
+    waiter->next = *finished;
+    *finished = waiter;
+}
+
+static void* reaper_thread(void *arg) {
+    struct epoll_event events[REAPER_MAX_EVENTS];
+    (void)arg;
+
+    for (;;) {
+        reaper_waiter_t *finished = NULL;
+        int count = epoll_wait(epoll_fd, events, REAPER_MAX_EVENTS, -1);
+
+        if (count < 0) {
+            if (errno != EINTR) {
+                perror("epoll_wait");
+            }
+            continue;
+        }
+
+        for (int i = 0; i < count; i++) {
+            watched_t *watched = events[i].data.ptr;
+            if (watched->is_waiter) {
+                drop_waiter((reaper_waiter_t *)watched, &finished);
+            } else {
+                reap_entry((reaper_entry_t *)watched, &finished);
+            }
+        }
+
+        while (finished) {
+            reaper_waiter_t *waiter = finished;
+            finished = waiter->next;
+            free(waiter);
+        }
+    }
+    return NULL;
+}
+
+int init_reaper(void) {
+    pthread_condattr_t attr;
+    pthread_t thread;
+
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&reaped, &attr);
+    pthread_condattr_destroy(&attr);
+
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (epoll_fd < 0) {
+        perror("epoll_create1");
+        return -1;
+    }
+
+    if (pthread_create(&thread, NULL, reaper_thread, NULL) != 0) {
+        perror("pthread_create");
+        close(epoll_fd);
+        epoll_fd = -1;
+        return -1;
+    }
+    pthread_detach(thread);
+    return 0;
+}
+
+// ----------------------------------------------------------------------------
+// Tracking and waiting
+// ----------------------------------------------------------------------------
+
+// From here on the reaper owns pid: nothing else may wait on it
+int reaper_track(const char *container_id, pid_t pid) {
+    struct epoll_event event;
+    reaper_entry_t *entry;
+    int pidfd;
+
+    pidfd = syscall(SYS_pidfd_open, pid, 0);
+    if (pidfd < 0) {
+        perror("pidfd_open");
+        return -1;
+    }
+
+    entry = calloc(1, sizeof(reaper_entry_t));
+    if (!entry) {
+        perror("calloc");
+        close(pidfd);
+        return -1;
+    }
+    entry->watched.fd = pidfd;
+    entry->pid = pid;
+    snprintf(entry->container_id, sizeof(entry->container_id), "%s", container_id);
+
+    memset(&event, 0, sizeof(event));
+    event.events = EPOLLIN;
+    event.data.ptr = entry;
+
+    pthread_mutex_lock(&reaper_lock);
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, pidfd, &event) != 0) {
+        pthread_mutex_unlock(&reaper_lock);
+        perror("epoll_ctl");
+        close(pidfd);
+        free(entry);
+        return -1;
+    }
+    entry->next = entries;
+    entries = entry;
+    pthread_mutex_unlock(&reaper_lock);
+    return 0;
+}
+
+// 0 once the container is no longer tracked (reaped, or never was), 1 if
+// it is still running after timeout_ms; a negative timeout waits for good
+int reaper_wait(const char *container_id, int timeout_ms) {
+    struct timespec deadline;
+    int result = 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += timeout_ms / 1000;
+    deadline.tv_nsec += (long)(timeout_ms % 1000) * 1000000;
+    if (deadline.tv_nsec >= 1000000000) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000;
+    }
+
+    pthread_mutex_lock(&reaper_lock);
+    while (find_entry(container_id)) {
+        if (timeout_ms < 0) {
+            pthread_cond_wait(&reaped, &reaper_lock);
+        } else if (pthread_cond_timedwait(&reaped, &reaper_lock, &deadline) == ETIMEDOUT) {
+            result = find_entry(container_id) ? 1 : 0;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&reaper_lock);
+    return result;
+}
+
+// 0 when fd is parked until the container exits, 1 when the container is
+// not running under the reaper (the caller answers right away), -1 on error.
+// A parked fd is made non-blocking, so a client that stopped reading cannot
+// hold up the reaper thread when it is answered.
+int reaper_park(const char *container_id, int fd, reaper_wait_fn fn, void *ctx) {
+    struct epoll_event event;
+    reaper_waiter_t *waiter;
+    reaper_entry_t *entry;
+    int flags;
+
+    waiter = calloc(1, sizeof(reaper_waiter_t));
+    if (!waiter) {
+        perror("calloc");
+        return -1;
+    }
+    waiter->watched.fd = fd;
+    waiter->watched.is_waiter = 1;
+    waiter->fn = fn;
+    waiter->ctx = ctx;
+
+    memset(&event, 0, sizeof(event));
+    event.events = EPOLLRDHUP;
+    event.data.ptr = waiter;
+
+    pthread_mutex_lock(&reaper_lock);
+    entry = find_entry(container_id);
+    if (!entry) {
+        pthread_mutex_unlock(&reaper_lock);
+        free(waiter);
+        return 1;
+    }
+    flags = fcntl(fd, F_GETFL);
+    if (flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) != 0) {
+        pthread_mutex_unlock(&reaper_lock);
+        perror("fcntl");
+        free(waiter);
+        return -1;
+    }
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event) != 0) {
+        fcntl(fd, F_SETFL, flags);
+        pthread_mutex_unlock(&reaper_lock);
+        perror("epoll_ctl");
+        free(waiter);
+        return -1;
+    }
+    waiter->entry = entry;
+    waiter->next = entry->waiters;
+    entry->waiters = waiter;
+    pthread_mutex_unlock(&reaper_lock);
+    return 0;
+}
@@ -0,0 +1,35 @@
+#ifndef REAPER_H
+#define REAPER_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+
+#include "container.h"
+
+// Reaps the daemon's containers as they exit, whether anything waits on
+// them or not. One thread watches a pidfd per running container; on exit
+// it collects the status, records it in the container's metadata and
+// publishes die.
+//
+// Requests waiting on an exit don't hold a thread either: their socket is
+// parked with the container, watched by the same thread, and answered from
+// it once the container exits, or dropped if the client hangs up first.
+#define REAPER_MAX_EVENTS 64
+
+// Called once on the reaper thread with the container's exit code, or -1
+// when the client hung up first. It owns fd from then on; fd is
+// non-blocking, and a client whose socket is full is to be dropped.
+typedef void (*reaper_wait_fn)(int fd, int exit_code, void *ctx);
+
+// Function declarations
+int init_reaper(void);
+int reaper_track(const char *container_id, pid_t pid);
+int reaper_wait(const char *container_id, int timeout_ms);
+int reaper_park(const char *container_id, int fd, reaper_wait_fn fn, void *ctx);
+
+// Helper functions
+int reaper_exit_code(int status);
+
+#endif // REAPER_H
@@ -0,0 +1,1357 @@
+#include "registry.h"
+#include "lazy.h"
+#include "tar.h"
+#include "gc.h"
+#include "json.h"
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <sys/file.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+// One HTTP/1.1 exchange with the registry. Every request gets its own
+// connection, so concurrent blob transfers each hold one.
+typedef struct {
+    int fd;
+    int status;
+    int head;                   // response to HEAD carries no body
+    long long content_length;   // -1 when the body runs to EOF or is chunked
+    int chunked;
+    long long chunk_left;
+    int done;
+    char location[REGISTRY_MAX_URL_LEN];
+    char content_range[128];
+    char digest[MAX_DIGEST_LEN];
+    size_t start;
+    size_t end;
+    char buffer[REGISTRY_BUFFER_SIZE];
+} registry_conn_t;
+
+typedef struct {
+    const registry_ref_t *ref;
+    registry_blob_t *blobs;
+    int count;
+    int next;
+    int push;
+    pthread_mutex_t lock;
+} blob_queue_t;
+
+// Helper functions
+static int split_host_port(const char *text, char *host, size_t host_size, int *port) {
+    const char *colon = strrchr(text, ':');
+    size_t len = colon ? (size_t)(colon - text) : strlen(text);
+
+    if (len == 0 || len >= host_size) {
+        return -1;
+    }
+    memcpy(host, text, len);
+    host[len] = '\0';
+
+    *port = 80;
+    if (colon) {
+        char *end;
+        long value = strtol(colon + 1, &end, 10);
+        if (*end != '\0' || value <= 0 || value > 65535) {
+            return -1;
+        }
+        *port = (int)value;
+    }
+    return 0;
+}
+
+// Same rules as docker: the first component names a registry when it
+// has a dot or a port in it, or is localhost
+int parse_registry_ref(const char *image_ref, registry_ref_t *ref) {
+    char registry[256];
+    const char *slash = strchr(image_ref, '/');
+    const char *repository = image_ref;
+    const char *name, *at, *colon;
+    size_t len;
+
+    memset(ref, 0, sizeof(*ref));
+
+    if (slash && (memchr(image_ref, '.', slash - image_ref) || memchr(image_ref, ':', slash - image_ref) ||
+                  (slash - image_ref == 9 && strncmp(image_ref, "localhost", 9) == 0))) {
+        len = slash - image_ref;
+        if (len >= sizeof(registry)) {
+            return -1;
+        }
+        memcpy(registry, image_ref, len);
+        registry[len] = '\0';
+        repository = slash + 1;
+    } else {
+        const char *env = getenv(REGISTRY_ENV);
+        snprintf(registry, sizeof(registry), "%s", env && env[0] ? env : DEFAULT_REGISTRY);
+    }
+
+    if (split_host_port(registry, ref->host, sizeof(ref->host), &ref->port) != 0) {
+        return -1;
+    }
+
+    // The tag follows the last colon after the last slash; a digest follows @
+    at = strchr(repository, '@');
+    name = strrchr(repository, '/');
+    name = name ? name + 1 : repository;
+    colon = strchr(name, ':');
+    if (at) {
+        len = at - repository;
+        if (strncmp(at + 1, "sha256:", 7) != 0 || strlen(at + 1) != 7 + SHA256_HEX_LEN) {
+            return -1;
+        }
+        snprintf(ref->reference, sizeof(ref->reference), "%s", at + 1);
+        snprintf(ref->local_tag, sizeof(ref->local_tag), "%.12s", at + 8);
+    } else if (colon) {
+        len = colon - repository;
+        snprintf(ref->reference, sizeof(ref->reference), "%s", colon + 1);
+        snprintf(ref->local_tag, sizeof(ref->local_tag), "%s", colon + 1);
+    } else {
+        len = strlen(repository);
+        strcpy(ref->reference, "latest");
+        strcpy(ref->local_tag, "latest");
+    }
+
+    if (len == 0 || len >= sizeof(ref->repository)) {
+        return -1;
+    }
+    memcpy(ref->repository, repository, len);
+    ref->repository[len] = '\0';
+
+    for (const char *p = ref->repository; *p; p++) {
+        if (!islower((unsigned char)*p) && !isdigit((unsigned char)*p) && !strchr("._-/", *p)) {
+            return -1;
+        }
+    }
+    for (const char *p = ref->reference; *p; p++) {
+        if (!isalnum((unsigned char)*p) && !strchr("._-:", *p)) {
+            return -1;
+        }
+    }
+
+    // Local image names are flat, so an image is known by its last component
+    name = strrchr(ref->repository, '/');
+    snprintf(ref->local_name, sizeof(ref->local_name), "%s", name ? name + 1 : ref->repository);
+    return ref->local_name[0] && ref->local_name[0] != '.' ? 0 : -1;
+}
+
+static int write_all(int fd, const void *data, size_t len) {
+    const char *p = data;
+
+    while (len > 0) {
+        ssize_t n = send(fd, p, len, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static int conn_open(registry_conn_t *conn, const char *host, int port) {
+    struct addrinfo hints, *addrs, *addr;
+    char service[16];
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    snprintf(service, sizeof(service), "%d", port);
+
+    conn->fd = -1;
+    conn->start = conn->end = 0;
+    if (getaddrinfo(host, service, &hints, &addrs) != 0) {
+        fprintf(stderr, "Cannot resolve registry host %s\n", host);
+        return -1;
+    }
+
+    for (addr = addrs; addr; addr = addr->ai_next) {
+        conn->fd = socket(addr->ai_family, addr->ai_socktype | SOCK_CLOEXEC, addr->ai_protocol);
+        if (conn->fd < 0) continue;
+        if (connect(conn->fd, addr->ai_addr, addr->ai_addrlen) == 0) break;
+        close(conn->fd);
+        conn->fd = -1;
+    }
+    freeaddrinfo(addrs);
+
+    if (conn->fd < 0) {
+        fprintf(stderr, "Cannot connect to registry %s:%d\n", host, port);
+        return -1;
+    }
+    return 0;
+}
+
+static void conn_close(registry_conn_t *conn) {
+    if (conn->fd >= 0) {
+        close(conn->fd);
+        conn->fd = -1;
+    }
+}
+
+static int conn_send_head(registry_conn_t *conn, const char *method, const char *host, int port,
+                          const char *path, const char *headers, long long content_length) {
+    char request[REGISTRY_MAX_URL_LEN + 1024];
+    int len;
+
+    len = snprintf(request, sizeof(request),
+                   "%s %s HTTP/1.1\r\n"
+                   "Host: %s:%d\r\n"
+                   "User-Agent: docker-clone\r\n"
+                   "Connection: close\r\n"
+                   "%s",
+                   method, path, host, port, headers ? headers : "");
+    if (content_length >= 0 && len > 0 && (size_t)len < sizeof(request)) {
+        len += snprintf(request + len, sizeof(request) - len, "Content-Length: %lld\r\n", content_length);
+    }
+    if (len <= 0 || (size_t)len + 2 >= sizeof(request)) {
+        return -1;
+    }
+    memcpy(request + len, "\r\n", 2);
+    return write_all(conn->fd, request, len + 2);
+}
+
+static ssize_t conn_fill(registry_conn_t *conn) {
+    ssize_t n;
+
+    do {
+        n = recv(conn->fd, conn->buffer, sizeof(conn->buffer), 0);
+    } while (n < 0 && errno == EINTR);
+
+    conn->start = 0;
+    conn->end = n > 0 ? n : 0;
+    return n;
+}
+
+// Reads one CRLF-terminated line out of the buffer
+static int conn_read_line(registry_conn_t *conn, char *line, size_t size) {
+    size_t len = 0;
+
+    for (;;) {
+        if (conn->start == conn->end && conn_fill(conn) <= 0) {
+            return -1;
+        }
+
+        char c = conn->buffer[conn->start++];
+        if (c == '\n') {
+            if (len > 0 && line[len - 1] == '\r') len--;
+            line[len] = '\0';
+            return 0;
+        }
+        if (len + 1 < size) {
+            line[len++] = c;
+        }
+    }
+}
+
+static int conn_read_response(registry_conn_t *conn) {
+    char line[REGISTRY_MAX_URL_LEN + 64];
+
+    conn->status = 0;
+    conn->content_length = -1;
+    conn->chunked = 0;
+    conn->chunk_left = 0;
+    conn->done = 0;
+    conn->location[0] = '\0';
+    conn->content_range[0] = '\0';
+    conn->digest[0] = '\0';
+
+    if (conn_read_line(conn, line, sizeof(line)) != 0 ||
+        sscanf(line, "HTTP/%*d.%*d %d", &conn->status) != 1) {
+        fprintf(stderr, "Malformed response from registry\n");
+        return -1;
+    }
+
+    while (conn_read_line(conn, line, sizeof(line)) == 0) {
+        char *value = strchr(line, ':');
+
+        if (line[0] == '\0') {
+            // No body for HEAD, 1xx, 204 and 304
+            if (conn->head || conn->status == 204 || conn->status == 304 || conn->status < 200) {
+                conn->done = 1;
+            } else if (conn->content_length == 0) {
+                conn->done = 1;
+            }
+            return 0;
+        }
+        if (!value) continue;
+
+        *value++ = '\0';
+        while (*value == ' ' || *value == '\t') value++;
+
+        if (strcasecmp(line, "Content-Length") == 0) {
+            conn->content_length = strtoll(value, NULL, 10);
+        } else if (strcasecmp(line, "Transfer-Encoding") == 0 && strcasestr(value, "chunked")) {
+            conn->chunked = 1;
+        } else if (strcasecmp(line, "Location") == 0) {
+            snprintf(conn->location, sizeof(conn->location), "%s", value);
+        } else if (strcasecmp(line, "Content-Range") == 0) {
+            snprintf(conn->content_range, sizeof(conn->content_range), "%s", value);
+        } else if (strcasecmp(line, "Docker-Content-Digest") == 0) {
+            snprintf(conn->digest, sizeof(conn->digest), "%s", value);
+        }
+    }
+
+    fprintf(stderr, "Registry closed the connection mid-response\n");
+    return -1;
+}
+
+// Returns body bytes, 0 at the end of a complete body, -1 when the body
+// was cut short
+static ssize_t conn_read_body(registry_conn_t *conn, void *dst, size_t len) {
+    size_t available;
+
+    if (conn->done) {
+        return 0;
+    }
+
+    if (conn->chunked && conn->chunk_left == 0) {
+        char line[64];
+        if (conn_read_line(conn, line, sizeof(line)) != 0) {
+            return -1;
+        }
+        if (line[0] == '\0' && conn_read_line(conn, line, sizeof(line)) != 0) {
+            return -1;
+        }
+        conn->chunk_left = strtoll(line, NULL, 16);
+        if (conn->chunk_left == 0) {
+            conn->done = 1;
+            return 0;
+        }
+    }
+
+    if (conn->start == conn->end) {
+        ssize_t n = conn_fill(conn);
+        if (n <= 0) {
+            // Without a length or chunking, EOF is the end of the body
+            if (n == 0 && !conn->chunked && conn->content_length < 0) {
+                conn->done = 1;
+                return 0;
+            }
+            return -1;
+        }
+    }
+
+    available = conn->end - conn->start;
+    if (len > available) len = available;
+    if (conn->chunked && (long long)len > conn->chunk_left) len = conn->chunk_left;
+    if (conn->content_length >= 0 && (long long)len > conn->content_length) len = conn->content_length;
+
+    memcpy(dst, conn->buffer + conn->start, len);
+    conn->start += len;
+
+    if (conn->chunked) {
+        conn->chunk_left -= len;
+    }
+    if (conn->content_length >= 0) {
+        conn->content_length -= len;
+        if (conn->content_length == 0) {
+            conn->done = 1;
+        }
+    }
+    return len;
+}
+
+static char* conn_read_all(registry_conn_t *conn, size_t max_len, size_t *out_len) {
+    size_t len = 0, capacity = 4096;
+    char *data = malloc(capacity);
+    ssize_t n;
+
+    if (!data) {
+        return NULL;
+    }
+
+    while ((n = conn_read_body(conn, data + len, capacity - len - 1)) > 0) {
+        len += n;
+        if (len + 1 == capacity) {
+            if (capacity > max_len) {
+                fprintf(stderr, "Registry response is too large\n");
+                free(data);
+                return NULL;
+            }
+            char *grown = realloc(data, capacity * 2);
+            if (!grown) {
+                free(data);
+                return NULL;
+            }
+            data = grown;
+            capacity *= 2;
+        }
+    }
+    if (n < 0) {
+        free(data);
+        return NULL;
+    }
+
+    data[len] = '\0';
+    if (out_len) *out_len = len;
+    return data;
+}
+
+// Splits a Location header into where the next request goes. Relative
+// locations stay on the current host.
+static int resolve_location(const char *location, char *host, size_t host_size, int *port,
+                            char *path, size_t path_size) {
+    if (strncmp(location, "https://", 8) == 0) {
+        fprintf(stderr, "Registry redirected to TLS, which is not supported\n");
+        return -1;
+    }
+
+    if (strncmp(location, "http://", 7) == 0) {
+        char authority[256];
+        const char *start = location + 7;
+        const char *slash = strchr(start, '/');
+        size_t len = slash ? (size_t)(slash - start) : strlen(start);
+
+        if (len >= sizeof(authority)) {
+            return -1;
+        }
+        memcpy(authority, start, len);
+        authority[len] = '\0';
+        if (split_host_port(authority, host, host_size, port) != 0) {
+            return -1;
+        }
+        location = slash ? slash : "/";
+    }
+
+    if (location[0] != '/') {
+        return -1;
+    }
+    snprintf(path, path_size, "%s", location);
+    return 0;
+}
+
+// Sends a bodiless request and reads the response headers, following
+// redirects (blob downloads are often redirected to separate storage)
+static int registry_get(registry_conn_t *conn, const registry_ref_t *ref, const char *method,
+                        const char *path, const char *headers) {
+    char host[256];
+    char current[REGISTRY_MAX_URL_LEN];
+    int port = ref->port;
+
+    snprintf(host, sizeof(host), "%s", ref->host);
+    snprintf(current, sizeof(current), "%s", path);
+
+    for (int redirects = 0; redirects <= REGISTRY_MAX_REDIRECTS; redirects++) {
+        conn->head = strcmp(method, "HEAD") == 0;
+        if (conn_open(conn, host, port) != 0) {
+            return -1;
+        }
+        if (conn_send_head(conn, method, host, port, current, headers, -1) != 0 ||
+            conn_read_response(conn) != 0) {
+            conn_close(conn);
+            return -1;
+        }
+
+        if (conn->status < 300 || conn->status >= 400 || conn->status == 304 || !conn->location[0]) {
+            return 0;
+        }
+
+        char location[REGISTRY_MAX_URL_LEN];
+        snprintf(location, sizeof(location), "%s", conn->location);
+        conn_close(conn);
+        if (resolve_location(location, host, sizeof(host), &port, current, sizeof(current)) != 0) {
+            return -1;
+        }
+    }
+
+    fprintf(stderr, "Too many redirects from registry\n");
+    return -1;
+}
+
+static int read_descriptor(const json_value_t *descriptor, registry_blob_t *blob) {
+    json_value_t object = *descriptor;
+    long long size;
+
+    memset(blob, 0, sizeof(*blob));
+    json_get_string(&object, "mediaType", blob->media_type, sizeof(blob->media_type));
+    if (json_get_string(&object, "digest", blob->digest, sizeof(blob->digest)) != 0 ||
+        json_get_ll(&object, "size", &size) != 0 || size < 0) {
+        return -1;
+    }
+    blob->size = size;
+    return 0;
+}
+
+static int verify_digest(const char *data, size_t len, const char *digest) {
+    char hex[SHA256_HEX_LEN + 1];
+
+    sha256_hex(data, len, hex);
+    return strncmp(digest, "sha256:", 7) == 0 && strcmp(digest + 7, hex) == 0 ? 0 : -1;
+}
+
+// Fetches a manifest by tag or digest. Manifest lists resolve to their
+// linux/amd64 entry.
+static char* fetch_manifest(const registry_ref_t *ref, const char *reference, int depth) {
+    static const char accept[] =
+        "Accept: " MEDIA_TYPE_OCI_MANIFEST ", " MEDIA_TYPE_DOCKER_MANIFEST ", "
+        MEDIA_TYPE_OCI_INDEX ", " MEDIA_TYPE_DOCKER_LIST "\r\n";
+    char path[REGISTRY_MAX_URL_LEN];
+    registry_conn_t *conn = malloc(sizeof(registry_conn_t));
+    char *manifest = NULL;
+    size_t len = 0;
+
+    if (!conn) {
+        return NULL;
+    }
+
+    snprintf(path, sizeof(path), "/v2/%s/manifests/%s", ref->repository, reference);
+    if (registry_get(conn, ref, "GET", path, accept) != 0) {
+        free(conn);
+        return NULL;
+    }
+
+    if (conn->status != 200) {
+        fprintf(stderr, "Registry returned %d for %s:%s\n", conn->status, ref->repository, reference);
+    } else {
+        manifest = conn_read_all(conn, REGISTRY_MAX_MANIFEST_LEN, &len);
+    }
+
+    // Content addressed references are checked, and so is what the registry
+    // says the digest is
+    if (manifest && ((strncmp(reference, "sha256:", 7) == 0 && verify_digest(manifest, len, reference) != 0) ||
+                     (conn->digest[0] && verify_digest(manifest, len, conn->digest) != 0))) {
+        fprintf(stderr, "Manifest for %s does not match its digest\n", ref->repository);
+        free(manifest);
+        manifest = NULL;
+    }
+    conn_close(conn);
+    free(conn);
+
+    // Anything but a list goes back as it is, for the caller to read
+    json_value_t root, entries, entry, value;
+    json_iter_t it;
+    if (!manifest || json_parse(manifest, len, &root) != 0 || json_get(&root, "manifests", &entries) != 0 ||
+        json_iter_init(&entries, &it) != 0 || it.object) {
+        return manifest;
+    }
+
+    // The platform's fields sit in an object of their own
+    char digest[MAX_DIGEST_LEN] = "";
+    while (depth == 0 && json_iter_next(&it, NULL, &entry) > 0) {
+        char architecture[32] = "", os[32] = "";
+
+        if (json_find(&entry, "architecture", &value) == 0) {
+            json_string_copy(&value, architecture, sizeof(architecture));
+        }
+        if (json_find(&entry, "os", &value) == 0) {
+            json_string_copy(&value, os, sizeof(os));
+        }
+        int chosen = strcmp(architecture, "amd64") == 0 && strcmp(os, "linux") == 0;
+        if (!digest[0] || chosen) {
+            json_get_string(&entry, "digest", digest, sizeof(digest));
+        }
+        if (chosen) break;
+    }
+    free(manifest);
+
+    if (!digest[0]) {
+        fprintf(stderr, "Manifest list for %s has no usable entry\n", ref->repository);
+        return NULL;
+    }
+    return fetch_manifest(ref, digest, depth + 1);
+}
+
+// Downloads one blob into the content store. The digest is computed as the
+// bytes arrive; an interrupted transfer keeps its .partial file and the
+// next attempt (or the next pull) asks only for the rest with Range.
+static int fetch_blob(const registry_ref_t *ref, registry_blob_t *blob) {
+    char blob_path[MAX_PATH_LEN];
+    char partial_path[MAX_PATH_LEN + 16];
+    char path[REGISTRY_MAX_URL_LEN];
+    char headers[128];
+    uint8_t digest[SHA256_DIGEST_LEN];
+    char hex[SHA256_HEX_LEN + 1];
+    registry_conn_t *conn;
+    sha256_ctx_t hash;
+    long long offset;
+    int complete = 0;
+    int fd;
+
+    if (blob_storage_path(blob->digest, blob_path, sizeof(blob_path)) != 0) {
+        fprintf(stderr, "Unsupported blob digest %s\n", blob->digest);
+        return -1;
+    }
+    snprintf(partial_path, sizeof(partial_path), "%s.partial", blob_path);
+
+    // Concurrent pulls of the same blob take turns on the partial file
+    fd = open(partial_path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (fd < 0 || flock(fd, LOCK_EX) != 0) {
+        perror("open partial blob");
+        if (fd >= 0) close(fd);
+        return -1;
+    }
+    if (access(blob_path, F_OK) == 0) {
+        close(fd);
+        blob->present = 1;
+        return 0;
+    }
+
+    conn = malloc(sizeof(registry_conn_t));
+    if (!conn) {
+        close(fd);
+        return -1;
+    }
+
+    // Bytes kept from an earlier attempt go into the digest first
+    sha256_init(&hash);
+    offset = lseek(fd, 0, SEEK_END);
+    if (offset > blob->size && ftruncate(fd, 0) == 0) {
+        offset = 0;
+    }
+    for (long long done = 0; done < offset; ) {
+        ssize_t n = pread(fd, conn->buffer, sizeof(conn->buffer), done);
+        if (n <= 0) {
+            offset = done;
+            if (ftruncate(fd, offset) != 0) break;
+            break;
+        }
+        if (done + n > offset) n = offset - done;
+        sha256_update(&hash, conn->buffer, n);
+        done += n;
+    }
+
+    snprintf(path, sizeof(path), "/v2/%s/blobs/%s", ref->repository, blob->digest);
+
+    for (int attempt = 0; attempt < REGISTRY_MAX_ATTEMPTS && !complete; attempt++) {
+        headers[0] = '\0';
+        if (offset > 0) {
+            snprintf(headers, sizeof(headers), "Range: bytes=%lld-\r\n", offset);
+        }
+
+        if (registry_get(conn, ref, "GET", path, headers) != 0) {
+            continue;
+        }
+
+        if (conn->status == 416 && offset == blob->size) {
+            complete = 1;
+        } else if (conn->status == 206 && offset > 0) {
+            long long range_start = -1;
+            sscanf(conn->content_range, "bytes %lld-", &range_start);
+            if (range_start != offset) {
+                fprintf(stderr, "Registry resumed %s at the wrong offset\n", blob->digest);
+                conn_close(conn);
+                break;
+            }
+            blob->resumed += offset;
+        } else if (conn->status == 200) {
+            // The registry ignored the range: start over
+            if (offset > 0) {
+                sha256_init(&hash);
+                offset = 0;
+                if (ftruncate(fd, 0) != 0) {
+                    conn_close(conn);
+                    break;
+                }
+            }
+        } else {
+            fprintf(stderr, "Registry returned %d for blob %s\n", conn->status, blob->digest);
+            conn_close(conn);
+            break;
+        }
+
+        ssize_t n = 0;
+        int oversized = 0;
+        while (!complete) {
+            char chunk[16384];
+            n = conn_read_body(conn, chunk, sizeof(chunk));
+            if (n <= 0) break;
+            if (offset + n > blob->size) {
+                oversized = 1;
+                break;
+            }
+            if (pwrite(fd, chunk, n, offset) != n) {
+                perror("write blob");
+                break;
+            }
+            sha256_update(&hash, chunk, n);
+            offset += n;
+            blob->transferred += n;
+        }
+        conn_close(conn);
+
+        if (offset == blob->size && !oversized) {
+            complete = 1;
+        } else if (n >= 0 || oversized) {
+            // The body ended cleanly at the wrong length, or the disk failed
+            break;
+        } else {
+            fprintf(stderr, "Download of %s interrupted at %lld of %lld bytes, resuming\n",
+                    blob->digest, offset, blob->size);
+        }
+    }
+    free(conn);
+
+    if (!complete) {
+        fprintf(stderr, "Failed to download blob %s\n", blob->digest);
+        close(fd);
+        return -1;
+    }
+
+    sha256_final(&hash, digest);
+    sha256_to_hex(digest, hex);
+    if (strcmp(hex, blob->digest + 7) != 0) {
+        fprintf(stderr, "Blob %s does not match its digest\n", blob->digest);
+        if (ftruncate(fd, 0) != 0) {
+            unlink(partial_path);
+        }
+        close(fd);
+        return -1;
+    }
+
+    if (rename(partial_path, blob_path) != 0) {
+        perror("rename blob");
+        close(fd);
+        return -1;
+    }
+    close(fd);
+    return 0;
+}
+
+// source names a blob as host:port/repository@digest
+static int parse_blob_source(const char *source, registry_ref_t *ref) {
+    if (parse_registry_ref(source, ref) != 0 || strncmp(ref->reference, "sha256:", 7) != 0) {
+        fprintf(stderr, "Invalid blob source: %s\n", source);
+        return -1;
+    }
+    return 0;
+}
+
+// Downloads a whole blob into the content store, resuming as usual
+int registry_fetch_blob(const char *source, long long size) {
+    registry_ref_t ref;
+    registry_blob_t blob;
+
+    if (parse_blob_source(source, &ref) != 0) {
+        return -1;
+    }
+    memset(&blob, 0, sizeof(blob));
+    snprintf(blob.digest, sizeof(blob.digest), "%s", ref.reference);
+    blob.size = size;
+    return fetch_blob(&ref, &blob);
+}
+
+// Writes length bytes of a blob, starting at offset, to fd from its start.
+// Interrupted transfers ask for the rest; a registry that ignores Range is
+// read up to the offset and the bytes before it dropped.
+int registry_fetch_range(const char *source, long long offset, long long length, int fd, sha256_ctx_t *hash) {
+    char path[REGISTRY_MAX_URL_LEN];
+    char headers[128];
+    registry_conn_t *conn;
+    registry_ref_t ref;
+    long long done = 0;
+
+    if (parse_blob_source(source, &ref) != 0) {
+        return -1;
+    }
+    if (length == 0) {
+        return 0;
+    }
+    conn = malloc(sizeof(registry_conn_t));
+    if (!conn) {
+        return -1;
+    }
+
+    snprintf(path, sizeof(path), "/v2/%s/blobs/%s", ref.repository, ref.reference);
+    for (int attempt = 0; attempt < REGISTRY_MAX_ATTEMPTS && done < length; attempt++) {
+        long long skip = 0;
+
+        snprintf(headers, sizeof(headers), "Range: bytes=%lld-%lld\r\n", offset + done, offset + length - 1);
+        if (registry_get(conn, &ref, "GET", path, headers) != 0) {
+            continue;
+        }
+
+        if (conn->status == 206) {
+            long long range_start = -1;
+            sscanf(conn->content_range, "bytes %lld-", &range_start);
+            if (range_start != offset + done) {
+                fprintf(stderr, "Registry answered %s with the wrong range\n", ref.reference);
+                conn_close(conn);
+                break;
+            }
+        } else if (conn->status == 200) {
+            skip = offset + done;
+        } else {
+            fprintf(stderr, "Registry returned %d for blob %s\n", conn->status, ref.reference);
+            conn_close(conn);
+            break;
+        }
+
+        ssize_t n = 0;
+        while (done < length) {
+            char chunk[16384];
+            n = conn_read_body(conn, chunk, sizeof(chunk));
+            if (n <= 0) break;
+
+            char *data = chunk;
+            if (skip > 0) {
+                long long dropped = skip < n ? skip : n;
+                skip -= dropped;
+                data += dropped;
+                n -= dropped;
+            }
+            if (n > length - done) {
+                n = length - done;
+            }
+            if (n > 0 && pwrite(fd, data, n, done) != n) {
+                perror("write fetched range");
+                n = 0;
+                break;
+            }
+            if (hash) {
+                sha256_update(hash, data, n);
+            }
+            done += n;
+            n = 1;
+        }
+        conn_close(conn);
+
+        if (done < length && n == 0) {
+            // The body ended early without an error: nothing to resume
+            break;
+        }
+    }
+    free(conn);
+
+    if (done != length) {
+        fprintf(stderr, "Failed to fetch %lld bytes at %lld of %s\n", length, offset, ref.reference);
+        return -1;
+    }
+    return 0;
+}
+
+// Uploads one blob unless the registry already has it: a HEAD check,
+// then a monolithic upload (POST for a session, PUT with the digest)
+static int push_blob(const registry_ref_t *ref, registry_blob_t *blob) {
+    char path[REGISTRY_MAX_URL_LEN];
+    char upload[REGISTRY_MAX_URL_LEN + MAX_DIGEST_LEN + 16];
+    char host[256];
+    int port = ref->port;
+    registry_conn_t *conn = malloc(sizeof(registry_conn_t));
+    int result = -1;
+
+    if (!conn) {
+        return -1;
+    }
+
+    snprintf(path, sizeof(path), "/v2/%s/blobs/%s", ref->repository, blob->digest);
+    if (registry_get(conn, ref, "HEAD", path, NULL) == 0) {
+        int exists = conn->status == 200;
+        conn_close(conn);
+        if (exists) {
+            blob->present = 1;
+            free(conn);
+            return 0;
+        }
+    }
+
+    // Start an upload session
+    snprintf(path, sizeof(path), "/v2/%s/blobs/uploads/", ref->repository);
+    snprintf(host, sizeof(host), "%s", ref->host);
+    conn->head = 0;
+    if (conn_open(conn, host, port) != 0) {
+        free(conn);
+        return -1;
+    }
+    if (conn_send_head(conn, "POST", host, port, path, NULL, 0) != 0 || conn_read_response(conn) != 0 ||
+        conn->status != 202 || !conn->location[0] ||
+        resolve_location(conn->location, host, sizeof(host), &port, path, sizeof(path)) != 0) {
+        fprintf(stderr, "Registry refused an upload for %s (status %d)\n", ref->repository, conn->status);
+        conn_close(conn);
+        free(conn);
+        return -1;
+    }
+    conn_close(conn);
+
+    snprintf(upload, sizeof(upload), "%s%cdigest=%s", path, strchr(path, '?') ? '&' : '?', blob->digest);
+    if (conn_open(conn, host, port) != 0 ||
+        conn_send_head(conn, "PUT", host, port, upload, "Content-Type: application/octet-stream\r\n",
+                       blob->size) != 0) {
+        conn_close(conn);
+        free(conn);
+        return -1;
+    }
+
+    if (blob->layer_id) {
+        result = write_layer_tar(blob->layer_id, conn->fd);
+    } else {
+        result = write_all(conn->fd, blob->data, blob->size);
+    }
+
+    if (result == 0 && (conn_read_response(conn) != 0 || conn->status != 201)) {
+        fprintf(stderr, "Registry rejected blob %s (status %d)\n", blob->digest, conn->status);
+        result = -1;
+    }
+    if (result == 0) {
+        blob->transferred = blob->size;
+    }
+
+    conn_close(conn);
+    free(conn);
+    return result;
+}
+
+static void* blob_worker(void *arg) {
+    blob_queue_t *queue = arg;
+
+    for (;;) {
+        pthread_mutex_lock(&queue->lock);
+        int index = queue->next < queue->count ? queue->next++ : -1;
+        pthread_mutex_unlock(&queue->lock);
+
+        if (index < 0) {
+            return NULL;
+        }
+
+        registry_blob_t *blob = &queue->blobs[index];
+        if (blob->present || blob->lazy) {
+            continue;
+        }
+        if ((queue->push ? push_blob(queue->ref, blob) : fetch_blob(queue->ref, blob)) != 0) {
+            blob->failed = 1;
+        }
+    }
+}
+
+// Moves blobs over up to REGISTRY_MAX_CONNECTIONS connections at once
+static int transfer_blobs(const registry_ref_t *ref, registry_blob_t *blobs, int count, int push,
+                          registry_stats_t *stats) {
+    pthread_t workers[REGISTRY_MAX_CONNECTIONS];
+    blob_queue_t queue;
+    int pending = 0, started = 0;
+    int result = 0;
+
+    for (int i = 0; i < count; i++) {
+        pending += !blobs[i].present && !blobs[i].lazy;
+    }
+
+    memset(&queue, 0, sizeof(queue));
+    queue.ref = ref;
+    queue.blobs = blobs;
+    queue.count = count;
+    queue.push = push;
+    pthread_mutex_init(&queue.lock, NULL);
+
+    // The calling thread takes part, so one pending blob needs no thread
+    for (int i = 0; i < pending - 1 && i < REGISTRY_MAX_CONNECTIONS - 1; i++) {
+        if (pthread_create(&workers[started], NULL, blob_worker, &queue) != 0) {
+            break;
+        }
+        started++;
+    }
+    blob_worker(&queue);
+    for (int i = 0; i < started; i++) {
+        pthread_join(workers[i], NULL);
+    }
+    pthread_mutex_destroy(&queue.lock);
+
+    for (int i = 0; i < count; i++) {
+        if (blobs[i].failed) {
+            result = -1;
+        } else if (blobs[i].lazy) {
+            stats->layers_lazy++;
+        } else if (blobs[i].present) {
+            stats->blobs_skipped++;
+        } else {
+            stats->blobs_transferred++;
+        }
+        stats->bytes_transferred += blobs[i].transferred;
+        stats->bytes_resumed += blobs[i].resumed;
+    }
+    return result;
+}
+
+static int layer_media_type_supported(const char *media_type) {
+    return media_type[0] == '\0' || strcmp(media_type, MEDIA_TYPE_OCI_LAYER) == 0 ||
+           strcmp(media_type, MEDIA_TYPE_DOCKER_LAYER) == 0;
+}
+
+static char* read_blob(const char *digest, size_t max_len) {
+    char path[MAX_PATH_LEN];
+    struct stat st;
+    char *data;
+    FILE *fp;
+
+    if (blob_storage_path(digest, path, sizeof(path)) != 0 || !(fp = fopen(path, "r"))) {
+        return NULL;
+    }
+    if (fstat(fileno(fp), &st) != 0 || (size_t)st.st_size > max_len ||
+        !(data = malloc(st.st_size + 1))) {
+        fclose(fp);
+        return NULL;
+    }
+    if (fread(data, 1, st.st_size, fp) != (size_t)st.st_size) {
+        free(data);
+        fclose(fp);
+        return NULL;
+    }
+    data[st.st_size] = '\0';
+    fclose(fp);
+    return data;
+}
+
+// Fetches the config and the layers' file indexes, and lays out the layers
+// that have one as placeholder trees. Their blobs are not downloaded.
+static int prepare_lazy_layers(const registry_ref_t *ref, registry_blob_t *blobs, int count,
+                               registry_stats_t *stats) {
+    char layer_id[MAX_LAYER_ID_LEN];
+    char source[512];
+    registry_blob_t *first;
+    char *config = NULL;
+    json_value_t root, diff_ids, element;
+    json_iter_t it;
+    int indexed = 1;
+    int result = -1;
+
+    first = calloc(count, sizeof(registry_blob_t));
+    if (!first) {
+        return -1;
+    }
+    first[0] = blobs[0];
+    for (int i = 1; i < count; i++) {
+        if (blobs[i].index_digest[0] && blobs[i].index_size > 0 && blobs[i].index_size <= LAZY_MAX_INDEX_LEN) {
+            registry_blob_t *index = &first[indexed++];
+            char path[MAX_PATH_LEN];
+
+            snprintf(index->digest, sizeof(index->digest), "%s", blobs[i].index_digest);
+            snprintf(index->media_type, sizeof(index->media_type), "%s", MEDIA_TYPE_FILE_INDEX);
+            index->size = blobs[i].index_size;
+            if (blob_storage_path(index->digest, path, sizeof(path)) != 0) {
+                fprintf(stderr, "Unsupported blob digest %s\n", index->digest);
+                goto out;
+            }
+            index->present = access(path, F_OK) == 0;
+        }
+    }
+    if (transfer_blobs(ref, first, indexed, 0, stats) != 0) {
+        goto out;
+    }
+
+    // Only layers whose blob is their diff_id can be read by offset
+    config = read_blob(blobs[0].digest, REGISTRY_MAX_MANIFEST_LEN);
+    if (!config || json_parse(config, strlen(config), &root) != 0 || json_find(&root, "diff_ids", &diff_ids) != 0 ||
+        json_iter_init(&diff_ids, &it) != 0 || it.object) {
+        fprintf(stderr, "Image config has no diff_ids\n");
+        goto out;
+    }
+    for (int i = 1; i < count; i++) {
+        char diff_id[MAX_DIGEST_LEN];
+        char path[MAX_PATH_LEN];
+        char *index;
+
+        if (json_iter_next(&it, NULL, &element) <= 0 || json_string_copy(&element, diff_id, sizeof(diff_id)) != 0) {
+            fprintf(stderr, "Image config has too few diff_ids\n");
+            goto out;
+        }
+        if (!blobs[i].index_digest[0] || blobs[i].present || strcmp(diff_id, blobs[i].digest) != 0) {
+            continue;
+        }
+        imported_layer_id(diff_id, layer_id, sizeof(layer_id));
+        snprintf(path, sizeof(path), "%s/%s", LAYER_STORAGE_DIR, layer_id);
+        gc_lease_layer(layer_id);
+        if (access(path, F_OK) == 0) {
+            continue;
+        }
+
+        index = read_blob(blobs[i].index_digest, LAZY_MAX_INDEX_LEN);
+        if (!index) {
+            continue;
+        }
+        // A layer that cannot be sourced lazily is fetched whole instead
+        if (snprintf(source, sizeof(source), "%s:%d/%s@%s", ref->host, ref->port, ref->repository,
+                     blobs[i].digest) >= (int)sizeof(source)) {
+            fprintf(stderr, "Registry reference too long to serve %s lazily\n", blobs[i].digest);
+        } else if (lazy_create_layer(layer_id, source, blobs[i].digest, blobs[i].size, index, strlen(index)) == 0) {
+            blobs[i].lazy = 1;
+        }
+        free(index);
+    }
+    result = 0;
+
+out:
+    free(config);
+    free(first);
+    return result;
+}
+
+// Pulls image_ref into the local store and names it local_ref (the last
+// repository component plus the tag). A lazy pull only fetches the layers
+// that were pushed without a file index.
+int registry_pull(const char *image_ref, int lazy, char *local_ref, size_t ref_size, registry_stats_t *stats) {
+    char (*layer_digests)[MAX_DIGEST_LEN] = NULL;
+    registry_blob_t *blobs = NULL;
+    registry_stats_t local_stats;
+    registry_ref_t ref;
+    char *manifest = NULL, *config = NULL;
+    json_value_t root, value, layer;
+    json_iter_t it;
+    int count = 0, capacity = 0;
+    int result = -1;
+
+    if (!stats) {
+        stats = &local_stats;
+    }
+    memset(stats, 0, sizeof(*stats));
+
+    if (parse_registry_ref(image_ref, &ref) != 0) {
+        fprintf(stderr, "Invalid image reference: %s\n", image_ref);
+        return -1;
+    }
+    if (create_directory_structure() != 0) {
+        return -1;
+    }
+
+    manifest = fetch_manifest(&ref, ref.reference, 0);
+    if (!manifest) {
+        return -1;
+    }
+
+    // blobs[0] is the config, the layers follow in order
+    capacity = 8;
+    blobs = calloc(capacity, sizeof(registry_blob_t));
+    if (!blobs || json_parse(manifest, strlen(manifest), &root) != 0 || root.type != JSON_OBJECT ||
+        json_get(&root, "config", &value) != 0 || read_descriptor(&value, &blobs[0]) != 0) {
+        fprintf(stderr, "Manifest for %s has no config\n", image_ref);
+        goto out;
+    }
+    count = 1;
+
+    if (json_get(&root, "layers", &value) != 0 || json_iter_init(&value, &it) != 0 || it.object) {
+        fprintf(stderr, "Manifest for %s has no layers\n", image_ref);
+        goto out;
+    }
+    while (json_iter_next(&it, NULL, &layer) > 0) {
+        if (count == capacity) {
+            registry_blob_t *grown = realloc(blobs, capacity * 2 * sizeof(registry_blob_t));
+            if (!grown) {
+                goto out;
+            }
+            blobs = grown;
+            capacity *= 2;
+        }
+        int valid = read_descriptor(&layer, &blobs[count]) == 0;
+        if (valid && lazy) {
+            char index_size[32];
+            json_value_t annotations;
+            if (json_get(&layer, "annotations", &annotations) == 0 &&
+                json_get_string(&annotations, LAZY_INDEX_ANNOTATION, blobs[count].index_digest,
+                                sizeof(blobs[count].index_digest)) == 0 &&
+                json_get_string(&annotations, LAZY_INDEX_ANNOTATION ".size", index_size, sizeof(index_size)) == 0) {
+                blobs[count].index_size = strtoll(index_size, NULL, 10);
+            } else {
+                blobs[count].index_digest[0] = '\0';
+            }
+        }
+        if (!valid) {
+            fprintf(stderr, "Malformed layer in manifest for %s\n", image_ref);
+            goto out;
+        }
+        if (!layer_media_type_supported(blobs[count].media_type)) {
+            fprintf(stderr, "Layer format %s is not supported\n", blobs[count].media_type);
+            goto out;
+        }
+        count++;
+    }
+    if (count == 1) {
+        fprintf(stderr, "Manifest for %s has no layers\n", image_ref);
+        goto out;
+    }
+
+    // Blobs already in the content store are not fetched again
+    for (int i = 0; i < count; i++) {
+        char path[MAX_PATH_LEN];
+        if (blob_storage_path(blobs[i].digest, path, sizeof(path)) != 0) {
+            fprintf(stderr, "Unsupported blob digest %s\n", blobs[i].digest);
+            goto out;
+        }
+        blobs[i].present = access(path, F_OK) == 0;
+    }
+
+    if (lazy) {
+        // The config comes with the file indexes
+        if (prepare_lazy_layers(&ref, blobs, count, stats) != 0 ||
+            transfer_blobs(&ref, blobs + 1, count - 1, 0, stats) != 0) {
+            goto out;
+        }
+    } else if (transfer_blobs(&ref, blobs, count, 0, stats) != 0) {
+        goto out;
+    }
+
+    config = read_blob(blobs[0].digest, REGISTRY_MAX_MANIFEST_LEN);
+    layer_digests = calloc(count - 1, MAX_DIGEST_LEN);
+    if (!config || !layer_digests) {
+        goto out;
+    }
+    for (int i = 1; i < count; i++) {
+        strcpy(layer_digests[i - 1], blobs[i].digest);
+    }
+
+    if (import_image(ref.local_name, ref.local_tag, config, blobs[0].digest, layer_digests, count - 1) != 0) {
+        goto out;
+    }
+
+    if (local_ref) {
+        snprintf(local_ref, ref_size, "%s", get_image_full_name(ref.local_name, ref.local_tag));
+    }
+    result = 0;
+
+out:
+    free(layer_digests);
+    free(config);
+    free(blobs);
+    free(manifest);
+    return result;
+}
+
+static char* build_manifest(registry_blob_t *blobs, int count, size_t *len) {
+    char *manifest = NULL;
+    FILE *fp = open_memstream(&manifest, len);
+
+    if (!fp) {
+        perror("open_memstream");
+        return NULL;
+    }
+
+    fprintf(fp, "{\"schemaVersion\":2,\"mediaType\":\"%s\",", MEDIA_TYPE_OCI_MANIFEST);
+    fprintf(fp, "\"config\":{\"mediaType\":\"%s\",\"digest\":\"%s\",\"size\":%lld},\"layers\":[",
+            blobs[0].media_type, blobs[0].digest, blobs[0].size);
+    for (int i = 1; i < count; i++) {
+        fprintf(fp, "%s{\"mediaType\":\"%s\",\"digest\":\"%s\",\"size\":%lld",
+                i > 1 ? "," : "", blobs[i].media_type, blobs[i].digest, blobs[i].size);
+        if (blobs[i].index_digest[0]) {
+            fprintf(fp, ",\"annotations\":{\"%s\":\"%s\",\"%s.size\":\"%lld\"}",
+                    LAZY_INDEX_ANNOTATION, blobs[i].index_digest, LAZY_INDEX_ANNOTATION, blobs[i].index_size);
+        }
+        fprintf(fp, "}");
+    }
+    fprintf(fp, "]}");
+
+    if (fclose(fp) != 0) {
+        free(manifest);
+        return NULL;
+    }
+    return manifest;
+}
+
+// Pushes the local image named by the last component of image_ref. Layers
+// go up as plain tar streams, so their blob digests are their diff_ids, each
+// with a file index that lets pulls fetch single files by offset.
+int registry_push(const char *image_ref, registry_stats_t *stats) {
+    char full_name[MAX_IMAGE_NAME_LEN + MAX_IMAGE_TAG_LEN + 2];
+    char (*diff_ids)[MAX_DIGEST_LEN] = NULL;
+    char path[REGISTRY_MAX_URL_LEN];
+    char headers[128];
+    registry_blob_t *blobs = NULL;
+    registry_stats_t local_stats;
+    registry_conn_t *conn = NULL;
+    registry_ref_t ref;
+    image_info_t image;
+    char **indexes = NULL;
+    char *config = NULL, *manifest = NULL;
+    size_t config_len, manifest_len;
+    int result = -1;
+
+    if (!stats) {
+        stats = &local_stats;
+    }
+    memset(stats, 0, sizeof(*stats));
+
+    if (parse_registry_ref(image_ref, &ref) != 0 || strncmp(ref.reference, "sha256:", 7) == 0) {
+        fprintf(stderr, "Invalid image reference: %s\n", image_ref);
+        return -1;
+    }
+
+    snprintf(full_name, sizeof(full_name), "%s", get_image_full_name(ref.local_name, ref.local_tag));
+    if (read_image_metadata(full_name, &image) != 0) {
+        fprintf(stderr, "No such image: %s\n", full_name);
+        return -1;
+    }
+    if (image.layer_count == 0) {
+        fprintf(stderr, "Image %s has no layers\n", full_name);
+        goto out;
+    }
+
+    diff_ids = calloc(image.layer_count, MAX_DIGEST_LEN);
+    // The config, the layers, then each layer's file index
+    blobs = calloc(2 * image.layer_count + 1, sizeof(registry_blob_t));
+    indexes = calloc(image.layer_count, sizeof(char *));
+    if (!diff_ids || !blobs || !indexes) {
+        goto out;
+    }
+
+    for (int i = 0; i < image.layer_count; i++) {
+        registry_blob_t *blob = &blobs[i + 1];
+        registry_blob_t *index = &blobs[image.layer_count + i + 1];
+        size_t index_len;
+
+        if (layer_tar_digest(image.layers[i].id, diff_ids[i], &blob->size) != 0) {
+            goto out;
+        }
+        strcpy(blob->digest, diff_ids[i]);
+        strcpy(blob->media_type, MEDIA_TYPE_OCI_LAYER);
+        blob->layer_id = image.layers[i].id;
+
+        indexes[i] = lazy_build_index(image.layers[i].id, diff_ids[i], &index_len);
+        if (!indexes[i]) {
+            goto out;
+        }
+        strcpy(index->digest, "sha256:");
+        sha256_hex(indexes[i], index_len, index->digest + 7);
+        strcpy(index->media_type, MEDIA_TYPE_FILE_INDEX);
+        index->size = index_len;
+        index->data = indexes[i];
+        strcpy(blob->index_digest, index->digest);
+        blob->index_size = index_len;
+    }
+
+    config = build_image_config(&image, diff_ids, &config_len);
+    if (!config) {
+        goto out;
+    }
+    strcpy(blobs[0].digest, "sha256:");
+    sha256_hex(config, config_len, blobs[0].digest + 7);
+    strcpy(blobs[0].media_type, MEDIA_TYPE_OCI_CONFIG);
+    blobs[0].size = config_len;
+    blobs[0].data = config;
+
+    if (transfer_blobs(&ref, blobs, 2 * image.layer_count + 1, 1, stats) != 0) {
+        goto out;
+    }
+
+    // The manifest goes last, once everything it names is in place
+    manifest = build_manifest(blobs, image.layer_count + 1, &manifest_len);
+    conn = malloc(sizeof(registry_conn_t));
+    if (!manifest || !conn) {
+        goto out;
+    }
+
+    snprintf(path, sizeof(path), "/v2/%s/manifests/%s", ref.repository, ref.reference);
+    snprintf(headers, sizeof(headers), "Content-Type: %s\r\n", MEDIA_TYPE_OCI_MANIFEST);
+    conn->head = 0;
+    if (conn_open(conn, ref.host, ref.port) != 0) {
+        goto out;
+    }
+    if (conn_send_head(conn, "PUT", ref.host, ref.port, path, headers, manifest_len) != 0 ||
+        write_all(conn->fd, manifest, manifest_len) != 0 || conn_read_response(conn) != 0) {
+        conn_close(conn);
+        goto out;
+    }
+    if (conn->status != 201) {
+        fprintf(stderr, "Registry rejected the manifest for %s (status %d)\n", image_ref, conn->status);
+    } else {
+        result = 0;
+    }
+    conn_close(conn);
+
+out:
+    free(conn);
+    free(manifest);
+    free(config);
+    for (int i = 0; indexes && i < image.layer_count; i++) {
+        free(indexes[i]);
+    }
+    free(indexes);
+    free(blobs);
+    free(diff_ids);
+    free(image.layers);
+    return result;
+}
@@ -0,0 +1,68 @@
+#ifndef REGISTRY_H
+#define REGISTRY_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "config.h"
+#include "image.h"
+#include "sha256.h"
+
+#define REGISTRY_BUFFER_SIZE (64 * 1024)
+#define REGISTRY_MAX_MANIFEST_LEN (4 * 1024 * 1024)
+#define REGISTRY_MAX_REDIRECTS 3
+#define REGISTRY_MAX_ATTEMPTS 4
+#define REGISTRY_MAX_URL_LEN 2048
+
+#define MEDIA_TYPE_OCI_MANIFEST "application/vnd.oci.image.manifest.v1+json"
+#define MEDIA_TYPE_OCI_INDEX "application/vnd.oci.image.index.v1+json"
+#define MEDIA_TYPE_OCI_CONFIG "application/vnd.oci.image.config.v1+json"
+#define MEDIA_TYPE_OCI_LAYER "application/vnd.oci.image.layer.v1.tar"
+#define MEDIA_TYPE_DOCKER_MANIFEST "application/vnd.docker.distribution.manifest.v2+json"
+#define MEDIA_TYPE_DOCKER_LIST "application/vnd.docker.distribution.manifest.list.v2+json"
+#define MEDIA_TYPE_DOCKER_LAYER "application/vnd.docker.image.rootfs.diff.tar"
+
+// host:port/repository[:tag|@digest], plus the name the image gets locally
+typedef struct {
+    char host[256];
+    int port;
+    char repository[256];
+    char reference[MAX_DIGEST_LEN];     // tag or digest
+    char local_name[MAX_IMAGE_NAME_LEN];
+    char local_tag[MAX_IMAGE_TAG_LEN];
+} registry_ref_t;
+
+typedef struct {
+    char digest[MAX_DIGEST_LEN];
+    char media_type[128];
+    long long size;
+    const char *layer_id;       // push: layer whose tar stream is the blob
+    const char *data;           // push: in-memory blob such as the config
+    char index_digest[MAX_DIGEST_LEN];  // layer's file index, for lazy pulls
+    long long index_size;
+    int present;                // already in the content store or registry
+    int lazy;                   // pull: laid out from its file index instead
+    long long transferred;
+    long long resumed;          // bytes kept from an interrupted download
+    int failed;
+} registry_blob_t;
+
+typedef struct {
+    int blobs_transferred;
+    int blobs_skipped;
+    long long bytes_transferred;
+    long long bytes_resumed;
+    int layers_lazy;            // laid out from their file index only
+} registry_stats_t;
+
+// Function declarations
+int parse_registry_ref(const char *image_ref, registry_ref_t *ref);
+int registry_pull(const char *image_ref, int lazy, char *local_ref, size_t ref_size, registry_stats_t *stats);
+int registry_push(const char *image_ref, registry_stats_t *stats);
+int registry_fetch_blob(const char *source, long long size);
+int registry_fetch_range(const char *source, long long offset, long long length, int fd, sha256_ctx_t *hash);
+
+#endif // REGISTRY_H
@@ -0,0 +1,28 @@
+#ifndef SHA256_H
+#define SHA256_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define SHA256_DIGEST_LEN 32
+#define SHA256_HEX_LEN 64
+#define SHA256_BLOCK_LEN 64
+
+typedef struct {
+    uint32_t state[8];
+    uint64_t bit_count;
+    uint8_t buffer[SHA256_BLOCK_LEN];
+    size_t buffer_len;
+} sha256_ctx_t;
+
+// Function declarations
+void sha256_init(sha256_ctx_t *ctx);
+void sha256_update(sha256_ctx_t *ctx, const void *data, size_t len);
+void sha256_final(sha256_ctx_t *ctx, uint8_t digest[SHA256_DIGEST_LEN]);
+
+// Helper functions
+void sha256_to_hex(const uint8_t digest[SHA256_DIGEST_LEN], char hex[SHA256_HEX_LEN + 1]);
+void sha256_hex(const void *data, size_t len, char hex[SHA256_HEX_LEN + 1]);
+int sha256_file(const char *path, char hex[SHA256_HEX_LEN + 1]);
+
+#endif // SHA256_H
@@ -0,0 +1,1304 @@
+#include "tar.h"
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/sysmacros.h>
+#include <time.h>
+
+#define TAR_LONGLINK_NAME "././@LongLink"
+#define TAR_SENDFILE_MIN (64 * 1024)
+#define TAR_MAX_PAX_LEN (64 * 1024)
+
+typedef struct {
+    char name[100];
+    char mode[8];
+    char uid[8];
+    char gid[8];
+    char size[12];
+    char mtime[12];
+    char checksum[8];
+    char type;
+    char linkname[100];
+    char magic[6];
+    char version[2];
+    char uname[32];
+    char gname[32];
+    char devmajor[8];
+    char devminor[8];
+    char prefix[155];
+    char pad[12];
+} tar_header_t;
+
+static const char zero_block[TAR_BLOCK_SIZE];
+
+// Octal while it fits, otherwise the GNU base-256 form (files over 8 GB)
+static void format_number(char *field, size_t width, unsigned long long value) {
+    if (value < (1ULL << (3 * (width - 1)))) {
+        snprintf(field, width, "%0*llo", (int)(width - 1), value);
+        return;
+    }
+
+    memset(field, 0, width);
+    for (size_t i = width - 1; i > 0; i--) {
+        field[i] = value & 0xff;
+        value >>= 8;
+    }
+    field[0] = (char)0x80;
+}
+
+static long long parse_number(const char *field, size_t width) {
+    long long value = 0;
+
+    if ((unsigned char)field[0] & 0x80) {
+        value = field[0] & 0x7f;
+        for (size_t i = 1; i < width; i++) {
+            value = (value << 8) | (unsigned char)field[i];
+        }
+        return value;
+    }
+
+    for (size_t i = 0; i < width && field[i]; i++) {
+        if (field[i] >= '0' && field[i] <= '7') {
+            value = value * 8 + (field[i] - '0');
+        } else if (field[i] != ' ') {
+            break;
+        }
+    }
+    return value;
+}
+
+static unsigned int header_checksum(const tar_header_t *header) {
+    const unsigned char *bytes = (const unsigned char*)header;
+    unsigned int sum = 0;
+
+    for (size_t i = 0; i < sizeof(tar_header_t); i++) {
+        if (i >= offsetof(tar_header_t, checksum) && i < offsetof(tar_header_t, checksum) + 8) {
+            sum += ' ';
+        } else {
+            sum += bytes[i];
+        }
+    }
+    return sum;
+}
+
+// ---------------------------------------------------------------------------
+// Writer
+
+static int write_out(tar_writer_t *writer, const void *data, size_t len) {
+    const char *p = data;
+
+    while (len > 0) {
+        ssize_t n = writer->socket ? send(writer->fd, p, len, MSG_NOSIGNAL) : write(writer->fd, p, len);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static int write_chunk_header(tar_writer_t *writer, unsigned long long len) {
+    char size_line[32];
+
+    if (!writer->chunked) {
+        return 0;
+    }
+    int n = snprintf(size_line, sizeof(size_line), "%llx\r\n", len);
+    return write_out(writer, size_line, n);
+}
+
+static int write_chunk_trailer(tar_writer_t *writer) {
+    return writer->chunked ? write_out(writer, "\r\n", 2) : 0;
+}
+
+tar_writer_t* tar_writer_open(int fd, int chunked) {
+    tar_writer_t *writer;
+    struct stat st;
+
+    writer = calloc(1, sizeof(tar_writer_t));
+    if (!writer) {
+        perror("calloc");
+        return NULL;
+    }
+
+    writer->fd = fd;
+    writer->chunked = chunked;
+    writer->socket = fd >= 0 && fstat(fd, &st) == 0 && S_ISSOCK(st.st_mode);
+    return writer;
+}
+
+int tar_writer_close(tar_writer_t *writer) {
+    int result = tar_flush(writer);
+
+    if (writer->compressor && lz_writer_close(writer->compressor) != 0) {
+        result = -1;
+    }
+    free(writer);
+    return result;
+}
+
+// Sends bytes that are ready for the wire, framed as a chunk when needed
+static int emit(void *ctx, const void *data, size_t len) {
+    tar_writer_t *writer = ctx;
+
+    if (write_chunk_header(writer, len) != 0 ||
+        write_out(writer, data, len) != 0 ||
+        write_chunk_trailer(writer) != 0) {
+        return -1;
+    }
+    return 0;
+}
+
+int tar_writer_compress(tar_writer_t *writer, int threads) {
+    if (writer->fd < 0 || writer->compressor || writer->offset > 0) {
+        return -1;
+    }
+
+    writer->compressor = lz_writer_open(emit, writer, threads);
+    return writer->compressor ? 0 : -1;
+}
+
+// Whether emitted bytes are only counted
+static int counting_only(const tar_writer_t *writer) {
+    return writer->fd < 0 && !writer->chunks;
+}
+
+int tar_flush(tar_writer_t *writer) {
+    int result;
+
+    if (writer->buffered == 0 || counting_only(writer)) {
+        writer->buffered = 0;
+        return 0;
+    }
+
+    if (writer->chunks) {
+        result = chunk_write(writer->chunks, writer->buffer, writer->buffered);
+    } else if (writer->compressor) {
+        result = lz_write(writer->compressor, writer->buffer, writer->buffered);
+    } else {
+        result = emit(writer, writer->buffer, writer->buffered);
+    }
+
+    writer->buffered = 0;
+    return result;
+}
+
+int tar_write_data(tar_writer_t *writer, const void *data, size_t len) {
+    const char *p = data;
+
+    if (writer->hash) {
+        sha256_update(writer->hash, data, len);
+    }
+    writer->offset += len;
+
+    if (counting_only(writer)) {
+        return 0;
+    }
+
+    while (len > 0) {
+        size_t space = TAR_BUFFER_SIZE - writer->buffered;
+        size_t n = len < space ? len : space;
+
+        memcpy(writer->buffer + writer->buffered, p, n);
+        writer->buffered += n;
+        p += n;
+        len -= n;
+
+        if (writer->buffered == TAR_BUFFER_SIZE && tar_flush(writer) != 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int tar_pad(tar_writer_t *writer) {
+    size_t partial = writer->offset % TAR_BLOCK_SIZE;
+
+    if (partial == 0) {
+        return 0;
+    }
+    return tar_write_data(writer, zero_block, TAR_BLOCK_SIZE - partial);
+}
+
+// Copies size bytes of fd into the archive. If the file shrank since its
+// header was written the rest is zero filled so the archive stays valid.
+int tar_write_file_data(tar_writer_t *writer, int fd, long long size) {
+    long long left = size;
+
+    if (counting_only(writer) && !writer->hash) {
+        writer->offset += size;
+        return 0;
+    }
+
+    // Hashing and compression need the bytes in userspace anyway, and small
+    // files are cheaper to batch with their headers than to send on their own
+    if (writer->hash || writer->compressor || writer->fd < 0 || size < TAR_SENDFILE_MIN) {
+        while (left > 0) {
+            if (writer->buffered == TAR_BUFFER_SIZE && tar_flush(writer) != 0) {
+                return -1;
+            }
+
+            size_t space = TAR_BUFFER_SIZE - writer->buffered;
+            if ((long long)space > left) space = left;
+
+            ssize_t n = read(fd, writer->buffer + writer->buffered, space);
+            if (n < 0) {
+                if (errno == EINTR) continue;
+                perror("read");
+                return -1;
+            }
+            if (n == 0) {
+                memset(writer->buffer + writer->buffered, 0, space);
+                n = space;
+            }
+
+            if (writer->hash) {
+                sha256_update(writer->hash, writer->buffer + writer->buffered, n);
+            }
+            writer->buffered += n;
+            writer->offset += n;
+            left -= n;
+        }
+        return 0;
+    }
+
+    // Large files go straight from the page cache to the output
+    if (tar_flush(writer) != 0 || write_chunk_header(writer, size) != 0) {
+        return -1;
+    }
+
+    while (left > 0) {
+        ssize_t n = sendfile(writer->fd, fd, NULL, left > (1 << 30) ? (1 << 30) : left);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            perror("sendfile");
+            return -1;
+        }
+        if (n == 0) {
+            while (left > 0) {
+                size_t len = left > TAR_BLOCK_SIZE ? TAR_BLOCK_SIZE : left;
+                if (write_out(writer, zero_block, len) != 0) {
+                    return -1;
+                }
+                left -= len;
+            }
+            break;
+        }
+        left -= n;
+    }
+
+    writer->offset += size;
+    return write_chunk_trailer(writer);
+}
+
+static int write_long_name(tar_writer_t *writer, char type, const char *name) {
+    tar_header_t header;
+    size_t len = strlen(name) + 1;
+
+    memset(&header, 0, sizeof(header));
+    strcpy(header.name, TAR_LONGLINK_NAME);
+    format_number(header.mode, sizeof(header.mode), 0644);
+    format_number(header.uid, sizeof(header.uid), 0);
+    format_number(header.gid, sizeof(header.gid), 0);
+    format_number(header.size, sizeof(header.size), len);
+    format_number(header.mtime, sizeof(header.mtime), 0);
+    header.type = type;
+    memcpy(header.magic, "ustar ", 6);
+    memcpy(header.version, " ", 2);
+    snprintf(header.checksum, 7, "%06o", header_checksum(&header));
+    header.checksum[7] = ' ';
+
+    if (tar_write_data(writer, &header, sizeof(header)) != 0 ||
+        tar_write_data(writer, name, len) != 0) {
+        return -1;
+    }
+    return tar_pad(writer);
+}
+
+int tar_write_header(tar_writer_t *writer, const char *name, const struct stat *st, const char *linkname) {
+    tar_header_t header;
+    unsigned long long size = 0;
+
+    memset(&header, 0, sizeof(header));
+
+    // A regular file given a link name is a hard link to that entry
+    if (S_ISREG(st->st_mode) && linkname) {
+        header.type = '1';
+    } else if (S_ISREG(st->st_mode)) {
+        header.type = '0';
+        size = st->st_size;
+    } else if (S_ISDIR(st->st_mode)) {
+        header.type = '5';
+    } else if (S_ISLNK(st->st_mode)) {
+        header.type = '2';
+    } else if (S_ISCHR(st->st_mode)) {
+        header.type = '3';
+    } else if (S_ISBLK(st->st_mode)) {
+        header.type = '4';
+    } else if (S_ISFIFO(st->st_mode)) {
+        header.type = '6';
+    } else {
+        return -1;
+    }
+
+    // Names that do not fit the header travel in a GNU long-name entry first
+    if (strlen(name) >= sizeof(header.name) && write_long_name(writer, 'L', name) != 0) {
+        return -1;
+    }
+    if (linkname && strlen(linkname) >= sizeof(header.linkname) && write_long_name(writer, 'K', linkname) != 0) {
+        return -1;
+    }
+
+    // Header fields are not NUL-terminated when the name fills them
+    memcpy(header.name, name, strnlen(name, sizeof(header.name)));
+    if (linkname) {
+        memcpy(header.linkname, linkname, strnlen(linkname, sizeof(header.linkname)));
+    }
+    format_number(header.mode, sizeof(header.mode), st->st_mode & 07777);
+    format_number(header.uid, sizeof(header.uid), st->st_uid);
+    format_number(header.gid, sizeof(header.gid), st->st_gid);
+    format_number(header.size, sizeof(header.size), size);
+    format_number(header.mtime, sizeof(header.mtime), st->st_mtime > 0 ? st->st_mtime : 0);
+    memcpy(header.magic, "ustar ", 6);
+    memcpy(header.version, " ", 2);
+
+    if (S_ISCHR(st->st_mode) || S_ISBLK(st->st_mode)) {
+        format_number(header.devmajor, sizeof(header.devmajor), major(st->st_rdev));
+        format_number(header.devminor, sizeof(header.devminor), minor(st->st_rdev));
+    }
+
+    snprintf(header.checksum, 7, "%06o", header_checksum(&header));
+    header.checksum[7] = ' ';
+
+    return tar_write_data(writer, &header, sizeof(header));
+}
+
+int tar_write_buffer(tar_writer_t *writer, const char *name, const void *data, size_t len, mode_t mode) {
+    struct stat st;
+
+    memset(&st, 0, sizeof(st));
+    st.st_mode = S_IFREG | mode;
+    st.st_size = len;
+
+    if (tar_write_header(writer, name, &st, NULL) != 0 ||
+        tar_write_data(writer, data, len) != 0) {
+        return -1;
+    }
+    return tar_pad(writer);
+}
+
+static int compare_names(const void *a, const void *b) {
+    return strcmp(*(const char* const*)a, *(const char* const*)b);
+}
+
+// Entries are emitted in sorted order so the same tree always produces the
+// same bytes, which is what makes a layer digest reusable
+typedef struct {
+    const char *skip_prefix;    // top-level names to leave out
+    tar_tree_filter_t filter;
+    void *ctx;
+} tree_walk_t;
+
+static int write_opaque_marker(tar_writer_t *writer, const char *dir_name, const struct stat *dir_st) {
+    char name[PATH_MAX + sizeof(TAR_OPAQUE_MARKER)];
+    struct stat st;
+
+    memset(&st, 0, sizeof(st));
+    st.st_mode = S_IFREG | 0644;
+    st.st_mtime = dir_st->st_mtime;
+    snprintf(name, sizeof(name), "%s%s", dir_name, TAR_OPAQUE_MARKER);
+    return tar_write_header(writer, name, &st, NULL);
+}
+
+static int write_tree_dir(tar_writer_t *writer, char *path, size_t root_len, const tree_walk_t *walk) {
+    char name[PATH_MAX + 1];
+    char link_target[PATH_MAX];
+    char **names = NULL;
+    size_t count = 0, capacity = 0;
+    size_t path_len = strlen(path);
+    struct dirent *dirent;
+    int result = 0;
+    DIR *dir;
+
+    dir = opendir(path);
+    if (!dir) {
+        perror("opendir");
+        return -1;
+    }
+
+    while ((dirent = readdir(dir)) != NULL) {
+        if (strcmp(dirent->d_name, ".") == 0 || strcmp(dirent->d_name, "..") == 0) {
+            continue;
+        }
+        if (path_len == root_len && walk->skip_prefix &&
+            strncmp(dirent->d_name, walk->skip_prefix, strlen(walk->skip_prefix)) == 0) {
+            continue;
+        }
+        if (count == capacity) {
+            capacity = capacity ? capacity * 2 : 32;
+            char **grown = realloc(names, capacity * sizeof(char*));
+            if (!grown) {
+                result = -1;
+                break;
+            }
+            names = grown;
+        }
+        if (!(names[count] = strdup(dirent->d_name))) {
+            result = -1;
+            break;
+        }
+        count++;
+    }
+    closedir(dir);
+
+    if (result == 0) {
+        qsort(names, count, sizeof(char*), compare_names);
+    }
+
+    for (size_t i = 0; i < count && result == 0; i++) {
+        struct stat st;
+
+        if (path_len + 1 + strlen(names[i]) >= PATH_MAX) {
+            fprintf(stderr, "tar: path too long: %s/%s\n", path, names[i]);
+            result = -1;
+            break;
+        }
+        snprintf(path + path_len, PATH_MAX - path_len, "/%s", names[i]);
+
+        if (lstat(path, &st) != 0) {
+            perror("lstat");
+            result = -1;
+            break;
+        }
+
+        const char *relative = path + root_len + 1;
+        int verdict = walk->filter ? walk->filter(walk->ctx, path, relative, &st) : TAR_TREE_INCLUDE;
+
+        if (verdict < 0) {
+            result = -1;
+            break;
+        }
+        if (verdict == TAR_TREE_SKIP) {
+            path[path_len] = '\0';
+            continue;
+        }
+
+        if (S_ISDIR(st.st_mode)) {
+            snprintf(name, sizeof(name), "%s/", relative);
+            result = tar_write_header(writer, name, &st, NULL);
+            if (result == 0 && verdict == TAR_TREE_OPAQUE) {
+                result = write_opaque_marker(writer, name, &st);
+            }
+            if (result == 0) {
+                result = write_tree_dir(writer, path, root_len, walk);
+            }
+        } else if (S_ISREG(st.st_mode)) {
+            int fd = open(path, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+            if (fd < 0) {
+                perror("open");
+                result = -1;
+                break;
+            }
+            result = tar_write_header(writer, relative, &st, NULL);
+            if (result == 0) result = tar_write_file_data(writer, fd, st.st_size);
+            if (result == 0) result = tar_pad(writer);
+            close(fd);
+        } else if (S_ISLNK(st.st_mode)) {
+            ssize_t len = readlink(path, link_target, sizeof(link_target) - 1);
+            if (len < 0) {
+                perror("readlink");
+                result = -1;
+                break;
+            }
+            link_target[len] = '\0';
+            result = tar_write_header(writer, relative, &st, link_target);
+        } else if (S_ISCHR(st.st_mode) || S_ISBLK(st.st_mode) || S_ISFIFO(st.st_mode)) {
+            result = tar_write_header(writer, relative, &st, NULL);
+        }
+
+        path[path_len] = '\0';
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        free(names[i]);
+    }
+    free(names);
+    return result;
+}
+
+static int write_root(tar_writer_t *writer, const char *root, const tree_walk_t *walk) {
+    char path[PATH_MAX];
+    size_t root_len = strlen(root);
+
+    while (root_len > 1 && root[root_len - 1] == '/') {
+        root_len--;
+    }
+    if (root_len >= sizeof(path)) {
+        return -1;
+    }
+
+    memcpy(path, root, root_len);
+    path[root_len] = '\0';
+    return write_tree_dir(writer, path, root_len, walk);
+}
+
+int tar_write_tree(tar_writer_t *writer, const char *root, const char *skip_prefix) {
+    tree_walk_t walk = { skip_prefix, NULL, NULL };
+    return write_root(writer, root, &walk);
+}
+
+// Like tar_write_tree, with filter deciding on every entry before it is
+// written; TAR_TREE_SKIP on a directory leaves out everything under it
+int tar_write_tree_filtered(tar_writer_t *writer, const char *root, tar_tree_filter_t filter, void *ctx) {
+    tree_walk_t walk = { NULL, filter, ctx };
+    return write_root(writer, root, &walk);
+}
+
+int tar_finish(tar_writer_t *writer) {
+    if (tar_write_data(writer, zero_block, TAR_BLOCK_SIZE) != 0 ||
+        tar_write_data(writer, zero_block, TAR_BLOCK_SIZE) != 0) {
+        return -1;
+    }
+    return 0;
+}
+
+long long tar_tree_size(const char *root, const char *skip_prefix) {
+    tar_writer_t *writer = tar_writer_open(-1, 0);
+    long long size = -1;
+
+    if (!writer) {
+        return -1;
+    }
+
+    if (tar_write_tree(writer, root, skip_prefix) == 0 && tar_finish(writer) == 0) {
+        size = writer->offset;
+    }
+
+    tar_writer_close(writer);
+    return size;
+}
+
+// ---------------------------------------------------------------------------
+// Reader
+
+tar_reader_t* tar_reader_open(int fd, const void *prefix, size_t prefix_len, long long limit) {
+    tar_reader_t *reader;
+
+    if (prefix_len > TAR_BUFFER_SIZE) {
+        return NULL;
+    }
+
+    reader = calloc(1, sizeof(tar_reader_t));
+    if (!reader) {
+        perror("calloc");
+        return NULL;
+    }
+
+    reader->buffer = malloc(TAR_BUFFER_SIZE);
+    if (!reader->buffer) {
+        perror("malloc");
+        free(reader);
+        return NULL;
+    }
+
+    reader->fd = fd;
+    reader->remaining = limit;
+    if (prefix_len > 0) {
+        memcpy(reader->buffer, prefix, prefix_len);
+        reader->end = prefix_len;
+    }
+    return reader;
+}
+
+void tar_reader_nested(tar_reader_t *reader, tar_reader_t *parent, long long size, sha256_ctx_t *hash) {
+    memset(reader, 0, sizeof(tar_reader_t));
+    reader->fd = -1;
+    reader->parent = parent;
+    reader->remaining = size;
+    reader->hash = hash;
+}
+
+void tar_reader_close(tar_reader_t *reader) {
+    if (!reader) return;
+    lz_reader_close(reader->decompressor);
+    chunk_reader_close(reader->chunks);
+    free(reader->buffer);
+    free(reader);
+}
+
+// Bytes as they arrive on the descriptor, before any decompression
+static ssize_t raw_read(void *ctx, void *dst, size_t len) {
+    tar_reader_t *reader = ctx;
+    ssize_t n;
+
+    if (reader->remaining == 0) {
+        return 0;
+    }
+    if (reader->remaining > 0 && (long long)len > reader->remaining) {
+        len = reader->remaining;
+    }
+
+    if (reader->start < reader->end) {
+        n = reader->end - reader->start;
+        if ((size_t)n > len) n = len;
+        memcpy(dst, reader->buffer + reader->start, n);
+        reader->start += n;
+    } else if (len >= TAR_BUFFER_SIZE) {
+        do {
+            n = read(reader->fd, dst, len);
+        } while (n < 0 && errno == EINTR);
+    } else {
+        // Never read past the end of the stream: the rest belongs to someone else
+        size_t want = TAR_BUFFER_SIZE;
+        if (reader->remaining > 0 && (long long)want > reader->remaining) {
+            want = reader->remaining;
+        }
+        do {
+            n = read(reader->fd, reader->buffer, want);
+        } while (n < 0 && errno == EINTR);
+
+        if (n > 0) {
+            reader->start = 0;
+            reader->end = n;
+            if ((size_t)n > len) n = len;
+            memcpy(dst, reader->buffer, n);
+            reader->start = n;
+        }
+    }
+
+    if (n > 0 && reader->remaining > 0) {
+        reader->remaining -= n;
+    }
+    return n;
+}
+
+static ssize_t stream_read(tar_reader_t *reader, void *dst, size_t len) {
+    ssize_t n;
+
+    if (reader->parent) {
+        if (reader->remaining == 0) {
+            return 0;
+        }
+        if (reader->remaining > 0 && (long long)len > reader->remaining) {
+            len = reader->remaining;
+        }
+        n = tar_read_data(reader->parent, dst, len);
+        if (n > 0 && reader->remaining > 0) {
+            reader->remaining -= n;
+        }
+    } else if (reader->decompressor) {
+        n = lz_read(reader->decompressor, dst, len);
+    } else if (reader->chunks) {
+        n = chunk_read(reader->chunks, dst, len);
+    } else {
+        n = raw_read(reader, dst, len);
+    }
+
+    if (n > 0) {
+        reader->offset += n;
+        if (reader->hash) {
+            sha256_update(reader->hash, dst, n);
+        }
+    }
+    return n;
+}
+
+// Switches a reader over to decompression when its stream starts with an
+// lz frame. Returns 1 if it does, 0 for a plain archive.
+int tar_reader_detect_compression(tar_reader_t *reader, int threads) {
+    if (reader->parent || reader->decompressor || reader->start != 0) {
+        return -1;
+    }
+
+    // Peek at the magic without consuming it
+    while (reader->end < LZ_MAGIC_LEN && (reader->remaining < 0 || reader->remaining > (long long)reader->end)) {
+        ssize_t n = read(reader->fd, reader->buffer + reader->end, LZ_MAGIC_LEN - reader->end);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+        reader->end += n;
+    }
+
+    if (!lz_is_frame(reader->buffer, reader->end)) {
+        return 0;
+    }
+
+    reader->decompressor = lz_reader_open(raw_read, reader, threads);
+    return reader->decompressor ? 1 : -1;
+}
+
+static ssize_t stream_read_full(tar_reader_t *reader, void *dst, size_t len) {
+    size_t got = 0;
+
+    while (got < len) {
+        ssize_t n = stream_read(reader, (char*)dst + got, len - got);
+        if (n < 0) return -1;
+        if (n == 0) break;
+        got += n;
+    }
+    return got;
+}
+
+static int stream_skip(tar_reader_t *reader, long long len) {
+    char scratch[8192];
+
+    while (len > 0) {
+        ssize_t n = stream_read(reader, scratch, len > (long long)sizeof(scratch) ? (long long)sizeof(scratch) : len);
+        if (n <= 0) {
+            return -1;
+        }
+        len -= n;
+    }
+    return 0;
+}
+
+ssize_t tar_read_data(tar_reader_t *reader, void *dst, size_t len) {
+    ssize_t n;
+
+    if (reader->entry_data == 0) {
+        return 0;
+    }
+    if ((long long)len > reader->entry_data) {
+        len = reader->entry_data;
+    }
+
+    n = stream_read(reader, dst, len);
+    if (n <= 0) {
+        fprintf(stderr, "tar: archive truncated\n");
+        return -1;
+    }
+
+    reader->entry_data -= n;
+    return n;
+}
+
+int tar_read_all(tar_reader_t *reader, char **data, size_t max_len) {
+    size_t len = reader->entry_data;
+    char *buffer;
+
+    if (len > max_len) {
+        fprintf(stderr, "tar: entry too large (%zu bytes)\n", len);
+        return -1;
+    }
+
+    buffer = malloc(len + 1);
+    if (!buffer) {
+        perror("malloc");
+        return -1;
+    }
+
+    for (size_t got = 0; got < len; ) {
+        ssize_t n = tar_read_data(reader, buffer + got, len - got);
+        if (n <= 0) {
+            free(buffer);
+            return -1;
+        }
+        got += n;
+    }
+
+    buffer[len] = '\0';
+    *data = buffer;
+    return 0;
+}
+
+int tar_drain(tar_reader_t *reader) {
+    char scratch[8192];
+    ssize_t n;
+
+    reader->entry_data = 0;
+    reader->entry_pad = 0;
+    while ((n = stream_read(reader, scratch, sizeof(scratch))) > 0) {
+    }
+    return n < 0 ? -1 : 0;
+}
+
+static void parse_pax_records(const char *data, size_t len, tar_entry_t *entry, long long *size) {
+    const char *p = data;
+    const char *end = data + len;
+
+    while (p < end) {
+        char *space;
+        long record_len = strtol(p, &space, 10);
+
+        if (record_len <= 0 || *space != ' ' || p + record_len > end) {
+            break;
+        }
+
+        const char *key = space + 1;
+        const char *equals = memchr(key, '=', p + record_len - key);
+        if (equals) {
+            const char *value = equals + 1;
+            size_t value_len = p + record_len - 1 - value;
+
+            if (strncmp(key, "path=", 5) == 0 && value_len < sizeof(entry->name)) {
+                memcpy(entry->name, value, value_len);
+                entry->name[value_len] = '\0';
+            } else if (strncmp(key, "linkpath=", 9) == 0 && value_len < sizeof(entry->linkname)) {
+                memcpy(entry->linkname, value, value_len);
+                entry->linkname[value_len] = '\0';
+            } else if (strncmp(key, "size=", 5) == 0) {
+                *size = strtoll(value, NULL, 10);
+            }
+        }
+        p += record_len;
+    }
+}
+
+int tar_next(tar_reader_t *reader, tar_entry_t *entry) {
+    tar_header_t header;
+    long long pax_size = -1;
+    int has_name = 0, has_link = 0;
+
+    if (stream_skip(reader, reader->entry_data + reader->entry_pad) != 0) {
+        return -1;
+    }
+    reader->entry_data = 0;
+    reader->entry_pad = 0;
+
+    memset(entry, 0, sizeof(tar_entry_t));
+
+    for (;;) {
+        ssize_t got = stream_read_full(reader, &header, sizeof(header));
+
+        // A stream that stops on a block boundary is treated as finished
+        if (got == 0) return 0;
+        if (got != sizeof(header)) {
+            fprintf(stderr, "tar: archive truncated\n");
+            return -1;
+        }
+        if (memcmp(&header, zero_block, sizeof(header)) == 0) {
+            return 0;
+        }
+        if (parse_number(header.checksum, sizeof(header.checksum)) != header_checksum(&header)) {
+            fprintf(stderr, "tar: bad header checksum\n");
+            return -1;
+        }
+
+        long long size = parse_number(header.size, sizeof(header.size));
+        long long pad = (TAR_BLOCK_SIZE - size % TAR_BLOCK_SIZE) % TAR_BLOCK_SIZE;
+
+        if (header.type == 'L' || header.type == 'K' || header.type == 'x') {
+            char *data;
+
+            reader->entry_data = size;
+            reader->entry_pad = pad;
+            if (tar_read_all(reader, &data, header.type == 'x' ? TAR_MAX_PAX_LEN : PATH_MAX - 1) != 0) {
+                return -1;
+            }
+            if (header.type == 'L') {
+                strcpy(entry->name, data);
+                has_name = 1;
+            } else if (header.type == 'K') {
+                strcpy(entry->linkname, data);
+                has_link = 1;
+            } else {
+                parse_pax_records(data, size, entry, &pax_size);
+                has_name = has_name || entry->name[0];
+                has_link = has_link || entry->linkname[0];
+            }
+            free(data);
+            if (stream_skip(reader, pad) != 0) {
+                return -1;
+            }
+            reader->entry_pad = 0;
+            continue;
+        }
+
+        if (header.type == 'g') {
+            if (stream_skip(reader, size + pad) != 0) {
+                return -1;
+            }
+            continue;
+        }
+
+        if (!has_name) {
+            if (memcmp(header.magic, "ustar\0", 6) == 0 && header.prefix[0]) {
+                snprintf(entry->name, sizeof(entry->name), "%.155s/%.100s", header.prefix, header.name);
+            } else {
+                snprintf(entry->name, sizeof(entry->name), "%.100s", header.name);
+            }
+        }
+        if (!has_link) {
+            snprintf(entry->linkname, sizeof(entry->linkname), "%.100s", header.linkname);
+        }
+
+        entry->type = header.type ? header.type : '0';
+        entry->mode = parse_number(header.mode, sizeof(header.mode)) & 07777;
+        entry->uid = parse_number(header.uid, sizeof(header.uid));
+        entry->gid = parse_number(header.gid, sizeof(header.gid));
+        entry->size = pax_size >= 0 ? pax_size : size;
+        entry->mtime = parse_number(header.mtime, sizeof(header.mtime));
+        entry->devmajor = parse_number(header.devmajor, sizeof(header.devmajor));
+        entry->devminor = parse_number(header.devminor, sizeof(header.devminor));
+
+        // Links, directories and device nodes carry no data
+        if (strchr("123456", entry->type)) {
+            entry->size = 0;
+        }
+        reader->entry_data = entry->size;
+        reader->entry_pad = (TAR_BLOCK_SIZE - entry->size % TAR_BLOCK_SIZE) % TAR_BLOCK_SIZE;
+        return 1;
+    }
+}
+
+// ---------------------------------------------------------------------------
+// Extraction
+
+// Archive names are relative to the extraction root and must stay inside it
+static int sanitize_name(const char *name, char *out, size_t size) {
+    const char *p = name;
+    size_t len;
+
+    while (*p == '/' || (p[0] == '.' && p[1] == '/')) {
+        p += *p == '/' ? 1 : 2;
+    }
+
+    len = strlen(p);
+    while (len > 0 && p[len - 1] == '/') {
+        len--;
+    }
+    if (len == 0 || (len == 1 && p[0] == '.')) {
+        return 1;
+    }
+    if (len >= size) {
+        return -1;
+    }
+
+    memcpy(out, p, len);
+    out[len] = '\0';
+
+    for (char *component = out; component; ) {
+        char *slash = strchr(component, '/');
+        size_t component_len = slash ? (size_t)(slash - component) : strlen(component);
+        if (component_len == 2 && component[0] == '.' && component[1] == '.') {
+            return -1;
+        }
+        component = slash ? slash + 1 : NULL;
+    }
+    return 0;
+}
+
+static int resolves_inside(const char *root, size_t root_len, const char *path) {
+    char resolved[PATH_MAX];
+
+    return realpath(path, resolved) != NULL &&
+           strncmp(resolved, root, root_len) == 0 &&
+           (resolved[root_len] == '/' || resolved[root_len] == '\0');
+}
+
+// Creates a missing directory. One that exists already may be a symlink an
+// earlier entry made; it has to stay inside the root, or the next mkdir
+// would create something outside it.
+static int make_parent(const char *root, size_t root_len, const char *path) {
+    struct stat st;
+
+    if (mkdir(path, 0755) == 0) {
+        return 0;
+    }
+    if (errno != EEXIST || lstat(path, &st) != 0) {
+        return -1;
+    }
+    return !S_ISLNK(st.st_mode) || resolves_inside(root, root_len, path) ? 0 : -1;
+}
+
+// Creates missing parents and checks that none of them is a symlink
+// pointing out of the root, which would let an entry escape it
+static int prepare_parent(const char *root, size_t root_len, char *path) {
+    char *slash = strrchr(path, '/');
+
+    if (!slash || (size_t)(slash - path) < root_len) {
+        return -1;
+    }
+
+    *slash = '\0';
+    for (char *p = path + root_len + 1; *p; p++) {
+        if (*p == '/') {
+            *p = '\0';
+            if (make_parent(root, root_len, path) != 0) {
+                *p = '/';
+                *slash = '/';
+                return -1;
+            }
+            *p = '/';
+        }
+    }
+    if (slash > path + root_len && make_parent(root, root_len, path) != 0) {
+        *slash = '/';
+        return -1;
+    }
+
+    int inside = resolves_inside(root, root_len, path);
+    *slash = '/';
+    return inside ? 0 : -1;
+}
+
+// Checks, without creating anything, that path's directory resolves inside
+// the root
+static int parent_inside(const char *root, size_t root_len, char *path) {
+    char *slash = strrchr(path, '/');
+
+    if (!slash || (size_t)(slash - path) < root_len) {
+        return 0;
+    }
+    *slash = '\0';
+    int inside = resolves_inside(root, root_len, path);
+    *slash = '/';
+    return inside;
+}
+
+static int remove_existing(const char *path) {
+    struct stat st;
+
+    if (lstat(path, &st) != 0) {
+        return errno == ENOENT ? 0 : -1;
+    }
+    if (S_ISDIR(st.st_mode)) {
+        return rmdir(path) == 0 || errno == ENOTEMPTY ? 0 : -1;
+    }
+    return unlink(path);
+}
+
+static int extract_file(tar_reader_t *reader, const tar_entry_t *entry, const char *path, char *buffer) {
+    int fd;
+    ssize_t n;
+
+    if (remove_existing(path) != 0) {
+        perror("unlink");
+        return -1;
+    }
+
+    fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW | O_CLOEXEC, entry->mode & 07777);
+    if (fd < 0) {
+        perror("open");
+        return -1;
+    }
+
+    while ((n = tar_read_data(reader, buffer, TAR_BUFFER_SIZE)) > 0) {
+        for (ssize_t written = 0; written < n; ) {
+            ssize_t w = write(fd, buffer + written, n - written);
+            if (w < 0) {
+                if (errno == EINTR) continue;
+                perror("write");
+                close(fd);
+                return -1;
+            }
+            written += w;
+        }
+    }
+
+    if (n < 0) {
+        close(fd);
+        return -1;
+    }
+
+    struct timespec times[2] = { { entry->mtime, 0 }, { entry->mtime, 0 } };
+    if (geteuid() == 0 && fchown(fd, entry->uid, entry->gid) != 0) {
+        perror("fchown");
+    }
+    fchmod(fd, entry->mode & 07777);
+    futimens(fd, times);
+    close(fd);
+    return 0;
+}
+
+static int create_placeholder(const tar_entry_t *entry, const char *path) {
+    struct timespec times[2] = { { entry->mtime, 0 }, { entry->mtime, 0 } };
+    int fd;
+
+    if (remove_existing(path) != 0) {
+        perror("unlink");
+        return -1;
+    }
+
+    fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW | O_CLOEXEC, entry->mode & 07777);
+    if (fd < 0) {
+        perror("open");
+        return -1;
+    }
+    if (ftruncate(fd, entry->size) != 0) {
+        perror("ftruncate");
+        close(fd);
+        return -1;
+    }
+
+    if (geteuid() == 0 && fchown(fd, entry->uid, entry->gid) != 0) {
+        perror("fchown");
+    }
+    fchmod(fd, entry->mode & 07777);
+    futimens(fd, times);
+    close(fd);
+    return 0;
+}
+
+// Creates one entry under root_path. Without a reader, regular files are
+// left as sparse placeholders of their full size.
+static int extract_entry(tar_reader_t *reader, const char *root_path, size_t root_len, const tar_entry_t *entry,
+                         char *path, size_t path_size, char *buffer) {
+    char relative[PATH_MAX];
+    int sanitized = sanitize_name(entry->name, relative, sizeof(relative));
+
+    if (sanitized == 1) {
+        return 1;
+    }
+    snprintf(path, path_size, "%s/%s", root_path, relative);
+    if (sanitized != 0 || prepare_parent(root_path, root_len, path) != 0) {
+        fprintf(stderr, "tar: refusing unsafe path %s\n", entry->name);
+        return -1;
+    }
+
+    switch (entry->type) {
+        case '0':
+        case '7':
+            if (reader) {
+                return extract_file(reader, entry, path, buffer);
+            }
+            return create_placeholder(entry, path);
+
+        case '5': {
+            int fd;
+
+            if (mkdir(path, entry->mode & 07777) != 0 && errno != EEXIST) {
+                perror("mkdir");
+                return -1;
+            }
+            // What is there already has to be a directory itself, not a
+            // symlink that would carry the mode and owner somewhere else
+            fd = open(path, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+            if (fd < 0) {
+                fprintf(stderr, "tar: refusing directory %s over something else\n", entry->name);
+                return -1;
+            }
+            fchmod(fd, entry->mode & 07777);
+            if (geteuid() == 0 && fchown(fd, entry->uid, entry->gid) != 0) {
+                perror("fchown");
+            }
+            close(fd);
+            return 0;
+        }
+
+        case '2': {
+            struct timespec times[2] = { { entry->mtime, 0 }, { entry->mtime, 0 } };
+            if (remove_existing(path) != 0 || symlink(entry->linkname, path) != 0) {
+                perror("symlink");
+                return -1;
+            }
+            if (geteuid() == 0 && lchown(path, entry->uid, entry->gid) != 0) {
+                perror("lchown");
+            }
+            utimensat(AT_FDCWD, path, times, AT_SYMLINK_NOFOLLOW);
+            return 0;
+        }
+
+        case '1': {
+            char target_relative[PATH_MAX];
+            char target[PATH_MAX * 2];
+            struct stat st;
+
+            // link() follows symlinks on the way to the target, and a link to
+            // a symlink would be one to wherever it points later
+            if (sanitize_name(entry->linkname, target_relative, sizeof(target_relative)) != 0 ||
+                snprintf(target, sizeof(target), "%s/%s", root_path, target_relative) >= (int)sizeof(target) ||
+                !parent_inside(root_path, root_len, target) || lstat(target, &st) != 0 || !S_ISREG(st.st_mode)) {
+                fprintf(stderr, "tar: refusing unsafe link target %s\n", entry->linkname);
+                return -1;
+            }
+            if (remove_existing(path) != 0 || link(target, path) != 0) {
+                perror("link");
+                return -1;
+            }
+            return 0;
+        }
+
+        case '3':
+        case '4':
+        case '6': {
+            mode_t type = entry->type == '3' ? S_IFCHR : entry->type == '4' ? S_IFBLK : S_IFIFO;
+            if (remove_existing(path) != 0 ||
+                mknod(path, type | (entry->mode & 07777), makedev(entry->devmajor, entry->devminor)) != 0) {
+                // Unprivileged extraction cannot create device nodes
+                fprintf(stderr, "tar: skipping special file %s: %s\n", relative, strerror(errno));
+            }
+            return 0;
+        }
+
+        default:
+            return 0;
+    }
+}
+
+int tar_extract(tar_reader_t *reader, const char *root) {
+    char root_path[PATH_MAX];
+    char path[PATH_MAX * 2];
+    tar_entry_t *entry;
+    char *buffer;
+    size_t root_len;
+    int rc;
+
+    if (!realpath(root, root_path)) {
+        perror("realpath");
+        return -1;
+    }
+    root_len = strlen(root_path);
+
+    entry = malloc(sizeof(tar_entry_t));
+    buffer = malloc(TAR_BUFFER_SIZE);
+    if (!entry || !buffer) {
+        free(entry);
+        free(buffer);
+        return -1;
+    }
+
+    while ((rc = tar_next(reader, entry)) == 1) {
+        if (extract_entry(reader, root_path, root_len, entry, path, sizeof(path), buffer) < 0) {
+            rc = -1;
+            break;
+        }
+    }
+
+    free(entry);
+    free(buffer);
+    return rc == 0 ? 0 : -1;
+}
+
+// Creates an entry without its data, for trees whose file contents are
+// filled in later. root must already be canonical. path receives where the
+// entry went; returns 1 for entries that are skipped, like "./".
+int tar_create_entry(const char *root, const tar_entry_t *entry, char *path, size_t path_size) {
+    return extract_entry(NULL, root, strlen(root), entry, path, path_size, NULL);
+}
+
+// The name an entry is extracted under, relative to the root: no leading
+// "./" or "/", no trailing "/". Returns 1 for the root itself and -1 for
+// names that would leave it.
+int tar_entry_path(const char *name, char *path, size_t size) {
+    return sanitize_name(name, path, size);
+}
+
+// Writes the header of an entry read from another archive; its data, if
+// any, follows with tar_write_data and tar_pad
+int tar_write_entry(tar_writer_t *writer, const tar_entry_t *entry) {
+    struct stat st;
+
+    memset(&st, 0, sizeof(st));
+    switch (entry->type) {
+        case '0': case '7': case '1': st.st_mode = S_IFREG; break;
+        case '5': st.st_mode = S_IFDIR; break;
+        case '2': st.st_mode = S_IFLNK; break;
+        case '3': st.st_mode = S_IFCHR; break;
+        case '4': st.st_mode = S_IFBLK; break;
+        case '6': st.st_mode = S_IFIFO; break;
+        default: return -1;
+    }
+    st.st_mode |= entry->mode & 07777;
+    st.st_uid = entry->uid;
+    st.st_gid = entry->gid;
+    st.st_size = entry->type == '1' ? 0 : entry->size;
+    st.st_mtime = entry->mtime;
+    st.st_rdev = makedev(entry->devmajor, entry->devminor);
+
+    return tar_write_header(writer, entry->name, &st,
+                            entry->type == '1' || entry->type == '2' ? entry->linkname : NULL);
+}
@@ -0,0 +1,106 @@
+#ifndef TAR_H
+#define TAR_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include <limits.h>
+
+#include "sha256.h"
+#include "lz.h"
+#include "chunk.h"
+
+#define TAR_BLOCK_SIZE 512
+#define TAR_BUFFER_SIZE (256 * 1024)
+
+// Streams a tar archive to a file, pipe or socket, or into the chunk
+// store. File contents go out through sendfile unless the archive is being
+// hashed or compressed. With fd set to -1 and no chunk writer nothing is
+// written and only the archive size is counted.
+typedef struct {
+    int fd;
+    int socket;                 // use MSG_NOSIGNAL semantics for writes
+    int chunked;                // frame output as HTTP/1.1 chunks
+    lz_writer_t *compressor;    // output goes through the lz codec, when set
+    chunk_writer_t *chunks;     // output is cut into stored chunks instead, when set
+    sha256_ctx_t *hash;         // digest of every byte emitted, when set
+    unsigned long long offset;  // bytes emitted so far
+    size_t buffered;
+    char buffer[TAR_BUFFER_SIZE];
+} tar_writer_t;
+
+// What a tar_write_tree_filtered filter makes of an entry. An opaque
+// directory hides what lower layers have under it: it is followed by an
+// empty TAR_OPAQUE_MARKER entry, as in OCI layers.
+#define TAR_TREE_INCLUDE 0
+#define TAR_TREE_SKIP 1
+#define TAR_TREE_OPAQUE 2
+#define TAR_OPAQUE_MARKER ".wh..wh..opq"
+
+// Called with the entry's full path, its name in the archive and its lstat;
+// returns one of the above, or -1 to fail the walk
+typedef int (*tar_tree_filter_t)(void *ctx, const char *path, const char *relative, const struct stat *st);
+
+typedef struct {
+    char name[PATH_MAX];
+    char linkname[PATH_MAX];
+    char type;
+    mode_t mode;
+    uid_t uid;
+    gid_t gid;
+    long long size;
+    time_t mtime;
+    unsigned int devmajor;
+    unsigned int devminor;
+} tar_entry_t;
+
+// Reads a tar archive from a descriptor, or the contents of one entry of
+// an enclosing archive when parent is set (a layer.tar inside an image).
+typedef struct tar_reader {
+    int fd;
+    struct tar_reader *parent;
+    lz_reader_t *decompressor;  // set once an lz frame is detected
+    chunk_reader_t *chunks;     // the stream comes from the chunk store, when set
+    long long remaining;        // bytes left in this stream, -1 until EOF
+    sha256_ctx_t *hash;         // digest of every byte consumed, when set
+    long long offset;           // archive bytes consumed so far
+    long long entry_data;       // unread data of the current entry
+    long long entry_pad;        // padding after the current entry's data
+    size_t start;
+    size_t end;
+    char *buffer;
+} tar_reader_t;
+
+// Writer
+tar_writer_t* tar_writer_open(int fd, int chunked);
+int tar_writer_compress(tar_writer_t *writer, int threads);
+int tar_writer_close(tar_writer_t *writer);
+int tar_flush(tar_writer_t *writer);
+int tar_write_header(tar_writer_t *writer, const char *name, const struct stat *st, const char *linkname);
+int tar_write_buffer(tar_writer_t *writer, const char *name, const void *data, size_t len, mode_t mode);
+int tar_write_data(tar_writer_t *writer, const void *data, size_t len);
+int tar_write_file_data(tar_writer_t *writer, int fd, long long size);
+int tar_pad(tar_writer_t *writer);
+int tar_write_entry(tar_writer_t *writer, const tar_entry_t *entry);
+int tar_write_tree(tar_writer_t *writer, const char *root, const char *skip_prefix);
+int tar_write_tree_filtered(tar_writer_t *writer, const char *root, tar_tree_filter_t filter, void *ctx);
+int tar_finish(tar_writer_t *writer);
+long long tar_tree_size(const char *root, const char *skip_prefix);
+
+// Reader
+tar_reader_t* tar_reader_open(int fd, const void *prefix, size_t prefix_len, long long limit);
+void tar_reader_nested(tar_reader_t *reader, tar_reader_t *parent, long long size, sha256_ctx_t *hash);
+int tar_reader_detect_compression(tar_reader_t *reader, int threads);
+void tar_reader_close(tar_reader_t *reader);
+int tar_next(tar_reader_t *reader, tar_entry_t *entry);
+ssize_t tar_read_data(tar_reader_t *reader, void *dst, size_t len);
+int tar_read_all(tar_reader_t *reader, char **data, size_t max_len);
+int tar_drain(tar_reader_t *reader);
+int tar_extract(tar_reader_t *reader, const char *root);
+int tar_create_entry(const char *root, const tar_entry_t *entry, char *path, size_t path_size);
+int tar_entry_path(const char *name, char *path, size_t size);
+
+#endif // TAR_H
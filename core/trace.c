@@ -0,0 +1,269 @@
+#include "trace.h"
+#include "json.h"
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+typedef struct {
+    const char *name;
+    char detail[TRACE_DETAIL_LEN];
+    uint64_t start_ns;
+    uint64_t duration_ns;
+    pid_t pid;
+    pid_t tid;
+} trace_record_t;
+
+struct trace_buffer {
+    struct trace_buffer *next;
+    atomic_int owned;
+    atomic_ullong written;              // records ever written; the ring holds the last ones
+    trace_record_t records[TRACE_RING_SIZE];
+};
+
+static atomic_int enabled;
+static _Atomic(trace_buffer_t*) buffers;
+static __thread trace_buffer_t *thread_buffer;
+static __thread int thread_adopted;     // never claim a ring of its own
+static __thread pid_t thread_pid;       // as the daemon sees it, when getpid() differs
+static pthread_key_t buffer_key;
+static pthread_once_t buffer_key_once = PTHREAD_ONCE_INIT;
+
+// ----------------------------------------------------------------------------
+// Recording
+// ----------------------------------------------------------------------------
+
+static uint64_t now_ns(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+static void release_buffer(void *arg) {
+    trace_buffer_t *buffer = arg;
+    atomic_store_explicit(&buffer->owned, 0, memory_order_release);
+}
+
+static void create_buffer_key(void) {
+    pthread_key_create(&buffer_key, release_buffer);
+}
+
+// Claim a ring a finished thread left behind, or map a new one. Rings are
+// never unmapped, so a dump can walk the list without holding anything.
+static trace_buffer_t* claim_buffer(void) {
+    trace_buffer_t *buffer;
+
+    for (buffer = atomic_load_explicit(&buffers, memory_order_acquire); buffer; buffer = buffer->next) {
+        int expected = 0;
+        if (atomic_compare_exchange_strong(&buffer->owned, &expected, 1)) {
+            return buffer;
+        }
+    }
+
+    buffer = mmap(NULL, sizeof(*buffer), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (buffer == MAP_FAILED) {
+        perror("mmap trace");
+        return NULL;
+    }
+    atomic_init(&buffer->owned, 1);
+    buffer->next = atomic_load_explicit(&buffers, memory_order_relaxed);
+    while (!atomic_compare_exchange_weak_explicit(&buffers, &buffer->next, buffer, memory_order_release,
+                                                  memory_order_relaxed)) {
+    }
+    return buffer;
+}
+
+static trace_buffer_t* thread_ring(void) {
+    if (!thread_buffer && !thread_adopted) {
+        pthread_once(&buffer_key_once, create_buffer_key);
+        thread_buffer = claim_buffer();
+        if (thread_buffer) {
+            pthread_setspecific(buffer_key, thread_buffer);
+        }
+    }
+    return thread_buffer;
+}
+
+int init_trace(void) {
+    const char *value = getenv(TRACE_ENV);
+
+    if (pthread_once(&buffer_key_once, create_buffer_key) != 0) {
+        fprintf(stderr, "Failed to create trace thread key\n");
+        return -1;
+    }
+    if (value && strcmp(value, "0") != 0 && value[0] != '\0') {
+        trace_set_enabled(1);
+    }
+    return 0;
+}
+
+void trace_set_enabled(int on) {
+    atomic_store_explicit(&enabled, on ? 1 : 0, memory_order_relaxed);
+}
+
+int trace_enabled(void) {
+    return atomic_load_explicit(&enabled, memory_order_relaxed);
+}
+
+void trace_begin(trace_span_t *span, const char *name) {
+    span->name = name;
+    span->start_ns = atomic_load_explicit(&enabled, memory_order_relaxed) ? now_ns() : 0;
+}
+
+// Only the owning thread writes its ring, so a record is filled in place
+// and then published by moving the count past it
+void trace_end(trace_span_t *span, const char *detail) {
+    trace_buffer_t *buffer;
+
+    if (span->start_ns == 0 || !(buffer = thread_ring())) {
+        return;
+    }
+
+    unsigned long long index = atomic_load_explicit(&buffer->written, memory_order_relaxed);
+    trace_record_t *record = &buffer->records[index & (TRACE_RING_SIZE - 1)];
+
+    record->name = span->name;
+    snprintf(record->detail, sizeof(record->detail), "%s", detail ? detail : "");
+    record->start_ns = span->start_ns;
+    record->duration_ns = now_ns() - span->start_ns;
+    record->pid = thread_pid ? thread_pid : getpid();
+    record->tid = thread_pid ? thread_pid : syscall(SYS_gettid);
+    atomic_store_explicit(&buffer->written, index + 1, memory_order_release);
+}
+
+// Threads that fork a worker attach first, so the worker inherits a ring
+// the daemon can see rather than mapping one of its own
+void trace_attach_thread(void) {
+    if (trace_enabled()) {
+        thread_ring();
+    }
+}
+
+// A ring for a cloned child to adopt; NULL while tracing is off
+trace_buffer_t* trace_reserve_buffer(void) {
+    return trace_enabled() ? claim_buffer() : NULL;
+}
+
+// In the child: write into the reserved ring, or nowhere. A child in a pid
+// namespace of its own is pid 1 to itself; the daemon's /proc, still
+// mounted until the pivot, has its real pid.
+void trace_adopt_buffer(trace_buffer_t *buffer) {
+    char link[32];
+    ssize_t len;
+
+    thread_buffer = buffer;
+    thread_adopted = 1;
+    if (buffer && (len = readlink("/proc/self", link, sizeof(link) - 1)) > 0) {
+        link[len] = '\0';
+        thread_pid = atoi(link);
+    }
+}
+
+// Give a reserved ring back: from the child right before exec, or from the
+// parent when the clone failed
+void trace_release_buffer(trace_buffer_t *buffer) {
+    if (buffer) {
+        release_buffer(buffer);
+    }
+    if (thread_buffer == buffer) {
+        thread_buffer = NULL;
+    }
+}
+
+// ----------------------------------------------------------------------------
+// Export
+// ----------------------------------------------------------------------------
+
+// A duration or timestamp in the microseconds trace viewers expect
+static void write_micros(json_writer_t *w, const char *key, uint64_t ns) {
+    char number[32];
+    int len = snprintf(number, sizeof(number), "%.3f", ns / 1e3);
+
+    json_write_key(w, key);
+    json_write_raw(w, number, len);
+}
+
+// Every span still in a ring as complete ("X") events; the caller frees it.
+// A ring may be written while it is read, so records are read newest first
+// and reading stops at the first one the writer may have reached again.
+char* trace_render(size_t *len) {
+    char chunk[16384];
+    char *text = NULL;
+    json_writer_t w;
+    FILE *fp = open_memstream(&text, len);
+
+    if (!fp) {
+        perror("open_memstream");
+        return NULL;
+    }
+
+    json_writer_init(&w, chunk, sizeof(chunk), json_flush_file, fp);
+    json_write_object_begin(&w);
+    json_write_key(&w, "displayTimeUnit");
+    json_write_string(&w, "ms");
+    json_write_key(&w, "traceEvents");
+    json_write_array_begin(&w);
+    json_write_object_begin(&w);
+    json_write_key(&w, "name");
+    json_write_string(&w, "process_name");
+    json_write_key(&w, "ph");
+    json_write_string(&w, "M");
+    json_write_key(&w, "pid");
+    json_write_ll(&w, getpid());
+    json_write_key(&w, "args");
+    json_write_object_begin(&w);
+    json_write_key(&w, "name");
+    json_write_string(&w, "docker-clone-daemon");
+    json_write_object_end(&w);
+    json_write_object_end(&w);
+
+    for (trace_buffer_t *buffer = atomic_load_explicit(&buffers, memory_order_acquire); buffer; buffer = buffer->next) {
+        unsigned long long written = atomic_load_explicit(&buffer->written, memory_order_acquire);
+        unsigned long long oldest = written > TRACE_RING_SIZE ? written - TRACE_RING_SIZE : 0;
+
+        for (unsigned long long i = written; i-- > oldest;) {
+            trace_record_t record = buffer->records[i & (TRACE_RING_SIZE - 1)];
+
+            // The writer has come round to this slot again since written was read
+            if (atomic_load_explicit(&buffer->written, memory_order_acquire) - i >= TRACE_RING_SIZE) {
+                break;
+            }
+            if (!record.name) {
+                continue;
+            }
+
+            record.detail[sizeof(record.detail) - 1] = '\0';
+            json_write_object_begin(&w);
+            json_write_key(&w, "name");
+            json_write_string(&w, record.name);
+            json_write_key(&w, "ph");
+            json_write_string(&w, "X");
+            write_micros(&w, "ts", record.start_ns);
+            write_micros(&w, "dur", record.duration_ns);
+            json_write_key(&w, "pid");
+            json_write_ll(&w, record.pid);
+            json_write_key(&w, "tid");
+            json_write_ll(&w, record.tid);
+            if (record.detail[0]) {
+                json_write_key(&w, "args");
+                json_write_object_begin(&w);
+                json_write_key(&w, "detail");
+                json_write_string(&w, record.detail);
+                json_write_object_end(&w);
+            }
+            json_write_object_end(&w);
+        }
+    }
+    json_write_array_end(&w);
+    json_write_object_end(&w);
+    json_write_raw(&w, "\n", 1);
+
+    int failed = json_writer_finish(&w) < 0;
+    if (fclose(fp) != 0 || failed) {
+        free(text);
+        return NULL;
+    }
+    return text;
+}
@@ -0,0 +1,41 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+// Timed spans of daemon work, dumped as Chrome trace JSON (chrome://tracing,
+// Perfetto). Off by default: a span then costs one flag test. Turned on by
+// DOCKER_CLONE_TRACE=1 at startup or POST /trace?enabled=1.
+//
+// Each thread writes finished spans into a ring of its own; a full ring
+// overwrites its oldest spans. Rings are shared mappings, so a forked build
+// worker keeps writing into the ring of the thread waiting on it, and a
+// container's init writes into a ring reserved for it before the clone,
+// which it gives back just before exec.
+#define TRACE_ENV "DOCKER_CLONE_TRACE"
+#define TRACE_RING_SIZE 4096            // a power of two
+#define TRACE_DETAIL_LEN 48
+
+typedef struct trace_buffer trace_buffer_t;
+
+typedef struct {
+    const char *name;                   // a string literal
+    uint64_t start_ns;                  // 0 while tracing is off
+} trace_span_t;
+
+// Function declarations
+int init_trace(void);
+void trace_set_enabled(int enabled);
+int trace_enabled(void);
+void trace_begin(trace_span_t *span, const char *name);
+void trace_end(trace_span_t *span, const char *detail);
+void trace_attach_thread(void);
+trace_buffer_t* trace_reserve_buffer(void);
+void trace_adopt_buffer(trace_buffer_t *buffer);
+void trace_release_buffer(trace_buffer_t *buffer);
+char* trace_render(size_t *len);
+
+#endif // TRACE_H
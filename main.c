@@ -53,24 +53,30 @@ int main(int argc, char *argv[]) {
             break;
 
         case CMD_BUILD:
-            result = docker_build(cmd->image_name, cmd->dockerfile_path, cmd->working_dir);
+            result = docker_build(cmd->image_name, cmd->dockerfile_path, cmd->working_dir,
+                                  cmd->memory_limit, cmd->cpu_quota, cmd->cpu_period, cmd->compression);
             break;
 
         case CMD_IMAGES:
-            result = docker_images();
+            result = docker_images(cmd->filters, cmd->limit, cmd->cursor);
             break;
 
         case CMD_CONTAINERS:
         case CMD_PS:
-            result = docker_containers();
+            result = docker_containers(cmd->filters, cmd->limit, cmd->cursor);
             break;
 
+        // One container takes the plain endpoint, anything more a batch
         case CMD_STOP:
-            result = docker_stop(cmd->container_name);
-            break;
-
         case CMD_RM:
-            result = docker_rm(cmd->container_name);
+        case CMD_KILL:
+            if (cmd->type != CMD_KILL && cmd->container_count == 1 && !cmd->filters[0] && !cmd->all) {
+                result = cmd->type == CMD_STOP ? docker_stop(cmd->container_name) : docker_rm(cmd->container_name);
+            } else {
+                result = docker_batch(cmd->type == CMD_STOP ? "stop" : cmd->type == CMD_RM ? "rm" : "kill",
+                                      (const char**)cmd->containers, cmd->container_count, cmd->filters,
+                                      cmd->all, cmd->parallel);
+            }
             break;
 
         case CMD_RMI:
@@ -86,7 +92,39 @@ int main(int argc, char *argv[]) {
             break;
 
         case CMD_COMMIT:
-            result = docker_commit(cmd->container_name, cmd->image_name, cmd->command);
+            result = docker_commit(cmd->container_name, cmd->image_name, cmd->command, !cmd->no_pause);
+            break;
+
+        case CMD_SAVE:
+            result = docker_save(cmd->image_name, cmd->file_path, cmd->compression);
+            break;
+
+        case CMD_LOAD:
+            result = docker_load(cmd->file_path);
+            break;
+
+        case CMD_PULL:
+            result = docker_pull(cmd->image_name, cmd->lazy);
+            break;
+
+        case CMD_PUSH:
+            result = docker_push(cmd->image_name);
+            break;
+
+        case CMD_SYSTEM:
+            result = docker_system_prune(cmd->force);
+            break;
+
+        case CMD_SQUASH:
+            result = docker_squash(cmd->image_name, cmd->from_layer, cmd->to_layer, cmd->target_name);
+            break;
+
+        case CMD_WAIT:
+            result = docker_wait(cmd->container_name);
+            break;
+
+        case CMD_EVENTS:
+            result = docker_events(cmd->since, cmd->filters);
             break;
 
         default:
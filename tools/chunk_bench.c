@@ -0,0 +1,224 @@
+// Measures content-defined chunking on a series of layer versions: each
+// directory is packed into an in-memory tar exactly as a layer would be,
+// cut with the chunker the daemon uses and checked against the chunks of
+// the inputs before it, as the chunk store would.
+//
+//   chunk_bench [-r rounds] <directory|tarball>...
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "../core/chunk.h"
+#include "../core/tar.h"
+
+typedef struct {
+    uint8_t *data;
+    size_t len;
+} bench_input_t;
+
+// Open-addressed set of chunk digests seen so far
+typedef struct {
+    uint8_t (*digests)[SHA256_DIGEST_LEN];
+    uint8_t *used;
+    size_t capacity;
+    size_t count;
+} digest_set_t;
+
+static double now_seconds(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Packs a directory with the layer tar writer, or reads a file as is
+static int load_input(const char *path, bench_input_t *input) {
+    struct stat st;
+    int fd;
+
+    if (stat(path, &st) != 0) {
+        perror(path);
+        return -1;
+    }
+
+    if (S_ISDIR(st.st_mode)) {
+        fd = memfd_create("chunk-bench", MFD_CLOEXEC);
+        tar_writer_t *writer = fd >= 0 ? tar_writer_open(fd, 0) : NULL;
+        if (!writer || tar_write_tree(writer, path, NULL) != 0 || tar_finish(writer) != 0 ||
+            tar_writer_close(writer) != 0) {
+            fprintf(stderr, "Failed to pack %s\n", path);
+            return -1;
+        }
+        if (fstat(fd, &st) != 0) {
+            return -1;
+        }
+    } else {
+        fd = open(path, O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            perror(path);
+            return -1;
+        }
+    }
+
+    input->len = st.st_size;
+    input->data = malloc(input->len ? input->len : 1);
+    if (!input->data || pread(fd, input->data, input->len, 0) != (ssize_t)input->len) {
+        fprintf(stderr, "Failed to read %s\n", path);
+        close(fd);
+        return -1;
+    }
+
+    close(fd);
+    return 0;
+}
+
+static int digest_set_grow(digest_set_t *set) {
+    digest_set_t grown;
+
+    grown.capacity = set->capacity ? set->capacity * 2 : 4096;
+    grown.count = 0;
+    grown.digests = malloc(grown.capacity * SHA256_DIGEST_LEN);
+    grown.used = calloc(grown.capacity, 1);
+    if (!grown.digests || !grown.used) {
+        free(grown.digests);
+        free(grown.used);
+        return -1;
+    }
+
+    for (size_t i = 0; i < set->capacity; i++) {
+        if (set->used[i]) {
+            size_t slot;
+            memcpy(&slot, set->digests[i], sizeof(slot));
+            for (slot &= grown.capacity - 1; grown.used[slot]; slot = (slot + 1) & (grown.capacity - 1)) {
+            }
+            memcpy(grown.digests[slot], set->digests[i], SHA256_DIGEST_LEN);
+            grown.used[slot] = 1;
+            grown.count++;
+        }
+    }
+
+    free(set->digests);
+    free(set->used);
+    *set = grown;
+    return 0;
+}
+
+// Returns 1 if the digest is new, 0 if it was already in the set
+static int digest_set_add(digest_set_t *set, const uint8_t *digest) {
+    size_t slot;
+
+    if ((set->count + 1) * 2 > set->capacity && digest_set_grow(set) != 0) {
+        return -1;
+    }
+
+    memcpy(&slot, digest, sizeof(slot));
+    for (slot &= set->capacity - 1; set->used[slot]; slot = (slot + 1) & (set->capacity - 1)) {
+        if (memcmp(set->digests[slot], digest, SHA256_DIGEST_LEN) == 0) {
+            return 0;
+        }
+    }
+    memcpy(set->digests[slot], digest, SHA256_DIGEST_LEN);
+    set->used[slot] = 1;
+    set->count++;
+    return 1;
+}
+
+// Cut points only, best of several rounds
+static double time_chunking(const bench_input_t *input, int rounds) {
+    double best = 0;
+
+    for (int r = 0; r < rounds; r++) {
+        double start = now_seconds();
+        for (size_t offset = 0; offset < input->len;) {
+            offset += chunk_boundary(input->data + offset, input->len - offset);
+        }
+        double elapsed = now_seconds() - start;
+        if (best == 0 || elapsed < best) best = elapsed;
+    }
+    return best;
+}
+
+int main(int argc, char *argv[]) {
+    digest_set_t seen;
+    long long total_bytes = 0, stored_bytes = 0;
+    int rounds = 3;
+    int inputs = 0;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-r") == 0 && i + 1 < argc) {
+            rounds = atoi(argv[++i]);
+        } else if (argv[i][0] != '-') {
+            inputs++;
+        }
+    }
+
+    if (inputs == 0 || rounds < 1) {
+        fprintf(stderr, "Usage: %s [-r rounds] <directory|tarball>...\n", argv[0]);
+        return 1;
+    }
+
+    memset(&seen, 0, sizeof(seen));
+    printf("%-24s %10s %8s %10s %8s %10s %12s %12s\n", "input", "MB", "chunks", "avg KB", "new",
+           "new MB", "saved", "chunk MB/s");
+
+    for (int i = 1; i < argc; i++) {
+        bench_input_t input;
+        long long chunks = 0, new_chunks = 0, new_bytes = 0;
+
+        if (strcmp(argv[i], "-r") == 0) {
+            i++;
+            continue;
+        }
+
+        memset(&input, 0, sizeof(input));
+        if (load_input(argv[i], &input) != 0) {
+            return 1;
+        }
+
+        for (size_t offset = 0; offset < input.len;) {
+            size_t len = chunk_boundary(input.data + offset, input.len - offset);
+            uint8_t digest[SHA256_DIGEST_LEN];
+            sha256_ctx_t hash;
+
+            sha256_init(&hash);
+            sha256_update(&hash, input.data + offset, len);
+            sha256_final(&hash, digest);
+
+            int added = digest_set_add(&seen, digest);
+            if (added < 0) {
+                fprintf(stderr, "Out of memory\n");
+                return 1;
+            }
+            if (added) {
+                new_chunks++;
+                new_bytes += len;
+            }
+            chunks++;
+            offset += len;
+        }
+
+        total_bytes += input.len;
+        stored_bytes += new_bytes;
+
+        // Savings so far: stream bytes of every input against unique chunks
+        const char *name = strrchr(argv[i], '/') && strrchr(argv[i], '/')[1] ? strrchr(argv[i], '/') + 1 : argv[i];
+        double elapsed = time_chunking(&input, rounds);
+        printf("%-24.24s %10.1f %8lld %10.1f %8lld %10.1f %11.1f%% %12.0f\n", name, input.len / 1e6, chunks,
+               chunks ? input.len / 1024.0 / chunks : 0.0, new_chunks, new_bytes / 1e6,
+               total_bytes ? 100.0 * (total_bytes - stored_bytes) / total_bytes : 0.0,
+               elapsed > 0 ? input.len / 1e6 / elapsed : 0.0);
+
+        free(input.data);
+    }
+
+    printf("total: %.1f MB of layers, %.1f MB of unique chunks\n", total_bytes / 1e6, stored_bytes / 1e6);
+    free(seen.digests);
+    free(seen.used);
+    return 0;
+}
@@ -0,0 +1,189 @@
+// Measures parse_dockerfile on a large synthetic Dockerfile: a mix of
+// FROM stages, ARG and ENV definitions that later lines expand, RUN lines
+// folded from backslash continuations with comments inside them, exec-form
+// COPY, ADD and VOLUME arrays, LABELs and heredocs. The file is written
+// once to /tmp and parsed again each round, since the parser folds lines
+// in place in its private mapping. Given a file, that is parsed instead.
+//
+//   dockerfile_bench [-n lines] [-r rounds] [Dockerfile]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../core/dockerfile.h"
+
+static double now_seconds(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Writes about `lines` lines and returns how many it wrote
+static int write_synthetic(FILE *fp, int lines) {
+    int written = 0;
+
+    for (int i = 0; written < lines; i++) {
+        switch (i % 16) {
+        case 0:
+            fprintf(fp, "# stage %d\nFROM registry.local/team/base-%d:1.%d AS stage%d\n", i / 16, i % 7, i % 3, i);
+            written += 2;
+            break;
+        case 1:
+            fprintf(fp, "ARG VERSION_%d=%d.%d.%d\n", i % 64, i % 9, i % 13, i);
+            written++;
+            break;
+        case 2:
+            fprintf(fp, "ENV APP_HOME_%d=/srv/app%d APP_BIN_%d=/srv/app%d/bin:$VERSION_%d\n", i % 64, i, i % 64, i,
+                    (i - 1) % 64);
+            written++;
+            break;
+        case 3:
+            fprintf(fp, "RUN apt-get update && \\\n"
+                        "    # pinned for reproducible builds\n"
+                        "    apt-get install -y curl=7.%d ca-certificates && \\\n"
+                        "    rm -rf /var/lib/apt/lists/*\n", i % 90);
+            written += 4;
+            break;
+        case 4:
+            fprintf(fp, "WORKDIR ${APP_HOME_%d}/src\n", i % 64);
+            written++;
+            break;
+        case 5:
+            fprintf(fp, "COPY [\"src/module %d\", \"lib/shared.c\", \"${APP_HOME_%d}/\"]\n", i, (i - 3) % 64);
+            written++;
+            break;
+        case 6:
+            fprintf(fp, "ADD vendor/pkg-%d.tar /opt/vendor/\n", i % 50);
+            written++;
+            break;
+        case 7:
+            fprintf(fp, "LABEL org.example.build=\"%d\" org.example.version=\"${VERSION_%d}\"\n", i, (i - 6) % 64);
+            written++;
+            break;
+        case 8:
+            fprintf(fp, "RUN <<EOF\nset -e\necho building %d\nmake -j4 target%d\nEOF\n", i, i);
+            written += 5;
+            break;
+        case 9:
+            fprintf(fp, "VOLUME [\"/data/%d\", \"/var/log/app %d\"]\n", i, i);
+            written++;
+            break;
+        case 10:
+            fprintf(fp, "EXPOSE %d\n", 8000 + i % 1000);
+            written++;
+            break;
+        case 11:
+            fprintf(fp, "USER app%d\n\n", i % 5);
+            written += 2;
+            break;
+        case 12:
+            fprintf(fp, "COPY <<EOF /etc/app/config-%d.ini\n[server]\nport=%d\nEOF\n", i, 8000 + i % 1000);
+            written += 4;
+            break;
+        case 13:
+            fprintf(fp, "RUN [\"/bin/sh\", \"-c\", \"echo \\\"step %d\\\" >> /tmp/log\"]\n", i);
+            written++;
+            break;
+        case 14:
+            fprintf(fp, "ENTRYPOINT [\"/srv/app%d/bin/server\", \"--port\", \"%d\"]\n", i, 8000 + i % 1000);
+            written++;
+            break;
+        default:
+            fprintf(fp, "CMD [\"--workers\", \"%d\"]\n", 1 + i % 8);
+            written++;
+            break;
+        }
+    }
+    return written;
+}
+
+int main(int argc, char *argv[]) {
+    char path[] = "/tmp/dockerfile_bench.XXXXXX";
+    const char *file = NULL;
+    int lines = 50000, rounds = 5, opt, instructions = 0;
+    double best = 0, total = 0;
+    long size;
+    FILE *fp;
+
+    while ((opt = getopt(argc, argv, "n:r:")) != -1) {
+        switch (opt) {
+        case 'n':
+            lines = atoi(optarg);
+            break;
+        case 'r':
+            rounds = atoi(optarg);
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-n lines] [-r rounds] [Dockerfile]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (lines <= 0 || rounds <= 0) {
+        fprintf(stderr, "lines and rounds must be positive\n");
+        return 1;
+    }
+
+    if (optind < argc) {
+        file = argv[optind];
+        fp = fopen(file, "r");
+        if (!fp) {
+            perror(file);
+            return 1;
+        }
+        lines = 0;
+        for (int c; (c = getc(fp)) != EOF;) {
+            lines += c == '\n';
+        }
+    } else {
+        int fd = mkstemp(path);
+
+        if (fd < 0 || !(fp = fdopen(fd, "w+"))) {
+            perror("mkstemp");
+            return 1;
+        }
+        file = path;
+        lines = write_synthetic(fp, lines);
+        fflush(fp);
+    }
+    fseek(fp, 0, SEEK_END);
+    size = ftell(fp);
+    fclose(fp);
+
+    printf("%s: %d lines, %.1f KB, %d rounds\n", file, lines, size / 1024.0, rounds);
+
+    for (int r = 0; r < rounds; r++) {
+        double start = now_seconds();
+        dockerfile_t *dockerfile = parse_dockerfile(file);
+        double seconds = now_seconds() - start;
+
+        if (!dockerfile) {
+            fprintf(stderr, "parse failed\n");
+            if (file == path) {
+                unlink(path);
+            }
+            return 1;
+        }
+        instructions = dockerfile->count;
+        free_dockerfile(dockerfile);
+
+        total += seconds;
+        if (r == 0 || seconds < best) {
+            best = seconds;
+        }
+    }
+
+    printf("  %d instructions\n", instructions);
+    printf("  %-12s %8.2f ms  %8.1f MB/s  %8.2f M lines/s\n", "best", best * 1e3, size / best / 1e6,
+           lines / best / 1e6);
+    printf("  %-12s %8.2f ms  %8.1f MB/s  %8.2f M lines/s\n", "mean", total / rounds * 1e3,
+           size / (total / rounds) / 1e6, lines / (total / rounds) / 1e6);
+
+    if (file == path) {
+        unlink(path);
+    }
+    return 0;
+}
@@ -0,0 +1,321 @@
+// Measures the JSON reader and writer against the code they replaced, on
+// container metadata documents: serializing the way write_container_metadata
+// used to (one fprintf per line, nothing escaped) and parsing the way
+// read_container_metadata used to (strstr and sscanf on each line), next to
+// json_writer_t and json_parse with json_get_*.
+//
+// Every few documents carry a command with quotes and backslashes in it,
+// which the old writer emits unescaped and the old reader truncates; the
+// bench counts those as mismatches rather than leaving them out.
+//
+//   json_bench [-n documents] [-r rounds]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../core/json.h"
+
+#define BENCH_DOC_SIZE 4096
+
+typedef struct {
+    char id[64];
+    char name[64];
+    char image[128];
+    char command[256];
+    char working_dir[128];
+    char env_vars[256];
+    char created[32];
+    int state;
+    int pid;
+    int exit_code;
+    int detach;
+} bench_record_t;
+
+typedef struct {
+    char *data;
+    size_t *offsets;
+    size_t len;
+} bench_docs_t;
+
+static double now_seconds(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void make_record(int i, bench_record_t *record) {
+    memset(record, 0, sizeof(*record));
+    snprintf(record->id, sizeof(record->id), "%016x%016x", (unsigned)i * 2654435761u, (unsigned)i);
+    snprintf(record->name, sizeof(record->name), "bench_container_%d", i);
+    snprintf(record->image, sizeof(record->image), "registry.local/team/service-%d:1.%d", i % 17, i % 5);
+    if (i % 8 == 0) {
+        snprintf(record->command, sizeof(record->command), "sh -c \"echo \\\"%d\\\" > /tmp/out\"", i);
+    } else {
+        snprintf(record->command, sizeof(record->command), "/usr/bin/server --port %d --workers 4", 8000 + i % 1000);
+    }
+    snprintf(record->working_dir, sizeof(record->working_dir), "/srv/app%d", i % 11);
+    snprintf(record->env_vars, sizeof(record->env_vars), "PATH=/usr/bin:/bin;MODE=prod;SHARD=%d", i % 64);
+    snprintf(record->created, sizeof(record->created), "2024-03-%02d %02d:%02d:%02d", 1 + i % 28, i % 24,
+             i % 60, (i * 7) % 60);
+    record->state = i % 4;
+    record->pid = i % 4 == 1 ? 1000 + i : 0;
+    record->exit_code = i % 3;
+    record->detach = i % 2;
+}
+
+static int records_equal(const bench_record_t *a, const bench_record_t *b) {
+    return strcmp(a->id, b->id) == 0 && strcmp(a->name, b->name) == 0 && strcmp(a->image, b->image) == 0 &&
+           strcmp(a->command, b->command) == 0 && strcmp(a->working_dir, b->working_dir) == 0 &&
+           strcmp(a->env_vars, b->env_vars) == 0 && strcmp(a->created, b->created) == 0 &&
+           a->state == b->state && a->pid == b->pid && a->exit_code == b->exit_code && a->detach == b->detach;
+}
+
+// ----------------------------------------------------------------------------
+// The old code path
+// ----------------------------------------------------------------------------
+
+static int old_write(const bench_record_t *r, char *out, size_t size) {
+    size_t len = 0;
+
+    len += snprintf(out + len, size - len, "{\n");
+    len += snprintf(out + len, size - len, "  \"id\": \"%s\",\n", r->id);
+    len += snprintf(out + len, size - len, "  \"name\": \"%s\",\n", r->name);
+    len += snprintf(out + len, size - len, "  \"image\": \"%s\",\n", r->image);
+    len += snprintf(out + len, size - len, "  \"command\": \"%s\",\n", r->command);
+    len += snprintf(out + len, size - len, "  \"working_dir\": \"%s\",\n", r->working_dir);
+    len += snprintf(out + len, size - len, "  \"env_vars\": \"%s\",\n", r->env_vars);
+    len += snprintf(out + len, size - len, "  \"state\": %d,\n", r->state);
+    len += snprintf(out + len, size - len, "  \"pid\": %d,\n", r->pid);
+    len += snprintf(out + len, size - len, "  \"created\": \"%s\",\n", r->created);
+    len += snprintf(out + len, size - len, "  \"exit_code\": %d,\n", r->exit_code);
+    len += snprintf(out + len, size - len, "  \"detach\": %d\n", r->detach);
+    len += snprintf(out + len, size - len, "}\n");
+    return len < size ? (int)len : -1;
+}
+
+static void old_parse(const char *doc, size_t len, bench_record_t *r) {
+    const char *p = doc, *end = doc + len;
+    char line[1024];
+
+    memset(r, 0, sizeof(*r));
+    while (p < end) {
+        const char *nl = memchr(p, '\n', end - p);
+        size_t n = nl ? (size_t)(nl - p) : (size_t)(end - p);
+        if (n >= sizeof(line)) {
+            n = sizeof(line) - 1;
+        }
+        memcpy(line, p, n);
+        line[n] = '\0';
+        p = nl ? nl + 1 : end;
+
+        if (strstr(line, "\"id\"")) {
+            sscanf(line, "  \"id\": \"%63[^\"]\"", r->id);
+        } else if (strstr(line, "\"name\"")) {
+            sscanf(line, "  \"name\": \"%63[^\"]\"", r->name);
+        } else if (strstr(line, "\"image\"")) {
+            sscanf(line, "  \"image\": \"%127[^\"]\"", r->image);
+        } else if (strstr(line, "\"command\"")) {
+            sscanf(line, "  \"command\": \"%255[^\"]\"", r->command);
+        } else if (strstr(line, "\"working_dir\"")) {
+            sscanf(line, "  \"working_dir\": \"%127[^\"]\"", r->working_dir);
+        } else if (strstr(line, "\"env_vars\"")) {
+            sscanf(line, "  \"env_vars\": \"%255[^\"]\"", r->env_vars);
+        } else if (strstr(line, "\"state\"")) {
+            sscanf(line, "  \"state\": %d", &r->state);
+        } else if (strstr(line, "\"pid\"")) {
+            sscanf(line, "  \"pid\": %d", &r->pid);
+        } else if (strstr(line, "\"created\"")) {
+            sscanf(line, "  \"created\": \"%31[^\"]\"", r->created);
+        } else if (strstr(line, "\"exit_code\"")) {
+            sscanf(line, "  \"exit_code\": %d", &r->exit_code);
+        } else if (strstr(line, "\"detach\"")) {
+            sscanf(line, "  \"detach\": %d", &r->detach);
+        }
+    }
+}
+
+// ----------------------------------------------------------------------------
+// The JSON library
+// ----------------------------------------------------------------------------
+
+static int new_write(const bench_record_t *r, char *out, size_t size) {
+    json_writer_t w;
+
+    json_writer_init(&w, out, size, NULL, NULL);
+    w.pretty = 1;
+    json_write_object_begin(&w);
+    json_write_key(&w, "id");
+    json_write_string(&w, r->id);
+    json_write_key(&w, "name");
+    json_write_string(&w, r->name);
+    json_write_key(&w, "image");
+    json_write_string(&w, r->image);
+    json_write_key(&w, "command");
+    json_write_string(&w, r->command);
+    json_write_key(&w, "working_dir");
+    json_write_string(&w, r->working_dir);
+    json_write_key(&w, "env_vars");
+    json_write_string(&w, r->env_vars);
+    json_write_key(&w, "state");
+    json_write_ll(&w, r->state);
+    json_write_key(&w, "pid");
+    json_write_ll(&w, r->pid);
+    json_write_key(&w, "created");
+    json_write_string(&w, r->created);
+    json_write_key(&w, "exit_code");
+    json_write_ll(&w, r->exit_code);
+    json_write_key(&w, "detach");
+    json_write_ll(&w, r->detach);
+    json_write_object_end(&w);
+    json_write_raw(&w, "\n", 1);
+    return (int)json_writer_finish(&w);
+}
+
+static int get_int(json_value_t *object, const char *key) {
+    long long value = 0;
+
+    json_get_ll(object, key, &value);
+    return (int)value;
+}
+
+static int new_parse(const char *doc, size_t len, bench_record_t *r) {
+    json_value_t root;
+
+    memset(r, 0, sizeof(*r));
+    if (json_parse(doc, len, &root) != 0) {
+        return -1;
+    }
+    json_get_string(&root, "id", r->id, sizeof(r->id));
+    json_get_string(&root, "name", r->name, sizeof(r->name));
+    json_get_string(&root, "image", r->image, sizeof(r->image));
+    json_get_string(&root, "command", r->command, sizeof(r->command));
+    json_get_string(&root, "working_dir", r->working_dir, sizeof(r->working_dir));
+    json_get_string(&root, "env_vars", r->env_vars, sizeof(r->env_vars));
+    json_get_string(&root, "created", r->created, sizeof(r->created));
+    r->state = get_int(&root, "state");
+    r->pid = get_int(&root, "pid");
+    r->exit_code = get_int(&root, "exit_code");
+    r->detach = get_int(&root, "detach");
+    return 0;
+}
+
+// ----------------------------------------------------------------------------
+// Driver
+// ----------------------------------------------------------------------------
+
+typedef int (*write_fn)(const bench_record_t *r, char *out, size_t size);
+
+// Serializes every record into one buffer, returning seconds per round
+static double run_write(write_fn write, const bench_record_t *records, int count, int rounds,
+                        bench_docs_t *docs) {
+    double start = now_seconds();
+
+    for (int round = 0; round < rounds; round++) {
+        docs->len = 0;
+        for (int i = 0; i < count; i++) {
+            int len = write(&records[i], docs->data + docs->len, BENCH_DOC_SIZE);
+            if (len < 0) {
+                fprintf(stderr, "Document %d does not fit\n", i);
+                exit(1);
+            }
+            docs->offsets[i] = docs->len;
+            docs->len += len;
+        }
+        docs->offsets[count] = docs->len;
+    }
+    return (now_seconds() - start) / rounds;
+}
+
+// Parses every document back, returning seconds per round; counts the
+// documents that do not come back as they were written
+static double run_parse(int use_library, const bench_docs_t *docs, const bench_record_t *records, int count,
+                        int rounds, int *mismatches) {
+    bench_record_t parsed;
+    double start = now_seconds();
+
+    *mismatches = 0;
+    for (int round = 0; round < rounds; round++) {
+        for (int i = 0; i < count; i++) {
+            const char *doc = docs->data + docs->offsets[i];
+            size_t len = docs->offsets[i + 1] - docs->offsets[i];
+            if (use_library) {
+                new_parse(doc, len, &parsed);
+            } else {
+                old_parse(doc, len, &parsed);
+            }
+            if (round == 0 && !records_equal(&parsed, &records[i])) {
+                (*mismatches)++;
+            }
+        }
+    }
+    return (now_seconds() - start) / rounds;
+}
+
+static void report(const char *what, size_t bytes, double seconds) {
+    printf("  %-28s %8.1f MB/s  %8.2f ms\n", what, bytes / seconds / 1e6, seconds * 1e3);
+}
+
+int main(int argc, char *argv[]) {
+    bench_record_t *records;
+    bench_docs_t old_docs, new_docs;
+    int count = 20000, rounds = 5, opt, mismatches;
+    double seconds;
+
+    while ((opt = getopt(argc, argv, "n:r:")) != -1) {
+        switch (opt) {
+        case 'n':
+            count = atoi(optarg);
+            break;
+        case 'r':
+            rounds = atoi(optarg);
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-n documents] [-r rounds]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (count <= 0 || rounds <= 0) {
+        fprintf(stderr, "documents and rounds must be positive\n");
+        return 1;
+    }
+
+    records = malloc(sizeof(bench_record_t) * count);
+    old_docs.data = malloc((size_t)count * BENCH_DOC_SIZE);
+    new_docs.data = malloc((size_t)count * BENCH_DOC_SIZE);
+    old_docs.offsets = malloc(sizeof(size_t) * (count + 1));
+    new_docs.offsets = malloc(sizeof(size_t) * (count + 1));
+    if (!records || !old_docs.data || !new_docs.data || !old_docs.offsets || !new_docs.offsets) {
+        fprintf(stderr, "Out of memory\n");
+        return 1;
+    }
+    for (int i = 0; i < count; i++) {
+        make_record(i, &records[i]);
+    }
+
+    printf("%d container metadata documents, %d rounds\n", count, rounds);
+
+    printf("serialize\n");
+    seconds = run_write(old_write, records, count, rounds, &old_docs);
+    report("snprintf, unescaped", old_docs.len, seconds);
+    seconds = run_write(new_write, records, count, rounds, &new_docs);
+    report("json_writer_t", new_docs.len, seconds);
+
+    printf("parse\n");
+    seconds = run_parse(0, &old_docs, records, count, rounds, &mismatches);
+    report("strstr+sscanf per line", old_docs.len, seconds);
+    printf("  %-28s %d of %d documents read back wrong\n", "", mismatches, count);
+    seconds = run_parse(1, &new_docs, records, count, rounds, &mismatches);
+    report("json_parse+json_get", new_docs.len, seconds);
+    printf("  %-28s %d of %d documents read back wrong\n", "", mismatches, count);
+
+    free(records);
+    free(old_docs.data);
+    free(new_docs.data);
+    free(old_docs.offsets);
+    free(new_docs.offsets);
+    return 0;
+}
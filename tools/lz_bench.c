@@ -0,0 +1,211 @@
+// Measures the layer codec on a representative tree: the directory is
+// packed into an in-memory tar exactly as a layer would be, then
+// compressed and decompressed through the same frame API the daemon uses.
+//
+//   lz_bench [-t threads] [-r rounds] <directory|tarball>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "../core/lz.h"
+#include "../core/tar.h"
+
+typedef struct {
+    char *data;
+    size_t len;
+    size_t capacity;
+    size_t offset;
+} bench_buffer_t;
+
+static double now_seconds(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int buffer_write(void *ctx, const void *data, size_t len) {
+    bench_buffer_t *buffer = ctx;
+
+    if (buffer->len + len > buffer->capacity) {
+        size_t capacity = buffer->capacity ? buffer->capacity : 1 << 20;
+        while (capacity < buffer->len + len) {
+            capacity *= 2;
+        }
+        char *grown = realloc(buffer->data, capacity);
+        if (!grown) {
+            return -1;
+        }
+        buffer->data = grown;
+        buffer->capacity = capacity;
+    }
+
+    memcpy(buffer->data + buffer->len, data, len);
+    buffer->len += len;
+    return 0;
+}
+
+static ssize_t buffer_read(void *ctx, void *data, size_t len) {
+    bench_buffer_t *buffer = ctx;
+    size_t left = buffer->len - buffer->offset;
+
+    if (len > left) {
+        len = left;
+    }
+    memcpy(data, buffer->data + buffer->offset, len);
+    buffer->offset += len;
+    return len;
+}
+
+// Packs a directory with the layer tar writer, or reads a file as is
+static int load_input(const char *path, bench_buffer_t *input) {
+    struct stat st;
+    int fd;
+
+    if (stat(path, &st) != 0) {
+        perror(path);
+        return -1;
+    }
+
+    if (S_ISDIR(st.st_mode)) {
+        fd = memfd_create("lz-bench", MFD_CLOEXEC);
+        tar_writer_t *writer = fd >= 0 ? tar_writer_open(fd, 0) : NULL;
+        if (!writer || tar_write_tree(writer, path, NULL) != 0 || tar_finish(writer) != 0 ||
+            tar_writer_close(writer) != 0) {
+            fprintf(stderr, "Failed to pack %s\n", path);
+            return -1;
+        }
+        if (fstat(fd, &st) != 0) {
+            return -1;
+        }
+    } else {
+        fd = open(path, O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            perror(path);
+            return -1;
+        }
+    }
+
+    input->len = st.st_size;
+    input->data = malloc(input->len ? input->len : 1);
+    if (!input->data || pread(fd, input->data, input->len, 0) != (ssize_t)input->len) {
+        fprintf(stderr, "Failed to read %s\n", path);
+        close(fd);
+        return -1;
+    }
+
+    close(fd);
+    return 0;
+}
+
+static int run_round(bench_buffer_t *input, int threads, double *compress_time, double *decompress_time,
+                     size_t *packed_len) {
+    bench_buffer_t packed;
+    char *output;
+    double start;
+    size_t got = 0;
+    ssize_t n;
+
+    memset(&packed, 0, sizeof(packed));
+    output = malloc(input->len ? input->len : 1);
+    if (!output) {
+        return -1;
+    }
+
+    start = now_seconds();
+    lz_writer_t *writer = lz_writer_open(buffer_write, &packed, threads);
+    if (!writer || lz_write(writer, input->data, input->len) != 0 || lz_writer_close(writer) != 0) {
+        fprintf(stderr, "Compression failed\n");
+        free(output);
+        free(packed.data);
+        return -1;
+    }
+    *compress_time = now_seconds() - start;
+    *packed_len = packed.len;
+
+    start = now_seconds();
+    lz_reader_t *reader = lz_reader_open(buffer_read, &packed, threads);
+    while (reader && got < input->len && (n = lz_read(reader, output + got, input->len - got)) > 0) {
+        got += n;
+    }
+    lz_reader_close(reader);
+    *decompress_time = now_seconds() - start;
+
+    int result = got == input->len && memcmp(output, input->data, got) == 0 ? 0 : -1;
+    if (result != 0) {
+        fprintf(stderr, "Round trip mismatch\n");
+    }
+
+    free(output);
+    free(packed.data);
+    return result;
+}
+
+int main(int argc, char *argv[]) {
+    bench_buffer_t input;
+    int threads = lz_default_threads();
+    int rounds = 3;
+    const char *path = NULL;
+    int counts[2];
+    int runs;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-t") == 0 && i + 1 < argc) {
+            threads = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-r") == 0 && i + 1 < argc) {
+            rounds = atoi(argv[++i]);
+        } else if (argv[i][0] != '-') {
+            path = argv[i];
+        }
+    }
+
+    if (!path || threads < 1 || rounds < 1) {
+        fprintf(stderr, "Usage: %s [-t threads] [-r rounds] <directory|tarball>\n", argv[0]);
+        return 1;
+    }
+    if (threads > LZ_MAX_THREADS) {
+        threads = LZ_MAX_THREADS;
+    }
+
+    memset(&input, 0, sizeof(input));
+    if (load_input(path, &input) != 0) {
+        return 1;
+    }
+
+    printf("input: %s, %.1f MB\n", path, input.len / 1e6);
+    printf("%-8s %12s %12s %14s %16s\n", "threads", "packed MB", "ratio", "compress MB/s", "decompress MB/s");
+
+    // Single-threaded first, then block-parallel if more than one thread
+    counts[0] = 1;
+    counts[1] = threads;
+    runs = threads > 1 ? 2 : 1;
+
+    for (int r = 0; r < runs; r++) {
+        double best_compress = 0, best_decompress = 0;
+        size_t packed_len = 0;
+
+        // Report the best of several rounds to keep page-cache noise out
+        for (int i = 0; i < rounds; i++) {
+            double compress_time, decompress_time;
+            if (run_round(&input, counts[r], &compress_time, &decompress_time, &packed_len) != 0) {
+                free(input.data);
+                return 1;
+            }
+            if (best_compress == 0 || compress_time < best_compress) best_compress = compress_time;
+            if (best_decompress == 0 || decompress_time < best_decompress) best_decompress = decompress_time;
+        }
+
+        printf("%-8d %12.1f %11.2fx %14.0f %16.0f\n", counts[r], packed_len / 1e6,
+               packed_len ? (double)input.len / packed_len : 0.0,
+               input.len / 1e6 / best_compress, input.len / 1e6 / best_decompress);
+    }
+
+    free(input.data);
+    return 0;
+}
@@ -0,0 +1,483 @@
+// A small OCI distribution registry for exercising pull and push on
+// loopback. It keeps blobs and manifests in a directory, serves ranged
+// blob reads, and accepts monolithic uploads (POST then PUT ?digest=).
+//
+//   mini_registry [-p port] [-d dir] [--drop-after bytes]
+//
+// --drop-after cuts every blob download that starts at offset 0 after that
+// many bytes, so clients have to resume with a Range request.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "../core/sha256.h"
+
+#define REGISTRY_REQUEST_MAX 16384
+#define REGISTRY_PATH_MAX 1024
+
+typedef struct {
+    int fd;
+    char buffer[REGISTRY_REQUEST_MAX];
+    size_t start;
+    size_t end;
+} client_t;
+
+typedef struct {
+    char method[16];
+    char path[REGISTRY_PATH_MAX];
+    char query[REGISTRY_PATH_MAX];
+    char content_type[128];
+    long long content_length;
+    long long range_start;      // -1 without a Range header
+    long long range_end;        // inclusive, -1 for the rest of the blob
+} request_t;
+
+static const char *storage_dir = "/tmp/mini-registry";
+static long long drop_after = -1;
+static unsigned long upload_counter;
+static pthread_mutex_t counter_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int write_all(int fd, const void *data, size_t len) {
+    const char *p = data;
+
+    while (len > 0) {
+        ssize_t n = send(fd, p, len, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static int respond(int fd, int status, const char *reason, const char *headers, const char *body) {
+    char head[2048];
+    size_t body_len = body ? strlen(body) : 0;
+    int len = snprintf(head, sizeof(head),
+                       "HTTP/1.1 %d %s\r\nContent-Length: %zu\r\nConnection: close\r\n"
+                       "Docker-Distribution-API-Version: registry/2.0\r\n%s\r\n",
+                       status, reason, body_len, headers ? headers : "");
+
+    if (write_all(fd, head, len) != 0) {
+        return -1;
+    }
+    return body_len ? write_all(fd, body, body_len) : 0;
+}
+
+static int read_request(client_t *client, request_t *request) {
+    char *end, *line, *save;
+
+    client->start = client->end = 0;
+    while (!(end = memmem(client->buffer, client->end, "\r\n\r\n", 4))) {
+        if (client->end == sizeof(client->buffer)) return -1;
+        ssize_t n = recv(client->fd, client->buffer + client->end, sizeof(client->buffer) - client->end, 0);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        client->end += n;
+    }
+    *end = '\0';
+    client->start = end + 4 - client->buffer;
+
+    memset(request, 0, sizeof(*request));
+    request->range_start = -1;
+    request->range_end = -1;
+
+    line = strtok_r(client->buffer, "\r\n", &save);
+    if (!line || sscanf(line, "%15s %1023s", request->method, request->path) != 2) {
+        return -1;
+    }
+
+    char *query = strchr(request->path, '?');
+    if (query) {
+        *query = '\0';
+        snprintf(request->query, sizeof(request->query), "%s", query + 1);
+    }
+
+    while ((line = strtok_r(NULL, "\r\n", &save)) != NULL) {
+        if (strncasecmp(line, "Content-Length:", 15) == 0) {
+            request->content_length = strtoll(line + 15, NULL, 10);
+        } else if (strncasecmp(line, "Content-Type:", 13) == 0) {
+            sscanf(line + 13, " %127[^\r\n]", request->content_type);
+        } else if (strncasecmp(line, "Range:", 6) == 0) {
+            sscanf(line + 6, " bytes=%lld-%lld", &request->range_start, &request->range_end);
+        }
+    }
+    return 0;
+}
+
+// Reads the request body, starting with what arrived alongside the headers
+static ssize_t read_body(client_t *client, void *dst, size_t len) {
+    if (client->start < client->end) {
+        size_t n = client->end - client->start;
+        if (n > len) n = len;
+        memcpy(dst, client->buffer + client->start, n);
+        client->start += n;
+        return n;
+    }
+
+    ssize_t n;
+    do {
+        n = recv(client->fd, dst, len, 0);
+    } while (n < 0 && errno == EINTR);
+    return n;
+}
+
+static int valid_digest(const char *digest) {
+    return strncmp(digest, "sha256:", 7) == 0 && strlen(digest) == 7 + SHA256_HEX_LEN &&
+           strspn(digest + 7, "0123456789abcdef") == SHA256_HEX_LEN;
+}
+
+// Repository names may hold slashes; they become one directory level
+static void repository_dir(const char *name, char *dir, size_t size) {
+    char flat[REGISTRY_PATH_MAX];
+    size_t i;
+
+    for (i = 0; name[i] && i + 1 < sizeof(flat); i++) {
+        flat[i] = name[i] == '/' ? '+' : name[i];
+    }
+    flat[i] = '\0';
+    snprintf(dir, size, "%s/manifests/%s", storage_dir, flat);
+}
+
+static void serve_blob(client_t *client, request_t *request, const char *digest) {
+    char path[REGISTRY_PATH_MAX + 64];
+    char headers[512];
+    struct stat st;
+    int head = strcmp(request->method, "HEAD") == 0;
+    int fd;
+
+    snprintf(path, sizeof(path), "%s/blobs/%s", storage_dir, digest + 7);
+    if (!valid_digest(digest) || (fd = open(path, O_RDONLY | O_CLOEXEC)) < 0 || fstat(fd, &st) != 0) {
+        respond(client->fd, 404, "Not Found", NULL, head ? NULL : "{\"errors\":[{\"code\":\"BLOB_UNKNOWN\"}]}");
+        printf("%s /blobs/%.19s 404\n", request->method, digest);
+        return;
+    }
+
+    long long start = request->range_start > 0 ? request->range_start : 0;
+    long long end = request->range_end >= 0 && request->range_end < st.st_size ? request->range_end + 1 : st.st_size;
+    long long length = end - start;
+    if (start > st.st_size || (start == st.st_size && start > 0) || length < 0) {
+        snprintf(headers, sizeof(headers), "Content-Range: bytes */%lld\r\n", (long long)st.st_size);
+        respond(client->fd, 416, "Range Not Satisfiable", headers, NULL);
+        close(fd);
+        return;
+    }
+
+    int partial = request->range_start > 0 || end < st.st_size;
+    int len = snprintf(headers, sizeof(headers),
+                       "HTTP/1.1 %s\r\nContent-Length: %lld\r\nContent-Type: application/octet-stream\r\n"
+                       "Docker-Content-Digest: %s\r\nAccept-Ranges: bytes\r\nConnection: close\r\n",
+                       partial ? "206 Partial Content" : "200 OK", length, digest);
+    if (partial) {
+        len += snprintf(headers + len, sizeof(headers) - len, "Content-Range: bytes %lld-%lld/%lld\r\n",
+                        start, end - 1, (long long)st.st_size);
+    }
+    len += snprintf(headers + len, sizeof(headers) - len, "\r\n");
+    printf("%s /blobs/%.19s %d from %lld\n", request->method, digest, partial ? 206 : 200, start);
+
+    if (write_all(client->fd, headers, len) != 0 || head) {
+        close(fd);
+        return;
+    }
+
+    // Fresh downloads are cut short on request, to make clients resume
+    long long limit = !partial && drop_after >= 0 && drop_after < length ? drop_after : length;
+    char buffer[65536];
+    while (limit > 0) {
+        ssize_t n = pread(fd, buffer, limit < (long long)sizeof(buffer) ? limit : (long long)sizeof(buffer), start);
+        if (n <= 0 || write_all(client->fd, buffer, n) != 0) break;
+        start += n;
+        limit -= n;
+    }
+    if (limit == 0 && start < end) {
+        printf("dropped %.19s at %lld\n", digest, start);
+    }
+    close(fd);
+}
+
+static void receive_blob(client_t *client, request_t *request, const char *name) {
+    char digest[128] = "";
+    char temp_path[REGISTRY_PATH_MAX + 64];
+    char path[REGISTRY_PATH_MAX + 64];
+    char headers[512];
+    char hex[SHA256_HEX_LEN + 1];
+    uint8_t sum[SHA256_DIGEST_LEN];
+    char buffer[65536];
+    sha256_ctx_t hash;
+    long long left = request->content_length;
+    const char *param = strstr(request->query, "digest=");
+    int fd;
+
+    if (param) {
+        sscanf(param, "digest=%127[^&]", digest);
+    }
+    if (!valid_digest(digest)) {
+        respond(client->fd, 400, "Bad Request", NULL, "{\"errors\":[{\"code\":\"DIGEST_INVALID\"}]}");
+        return;
+    }
+
+    pthread_mutex_lock(&counter_lock);
+    snprintf(temp_path, sizeof(temp_path), "%s/uploads/%lu", storage_dir, ++upload_counter);
+    pthread_mutex_unlock(&counter_lock);
+
+    fd = open(temp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        respond(client->fd, 500, "Internal Server Error", NULL, NULL);
+        return;
+    }
+
+    sha256_init(&hash);
+    while (left > 0) {
+        ssize_t n = read_body(client, buffer, left < (long long)sizeof(buffer) ? left : (long long)sizeof(buffer));
+        if (n <= 0 || write(fd, buffer, n) != n) break;
+        sha256_update(&hash, buffer, n);
+        left -= n;
+    }
+    close(fd);
+
+    sha256_final(&hash, sum);
+    sha256_to_hex(sum, hex);
+    if (left != 0 || strcmp(hex, digest + 7) != 0) {
+        unlink(temp_path);
+        respond(client->fd, 400, "Bad Request", NULL, "{\"errors\":[{\"code\":\"DIGEST_INVALID\"}]}");
+        printf("PUT blob %.19s rejected\n", digest);
+        return;
+    }
+
+    snprintf(path, sizeof(path), "%s/blobs/%s", storage_dir, digest + 7);
+    rename(temp_path, path);
+    snprintf(headers, sizeof(headers), "Location: /v2/%s/blobs/%s\r\nDocker-Content-Digest: %s\r\n",
+             name, digest, digest);
+    respond(client->fd, 201, "Created", headers, NULL);
+    printf("PUT blob %.19s %lld bytes\n", digest, request->content_length);
+}
+
+static void handle_manifest(client_t *client, request_t *request, const char *name, const char *reference) {
+    char dir[REGISTRY_PATH_MAX + 64];
+    char path[REGISTRY_PATH_MAX * 2];
+    char type_path[REGISTRY_PATH_MAX * 2 + 8];
+    char headers[512];
+    char hex[SHA256_HEX_LEN + 1];
+    char type[128] = "application/vnd.oci.image.manifest.v1+json";
+    char *body;
+    FILE *fp;
+
+    repository_dir(name, dir, sizeof(dir));
+    if (strchr(reference, '/') || reference[0] == '.') {
+        respond(client->fd, 400, "Bad Request", NULL, NULL);
+        return;
+    }
+
+    if (strcmp(request->method, "PUT") == 0) {
+        if (request->content_length <= 0 || request->content_length > 4 * 1024 * 1024 ||
+            !(body = malloc(request->content_length + 1))) {
+            respond(client->fd, 400, "Bad Request", NULL, NULL);
+            return;
+        }
+        long long got = 0;
+        while (got < request->content_length) {
+            ssize_t n = read_body(client, body + got, request->content_length - got);
+            if (n <= 0) break;
+            got += n;
+        }
+        if (got != request->content_length) {
+            free(body);
+            return;
+        }
+
+        sha256_hex(body, got, hex);
+        mkdir(dir, 0755);
+
+        // Stored under the tag and under its digest
+        const char *names[2] = { reference, NULL };
+        char digest_name[SHA256_HEX_LEN + 8];
+        snprintf(digest_name, sizeof(digest_name), "sha256:%s", hex);
+        names[1] = digest_name;
+        for (int i = 0; i < 2; i++) {
+            snprintf(path, sizeof(path), "%s/%s", dir, names[i]);
+            snprintf(type_path, sizeof(type_path), "%s.type", path);
+            if ((fp = fopen(path, "w"))) {
+                fwrite(body, 1, got, fp);
+                fclose(fp);
+            }
+            if ((fp = fopen(type_path, "w"))) {
+                fputs(request->content_type[0] ? request->content_type : type, fp);
+                fclose(fp);
+            }
+        }
+        free(body);
+
+        snprintf(headers, sizeof(headers), "Location: /v2/%s/manifests/%s\r\nDocker-Content-Digest: %s\r\n",
+                 name, digest_name, digest_name);
+        respond(client->fd, 201, "Created", headers, NULL);
+        printf("PUT manifest %s:%s\n", name, reference);
+        return;
+    }
+
+    snprintf(path, sizeof(path), "%s/%s", dir, reference);
+    snprintf(type_path, sizeof(type_path), "%s.type", path);
+    fp = fopen(path, "r");
+    if (!fp) {
+        respond(client->fd, 404, "Not Found", NULL, "{\"errors\":[{\"code\":\"MANIFEST_UNKNOWN\"}]}");
+        printf("%s manifest %s:%s 404\n", request->method, name, reference);
+        return;
+    }
+
+    struct stat st;
+    if (fstat(fileno(fp), &st) != 0 || !(body = calloc(1, st.st_size + 1)) ||
+        fread(body, 1, st.st_size, fp) != (size_t)st.st_size) {
+        fclose(fp);
+        respond(client->fd, 500, "Internal Server Error", NULL, NULL);
+        return;
+    }
+    fclose(fp);
+
+    if ((fp = fopen(type_path, "r"))) {
+        if (!fgets(type, sizeof(type), fp)) type[0] = '\0';
+        fclose(fp);
+    }
+
+    sha256_hex(body, st.st_size, hex);
+    snprintf(headers, sizeof(headers), "Content-Type: %s\r\nDocker-Content-Digest: sha256:%s\r\n", type, hex);
+    respond(client->fd, 200, "OK", headers, strcmp(request->method, "HEAD") == 0 ? NULL : body);
+    printf("%s manifest %s:%s\n", request->method, name, reference);
+    free(body);
+}
+
+static void* handle_client(void *arg) {
+    client_t *client = arg;
+    request_t request;
+    char name[REGISTRY_PATH_MAX];
+    const char *rest;
+    char *marker;
+
+    if (read_request(client, &request) != 0) {
+        goto out;
+    }
+
+    if (strcmp(request.path, "/v2/") == 0 || strcmp(request.path, "/v2") == 0) {
+        respond(client->fd, 200, "OK", "Content-Type: application/json\r\n", "{}");
+        goto out;
+    }
+    if (strncmp(request.path, "/v2/", 4) != 0) {
+        respond(client->fd, 404, "Not Found", NULL, NULL);
+        goto out;
+    }
+
+    // /v2/<name>/{blobs,manifests}/<reference>, where <name> may contain slashes
+    rest = request.path + 4;
+    snprintf(name, sizeof(name), "%s", rest);
+    if ((marker = strstr(name, "/blobs/uploads/"))) {
+        char *upload = marker + strlen("/blobs/uploads/");
+        *marker = '\0';
+        if (strcmp(request.method, "POST") == 0 && *upload == '\0') {
+            char headers[REGISTRY_PATH_MAX + 64];
+            unsigned long id;
+            pthread_mutex_lock(&counter_lock);
+            id = ++upload_counter;
+            pthread_mutex_unlock(&counter_lock);
+            snprintf(headers, sizeof(headers), "Location: /v2/%s/blobs/uploads/%lu\r\nRange: 0-0\r\n", name, id);
+            respond(client->fd, 202, "Accepted", headers, NULL);
+        } else if (strcmp(request.method, "PUT") == 0 && *upload) {
+            receive_blob(client, &request, name);
+        } else {
+            respond(client->fd, 405, "Method Not Allowed", NULL, NULL);
+        }
+    } else if ((marker = strstr(name, "/blobs/"))) {
+        *marker = '\0';
+        serve_blob(client, &request, marker + strlen("/blobs/"));
+    } else if ((marker = strstr(name, "/manifests/"))) {
+        *marker = '\0';
+        handle_manifest(client, &request, name, marker + strlen("/manifests/"));
+    } else {
+        respond(client->fd, 404, "Not Found", NULL, NULL);
+    }
+
+out:
+    fflush(stdout);
+    close(client->fd);
+    free(client);
+    return NULL;
+}
+
+int main(int argc, char *argv[]) {
+    struct sockaddr_in addr;
+    char path[REGISTRY_PATH_MAX];
+    int port = 5000;
+    int server_fd, one = 1;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-p") == 0 && i + 1 < argc) {
+            port = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-d") == 0 && i + 1 < argc) {
+            storage_dir = argv[++i];
+        } else if (strcmp(argv[i], "--drop-after") == 0 && i + 1 < argc) {
+            drop_after = atoll(argv[++i]);
+        } else {
+            fprintf(stderr, "Usage: %s [-p port] [-d dir] [--drop-after bytes]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+    mkdir(storage_dir, 0755);
+    const char *subdirs[] = { "blobs", "uploads", "manifests" };
+    for (int i = 0; i < 3; i++) {
+        snprintf(path, sizeof(path), "%s/%s", storage_dir, subdirs[i]);
+        if (mkdir(path, 0755) != 0 && errno != EEXIST) {
+            perror(path);
+            return 1;
+        }
+    }
+
+    server_fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    if (bind(server_fd, (struct sockaddr*)&addr, sizeof(addr)) != 0 || listen(server_fd, 64) != 0) {
+        perror("bind");
+        return 1;
+    }
+    printf("mini registry on 127.0.0.1:%d, storing in %s\n", port, storage_dir);
+    fflush(stdout);
+
+    for (;;) {
+        int fd = accept(server_fd, NULL, NULL);
+        if (fd < 0) {
+            if (errno == EINTR) continue;
+            perror("accept");
+            break;
+        }
+
+        client_t *client = malloc(sizeof(client_t));
+        pthread_t thread;
+        if (!client) {
+            close(fd);
+            continue;
+        }
+        client->fd = fd;
+        if (pthread_create(&thread, NULL, handle_client, client) != 0) {
+            close(fd);
+            free(client);
+            continue;
+        }
+        pthread_detach(thread);
+    }
+
+    close(server_fd);
+    return 0;
+}